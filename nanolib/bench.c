@@ -0,0 +1,502 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// dbtree_bench builds a dbtree of generated subscriptions and reports the
+// throughput and latency percentiles of insert, delete, topic match,
+// shared lookup and nano_retain lookup. Lookups are run with 1, 2, 4 .. -r
+// reader threads, while a writer thread keeps subscribing and
+// unsubscribing other filters unless -n is given.
+//
+// Filter i is generated from the seed and i alone, so it is generated
+// again to be deleted instead of being kept. Each latency is one
+// clock_gettime pair around one call, the cost of the clock itself
+// (some 20ns) is part of it.
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "include/mqtt_db.h"
+#include "include/nano_retain.h"
+
+#define BENCH_TOPIC_LEN 256
+#define BENCH_CHURN_POOL 4096
+
+// log-linear histogram, 16 buckets per power of 2 are within 7%
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct {
+	uint64_t count;
+	uint64_t bucket[HIST_BUCKETS];
+} bench_hist;
+
+typedef struct {
+	uint64_t subs;
+	int      depth;   // levels of a topic
+	int      fanout;  // tokens a level is picked from
+	int      plus;    // % of filter levels that are +
+	int      well;    // % of filters ending with #
+	int      shared;  // % of filters under $share
+	int      groups;  // shared groups
+	int      readers; // lookups run with 1, 2, 4 .. readers
+	uint64_t ops;     // lookups of a reader
+	uint64_t retains;
+	bool     churn;
+	uint64_t seed;
+} bench_opt;
+
+enum {
+	BENCH_MATCH,
+	BENCH_SHARED,
+	BENCH_RETAIN,
+};
+
+static const char *bench_names[] = { "match", "shared", "retain" };
+
+typedef struct {
+	const bench_opt *opt;
+	dbtree *         db;
+	nano_retain *    retain;
+	int              kind;
+	uint64_t         rng;
+	uint64_t         found;
+	bench_hist       hist;
+} bench_reader;
+
+typedef struct {
+	const bench_opt *opt;
+	dbtree *         db;
+	atomic_bool      stop;
+	uint64_t         ops;
+} bench_churn;
+
+static inline uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// splitmix64, a seed of 0 is fine
+static inline uint64_t
+bench_rand(uint64_t *s)
+{
+	uint64_t z = (*s += 0x9e3779b97f4a7c15);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+static inline bool
+bench_pct(uint64_t *s, int pct)
+{
+	return (int) (bench_rand(s) % 100) < pct;
+}
+
+static inline int
+hist_bucket(uint64_t ns)
+{
+	int e;
+
+	if (ns < HIST_SUB) {
+		return (int) ns;
+	}
+	e = 63 - __builtin_clzll(ns);
+	return (e - 3) * HIST_SUB + (int) ((ns >> (e - 4)) & (HIST_SUB - 1));
+}
+
+static inline uint64_t
+hist_value(int b)
+{
+	if (b < HIST_SUB) {
+		return b;
+	}
+	return (uint64_t) (HIST_SUB + b % HIST_SUB) << (b / HIST_SUB - 1);
+}
+
+static inline void
+hist_add(bench_hist *h, uint64_t ns)
+{
+	h->bucket[hist_bucket(ns)]++;
+	h->count++;
+}
+
+static void
+hist_merge(bench_hist *dst, const bench_hist *src)
+{
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		dst->bucket[i] += src->bucket[i];
+	}
+	dst->count += src->count;
+}
+
+static uint64_t
+hist_pct(const bench_hist *h, double pct)
+{
+	uint64_t rank = (uint64_t) (h->count * pct);
+	uint64_t seen = 0;
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen > rank) {
+			return hist_value(i);
+		}
+	}
+	return 0;
+}
+
+static void
+bench_report(const char *name, int threads, uint64_t ops, uint64_t ns,
+    const bench_hist *h)
+{
+	printf("%-8s %7d %12.0f %9lu %9lu %9lu\n", name, threads,
+	    ns > 0 ? ops * 1e9 / ns : 0.0, hist_pct(h, 0.5),
+	    hist_pct(h, 0.99), hist_pct(h, 0.999));
+}
+
+// A concrete topic of depth levels.
+static void
+bench_topic(const bench_opt *o, uint64_t *rng, char *buf)
+{
+	int n = 0;
+
+	for (int l = 0; l < o->depth; l++) {
+		n += sprintf(buf + n, l ? "/t%u" : "t%u",
+		    (unsigned) (bench_rand(rng) % o->fanout));
+	}
+}
+
+// Filter i, with $share if shared is allowed.
+static void
+bench_filter(const bench_opt *o, uint64_t i, bool shared, char *buf)
+{
+	uint64_t rng    = o->seed ^ (i * 0x2545f4914f6cdd1d);
+	bool     well   = bench_pct(&rng, o->well);
+	int      levels = well ? bench_rand(&rng) % o->depth : o->depth;
+	int      n      = 0;
+
+	if (shared && bench_pct(&rng, o->shared)) {
+		n += sprintf(buf, "$share/g%u/",
+		    (unsigned) (bench_rand(&rng) % o->groups));
+	}
+	for (int l = 0; l < levels; l++) {
+		if (l > 0) {
+			buf[n++] = '/';
+		}
+		if (bench_pct(&rng, o->plus)) {
+			buf[n++] = '+';
+		} else {
+			n += sprintf(buf + n, "t%u",
+			    (unsigned) (bench_rand(&rng) % o->fanout));
+		}
+	}
+	if (well) {
+		n += sprintf(buf + n, levels > 0 ? "/#" : "#");
+	}
+	buf[n] = '\0';
+}
+
+static inline void *
+bench_ctxt(uint32_t pipe_id)
+{
+	return (void *) (uintptr_t) pipe_id;
+}
+
+static void
+bench_retain_cb(const nano_retain_msg *msg, void *arg)
+{
+	(void) msg;
+	(*(uint64_t *) arg)++;
+}
+
+static void *
+bench_reader_run(void *arg)
+{
+	bench_reader *      r = arg;
+	const bench_opt *   o = r->opt;
+	char                topic[BENCH_TOPIC_LEN];
+	void **             v;
+	nano_retain_cursor *cur;
+	size_t              cnt;
+	uint64_t            t0;
+
+	for (uint64_t i = 0; i < o->ops; i++) {
+		if (r->kind == BENCH_RETAIN) {
+			bench_filter(o, bench_rand(&r->rng), false, topic);
+			t0  = bench_now();
+			cur = nano_retain_cursor_new(r->retain, topic);
+			while (!nano_retain_cursor_done(cur)) {
+				nano_retain_cursor_next(cur, SIZE_MAX, 0,
+				    bench_retain_cb, &r->found);
+			}
+			nano_retain_cursor_free(cur);
+			hist_add(&r->hist, bench_now() - t0);
+			continue;
+		}
+		bench_topic(o, &r->rng, topic);
+		cnt = 0;
+		t0  = bench_now();
+		if (r->kind == BENCH_MATCH) {
+			v = dbtree_find_clients_and_cache_msg(
+			    r->db, topic, NULL, &cnt);
+		} else {
+			v = dbtree_find_shared_sub_clients(r->db, topic, NULL,
+			    &cnt, (uint32_t) bench_rand(&r->rng));
+		}
+		hist_add(&r->hist, bench_now() - t0);
+		r->found += cvector_size(v);
+		cvector_free(v);
+	}
+
+	return NULL;
+}
+
+// Subscribe and unsubscribe filters of pipes past the built ones.
+static void *
+bench_churn_run(void *arg)
+{
+	bench_churn *    c = arg;
+	const bench_opt *o = c->opt;
+	char             topic[BENCH_TOPIC_LEN];
+	bool             in[BENCH_CHURN_POOL] = { false };
+	uint64_t         i                    = 0;
+	uint32_t         j;
+
+	while (!atomic_load_explicit(&c->stop, memory_order_relaxed)) {
+		j = i++ % BENCH_CHURN_POOL;
+		bench_filter(o, o->subs + j, true, topic);
+		if (!in[j]) {
+			dbtree_insert_client(c->db, topic,
+			    bench_ctxt(o->subs + 1 + j), o->subs + 1 + j, 0);
+		} else {
+			dbtree_delete_client(c->db, topic, 0, o->subs + 1 + j);
+		}
+		in[j] = !in[j];
+	}
+	// leave none of them behind
+	for (j = 0; j < BENCH_CHURN_POOL; j++) {
+		if (in[j]) {
+			bench_filter(o, o->subs + j, true, topic);
+			dbtree_delete_client(c->db, topic, 0, o->subs + 1 + j);
+		}
+	}
+	c->ops = i;
+
+	return NULL;
+}
+
+static void
+bench_lookup(const bench_opt *o, dbtree *db, nano_retain *retain, int kind)
+{
+	bench_reader *readers = calloc(o->readers, sizeof(bench_reader));
+	pthread_t *   thr     = calloc(o->readers, sizeof(pthread_t));
+	bench_churn   churn   = { .opt = o, .db = db };
+	pthread_t     churn_thr;
+	bench_hist *  all = calloc(1, sizeof(bench_hist));
+	uint64_t      t0, ns;
+
+	for (int n = 1;; n = n * 2 > o->readers ? o->readers : n * 2) {
+		memset(all, 0, sizeof(bench_hist));
+		atomic_store(&churn.stop, false);
+		if (o->churn && kind != BENCH_RETAIN) {
+			pthread_create(
+			    &churn_thr, NULL, bench_churn_run, &churn);
+		}
+		t0 = bench_now();
+		for (int i = 0; i < n; i++) {
+			memset(&readers[i], 0, sizeof(bench_reader));
+			readers[i].opt  = o;
+			readers[i].db     = db;
+			readers[i].retain = retain;
+			readers[i].kind   = kind;
+			readers[i].rng  = o->seed + kind * 1000 + i;
+			pthread_create(&thr[i], NULL, bench_reader_run,
+			    &readers[i]);
+		}
+		for (int i = 0; i < n; i++) {
+			pthread_join(thr[i], NULL);
+			hist_merge(all, &readers[i].hist);
+		}
+		ns = bench_now() - t0;
+		bench_report(bench_names[kind], n, o->ops * n, ns, all);
+		if (o->churn && kind != BENCH_RETAIN) {
+			atomic_store(&churn.stop, true);
+			pthread_join(churn_thr, NULL);
+			printf("%-8s %7d %12.0f\n", "churn", 1,
+			    churn.ops * 1e9 / ns);
+		}
+		if (n == o->readers) {
+			break;
+		}
+	}
+	free(all);
+	free(thr);
+	free(readers);
+}
+
+static void
+bench_usage(const char *prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [-s subs] [-d depth] [-f fanout] [-p plus%%] "
+	    "[-w well%%]\n"
+	    "       [-S shared%%] [-g groups] [-r readers] [-o ops] "
+	    "[-R retains]\n"
+	    "       [-x seed] [-n]\n"
+	    "  -n  no writer churn thread during lookups\n",
+	    prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_opt opt = {
+		.subs    = 1000000,
+		.depth   = 4,
+		.fanout  = 16,
+		.plus    = 10,
+		.well    = 5,
+		.shared  = 5,
+		.groups  = 8,
+		.readers = 4,
+		.ops     = 100000,
+		.retains = 100000,
+		.churn   = true,
+		.seed    = 1,
+	};
+	nano_retain_opt ret_opt = { 0, NANO_RETAIN_EVICT_LRU, 0 };
+	nano_retain_msg ret     = { .qos = 1 };
+	dbtree *        db      = NULL;
+	nano_retain *   retain  = NULL;
+	bench_hist *    h       = calloc(1, sizeof(bench_hist));
+	char            topic[BENCH_TOPIC_LEN];
+	uint64_t        rng;
+	uint64_t        t0, t1, ns;
+	struct rusage   ru;
+	int             c;
+
+	while ((c = getopt(argc, argv, "s:d:f:p:w:S:g:r:o:R:x:nh")) != -1) {
+		switch (c) {
+		case 's':
+			opt.subs = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			opt.depth = atoi(optarg);
+			break;
+		case 'f':
+			opt.fanout = atoi(optarg);
+			break;
+		case 'p':
+			opt.plus = atoi(optarg);
+			break;
+		case 'w':
+			opt.well = atoi(optarg);
+			break;
+		case 'S':
+			opt.shared = atoi(optarg);
+			break;
+		case 'g':
+			opt.groups = atoi(optarg);
+			break;
+		case 'r':
+			opt.readers = atoi(optarg);
+			break;
+		case 'o':
+			opt.ops = strtoull(optarg, NULL, 10);
+			break;
+		case 'R':
+			opt.retains = strtoull(optarg, NULL, 10);
+			break;
+		case 'x':
+			opt.seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'n':
+			opt.churn = false;
+			break;
+		default:
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (opt.subs == 0 || opt.subs > UINT32_MAX - BENCH_CHURN_POOL ||
+	    opt.depth < 1 || opt.depth > 32 || opt.fanout < 1 ||
+	    opt.groups < 1 || opt.readers < 1) {
+		bench_usage(argv[0]);
+		return 1;
+	}
+
+	printf("dbtree bench: %lu subs, depth %d, fanout %d, + %d%%, "
+	       "# %d%%, shared %d%%, %lu retains\n",
+	    opt.subs, opt.depth, opt.fanout, opt.plus, opt.well, opt.shared,
+	    opt.retains);
+	printf("%-8s %7s %12s %9s %9s %9s\n", "op", "threads", "ops/s",
+	    "p50(ns)", "p99(ns)", "p999(ns)");
+
+	dbtree_create(&db);
+	retain = nano_retain_create(&ret_opt);
+
+	t0 = bench_now();
+	for (uint64_t i = 0; i < opt.subs; i++) {
+		bench_filter(&opt, i, true, topic);
+		t1 = bench_now();
+		dbtree_insert_client(db, topic, bench_ctxt(i + 1), i + 1, 0);
+		hist_add(h, bench_now() - t1);
+	}
+	bench_report("insert", 1, opt.subs, bench_now() - t0, h);
+
+	rng = opt.seed;
+	memset(h, 0, sizeof(bench_hist));
+	t0 = bench_now();
+	for (uint64_t i = 0; i < opt.retains; i++) {
+		bench_topic(&opt, &rng, topic);
+		ret.topic     = topic;
+		ret.topic_len = strlen(topic);
+		t1            = bench_now();
+		nano_retain_set(retain, &ret);
+		hist_add(h, bench_now() - t1);
+	}
+	bench_report("retain+", 1, opt.retains, bench_now() - t0, h);
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%-8s %7s %12ld\n", "rss(KB)", "-", ru.ru_maxrss);
+
+	bench_lookup(&opt, db, NULL, BENCH_MATCH);
+	bench_lookup(&opt, db, NULL, BENCH_SHARED);
+	bench_lookup(&opt, NULL, retain, BENCH_RETAIN);
+
+	memset(h, 0, sizeof(bench_hist));
+	t0 = bench_now();
+	for (uint64_t i = 0; i < opt.subs; i++) {
+		bench_filter(&opt, i, true, topic);
+		t1 = bench_now();
+		dbtree_delete_client(db, topic, 0, i + 1);
+		hist_add(h, bench_now() - t1);
+	}
+	ns = bench_now() - t0;
+	bench_report("delete", 1, opt.subs, ns, h);
+
+	rng = opt.seed;
+	for (uint64_t i = 0; i < opt.retains; i++) {
+		bench_topic(&opt, &rng, topic);
+		nano_retain_del(retain, topic);
+	}
+	dbtree_destory(db);
+	nano_retain_destroy(retain);
+	free(h);
+
+	return 0;
+}
@@ -11,8 +11,261 @@
 #include "include/conf.h"
 #include "include/dbg.h"
 #include "include/file.h"
+#include "include/mqtt_db.h"
+#include "include/nano_retain.h"
 #include "nanomq.h"
 
+static const char *shared_strategies[] = {
+	[SHARED_ROUND_ROBIN]    = "round_robin",
+	[SHARED_RANDOM]         = "random",
+	[SHARED_STICKY]         = "sticky",
+	[SHARED_LEAST_INFLIGHT] = "least_inflight",
+};
+
+/**
+ * @brief conf_shared_strategy - Parse a shared subscription strategy.
+ * @param value - name of strategy
+ * @return dbtree_shared_strategy, round_robin if value is unknown
+ */
+int
+conf_shared_strategy(const char *value)
+{
+	size_t n = sizeof(shared_strategies) / sizeof(shared_strategies[0]);
+
+	for (size_t i = 0; i < n; i++) {
+		if (strcasecmp(value, shared_strategies[i]) == 0) {
+			return i;
+		}
+	}
+
+	log_warn("Unknown shared_subscription_strategy: %s", value);
+	return SHARED_ROUND_ROBIN;
+}
+
+const char *
+conf_shared_strategy_str(int strategy)
+{
+	size_t n = sizeof(shared_strategies) / sizeof(shared_strategies[0]);
+
+	if (strategy < 0 || (size_t) strategy >= n) {
+		return "unknown";
+	}
+	return shared_strategies[strategy];
+}
+
+static const char *session_overflows[] = {
+	[SESSION_DROP_OLDEST] = "drop_oldest",
+	[SESSION_DROP_NEWEST] = "drop_newest",
+	[SESSION_REJECT]      = "reject",
+};
+
+/**
+ * @brief conf_session_overflow - Parse an overflow policy of offline
+ * session queues.
+ * @param value - name of policy
+ * @return dbtree_session_overflow, drop_oldest if value is unknown
+ */
+int
+conf_session_overflow(const char *value)
+{
+	size_t n = sizeof(session_overflows) / sizeof(session_overflows[0]);
+
+	for (size_t i = 0; i < n; i++) {
+		if (strcasecmp(value, session_overflows[i]) == 0) {
+			return i;
+		}
+	}
+
+	log_warn("Unknown session_queue_overflow: %s", value);
+	return SESSION_DROP_OLDEST;
+}
+
+const char *
+conf_session_overflow_str(int overflow)
+{
+	size_t n = sizeof(session_overflows) / sizeof(session_overflows[0]);
+
+	if (overflow < 0 || (size_t) overflow >= n) {
+		return "unknown";
+	}
+	return session_overflows[overflow];
+}
+
+static const char *sub_queue_overflows[] = {
+	[SUB_QUEUE_DROP_QOS0]   = "drop_qos0",
+	[SUB_QUEUE_DROP_OLDEST] = "drop_oldest",
+	[SUB_QUEUE_DISCONNECT]  = "disconnect",
+};
+
+/**
+ * @brief conf_sub_queue_overflow - Parse an overflow policy of subscriber
+ * outbound queues.
+ * @param value - name of policy
+ * @return sub_queue_overflow, drop_qos0 if value is unknown
+ */
+int
+conf_sub_queue_overflow(const char *value)
+{
+	size_t n =
+	    sizeof(sub_queue_overflows) / sizeof(sub_queue_overflows[0]);
+
+	for (size_t i = 0; i < n; i++) {
+		if (strcasecmp(value, sub_queue_overflows[i]) == 0) {
+			return i;
+		}
+	}
+
+	log_warn("Unknown sub_queue_overflow: %s", value);
+	return SUB_QUEUE_DROP_QOS0;
+}
+
+const char *
+conf_sub_queue_overflow_str(int overflow)
+{
+	size_t n =
+	    sizeof(sub_queue_overflows) / sizeof(sub_queue_overflows[0]);
+
+	if (overflow < 0 || (size_t) overflow >= n) {
+		return "unknown";
+	}
+	return sub_queue_overflows[overflow];
+}
+
+static const char *retain_evictions[] = {
+	[NANO_RETAIN_EVICT_LRU]    = "lru",
+	[NANO_RETAIN_EVICT_OLDEST] = "oldest",
+};
+
+/**
+ * @brief conf_retain_eviction - Parse the order retained messages are
+ * evicted in.
+ * @param value - lru or oldest
+ * @return nano_retain_eviction, lru if value is unknown
+ */
+int
+conf_retain_eviction(const char *value)
+{
+	size_t n = sizeof(retain_evictions) / sizeof(retain_evictions[0]);
+
+	for (size_t i = 0; i < n; i++) {
+		if (strcasecmp(value, retain_evictions[i]) == 0) {
+			return i;
+		}
+	}
+
+	log_warn("Unknown retain.eviction: %s", value);
+	return NANO_RETAIN_EVICT_LRU;
+}
+
+const char *
+conf_retain_eviction_str(int eviction)
+{
+	size_t n = sizeof(retain_evictions) / sizeof(retain_evictions[0]);
+
+	if (eviction < 0 || (size_t) eviction >= n) {
+		return "unknown";
+	}
+	return retain_evictions[eviction];
+}
+
+static const char *rate_limit_policies[] = {
+	[RATE_LIMIT_DROP]       = "drop",
+	[RATE_LIMIT_DISCONNECT] = "disconnect",
+	[RATE_LIMIT_PAUSE]      = "pause",
+};
+
+/**
+ * @brief conf_rate_limit_policy - Parse what is done with a PUBLISH over
+ * a rate limit.
+ * @param value - name of policy
+ * @return rate_limit_policy, drop if value is unknown
+ */
+int
+conf_rate_limit_policy(const char *value)
+{
+	size_t n =
+	    sizeof(rate_limit_policies) / sizeof(rate_limit_policies[0]);
+
+	for (size_t i = 0; i < n; i++) {
+		if (strcasecmp(value, rate_limit_policies[i]) == 0) {
+			return i;
+		}
+	}
+
+	log_warn("Unknown rate_limit.policy: %s", value);
+	return RATE_LIMIT_DROP;
+}
+
+const char *
+conf_rate_limit_policy_str(int policy)
+{
+	size_t n =
+	    sizeof(rate_limit_policies) / sizeof(rate_limit_policies[0]);
+
+	if (policy < 0 || (size_t) policy >= n) {
+		return "unknown";
+	}
+	return rate_limit_policies[policy];
+}
+
+/**
+ * @brief conf_rate_limit_rules - Add the rules of a list of
+ * prefix:msgs:bytes separated by ',', the prefix is what is before the
+ * last two ':'. A malformed rule is skipped.
+ * @param limit - conf_rate_limit
+ * @param value - list of rules
+ * @return void
+ */
+void
+conf_rate_limit_rules(conf_rate_limit *limit, const char *value)
+{
+	char *list = zstrdup(value);
+	char *save = NULL;
+
+	for (char *tk = strtok_r(list, ",", &save); tk != NULL;
+	     tk       = strtok_r(NULL, ",", &save)) {
+		char *          bytes = strrchr(tk, ':');
+		char *          msgs;
+		conf_rate_rule *rule;
+
+		if (bytes == NULL) {
+			log_warn("Malformed rate_limit.topics rule: %s", tk);
+			continue;
+		}
+		*bytes++ = '\0';
+		if ((msgs = strrchr(tk, ':')) == NULL || msgs == tk) {
+			log_warn("Malformed rate_limit.topics rule: %s", tk);
+			continue;
+		}
+		*msgs++ = '\0';
+
+		limit->rules = zrealloc(limit->rules,
+		    sizeof(conf_rate_rule) * (limit->rules_count + 1));
+		rule         = &limit->rules[limit->rules_count++];
+		rule->prefix = zstrdup(tk);
+		rule->msgs   = atoi(msgs);
+		rule->bytes  = atol(bytes);
+	}
+	zfree(list);
+}
+
+/**
+ * @brief conf_log_level - Parse a log level.
+ * @param value - trace, debug, info, warn, error or off
+ * @return NANO_LOG_*, warn if value is unknown
+ */
+int
+conf_log_level(const char *value)
+{
+	int level = nano_log_level(value);
+
+	if (level == -1) {
+		log_warn("Unknown log.level: %s", value);
+		return NANO_LOG_WARN;
+	}
+	return level;
+}
+
 static char *
 strtrim(char *str)
 {
@@ -97,6 +350,18 @@ conf_parser(conf *nanomq_conf)
 		    NULL) {
 			config->parallel = atoi(value);
 			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "parallel_max")) != NULL) {
+			config->parallel_max = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "fanout_threshold")) != NULL) {
+			config->fanout_threshold = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "fanout_works")) != NULL) {
+			config->fanout_works = atoi(value);
+			free(value);
 		} else if ((value = get_conf_value(
 		                line, sz, "property_size")) != NULL) {
 			config->property_size = atoi(value);
@@ -109,6 +374,55 @@ conf_parser(conf *nanomq_conf)
 		                line, sz, "qos_duration")) != NULL) {
 			config->qos_duration = atoi(value);
 			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "match_cache_size")) != NULL) {
+			config->match_cache_size = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(line, sz,
+		                "shared_subscription_strategy")) != NULL) {
+			config->shared_strategy = conf_shared_strategy(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "session_queue_size")) != NULL) {
+			config->session_queue_size = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(line, sz,
+		                "session_queue_overflow")) != NULL) {
+			config->session_overflow = conf_session_overflow(value);
+			free(value);
+		} else if ((value = get_conf_value(line, sz,
+		                "session_expiry_interval")) != NULL) {
+			config->session_expiry = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "session_msg_max_age")) != NULL) {
+			config->session_msg_max_age = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "session_memory_limit")) != NULL) {
+			config->session_mem_limit = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "sub_queue_size")) != NULL) {
+			config->sub_queue_size = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "sub_queue_overflow")) != NULL) {
+			config->sub_queue_overflow =
+			    conf_sub_queue_overflow(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "sub_queue_conflate")) != NULL) {
+			FREE_NONULL(config->sub_queue_conflate);
+			config->sub_queue_conflate = value;
+		} else if ((value = get_conf_value(
+		                line, sz, "topic_alias_max")) != NULL) {
+			config->topic_alias_max = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "topic_alias_out")) != NULL) {
+			config->topic_alias_out = atoi(value);
+			free(value);
 		} else if ((value = get_conf_value(
 		                line, sz, "allow_anonymous")) != NULL) {
 			config->allow_anonymous =
@@ -126,6 +440,43 @@ conf_parser(conf *nanomq_conf)
 			FREE_NONULL(config->websocket.url);
 			config->websocket.url = value;
 
+		} else if ((value = get_conf_value(
+		                line, sz, "tls.enable")) != NULL) {
+			config->tls.enable = strcasecmp(value, "yes") == 0 ||
+			    strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(line, sz, "tls.url")) !=
+		    NULL) {
+			FREE_NONULL(config->tls.url);
+			config->tls.url = value;
+		} else if ((value = get_conf_value(
+		                line, sz, "tls.certfile")) != NULL) {
+			FREE_NONULL(config->tls.certfile);
+			config->tls.certfile = value;
+		} else if ((value = get_conf_value(
+		                line, sz, "tls.keyfile")) != NULL) {
+			FREE_NONULL(config->tls.keyfile);
+			config->tls.keyfile = value;
+		} else if ((value = get_conf_value(
+		                line, sz, "tls.key_password")) != NULL) {
+			FREE_NONULL(config->tls.key_password);
+			config->tls.key_password = value;
+		} else if ((value = get_conf_value(
+		                line, sz, "tls.cacertfile")) != NULL) {
+			FREE_NONULL(config->tls.cafile);
+			config->tls.cafile = value;
+		} else if ((value = get_conf_value(
+		                line, sz, "tls.verify_peer")) != NULL) {
+			config->tls.verify_peer =
+			    strcasecmp(value, "yes") == 0 ||
+			    strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(line, sz,
+		                "tls.fail_if_no_peer_cert")) != NULL) {
+			config->tls.fail_if_no_peer_cert =
+			    strcasecmp(value, "yes") == 0 ||
+			    strcasecmp(value, "true") == 0;
+			free(value);
 		} else if ((value = get_conf_value(
 		                line, sz, "http_server.enable")) != NULL) {
 			config->http_server.enable =
@@ -144,6 +495,188 @@ conf_parser(conf *nanomq_conf)
 		                line, sz, "http_server.password")) != NULL) {
 			FREE_NONULL(config->http_server.password);
 			config->http_server.password = value;
+		} else if ((value = get_conf_value(
+		                line, sz, "persistence.enable")) != NULL) {
+			config->persistence.enable =
+			    strcasecmp(value, "yes") == 0 ||
+			    strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "persistence.dir")) != NULL) {
+			FREE_NONULL(config->persistence.dir);
+			config->persistence.dir = value;
+		} else if ((value = get_conf_value(
+		                line, sz, "persistence.segment_size")) != NULL) {
+			config->persistence.segment_size = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "persistence.fsync_batch")) != NULL) {
+			config->persistence.fsync_batch = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(line, sz,
+		                "persistence.fsync_interval")) != NULL) {
+			config->persistence.fsync_interval = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "persistence.compact_size")) != NULL) {
+			config->persistence.compact_size = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "snapshot.enable")) != NULL) {
+			config->snapshot.enable =
+			    strcasecmp(value, "yes") == 0 ||
+			    strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "snapshot.path")) != NULL) {
+			FREE_NONULL(config->snapshot.path);
+			config->snapshot.path = value;
+		} else if ((value = get_conf_value(
+		                line, sz, "snapshot.interval")) != NULL) {
+			config->snapshot.interval = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "sys_event.enable")) != NULL) {
+			config->sys_event.enable =
+			    strcasecmp(value, "yes") == 0 ||
+			    strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "sys_event.batch")) != NULL) {
+			config->sys_event.batch = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "sys_event.interval")) != NULL) {
+			config->sys_event.interval = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(line, sz,
+		                "sys_event.metrics_interval")) != NULL) {
+			config->sys_event.metrics_interval = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(line, sz,
+		                "sys_event.route_interval")) != NULL) {
+			config->sys_event.route_interval = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "shm.enable")) != NULL) {
+			config->shm.enable = strcasecmp(value, "yes") == 0 ||
+			    strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(line, sz, "shm.dir")) !=
+		    NULL) {
+			FREE_NONULL(config->shm.dir);
+			config->shm.dir = value;
+		} else if ((value = get_conf_value(line, sz, "shm.rings")) !=
+		    NULL) {
+			config->shm.rings = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "shm.ring_size")) != NULL) {
+			config->shm.ring_size = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(line, sz, "shm.batch")) !=
+		    NULL) {
+			config->shm.batch = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "shm.interval")) != NULL) {
+			config->shm.interval = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "capture.enable")) != NULL) {
+			config->capture.enable =
+			    strcasecmp(value, "yes") == 0 ||
+			    strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "capture.file")) != NULL) {
+			FREE_NONULL(config->capture.file);
+			config->capture.file = value;
+		} else if ((value = get_conf_value(
+		                line, sz, "capture.max_size")) != NULL) {
+			config->capture.max_size = atol(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "mem.high_watermark")) != NULL) {
+			config->mem.high_watermark = atol(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "mem.low_watermark")) != NULL) {
+			config->mem.low_watermark = atol(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "mem.reject_connect")) != NULL) {
+			config->mem.reject_connect =
+			    strcasecmp(value, "yes") == 0 ||
+			    strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "mem.reject_subscribe")) != NULL) {
+			config->mem.reject_subscribe =
+			    strcasecmp(value, "yes") == 0 ||
+			    strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "mem.shed_qos0")) != NULL) {
+			config->mem.shed_qos0 =
+			    strcasecmp(value, "yes") == 0 ||
+			    strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "mem.evict_retain")) != NULL) {
+			config->mem.evict_retain =
+			    strcasecmp(value, "yes") == 0 ||
+			    strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(line, sz, "log.level")) !=
+		    NULL) {
+			config->log.level = conf_log_level(value);
+			free(value);
+		} else if ((value = get_conf_value(line, sz, "log.to")) !=
+		    NULL) {
+			config->log.to = nano_log_to(value);
+			free(value);
+		} else if ((value = get_conf_value(line, sz, "log.file")) !=
+		    NULL) {
+			FREE_NONULL(config->log.file);
+			config->log.file = value;
+		} else if ((value = get_conf_value(
+		                line, sz, "trace.sample")) != NULL) {
+			config->trace.sample = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "trace.slow_threshold")) != NULL) {
+			config->trace.slow_threshold = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "retain.mem_limit")) != NULL) {
+			config->retain.mem_limit = atol(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "retain.eviction")) != NULL) {
+			config->retain.eviction = conf_retain_eviction(value);
+			free(value);
+		} else if ((value = get_conf_value(line, sz,
+		                "retain.compress_threshold")) != NULL) {
+			config->retain.compress_threshold = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "rate_limit.msgs")) != NULL) {
+			config->rate_limit.msgs = atoi(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "rate_limit.bytes")) != NULL) {
+			config->rate_limit.bytes = atol(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "rate_limit.policy")) != NULL) {
+			config->rate_limit.policy =
+			    conf_rate_limit_policy(value);
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "rate_limit.topics")) != NULL) {
+			conf_rate_limit_rules(&config->rate_limit, value);
+			free(value);
 		}
 
 		free(line);
@@ -161,27 +694,99 @@ conf_parser(conf *nanomq_conf)
 void
 conf_init(conf *nanomq_conf)
 {
-	nanomq_conf->url                  = NULL;
-	nanomq_conf->conf_file            = NULL;
-	nanomq_conf->bridge_file          = NULL;
-	nanomq_conf->auth_file            = NULL;
-	nanomq_conf->num_taskq_thread     = 10;
-	nanomq_conf->max_taskq_thread     = 10;
-	nanomq_conf->parallel             = 30; // not work
-	nanomq_conf->property_size        = sizeof(uint8_t) * 32;
-	nanomq_conf->msq_len              = 64;
-	nanomq_conf->qos_duration         = 30;
-	nanomq_conf->allow_anonymous      = true;
-	nanomq_conf->daemon               = false;
-	nanomq_conf->http_server.enable   = false;
-	nanomq_conf->http_server.port     = 8081;
-	nanomq_conf->http_server.username = NULL;
-	nanomq_conf->http_server.password = NULL;
-	nanomq_conf->websocket.enable     = true;
-	nanomq_conf->websocket.url        = NULL;
-	nanomq_conf->bridge.bridge_mode   = false;
-	nanomq_conf->bridge.sub_count     = 0;
-	nanomq_conf->bridge.parallel      = 1;
+	nanomq_conf->url                        = NULL;
+	nanomq_conf->conf_file                  = NULL;
+	nanomq_conf->bridge_file                = NULL;
+	nanomq_conf->auth_file                  = NULL;
+	nanomq_conf->num_taskq_thread           = 10;
+	nanomq_conf->max_taskq_thread           = 10;
+	nanomq_conf->parallel                   = 30; // not work
+	nanomq_conf->parallel_max               = 0;
+	nanomq_conf->fanout_threshold           = 10000;
+	nanomq_conf->fanout_works               = 0;
+	nanomq_conf->property_size              = sizeof(uint8_t) * 32;
+	nanomq_conf->msq_len                    = 64;
+	nanomq_conf->qos_duration               = 30;
+	nanomq_conf->match_cache_size           = 0;
+	nanomq_conf->shared_strategy            = SHARED_ROUND_ROBIN;
+	nanomq_conf->session_queue_size         = DBTREE_SESSION_QUEUE_SIZE;
+	nanomq_conf->session_overflow           = SESSION_DROP_OLDEST;
+	nanomq_conf->session_expiry             = 0;
+	nanomq_conf->session_msg_max_age        = 0;
+	nanomq_conf->session_mem_limit          = 0;
+	nanomq_conf->sub_queue_size             = 0;
+	nanomq_conf->sub_queue_overflow         = SUB_QUEUE_DROP_QOS0;
+	nanomq_conf->sub_queue_conflate         = NULL;
+	nanomq_conf->topic_alias_max            = 64;
+	nanomq_conf->topic_alias_out            = 0;
+	nanomq_conf->allow_anonymous            = true;
+	nanomq_conf->daemon                     = false;
+	nanomq_conf->http_server.enable         = false;
+	nanomq_conf->http_server.port           = 8081;
+	nanomq_conf->http_server.username       = NULL;
+	nanomq_conf->http_server.password       = NULL;
+	nanomq_conf->websocket.enable           = true;
+	nanomq_conf->websocket.url              = NULL;
+	nanomq_conf->tls.enable                 = false;
+	nanomq_conf->tls.url                    = NULL;
+	nanomq_conf->tls.certfile               = NULL;
+	nanomq_conf->tls.keyfile                = NULL;
+	nanomq_conf->tls.key_password           = NULL;
+	nanomq_conf->tls.cafile                 = NULL;
+	nanomq_conf->tls.verify_peer            = false;
+	nanomq_conf->tls.fail_if_no_peer_cert   = false;
+	nanomq_conf->persistence.enable         = false;
+	nanomq_conf->persistence.dir            = NULL;
+	nanomq_conf->persistence.segment_size   = 64 * 1024 * 1024;
+	nanomq_conf->persistence.fsync_batch    = 64;
+	nanomq_conf->persistence.fsync_interval = 100;
+	nanomq_conf->persistence.compact_size   = 256 * 1024 * 1024;
+	nanomq_conf->snapshot.enable            = false;
+	nanomq_conf->snapshot.path              = NULL;
+	nanomq_conf->snapshot.interval          = 300;
+	nanomq_conf->sys_event.enable           = true;
+	nanomq_conf->sys_event.batch            = 1;
+	nanomq_conf->sys_event.interval         = 0;
+	nanomq_conf->sys_event.metrics_interval = 0;
+	nanomq_conf->sys_event.route_interval   = 0;
+	nanomq_conf->shm.enable                 = false;
+	nanomq_conf->shm.dir                    = NULL;
+	nanomq_conf->shm.rings                  = 4;
+	nanomq_conf->shm.ring_size              = 1024 * 1024;
+	nanomq_conf->shm.batch                  = 64;
+	nanomq_conf->shm.interval               = 1;
+	nanomq_conf->capture.enable             = false;
+	nanomq_conf->capture.file               = NULL;
+	nanomq_conf->capture.max_size           = 256 * 1024 * 1024;
+	nanomq_conf->mem.high_watermark         = 0;
+	nanomq_conf->mem.low_watermark          = 0;
+	nanomq_conf->mem.reject_connect         = true;
+	nanomq_conf->mem.reject_subscribe       = true;
+	nanomq_conf->mem.shed_qos0              = true;
+	nanomq_conf->mem.evict_retain           = false;
+	nanomq_conf->log.level                  = NANO_LOG_WARN;
+	nanomq_conf->log.to                     = NANO_LOG_TO_CONSOLE;
+	nanomq_conf->log.file                   = NULL;
+	nanomq_conf->trace.sample               = 0;
+	nanomq_conf->trace.slow_threshold       = 0;
+	nanomq_conf->retain.mem_limit           = 0;
+	nanomq_conf->retain.eviction            = NANO_RETAIN_EVICT_LRU;
+	nanomq_conf->retain.compress_threshold  = 0;
+	nanomq_conf->rate_limit.msgs            = 0;
+	nanomq_conf->rate_limit.bytes           = 0;
+	nanomq_conf->rate_limit.policy          = RATE_LIMIT_DROP;
+	nanomq_conf->rate_limit.rules_count     = 0;
+	nanomq_conf->rate_limit.rules           = NULL;
+	nanomq_conf->bridge.bridge_mode         = false;
+	nanomq_conf->bridge.sub_count           = 0;
+	nanomq_conf->bridge.parallel            = 1;
+	nanomq_conf->bridge.links               = 1;
+	nanomq_conf->bridge.batch               = false;
+	nanomq_conf->bridge.batch_size          = 16384;
+	nanomq_conf->bridge.batch_interval      = 100;
+	nanomq_conf->bridge.batch_compress      = true;
+	nanomq_conf->bridge.routes              = false;
+	nanomq_conf->bridge.forward_set         = NULL;
 }
 
 void
@@ -193,6 +798,11 @@ print_conf(conf *nanomq_conf)
 	debug_msg("enable websocket:         %s",
 	    nanomq_conf->websocket.enable ? "true" : "false");
 	debug_msg("websocket url:            %s", nanomq_conf->websocket.url);
+	debug_msg("enable tls:               %s",
+	    nanomq_conf->tls.enable ? "true" : "false");
+	debug_msg("tls url:                  %s", nanomq_conf->tls.url);
+	debug_msg("tls verify peer:          %s",
+	    nanomq_conf->tls.verify_peer ? "true" : "false");
 	debug_msg("daemon:                   %s",
 	    nanomq_conf->daemon ? "true" : "false");
 	debug_msg(
@@ -200,13 +810,104 @@ print_conf(conf *nanomq_conf)
 	debug_msg(
 	    "max_taskq_thread:         %d", nanomq_conf->max_taskq_thread);
 	debug_msg("parallel:                 %lu", nanomq_conf->parallel);
+	debug_msg("parallel_max:             %d", nanomq_conf->parallel_max);
+	debug_msg(
+	    "fanout_threshold:         %d", nanomq_conf->fanout_threshold);
+	debug_msg("fanout_works:             %d", nanomq_conf->fanout_works);
 	debug_msg("property_size:            %d", nanomq_conf->property_size);
 	debug_msg("msq_len:                  %d", nanomq_conf->msq_len);
 	debug_msg("qos_duration:             %d", nanomq_conf->qos_duration);
+	debug_msg(
+	    "match_cache_size:         %d", nanomq_conf->match_cache_size);
+	debug_msg("shared strategy:          %s",
+	    conf_shared_strategy_str(nanomq_conf->shared_strategy));
+	debug_msg("session_queue_size:       %d",
+	    nanomq_conf->session_queue_size);
+	debug_msg("session_queue_overflow:   %s",
+	    conf_session_overflow_str(nanomq_conf->session_overflow));
+	debug_msg(
+	    "session_expiry_interval:  %d", nanomq_conf->session_expiry);
+	debug_msg("session_msg_max_age:      %d",
+	    nanomq_conf->session_msg_max_age);
+	debug_msg(
+	    "session_memory_limit:     %d", nanomq_conf->session_mem_limit);
+	debug_msg(
+	    "sub_queue_size:           %d", nanomq_conf->sub_queue_size);
+	debug_msg("sub_queue_overflow:       %s",
+	    conf_sub_queue_overflow_str(nanomq_conf->sub_queue_overflow));
+	debug_msg("sub_queue_conflate:       %s",
+	    nanomq_conf->sub_queue_conflate ? nanomq_conf->sub_queue_conflate
+	                                    : "");
+	debug_msg(
+	    "topic_alias_max:          %u", nanomq_conf->topic_alias_max);
+	debug_msg(
+	    "topic_alias_out:          %u", nanomq_conf->topic_alias_out);
 	debug_msg("enable http server:       %s",
 	    nanomq_conf->http_server.enable ? "true" : "false");
 	debug_msg(
 	    "http server port:         %d", nanomq_conf->http_server.port);
+	debug_msg("enable persistence:       %s",
+	    nanomq_conf->persistence.enable ? "true" : "false");
+	debug_msg("persistence dir:          %s", nanomq_conf->persistence.dir);
+	debug_msg("enable snapshot:          %s",
+	    nanomq_conf->snapshot.enable ? "true" : "false");
+	debug_msg("snapshot path:            %s", nanomq_conf->snapshot.path);
+	debug_msg(
+	    "snapshot interval:        %d", nanomq_conf->snapshot.interval);
+	debug_msg("enable sys event:         %s",
+	    nanomq_conf->sys_event.enable ? "true" : "false");
+	debug_msg(
+	    "sys event batch:          %d", nanomq_conf->sys_event.batch);
+	debug_msg(
+	    "sys event interval:       %d", nanomq_conf->sys_event.interval);
+	debug_msg("sys metrics interval:     %d",
+	    nanomq_conf->sys_event.metrics_interval);
+	debug_msg("sys route interval:       %d",
+	    nanomq_conf->sys_event.route_interval);
+	debug_msg("enable shm:               %s",
+	    nanomq_conf->shm.enable ? "true" : "false");
+	debug_msg("shm dir:                  %s", nanomq_conf->shm.dir);
+	debug_msg("shm rings:                %d", nanomq_conf->shm.rings);
+	debug_msg("shm ring size:            %d", nanomq_conf->shm.ring_size);
+	debug_msg("enable capture:           %s",
+	    nanomq_conf->capture.enable ? "true" : "false");
+	debug_msg("capture file:             %s", nanomq_conf->capture.file);
+	debug_msg(
+	    "capture max size:         %ld", nanomq_conf->capture.max_size);
+	debug_msg(
+	    "mem high watermark:       %ld", nanomq_conf->mem.high_watermark);
+	debug_msg(
+	    "mem low watermark:        %ld", nanomq_conf->mem.low_watermark);
+	debug_msg("mem reject connect:       %s",
+	    nanomq_conf->mem.reject_connect ? "true" : "false");
+	debug_msg("mem reject subscribe:     %s",
+	    nanomq_conf->mem.reject_subscribe ? "true" : "false");
+	debug_msg("mem shed qos0:            %s",
+	    nanomq_conf->mem.shed_qos0 ? "true" : "false");
+	debug_msg("mem evict retain:         %s",
+	    nanomq_conf->mem.evict_retain ? "true" : "false");
+	debug_msg("log level:                %s",
+	    nano_log_level_str(nanomq_conf->log.level));
+	debug_msg("log file:                 %s", nanomq_conf->log.file);
+	debug_msg("trace sample:             %d", nanomq_conf->trace.sample);
+	debug_msg("trace slow threshold:     %d",
+	    nanomq_conf->trace.slow_threshold);
+	debug_msg(
+	    "retain memory limit:      %ld", nanomq_conf->retain.mem_limit);
+	debug_msg("retain eviction:          %s",
+	    conf_retain_eviction_str(nanomq_conf->retain.eviction));
+	debug_msg("retain compress threshold: %d",
+	    nanomq_conf->retain.compress_threshold);
+	debug_msg("rate limit msgs:          %d", nanomq_conf->rate_limit.msgs);
+	debug_msg(
+	    "rate limit bytes:         %ld", nanomq_conf->rate_limit.bytes);
+	debug_msg("rate limit policy:        %s",
+	    conf_rate_limit_policy_str(nanomq_conf->rate_limit.policy));
+	for (size_t i = 0; i < nanomq_conf->rate_limit.rules_count; i++) {
+		conf_rate_rule *rule = &nanomq_conf->rate_limit.rules[i];
+		debug_msg("rate limit topics:        %s %d/s %ld bytes/s",
+		    rule->prefix, rule->msgs, rule->bytes);
+	}
 }
 
 void
@@ -406,6 +1107,31 @@ conf_bridge_parse(conf *nanomq_conf)
 		                line, sz, "bridge.mqtt.parallel")) != NULL) {
 			bridge->parallel = atoi(value);
 			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "bridge.mqtt.links")) != NULL) {
+			bridge->links = atoi(value) > 0 ? atoi(value) : 1;
+			free(value);
+		} else if ((value = get_conf_value(line, sz,
+		                "bridge.mqtt.batch.enable")) != NULL) {
+			bridge->batch = strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "bridge.mqtt.batch.size")) != NULL) {
+			bridge->batch_size = atoi(value) > 0 ? atoi(value) : 1;
+			free(value);
+		} else if ((value = get_conf_value(line, sz,
+		                "bridge.mqtt.batch.interval")) != NULL) {
+			bridge->batch_interval =
+			    atoi(value) > 0 ? atoi(value) : 1;
+			free(value);
+		} else if ((value = get_conf_value(line, sz,
+		                "bridge.mqtt.batch.compress")) != NULL) {
+			bridge->batch_compress = strcasecmp(value, "true") == 0;
+			free(value);
+		} else if ((value = get_conf_value(
+		                line, sz, "bridge.mqtt.routes")) != NULL) {
+			bridge->routes = strcasecmp(value, "true") == 0;
+			free(value);
 		} else if ((value = get_conf_value(
 		                line, sz, "bridge.mqtt.address")) != NULL) {
 			bridge->address = value;
@@ -441,6 +1167,9 @@ conf_bridge_parse(conf *nanomq_conf)
 
 	fclose(fp);
 	conf_bridge_parse_subs(bridge, dest_path);
+	dbtree_filter_set_free(bridge->forward_set);
+	bridge->forward_set =
+	    dbtree_filter_set_new(bridge->forwards, bridge->forwards_count);
 	return true;
 
 out:
@@ -463,9 +1192,6 @@ conf_bridge_destroy(conf_bridge *bridge)
 	if (bridge->password) {
 		free(bridge->password);
 	}
-	if (bridge->forwards) {
-		free(bridge->forwards);
-	}
 	if (bridge->forwards_count > 0 && bridge->forwards) {
 		for (size_t i = 0; i < bridge->forwards_count; i++) {
 			if (bridge->forwards[i]) {
@@ -482,6 +1208,8 @@ conf_bridge_destroy(conf_bridge *bridge)
 		}
 		free(bridge->sub_list);
 	}
+	dbtree_filter_set_free(bridge->forward_set);
+	bridge->forward_set = NULL;
 }
 
 void
@@ -500,6 +1228,15 @@ print_bridge_conf(conf_bridge *bridge)
 	debug_msg("bridge.mqtt.password:     %s", bridge->password);
 	debug_msg("bridge.mqtt.keepalive:    %d", bridge->keepalive);
 	debug_msg("bridge.mqtt.parallel:     %ld", bridge->parallel);
+	debug_msg("bridge.mqtt.links:        %u", bridge->links);
+	debug_msg("bridge.mqtt.batch.enable: %s",
+	    bridge->batch ? "true" : "false");
+	debug_msg("bridge.mqtt.batch.size:   %u", bridge->batch_size);
+	debug_msg("bridge.mqtt.batch.interval: %u", bridge->batch_interval);
+	debug_msg("bridge.mqtt.batch.compress: %s",
+	    bridge->batch_compress ? "true" : "false");
+	debug_msg("bridge.mqtt.routes:       %s",
+	    bridge->routes ? "true" : "false");
 	debug_msg("bridge.mqtt.forwards: ");
 	for (size_t i = 0; i < bridge->forwards_count; i++) {
 		debug_msg("\t[%ld] topic:        %s", i, bridge->forwards[i]);
@@ -511,7 +1248,6 @@ print_bridge_conf(conf_bridge *bridge)
 		debug_msg("\t[%ld] qos:          %d", i + 1,
 		    bridge->sub_list[i].qos);
 	}
-	debug_msg("");
 }
 
 void
@@ -532,11 +1268,26 @@ conf_fini(conf *nanomq_conf)
 	zfree(nanomq_conf->conf_file);
 	zfree(nanomq_conf->bridge_file);
 	zfree(nanomq_conf->auth_file);
+	zfree(nanomq_conf->sub_queue_conflate);
 
 	zfree(nanomq_conf->http_server.username);
 	zfree(nanomq_conf->http_server.password);
 
 	zfree(nanomq_conf->websocket.url);
+	zfree(nanomq_conf->tls.url);
+	zfree(nanomq_conf->tls.certfile);
+	zfree(nanomq_conf->tls.keyfile);
+	zfree(nanomq_conf->tls.key_password);
+	zfree(nanomq_conf->tls.cafile);
+	zfree(nanomq_conf->persistence.dir);
+	zfree(nanomq_conf->snapshot.path);
+	zfree(nanomq_conf->shm.dir);
+	zfree(nanomq_conf->capture.file);
+	zfree(nanomq_conf->log.file);
+	for (size_t i = 0; i < nanomq_conf->rate_limit.rules_count; i++) {
+		zfree(nanomq_conf->rate_limit.rules[i].prefix);
+	}
+	zfree(nanomq_conf->rate_limit.rules);
 
 	conf_bridge_destroy(&nanomq_conf->bridge);
 
@@ -1,4 +1,5 @@
 #include "include/env.h"
+#include "include/nano_log.h"
 
 static void
 set_string_var(char **var, const char *env_str)
@@ -24,6 +25,16 @@ set_int_var(int *var, const char *env_str)
 	}
 }
 
+static void
+set_u16_var(uint16_t *var, const char *env_str)
+{
+	char *env = NULL;
+
+	if ((env = getenv(env_str)) != NULL) {
+		*var = (uint16_t) atoi(env);
+	}
+}
+
 static void
 set_long_var(long *var, const char *env_str)
 {
@@ -34,6 +45,86 @@ set_long_var(long *var, const char *env_str)
 	}
 }
 
+static void
+set_shared_strategy_var(int *var, const char *env_str)
+{
+	char *env = NULL;
+
+	if ((env = getenv(env_str)) != NULL) {
+		*var = conf_shared_strategy(env);
+	}
+}
+
+static void
+set_session_overflow_var(int *var, const char *env_str)
+{
+	char *env = NULL;
+
+	if ((env = getenv(env_str)) != NULL) {
+		*var = conf_session_overflow(env);
+	}
+}
+
+static void
+set_rate_limit_policy_var(int *var, const char *env_str)
+{
+	char *env = NULL;
+
+	if ((env = getenv(env_str)) != NULL) {
+		*var = conf_rate_limit_policy(env);
+	}
+}
+
+static void
+set_rate_limit_rules_var(conf_rate_limit *var, const char *env_str)
+{
+	char *env = NULL;
+
+	if ((env = getenv(env_str)) != NULL) {
+		conf_rate_limit_rules(var, env);
+	}
+}
+
+static void
+set_sub_queue_overflow_var(int *var, const char *env_str)
+{
+	char *env = NULL;
+
+	if ((env = getenv(env_str)) != NULL) {
+		*var = conf_sub_queue_overflow(env);
+	}
+}
+
+static void
+set_retain_eviction_var(int *var, const char *env_str)
+{
+	char *env = NULL;
+
+	if ((env = getenv(env_str)) != NULL) {
+		*var = conf_retain_eviction(env);
+	}
+}
+
+static void
+set_log_level_var(int *var, const char *env_str)
+{
+	char *env = NULL;
+
+	if ((env = getenv(env_str)) != NULL) {
+		*var = conf_log_level(env);
+	}
+}
+
+static void
+set_log_to_var(int *var, const char *env_str)
+{
+	char *env = NULL;
+
+	if ((env = getenv(env_str)) != NULL) {
+		*var = nano_log_to(env);
+	}
+}
+
 static void
 set_bool_var(bool *var, const char *env_str)
 {
@@ -54,12 +145,41 @@ read_env_conf(conf *config)
 	set_int_var(&config->num_taskq_thread, NANOMQ_NUM_TASKQ_THREAD);
 	set_int_var(&config->max_taskq_thread, NANOMQ_MAX_TASKQ_THREAD);
 	set_long_var((long *) &config->parallel, NANOMQ_PARALLEL);
+	set_int_var(&config->parallel_max, NANOMQ_PARALLEL_MAX);
+	set_int_var(&config->fanout_threshold, NANOMQ_FANOUT_THRESHOLD);
+	set_int_var(&config->fanout_works, NANOMQ_FANOUT_WORKS);
 	set_int_var(&config->property_size, NANOMQ_PROPERTY_SIZE);
 	set_int_var(&config->msq_len, NANOMQ_MSQ_LEN);
 	set_int_var(&config->qos_duration, NANOMQ_QOS_DURATION);
+	set_int_var(&config->match_cache_size, NANOMQ_MATCH_CACHE_SIZE);
+	set_shared_strategy_var(
+	    &config->shared_strategy, NANOMQ_SHARED_SUBSCRIPTION_STRATEGY);
+	set_int_var(&config->session_queue_size, NANOMQ_SESSION_QUEUE_SIZE);
+	set_session_overflow_var(
+	    &config->session_overflow, NANOMQ_SESSION_QUEUE_OVERFLOW);
+	set_int_var(&config->session_expiry, NANOMQ_SESSION_EXPIRY_INTERVAL);
+	set_int_var(
+	    &config->session_msg_max_age, NANOMQ_SESSION_MSG_MAX_AGE);
+	set_int_var(&config->session_mem_limit, NANOMQ_SESSION_MEMORY_LIMIT);
+	set_int_var(&config->sub_queue_size, NANOMQ_SUB_QUEUE_SIZE);
+	set_sub_queue_overflow_var(
+	    &config->sub_queue_overflow, NANOMQ_SUB_QUEUE_OVERFLOW);
+	set_string_var(
+	    &config->sub_queue_conflate, NANOMQ_SUB_QUEUE_CONFLATE);
+	set_u16_var(&config->topic_alias_max, NANOMQ_TOPIC_ALIAS_MAX);
+	set_u16_var(&config->topic_alias_out, NANOMQ_TOPIC_ALIAS_OUT);
 	set_bool_var(&config->allow_anonymous, NANOMQ_ALLOW_ANONYMOUS);
 	set_bool_var(&config->websocket.enable, NANOMQ_WEBSOCKET_ENABLE);
 	set_string_var(&config->websocket.url, NANOMQ_WEBSOCKET_URL);
+	set_bool_var(&config->tls.enable, NANOMQ_TLS_ENABLE);
+	set_string_var(&config->tls.url, NANOMQ_TLS_URL);
+	set_string_var(&config->tls.certfile, NANOMQ_TLS_CERTFILE);
+	set_string_var(&config->tls.keyfile, NANOMQ_TLS_KEYFILE);
+	set_string_var(&config->tls.key_password, NANOMQ_TLS_KEY_PASSWORD);
+	set_string_var(&config->tls.cafile, NANOMQ_TLS_CACERTFILE);
+	set_bool_var(&config->tls.verify_peer, NANOMQ_TLS_VERIFY_PEER);
+	set_bool_var(&config->tls.fail_if_no_peer_cert,
+	    NANOMQ_TLS_FAIL_IF_NO_PEER_CERT);
 	set_bool_var(&config->http_server.enable, NANOMQ_HTTP_SERVER_ENABLE);
 	set_int_var(
 	    (int *) &config->http_server.port, NANOMQ_HTTP_SERVER_PORT);
@@ -67,6 +187,58 @@ read_env_conf(conf *config)
 	    &config->http_server.username, NANOMQ_HTTP_SERVER_USERNAME);
 	set_string_var(
 	    &config->http_server.password, NANOMQ_HTTP_SERVER_PASSWORD);
+	set_bool_var(&config->persistence.enable, NANOMQ_PERSISTENCE_ENABLE);
+	set_string_var(&config->persistence.dir, NANOMQ_PERSISTENCE_DIR);
+	set_int_var(&config->persistence.segment_size,
+	    NANOMQ_PERSISTENCE_SEGMENT_SIZE);
+	set_int_var(
+	    &config->persistence.fsync_batch, NANOMQ_PERSISTENCE_FSYNC_BATCH);
+	set_int_var(&config->persistence.fsync_interval,
+	    NANOMQ_PERSISTENCE_FSYNC_INTERVAL);
+	set_int_var(&config->persistence.compact_size,
+	    NANOMQ_PERSISTENCE_COMPACT_SIZE);
+	set_bool_var(&config->snapshot.enable, NANOMQ_SNAPSHOT_ENABLE);
+	set_string_var(&config->snapshot.path, NANOMQ_SNAPSHOT_PATH);
+	set_int_var(&config->snapshot.interval, NANOMQ_SNAPSHOT_INTERVAL);
+	set_bool_var(&config->sys_event.enable, NANOMQ_SYS_EVENT_ENABLE);
+	set_int_var(&config->sys_event.batch, NANOMQ_SYS_EVENT_BATCH);
+	set_int_var(&config->sys_event.interval, NANOMQ_SYS_EVENT_INTERVAL);
+	set_int_var(&config->sys_event.metrics_interval,
+	    NANOMQ_SYS_EVENT_METRICS_INTERVAL);
+	set_int_var(&config->sys_event.route_interval,
+	    NANOMQ_SYS_EVENT_ROUTE_INTERVAL);
+	set_bool_var(&config->shm.enable, NANOMQ_SHM_ENABLE);
+	set_string_var(&config->shm.dir, NANOMQ_SHM_DIR);
+	set_int_var(&config->shm.rings, NANOMQ_SHM_RINGS);
+	set_int_var(&config->shm.ring_size, NANOMQ_SHM_RING_SIZE);
+	set_int_var(&config->shm.batch, NANOMQ_SHM_BATCH);
+	set_int_var(&config->shm.interval, NANOMQ_SHM_INTERVAL);
+	set_bool_var(&config->capture.enable, NANOMQ_CAPTURE_ENABLE);
+	set_string_var(&config->capture.file, NANOMQ_CAPTURE_FILE);
+	set_long_var(&config->capture.max_size, NANOMQ_CAPTURE_MAX_SIZE);
+	set_long_var(&config->mem.high_watermark, NANOMQ_MEM_HIGH_WATERMARK);
+	set_long_var(&config->mem.low_watermark, NANOMQ_MEM_LOW_WATERMARK);
+	set_bool_var(&config->mem.reject_connect, NANOMQ_MEM_REJECT_CONNECT);
+	set_bool_var(
+	    &config->mem.reject_subscribe, NANOMQ_MEM_REJECT_SUBSCRIBE);
+	set_bool_var(&config->mem.shed_qos0, NANOMQ_MEM_SHED_QOS0);
+	set_bool_var(&config->mem.evict_retain, NANOMQ_MEM_EVICT_RETAIN);
+	set_log_level_var(&config->log.level, NANOMQ_LOG_LEVEL);
+	set_log_to_var(&config->log.to, NANOMQ_LOG_TO);
+	set_string_var(&config->log.file, NANOMQ_LOG_FILE);
+	set_int_var(&config->trace.sample, NANOMQ_TRACE_SAMPLE);
+	set_int_var(
+	    &config->trace.slow_threshold, NANOMQ_TRACE_SLOW_THRESHOLD);
+	set_long_var(&config->retain.mem_limit, NANOMQ_RETAIN_MEM_LIMIT);
+	set_retain_eviction_var(
+	    &config->retain.eviction, NANOMQ_RETAIN_EVICTION);
+	set_int_var(&config->retain.compress_threshold,
+	    NANOMQ_RETAIN_COMPRESS_THRESHOLD);
+	set_int_var(&config->rate_limit.msgs, NANOMQ_RATE_LIMIT_MSGS);
+	set_long_var(&config->rate_limit.bytes, NANOMQ_RATE_LIMIT_BYTES);
+	set_rate_limit_policy_var(
+	    &config->rate_limit.policy, NANOMQ_RATE_LIMIT_POLICY);
+	set_rate_limit_rules_var(&config->rate_limit, NANOMQ_RATE_LIMIT_TOPICS);
 	set_string_var(&config->conf_file, NANOMQ_CONF_PATH);
 	set_string_var(&config->bridge_file, NANOMQ_BRIDGE_CONF_PATH);
 	set_string_var(&config->auth_file, NANOMQ_AUTH_CONF_PATH);
@@ -12,73 +12,158 @@
 #include <cstdlib>
 #include <cstring>
 #include <mutex>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 using namespace std;
 
 /*
  * A thread safe hash table
- * baseed on unordered_map
+ * baseed on unordered_map, split into stripes of their own mutex so
+ * that lookups of different keys do not contend on one lock. get() and
+ * contains() never insert, compound updates run under the stripe lock
+ * through update() and modify().
  */
 
-template <typename K, typename V> class mqtt_hash {
+template <typename K, typename V, size_t N = 64> class mqtt_hash {
     public:
-	typedef typename unordered_map<K, V>::iterator iterator;
-
-	V &operator[](const K &_key)
+	V get(const K &_key)
 	{
-		lock_guard<mutex> lk(_mtx);
-		return hash_map[_key];
+		stripe &                 s = stripe_of(_key);
+		lock_guard<mutex>        lk(s.mtx);
+		typename map_t::iterator iter = s.map.find(_key);
+
+		return iter == s.map.end() ? V() : iter->second;
 	}
 
-	V get(const K &_key)
+	bool contains(const K &_key)
 	{
-		lock_guard<mutex> lk(_mtx);
-		return hash_map[_key];
+		stripe &          s = stripe_of(_key);
+		lock_guard<mutex> lk(s.mtx);
+
+		return s.map.find(_key) != s.map.end();
 	}
 
 	void set(const K &_key, const V &_val)
 	{
-		lock_guard<mutex> lk(_mtx);
-		hash_map[_key] = _val;
+		stripe &          s = stripe_of(_key);
+		lock_guard<mutex> lk(s.mtx);
+		s.map[_key] = _val;
 	}
 
 	void del(const K &_key)
 	{
-		lock_guard<mutex>         lk(_mtx);
-		mqtt_hash<K, V>::iterator iter = hash_map.find(_key);
+		stripe &          s = stripe_of(_key);
+		lock_guard<mutex> lk(s.mtx);
+		s.map.erase(_key);
+	}
 
-		if (iter != hash_map.end()) {
-			hash_map.erase(iter);
+	// Remove _key, its value is moved to _val if present.
+	bool take(const K &_key, V &_val)
+	{
+		stripe &                 s = stripe_of(_key);
+		lock_guard<mutex>        lk(s.mtx);
+		typename map_t::iterator iter = s.map.find(_key);
+
+		if (iter == s.map.end()) {
+			return false;
 		}
+		_val = std::move(iter->second);
+		s.map.erase(iter);
+		return true;
+	}
+
+	// Run fn on the value of _key, a default one is inserted on a miss.
+	template <typename F> void update(const K &_key, F fn)
+	{
+		stripe &          s = stripe_of(_key);
+		lock_guard<mutex> lk(s.mtx);
+		fn(s.map[_key]);
 	}
 
-	bool find(const K &_key)
+	// Run fn on the value of _key if present, the entry is removed if fn
+	// returns false.
+	template <typename F> bool modify(const K &_key, F fn)
 	{
-		mqtt_hash<K, V>::iterator iter = hash_map.begin();
-		iter                           = hash_map.find(_key);
+		stripe &                 s = stripe_of(_key);
+		lock_guard<mutex>        lk(s.mtx);
+		typename map_t::iterator iter = s.map.find(_key);
 
-		if (iter != hash_map.end()) {
-			return true;
+		if (iter == s.map.end()) {
+			return false;
 		}
-		return false;
+		if (!fn(iter->second)) {
+			s.map.erase(iter);
+		}
+		return true;
+	}
+
+	// Visit about limit entries from cursor, the lock of a stripe is held
+	// only while fn runs over it. The cursor is a stripe and a bucket
+	// index, 0 starts and ends a scan. Entries present for the whole
+	// scan are visited, a rehash of a stripe between two calls may make
+	// some of its entries visited twice or missed.
+	template <typename F>
+	uint64_t scan(uint64_t cursor, size_t limit, F fn)
+	{
+		size_t n = 0;
+
+		for (size_t i = cursor >> 32, b = (uint32_t) cursor; i < N;
+		     i++, b = 0) {
+			lock_guard<mutex> lk(stripes[i].mtx);
+			map_t &           map = stripes[i].map;
+
+			for (; b < map.bucket_count(); b++) {
+				size_t bs = map.bucket_size(b);
+
+				// a bucket is never split across two calls
+				if (n > 0 && n + bs > limit) {
+					return ((uint64_t) i << 32) | b;
+				}
+				for (auto iter = map.begin(b);
+				     iter != map.end(b); ++iter) {
+					fn(iter->first, iter->second);
+				}
+				n += bs;
+			}
+		}
+
+		return 0;
 	}
 
 	vector<V> map_to_value_vector()
 	{
 		vector<V> vec;
 
-		std::transform(hash_map.begin(), hash_map.end(),
-		    std::back_inserter(vec),
-		    [](const std::pair<K, V> &p) { return p.second; });
+		for (size_t i = 0; i < N; i++) {
+			lock_guard<mutex> lk(stripes[i].mtx);
+			for (auto &p : stripes[i].map) {
+				vec.push_back(p.second);
+			}
+		}
 
 		return vec;
 	}
 
     private:
-	unordered_map<K, V> hash_map;
-	mutex               _mtx;
+	typedef unordered_map<K, V> map_t;
+
+	struct stripe {
+		mutex mtx;
+		map_t map;
+	};
+
+	// std::hash of an integer is the integer itself, mix it so that
+	// sequential pipe ids spread over the stripes.
+	stripe &stripe_of(const K &_key)
+	{
+		uint64_t h = (uint64_t) std::hash<K>()(_key);
+		return stripes[(h * 0x9E3779B97F4A7C15ull >> 32) % N];
+	}
+
+	stripe stripes[N];
 };
 
 /*
@@ -94,7 +179,7 @@ mqtt_hash<int, char *> _mqtt_hash;
 void
 push_val(int key, char *val)
 {
-	_mqtt_hash[key] = val;
+	_mqtt_hash.set(key, val);
 }
 
 /*
@@ -275,21 +360,46 @@ del_val(int key)
 
 mqtt_hash<uint32_t, topic_queue *> _topic_hash;
 
+/*
+ * @obj. _topic_set.
+ * @key. pipe_id.
+ * @val. topics of the topic_queue, for check_topic.
+ */
+
+mqtt_hash<uint32_t, unordered_set<string>> _topic_set;
+
 topic_queue **
 get_all_topic_queue(size_t *sz)
 {
-	size_t size = _topic_hash.map_to_value_vector().size();
+	vector<topic_queue *> vec  = _topic_hash.map_to_value_vector();
+	size_t                size = vec.size();
 
 	topic_queue **res =
 	    (topic_queue **) malloc(size * sizeof(topic_queue *));
 
-	memcpy(res, _topic_hash.map_to_value_vector().data(),
-	    size * sizeof(topic_queue *));
+	memcpy(res, vec.data(), size * sizeof(topic_queue *));
 
 	*sz = size;
 	return res;
 }
 
+/*
+ * @obj. _topic_hash.
+ * @key. pipe_id.
+ * @val. topics, cb is called for each one of about limit pipes.
+ */
+
+uint64_t
+scan_topic(uint64_t cursor, size_t limit, topic_scan_cb cb, void *arg)
+{
+	return _topic_hash.scan(
+	    cursor, limit, [cb, arg](uint32_t id, topic_queue *tq) {
+		    for (; tq; tq = tq->next) {
+			    cb(id, tq->topic, arg);
+		    }
+	    });
+}
+
 static struct topic_queue *
 new_topic_queue(char *val)
 {
@@ -340,16 +450,18 @@ void
 add_topic(uint32_t id, char *val)
 {
 	struct topic_queue *ntq = new_topic_queue(val);
-	struct topic_queue *tq  = _topic_hash[id];
-	if (tq == NULL) {
-		_topic_hash[id] = ntq;
-		log_info("add_topic:%s", _topic_hash[id]->topic);
-	} else {
-		struct topic_queue *tmp = tq->next;
-		tq->next                = ntq;
-		ntq->next               = tmp;
-		log_info("add_topic:%s", tq->next->topic);
-	}
+
+	_topic_hash.update(id, [ntq](topic_queue *&tq) {
+		if (tq == NULL) {
+			tq = ntq;
+		} else {
+			ntq->next = tq->next;
+			tq->next  = ntq;
+		}
+	});
+	log_info("add_topic:%s", ntq->topic);
+	_topic_set.update(
+	    id, [val](unordered_set<string> &set) { set.insert(val); });
 }
 
 /*
@@ -361,20 +473,17 @@ add_topic(uint32_t id, char *val)
 bool
 check_topic(uint32_t id, char *val)
 {
+	bool found = false;
+
 	if (!check_id(id)) {
 		return false;
 	}
+	_topic_set.modify(id, [val, &found](unordered_set<string> &set) {
+		found = set.count(val) > 0;
+		return true;
+	});
 
-	struct topic_queue *tq = _topic_hash[id];
-
-	while (tq != NULL) {
-		if (!strcmp(tq->topic, val)) {
-			return true;
-		}
-		tq = tq->next;
-	}
-
-	return false;
+	return found;
 }
 
 /*
@@ -385,11 +494,7 @@ check_topic(uint32_t id, char *val)
 struct topic_queue *
 get_topic(uint32_t id)
 {
-	if (_topic_hash[id]) {
-		return _topic_hash[id];
-	}
-
-	return NULL;
+	return _topic_hash.get(id);
 }
 
 /*
@@ -400,36 +505,22 @@ get_topic(uint32_t id)
 void
 del_topic_one(uint32_t id, char *topic)
 {
-	struct topic_queue *tt = _topic_hash[id];
-	struct topic_queue *tb = NULL;
-
-	if (tt == NULL) {
-		return;
-	}
-	if (!strcmp(tt->topic, topic) && tt->next == NULL) {
-		_topic_hash.del(id);
-		delete_topic_queue(tt);
-		return;
-	}
+	struct topic_queue *tt = NULL;
 
-	if (!strcmp(tt->topic, topic)) {
-		_topic_hash[id] = tt->next;
-		delete_topic_queue(tt);
-		return;
-	}
-
-	while (tt) {
-		if (!strcmp(tt->topic, topic)) {
-			if (tt->next == NULL) {
-				tb->next = NULL;
-			} else {
-				tb->next = tt->next;
+	_topic_hash.modify(id, [topic, &tt](topic_queue *&tq) {
+		for (topic_queue **pp = &tq; *pp; pp = &(*pp)->next) {
+			if (!strcmp((*pp)->topic, topic)) {
+				tt  = *pp;
+				*pp = tt->next;
+				break;
 			}
-			break;
 		}
-		tb = tt;
-		tt = tt->next;
-	}
+		return tq != NULL;
+	});
+	_topic_set.modify(id, [topic](unordered_set<string> &set) {
+		set.erase(topic);
+		return true;
+	});
 
 	delete_topic_queue(tt);
 
@@ -444,8 +535,9 @@ del_topic_one(uint32_t id, char *topic)
 void
 del_topic_all(uint32_t id)
 {
-	struct topic_queue *tq = _topic_hash[id];
-	_topic_hash.del(id);
+	struct topic_queue *tq = NULL;
+	_topic_hash.take(id, tq);
+	_topic_set.del(id);
 	while (tq) {
 		struct topic_queue *tt = tq;
 		tq                     = tq->next;
@@ -461,7 +553,7 @@ del_topic_all(uint32_t id)
 bool
 check_id(uint32_t id)
 {
-	return _topic_hash.find(id);
+	return _topic_hash.contains(id);
 }
 
 /*
@@ -472,7 +564,7 @@ check_id(uint32_t id)
 void
 print_topic_all(uint32_t id)
 {
-	struct topic_queue *tq    = _topic_hash[id];
+	struct topic_queue *tq    = _topic_hash.get(id);
 	int                 t_num = 0;
 	while (tq) {
 		log_info("Topic number %d, topic subscribed: %s.", ++t_num,
@@ -499,13 +591,14 @@ mqtt_hash<uint32_t, topic_queue *> _cached_topic_hash;
 void
 cache_topic_all(uint32_t pid, uint32_t cid)
 {
-	struct topic_queue *tq_in_topic_hash = _topic_hash[pid];
+	struct topic_queue *tq_in_topic_hash = NULL;
+	_topic_hash.take(pid, tq_in_topic_hash);
+	_topic_set.del(pid);
 	if (cached_check_id(cid)) {
 		log_info("unexpected: cached hash instance is not vacant");
 		del_cached_topic_all(cid);
 	}
-	_cached_topic_hash[cid] = tq_in_topic_hash;
-	_topic_hash.del(pid);
+	_cached_topic_hash.set(cid, tq_in_topic_hash);
 }
 
 /*
@@ -518,13 +611,35 @@ cache_topic_all(uint32_t pid, uint32_t cid)
 void
 restore_topic_all(uint32_t cid, uint32_t pid)
 {
-	struct topic_queue *tq_in_cached = _cached_topic_hash[cid];
+	struct topic_queue *tq_in_cached = NULL;
+	_cached_topic_hash.take(cid, tq_in_cached);
 	if (check_id(pid)) {
 		log_info("unexpected: hash instance is not vacant");
 		del_topic_all(pid);
 	}
-	_topic_hash[pid] = tq_in_cached;
-	_cached_topic_hash.del(cid);
+	_topic_hash.set(pid, tq_in_cached);
+	_topic_set.update(pid, [tq_in_cached](unordered_set<string> &set) {
+		for (topic_queue *tq = tq_in_cached; tq; tq = tq->next) {
+			set.insert(tq->topic);
+		}
+	});
+}
+
+/*
+ * @obj. _cached_topic_hash.
+ * @key. (DJBhashed) client_id.
+ * @val. topic, a session loaded without its client
+ */
+
+void
+add_cached_topic(uint32_t cid, char *val)
+{
+	struct topic_queue *ntq = new_topic_queue(val);
+
+	_cached_topic_hash.update(cid, [ntq](topic_queue *&tq) {
+		ntq->next = tq;
+		tq        = ntq;
+	});
 }
 
 /*
@@ -557,11 +672,7 @@ delete_cached_topic_one(struct topic_queue *ctq)
 struct topic_queue *
 get_cached_topic(uint32_t cid)
 {
-	if (_cached_topic_hash[cid]) {
-		return _cached_topic_hash[cid];
-	}
-
-	return NULL;
+	return _cached_topic_hash.get(cid);
 }
 
 /*
@@ -572,8 +683,8 @@ get_cached_topic(uint32_t cid)
 void
 del_cached_topic_all(uint32_t cid)
 {
-	struct topic_queue *ctq = _cached_topic_hash[cid];
-	_cached_topic_hash.del(cid);
+	struct topic_queue *ctq = NULL;
+	_cached_topic_hash.take(cid, ctq);
 	while (ctq) {
 		struct topic_queue *tt = ctq;
 		ctq                    = ctq->next;
@@ -590,7 +701,7 @@ del_cached_topic_all(uint32_t cid)
 bool
 cached_check_id(uint32_t key)
 {
-	return _cached_topic_hash.find(key);
+	return _cached_topic_hash.contains(key);
 }
 
 /*
@@ -608,20 +719,17 @@ mqtt_hash<uint32_t, char *> _pipe_hash;
 void
 add_pipe_id(uint32_t pipe_id, char *client_id)
 {
-	_pipe_hash[pipe_id] = client_id;
-	log_info("add_pipe_id %d, client_id %s", pipe_id, _pipe_hash[pipe_id]);
+	_pipe_hash.set(pipe_id, client_id);
+	log_info("add_pipe_id %d, client_id %s", pipe_id, client_id);
 	return;
 }
 
 void
 del_pipe_id(uint32_t pipe_id)
 {
-#ifdef NOLOG
-#else
-	char *res = _pipe_hash[pipe_id];
-#endif
+	char *res = NULL;
+	_pipe_hash.take(pipe_id, res);
 	log_info("del_pipe_id %d, client_id %s", pipe_id, res);
-	_pipe_hash.del(pipe_id);
 	return;
 }
 
@@ -632,7 +740,7 @@ del_pipe_id(uint32_t pipe_id)
 char *
 get_client_id(uint32_t pipe_id)
 {
-	return _pipe_hash[pipe_id];
+	return _pipe_hash.get(pipe_id);
 }
 
 /*
@@ -642,7 +750,20 @@ get_client_id(uint32_t pipe_id)
 bool
 check_pipe_id(uint32_t pipe_id)
 {
-	return _pipe_hash.find(pipe_id);
+	return _pipe_hash.contains(pipe_id);
+}
+
+/*
+ * @obj. _pipe_hash.
+ */
+
+uint64_t
+scan_pipe_id(uint64_t cursor, size_t limit, pipe_scan_cb cb, void *arg)
+{
+	return _pipe_hash.scan(
+	    cursor, limit, [cb, arg](uint32_t id, char *client_id) {
+		    cb(id, client_id, arg);
+	    });
 }
 
 /*
@@ -704,16 +825,16 @@ void
 add_msg_queue(char *id, char *msg)
 {
 	struct msg_queue *nmq = new_msg_queue(msg);
-	struct msg_queue *mq  = _msg_queue_hash[id];
-	if (mq == NULL) {
-		_msg_queue_hash[id] = nmq;
-		log_info("add_topic:%s",_msg_queue_hash[id]->msg);
-	} else {
-		struct msg_queue *tmp = mq->next;
-		mq->next              = nmq;
-		nmq->next             = tmp;
-		log_info("add_topic:%s", mq->next->msg);
-	}
+
+	_msg_queue_hash.update(id, [nmq](msg_queue *&mq) {
+		if (mq == NULL) {
+			mq = nmq;
+		} else {
+			nmq->next = mq->next;
+			mq->next  = nmq;
+		}
+	});
+	log_info("add_topic:%s", nmq->msg);
 }
 
 /*
@@ -723,8 +844,8 @@ add_msg_queue(char *id, char *msg)
 void
 del_msg_queue_all(char *id)
 {
-	struct msg_queue *mq = _msg_queue_hash[id];
-	_msg_queue_hash.del(id);
+	struct msg_queue *mq = NULL;
+	_msg_queue_hash.take(id, mq);
 	while (mq) {
 		struct msg_queue *tt = mq;
 		mq                   = mq->next;
@@ -740,7 +861,7 @@ del_msg_queue_all(char *id)
 bool
 check_msg_queue_clientid(char *id)
 {
-	return _msg_queue_hash.find(id);
+	return _msg_queue_hash.contains(id);
 }
 
 /*
@@ -750,10 +871,7 @@ check_msg_queue_clientid(char *id)
 struct msg_queue *
 get_msg_queue(char *id)
 {
-	if (check_msg_queue_clientid(id)) {
-		return _msg_queue_hash[id];
-	}
-	return NULL;
+	return _msg_queue_hash.get(id);
 }
 
 /*
@@ -771,7 +889,7 @@ mqtt_hash<uint32_t, void *> _session_hash;
 bool
 check_session(uint32_t id)
 {
-	return _session_hash.find(id);
+	return _session_hash.contains(id);
 }
 
 /*
@@ -782,11 +900,7 @@ check_session(uint32_t id)
 void *
 get_session(uint32_t id)
 {
-	if (_session_hash[id]) {
-		return _session_hash[id];
-	}
-
-	return NULL;
+	return _session_hash.get(id);
 }
 
 /*
@@ -798,7 +912,7 @@ get_session(uint32_t id)
 void
 add_session(uint32_t id, void *session)
 {
-	_session_hash[id] = session;
+	_session_hash.set(id, session);
 }
 
 /*
@@ -809,7 +923,7 @@ add_session(uint32_t id, void *session)
 void *
 del_session(uint32_t id)
 {
-	void *rv = _session_hash[id];
-	_session_hash.del(id);
+	void *rv = NULL;
+	_session_hash.take(id, rv);
 	return rv;
 }
@@ -18,9 +18,16 @@
 
 #define CONF_TCP_URL_DEFAULT "broker+tcp://0.0.0.0:1883"
 #define CONF_WS_URL_DEFAULT "nmq+ws://0.0.0.0:8083/mqtt"
+#define CONF_TLS_URL_DEFAULT "tls+broker+tcp://0.0.0.0:8883"
+#define CONF_PERSISTENCE_DIR_DEFAULT "/tmp/nanomq/wal"
+#define CONF_SNAPSHOT_PATH_DEFAULT "/tmp/nanomq/snapshot"
+#define CONF_SHM_DIR_DEFAULT "/dev/shm"
+#define CONF_CAPTURE_FILE_DEFAULT "/tmp/nanomq.cap"
+#define CONF_LOG_FILE_DEFAULT "/tmp/debug_nanomq.log"
 
 #define TCP_URL_PREFIX "broker+tcp"
 #define WS_URL_PREFIX "nmq+ws"
+#define TLS_URL_PREFIX "tls+broker+tcp"
 
 #define FREE_NONULL(p)    \
 	if (p) {          \
@@ -51,6 +58,127 @@ struct conf_websocket {
 
 typedef struct conf_websocket conf_websocket;
 
+struct conf_tls {
+	bool  enable;
+	char *url;
+	char *certfile; // PEM, with the chain up to the CA
+	char *keyfile;
+	char *key_password; // of keyfile, NULL if it is not encrypted
+	char *cafile;       // PEM of the CAs client certificates are checked by
+	bool  verify_peer;  // ask clients for a certificate
+	bool  fail_if_no_peer_cert;
+};
+
+typedef struct conf_tls conf_tls;
+
+struct conf_persistence {
+	bool  enable;
+	char *dir;
+	int   segment_size;
+	int   fsync_batch;
+	int   fsync_interval;
+	int   compact_size;
+};
+
+typedef struct conf_persistence conf_persistence;
+
+struct conf_snapshot {
+	bool  enable;
+	char *path;
+	int   interval; // s between two snapshots, 0 only on stop
+};
+
+typedef struct conf_snapshot conf_snapshot;
+
+struct conf_sys_event {
+	bool enable;
+	int  batch;            // events coalesced in one PUBLISH at most
+	int  interval;         // ms between two PUBLISH of a sys event work
+	int  metrics_interval; // s between two $SYS metrics, 0 disables
+	int  route_interval;   // ms between two route updates, 0 disables
+};
+
+typedef struct conf_sys_event conf_sys_event;
+
+// rings local processes publish on, see nano_shm.h
+struct conf_shm {
+	bool  enable;
+	char *dir;
+	int   rings;     // producers at once at most
+	int   ring_size; // bytes of a ring
+	int   batch;     // records taken from a ring before the next one
+	int   interval;  // ms between two looks at the rings once all empty
+};
+
+typedef struct conf_shm conf_shm;
+
+// packets received, recorded for nanomq replay, see nano_capture.h
+struct conf_capture {
+	bool  enable;
+	char *file;
+	long  max_size; // bytes of the file, 0 unbounded
+};
+
+typedef struct conf_capture conf_capture;
+
+// admission control by the memory accounted, see nano_mem.h
+struct conf_mem {
+	long high_watermark; // bytes the broker is under pressure above, 0 off
+	long low_watermark;  // bytes the pressure ends below
+	bool reject_connect;
+	bool reject_subscribe;
+	bool shed_qos0;
+	bool evict_retain; // down to low_watermark
+};
+
+typedef struct conf_mem conf_mem;
+
+struct conf_log {
+	int   level; // NANO_LOG_*
+	int   to;    // NANO_LOG_TO_* flags
+	char *file;
+};
+
+typedef struct conf_log conf_log;
+
+struct conf_trace {
+	int sample;         // one PUBLISH in sample is timed, 0 disables
+	int slow_threshold; // us a timed PUBLISH is logged beyond, 0 never
+};
+
+typedef struct conf_trace conf_trace;
+
+struct conf_retain {
+	long mem_limit;          // bytes of retained messages, 0 unbounded
+	int  eviction;           // nano_retain_eviction
+	int  compress_threshold; // payload bytes compressed beyond, 0 never
+};
+
+typedef struct conf_retain conf_retain;
+
+// what to do with a PUBLISH over a rate limit of its client
+typedef enum {
+	RATE_LIMIT_DROP,       // drop it
+	RATE_LIMIT_DISCONNECT, // close the pipe
+	RATE_LIMIT_PAUSE,      // hold it back until it is within the limit
+} rate_limit_policy;
+
+typedef struct {
+	char *prefix; // of topics the limits are on
+	int   msgs;   // PUBLISH/s, 0 unbounded
+	long  bytes;  // bytes/s, 0 unbounded
+} conf_rate_rule;
+
+struct conf_rate_limit {
+	int             msgs;   // PUBLISH/s of a client, 0 unbounded
+	long            bytes;  // bytes/s of a client, 0 unbounded
+	int             policy; // rate_limit_policy
+	size_t          rules_count;
+	conf_rate_rule *rules; // limits of each client on a topic prefix
+};
+
+typedef struct conf_rate_limit conf_rate_limit;
+
 typedef struct {
 	char *   topic;
 	uint32_t topic_len;
@@ -71,10 +199,28 @@ struct conf_bridge {
 	size_t     sub_count;
 	subscribe *sub_list;
 	uint64_t   parallel;
+	uint32_t   links; // upstream connections, forwards split by topic
+	// forwards of a link packed into a nano_envelope, sent once it has
+	// batch_size bytes or is batch_interval ms old
+	bool       batch;
+	uint32_t   batch_size;
+	uint32_t   batch_interval;
+	bool       batch_compress;
+	// forwards only what the remote nanomq advertises subscribers for
+	bool       routes;
+	// forwards compiled by conf_bridge_parse, a dbtree_filter_set
+	struct dbtree_filter_set *forward_set;
 };
 
 typedef struct conf_bridge conf_bridge;
 
+// what to do with a subscriber once sub_queue_size messages are held for it
+typedef enum {
+	SUB_QUEUE_DROP_QOS0,   // drop QoS 0, drop the oldest held message
+	SUB_QUEUE_DROP_OLDEST, // drop the oldest held message
+	SUB_QUEUE_DISCONNECT,  // close the pipe
+} sub_queue_overflow;
+
 struct conf {
 	char *   conf_file;
 	char *   bridge_file;
@@ -83,15 +229,41 @@ struct conf {
 	int      num_taskq_thread;
 	int      max_taskq_thread;
 	uint64_t parallel;
+	int      parallel_max; // broker works grown to, 0 from max_taskq_thread
+	int      fanout_threshold; // receivers sent by the fanout works, 0 off
+	int      fanout_works;     // 0 for max_taskq_thread
 	int      property_size;
 	int      msq_len;
 	int      qos_duration;
+	int      match_cache_size;
+	int      shared_strategy;
+	int      session_queue_size;
+	int      session_overflow;
+	int      session_expiry;      // s an offline session is kept, 0 forever
+	int      session_msg_max_age; // s a message is queued, 0 forever
+	int      session_mem_limit;   // bytes of queued messages, 0 unbounded
+	int      sub_queue_size;
+	int      sub_queue_overflow;
+	char *   sub_queue_conflate; // topic filters separated by ','
+	uint16_t topic_alias_max;
+	uint16_t topic_alias_out;
 	void *   db_root;
 	bool     allow_anonymous;
 	bool     daemon;
 
 	conf_http_server http_server;
 	conf_websocket   websocket;
+	conf_tls         tls;
+	conf_persistence persistence;
+	conf_snapshot    snapshot;
+	conf_sys_event   sys_event;
+	conf_shm         shm;
+	conf_capture     capture;
+	conf_mem         mem;
+	conf_log         log;
+	conf_trace       trace;
+	conf_retain      retain;
+	conf_rate_limit  rate_limit;
 	conf_bridge      bridge;
 
 	conf_auth auths;
@@ -110,4 +282,17 @@ extern void conf_auth_parser(conf *);
 
 extern int string_trim(char **dst, char *str);
 
+extern int         conf_shared_strategy(const char *value);
+extern const char *conf_shared_strategy_str(int strategy);
+extern int         conf_session_overflow(const char *value);
+extern const char *conf_session_overflow_str(int overflow);
+extern int         conf_sub_queue_overflow(const char *value);
+extern const char *conf_sub_queue_overflow_str(int overflow);
+extern int         conf_log_level(const char *value);
+extern int         conf_retain_eviction(const char *value);
+extern const char *conf_retain_eviction_str(int eviction);
+extern int         conf_rate_limit_policy(const char *value);
+extern const char *conf_rate_limit_policy_str(int policy);
+extern void conf_rate_limit_rules(conf_rate_limit *limit, const char *value);
+
 #endif
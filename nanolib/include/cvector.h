@@ -4,11 +4,21 @@
 
 #include <assert.h> /* for assert */
 #include <stdlib.h> /* for malloc/realloc/free */
+#include <string.h> /* for memcpy */
 
 /**
  * @brief cvector_vector_type - The vector type used in this library
  */
 #define cvector(type) type *
+
+/**
+ * @brief CVECTOR_BORROWED - For internal use, set in the capacity of a
+ * vector whose storage it does not own, a buffer of the caller or memory
+ * of an arena. It moves to the heap once it outgrows the storage, until
+ * then cvector_free frees nothing.
+ */
+#define CVECTOR_BORROWED ((size_t) 1 << (sizeof(size_t) * 8 - 1))
+
 /**
  * @brief cvector_set_capacity - For internal use, sets the capacity variable
  * of the vector
@@ -42,7 +52,63 @@
  * @param vec - the vector
  * @return the capacity as a size_t
  */
-#define cvector_capacity(vec) ((vec) ? ((size_t *) (vec))[-1] : (size_t) 0)
+#define cvector_capacity(vec) \
+	((vec) ? ((size_t *) (vec))[-1] & ~CVECTOR_BORROWED : (size_t) 0)
+
+/**
+ * @brief cvector_borrowed - returns non-zero if the vector still is on
+ * storage it does not own
+ * @param vec - the vector
+ * @return non-zero if borrowed
+ */
+#define cvector_borrowed(vec) \
+	((vec) && (((size_t *) (vec))[-1] & CVECTOR_BORROWED))
+
+/**
+ * @brief cvector_buf - declares a buffer for cvector_init_buf to keep count
+ * elements of type in
+ * @param type - type of the elements
+ * @param name - name of the buffer
+ * @param count - elements it holds
+ */
+#define cvector_buf(type, name, count)                                  \
+	size_t name[2 + ((count) * sizeof(type) + sizeof(size_t) - 1) / \
+	    sizeof(size_t)]
+
+/**
+ * @brief cvector_init_buf - starts an empty vector on the storage of the
+ * caller, so no heap is used until it outgrows it
+ * @param vec - the vector, which is overwritten
+ * @param buf - storage aligned as a size_t, which must outlive vec
+ * @param bytes - size of buf
+ * @return void
+ */
+#define cvector_init_buf(vec, buf, bytes)                       \
+	do {                                                    \
+		size_t *cv_b = (size_t *) (buf);                \
+		cv_b[0]      = 0;                               \
+		cv_b[1]      = ((bytes) - sizeof(size_t) * 2) / \
+		    sizeof(*(vec));                             \
+		cv_b[1] |= CVECTOR_BORROWED;                    \
+		(vec) = (void *) (&cv_b[2]);                    \
+	} while (0)
+
+/**
+ * @brief cvector_init_arena - starts an empty vector for count elements on
+ * memory of a nano_arena, which must outlive vec, nano_arena.h has to be
+ * included by the caller
+ * @param vec - the vector, which is overwritten
+ * @param arena - nano_arena
+ * @param count - elements it holds before moving to the heap
+ * @return void
+ */
+#define cvector_init_arena(vec, arena, count)                        \
+	do {                                                         \
+		const size_t cv_ab =                                 \
+		    (count) * sizeof(*(vec)) + sizeof(size_t) * 2;   \
+		cvector_init_buf(                                    \
+		    (vec), nano_arena_alloc((arena), cv_ab), cv_ab); \
+	} while (0)
 
 /**
  * @brief cvector_size - gets the current size of the vector
@@ -58,6 +124,13 @@
  */
 #define cvector_empty(vec) (cvector_size(vec) == 0)
 
+/**
+ * @brief cvector_clear - removes all elements, the storage is kept
+ * @param vec - the vector
+ * @return void
+ */
+#define cvector_clear(vec) cvector_set_size((vec), 0)
+
 /**
  * @brief cvector_grow - For internal use, ensures that the vector is at least
  * <count> elements big
@@ -65,23 +138,33 @@
  * @param count - the new capacity to set
  * @return void
  */
-#define cvector_grow(vec, count)                                     \
-	do {                                                         \
-		const size_t cv_sz =                                 \
-		    (count) * sizeof(*(vec)) + (sizeof(size_t) * 2); \
-		if (!(vec)) {                                        \
-			size_t *cv_p = malloc(cv_sz);                \
-			assert(cv_p);                                \
-			(vec) = (void *) (&cv_p[2]);                 \
-			cvector_set_capacity((vec), (count));        \
-			cvector_set_size((vec), 0);                  \
-		} else {                                             \
-			size_t *cv_p1 = &((size_t *) (vec))[-2];     \
-			size_t *cv_p2 = realloc(cv_p1, (cv_sz));     \
-			assert(cv_p2);                               \
-			(vec) = (void *) (&cv_p2[2]);                \
-			cvector_set_capacity((vec), (count));        \
-		}                                                    \
+#define cvector_grow(vec, count)                                             \
+	do {                                                                 \
+		/* a vector outgrowing borrowed storage at least doubles */  \
+		const int cv_bw = cvector_borrowed(vec);                     \
+		size_t    cv_n  = cv_bw ? cvector_capacity(vec) * 2 : 0;     \
+		cv_n            = cv_n > (count) ? cv_n : (count);           \
+		const size_t cv_sz =                                         \
+		    cv_n * sizeof(*(vec)) + (sizeof(size_t) * 2);            \
+		if (!(vec)) {                                                \
+			size_t *cv_p = malloc(cv_sz);                        \
+			assert(cv_p);                                        \
+			(vec) = (void *) (&cv_p[2]);                         \
+			cvector_set_capacity((vec), cv_n);                   \
+			cvector_set_size((vec), 0);                          \
+		} else {                                                     \
+			size_t *cv_p1 =                                      \
+			    cv_bw ? NULL : &((size_t *) (vec))[-2];          \
+			size_t *cv_p2 = realloc(cv_p1, (cv_sz));             \
+			assert(cv_p2);                                       \
+			if (cv_bw) {                                         \
+				memcpy(cv_p2, &((size_t *) (vec))[-2],       \
+				    sizeof(size_t) * 2 +                     \
+				        cvector_size(vec) * sizeof(*(vec))); \
+			}                                                    \
+			(vec) = (void *) (&cv_p2[2]);                        \
+			cvector_set_capacity((vec), cv_n);                   \
+		}                                                            \
 	} while (0)
 
 /**
@@ -122,7 +205,7 @@
  */
 #define cvector_free(vec)                                     \
 	do {                                                  \
-		if (vec) {                                    \
+		if (vec && !cvector_borrowed(vec)) {          \
 			size_t *p1 = &((size_t *) (vec))[-2]; \
 			free(p1);                             \
 		}                                             \
@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+
+#include "nano_log.h"
 // #define NOLOG
 
 static inline char *
@@ -35,21 +37,17 @@ nano_get_time()
 
 #define clean_errno() (errno == 0 ? "None" : strerror(errno))
 
-#define log_err(M, ...)                                                 \
-	fprintf(stderr, "[ERROR] (%s:%d: errno: %s) " M "\n", __FILE__, \
-	    __LINE__, clean_errno(), ##__VA_ARGS__)
+#define log_err(M, ...)                                            \
+	nano_log(NANO_LOG_ERROR, "(errno: %s) " M, clean_errno(), \
+	    ##__VA_ARGS__)
 
-#define log_warn(M, ...)                                                \
-	fprintf(stderr, "[WARN] (%s:%d) " M "\n", __FILE__,             \
-	    __LINE__, ##__VA_ARGS__)
+#define log_warn(M, ...) nano_log(NANO_LOG_WARN, M, ##__VA_ARGS__)
 // #define NOLOG
 #ifdef NOLOG
 #define log(M, ...)
 #define log_info(M, ...)
 #else
-#define log_info(M, ...)                                                  \
-	fprintf(stderr, "[INFO] %s (%lu:%s:%d) " M "\n", nano_get_time(), \
-	    pthread_self(), __FUNCTION__, __LINE__, ##__VA_ARGS__)
+#define log_info(M, ...) nano_log(NANO_LOG_INFO, M, ##__VA_ARGS__)
 #endif
 
 #define check(A, M, ...)                   \
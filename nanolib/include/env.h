@@ -8,19 +8,92 @@
 #define NANOMQ_NUM_TASKQ_THREAD "NANOMQ_MAX_TASKQ_THREAD"
 #define NANOMQ_MAX_TASKQ_THREAD "NANOMQ_MAX_TASKQ_THREAD"
 #define NANOMQ_PARALLEL "NANOMQ_PARALLEL"
+#define NANOMQ_PARALLEL_MAX "NANOMQ_PARALLEL_MAX"
+#define NANOMQ_FANOUT_THRESHOLD "NANOMQ_FANOUT_THRESHOLD"
+#define NANOMQ_FANOUT_WORKS "NANOMQ_FANOUT_WORKS"
 #define NANOMQ_PROPERTY_SIZE "NANOMQ_PROPERTY_SIZE"
 #define NANOMQ_MSQ_LEN "NANOMQ_MSQ_LEN"
 #define NANOMQ_QOS_DURATION "NANOMQ_QOS_DURATION"
+#define NANOMQ_MATCH_CACHE_SIZE "NANOMQ_MATCH_CACHE_SIZE"
+#define NANOMQ_SHARED_SUBSCRIPTION_STRATEGY \
+	"NANOMQ_SHARED_SUBSCRIPTION_STRATEGY"
+#define NANOMQ_SESSION_QUEUE_SIZE "NANOMQ_SESSION_QUEUE_SIZE"
+#define NANOMQ_SESSION_QUEUE_OVERFLOW "NANOMQ_SESSION_QUEUE_OVERFLOW"
+#define NANOMQ_SESSION_EXPIRY_INTERVAL "NANOMQ_SESSION_EXPIRY_INTERVAL"
+#define NANOMQ_SESSION_MSG_MAX_AGE "NANOMQ_SESSION_MSG_MAX_AGE"
+#define NANOMQ_SESSION_MEMORY_LIMIT "NANOMQ_SESSION_MEMORY_LIMIT"
+#define NANOMQ_SUB_QUEUE_SIZE "NANOMQ_SUB_QUEUE_SIZE"
+#define NANOMQ_SUB_QUEUE_OVERFLOW "NANOMQ_SUB_QUEUE_OVERFLOW"
+#define NANOMQ_SUB_QUEUE_CONFLATE "NANOMQ_SUB_QUEUE_CONFLATE"
+#define NANOMQ_TOPIC_ALIAS_MAX "NANOMQ_TOPIC_ALIAS_MAX"
+#define NANOMQ_TOPIC_ALIAS_OUT "NANOMQ_TOPIC_ALIAS_OUT"
 #define NANOMQ_ALLOW_ANONYMOUS "NANOMQ_ALLOW_ANONYMOUS"
 
 #define NANOMQ_WEBSOCKET_ENABLE "NANOMQ_WEBSOCKET_ENABLE"
 #define NANOMQ_WEBSOCKET_URL "NANOMQ_WEBSOCKET_URL"
 
+#define NANOMQ_TLS_ENABLE "NANOMQ_TLS_ENABLE"
+#define NANOMQ_TLS_URL "NANOMQ_TLS_URL"
+#define NANOMQ_TLS_CERTFILE "NANOMQ_TLS_CERTFILE"
+#define NANOMQ_TLS_KEYFILE "NANOMQ_TLS_KEYFILE"
+#define NANOMQ_TLS_KEY_PASSWORD "NANOMQ_TLS_KEY_PASSWORD"
+#define NANOMQ_TLS_CACERTFILE "NANOMQ_TLS_CACERTFILE"
+#define NANOMQ_TLS_VERIFY_PEER "NANOMQ_TLS_VERIFY_PEER"
+#define NANOMQ_TLS_FAIL_IF_NO_PEER_CERT "NANOMQ_TLS_FAIL_IF_NO_PEER_CERT"
+
 #define NANOMQ_HTTP_SERVER_ENABLE "NANOMQ_HTTP_SERVER_ENABLE"
 #define NANOMQ_HTTP_SERVER_PORT "NANOMQ_HTTP_SERVER_PORT"
 #define NANOMQ_HTTP_SERVER_USERNAME "NANOMQ_HTTP_SERVER_USERNAME"
 #define NANOMQ_HTTP_SERVER_PASSWORD "NANOMQ_HTTP_SERVER_PASSWORD"
 
+#define NANOMQ_PERSISTENCE_ENABLE "NANOMQ_PERSISTENCE_ENABLE"
+#define NANOMQ_PERSISTENCE_DIR "NANOMQ_PERSISTENCE_DIR"
+#define NANOMQ_PERSISTENCE_SEGMENT_SIZE "NANOMQ_PERSISTENCE_SEGMENT_SIZE"
+#define NANOMQ_PERSISTENCE_FSYNC_BATCH "NANOMQ_PERSISTENCE_FSYNC_BATCH"
+#define NANOMQ_PERSISTENCE_FSYNC_INTERVAL "NANOMQ_PERSISTENCE_FSYNC_INTERVAL"
+#define NANOMQ_PERSISTENCE_COMPACT_SIZE "NANOMQ_PERSISTENCE_COMPACT_SIZE"
+#define NANOMQ_SNAPSHOT_ENABLE "NANOMQ_SNAPSHOT_ENABLE"
+#define NANOMQ_SNAPSHOT_PATH "NANOMQ_SNAPSHOT_PATH"
+#define NANOMQ_SNAPSHOT_INTERVAL "NANOMQ_SNAPSHOT_INTERVAL"
+
+#define NANOMQ_SYS_EVENT_ENABLE "NANOMQ_SYS_EVENT_ENABLE"
+#define NANOMQ_SYS_EVENT_BATCH "NANOMQ_SYS_EVENT_BATCH"
+#define NANOMQ_SYS_EVENT_INTERVAL "NANOMQ_SYS_EVENT_INTERVAL"
+#define NANOMQ_SYS_EVENT_METRICS_INTERVAL "NANOMQ_SYS_EVENT_METRICS_INTERVAL"
+#define NANOMQ_SYS_EVENT_ROUTE_INTERVAL "NANOMQ_SYS_EVENT_ROUTE_INTERVAL"
+
+#define NANOMQ_SHM_ENABLE "NANOMQ_SHM_ENABLE"
+#define NANOMQ_SHM_DIR "NANOMQ_SHM_DIR"
+#define NANOMQ_SHM_RINGS "NANOMQ_SHM_RINGS"
+#define NANOMQ_SHM_RING_SIZE "NANOMQ_SHM_RING_SIZE"
+#define NANOMQ_SHM_BATCH "NANOMQ_SHM_BATCH"
+#define NANOMQ_SHM_INTERVAL "NANOMQ_SHM_INTERVAL"
+#define NANOMQ_CAPTURE_ENABLE "NANOMQ_CAPTURE_ENABLE"
+#define NANOMQ_CAPTURE_FILE "NANOMQ_CAPTURE_FILE"
+#define NANOMQ_CAPTURE_MAX_SIZE "NANOMQ_CAPTURE_MAX_SIZE"
+#define NANOMQ_MEM_HIGH_WATERMARK "NANOMQ_MEM_HIGH_WATERMARK"
+#define NANOMQ_MEM_LOW_WATERMARK "NANOMQ_MEM_LOW_WATERMARK"
+#define NANOMQ_MEM_REJECT_CONNECT "NANOMQ_MEM_REJECT_CONNECT"
+#define NANOMQ_MEM_REJECT_SUBSCRIBE "NANOMQ_MEM_REJECT_SUBSCRIBE"
+#define NANOMQ_MEM_SHED_QOS0 "NANOMQ_MEM_SHED_QOS0"
+#define NANOMQ_MEM_EVICT_RETAIN "NANOMQ_MEM_EVICT_RETAIN"
+
+#define NANOMQ_LOG_LEVEL "NANOMQ_LOG_LEVEL"
+#define NANOMQ_LOG_TO "NANOMQ_LOG_TO"
+#define NANOMQ_LOG_FILE "NANOMQ_LOG_FILE"
+
+#define NANOMQ_TRACE_SAMPLE "NANOMQ_TRACE_SAMPLE"
+#define NANOMQ_TRACE_SLOW_THRESHOLD "NANOMQ_TRACE_SLOW_THRESHOLD"
+
+#define NANOMQ_RETAIN_MEM_LIMIT "NANOMQ_RETAIN_MEM_LIMIT"
+#define NANOMQ_RETAIN_EVICTION "NANOMQ_RETAIN_EVICTION"
+#define NANOMQ_RETAIN_COMPRESS_THRESHOLD "NANOMQ_RETAIN_COMPRESS_THRESHOLD"
+
+#define NANOMQ_RATE_LIMIT_MSGS "NANOMQ_RATE_LIMIT_MSGS"
+#define NANOMQ_RATE_LIMIT_BYTES "NANOMQ_RATE_LIMIT_BYTES"
+#define NANOMQ_RATE_LIMIT_POLICY "NANOMQ_RATE_LIMIT_POLICY"
+#define NANOMQ_RATE_LIMIT_TOPICS "NANOMQ_RATE_LIMIT_TOPICS"
+
 #define NANOMQ_CONF_PATH "NANOMQ_CONF_PATH"
 #define NANOMQ_BRIDGE_CONF_PATH "NANOMQ_BRIDGE_CONF_PATH"
 #define NANOMQ_AUTH_CONF_PATH "NANOMQ_AUTH_CONF_PATH"
@@ -23,6 +23,11 @@ struct msg_queue {
 
 typedef struct msg_queue msg_queue;
 
+// Called under the lock of a stripe, must not use the same table.
+typedef void (*topic_scan_cb)(uint32_t pipe_id, const char *topic, void *arg);
+typedef void (*pipe_scan_cb)(
+    uint32_t pipe_id, const char *client_id, void *arg);
+
 void push_val(int key, char *val);
 
 char *get_val(int key);
@@ -47,12 +52,17 @@ void print_topic_all(uint32_t id);
 
 topic_queue **get_all_topic_queue(size_t *sz);
 
+uint64_t scan_topic(
+    uint64_t cursor, size_t limit, topic_scan_cb cb, void *arg);
+
 // @obj. _cached_topic_hash
 
 void cache_topic_all(uint32_t pid, uint32_t cid);
 
 void restore_topic_all(uint32_t cid, uint32_t pid);
 
+void add_cached_topic(uint32_t cid, char *val);
+
 struct topic_queue *get_cached_topic(uint32_t cid);
 
 void del_cached_topic_all(uint32_t key);
@@ -69,6 +79,9 @@ char *get_client_id(uint32_t pipe_id);
 
 bool check_pipe_id(uint32_t pipe_id);
 
+uint64_t scan_pipe_id(
+    uint64_t cursor, size_t limit, pipe_scan_cb cb, void *arg);
+
 // @obj. _msg_queue_hash
 
 void add_msg_queue(char *id, char *msg);
@@ -11,57 +11,163 @@ typedef struct {
 	uint32_t session_id;
 	uint32_t pipe_id;
 	void *   ctxt;
+	uint8_t  qos; // granted by SUBSCRIBE
 } dbtree_client;
 
-typedef struct {
-	uint8_t qos;
-	bool    exist;
-	char *  m;
-	void *  message;
-} dbtree_retain_msg;
-
 typedef struct {
 	uint32_t session_id;
 	void *   ctxt;
+	uint8_t  qos;
 } dbtree_session;
 
-typedef struct dbtree_node dbtree_node;
+/*
+ * A client or session bound to a topic, as dbtree_foreach_subscription
+ * reports it and dbtree_insert_sessions takes it. topic is
+ * $share/<group>/<filter> for a shared subscription.
+ */
+typedef struct {
+	const char *topic;
+	uint32_t    session_id; // 0 for a client online
+	uint32_t    pipe_id;    // 0 for a session offline
+	void *      ctxt;
+	uint8_t     qos;
+} dbtree_subscription;
+
+typedef struct dbtree_node        dbtree_node;
+typedef struct dbtree_child_index dbtree_child_index;
+typedef struct dbtree_wild_entry  dbtree_wild_entry;
+typedef struct dbtree_wild_index  dbtree_wild_index;
+
+/*
+ * The vectors of a node are never modified in place once they are
+ * reachable from root, writers build a new copy and swap the pointer,
+ * so that matching can walk the tree without any lock. plus and well
+ * are only used by writers, readers find wildcard children in the first
+ * two slots of child. Once a node has many children the non wildcard ones
+ * move to child_index, a hash table, and child keeps "+" and "#" only.
+ * A subscription of $share/<group>/<filter> lives on the node of
+ * <filter>, shared keeps one node per group sorted by group name, it holds
+ * the members in clients and the dispatch counter in rr. The node a
+ * subscription with wildcards ends on has its entry of db->wild in wild.
+ *
+ * The first 32 bytes are what a match reads on every level it passes,
+ * the rest is read on the nodes it ends on. A level shorter than
+ * DBTREE_NODE_INLINE is kept in name, topic points to it or to the heap.
+ */
+#define DBTREE_NODE_INLINE 28
 
 struct dbtree_node {
-	char *             topic;
-	int                plus;
-	int                well;
-	dbtree_retain_msg *retain;
-	cvector(dbtree_client *) clients;
+	char *              topic;
+	uint32_t            hash; // level_hash of topic
+	uint16_t            len;  // of topic
+	int8_t              plus;
+	int8_t              well;
 	cvector(dbtree_node *) child;
+	dbtree_child_index *child_index;
+	cvector(dbtree_client *) clients;
+	cvector(dbtree_node *) shared;
 	cvector(dbtree_session *) session_vector;
-	pthread_rwlock_t rwlock;
+	dbtree_wild_entry *wild;
+	uint32_t           rr;
+	char               name[DBTREE_NODE_INLINE];
 };
 
-typedef struct {
-	uint32_t session_id;
-	cvector(void *) msg_list;
-} dbtree_session_msg;
+typedef struct dbtree_match_cache   dbtree_match_cache;
+typedef struct dbtree_session_store dbtree_session_store;
+typedef struct dbtree_snapshot      dbtree_snapshot;
 
+/* Default max messages queued for an offline session. */
+#define DBTREE_SESSION_QUEUE_SIZE 1024
+
+/*
+ * What happens to a message for an offline session whose queue is full.
+ * DROP_OLDEST makes room by freeing the oldest message, DROP_NEWEST and
+ * REJECT both leave the queue as it is, REJECT is counted apart and
+ * logged since it means the session can not keep up at all.
+ */
+typedef enum {
+	SESSION_DROP_OLDEST,
+	SESSION_DROP_NEWEST,
+	SESSION_REJECT,
+} dbtree_session_overflow;
+
+/*
+ * How one member of $share/<group>/<filter> is picked for a message.
+ * LEAST_INFLIGHT asks shared_load of dbtree for the load of each member
+ * and falls back to ROUND_ROBIN without it.
+ */
+typedef enum {
+	SHARED_ROUND_ROBIN,
+	SHARED_RANDOM,
+	SHARED_STICKY,
+	SHARED_LEAST_INFLIGHT,
+} dbtree_shared_strategy;
+
+/*
+ * rwlock serializes writers (insert, delete, cache and restore session),
+ * readers only enter an epoch and never block on it. Nodes, clients and
+ * vectors unlinked by a writer are freed once every reader that entered
+ * before has left. gen is bumped by writers before and after changing
+ * clients or sessions, it invalidates the match caches and tells the
+ * snapshot kept in snapshot is still the state of the tree.
+ */
 typedef struct {
-	dbtree_node *root;
-	cvector(dbtree_session_msg *) session_msg_list;
-	pthread_rwlock_t rwlock;
-	pthread_rwlock_t rwlock_session;
+	dbtree_node *         root;
+	dbtree_session_store *session_store;
+	pthread_rwlock_t      rwlock;
+	uint64_t              gen;
+	dbtree_match_cache *  cache;
+	dbtree_wild_index *   wild;
+	dbtree_snapshot *     snapshot;
+	pthread_mutex_t       snapshot_mtx;
+
+	dbtree_shared_strategy shared_strategy;
+	uint32_t (*shared_load)(uint32_t pipe_id);
 } dbtree;
 
+typedef struct {
+	uint64_t hit;
+	uint64_t miss;
+	size_t   size;
+	size_t   capacity;
+} dbtree_match_cache_stats;
+
+typedef struct {
+	size_t   sessions;
+	uint64_t dropped;
+	uint64_t rejected;
+	uint64_t expired; // dropped by the reaper for their age
+	size_t   memory;  // bytes queued, as msg_size of the reap hooks counts
+} dbtree_session_queue_stats;
+
+/**
+ * @brief topic_level - One level of a topic, len bytes from s, it points
+ * into the original topic and is not NUL terminated. hash is only set on
+ * levels of a split topic, it is what hash lookups of children use.
+ */
+typedef struct {
+	const char *s;
+	size_t      len;
+	uint32_t    hash;
+} topic_level;
+
 /**
  * @brief node_cmp - A callback to compare different node
  * @param x - normally x is dbtree_node
- * @param y - y is topic we want to compare
- * @return 0, minus or plus, based on strcmp
+ * @param y - y is pointer of topic_level we want to compare
+ * @return 0, minus or plus, same order as strcmp
  */
 static inline int
 node_cmp(void *x_, void *y_)
 {
-	char *       y     = (char *) y_;
+	topic_level *y     = (topic_level *) y_;
 	dbtree_node *ele_x = (dbtree_node *) x_;
-	return strcmp(ele_x->topic, y);
+	size_t       len   = ele_x->len < y->len ? ele_x->len : y->len;
+	int          rv    = memcmp(ele_x->topic, y->s, len);
+	if (rv != 0) {
+		return rv;
+	}
+	return (int) ele_x->len - (int) y->len;
 }
 
 /**
@@ -93,14 +199,6 @@ ids_cmp(void *x_, void *y_)
 	return *pipe_id - *id;
 }
 
-static inline int
-session_msg_cmp(void *x_, void *y_)
-{
-	uint32_t *          y     = (uint32_t *) y_;
-	dbtree_session_msg *ele_x = (dbtree_session_msg *) x_;
-	return *y - ele_x->session_id;
-}
-
 static inline int
 session_cmp(void *x_, void *y_)
 {
@@ -123,6 +221,119 @@ void dbtree_create(dbtree **db);
  */
 void dbtree_destory(dbtree *db);
 
+/**
+ * @brief dbtree_match_cache_init - Enable the match cache of publish
+ * topics, it keeps at most capacity topics. Call it before the dbtree
+ * is shared with other threads.
+ * @param db - dbtree
+ * @param capacity - max entries of cache, 0 keeps it disabled
+ * @return void
+ */
+void dbtree_match_cache_init(dbtree *db, size_t capacity);
+
+/**
+ * @brief dbtree_get_match_cache_stats - Get counters of the match cache,
+ * all zero if it is disabled.
+ * @param db - dbtree
+ * @param stats - dbtree_match_cache_stats
+ * @return void
+ */
+void dbtree_get_match_cache_stats(dbtree *db, dbtree_match_cache_stats *stats);
+
+/**
+ * @brief dbtree_set_session_queue - Set the bound of offline session
+ * queues, call it before the dbtree is shared with other threads.
+ * @param db - dbtree
+ * @param cap - max messages of a session, 0 means unbounded
+ * @param overflow - dbtree_session_overflow
+ * @param free_msg - release a message dropped from a queue, may be NULL
+ * @return void
+ */
+void dbtree_set_session_queue(dbtree *db, size_t cap,
+    dbtree_session_overflow overflow, void (*free_msg)(void *msg));
+
+/*
+ * Hooks of a persistence engine on offline session queues, put is called
+ * for each message queued and take when a session takes its queue back.
+ * Both run under the lock of the session, they must not call back into
+ * the dbtree.
+ */
+typedef struct {
+	void (*put)(uint32_t session_id, void *msg, void *arg);
+	void (*take)(uint32_t session_id, void *arg);
+	void *arg;
+} dbtree_session_persist;
+
+/**
+ * @brief dbtree_set_session_persist - Set or clear (NULL) the
+ * persistence hooks of offline session queues.
+ * @param db - dbtree
+ * @param persist - dbtree_session_persist
+ * @return void
+ */
+void dbtree_set_session_persist(
+    dbtree *db, const dbtree_session_persist *persist);
+
+/*
+ * Limits the reaper enforces on offline session queues. A message older
+ * than max_age is expired, while the queued bytes are above mem_limit
+ * the oldest message of each queue is dropped. 0 disables a limit,
+ * msg_size and msg_time tell the size and the time a message arrived,
+ * in the clock passed to dbtree_reap_session_msg. msg_expire, if set,
+ * is asked once as a message is queued for the time it expires on its
+ * own, 0 never, it runs under the lock of the session.
+ */
+typedef struct {
+	size_t   mem_limit;
+	uint64_t max_age;
+	size_t (*msg_size)(void *msg);
+	uint64_t (*msg_time)(void *msg);
+	uint64_t (*msg_expire)(void *msg);
+} dbtree_session_reap;
+
+/**
+ * @brief dbtree_set_session_reap - Set the limits of offline session
+ * queues, before the dbtree is shared.
+ * @param db - dbtree
+ * @param reap - dbtree_session_reap
+ * @return void
+ */
+void dbtree_set_session_reap(dbtree *db, const dbtree_session_reap *reap);
+
+/**
+ * @brief dbtree_reap_session_msg - Enforce the limits of
+ * dbtree_set_session_reap on the next shards of the session store, each
+ * one is locked only while it is scanned, so a pass can be spread over
+ * many calls. A queue left empty is removed.
+ * @param db - dbtree
+ * @param now - current time
+ * @param shards - count of shards to scan
+ * @return count of messages dropped
+ */
+size_t dbtree_reap_session_msg(dbtree *db, uint64_t now, size_t shards);
+
+/**
+ * @brief dbtree_foreach_session_msg - Call cb for every queued message of
+ * offline sessions, oldest first per session. A session is locked while
+ * its messages are visited. Stops once cb returns non zero.
+ * @param db - dbtree
+ * @param cb - callback
+ * @param arg - argument of cb
+ * @return the last return of cb
+ */
+int dbtree_foreach_session_msg(dbtree *db,
+    int (*cb)(uint32_t session_id, void *msg, void *arg), void *arg);
+
+/**
+ * @brief dbtree_get_session_queue_stats - Get counters of offline
+ * session queues.
+ * @param db - dbtree
+ * @param stats - dbtree_session_queue_stats
+ * @return void
+ */
+void dbtree_get_session_queue_stats(
+    dbtree *db, dbtree_session_queue_stats *stats);
+
 /**
  * @brief dbtree_print - Print dbtree for debug.
  * @param dbtree - dbtree
@@ -140,10 +351,97 @@ void dbtree_print(dbtree *db);
  * @param topic - topic
  * @param ctxt - data related with pipe_id
  * @param pipe_id - pipe id
+ * @param qos - granted qos, replaced if the pipe is already on topic
  * @return
  */
 void *dbtree_insert_client(
-    dbtree *db, char *topic, void *ctxt, uint32_t pipe_id);
+    dbtree *db, char *topic, void *ctxt, uint32_t pipe_id, uint8_t qos);
+
+/**
+ * @brief dbtree_insert_clients - Insert the client on many topics at
+ * once. Topics are sorted so that the walks of neighbours share their
+ * common prefix, and the tree is locked once for the whole batch.
+ * @param dbtree - dbtree
+ * @param topics - topics
+ * @param qos - granted qos of each topic, may be NULL for all 0
+ * @param n - count of topics
+ * @param ctxt - data related with pipe_id
+ * @param pipe_id - pipe id
+ * @param rets - may be NULL, set to 1 for each topic the pipe was already
+ * on, else 0
+ * @return void
+ */
+void dbtree_insert_clients(dbtree *db, char **topics, const uint8_t *qos,
+    size_t n, void *ctxt, uint32_t pipe_id, int *rets);
+
+/**
+ * @brief dbtree_insert_sessions - Put offline sessions on many topics at
+ * once, as a restart loads them back. Topics are sorted so that the walks
+ * of neighbours share their common prefix, and the tree is locked once
+ * for the whole batch. A session already on a topic is kept.
+ * @param dbtree - dbtree
+ * @param subs - dbtree_subscription, pipe_id is not used
+ * @param n - count of subs
+ * @return void
+ */
+void dbtree_insert_sessions(
+    dbtree *db, const dbtree_subscription *subs, size_t n);
+
+/**
+ * @brief dbtree_foreach_subscription - Call cb for every client and
+ * session on the tree, with the tree locked against writers. cb must not
+ * call back into the tree.
+ * @param dbtree - dbtree
+ * @param cb - stops the walk and is returned if not 0
+ * @param arg - passed to cb
+ * @return 0 or what cb returned
+ */
+int dbtree_foreach_subscription(dbtree *db,
+    int (*cb)(const dbtree_subscription *sub, void *arg), void *arg);
+
+/**
+ * @brief dbtree_snapshot_take - Get a read only copy of the clients and
+ * sessions on the tree at one point in time, as
+ * dbtree_foreach_subscription reports them but with ctxt NULL. It is
+ * copied without blocking writers if it can, and shared with other
+ * takers until the tree changes, so an admin reader can go over it at
+ * its own pace.
+ * @param dbtree - dbtree
+ * @return dbtree_snapshot, release it with dbtree_snapshot_release
+ */
+dbtree_snapshot *dbtree_snapshot_take(dbtree *db);
+
+/**
+ * @brief dbtree_snapshot_release - Drop a snapshot taken.
+ * @param snap - dbtree_snapshot, may be NULL
+ * @return void
+ */
+void dbtree_snapshot_release(dbtree_snapshot *snap);
+
+/**
+ * @brief dbtree_snapshot_count - Count of subscriptions in a snapshot.
+ * @param snap - dbtree_snapshot
+ * @return count
+ */
+size_t dbtree_snapshot_count(const dbtree_snapshot *snap);
+
+/**
+ * @brief dbtree_snapshot_get - Get a subscription of a snapshot, they are
+ * in the order of a walk of the tree, the ones on a topic in a row.
+ * @param snap - dbtree_snapshot
+ * @param i - index, below dbtree_snapshot_count
+ * @return dbtree_subscription, valid until the snapshot is released, or
+ * NULL
+ */
+const dbtree_subscription *dbtree_snapshot_get(
+    const dbtree_snapshot *snap, size_t i);
+
+/**
+ * @brief dbtree_snapshot_gen - Generation of the tree a snapshot is of.
+ * @param snap - dbtree_snapshot
+ * @return generation, two snapshots of the same one hold the same
+ */
+uint64_t dbtree_snapshot_gen(const dbtree_snapshot *snap);
 
 /**
  * @brief dbtree_restore_session - This function
@@ -176,6 +474,36 @@ void *dbtree_restore_session(
 void *dbtree_cache_session(
     dbtree *db, char *topic, uint32_t session_id, uint32_t pipe_id);
 
+/**
+ * @brief dbtree_cache_sessions - Cache the session of the client on many
+ * topics at once, as dbtree_cache_session does for each, with the tree
+ * locked once for the whole batch.
+ * @param dbtree - dbtree
+ * @param topics - topics
+ * @param n - count of topics
+ * @param session_id - client id hash value
+ * @param pipe_id - pipe id
+ * @return void
+ */
+void dbtree_cache_sessions(dbtree *db, char **topics, size_t n,
+    uint32_t session_id, uint32_t pipe_id);
+
+/**
+ * @brief dbtree_restore_sessions - Restore the session on many topics at
+ * once, as dbtree_restore_session does for each, with the tree locked
+ * once for the whole batch, then take the messages queued for it.
+ * @param dbtree - dbtree
+ * @param topics - topics
+ * @param n - count of topics
+ * @param session_id - client id hash value
+ * @param pipe_id - pipe id
+ * @param msgs - may be NULL, set to the cvector of queued messages as
+ * dbtree_restore_session_msg returns
+ * @return ctxt of the session or NULL
+ */
+void *dbtree_restore_sessions(dbtree *db, char **topics, size_t n,
+    uint32_t session_id, uint32_t pipe_id, void ***msgs);
+
 /**
  * @brief dbtree_delete_session - This function will
  * be called when connection is established and
@@ -191,6 +519,22 @@ void *dbtree_cache_session(
 void *dbtree_delete_session(
     dbtree *db, char *topic, uint32_t session_id, uint32_t pipe_id);
 
+/**
+ * @brief dbtree_delete_sessions - Delete the session on many topics at
+ * once, as dbtree_delete_session does for each, with the tree locked
+ * once for the whole batch. Its queued messages are left to
+ * dbtree_restore_session_msg.
+ * @param dbtree - dbtree
+ * @param topics - topics
+ * @param n - count of topics
+ * @param session_id - client id hash value
+ * @param ctxts - may be NULL, set to the ctxt of the session on each
+ * topic, NULL for a topic it is not on
+ * @return void
+ */
+void dbtree_delete_sessions(dbtree *db, char **topics, size_t n,
+    uint32_t session_id, void **ctxts);
+
 /**
  * @brief dbtree_delete_client - This function will
  * be called when disconnection and cleansession = 1.
@@ -205,6 +549,22 @@ void *dbtree_delete_session(
 void *dbtree_delete_client(
     dbtree *db, char *topic, uint32_t session_id, uint32_t pipe_id);
 
+/**
+ * @brief dbtree_delete_clients - Delete the client from many topics at
+ * once, as dbtree_delete_client does for each. Topics are sorted so that
+ * the walks of neighbours share their common prefix, and the tree is
+ * locked once for the whole batch.
+ * @param dbtree - dbtree
+ * @param topics - topics
+ * @param n - count of topics
+ * @param pipe_id - pipe id
+ * @param ctxts - may be NULL, set to the ctxt deleted from each topic or
+ * NULL
+ * @return void
+ */
+void dbtree_delete_clients(
+    dbtree *db, char **topics, size_t n, uint32_t pipe_id, void **ctxts);
+
 /**
  * @brief dbtree_cache_session_msg - This function will
  * be called when cleansession = 0 and qos 1,2 message 
@@ -228,47 +588,42 @@ int dbtree_cache_session_msg(dbtree *db, void *msg, uint32_t session_id);
 void **dbtree_find_clients_and_cache_msg(dbtree *db, char *topic, void *msg, size_t *msg_cnt);
 
 /**
- * @brief dbtree_restore_session_msg - Get all be 
- * cached session message.
- * message for offline.
+ * @brief dbtree_find_all_clients_and_cache_msg - Get all subscribers
+ * online to this topic, followed by the picked member of each matched
+ * shared group, with one walk of the tree. Session message is cached
+ * for both kinds of offline subscribers.
  * @param dbtree - dbtree
  * @param topic - topic
+ * @param msg_cnt - message used count
+ * @param key - hash of publisher client id, used by SHARED_STICKY
+ * @param qos - if not NULL, set to a vector of the granted qos of each
+ * returned client, the highest one of a client on many matched filters
  * @return dbtree_client
  */
-void **dbtree_restore_session_msg(dbtree *db, uint32_t session_id);
+void **dbtree_find_all_clients_and_cache_msg(dbtree *db, char *topic,
+    void *msg, size_t *msg_cnt, uint32_t key, uint8_t **qos);
 
 /**
- * @brief dbtree_insert_retain - Insert retain message to this topic.
- * @param db - dbtree
- * @param topic - topic
- * @param ret_msg - dbtree_retain_msg
- * @return
- */
-void *dbtree_insert_retain(
-    dbtree *db, char *topic, dbtree_retain_msg *ret_msg);
-
-/**
- * @brief dbtree_delete_retain - Delete all retain message to this topic.
- * @param db - dbtree
+ * @brief dbtree_find_online_clients - Get the subscribers online to this
+ * topic and the picked member of each matched shared group, for a message
+ * which is not kept for offline sessions. Sessions are not visited, nor
+ * their store locked, and the granted qos is not gathered.
+ * @param dbtree - dbtree
  * @param topic - topic
- * @return ctxt or NULL, if client can be delete or not
+ * @param key - hash of publisher client id, used by SHARED_STICKY
+ * @return ctxts of clients
  */
-void *dbtree_delete_retain(dbtree *db, char *topic);
+void **dbtree_find_online_clients(dbtree *db, char *topic, uint32_t key);
 
 /**
- * @brief dbtree_find_retain - Get all retain message to this topic.
- * @param db - dbtree
+ * @brief dbtree_restore_session_msg - Get all be 
+ * cached session message.
+ * message for offline.
+ * @param dbtree - dbtree
  * @param topic - topic
- * @return dbtree_retain_msg pointer vector
+ * @return dbtree_client
  */
-dbtree_retain_msg **dbtree_find_retain(dbtree *db, char *topic);
-
-/* A hash table, clientId or alias as key, topic as value */
-char *hash_check_alias(int alias);
-
-void hash_add_alias(int alias, char *topic_data);
-
-void hash_del_alias(int alias);
+void **dbtree_restore_session_msg(dbtree *db, uint32_t session_id);
 
 /**
  * @brief dbtree_find_shared_sub_clients - This function
@@ -276,9 +631,23 @@ void hash_del_alias(int alias);
  * @param dbtree - dbtree
  * @param topic - topic
  * @param msg_cnt - message used count
+ * @param key - hash of publisher client id, used by SHARED_STICKY
  * @return dbtree_client
  */
-void **dbtree_find_shared_sub_clients(dbtree *db, char *topic, void *msg, size_t *msg_cnt);
+void **dbtree_find_shared_sub_clients(
+    dbtree *db, char *topic, void *msg, size_t *msg_cnt, uint32_t key);
+
+/**
+ * @brief dbtree_set_shared_strategy - Set how shared subscription
+ * members are picked, call it before the dbtree is shared with other
+ * threads.
+ * @param db - dbtree
+ * @param strategy - dbtree_shared_strategy
+ * @param load - load of a pipe for SHARED_LEAST_INFLIGHT, may be NULL
+ * @return void
+ */
+void dbtree_set_shared_strategy(dbtree *db, dbtree_shared_strategy strategy,
+    uint32_t (*load)(uint32_t pipe_id));
 
 
 /**
@@ -312,5 +681,32 @@ void *dbtree_insert_shared_sub_client(
 void *dbtree_delete_shared_sub_client(
     dbtree *db, char *topic, uint32_t session_id, uint32_t pipe_id);
 
+typedef struct dbtree_filter_set dbtree_filter_set;
+
+/**
+ * @brief dbtree_filter_set_new - Compile topic filters to a set matched
+ * by dbtree_filter_set_match.
+ * @param filters - topic filters
+ * @param n - number of filters
+ * @return dbtree_filter_set
+ */
+dbtree_filter_set *dbtree_filter_set_new(char **filters, size_t n);
+
+/**
+ * @brief dbtree_filter_set_free - Free a set.
+ * @param set - dbtree_filter_set
+ * @return void
+ */
+void dbtree_filter_set_free(dbtree_filter_set *set);
+
+/**
+ * @brief dbtree_filter_set_match - Check if topic matches any filter of
+ * set in one pass, with no lock and no allocation.
+ * @param set - dbtree_filter_set, NULL matches nothing
+ * @param topic - topic
+ * @return true if it matches
+ */
+bool dbtree_filter_set_match(dbtree_filter_set *set, const char *topic);
+
 
 #endif
@@ -0,0 +1,41 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_ALIAS_H
+#define NANO_ALIAS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// nano_alias holds the MQTT 5 topic aliases of one connection. Inbound
+// aliases, chosen by the client, are an array indexed by alias. Outbound
+// ones, chosen by the broker, are a small open addressing table of topic
+// to alias, handed out in order until out_max and never reassigned.
+// Locking must be supplied by the caller.
+typedef struct nano_alias_out nano_alias_out;
+
+typedef struct nano_alias {
+	uint16_t        in_max;
+	char **         in; // [in_max + 1], topic of each alias
+	uint16_t        out_max;
+	uint16_t        out_next; // last alias handed out
+	uint32_t        out_mask;
+	nano_alias_out *out;
+} nano_alias;
+
+extern int         nano_alias_init(
+            nano_alias *alias, uint16_t in_max, uint16_t out_max);
+extern void        nano_alias_fini(nano_alias *alias);
+extern int         nano_alias_set(
+            nano_alias *alias, uint16_t id, const char *topic, size_t len);
+extern const char *nano_alias_get(nano_alias *alias, uint16_t id);
+extern uint16_t    nano_alias_out_get(
+       nano_alias *alias, const char *topic, size_t len, bool *fresh);
+
+#endif
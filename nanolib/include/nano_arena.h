@@ -0,0 +1,42 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_ARENA_H
+#define NANO_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// nano_arena is a bump pointer allocator for memory which dies together,
+// like the decoded structures of one message. Nothing is freed on its
+// own, nano_arena_reset drops all of it at once. An allocation which does
+// not fit takes the slow path of a separate block, the arena grows to the
+// high water mark on the next reset so the slow path stays rare. Locking
+// must be done by the caller. For performance reasons, this is allocated
+// inline.
+typedef struct nano_arena_block nano_arena_block;
+
+typedef struct nano_arena {
+	uint8_t *         buf;
+	size_t            size;
+	size_t            used;
+	size_t            high; // bytes asked for since the last reset
+	nano_arena_block *blocks; // slow path allocations
+} nano_arena;
+
+#define NANO_ARENA_ALIGN 8
+#define NANO_ARENA_MAX (64 * 1024) // never grows past this
+
+extern void  nano_arena_init(nano_arena *arena, size_t size);
+extern void  nano_arena_fini(nano_arena *arena);
+extern void *nano_arena_alloc(nano_arena *arena, size_t sz);
+extern void *nano_arena_zalloc(nano_arena *arena, size_t sz);
+extern char *nano_arena_strndup(nano_arena *arena, const char *s, size_t n);
+extern void  nano_arena_reset(nano_arena *arena);
+
+#endif
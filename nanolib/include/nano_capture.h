@@ -0,0 +1,75 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_CAPTURE_H
+#define NANO_CAPTURE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// nano_capture is a file of the packets a broker received, for a replay
+// to feed them to the broker core again. The file is a header of 8
+// bytes, "NMQC", the version and 3 reserved bytes, then records: the
+// microseconds since the last record, the pipe, the lengths of the
+// fixed header and of the rest of the packet as varints, the kind and
+// the protocol of the pipe in a byte each, the fixed header and the
+// rest. The kind is the one the transport tells, not always the type in
+// the fixed header.
+//
+// Records are written by many threads, each one whole, and reach the
+// file at the latest a second after the one before them.
+#define NANO_CAPTURE_VERSION 1
+#define NANO_CAPTURE_HEADER 8
+#define NANO_CAPTURE_FLUSH_US 1000000
+#define NANO_CAPTURE_MAX (16 * 1024 * 1024) // bytes of a packet at most
+
+typedef struct {
+	uint64_t       time_us; // since the first record
+	uint32_t       pipe;
+	uint8_t        kind;
+	uint8_t        proto;
+	const uint8_t *header;
+	uint32_t       header_len;
+	const uint8_t *body;
+	uint32_t       body_len;
+} nano_capture_record;
+
+typedef struct {
+	pthread_mutex_t mtx;
+	FILE *          fp;
+	uint64_t        max;   // bytes of the file at most, 0 unbounded
+	uint64_t        bytes; // written
+	uint64_t        first_us;
+	uint64_t        last_us;
+	uint64_t        flush_us;
+	uint64_t        records;
+	uint64_t        dropped; // records past max
+} nano_capture;
+
+typedef struct {
+	FILE *   fp;
+	uint8_t *buf;
+	size_t   cap;
+	uint64_t time_us;
+} nano_capture_reader;
+
+extern int  nano_capture_open(nano_capture *c, const char *path, uint64_t max);
+extern int  nano_capture_write(nano_capture *c, uint64_t now_us,
+    uint32_t pipe, uint8_t kind, uint8_t proto, const uint8_t *header,
+    size_t header_len, const uint8_t *body, size_t body_len);
+extern void nano_capture_close(nano_capture *c);
+
+extern int  nano_capture_reader_open(nano_capture_reader *r, const char *path);
+extern bool nano_capture_next(
+    nano_capture_reader *r, nano_capture_record *rec);
+extern void nano_capture_reader_close(nano_capture_reader *r);
+
+#endif // NANO_CAPTURE_H
@@ -0,0 +1,64 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_ENVELOPE_H
+#define NANO_ENVELOPE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// nano_envelope packs many publishes into the payload of one, for a
+// bridge to send over a costly link. The wire form is a header of 12
+// bytes, "NB", the version, the flags, the count of records and the
+// bytes of the records all big endian 32 bits, then the records, as
+// nano_lz made them if the flags have NANO_ENVELOPE_LZ. A record is its
+// flags, the length of its topic in 16 bits and of its payload in 32
+// bits, the topic and the payload.
+//
+// The flags of a record are NANO_ENVELOPE_RETAIN and the qos shifted by
+// 1, like in the fixed header of a PUBLISH.
+#define NANO_ENVELOPE_VERSION 1
+#define NANO_ENVELOPE_HEADER 12
+#define NANO_ENVELOPE_LZ 0x01
+#define NANO_ENVELOPE_RETAIN 0x01
+#define NANO_ENVELOPE_MAX (16 * 1024 * 1024) // records unpacked at most
+
+typedef struct {
+	uint8_t *buf; // records
+	size_t   len;
+	size_t   cap;
+	uint32_t count;
+	uint8_t  qos; // highest of the records
+} nano_envelope;
+
+typedef struct {
+	uint8_t *      buf; // records, unpacked
+	const uint8_t *pos;
+	const uint8_t *end;
+	uint32_t       left;
+} nano_envelope_reader;
+
+extern void     nano_envelope_init(nano_envelope *e);
+extern void     nano_envelope_fini(nano_envelope *e);
+extern void     nano_envelope_reset(nano_envelope *e);
+extern int      nano_envelope_add(nano_envelope *e, const char *topic,
+    size_t topic_len, const uint8_t *payload, size_t payload_len,
+    uint8_t flags);
+extern uint8_t *nano_envelope_pack(
+    nano_envelope *e, bool compress, size_t *len);
+
+extern bool nano_envelope_is(const uint8_t *in, size_t len);
+extern int  nano_envelope_open(
+    nano_envelope_reader *r, const uint8_t *in, size_t len);
+extern bool nano_envelope_next(nano_envelope_reader *r, const char **topic,
+    uint16_t *topic_len, const uint8_t **payload, uint32_t *payload_len,
+    uint8_t *flags);
+extern void nano_envelope_close(nano_envelope_reader *r);
+
+#endif // NANO_ENVELOPE_H
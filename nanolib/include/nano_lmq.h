@@ -40,6 +40,8 @@ extern size_t nano_lmq_len(nano_lmq *);
 extern size_t nano_lmq_cap(nano_lmq *);
 extern int    nano_lmq_putq(nano_lmq *, void *);
 extern int    nano_lmq_getq(nano_lmq *, void **);
+extern int    nano_lmq_peek(nano_lmq *, void **);
+extern void **nano_lmq_slot(nano_lmq *, size_t);
 extern int    nano_lmq_resize(nano_lmq *, size_t);
 extern int    nano_lmq_resize_with_cb(nano_lmq *lmq, size_t cap,
        nano_lmq_free free_cb, nano_lmq_get_sub_msg get_sub_msg);
@@ -0,0 +1,95 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_LOG_H
+#define NANO_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// nano_log formats a line on the calling thread into a ring owned by that
+// thread and returns, a writer thread drains the rings of all threads to
+// the console, a file and syslog. A ring is only written by its thread
+// and only read by the writer, neither of them takes a lock. A line is
+// dropped and counted if the ring of its thread is full, logging never
+// blocks the caller. Lines of different threads are written ring after
+// ring, only the lines of one thread are in order.
+//
+// Until nano_log_open and after nano_log_close a line is written to
+// stderr by the caller. The level is checked before the arguments are
+// evaluated, a disabled line costs one relaxed load. log_trace is for
+// the per message paths and compiles to nothing unless DEBUG.
+enum {
+	NANO_LOG_TRACE = 0,
+	NANO_LOG_DEBUG,
+	NANO_LOG_INFO,
+	NANO_LOG_WARN,
+	NANO_LOG_ERROR,
+	NANO_LOG_OFF,
+};
+
+enum {
+	NANO_LOG_TO_CONSOLE = 1 << 0,
+	NANO_LOG_TO_FILE    = 1 << 1,
+	NANO_LOG_TO_SYSLOG  = 1 << 2,
+};
+
+typedef struct {
+	int         level;
+	int         to;             // NANO_LOG_TO_* flags
+	const char *file;           // appended to if NANO_LOG_TO_FILE
+	uint32_t    flush_interval; // ms between two drains, 0 is default
+} nano_log_opt;
+
+typedef struct {
+	uint64_t written; // lines written by the writer
+	uint64_t dropped; // lines dropped on a full ring
+} nano_log_stats;
+
+extern int nano_log_cur_level;
+
+extern int  nano_log_open(const nano_log_opt *opt);
+extern void nano_log_close(void);
+extern void nano_log_set_level(int level);
+extern int  nano_log_get_level(void);
+extern int  nano_log_level(const char *name);
+extern const char *nano_log_level_str(int level);
+extern int         nano_log_to(const char *names);
+extern void        nano_log_get_stats(nano_log_stats *stats);
+extern void        nano_log_write(int level, const char *func, int line,
+           const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+#define nano_log_enabled(lvl) \
+	((lvl) >= __atomic_load_n(&nano_log_cur_level, __ATOMIC_RELAXED))
+
+#define nano_log(lvl, fmt, ...)                                   \
+	do {                                                      \
+		if (nano_log_enabled(lvl)) {                      \
+			nano_log_write((lvl), __FUNCTION__,       \
+			    __LINE__, fmt, ##__VA_ARGS__);        \
+		}                                                 \
+	} while (0)
+
+#if defined(DEBUG) && !defined(NOLOG)
+#define log_trace(fmt, ...) nano_log(NANO_LOG_TRACE, fmt, ##__VA_ARGS__)
+#else
+#define log_trace(fmt, ...) \
+	do {                \
+	} while (0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // NANO_LOG_H
@@ -0,0 +1,29 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_LZ_H
+#define NANO_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// nano_lz is a byte oriented LZ77 codec in the format of LZF, fast enough
+// for the message path and with no state kept between calls. A control
+// byte below 32 starts a run of that many plus one literals, any other
+// has the length of a back reference minus 2 in its top 3 bits, 7 takes
+// an extra length byte, and the high 5 bits of its offset minus 1, the
+// low 8 bits follow. References reach back 8KB at most.
+//
+// Both functions return the bytes written to out, or 0 if out is too
+// small or, on decompression, in is broken.
+extern size_t nano_lz_compress(
+    const uint8_t *in, size_t len, uint8_t *out, size_t out_len);
+extern size_t nano_lz_decompress(
+    const uint8_t *in, size_t len, uint8_t *out, size_t out_len);
+
+#endif // NANO_LZ_H
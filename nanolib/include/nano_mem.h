@@ -0,0 +1,48 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_MEM_H
+#define NANO_MEM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// nano_mem counts the bytes the broker holds by subsystem, so metrics
+// tell where memory goes and admission control acts before the kernel
+// does. A subsystem counting its own bytes already, like the retain
+// store, has them set by a sampler, the others add and subtract as they
+// allocate and free, lock free.
+//
+// The count is of what a subsystem keeps, not of malloc: vectors and
+// hash tables around it are not in, so it is below the resident size.
+//
+// Pressure starts once the total is above the high watermark and ends
+// once it is below the low one, nano_mem_check moves it.
+typedef enum {
+	NANO_MEM_TREE,     // nodes, long level names and clients
+	NANO_MEM_RETAIN,   // retained messages
+	NANO_MEM_SESSION,  // messages queued for offline sessions
+	NANO_MEM_INFLIGHT, // QoS 1/2 messages not acknowledged
+	NANO_MEM_CONN,     // state of the connections
+	NANO_MEM_TAGS,
+} nano_mem_tag;
+
+extern void        nano_mem_add(nano_mem_tag tag, size_t bytes);
+extern void        nano_mem_sub(nano_mem_tag tag, size_t bytes);
+extern void        nano_mem_set(nano_mem_tag tag, size_t bytes);
+extern size_t      nano_mem_used(nano_mem_tag tag);
+extern size_t      nano_mem_total(void);
+extern const char *nano_mem_name(nano_mem_tag tag);
+
+extern void   nano_mem_watermarks(size_t high, size_t low);
+extern bool   nano_mem_check(void);
+extern bool   nano_mem_pressure(void);
+extern size_t nano_mem_excess(void);
+
+#endif // NANO_MEM_H
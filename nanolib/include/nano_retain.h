@@ -0,0 +1,94 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_RETAIN_H
+#define NANO_RETAIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// nano_retain keeps the retained messages of a broker by topic in a hash
+// table. A message is one packed block of its topic, qos, the properties
+// of its PUBLISH as they were received and its payload, a payload above
+// compress_threshold is kept compressed by nano_lz if that saves space.
+//
+// Once the blocks take more than mem_limit bytes the list order picks the
+// messages to drop: LRU moves a message to the front when it is set and
+// when a cursor hands it out, OLDEST only when it is set. A message
+// bigger than mem_limit on its own is not kept.
+//
+// A message with an expire_at is not handed out from then on, a cursor
+// meeting it drops it and nano_retain_expire sweeps the table in bounded
+// steps for the ones no cursor meets.
+//
+// A filter without wildcards is one lookup. The messages are also kept in
+// a group for each of the first levels of their topic, up to three, so a
+// filter with literal first levels, like dev/42/+, walks the group of
+// those and never the messages elsewhere. A filter starting with a
+// wildcard walks the table in bounded steps with the reverse binary
+// cursor of Redis SCAN, so a walk started before the table grows still
+// visits every message present all along once.
+//
+// One mutex guards the store, it is held while a cursor takes a
+// reference to the messages it matched and never while it hands them
+// out, nor between two steps. A message set or deleted meanwhile is freed
+// once the cursors holding it are done with it.
+typedef struct nano_retain        nano_retain;
+typedef struct nano_retain_cursor nano_retain_cursor;
+
+typedef enum {
+	NANO_RETAIN_EVICT_LRU,
+	NANO_RETAIN_EVICT_OLDEST,
+} nano_retain_eviction;
+
+typedef struct {
+	size_t mem_limit;          // bytes of all messages, 0 unbounded
+	int    eviction;           // nano_retain_eviction
+	size_t compress_threshold; // payload bytes compressed beyond, 0 never
+} nano_retain_opt;
+
+typedef struct {
+	size_t   count;
+	size_t   memory; // bytes of the blocks and the table
+	uint64_t evicted;
+	uint64_t compressed; // messages kept compressed
+	uint64_t expired;
+} nano_retain_stats;
+
+// A message as handed to a nano_retain_cb, valid during the call only.
+typedef struct {
+	const char *   topic;
+	uint32_t       topic_len;
+	uint8_t        qos;
+	const uint8_t *props; // MQTT 5 property length and properties
+	uint32_t       props_len;
+	const uint8_t *payload;
+	uint32_t       payload_len;
+	uint64_t       expire_at; // in the clock of the caller, 0 never
+} nano_retain_msg;
+
+// Called with the store unlocked, it may call back into the store.
+typedef void (*nano_retain_cb)(const nano_retain_msg *msg, void *arg);
+
+extern nano_retain *nano_retain_create(const nano_retain_opt *opt);
+extern void         nano_retain_destroy(nano_retain *r);
+extern int  nano_retain_set(nano_retain *r, const nano_retain_msg *msg);
+extern bool nano_retain_del(nano_retain *r, const char *topic);
+extern void nano_retain_get_stats(nano_retain *r, nano_retain_stats *st);
+extern size_t nano_retain_expire(nano_retain *r, uint64_t now, size_t max);
+extern size_t nano_retain_shrink(nano_retain *r, size_t bytes);
+
+extern nano_retain_cursor *nano_retain_cursor_new(
+    nano_retain *r, const char *filter);
+extern size_t nano_retain_cursor_next(nano_retain_cursor *cur, size_t max,
+    uint64_t now, nano_retain_cb cb, void *arg);
+extern bool nano_retain_cursor_done(nano_retain_cursor *cur);
+extern void nano_retain_cursor_free(nano_retain_cursor *cur);
+
+#endif // NANO_RETAIN_H
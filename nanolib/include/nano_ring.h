@@ -0,0 +1,81 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_RING_H
+#define NANO_RING_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// nano_spsc and nano_mpsc are bounded rings of pointers handed from one
+// thread to another without a lock, unlike nano_lmq. nano_spsc has one
+// producer and one consumer, nano_mpsc any number of producers and one
+// consumer. The capacity is rounded up to a power of 2, the head and the
+// tail are on cache lines of their own so the producers and the consumer
+// do not share one.
+//
+// A consumer may block in _wait until the ring is not empty, a producer
+// signals it only if it is waiting, so a put costs no syscall while the
+// consumer keeps up. For performance reasons, these are allocated inline.
+#define NANO_RING_LINE 64
+
+typedef struct {
+	pthread_mutex_t mtx;
+	pthread_cond_t  cond;
+	int             sleeping;
+} nano_ring_waiter;
+
+typedef struct nano_spsc {
+	size_t tail;       // producer
+	size_t head_cache; // head the producer saw last
+	char   pad0[NANO_RING_LINE - 2 * sizeof(size_t)];
+	size_t head;       // consumer
+	size_t tail_cache; // tail the consumer saw last
+	char   pad1[NANO_RING_LINE - 2 * sizeof(size_t)];
+	size_t mask;
+	void **slots;
+
+	nano_ring_waiter waiter;
+} nano_spsc;
+
+typedef struct nano_mpsc_cell nano_mpsc_cell;
+
+typedef struct nano_mpsc {
+	size_t tail; // producers
+	char   pad0[NANO_RING_LINE - sizeof(size_t)];
+	size_t head; // consumer
+	char   pad1[NANO_RING_LINE - sizeof(size_t)];
+	size_t mask;
+
+	nano_mpsc_cell * cells;
+	nano_ring_waiter waiter;
+} nano_mpsc;
+
+extern int    nano_spsc_init(nano_spsc *q, size_t cap);
+extern void   nano_spsc_fini(nano_spsc *q);
+extern bool   nano_spsc_put(nano_spsc *q, void *item);
+extern size_t nano_spsc_put_n(nano_spsc *q, void **items, size_t n);
+extern bool   nano_spsc_get(nano_spsc *q, void **item);
+extern size_t nano_spsc_get_n(nano_spsc *q, void **items, size_t n);
+extern size_t nano_spsc_len(nano_spsc *q);
+extern size_t nano_spsc_cap(nano_spsc *q);
+extern bool   nano_spsc_wait(nano_spsc *q, int timeout_ms);
+
+extern int    nano_mpsc_init(nano_mpsc *q, size_t cap);
+extern void   nano_mpsc_fini(nano_mpsc *q);
+extern bool   nano_mpsc_put(nano_mpsc *q, void *item);
+extern size_t nano_mpsc_put_n(nano_mpsc *q, void **items, size_t n);
+extern bool   nano_mpsc_get(nano_mpsc *q, void **item);
+extern size_t nano_mpsc_get_n(nano_mpsc *q, void **items, size_t n);
+extern size_t nano_mpsc_len(nano_mpsc *q);
+extern size_t nano_mpsc_cap(nano_mpsc *q);
+extern bool   nano_mpsc_wait(nano_mpsc *q, int timeout_ms);
+
+#endif // NANO_RING_H
@@ -0,0 +1,80 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_SHM_H
+#define NANO_SHM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// nano_shm is a ring of publishes in a file mapped by two processes, a
+// producer which fills it and the broker which drains it, for a process
+// on the same host to publish without a socket. The broker creates the
+// rings as <dir>/nanomq.<i>, a producer claims the first one no living
+// process owns with nano_shm_producer_open. One thread of a producer
+// publishes on a ring at a time.
+//
+// The ring is a header, on cache lines apart for the producer and the
+// consumer, then records of 8 bytes aligned: the length of the record,
+// its kind and flags, the length of its topic in 16 bits and of its
+// payload in 32 bits, the topic and the payload, in the byte order of
+// the host. A record does not wrap, a pad record fills the end instead.
+//
+// The flags of a record are NANO_SHM_RETAIN and the qos shifted by 1,
+// like in the fixed header of a PUBLISH.
+#define NANO_SHM_VERSION 1
+#define NANO_SHM_LINE 64
+#define NANO_SHM_NAME "nanomq.%d"
+#define NANO_SHM_RINGS_MAX 256
+#define NANO_SHM_SIZE_MIN 4096
+#define NANO_SHM_RETAIN 0x01
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;  // bytes of records, a power of 2
+	int32_t  owner; // pid of the producer, 0 if none
+	uint32_t pad;
+	uint64_t full; // publishes the producer found no room for
+	char     pad0[NANO_SHM_LINE - 32];
+	uint64_t tail; // producer
+	char     pad1[NANO_SHM_LINE - sizeof(uint64_t)];
+	uint64_t head; // consumer
+	char     pad2[NANO_SHM_LINE - sizeof(uint64_t)];
+} nano_shm_header;
+
+typedef struct {
+	nano_shm_header *hdr;
+	uint8_t *        data;
+	size_t           mask;
+	size_t           map_len;
+	uint64_t         head_cache; // head the producer saw last
+	uint64_t         tail_cache; // tail the consumer saw last
+	uint64_t         next;       // consumer, past the records taken
+} nano_shm;
+
+extern int  nano_shm_path(char *buf, size_t len, const char *dir, int i);
+extern int  nano_shm_create(nano_shm *s, const char *path, size_t size);
+extern int  nano_shm_attach(nano_shm *s, const char *path);
+extern void nano_shm_detach(nano_shm *s);
+
+extern bool nano_shm_claim(nano_shm *s);
+extern void nano_shm_unclaim(nano_shm *s);
+extern int  nano_shm_publish(nano_shm *s, const char *topic,
+    size_t topic_len, const uint8_t *payload, size_t payload_len,
+    uint8_t flags);
+extern int  nano_shm_producer_open(nano_shm *s, const char *dir);
+extern void nano_shm_producer_close(nano_shm *s);
+
+extern bool nano_shm_next(nano_shm *s, const char **topic,
+    uint16_t *topic_len, const uint8_t **payload, uint32_t *payload_len,
+    uint8_t *flags);
+extern void nano_shm_release(nano_shm *s);
+
+#endif // NANO_SHM_H
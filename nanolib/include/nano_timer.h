@@ -0,0 +1,51 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_TIMER_H
+#define NANO_TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// nano_timer_wheel is a hierarchical timer wheel of 4 levels with 64
+// slots each. A slot of the lowest level is one tick, a slot of a level
+// is 64 slots of the one below, timers past the reach of the top level
+// wait in its farthest slot and are placed again when it comes round.
+// Adding and deleting a timer is O(1), advancing touches the ticks it
+// passes and the timers due on them, a timer moves down a level at most
+// once per level on its way. Time is in any unit the caller picks, the
+// tick is in the same unit.
+//
+// A nano_timer lives in the struct of its owner. Locking must be supplied
+// by the caller, callbacks run from nano_timer_advance and may add or
+// delete any timer.
+typedef struct nano_timer       nano_timer;
+typedef struct nano_timer_wheel nano_timer_wheel;
+
+typedef void (*nano_timer_cb)(nano_timer *t, void *arg);
+
+struct nano_timer {
+	nano_timer *  next;
+	nano_timer *  prev; // NULL if not pending
+	uint64_t      expire; // tick
+	nano_timer_cb cb;
+	void *        arg;
+};
+
+extern void nano_timer_init(nano_timer *t, nano_timer_cb cb, void *arg);
+extern bool nano_timer_pending(const nano_timer *t);
+
+extern nano_timer_wheel *nano_timer_wheel_create(uint64_t now, uint64_t tick);
+extern void   nano_timer_wheel_destroy(nano_timer_wheel *w);
+extern void   nano_timer_add(nano_timer_wheel *w, nano_timer *t, uint64_t when);
+extern void   nano_timer_del(nano_timer_wheel *w, nano_timer *t);
+extern size_t nano_timer_advance(nano_timer_wheel *w, uint64_t now);
+extern size_t nano_timer_count(nano_timer_wheel *w);
+
+#endif // NANO_TIMER_H
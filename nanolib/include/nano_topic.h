@@ -0,0 +1,45 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_TOPIC_H
+#define NANO_TOPIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// nano_topic_scan goes over a topic once: it splits the levels, hashes
+// each of them with nano_topic_hash, which is what the tree keys its
+// nodes by, and checks the topic is well formed UTF-8 without U+0000, and
+// that it has no wildcard, or with NANO_TOPIC_FILTER that "+" and "#"
+// take a whole level and "#" is the last one. Runs of plain ASCII are
+// checked 16 bytes at a time with SSE2 or NEON where the target has them.
+//
+// The topic is always split whole, levels beyond cap are only counted,
+// cnt is set to the count of levels. The return value is the first rule
+// the topic breaks or NANO_TOPIC_OK.
+
+#define NANO_TOPIC_FILTER 0x01
+
+typedef enum {
+	NANO_TOPIC_OK = 0,
+	NANO_TOPIC_EMPTY,    // no byte at all
+	NANO_TOPIC_UTF8,     // malformed UTF-8 or U+0000
+	NANO_TOPIC_WILDCARD, // in a topic name, or misplaced in a filter
+} nano_topic_err;
+
+typedef struct {
+	uint32_t off; // of the level in topic
+	uint32_t len;
+	uint32_t hash; // nano_topic_hash of the level
+} nano_topic_level;
+
+extern uint32_t nano_topic_hash(const char *s, size_t len);
+extern int      nano_topic_scan(const char *topic, size_t len, int flags,
+         nano_topic_level *levels, int cap, int *cnt);
+
+#endif // NANO_TOPIC_H
@@ -0,0 +1,53 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANO_WAL_H
+#define NANO_WAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// nano_wal is an append-only write-ahead log kept in rotating segment
+// files "wal-NNNNNNNN.log" of a directory. Each record is a 9 bytes
+// header (payload length, crc32, type) followed by the payload, a torn
+// record at the tail of a segment ends the replay of that segment.
+//
+// Compaction writes the live state given by a dump callback to
+// "ckpt-NNNNNNNN.log" and removes segments older than NNNNNNNN, so the
+// replay starts from the latest checkpoint and only reads the log written
+// after it. Records written while a checkpoint is dumped are present in
+// both, replaying a record twice must be harmless.
+typedef struct nano_wal      nano_wal;
+typedef struct nano_wal_file nano_wal_ckpt;
+
+typedef struct {
+	const char *dir;
+	size_t      segment_size;   // rotate once a segment is this big
+	uint32_t    fsync_batch;    // fsync every n appends, 0 disables
+	uint32_t    fsync_interval; // ms between background fsync, 0 disables
+	size_t      compact_size;   // compact after this much log, 0 disables
+} nano_wal_opt;
+
+typedef void (*nano_wal_replay_cb)(
+    uint8_t type, const uint8_t *data, size_t len, void *arg);
+typedef int (*nano_wal_dump_cb)(nano_wal_ckpt *ckpt, void *arg);
+
+extern int  nano_wal_open(nano_wal **wal, const nano_wal_opt *opt,
+     nano_wal_dump_cb dump, void *arg);
+extern void nano_wal_close(nano_wal *wal);
+extern int  nano_wal_replay(nano_wal *wal, nano_wal_replay_cb cb, void *arg);
+extern int  nano_wal_append(
+     nano_wal *wal, uint8_t type, const struct iovec *iov, int cnt);
+extern int  nano_wal_sync(nano_wal *wal);
+extern int  nano_wal_compact(nano_wal *wal);
+extern int  nano_wal_ckpt_append(
+     nano_wal_ckpt *ckpt, uint8_t type, const struct iovec *iov, int cnt);
+
+#endif // NANO_WAL_H
@@ -18,19 +18,439 @@
 #include "include/dbg.h"
 #include "include/hash.h"
 #include "include/mqtt_db.h"
+#include "include/nano_alloc.h"
+#include "include/nano_arena.h"
+#include "include/nano_lmq.h"
+#include "include/nano_mem.h"
+#include "include/nano_topic.h"
 #include "include/zmalloc.h"
 
-// #define ROUND_ROBIN
-#define RANDOM
-
-static atomic_int acnt = 0;
-
 typedef enum {
 	DB_DELETE_SESSION,
 	DB_DELETE_CLIENT,
 	DB_CACHE_SESSION,
 } dbtree_delete_flag;
 
+/*
+ * Open addressed set of pipe ids for deduplication of matched clients.
+ * A slot belongs to the current search only if its stamp equals stamp,
+ * so starting a new search never clears the table. pos keeps where the
+ * id was first pushed to the result.
+ */
+typedef struct {
+	uint32_t *ids;
+	uint32_t *stamps;
+	uint32_t *pos;
+	size_t    cap;
+	size_t    cnt;
+	uint32_t  stamp;
+} pipe_set;
+
+/*
+ * Epoch based reclamation for the lock free read path. Every thread which
+ * reads the tree owns a record holding the global epoch it entered in, or
+ * 0 while it is outside. Writers unlink memory, retire it tagged with the
+ * current epoch and bump the epoch, a retired item is freed once no record
+ * holds an epoch older than or equal to its tag. A record also keeps the
+ * scratch memory of the searches of its thread.
+ */
+typedef struct dbtree_epoch_rec dbtree_epoch_rec;
+
+#define DBTREE_SCRATCH 2048 // first size of the scratch of a thread
+
+struct dbtree_epoch_rec {
+	atomic_uint_fast64_t epoch;
+	atomic_bool          in_use;
+	int                  nest;
+	uint32_t             seed;
+	pipe_set             dedup;
+	nano_arena           scratch; // vectors of one search, reset after it
+	dbtree_epoch_rec *   next;
+};
+
+typedef struct dbtree_retired dbtree_retired;
+
+struct dbtree_retired {
+	uint64_t        epoch;
+	void *          ptr;
+	void            (*free_fn)(void *);
+	dbtree_retired *next;
+};
+
+static atomic_uint_fast64_t       epoch_global = 1;
+static dbtree_epoch_rec *_Atomic  epoch_recs   = NULL;
+static dbtree_retired *           retired_head = NULL;
+static dbtree_retired *           retired_tail = NULL;
+static pthread_mutex_t            epoch_mtx    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t             epoch_once   = PTHREAD_ONCE_INIT;
+static pthread_key_t              epoch_key;
+static __thread dbtree_epoch_rec *epoch_self = NULL;
+
+static void
+epoch_rec_release(void *arg)
+{
+	dbtree_epoch_rec *rec = (dbtree_epoch_rec *) arg;
+
+	rec->nest = 0;
+	atomic_store(&rec->epoch, 0);
+	atomic_store(&rec->in_use, false);
+}
+
+static void
+epoch_key_init(void)
+{
+	pthread_key_create(&epoch_key, epoch_rec_release);
+}
+
+/**
+ * @brief epoch_rec_acquire - Take a free epoch record, records released
+ * by exited threads or cursors are reused.
+ * @return dbtree_epoch_rec*
+ */
+static dbtree_epoch_rec *
+epoch_rec_acquire(void)
+{
+	dbtree_epoch_rec *rec = NULL;
+
+	pthread_mutex_lock(&epoch_mtx);
+	for (rec = atomic_load(&epoch_recs); rec; rec = rec->next) {
+		if (!atomic_load(&rec->in_use)) {
+			break;
+		}
+	}
+
+	if (rec == NULL) {
+		rec = (dbtree_epoch_rec *) zmalloc(sizeof(*rec));
+		memset(&rec->dedup, 0, sizeof(pipe_set));
+		nano_arena_init(&rec->scratch, DBTREE_SCRATCH);
+		rec->seed = (uint32_t) time(NULL) ^ (uint32_t) (uintptr_t) rec;
+		rec->seed |= 1;
+		rec->nest = 0;
+		rec->next = atomic_load(&epoch_recs);
+		atomic_init(&rec->epoch, 0);
+		atomic_init(&rec->in_use, false);
+		atomic_store(&epoch_recs, rec);
+	}
+	atomic_store(&rec->in_use, true);
+	pthread_mutex_unlock(&epoch_mtx);
+
+	return rec;
+}
+
+/**
+ * @brief epoch_rec_get - Get the epoch record of the calling thread.
+ * @return dbtree_epoch_rec*
+ */
+static dbtree_epoch_rec *
+epoch_rec_get(void)
+{
+	dbtree_epoch_rec *rec = epoch_self;
+
+	if (rec) {
+		return rec;
+	}
+
+	pthread_once(&epoch_once, epoch_key_init);
+	rec = epoch_rec_acquire();
+	pthread_setspecific(epoch_key, rec);
+	epoch_self = rec;
+
+	return rec;
+}
+
+/**
+ * @brief dbtree_read_enter - Enter a read side critical section, nodes,
+ * clients and vectors loaded after this stay valid until dbtree_read_exit.
+ * @return void
+ */
+static void
+dbtree_read_enter(void)
+{
+	dbtree_epoch_rec *rec = epoch_rec_get();
+
+	if (rec->nest++ == 0) {
+		atomic_store(&rec->epoch, atomic_load(&epoch_global));
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+}
+
+/**
+ * @brief dbtree_read_exit - Leave a read side critical section.
+ * @return void
+ */
+static void
+dbtree_read_exit(void)
+{
+	dbtree_epoch_rec *rec = epoch_self;
+
+	if (--rec->nest == 0) {
+		atomic_store_explicit(&rec->epoch, 0, memory_order_release);
+	}
+}
+
+#define PIPE_SET_MIN 64
+
+static inline size_t
+pipe_set_slot(uint32_t id, size_t mask)
+{
+	return (size_t) (id * 2654435761u) & mask;
+}
+
+static void
+pipe_set_resize(pipe_set *set, size_t cap)
+{
+	uint32_t *ids    = set->ids;
+	uint32_t *stamps = set->stamps;
+	uint32_t *pos    = set->pos;
+	size_t    old    = set->cap;
+
+	set->ids    = (uint32_t *) zmalloc(sizeof(uint32_t) * cap);
+	set->stamps = (uint32_t *) zmalloc(sizeof(uint32_t) * cap);
+	set->pos    = (uint32_t *) zmalloc(sizeof(uint32_t) * cap);
+	memset(set->stamps, 0, sizeof(uint32_t) * cap);
+	set->cap = cap;
+
+	for (size_t i = 0; i < old; i++) {
+		if (stamps[i] == set->stamp) {
+			size_t j = pipe_set_slot(ids[i], cap - 1);
+			while (set->stamps[j] == set->stamp) {
+				j = (j + 1) & (cap - 1);
+			}
+			set->ids[j]    = ids[i];
+			set->stamps[j] = set->stamp;
+			set->pos[j]    = pos[i];
+		}
+	}
+
+	zfree(ids);
+	zfree(stamps);
+	zfree(pos);
+}
+
+/**
+ * @brief pipe_set_begin - Start deduplication of a new search.
+ * @param set - pipe_set of the calling thread
+ * @param hint - count of clients which may be added
+ * @return void
+ */
+static void
+pipe_set_begin(pipe_set *set, size_t hint)
+{
+	set->cnt = 0;
+	if (++set->stamp == 0) {
+		memset(set->stamps, 0, sizeof(uint32_t) * set->cap);
+		set->stamp = 1;
+	}
+
+	size_t cap = set->cap ? set->cap : PIPE_SET_MIN;
+	while (cap < hint * 2) {
+		cap <<= 1;
+	}
+	if (cap != set->cap) {
+		pipe_set_resize(set, cap);
+	}
+}
+
+/**
+ * @brief pipe_set_add_at - Add id to the set, remembering where it is.
+ * @param set - pipe_set
+ * @param id - pipe id
+ * @param pos - position of id, kept if id was not in the set
+ * @param at - set to the position kept for id if it was in the set
+ * @return true if id was not in the set
+ */
+static bool
+pipe_set_add_at(pipe_set *set, uint32_t id, uint32_t pos, uint32_t *at)
+{
+	if ((set->cnt + 1) * 2 > set->cap) {
+		pipe_set_resize(set, set->cap << 1);
+	}
+
+	size_t mask = set->cap - 1;
+	size_t i    = pipe_set_slot(id, mask);
+
+	for (; set->stamps[i] == set->stamp; i = (i + 1) & mask) {
+		if (set->ids[i] == id) {
+			*at = set->pos[i];
+			return false;
+		}
+	}
+
+	set->ids[i]    = id;
+	set->stamps[i] = set->stamp;
+	set->pos[i]    = pos;
+	set->cnt++;
+	return true;
+}
+
+static inline bool
+pipe_set_add(pipe_set *set, uint32_t id)
+{
+	uint32_t at;
+	return pipe_set_add_at(set, id, 0, &at);
+}
+
+/**
+ * @brief dbtree_retire - Defer free of ptr until no reader can see it, ptr
+ * must already be unreachable from root.
+ * @param ptr - memory unlinked by the writer
+ * @param free_fn - callback to free ptr
+ * @return void
+ */
+static void
+dbtree_retire(void *ptr, void (*free_fn)(void *))
+{
+	if (ptr == NULL) {
+		return;
+	}
+
+	dbtree_retired *r = (dbtree_retired *) zmalloc(sizeof(*r));
+	r->ptr            = ptr;
+	r->free_fn        = free_fn;
+	r->next           = NULL;
+
+	pthread_mutex_lock(&epoch_mtx);
+	r->epoch = atomic_fetch_add(&epoch_global, 1);
+	if (retired_tail) {
+		retired_tail->next = r;
+	} else {
+		retired_head = r;
+	}
+	retired_tail = r;
+	pthread_mutex_unlock(&epoch_mtx);
+}
+
+/**
+ * @brief dbtree_reclaim - Free all retired memory no reader can reach any
+ * more, called by writers after every update.
+ * @return void
+ */
+static void
+dbtree_reclaim(void)
+{
+	uint64_t        min  = atomic_load(&epoch_global);
+	dbtree_retired *list = NULL;
+	dbtree_retired *r    = NULL;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	for (dbtree_epoch_rec *rec = atomic_load(&epoch_recs); rec;
+	     rec                   = rec->next) {
+		uint64_t e = atomic_load(&rec->epoch);
+		if (e != 0 && e < min) {
+			min = e;
+		}
+	}
+
+	pthread_mutex_lock(&epoch_mtx);
+	if (retired_head && retired_head->epoch < min) {
+		list = retired_head;
+		r    = retired_head;
+		while (r->next && r->next->epoch < min) {
+			r = r->next;
+		}
+		retired_head = r->next;
+		r->next      = NULL;
+		if (retired_head == NULL) {
+			retired_tail = NULL;
+		}
+	}
+	pthread_mutex_unlock(&epoch_mtx);
+
+	while (list) {
+		r    = list;
+		list = list->next;
+		r->free_fn(r->ptr);
+		zfree(r);
+	}
+}
+
+static void
+dbtree_vec_free(void *vec)
+{
+	cvector_free(vec);
+}
+
+/**
+ * @brief vec_copy - Copy a vector with room for one more element, so that
+ * writers never touch a vector readers may be walking.
+ * @param vec - origin vector
+ * @return new vector or NULL if vec is empty
+ */
+static void **
+vec_copy(void **vec)
+{
+	void **copy = NULL;
+	size_t size = cvector_size(vec);
+
+	if (size == 0) {
+		return NULL;
+	}
+
+	cvector_grow(copy, size + 1);
+	memcpy(copy, vec, size * sizeof(void *));
+	cvector_set_size(copy, size);
+
+	return copy;
+}
+
+/**
+ * @brief vec_insert_copy - Return a copy of vec with e inserted at index.
+ * @param vec - origin vector
+ * @param index - position
+ * @param e - element
+ * @return new vector
+ */
+static void **
+vec_insert_copy(void **vec, int index, void *e)
+{
+	void **copy = vec_copy(vec);
+
+	if (index == cvector_size(copy)) {
+		cvector_push_back(copy, e);
+	} else {
+		cvector_insert(copy, index, e);
+	}
+
+	return copy;
+}
+
+/**
+ * @brief vec_erase_copy - Return a copy of vec without element at index.
+ * @param vec - origin vector
+ * @param index - position
+ * @return new vector or NULL if it becomes empty
+ */
+static void **
+vec_erase_copy(void **vec, int index)
+{
+	void **copy = vec_copy(vec);
+
+	cvector_erase(copy, index);
+	if (cvector_empty(copy)) {
+		cvector_free(copy);
+		copy = NULL;
+	}
+
+	return copy;
+}
+
+/**
+ * @brief vec_publish - Swap vector in slot and retire the old one.
+ * @param slot - address of vector in dbtree_node
+ * @param vec - new vector
+ * @return void
+ */
+static void
+vec_publish(void ***slot, void **vec)
+{
+	void **old = *slot;
+
+	__atomic_store_n(slot, vec, __ATOMIC_RELEASE);
+	dbtree_retire(old, dbtree_vec_free);
+}
+
+#define node_load(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+
 /**
  * @brief print_client - A way to print client in vec.
  * @param v - normally v is an dynamic array
@@ -125,231 +545,1635 @@ binary_search(
 	return false;
 }
 
+#define TOPIC_TOKENS_STACK 16
+
+/*
+ * Levels of a topic as (offset, length, hash) spans into the origin
+ * topic, no level is copied. Spans live in stack unless the topic is
+ * deeper than TOPIC_TOKENS_STACK levels.
+ */
+typedef struct {
+	const char *      topic;
+	int               cnt;
+	nano_topic_level *spans;
+	nano_topic_level  stack[TOPIC_TOKENS_STACK];
+} topic_tokens;
+
 /**
- * @brief topic_count - Count how many levels.
- * @param topic - original topic
- * @return topic level
+ * @brief topic_tokenize - Split topic to levels and hash them. Topics are
+ * checked by the protocol layer, what nano_topic_scan finds is ignored.
+ * @param tk - topic_tokens, normally on the stack of caller
+ * @param topic - original topic, must outlive tk
+ * @return void
  */
-static int
-topic_count(char *topic)
+static void
+topic_tokenize(topic_tokens *tk, const char *topic)
 {
-	int   cnt = 0;
-	char *t   = topic;
+	assert(topic != NULL);
 
-	while (t) {
-		// log_info("%s", t);
-		t = strchr(t, '/');
-		cnt++;
-		if (t == NULL) {
-			break;
-		}
-		t++;
+	size_t len = strlen(topic);
+
+	tk->topic = topic;
+	tk->spans = tk->stack;
+	nano_topic_scan(topic, len, NANO_TOPIC_FILTER, tk->spans,
+	    TOPIC_TOKENS_STACK, &tk->cnt);
+	if (tk->cnt > TOPIC_TOKENS_STACK) {
+		tk->spans = (nano_topic_level *) zmalloc(
+		    sizeof(nano_topic_level) * tk->cnt);
+		nano_topic_scan(topic, len, NANO_TOPIC_FILTER, tk->spans,
+		    tk->cnt, &tk->cnt);
 	}
-
-	return cnt;
 }
 
 /**
- * @brief topic_parse - Parsing topic to topic queue.
- * @param topic - original topic
- * @return topic queue
+ * @brief topic_tokens_fini - Free heap spans if any.
+ * @param tk - topic_tokens
+ * @return void
  */
-static char **
-topic_parse(char *topic)
+static void
+topic_tokens_fini(topic_tokens *tk)
 {
-	assert(topic != NULL);
+	if (tk->spans != tk->stack) {
+		zfree(tk->spans);
+	}
+	tk->spans = NULL;
+}
 
-	int   row   = 0;
-	int   len   = 2;
-	char *b_pos = topic;
-	char *pos   = NULL;
+/**
+ * @brief topic_tokens_level - Get level lv of tokens.
+ * @param tk - topic_tokens
+ * @param lv - level index
+ * @return topic_level
+ */
+static inline topic_level
+topic_tokens_level(topic_tokens *tk, int lv)
+{
+	topic_level level = {
+		.s    = tk->topic + tk->spans[lv].off,
+		.len  = tk->spans[lv].len,
+		.hash = tk->spans[lv].hash,
+	};
+	return level;
+}
 
-	int cnt = topic_count(topic);
+/**
+ * @brief is_well - Determine if the current topic is "#"
+ * @param level - topic in one level
+ * @return true, if curr topic is "#"
+ */
+static bool
+is_well(topic_level *level)
+{
+	return level->len == 1 && level->s[0] == '#';
+}
 
-	// Here we will get (cnt + 1) memory, one for NULL end
-	char **topic_queue = (char **) zmalloc(sizeof(char *) * (cnt + 1));
+/**
+ * @brief is_plus - Determine if the current topic is "+"
+ * @param level - topic in one level
+ * @return true, if curr topic is "+"
+ */
+static bool
+is_plus(topic_level *level)
+{
+	return level->len == 1 && level->s[0] == '+';
+}
 
-	while ((pos = strchr(b_pos, '/')) != NULL) {
+/**
+ * @brief skip_wildcard - To get left boundry of binary search, wildcard
+ * children always take the first slots.
+ * @param child - child vector of dbtree_node
+ * @return l - left boundry
+ */
+static int
+skip_wildcard(dbtree_node **child)
+{
+	int l    = 0;
+	int size = cvector_size(child);
 
-		len              = pos - b_pos + 1;
-		topic_queue[row] = (char *) zmalloc(sizeof(char) * len);
-		memcpy(topic_queue[row], b_pos, (len - 1));
-		topic_queue[row][len - 1] = '\0';
-		b_pos                     = pos + 1;
-		row++;
+	while (l < size && l < 2 && child[l]->len == 1 &&
+	    (child[l]->topic[0] == '+' || child[l]->topic[0] == '#')) {
+		l++;
 	}
 
-	len = strlen(b_pos);
+	return l;
+}
+
+/*
+ * Hash index of non wildcard children, built once a node has more than
+ * CHILD_INDEX_MIN of them. It is open addressed with linear probing, a
+ * slot is NULL, a child or CHILD_TOMBSTONE once that child is deleted.
+ * Writers fill slots in place under db->rwlock and readers probe them
+ * without any lock, so a table is only swapped when it grows.
+ */
+#define CHILD_INDEX_MIN 64
+#define CHILD_TOMBSTONE ((dbtree_node *) 1)
+
+struct dbtree_child_index {
+	size_t       cap;
+	size_t       live;
+	size_t       used;
+	dbtree_node *slots[];
+};
+
+static inline uint32_t
+level_hash(const char *s, size_t len)
+{
+	return nano_topic_hash(s, len);
+}
 
-	topic_queue[row] = (char *) zmalloc(sizeof(char) * (len + 1));
-	memcpy(topic_queue[row], b_pos, (len));
-	topic_queue[row][len] = '\0';
-	topic_queue[++row]    = NULL;
+static dbtree_child_index *
+child_index_new(size_t cnt)
+{
+	size_t cap = CHILD_INDEX_MIN;
+	while (cap < cnt * 2) {
+		cap <<= 1;
+	}
 
-	return topic_queue;
+	dbtree_child_index *idx = (dbtree_child_index *) zmalloc(
+	    sizeof(dbtree_child_index) + sizeof(dbtree_node *) * cap);
+	memset(idx->slots, 0, sizeof(dbtree_node *) * cap);
+	idx->cap  = cap;
+	idx->live = 0;
+	idx->used = 0;
+	return idx;
 }
 
 /**
- * @brief topic_queue_free - Free topic queue memory.
- * @param topic_queue - topic array
- * @return void
+ * @brief child_index_find - Find the child equal to level, safe for
+ * readers.
+ * @param idx - dbtree_child_index
+ * @param level - topic level of a split topic
+ * @return dbtree_node or NULL
  */
+static dbtree_node *
+child_index_find(dbtree_child_index *idx, topic_level *level)
+{
+	size_t   mask = idx->cap - 1;
+	uint32_t hash = level->hash;
+	size_t   i    = hash & mask;
+
+	for (;; i = (i + 1) & mask) {
+		dbtree_node *n = node_load(idx->slots[i]);
+		if (n == NULL) {
+			return NULL;
+		}
+		// the hash and length sit before the name in the node
+		if (n != CHILD_TOMBSTONE && n->hash == hash &&
+		    n->len == level->len &&
+		    memcmp(n->topic, level->s, level->len) == 0) {
+			return n;
+		}
+	}
+}
 
+// child must not be in idx and idx must have a free slot
 static void
-topic_queue_free(char **topic_queue)
+child_index_put(dbtree_child_index *idx, dbtree_node *child)
 {
-	char * t  = NULL;
-	char **tt = topic_queue;
+	size_t mask = idx->cap - 1;
+	size_t i    = child->hash & mask;
 
-	while (*topic_queue) {
-		t = *topic_queue;
-		topic_queue++;
-		zfree(t);
-		t = NULL;
+	while (idx->slots[i] != NULL && idx->slots[i] != CHILD_TOMBSTONE) {
+		i = (i + 1) & mask;
 	}
 
-	if (tt) {
-		zfree(tt);
+	if (idx->slots[i] == NULL) {
+		idx->used++;
 	}
+	idx->live++;
+	__atomic_store_n(&idx->slots[i], child, __ATOMIC_RELEASE);
 }
 
 static void
-print_dbtree_node(dbtree_node *node)
+child_index_del(dbtree_child_index *idx, dbtree_node *child)
 {
-	printf("topic:    %s\n", node->topic);
-
-	if (node->clients) {
-		cvector(dbtree_client *) clients = node->clients;
-		for (int i = 0; i < cvector_size(clients); i++) {
-			printf("pipe_id:       %d\n", clients[i]->pipe_id);
-			printf(
-			    "session_id:       %d\n", clients[i]->session_id);
+	size_t mask = idx->cap - 1;
+	size_t i    = child->hash & mask;
+
+	for (; idx->slots[i] != NULL; i = (i + 1) & mask) {
+		if (idx->slots[i] == child) {
+			__atomic_store_n(
+			    &idx->slots[i], CHILD_TOMBSTONE, __ATOMIC_RELEASE);
+			idx->live--;
+			return;
 		}
 	}
 }
 
 /**
- * @brief dbtree_print - Print dbtree for debug.
- * @param dbtree - dbtree
+ * @brief child_index_add - Add a child to the index of node, rehash to a
+ * new table when it is 3/4 full of children and tombstones.
+ * @param node - dbtree_node
+ * @param child - new child
  * @return void
  */
-#ifdef NOLOG
-void
-dbtree_print(dbtree *db)
+static void
+child_index_add(dbtree_node *node, dbtree_node *child)
 {
-	return;
+	dbtree_child_index *idx = node->child_index;
+
+	if ((idx->used + 1) * 4 > idx->cap * 3) {
+		dbtree_child_index *n = child_index_new(idx->live + 1);
+		for (size_t i = 0; i < idx->cap; i++) {
+			if (idx->slots[i] && idx->slots[i] != CHILD_TOMBSTONE) {
+				child_index_put(n, idx->slots[i]);
+			}
+		}
+		__atomic_store_n(&node->child_index, n, __ATOMIC_RELEASE);
+		dbtree_retire(idx, zfree);
+		idx = n;
+	}
+
+	child_index_put(idx, child);
 }
-#else
-void
-dbtree_print(dbtree *db)
+
+/**
+ * @brief child_index_build - Move non wildcard children of node and the
+ * new child to a hash index, child vector keeps wildcards only. The index
+ * is published before the vector shrinks and readers load the vector
+ * first.
+ * @param node - dbtree_node
+ * @param l - count of wildcard children
+ * @param child - new child
+ * @return void
+ */
+static void
+child_index_build(dbtree_node *node, int l, dbtree_node *child)
 {
-	assert(db);
-	pthread_rwlock_wrlock(&(db->rwlock));
+	size_t              size = cvector_size(node->child);
+	dbtree_child_index *idx  = child_index_new(size - l + 1);
+	cvector(dbtree_node *) wildcards = NULL;
 
-	dbtree_node *node = db->root;
-	dbtree_node **nodes = NULL;
-	dbtree_node **nodes_t = NULL;
+	for (size_t i = l; i < size; i++) {
+		child_index_put(idx, node->child[i]);
+	}
+	child_index_put(idx, child);
 
-	const char node_fmt[] = "[%-5s]\t";
-	cvector_push_back(nodes, node);
-	puts("___________PRINT_DB_TREE__________");
-	while (!cvector_empty(nodes)) {
-		for (int i = 0; i < cvector_size(nodes); i++) {
-			printf(node_fmt, nodes[i]->topic);
+	for (int i = 0; i < l; i++) {
+		cvector_push_back(wildcards, node->child[i]);
+	}
+
+	__atomic_store_n(&node->child_index, idx, __ATOMIC_RELEASE);
+	vec_publish((void ***) &node->child, (void **) wildcards);
+	log_info("Child index built on node: [%s]", node->topic);
+}
+
+/**
+ * @brief child_lookup - Find the non wildcard child equal to level.
+ * Readers must load child before idx.
+ * @param child - child vector
+ * @param idx - child index or NULL
+ * @param level - topic level
+ * @return dbtree_node or NULL
+ */
+static dbtree_node *
+child_lookup(dbtree_node **child, dbtree_child_index *idx, topic_level *level)
+{
+	int index = 0;
+
+	if (idx) {
+		return child_index_find(idx, level);
+	}
+
+	if (binary_search((void **) child, skip_wildcard(child), &index,
+	        level, node_cmp)) {
+		return child[index];
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief child_find - Find the child equal to level, wildcards included,
+ * for writers holding db->rwlock.
+ * @param node - dbtree_node
+ * @param level - topic level
+ * @return dbtree_node or NULL
+ */
+static dbtree_node *
+child_find(dbtree_node *node, topic_level *level)
+{
+	if (is_well(level)) {
+		return node->well != -1 ? node->child[node->well] : NULL;
+	}
+
+	if (is_plus(level)) {
+		return node->plus != -1 ? node->child[node->plus] : NULL;
+	}
+
+	return child_lookup(node->child, node->child_index, level);
+}
+
+/**
+ * @brief child_insert - Insert a non wildcard child which is not in node
+ * yet, for writers holding db->rwlock.
+ * @param node - dbtree_node
+ * @param child - new child
+ * @return void
+ */
+static void
+child_insert(dbtree_node *node, dbtree_node *child)
+{
+	if (node->child_index) {
+		child_index_add(node, child);
+		return;
+	}
+
+	int         l     = skip_wildcard(node->child);
+	int         index = l;
+	topic_level level = { .s = child->topic, .len = child->len };
+
+	if (cvector_size(node->child) - l >= CHILD_INDEX_MIN) {
+		child_index_build(node, l, child);
+		return;
+	}
+
+	if (l < cvector_size(node->child)) {
+		binary_search(
+		    (void **) node->child, l, &index, &level, node_cmp);
+	}
+	vec_publish((void ***) &node->child,
+	    vec_insert_copy((void **) node->child, index, child));
+}
+
+/**
+ * @brief child_count - Count children of node, for writers.
+ * @param node - dbtree_node
+ * @return count
+ */
+static size_t
+child_count(dbtree_node *node)
+{
+	size_t cnt = cvector_size(node->child);
+
+	if (node->child_index) {
+		cnt += node->child_index->live;
+	}
+
+	return cnt;
+}
+
+/**
+ * @brief child_exist - Check if node may have children, safe for
+ * readers.
+ * @param node - dbtree_node
+ * @return true if any
+ */
+static inline bool
+child_exist(dbtree_node *node)
+{
+	// cvector macros evaluate their argument more than once
+	dbtree_node **child = node_load(node->child);
+
+	return !cvector_empty(child) || node_load(node->child_index) != NULL;
+}
+
+/*
+ * Iterator on all children of a node, safe for readers. Wildcards come
+ * first, then the child vector or the index.
+ */
+typedef struct {
+	dbtree_node **      child;
+	dbtree_child_index *idx;
+	size_t              size;
+	size_t              i;
+	size_t              j;
+} child_iter;
+
+static void
+child_iter_init(child_iter *it, dbtree_node *node)
+{
+	it->child = node_load(node->child);
+	it->idx   = node_load(node->child_index);
+	// An old child vector may still hold the children of the index
+	it->size = it->idx ? skip_wildcard(it->child) : cvector_size(it->child);
+	it->i    = 0;
+	it->j    = 0;
+}
+
+static dbtree_node *
+child_iter_next(child_iter *it)
+{
+	if (it->i < it->size) {
+		return it->child[it->i++];
+	}
+
+	while (it->idx && it->j < it->idx->cap) {
+		dbtree_node *n = node_load(it->idx->slots[it->j++]);
+		if (n && n != CHILD_TOMBSTONE) {
+			return n;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Index of the filters with wildcards by shape, the string of what each
+ * level of a filter is, 'L' for a literal, '+' or '#'. "fleet/+/+/alarm"
+ * is "L++L" and its entry is keyed by its literal levels "fleet/alarm".
+ * A publish walks the tree on its own levels only, then probes once each
+ * shape it could match, so its cost follows the filters it matches and
+ * not the "+" and "#" branches of the tree. An entry points to the node
+ * its filter ends on, it is added when a subscription lands there and
+ * removed with that node. A filter with "#" before the last level matches
+ * nothing and has no entry. Shapes are sorted by level count, the vector
+ * is swapped like child vectors and a table like child_index, readers
+ * need no lock.
+ */
+#define WILD_TABLE_MIN 8
+#define WILD_TOMBSTONE ((dbtree_wild_entry *) 1)
+#define WILD_HASH_SEED 2166136261u
+
+typedef struct wild_shape wild_shape;
+
+struct dbtree_wild_entry {
+	wild_shape * shape;
+	dbtree_node *node;
+	uint32_t     hash; // of the literal levels
+	uint32_t     len;  // of key
+	char         key[];
+};
+
+typedef struct {
+	size_t             cap;
+	size_t             live;
+	size_t             used;
+	dbtree_wild_entry *slots[];
+} wild_table;
+
+struct wild_shape {
+	dbtree_wild_index *index;
+	wild_table *       table;
+	int                cnt;  // levels, "#" included
+	bool               well; // last level is "#"
+	char               sig[];
+};
+
+struct dbtree_wild_index {
+	cvector(wild_shape *) shapes;
+};
+
+static inline uint32_t
+wild_hash_fold(uint32_t h, uint32_t level)
+{
+	return (h ^ level) * 16777619u;
+}
+
+static wild_table *
+wild_table_new(size_t cnt)
+{
+	size_t cap = WILD_TABLE_MIN;
+	while (cap < cnt * 2) {
+		cap <<= 1;
+	}
+
+	wild_table *t = (wild_table *) zmalloc(
+	    sizeof(wild_table) + sizeof(dbtree_wild_entry *) * cap);
+	memset(t->slots, 0, sizeof(dbtree_wild_entry *) * cap);
+	t->cap  = cap;
+	t->live = 0;
+	t->used = 0;
+	return t;
+}
+
+// e must not be in t and t must have a free slot
+static void
+wild_table_put(wild_table *t, dbtree_wild_entry *e)
+{
+	size_t mask = t->cap - 1;
+	size_t i    = e->hash & mask;
+
+	while (t->slots[i] != NULL && t->slots[i] != WILD_TOMBSTONE) {
+		i = (i + 1) & mask;
+	}
+
+	if (t->slots[i] == NULL) {
+		t->used++;
+	}
+	t->live++;
+	__atomic_store_n(&t->slots[i], e, __ATOMIC_RELEASE);
+}
+
+static void
+wild_table_del(wild_table *t, dbtree_wild_entry *e)
+{
+	size_t mask = t->cap - 1;
+	size_t i    = e->hash & mask;
+
+	for (; t->slots[i] != NULL; i = (i + 1) & mask) {
+		if (t->slots[i] == e) {
+			__atomic_store_n(
+			    &t->slots[i], WILD_TOMBSTONE, __ATOMIC_RELEASE);
+			t->live--;
+			return;
+		}
+	}
+}
+
+static void
+wild_shape_free(void *shape)
+{
+	zfree(((wild_shape *) shape)->table);
+	zfree(shape);
+}
+
+static dbtree_wild_index *
+wild_index_new(void)
+{
+	dbtree_wild_index *index =
+	    (dbtree_wild_index *) zmalloc(sizeof(dbtree_wild_index));
+	index->shapes = NULL;
+	return index;
+}
+
+// nothing may read index any more
+static void
+wild_index_free(dbtree_wild_index *index)
+{
+	if (index == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < cvector_size(index->shapes); i++) {
+		wild_table *t = index->shapes[i]->table;
+		for (size_t j = 0; j < t->cap; j++) {
+			if (t->slots[j] && t->slots[j] != WILD_TOMBSTONE) {
+				t->slots[j]->node->wild = NULL;
+				zfree(t->slots[j]);
+			}
+		}
+		wild_shape_free(index->shapes[i]);
+	}
+	cvector_free(index->shapes);
+	zfree(index);
+}
+
+/**
+ * @brief wild_shape_get - Find the shape equal to sig, create it if there
+ * is none, for writers.
+ * @param index - dbtree_wild_index
+ * @param sig - shape of a filter
+ * @param well - last level of sig is "#"
+ * @return wild_shape
+ */
+static wild_shape *
+wild_shape_get(dbtree_wild_index *index, const char *sig, bool well)
+{
+	int    cnt = strlen(sig);
+	size_t i   = 0;
+
+	for (; i < cvector_size(index->shapes); i++) {
+		wild_shape *s = index->shapes[i];
+		if (s->cnt > cnt) {
+			break;
+		}
+		if (s->cnt == cnt && strcmp(s->sig, sig) == 0) {
+			return s;
+		}
+	}
+
+	wild_shape *s = (wild_shape *) zmalloc(sizeof(wild_shape) + cnt + 1);
+	memcpy(s->sig, sig, cnt + 1);
+	s->index = index;
+	s->table = wild_table_new(1);
+	s->cnt   = cnt;
+	s->well  = well;
+	vec_publish((void ***) &index->shapes,
+	    vec_insert_copy((void **) index->shapes, i, s));
+	log_info("New wildcard shape: [%s]", sig);
+	return s;
+}
+
+/**
+ * @brief wild_index_add - Give node, where filter tk ends, its entry if
+ * the filter has wildcards and can match a topic.
+ * @param index - dbtree_wild_index
+ * @param node - dbtree_node of the last level of tk
+ * @param tk - topic tokens of filter
+ * @return void
+ */
+static void
+wild_index_add(dbtree_wild_index *index, dbtree_node *node, topic_tokens *tk)
+{
+	char *   sig  = NULL;
+	uint32_t hash = WILD_HASH_SEED;
+	size_t   len  = 0;
+	bool     wild = false;
+
+	if (node->wild != NULL) {
+		return;
+	}
+
+	sig = (char *) zmalloc(tk->cnt + 1);
+	for (int lv = 0; lv < tk->cnt; lv++) {
+		topic_level level = topic_tokens_level(tk, lv);
+		if (is_well(&level) && lv + 1 < tk->cnt) {
+			zfree(sig);
+			return;
+		}
+		if (is_well(&level) || is_plus(&level)) {
+			sig[lv] = level.s[0];
+			wild    = true;
+		} else {
+			sig[lv] = 'L';
+			len += level.len + 1;
+			hash = wild_hash_fold(hash, level.hash);
+		}
+	}
+	sig[tk->cnt] = '\0';
+	if (!wild) {
+		zfree(sig);
+		return;
+	}
+
+	dbtree_wild_entry *e =
+	    (dbtree_wild_entry *) zmalloc(sizeof(dbtree_wild_entry) + len + 1);
+	char *k = e->key;
+	for (int lv = 0; lv < tk->cnt; lv++) {
+		topic_level level = topic_tokens_level(tk, lv);
+		if (sig[lv] == 'L') {
+			memcpy(k, level.s, level.len);
+			k += level.len;
+			*k++ = '/';
+		}
+	}
+	e->len         = len > 0 ? len - 1 : 0;
+	e->key[e->len] = '\0';
+	e->hash        = hash;
+	e->node        = node;
+	e->shape       = wild_shape_get(index, sig, sig[tk->cnt - 1] == '#');
+	zfree(sig);
+
+	wild_shape *s = e->shape;
+	wild_table *t = s->table;
+	if ((t->used + 1) * 4 > t->cap * 3) {
+		wild_table *n = wild_table_new(t->live + 1);
+		for (size_t i = 0; i < t->cap; i++) {
+			if (t->slots[i] && t->slots[i] != WILD_TOMBSTONE) {
+				wild_table_put(n, t->slots[i]);
+			}
+		}
+		__atomic_store_n(&s->table, n, __ATOMIC_RELEASE);
+		dbtree_retire(t, zfree);
+		t = n;
+	}
+	wild_table_put(t, e);
+	node->wild = e;
+}
+
+/**
+ * @brief wild_index_del - Remove the entry of a node which is being
+ * deleted, and its shape once it has no entry left.
+ * @param e - dbtree_wild_entry
+ * @return void
+ */
+static void
+wild_index_del(dbtree_wild_entry *e)
+{
+	wild_shape *       s     = e->shape;
+	dbtree_wild_index *index = s->index;
+
+	wild_table_del(s->table, e);
+	e->node->wild = NULL;
+	dbtree_retire(e, zfree);
+	if (s->table->live > 0) {
+		return;
+	}
+
+	for (size_t i = 0; i < cvector_size(index->shapes); i++) {
+		if (index->shapes[i] == s) {
+			vec_publish((void ***) &index->shapes,
+			    vec_erase_copy((void **) index->shapes, i));
+			break;
+		}
+	}
+	log_info("Delete wildcard shape: [%s]", s->sig);
+	dbtree_retire(s, wild_shape_free);
+}
+
+// the literal levels of tk at the 'L' of sig are the key of e
+static bool
+wild_key_eq(dbtree_wild_entry *e, const char *sig, topic_tokens *tk)
+{
+	const char *k   = e->key;
+	const char *end = e->key + e->len;
+
+	for (int lv = 0; sig[lv] != '\0'; lv++) {
+		if (sig[lv] != 'L') {
+			continue;
+		}
+		topic_level level = topic_tokens_level(tk, lv);
+		const char *seg   = memchr(k, '/', end - k);
+		if (seg == NULL) {
+			seg = end;
+		}
+		if ((size_t) (seg - k) != level.len ||
+		    memcmp(k, level.s, level.len) != 0) {
+			return false;
+		}
+		k = seg + 1;
+	}
+
+	return true;
+}
+
+/*
+ * Match cache, publish topic to the result of a lookup. An entry is tagged
+ * with the generation of the tree it was computed on, db->gen is odd while
+ * a writer is changing clients or sessions and bumped again when it is
+ * done, so an entry is only valid while its tag equals db->gen. Entries
+ * are spread on shards by topic hash, each shard is a bounded LRU list.
+ */
+#define MATCH_CACHE_SHARDS 16
+
+typedef struct match_cache_entry match_cache_entry;
+
+struct match_cache_entry {
+	char *             topic;
+	uint32_t           hash;
+	uint64_t           gen;
+	void **            vec;
+	match_cache_entry *hnext;
+	match_cache_entry *prev;
+	match_cache_entry *next;
+};
+
+typedef struct {
+	pthread_mutex_t     mtx;
+	match_cache_entry **buckets;
+	size_t              mask;
+	match_cache_entry * head;
+	match_cache_entry * tail;
+	size_t              size;
+	size_t              cap;
+} match_cache_shard;
+
+struct dbtree_match_cache {
+	match_cache_shard    shards[MATCH_CACHE_SHARDS];
+	size_t               cap;
+	atomic_uint_fast64_t hit;
+	atomic_uint_fast64_t miss;
+};
+
+static uint32_t
+match_cache_hash(const char *topic)
+{
+	return level_hash(topic, strlen(topic));
+}
+
+static dbtree_match_cache *
+match_cache_new(size_t cap)
+{
+	dbtree_match_cache *cache =
+	    (dbtree_match_cache *) zmalloc(sizeof(dbtree_match_cache));
+	if (cache == NULL) {
+		log_err("Memory alloc failed!");
+		return NULL;
+	}
+	memset(cache, 0, sizeof(dbtree_match_cache));
+	cache->cap = cap;
+
+	size_t per = (cap + MATCH_CACHE_SHARDS - 1) / MATCH_CACHE_SHARDS;
+	size_t nb  = 1;
+	while (nb < per) {
+		nb <<= 1;
+	}
+
+	for (int i = 0; i < MATCH_CACHE_SHARDS; i++) {
+		match_cache_shard *s = &cache->shards[i];
+		pthread_mutex_init(&s->mtx, NULL);
+		s->buckets = (match_cache_entry **) zmalloc(
+		    sizeof(match_cache_entry *) * nb);
+		memset(s->buckets, 0, sizeof(match_cache_entry *) * nb);
+		s->mask = nb - 1;
+		s->cap  = per;
+	}
+
+	return cache;
+}
+
+static void
+match_cache_entry_free(match_cache_entry *e)
+{
+	cvector_free(e->vec);
+	zfree(e->topic);
+	zfree(e);
+}
+
+static void
+match_cache_free(dbtree_match_cache *cache)
+{
+	if (cache == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < MATCH_CACHE_SHARDS; i++) {
+		match_cache_shard *s = &cache->shards[i];
+		match_cache_entry *e = s->head;
+		while (e) {
+			match_cache_entry *n = e->next;
+			match_cache_entry_free(e);
+			e = n;
+		}
+		zfree(s->buckets);
+		pthread_mutex_destroy(&s->mtx);
+	}
+	zfree(cache);
+}
+
+static void
+match_cache_unlink(match_cache_shard *s, match_cache_entry *e)
+{
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		s->head = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		s->tail = e->prev;
+	}
+	e->prev = e->next = NULL;
+}
+
+static void
+match_cache_push_front(match_cache_shard *s, match_cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = s->head;
+	if (s->head) {
+		s->head->prev = e;
+	} else {
+		s->tail = e;
+	}
+	s->head = e;
+}
+
+static match_cache_entry *
+match_cache_find(match_cache_shard *s, const char *topic, uint32_t hash)
+{
+	match_cache_entry *e = s->buckets[hash & s->mask];
+	while (e && (e->hash != hash || strcmp(e->topic, topic))) {
+		e = e->hnext;
+	}
+	return e;
+}
+
+static void
+match_cache_evict(match_cache_shard *s, match_cache_entry *e)
+{
+	match_cache_entry **pp = &s->buckets[e->hash & s->mask];
+	while (*pp != e) {
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+	match_cache_unlink(s, e);
+	match_cache_entry_free(e);
+	s->size--;
+}
+
+/**
+ * @brief match_cache_lookup - Find a valid entry of topic and build the
+ * result from it with on_hit, under the shard lock.
+ * @param cache - dbtree_match_cache
+ * @param topic - publish topic
+ * @param gen - current generation of dbtree, must be even
+ * @param on_hit - build the result from entry vector, or clear hit if the
+ * entry does not serve this lookup
+ * @param arg - passed to on_hit
+ * @param hit - set true if entry is found
+ * @return result of on_hit
+ */
+static void **
+match_cache_lookup(dbtree_match_cache *cache, const char *topic, uint64_t gen,
+    void **(*on_hit)(void **vec, void *arg, bool *hit), void *arg, bool *hit)
+{
+	uint32_t           hash = match_cache_hash(topic);
+	match_cache_shard *s    = &cache->shards[hash % MATCH_CACHE_SHARDS];
+	void **            ret  = NULL;
+
+	*hit = false;
+	pthread_mutex_lock(&s->mtx);
+	match_cache_entry *e = match_cache_find(s, topic, hash);
+	if (e && e->gen == gen) {
+		*hit = true;
+		ret  = on_hit(e->vec, arg, hit);
+	}
+	if (*hit) {
+		match_cache_unlink(s, e);
+		match_cache_push_front(s, e);
+	}
+	pthread_mutex_unlock(&s->mtx);
+
+	if (*hit) {
+		atomic_fetch_add(&cache->hit, 1);
+	} else {
+		atomic_fetch_add(&cache->miss, 1);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief match_cache_store - Store vec as the result of topic at gen, the
+ * cache takes vec over.
+ * @param cache - dbtree_match_cache
+ * @param topic - publish topic
+ * @param gen - generation vec is computed on
+ * @param vec - cvector
+ * @return void
+ */
+static void
+match_cache_store(
+    dbtree_match_cache *cache, const char *topic, uint64_t gen, void **vec)
+{
+	uint32_t           hash = match_cache_hash(topic);
+	match_cache_shard *s    = &cache->shards[hash % MATCH_CACHE_SHARDS];
+
+	pthread_mutex_lock(&s->mtx);
+	match_cache_entry *e = match_cache_find(s, topic, hash);
+	if (e) {
+		// at the same gen a full result replaces one of online
+		// clients only
+		if (e->gen <= gen) {
+			cvector_free(e->vec);
+			e->vec = vec;
+			e->gen = gen;
+			vec    = NULL;
+		}
+		match_cache_unlink(s, e);
+		match_cache_push_front(s, e);
+		pthread_mutex_unlock(&s->mtx);
+		cvector_free(vec);
+		return;
+	}
+
+	e = (match_cache_entry *) zmalloc(sizeof(match_cache_entry));
+	if (e == NULL) {
+		pthread_mutex_unlock(&s->mtx);
+		log_err("Memory alloc failed!");
+		cvector_free(vec);
+		return;
+	}
+	e->topic = zstrdup(topic);
+	e->hash  = hash;
+	e->gen   = gen;
+	e->vec   = vec;
+	e->hnext = s->buckets[hash & s->mask];
+
+	s->buckets[hash & s->mask] = e;
+	match_cache_push_front(s, e);
+	if (++s->size > s->cap) {
+		match_cache_evict(s, s->tail);
+	}
+	pthread_mutex_unlock(&s->mtx);
+}
+
+static size_t
+match_cache_size(dbtree_match_cache *cache)
+{
+	size_t size = 0;
+	for (int i = 0; i < MATCH_CACHE_SHARDS; i++) {
+		match_cache_shard *s = &cache->shards[i];
+		pthread_mutex_lock(&s->mtx);
+		size += s->size;
+		pthread_mutex_unlock(&s->mtx);
+	}
+	return size;
+}
+
+/*
+ * Offline message queues, one bounded nano_lmq per session. Sessions are
+ * spread on shards by session id, a shard is a chained hash table with its
+ * own mutex, so publishers to different sessions never share a lock. A
+ * queue starts small and doubles until it reaches cap, cap 0 means it is
+ * unbounded. mem counts the bytes of queued messages given by the
+ * msg_size hook of reap, the reaper expires old messages and evicts the
+ * oldest of each queue while mem is above its limit. With a msg_expire
+ * hook the deadline of each message rides in exp, in step with lmq, and
+ * a queue holding one gone by is sifted in full.
+ */
+#define SESSION_STORE_SHARDS 64
+#define SESSION_QUEUE_INIT 8
+
+typedef struct session_queue session_queue;
+
+struct session_queue {
+	uint32_t       session_id;
+	nano_lmq *     lmq;
+	nano_lmq *     exp;      // deadlines of lmq as uintptr_t, or NULL
+	uint64_t       next_exp; // earliest deadline in exp, 0 none
+	session_queue *next;
+};
+
+typedef struct {
+	pthread_mutex_t mtx;
+	session_queue **buckets;
+	size_t          mask;
+	size_t          cnt;
+} session_store_shard;
+
+struct dbtree_session_store {
+	session_store_shard     shards[SESSION_STORE_SHARDS];
+	size_t                  cap;
+	dbtree_session_overflow overflow;
+	void                    (*free_msg)(void *msg);
+	dbtree_session_persist  persist;
+	dbtree_session_reap     reap;
+	atomic_size_t           mem;
+	atomic_size_t           reap_shard; // next shard of the reaper
+	atomic_uint_fast64_t    dropped;
+	atomic_uint_fast64_t    rejected;
+	atomic_uint_fast64_t    expired;
+};
+
+static inline session_store_shard *
+session_store_shard_of(dbtree_session_store *store, uint32_t id)
+{
+	return &store->shards[(id * 2654435761u) >> 26];
+}
+
+static inline size_t
+session_store_slot(uint32_t id, size_t mask)
+{
+	return (size_t) (id * 0x9E3779B1u) & mask;
+}
+
+static inline size_t
+session_msg_size(dbtree_session_store *store, void *msg)
+{
+	return store->reap.msg_size ? store->reap.msg_size(msg) : 0;
+}
+
+static inline void *
+session_exp_pack(uint64_t t)
+{
+	return (void *) (uintptr_t) (t > UINTPTR_MAX ? UINTPTR_MAX : t);
+}
+
+// put msg to q, its deadline to q->exp, there is room in both
+static int
+session_queue_putq(dbtree_session_store *store, session_queue *q, void *msg)
+{
+	uint64_t t = 0;
+
+	if (nano_lmq_putq(q->lmq, msg) != 0) {
+		return -1;
+	}
+	if (q->exp != NULL) {
+		t = store->reap.msg_expire(msg);
+		nano_lmq_putq(q->exp, session_exp_pack(t));
+	}
+	if (t != 0 && (q->next_exp == 0 || t < q->next_exp)) {
+		q->next_exp = t;
+	}
+	return 0;
+}
 
-			for (int j = 0; j < cvector_size(nodes[i]->child);
-			     j++) {
-				cvector_push_back(
-				    nodes_t, (nodes[i]->child)[j]);
-			}
+static int
+session_queue_getq(session_queue *q, void **msg, uint64_t *t)
+{
+	void *e = NULL;
+
+	if (nano_lmq_getq(q->lmq, msg) != 0) {
+		return -1;
+	}
+	if (q->exp != NULL) {
+		nano_lmq_getq(q->exp, &e);
+	}
+	if (t != NULL) {
+		*t = (uintptr_t) e;
+	}
+	return 0;
+}
+
+static dbtree_session_store *
+session_store_new(void)
+{
+	dbtree_session_store *store =
+	    (dbtree_session_store *) zmalloc(sizeof(dbtree_session_store));
+	if (store == NULL) {
+		log_err("Memory alloc failed!");
+		return NULL;
+	}
+	memset(store, 0, sizeof(dbtree_session_store));
+	store->cap      = DBTREE_SESSION_QUEUE_SIZE;
+	store->overflow = SESSION_DROP_OLDEST;
+
+	for (int i = 0; i < SESSION_STORE_SHARDS; i++) {
+		session_store_shard *s = &store->shards[i];
+		pthread_mutex_init(&s->mtx, NULL);
+		s->buckets = (session_queue **) zmalloc(sizeof(session_queue *));
+		s->buckets[0] = NULL;
+		s->mask       = 0;
+	}
+
+	return store;
+}
+
+static void
+session_queue_free(dbtree_session_store *store, session_queue *q)
+{
+	void *msg = NULL;
+
+	while (session_queue_getq(q, &msg, NULL) == 0) {
+		atomic_fetch_sub(&store->mem, session_msg_size(store, msg));
+		if (store->free_msg) {
+			store->free_msg(msg);
 		}
-		printf("\n");
-		cvector_free(nodes);
-		nodes = NULL;
+	}
+	nano_lmq_fini(q->lmq);
+	NANO_FREE_STRUCT(q->lmq);
+	if (q->exp != NULL) {
+		nano_lmq_fini(q->exp);
+		NANO_FREE_STRUCT(q->exp);
+	}
+	zfree(q);
+}
 
-		for (int i = 0; i < cvector_size(nodes_t); i++) {
-			printf(node_fmt, nodes_t[i]->topic);
+static void
+session_store_free(dbtree_session_store *store)
+{
+	if (store == NULL) {
+		return;
+	}
 
-			for (int j = 0; j < cvector_size(nodes_t[i]->child);
-			     j++) {
-				cvector_push_back(
-				    nodes, (nodes_t[i]->child)[j]);
+	for (int i = 0; i < SESSION_STORE_SHARDS; i++) {
+		session_store_shard *s = &store->shards[i];
+		for (size_t b = 0; b <= s->mask; b++) {
+			session_queue *q = s->buckets[b];
+			while (q) {
+				session_queue *next = q->next;
+				session_queue_free(store, q);
+				q = next;
 			}
 		}
-		printf("\n");
-		cvector_free(nodes_t);
-		nodes_t = NULL;
+		zfree(s->buckets);
+		pthread_mutex_destroy(&s->mtx);
 	}
-	pthread_rwlock_unlock(&(db->rwlock));
-	puts("___________PRINT_DB_TREE__________");
+	zfree(store);
+}
+
+static void
+session_store_rehash(session_store_shard *s)
+{
+	size_t          nb      = (s->mask + 1) << 1;
+	session_queue **buckets = (session_queue **) zmalloc(
+	    sizeof(session_queue *) * nb);
+	if (buckets == NULL) {
+		return;
+	}
+	memset(buckets, 0, sizeof(session_queue *) * nb);
+
+	for (size_t b = 0; b <= s->mask; b++) {
+		session_queue *q = s->buckets[b];
+		while (q) {
+			session_queue *next = q->next;
+			size_t         slot = session_store_slot(q->session_id, nb - 1);
+			q->next             = buckets[slot];
+			buckets[slot]       = q;
+			q                   = next;
+		}
+	}
+
+	zfree(s->buckets);
+	s->buckets = buckets;
+	s->mask    = nb - 1;
 }
-#endif
 
 /**
- * @brief skip_wildcard - To get left boundry of binary search
- * @param node - dbtree_node
- * @return l - left boundry
+ * @brief session_store_get - Find queue of session in shard s, the caller
+ * holds the mutex of s.
+ * @param store - dbtree_session_store
+ * @param s - shard of session_id
+ * @param session_id - session id
+ * @param create - create the queue if it is not found
+ * @return session_queue or NULL
  */
-static int
-skip_wildcard(dbtree_node *node)
+static session_queue *
+session_store_get(dbtree_session_store *store, session_store_shard *s,
+    uint32_t session_id, bool create)
 {
-	int l = 0;
-	if (node->plus != -1) {
-		l++;
+	session_queue *q = s->buckets[session_store_slot(session_id, s->mask)];
+
+	for (; q; q = q->next) {
+		if (q->session_id == session_id) {
+			return q;
+		}
 	}
-	if (node->well != -1) {
-		l++;
+	if (!create) {
+		return NULL;
 	}
 
-	return l;
+	q = (session_queue *) zmalloc(sizeof(session_queue));
+	if (q == NULL) {
+		log_err("Memory alloc failed!");
+		return NULL;
+	}
+	// nano_lmq_init frees lmq itself on failure
+	size_t init = SESSION_QUEUE_INIT;
+	if (store->cap != 0 && store->cap < init) {
+		init = store->cap;
+	}
+	q->lmq = nano_alloc(sizeof(nano_lmq));
+	if (q->lmq == NULL || nano_lmq_init(q->lmq, init) != 0) {
+		log_err("Memory alloc failed!");
+		zfree(q);
+		return NULL;
+	}
+	q->exp      = NULL;
+	q->next_exp = 0;
+	if (store->reap.msg_expire != NULL) {
+		q->exp = nano_alloc(sizeof(nano_lmq));
+		if (q->exp == NULL || nano_lmq_init(q->exp, init) != 0) {
+			log_err("Memory alloc failed!");
+			nano_lmq_fini(q->lmq);
+			NANO_FREE_STRUCT(q->lmq);
+			zfree(q);
+			return NULL;
+		}
+	}
+	q->session_id = session_id;
+
+	if (s->cnt + 1 > s->mask + 1) {
+		session_store_rehash(s);
+	}
+	size_t slot   = session_store_slot(session_id, s->mask);
+	q->next       = s->buckets[slot];
+	s->buckets[slot] = q;
+	s->cnt++;
+
+	return q;
 }
 
 /**
- * @brief find_next - check if this topic is exist in this level.
- * @param node - dbtree_node
- * @param equal - a return state value
- * @param topic_queue - topic queue
- * @param index - search index will be return
- * @return dbtree_node we find or original node
+ * @brief session_store_put - Queue msg for a session, applying the
+ * overflow policy once its queue is full.
+ * @param store - dbtree_session_store
+ * @param session_id - session id
+ * @param msg - message
+ * @return true if msg is queued, the queue holds a reference of msg then
  */
-// TODO topic or topic queue
-// TODO return NULL if no find ?
-static dbtree_node *
-find_next(dbtree_node *node, bool *equal, char **topic_queue, int *index)
+static bool
+session_store_put(dbtree_session_store *store, uint32_t session_id, void *msg)
+{
+	session_store_shard *s       = session_store_shard_of(store, session_id);
+	void *               evicted = NULL;
+	bool                 queued  = false;
+
+	pthread_mutex_lock(&s->mtx);
+	session_queue *q = session_store_get(store, s, session_id, true);
+	if (q == NULL) {
+		pthread_mutex_unlock(&s->mtx);
+		return false;
+	}
+
+	if (nano_lmq_full(q->lmq)) {
+		size_t len = nano_lmq_len(q->lmq);
+		if (store->cap == 0 || len < store->cap) {
+			size_t cap = len << 1;
+			if (store->cap != 0 && cap > store->cap) {
+				cap = store->cap;
+			}
+			// exp first, it always has room for what lmq takes
+			if (q->exp == NULL ||
+			    nano_lmq_resize(q->exp, cap) == 0) {
+				nano_lmq_resize(q->lmq, cap);
+			}
+		}
+	}
+
+	if (!nano_lmq_full(q->lmq)) {
+		queued = session_queue_putq(store, q, msg) == 0;
+	} else if (store->overflow == SESSION_DROP_OLDEST) {
+		session_queue_getq(q, &evicted, NULL);
+		atomic_fetch_sub(&store->mem, session_msg_size(store, evicted));
+		queued = session_queue_putq(store, q, msg) == 0;
+	}
+	if (queued) {
+		atomic_fetch_add(&store->mem, session_msg_size(store, msg));
+	}
+	// logged under the shard lock so a put never passes the take after it
+	if (queued && store->persist.put) {
+		store->persist.put(session_id, msg, store->persist.arg);
+	}
+	pthread_mutex_unlock(&s->mtx);
+
+	if (evicted != NULL) {
+		atomic_fetch_add(&store->dropped, 1);
+		if (store->free_msg) {
+			store->free_msg(evicted);
+		}
+	} else if (!queued && store->overflow == SESSION_REJECT) {
+		atomic_fetch_add(&store->rejected, 1);
+		log_warn("Session queue of %u is full, message rejected",
+		    session_id);
+	} else if (!queued) {
+		atomic_fetch_add(&store->dropped, 1);
+	}
+
+	return queued;
+}
+
+/**
+ * @brief session_store_take - Take all messages queued for a session and
+ * drop its queue.
+ * @param store - dbtree_session_store
+ * @param session_id - session id
+ * @return cvector of messages, oldest first, or NULL
+ */
+static void **
+session_store_take(dbtree_session_store *store, uint32_t session_id)
 {
-	if (node == NULL || node->child == NULL) {
+	session_store_shard *s    = session_store_shard_of(store, session_id);
+	session_queue **     prev = NULL;
+	session_queue *      q    = NULL;
+	cvector(void *) msgs      = NULL;
+	void *msg                 = NULL;
+
+	pthread_mutex_lock(&s->mtx);
+	prev = &s->buckets[session_store_slot(session_id, s->mask)];
+	for (q = *prev; q; prev = &q->next, q = q->next) {
+		if (q->session_id == session_id) {
+			*prev = q->next;
+			s->cnt--;
+			break;
+		}
+	}
+	if (q != NULL && store->persist.take) {
+		store->persist.take(session_id, store->persist.arg);
+	}
+	pthread_mutex_unlock(&s->mtx);
+
+	if (q == NULL) {
+		log_info("Not find session queue of %u", session_id);
 		return NULL;
 	}
 
-	cvector(dbtree_node *) t = node->child;
+	if (nano_lmq_len(q->lmq) > 0) {
+		cvector_grow(msgs, nano_lmq_len(q->lmq));
+	}
+	while (session_queue_getq(q, &msg, NULL) == 0) {
+		atomic_fetch_sub(&store->mem, session_msg_size(store, msg));
+		cvector_push_back(msgs, msg);
+	}
+	session_queue_free(store, q);
 
-	int l = skip_wildcard(node);
+	return msgs;
+}
 
-	if (true ==
-	    binary_search((void **) t, l, index, *topic_queue, node_cmp)) {
-		*equal = true;
-		return t[*index];
+/**
+ * @brief session_store_put_all - Queue msg once for every session in ids.
+ * @param store - dbtree_session_store
+ * @param ids - session ids, may repeat
+ * @param msg - message
+ * @return count of sessions msg is queued for
+ */
+static size_t
+session_store_put_all(dbtree_session_store *store, uint32_t *ids, void *msg)
+{
+	pipe_set *set = &epoch_rec_get()->dedup;
+	size_t    cnt = 0;
+
+	pipe_set_begin(set, cvector_size(ids));
+	for (size_t i = 0; i < cvector_size(ids); i++) {
+		if (pipe_set_add(set, ids[i]) &&
+		    session_store_put(store, ids[i], msg)) {
+			cnt++;
+		}
 	}
 
-	return node;
+	return cnt;
+}
+
+/**
+ * @brief session_queue_reap - Take the expired messages at the head of q
+ * and, while the store is above its memory limit, its oldest one. Once a
+ * deadline of msg_expire passed, the messages past theirs are taken from
+ * all of q.
+ * @param store - dbtree_session_store
+ * @param q - session_queue, its shard is locked by the caller
+ * @param now - time in the clock of the msg_time hook
+ * @param evicted - cvector the messages taken are pushed to
+ * @return void
+ */
+static void
+session_queue_reap(dbtree_session_store *store, session_queue *q,
+    uint64_t now, void ***evicted)
+{
+	dbtree_session_reap *reap = &store->reap;
+	void *               msg  = NULL;
+	uint64_t             t;
+	size_t               sz;
+
+	while (nano_lmq_peek(q->lmq, &msg) == 0) {
+		bool old = reap->max_age > 0 && reap->msg_time &&
+		    reap->msg_time(msg) + reap->max_age <= now;
+		bool over = reap->mem_limit > 0 &&
+		    atomic_load(&store->mem) > reap->mem_limit;
+		if (!old && !over) {
+			break;
+		}
+		session_queue_getq(q, &msg, NULL);
+		sz = session_msg_size(store, msg);
+		atomic_fetch_sub(&store->mem, sz);
+		atomic_fetch_add(old ? &store->expired : &store->dropped, 1);
+		cvector_push_back((*evicted), msg);
+		if (!old) {
+			break; // one per queue and pass, the oldest of each go
+		}
+	}
+
+	if (q->next_exp == 0 || q->next_exp > now) {
+		return;
+	}
+	// put back the others in order, msg_expire is never asked again
+	q->next_exp = 0;
+	for (size_t n = nano_lmq_len(q->lmq); n > 0; n--) {
+		session_queue_getq(q, &msg, &t);
+		if (t != 0 && t <= now) {
+			sz = session_msg_size(store, msg);
+			atomic_fetch_sub(&store->mem, sz);
+			atomic_fetch_add(&store->expired, 1);
+			cvector_push_back((*evicted), msg);
+			continue;
+		}
+		nano_lmq_putq(q->lmq, msg);
+		nano_lmq_putq(q->exp, session_exp_pack(t));
+		if (t != 0 && (q->next_exp == 0 || t < q->next_exp)) {
+			q->next_exp = t;
+		}
+	}
+}
+
+size_t
+dbtree_reap_session_msg(dbtree *db, uint64_t now, size_t shards)
+{
+	dbtree_session_store *store = db->session_store;
+	cvector(void *) evicted     = NULL;
+	size_t cnt                  = 0;
+
+	if (store->reap.max_age == 0 && store->reap.mem_limit == 0 &&
+	    store->reap.msg_expire == NULL) {
+		return 0;
+	}
+	for (size_t i = 0; i < shards && i < SESSION_STORE_SHARDS; i++) {
+		size_t idx = atomic_fetch_add(&store->reap_shard, 1) %
+		    SESSION_STORE_SHARDS;
+		session_store_shard *s = &store->shards[idx];
+
+		pthread_mutex_lock(&s->mtx);
+		for (size_t b = 0; b <= s->mask; b++) {
+			session_queue **prev = &s->buckets[b];
+			while (*prev) {
+				session_queue *q = *prev;
+				session_queue_reap(store, q, now, &evicted);
+				if (!nano_lmq_empty(q->lmq)) {
+					prev = &q->next;
+					continue;
+				}
+				*prev = q->next;
+				s->cnt--;
+				if (store->persist.take) {
+					store->persist.take(
+					    q->session_id, store->persist.arg);
+				}
+				session_queue_free(store, q);
+			}
+		}
+		pthread_mutex_unlock(&s->mtx);
+
+		// freed out of the lock, publishers may wait on it
+		cnt += cvector_size(evicted);
+		for (size_t k = 0; k < cvector_size(evicted); k++) {
+			if (store->free_msg) {
+				store->free_msg(evicted[k]);
+			}
+		}
+		cvector_set_size(evicted, 0);
+	}
+	cvector_free(evicted);
+
+	return cnt;
+}
+
+/**
+ * @brief dbtree_gen_load - Generation of dbtree, odd while a writer is
+ * changing clients or sessions.
+ * @param db - dbtree
+ * @return generation
+ */
+static inline uint64_t
+dbtree_gen_load(dbtree *db)
+{
+	return __atomic_load_n(&db->gen, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief dbtree_gen_bump - Called by writers under rwlock before and
+ * after changing clients or sessions.
+ * @param db - dbtree
+ * @return void
+ */
+static inline void
+dbtree_gen_bump(dbtree *db)
+{
+	__atomic_add_fetch(&db->gen, 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+print_dbtree_node(dbtree_node *node)
+{
+	printf("topic:    %s\n", node->topic);
+
+	if (node->clients) {
+		cvector(dbtree_client *) clients = node->clients;
+		for (int i = 0; i < cvector_size(clients); i++) {
+			printf("pipe_id:       %d\n", clients[i]->pipe_id);
+			printf(
+			    "session_id:       %d\n", clients[i]->session_id);
+		}
+	}
+}
+
+/**
+ * @brief dbtree_print - Print dbtree for debug.
+ * @param dbtree - dbtree
+ * @return void
+ */
+#ifdef NOLOG
+void
+dbtree_print(dbtree *db)
+{
+	return;
+}
+#else
+void
+dbtree_print(dbtree *db)
+{
+	assert(db);
+	dbtree_read_enter();
+
+	dbtree_node *node = node_load(db->root);
+	dbtree_node **nodes = NULL;
+	dbtree_node **nodes_t = NULL;
+
+	const char node_fmt[] = "[%-5s]\t";
+	cvector_push_back(nodes, node);
+	puts("___________PRINT_DB_TREE__________");
+	child_iter   it;
+	dbtree_node *c = NULL;
+	while (!cvector_empty(nodes)) {
+		for (int i = 0; i < cvector_size(nodes); i++) {
+			printf(node_fmt, nodes[i]->topic);
+
+			child_iter_init(&it, nodes[i]);
+			while ((c = child_iter_next(&it)) != NULL) {
+				cvector_push_back(nodes_t, c);
+			}
+		}
+		printf("\n");
+		cvector_free(nodes);
+		nodes = NULL;
+
+		for (int i = 0; i < cvector_size(nodes_t); i++) {
+			printf(node_fmt, nodes_t[i]->topic);
+
+			child_iter_init(&it, nodes_t[i]);
+			while ((c = child_iter_next(&it)) != NULL) {
+				cvector_push_back(nodes, c);
+			}
+		}
+		printf("\n");
+		cvector_free(nodes_t);
+		nodes_t = NULL;
+	}
+	dbtree_read_exit();
+	puts("___________PRINT_DB_TREE__________");
 }
+#endif
 
 /**
  * @brief dbtree_client_new - create a client
  * @param id - client id
  * @param ctxt - client ctxt
+ * @param pipe_id - pipe id
+ * @param qos - granted qos
  * @return dbtree_client*
  */
 static dbtree_client *
-dbtree_client_new(uint32_t id, void *ctxt, uint32_t pipe_id)
+dbtree_client_new(uint32_t id, void *ctxt, uint32_t pipe_id, uint8_t qos)
 {
 	dbtree_client *client = NULL;
 	client = (dbtree_client *) zmalloc(sizeof(dbtree_client));
+	nano_mem_add(NANO_MEM_TREE, sizeof(dbtree_client));
 
 	log_info("New client pipe_id: [%d], session id: [%d]", pipe_id, id);
 	client->session_id = id;
 	client->pipe_id    = pipe_id;
 	client->ctxt       = ctxt;
+	client->qos        = qos;
 	return client;
 }
 
@@ -370,33 +2194,158 @@ dbtree_client_free(dbtree_client *client)
 		}
 
 		zfree(client);
+		nano_mem_sub(NANO_MEM_TREE, sizeof(dbtree_client));
 		client = NULL;
 	}
 
 	return ctxt;
 }
 
+/*
+ * Nodes are carved from slabs of NODE_SLAB_SIZE bytes aligned to their
+ * size, the slab of a node is found by masking its address. Nodes start
+ * NODE_SLAB_HEAD bytes in and are 96 bytes apart, so the hot first 32
+ * bytes of a node never straddle a cache line. A slab keeps the free list
+ * of its nodes, the slabs with a free node are on a list, and a slab is
+ * given back once all of its nodes are freed. The pool is shared by all
+ * trees since nodes are freed by the reclaim of any thread.
+ */
+#define NODE_SLAB_SIZE 8192
+#define NODE_SLAB_HEAD 64
+#define NODE_SLAB_NODES \
+	((NODE_SLAB_SIZE - NODE_SLAB_HEAD) / sizeof(dbtree_node))
+
+typedef struct node_slab node_slab;
+
+struct node_slab {
+	node_slab *prev; // in node_partial if it has a free node
+	node_slab *next;
+	void *     free; // freed nodes, linked through their first word
+	uint32_t   used; // nodes carved so far
+	uint32_t   live;
+};
+
+static pthread_mutex_t node_mtx     = PTHREAD_MUTEX_INITIALIZER;
+static node_slab *     node_partial = NULL;
+
+static inline void
+node_slab_unlink(node_slab *slab)
+{
+	if (slab->prev) {
+		slab->prev->next = slab->next;
+	} else {
+		node_partial = slab->next;
+	}
+	if (slab->next) {
+		slab->next->prev = slab->prev;
+	}
+	slab->prev = slab->next = NULL;
+}
+
+static inline void
+node_slab_link(node_slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = node_partial;
+	if (node_partial) {
+		node_partial->prev = slab;
+	}
+	node_partial = slab;
+}
+
+static inline bool
+node_slab_full(node_slab *slab)
+{
+	return slab->free == NULL && slab->used == NODE_SLAB_NODES;
+}
+
+static dbtree_node *
+node_alloc(void)
+{
+	node_slab *slab;
+	void *     node;
+
+	pthread_mutex_lock(&node_mtx);
+	if ((slab = node_partial) == NULL) {
+		// out of memory is fatal, as in zmalloc
+		if (posix_memalign((void **) &slab, NODE_SLAB_SIZE,
+		        NODE_SLAB_SIZE) != 0) {
+			log_err("Node slab can not be allocated");
+			abort();
+		}
+		memset(slab, 0, sizeof(node_slab));
+		node_slab_link(slab);
+		nano_mem_add(NANO_MEM_TREE, NODE_SLAB_SIZE);
+	}
+	if (slab->free) {
+		node       = slab->free;
+		slab->free = *(void **) node;
+	} else {
+		node = (uint8_t *) slab + NODE_SLAB_HEAD +
+		    sizeof(dbtree_node) * slab->used++;
+	}
+	slab->live++;
+	if (node_slab_full(slab)) {
+		node_slab_unlink(slab);
+	}
+	pthread_mutex_unlock(&node_mtx);
+
+	return (dbtree_node *) node;
+}
+
+static void
+node_release(dbtree_node *node)
+{
+	node_slab *slab =
+	    (node_slab *) ((uintptr_t) node & ~(uintptr_t)(NODE_SLAB_SIZE - 1));
+
+	pthread_mutex_lock(&node_mtx);
+	if (node_slab_full(slab)) {
+		node_slab_link(slab);
+	}
+	*(void **) node = slab->free;
+	slab->free      = node;
+	// keep one slab around, trees often grow back
+	if (--slab->live == 0 && (slab->prev || slab->next)) {
+		node_slab_unlink(slab);
+		free(slab);
+		nano_mem_sub(NANO_MEM_TREE, NODE_SLAB_SIZE);
+	}
+	pthread_mutex_unlock(&node_mtx);
+}
+
 /**
  * @brief dbtree_node_new - create a node
- * @param topic - topic
+ * @param level - topic level
  * @return dbtree_node*
  */
 static dbtree_node *
-dbtree_node_new(char *topic)
+dbtree_node_new(topic_level *level)
 {
-	dbtree_node *node = NULL;
-	node              = (dbtree_node *) zmalloc(sizeof(dbtree_node));
-	node->topic       = zstrdup(topic);
+	dbtree_node *node = node_alloc();
+
+	if (level->len < DBTREE_NODE_INLINE) {
+		node->topic = node->name;
+	} else {
+		node->topic = (char *) zmalloc(level->len + 1);
+		nano_mem_add(NANO_MEM_TREE, level->len + 1);
+	}
+	memcpy(node->topic, level->s, level->len);
+	node->topic[level->len] = '\0';
+	node->len               = level->len;
+	node->hash              = level_hash(level->s, level->len);
 	log_info("New node: [%s]", node->topic);
 
-	node->retain  = NULL;
-	node->child   = NULL;
-	node->clients = NULL;
-	node->well    = -1;
-	node->plus    = -1;
+	node->wild        = NULL;
+	node->child       = NULL;
+	node->child_index = NULL;
+	node->clients     = NULL;
+	node->well        = -1;
+	node->plus        = -1;
+	node->rr          = 0;
 
 	node->session_vector = NULL;
-	pthread_rwlock_init(&(node->rwlock), NULL);
+	node->shared         = NULL;
 	return node;
 }
 
@@ -409,20 +2358,30 @@ static void
 dbtree_node_free(dbtree_node *node)
 {
 	if (node) {
-		if (node->topic) {
-			log_info("Delete node: [%s]", node->topic);
+		log_info("Delete node: [%s]", node->topic);
+		if (node->topic != node->name) {
+			nano_mem_sub(NANO_MEM_TREE, node->len + 1);
 			zfree(node->topic);
-			node->topic = NULL;
 		}
+		node->topic = NULL;
 		if (node->session_vector) {
 			cvector_free(node->session_vector);
 		}
-		pthread_rwlock_destroy(&(node->rwlock));
-		zfree(node);
+		cvector_free(node->child);
+		zfree(node->child_index);
+		cvector_free(node->clients);
+		cvector_free(node->shared);
+		node_release(node);
 		node = NULL;
 	}
 }
 
+static void
+dbtree_node_retire_cb(void *node)
+{
+	dbtree_node_free((dbtree_node *) node);
+}
+
 /**
  * @brief dbtree_create - Create a dbtree, declare a global variable as func
  * para
@@ -435,17 +2394,121 @@ dbtree_create(dbtree **db)
 	*db = (dbtree *) zmalloc(sizeof(dbtree));
 	memset(*db, 0, sizeof(dbtree));
 
-	dbtree_node *node       = dbtree_node_new("\0");
-	(*db)->root             = node;
-	(*db)->session_msg_list = NULL;
+	topic_level  root       = { .s = "", .len = 0 };
+	dbtree_node *node       = dbtree_node_new(&root);
+	(*db)->root          = node;
+	(*db)->session_store = session_store_new();
+	(*db)->wild          = wild_index_new();
 	pthread_rwlock_init(&((*db)->rwlock), NULL);
-	pthread_rwlock_init(&((*db)->rwlock_session), NULL);
-#ifdef RANDOM
-	srand(time(NULL));
-#endif
+	pthread_mutex_init(&((*db)->snapshot_mtx), NULL);
+	(*db)->shared_strategy = SHARED_ROUND_ROBIN;
 	return;
 }
 
+void
+dbtree_match_cache_init(dbtree *db, size_t capacity)
+{
+	if (db == NULL || capacity == 0 || db->cache) {
+		return;
+	}
+	db->cache = match_cache_new(capacity);
+	log_info("Match cache enabled, capacity: %zu", capacity);
+}
+
+void
+dbtree_get_match_cache_stats(dbtree *db, dbtree_match_cache_stats *stats)
+{
+	dbtree_match_cache *cache = db->cache;
+
+	memset(stats, 0, sizeof(dbtree_match_cache_stats));
+	if (cache == NULL) {
+		return;
+	}
+	stats->hit      = atomic_load(&cache->hit);
+	stats->miss     = atomic_load(&cache->miss);
+	stats->size     = match_cache_size(cache);
+	stats->capacity = cache->cap;
+}
+
+void
+dbtree_set_session_queue(dbtree *db, size_t cap,
+    dbtree_session_overflow overflow, void (*free_msg)(void *msg))
+{
+	db->session_store->cap      = cap;
+	db->session_store->overflow = overflow;
+	db->session_store->free_msg = free_msg;
+}
+
+void
+dbtree_set_session_reap(dbtree *db, const dbtree_session_reap *reap)
+{
+	db->session_store->reap = *reap;
+}
+
+void
+dbtree_set_session_persist(dbtree *db, const dbtree_session_persist *persist)
+{
+	dbtree_session_store *store = db->session_store;
+
+	for (int i = 0; i < SESSION_STORE_SHARDS; i++) {
+		pthread_mutex_lock(&store->shards[i].mtx);
+	}
+	if (persist) {
+		store->persist = *persist;
+	} else {
+		memset(&store->persist, 0, sizeof(dbtree_session_persist));
+	}
+	for (int i = SESSION_STORE_SHARDS - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&store->shards[i].mtx);
+	}
+}
+
+int
+dbtree_foreach_session_msg(dbtree *db,
+    int (*cb)(uint32_t session_id, void *msg, void *arg), void *arg)
+{
+	dbtree_session_store *store = db->session_store;
+	int                   rv    = 0;
+
+	for (int i = 0; i < SESSION_STORE_SHARDS && rv == 0; i++) {
+		session_store_shard *s = &store->shards[i];
+		pthread_mutex_lock(&s->mtx);
+		for (size_t b = 0; b <= s->mask && rv == 0; b++) {
+			for (session_queue *q = s->buckets[b]; q && rv == 0;
+			     q                = q->next) {
+				nano_lmq *lmq = q->lmq;
+				for (size_t k = 0; k < lmq->lmq_len && rv == 0;
+				     k++) {
+					void *msg = lmq->lmq_msgs[(lmq->lmq_get +
+					    k) & lmq->lmq_mask];
+					rv = cb(q->session_id, msg, arg);
+				}
+			}
+		}
+		pthread_mutex_unlock(&s->mtx);
+	}
+
+	return rv;
+}
+
+void
+dbtree_get_session_queue_stats(dbtree *db, dbtree_session_queue_stats *stats)
+{
+	dbtree_session_store *store = db->session_store;
+
+	memset(stats, 0, sizeof(dbtree_session_queue_stats));
+	for (int i = 0; i < SESSION_STORE_SHARDS; i++) {
+		session_store_shard *s = &store->shards[i];
+		pthread_mutex_lock(&s->mtx);
+		stats->sessions += s->cnt;
+		pthread_mutex_unlock(&s->mtx);
+	}
+	stats->dropped  = atomic_load(&store->dropped);
+	stats->rejected = atomic_load(&store->rejected);
+	stats->expired  = atomic_load(&store->expired);
+	stats->memory   = atomic_load(&store->mem);
+}
+
 /**
  * @brief dbtree_destory - Destory dbtree tree
  * @param dbtree - dbtree
@@ -457,26 +2520,91 @@ dbtree_destory(dbtree *db)
 	if (db) {
 		dbtree_node_free(db->root);
 
-		for (int i = 0; i < cvector_size(db->session_msg_list); i++) {
-			dbtree_session_msg *s = db->session_msg_list[i];
-			if (s) {
-
-				if (s->msg_list) {
-					cvector_free(s->msg_list);
-				}
-
-				zfree(db->session_msg_list[i]);
-			}
-		}
-		if (db->session_msg_list) {
-			cvector_free(db->session_msg_list);
-		}
+		session_store_free(db->session_store);
+		match_cache_free(db->cache);
+		wild_index_free(db->wild);
+		dbtree_snapshot_release(db->snapshot);
 		zfree(db);
 		db = NULL;
 	}
 
 	// pthread_rwlock_destroy(&(db->rwlock));
-	// pthread_rwlock_destroy(&(db->rwlock_session));
+}
+
+/**
+ * @brief shared_topic_split - Split $share/<group>/<filter>.
+ * @param topic - topic
+ * @param group - set to group name in topic
+ * @return filter in topic, NULL if topic is not a shared subscription
+ */
+static const char *
+shared_topic_split(const char *topic, topic_level *group)
+{
+	if (strncmp(topic, "$share/", 7) != 0) {
+		return NULL;
+	}
+
+	const char *g = topic + 7;
+	const char *f = strchr(g, '/');
+	if (f == NULL || f == g || f[1] == '\0') {
+		return NULL;
+	}
+
+	group->s   = g;
+	group->len = f - g;
+	return f + 1;
+}
+
+/**
+ * @brief shared_group_find - Find group in shared of filter node, only
+ * for writers.
+ * @param node - filter node
+ * @param group - group name
+ * @param create - create the group if it is not found
+ * @return group node or NULL
+ */
+static dbtree_node *
+shared_group_find(dbtree_node *node, topic_level *group, bool create)
+{
+	int index = 0;
+
+	if (binary_search((void **) node->shared, 0, &index, group, node_cmp)) {
+		return node->shared[index];
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	dbtree_node *g = dbtree_node_new(group);
+	vec_publish((void ***) &node->shared,
+	    vec_insert_copy((void **) node->shared, index, g));
+	return g;
+}
+
+/**
+ * @brief delete_shared_group - Delete group from filter node if it has
+ * no member and no session.
+ * @param node - filter node
+ * @param group - group node
+ * @return void
+ */
+static void
+delete_shared_group(dbtree_node *node, dbtree_node *group)
+{
+	int         index = 0;
+	topic_level level = { .s = group->topic, .len = group->len };
+
+	if (!cvector_empty(group->clients) ||
+	    !cvector_empty(group->session_vector)) {
+		return;
+	}
+
+	if (binary_search((void **) node->shared, 0, &index, &level, node_cmp)) {
+		log_info("Delete shared group: [%s]", group->topic);
+		vec_publish((void ***) &node->shared,
+		    vec_erase_copy((void **) node->shared, index));
+		dbtree_retire(group, dbtree_node_retire_cb);
+	}
 }
 
 /**
@@ -488,72 +2616,42 @@ dbtree_destory(dbtree *db)
 static void *
 insert_dbtree_client(dbtree_node *node, void *args)
 {
-	pthread_rwlock_wrlock(&(node->rwlock));
-
 	int            index  = 0;
 	dbtree_client *client = (dbtree_client *) args;
 
 	if (false ==
 	    binary_search((void **) node->clients, 0, &index,
 	        &(client->pipe_id), client_cmp)) {
-		if (index == cvector_size(node->clients)) {
-			cvector_push_back(node->clients, client);
-		} else {
-			cvector_insert(node->clients, index, client);
-		}
+		vec_publish((void ***) &node->clients,
+		    vec_insert_copy((void **) node->clients, index, client));
 	} else {
+		// a subscribe again replaces the granted qos, readers may see
+		// either
+		__atomic_store_n(
+		    &node->clients[index]->qos, client->qos, __ATOMIC_RELAXED);
 		// TODO lazy binding
 		dbtree_client_free(client);
 	}
 
-	pthread_rwlock_unlock(&(node->rwlock));
 	return NULL;
 }
 
 /**
- * @brief is_plus - Determine if the current topic is "#"
- * @param topic_data - topic in one level
- * @return true, if curr topic is "#"
- */
-static bool
-is_well(char *topic_data)
-{
-	if (topic_data == NULL) {
-		return false;
-	}
-	return !strcmp(topic_data, "#");
-}
-
-/**
- * @brief is_plus - Determine if the current topic is "+"
- * @param topic_data - topic in one level
- * @return true, if curr topic is "+"
- */
-static bool
-is_plus(char *topic_data)
-{
-	// TODO
-	if (topic_data == NULL) {
-		return false;
-	}
-	return !strcmp(topic_data, "+");
-}
-
-/**
- * @brief dbtree_node_insert - insert node until topic_queue is NULL
+ * @brief dbtree_node_insert - insert node until the last level
  * @param node - dbtree_node
- * @param topic_queue - topic queue position
- * @param client - client info
- * @return void
+ * @param tk - topic tokens
+ * @param lv - first level to insert
+ * @return the node of last level
  */
 static dbtree_node *
-dbtree_node_insert(dbtree_node *node, char **topic_queue)
+dbtree_node_insert(dbtree_node *node, topic_tokens *tk, int lv)
 {
-	assert(node && topic_queue);
+	assert(node && tk);
 
-	while (*topic_queue) {
+	for (; lv < tk->cnt; lv++) {
+		topic_level  level    = topic_tokens_level(tk, lv);
 		dbtree_node *new_node = NULL;
-		if (is_well(*topic_queue)) {
+		if (is_well(&level)) {
 			if (node->well != -1) {
 				new_node = node->child[node->well];
 			} else {
@@ -562,12 +2660,13 @@ dbtree_node_insert(dbtree_node *node, char **topic_queue)
 				}
 
 				node->well = 0;
-				new_node   = dbtree_node_new(*topic_queue);
-				cvector_insert(
-				    node->child, node->well, new_node);
+				new_node   = dbtree_node_new(&level);
+				vec_publish((void ***) &node->child,
+				    vec_insert_copy((void **) node->child,
+				        node->well, new_node));
 			}
 
-		} else if (is_plus(*topic_queue)) {
+		} else if (is_plus(&level)) {
 			if (node->plus != -1) {
 				new_node = node->child[node->plus];
 			} else {
@@ -576,40 +2675,20 @@ dbtree_node_insert(dbtree_node *node, char **topic_queue)
 				}
 
 				node->plus = 0;
-				new_node   = dbtree_node_new(*topic_queue);
-				cvector_insert(
-				    node->child, node->plus, new_node);
+				new_node   = dbtree_node_new(&level);
+				vec_publish((void ***) &node->child,
+				    vec_insert_copy((void **) node->child,
+				        node->plus, new_node));
 			}
 		} else {
-			int l = skip_wildcard(node);
-			if (l == cvector_size(node->child)) {
-				new_node = dbtree_node_new(*topic_queue);
-				cvector_push_back(node->child, new_node);
-
-			} else {
-				int index = 0;
-				if (false ==
-				    binary_search((void **) node->child, l,
-				        &index, *topic_queue, node_cmp)) {
-					new_node =
-					    dbtree_node_new(*topic_queue);
-
-					//  TODO
-					if (index ==
-					    cvector_size(node->child)) {
-						cvector_push_back(
-						    node->child, new_node);
-					} else {
-						cvector_insert(node->child,
-						    index, new_node);
-					}
-				} else {
-					new_node = node->child[index];
-				}
+			new_node = child_lookup(
+			    node->child, node->child_index, &level);
+			if (new_node == NULL) {
+				new_node = dbtree_node_new(&level);
+				child_insert(node, new_node);
 			}
 		}
 
-		topic_queue++;
 		node = new_node;
 	}
 
@@ -632,67 +2711,514 @@ search_insert_node(dbtree *db, char *topic, void *args,
 {
 	assert(db->root && topic);
 
-	char **topic_queue = topic_parse(topic);
-	char **for_free    = topic_queue;
+	topic_level group  = { 0 };
+	const char *filter = shared_topic_split(topic, &group);
+
+	topic_tokens tk;
+	int          lv = 0;
+	topic_tokenize(&tk, filter ? filter : topic);
+
+	pthread_rwlock_wrlock(&(db->rwlock));
+	dbtree_node *node = db->root;
+
+	for (; lv < tk.cnt; lv++) {
+		topic_level  level  = topic_tokens_level(&tk, lv);
+		dbtree_node *node_t = child_find(node, &level);
+		if (node_t == NULL) {
+			/*
+			 ** If no node is matched with topic
+			 ** insert node until the last level
+			 */
+			log_info("Insert node and client");
+			node = dbtree_node_insert(node, &tk, lv);
+			break;
+		}
+		node = node_t;
+	}
+
+	wild_index_add(db->wild, node, &tk);
+	if (filter) {
+		node = shared_group_find(node, &group, true);
+	}
+
+	dbtree_gen_bump(db);
+	void *ret = inserter(node, args);
+	dbtree_gen_bump(db);
+	pthread_rwlock_unlock(&(db->rwlock));
+	dbtree_reclaim();
+	topic_tokens_fini(&tk);
+	return ret;
+}
+
+void *
+dbtree_insert_client(
+    dbtree *db, char *topic, void *ctxt, uint32_t pipe_id, uint8_t qos)
+{
+	dbtree_client *client = dbtree_client_new(0, ctxt, pipe_id, qos);
+	return search_insert_node(db, topic, client, insert_dbtree_client);
+}
+
+typedef struct {
+	const char *filter;
+	topic_level group;
+	size_t      idx;
+} insert_item;
+
+static int
+insert_item_cmp(const void *x_, const void *y_)
+{
+	const insert_item *x = (const insert_item *) x_;
+	const insert_item *y = (const insert_item *) y_;
+
+	return strcmp(x->filter, y->filter);
+}
+
+static inline bool
+tokens_level_eq(topic_tokens *x, topic_tokens *y, int lv)
+{
+	return x->spans[lv].len == y->spans[lv].len &&
+	    memcmp(x->topic + x->spans[lv].off, y->topic + y->spans[lv].off,
+	        x->spans[lv].len) == 0;
+}
+
+static void
+insert_item_set(insert_item *item, const char *topic, size_t idx)
+{
+	memset(&item->group, 0, sizeof(topic_level));
+	item->filter = shared_topic_split(topic, &item->group);
+	if (item->filter == NULL) {
+		item->filter = topic;
+	}
+	item->idx = idx;
+}
+
+// put the subscription of items[i] on its node, or its shared group
+typedef void (*batch_put)(dbtree_node *node, size_t idx, void *arg);
+
+/**
+ * @brief batch_insert - Insert the node of each item and run put on it,
+ * with the tree locked once. Items are sorted so that the walks of
+ * neighbours share their common prefix.
+ * @param db - dbtree
+ * @param items - insert_item, sorted here
+ * @param n - count of items
+ * @param put - batch_put
+ * @param arg - passed to put
+ * @return void
+ */
+static void
+batch_insert(
+    dbtree *db, insert_item *items, size_t n, batch_put put, void *arg)
+{
+	dbtree_node **path  = NULL;
+	size_t        depth = 0;
+	topic_tokens  tks[2];
+	topic_tokens *prev = NULL;
+
+	// neighbours share the longest prefix
+	qsort(items, n, sizeof(insert_item), insert_item_cmp);
+
+	pthread_rwlock_wrlock(&(db->rwlock));
+	dbtree_gen_bump(db);
+	for (size_t i = 0; i < n; i++) {
+		topic_tokens *tk = &tks[i & 1];
+		int           lv = 0;
+
+		topic_tokenize(tk, items[i].filter);
+		if (depth < (size_t) tk->cnt + 1) {
+			depth = tk->cnt + 1;
+			path  = (dbtree_node **) zrealloc(
+			     path, sizeof(dbtree_node *) * depth);
+		}
+		// path[lv] is the node of the first lv levels of prev
+		path[0] = db->root;
+		if (prev) {
+			while (lv < tk->cnt && lv < prev->cnt &&
+			    tokens_level_eq(tk, prev, lv)) {
+				lv++;
+			}
+		}
+
+		dbtree_node *node = path[lv];
+		for (; lv < tk->cnt; lv++) {
+			topic_level  level  = topic_tokens_level(tk, lv);
+			dbtree_node *node_t = child_find(node, &level);
+			if (node_t == NULL) {
+				// insert this level only, to keep path whole
+				int cnt = tk->cnt;
+				tk->cnt = lv + 1;
+				node_t  = dbtree_node_insert(node, tk, lv);
+				tk->cnt = cnt;
+			}
+			node         = node_t;
+			path[lv + 1] = node;
+		}
+
+		wild_index_add(db->wild, node, tk);
+		if (items[i].group.s) {
+			node = shared_group_find(node, &items[i].group, true);
+		}
+
+		put(node, items[i].idx, arg);
+
+		if (prev) {
+			topic_tokens_fini(prev);
+		}
+		prev = tk;
+	}
+	dbtree_gen_bump(db);
+	pthread_rwlock_unlock(&(db->rwlock));
+	dbtree_reclaim();
+
+	if (prev) {
+		topic_tokens_fini(prev);
+	}
+	zfree(path);
+}
+
+typedef struct {
+	const uint8_t *qos;
+	void *         ctxt;
+	uint32_t       pipe_id;
+	int *          rets;
+} client_put_arg;
+
+static void
+batch_put_client(dbtree_node *node, size_t idx, void *arg_)
+{
+	client_put_arg *arg   = (client_put_arg *) arg_;
+	int             index = 0;
+
+	if (arg->rets) {
+		arg->rets[idx] = binary_search((void **) node->clients, 0,
+		                     &index, &arg->pipe_id, client_cmp)
+		    ? 1
+		    : 0;
+	}
+	insert_dbtree_client(node,
+	    dbtree_client_new(0, arg->ctxt, arg->pipe_id,
+	        arg->qos ? arg->qos[idx] : 0));
+}
+
+void
+dbtree_insert_clients(dbtree *db, char **topics, const uint8_t *qos,
+    size_t n, void *ctxt, uint32_t pipe_id, int *rets)
+{
+	assert(db->root && topics);
+
+	insert_item *  items = (insert_item *) zmalloc(sizeof(insert_item) * n);
+	client_put_arg arg   = { qos, ctxt, pipe_id, rets };
+
+	for (size_t i = 0; i < n; i++) {
+		insert_item_set(&items[i], topics[i], i);
+	}
+	batch_insert(db, items, n, batch_put_client, &arg);
+	zfree(items);
+}
+
+static void insert_session_vector(dbtree_node *node, dbtree_session *s);
+
+static void
+batch_put_session(dbtree_node *node, size_t idx, void *arg)
+{
+	const dbtree_subscription *sub = (const dbtree_subscription *) arg;
+	dbtree_session *s = (dbtree_session *) zmalloc(sizeof(dbtree_session));
+
+	s->session_id = sub[idx].session_id;
+	s->ctxt       = sub[idx].ctxt;
+	s->qos        = sub[idx].qos;
+	insert_session_vector(node, s);
+}
+
+void
+dbtree_insert_sessions(dbtree *db, const dbtree_subscription *subs, size_t n)
+{
+	assert(db->root && subs);
+
+	insert_item *items = (insert_item *) zmalloc(sizeof(insert_item) * n);
+
+	for (size_t i = 0; i < n; i++) {
+		insert_item_set(&items[i], subs[i].topic, i);
+	}
+	batch_insert(db, items, n, batch_put_session, (void *) subs);
+	zfree(items);
+}
+
+typedef struct {
+	char *              buf; // topic of the node walked
+	size_t              cap;
+	char *              share; // $share/<group>/<topic>
+	size_t              share_cap;
+	dbtree_subscription sub;
+	int (*cb)(const dbtree_subscription *sub, void *arg);
+	void *arg;
+} foreach_ctx;
+
+static char *
+foreach_reserve(char **buf, size_t *cap, size_t len)
+{
+	if (*cap < len) {
+		*cap = len * 2;
+		*buf = (char *) zrealloc(*buf, *cap);
+	}
+	return *buf;
+}
+
+// report the clients and sessions of node under topic
+static int
+foreach_node_subs(foreach_ctx *fc, dbtree_node *node, const char *topic)
+{
+	int rv = 0;
+
+	cvector(dbtree_client *) clients = node_load(node->clients);
+	cvector(dbtree_session *) sessions = node_load(node->session_vector);
+
+	fc->sub.topic = topic;
+	for (size_t i = 0; i < cvector_size(clients) && rv == 0; i++) {
+		fc->sub.session_id = 0;
+		fc->sub.pipe_id    = clients[i]->pipe_id;
+		fc->sub.ctxt       = clients[i]->ctxt;
+		fc->sub.qos        = clients[i]->qos;
+		rv                 = fc->cb(&fc->sub, fc->arg);
+	}
+	for (size_t i = 0; i < cvector_size(sessions) && rv == 0; i++) {
+		fc->sub.session_id = sessions[i]->session_id;
+		fc->sub.pipe_id    = 0;
+		fc->sub.ctxt       = sessions[i]->ctxt;
+		fc->sub.qos        = sessions[i]->qos;
+		rv                 = fc->cb(&fc->sub, fc->arg);
+	}
+
+	return rv;
+}
+
+// node is at fc->buf[0..len], the root at len 0
+static int
+foreach_node(foreach_ctx *fc, dbtree_node *node, size_t len, bool root)
+{
+	child_iter   it;
+	dbtree_node *c  = NULL;
+	int          rv = 0;
+	cvector(dbtree_node *) shared = node_load(node->shared);
+
+	if (!root) {
+		rv = foreach_node_subs(fc, node, fc->buf);
+	}
+	for (size_t i = 0; i < cvector_size(shared) && rv == 0; i++) {
+		dbtree_node *g    = shared[i];
+		size_t       glen = g->len;
+		char *       t =
+		    foreach_reserve(&fc->share, &fc->share_cap, len + glen + 9);
+
+		sprintf(t, "$share/%s/%s", g->topic, fc->buf);
+		rv = foreach_node_subs(fc, g, t);
+	}
+
+	child_iter_init(&it, node);
+	while (rv == 0 && (c = child_iter_next(&it)) != NULL) {
+		size_t clen = c->len;
+		size_t off  = root ? 0 : len + 1;
+		char * t = foreach_reserve(&fc->buf, &fc->cap, off + clen + 1);
+
+		if (!root) {
+			t[len] = '/';
+		}
+		memcpy(t + off, c->topic, clen + 1);
+		rv     = foreach_node(fc, c, off + clen, false);
+		fc->buf[len] = '\0';
+	}
+
+	return rv;
+}
+
+// clients and sessions are loaded as readers do, so a walk in an epoch
+// is as safe as one under rwlock
+static int
+foreach_walk(dbtree *db,
+    int (*cb)(const dbtree_subscription *sub, void *arg), void *arg)
+{
+	foreach_ctx fc = { .cb = cb, .arg = arg };
+	int         rv = 0;
+
+	foreach_reserve(&fc.buf, &fc.cap, 64)[0] = '\0';
+	rv = foreach_node(&fc, node_load(db->root), 0, true);
+	zfree(fc.buf);
+	zfree(fc.share);
+
+	return rv;
+}
+
+int
+dbtree_foreach_subscription(dbtree *db,
+    int (*cb)(const dbtree_subscription *sub, void *arg), void *arg)
+{
+	int rv = 0;
+
+	pthread_rwlock_wrlock(&(db->rwlock));
+	rv = foreach_walk(db, cb, arg);
+	pthread_rwlock_unlock(&(db->rwlock));
+
+	return rv;
+}
+
+/*
+ * A snapshot is copied by a reader in an epoch, without rwlock, and kept
+ * only if db->gen was even and the same before and after the walk, then
+ * no writer changed a client or a session meanwhile and the copy is the
+ * tree as it was at one point. After SNAPSHOT_TRIES copies spoilt by
+ * writers it is taken with rwlock held, as dbtree_foreach_subscription
+ * walks. Publishers never take rwlock, either way leaves them alone.
+ *
+ * The tree keeps the last snapshot and hands it out again while gen has
+ * not moved, so scrapes in a row cost one copy. A snapshot is freed once
+ * the tree and every reader have released it.
+ */
+#define SNAPSHOT_TRIES 4
+
+struct dbtree_snapshot {
+	uint64_t gen;
+	int      ref;
+	cvector(dbtree_subscription) subs;
+	char * topics; // of subs, NUL terminated one after the other
+	size_t len;
+	size_t cap;
+};
+
+// a topic is kept once for the subscriptions on it in a row, while the
+// copy goes on subs[].topic is an offset in topics
+static int
+snapshot_copy_cb(const dbtree_subscription *sub, void *arg)
+{
+	dbtree_snapshot *   snap = (dbtree_snapshot *) arg;
+	dbtree_subscription s    = *sub;
+	size_t              n    = cvector_size(snap->subs);
+	size_t              off;
+
+	if (n > 0 &&
+	    strcmp(snap->topics + (uintptr_t) snap->subs[n - 1].topic,
+	        sub->topic) == 0) {
+		off = (uintptr_t) snap->subs[n - 1].topic;
+	} else {
+		size_t len = strlen(sub->topic) + 1;
+
+		off = snap->len;
+		foreach_reserve(&snap->topics, &snap->cap, off + len);
+		memcpy(snap->topics + off, sub->topic, len);
+		snap->len += len;
+	}
+	s.topic = (const char *) (uintptr_t) off;
+	s.ctxt  = NULL;
+	cvector_push_back(snap->subs, s);
+
+	return 0;
+}
+
+static void
+snapshot_reset(dbtree_snapshot *snap)
+{
+	if (snap->subs) {
+		cvector_set_size(snap->subs, 0);
+	}
+	snap->len = 0;
+}
+
+static dbtree_snapshot *
+snapshot_copy(dbtree *db)
+{
+	dbtree_snapshot *snap = (dbtree_snapshot *) zmalloc(sizeof(*snap));
+	uint64_t         gen  = 0;
+	bool             done = false;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->ref = 1;
+	for (int i = 0; i < SNAPSHOT_TRIES && !done; i++) {
+		snapshot_reset(snap);
+		dbtree_read_enter();
+		gen = dbtree_gen_load(db);
+		if ((gen & 1) == 0) {
+			foreach_walk(db, snapshot_copy_cb, snap);
+			atomic_thread_fence(memory_order_acquire);
+			done = dbtree_gen_load(db) == gen;
+		}
+		dbtree_read_exit();
+	}
+	if (!done) {
+		snapshot_reset(snap);
+		pthread_rwlock_wrlock(&(db->rwlock));
+		gen = dbtree_gen_load(db);
+		foreach_walk(db, snapshot_copy_cb, snap);
+		pthread_rwlock_unlock(&(db->rwlock));
+	}
+
+	snap->gen = gen;
+	for (size_t i = 0; i < cvector_size(snap->subs); i++) {
+		snap->subs[i].topic =
+		    snap->topics + (uintptr_t) snap->subs[i].topic;
+	}
 
-	pthread_rwlock_wrlock(&(db->rwlock));
-	dbtree_node *node = db->root;
-	// while dbtree is NULL, we will insert directly.
+	return snap;
+}
 
-	if (!(node->child && *node->child)) {
-		node = dbtree_node_insert(node, topic_queue);
-	} else {
+void
+dbtree_snapshot_release(dbtree_snapshot *snap)
+{
+	if (snap == NULL ||
+	    __atomic_sub_fetch(&snap->ref, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+	cvector_free(snap->subs);
+	zfree(snap->topics);
+	zfree(snap);
+}
 
-		while (*topic_queue && node->child && *node->child) {
-			dbtree_node *node_t = *node->child;
-			log_info("topic is: %s, node->topic is: %s",
-			    *topic_queue, node_t->topic);
-			if (strcmp(node_t->topic, *topic_queue)) {
-				bool equal = false;
-				int  index = 0;
+dbtree_snapshot *
+dbtree_snapshot_take(dbtree *db)
+{
+	dbtree_snapshot *snap;
+	dbtree_snapshot *old;
+
+	pthread_mutex_lock(&db->snapshot_mtx);
+	snap = db->snapshot;
+	if (snap != NULL && snap->gen == dbtree_gen_load(db)) {
+		__atomic_add_fetch(&snap->ref, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&db->snapshot_mtx);
+		return snap;
+	}
+	pthread_mutex_unlock(&db->snapshot_mtx);
 
-				node_t = find_next(
-				    node, &equal, topic_queue, &index);
-				if (equal == false) {
-					/*
-					 ** If no node is matched with topic
-					 ** insert node until topic_queue
-					 ** is NULL
-					 */
-					log_info("searching unequal");
-					node = dbtree_node_insert(
-					    node_t, topic_queue);
-					break;
-				}
-			}
+	snap = snapshot_copy(db);
 
-			if (node_t->child && *node_t->child &&
-			    *(topic_queue + 1)) {
-				topic_queue++;
-				node = node_t;
-			} else if (*(topic_queue + 1) == NULL) {
-				log_info("Search and insert client");
-				node = node_t;
-				break;
-			} else {
-				log_info("Insert node and client");
-				node = dbtree_node_insert(node_t, topic_queue);
-				break;
-			}
-		}
+	// the newest of snapshots copied at once is kept
+	pthread_mutex_lock(&db->snapshot_mtx);
+	old = db->snapshot;
+	if (old == NULL || old->gen < snap->gen) {
+		__atomic_add_fetch(&snap->ref, 1, __ATOMIC_RELAXED);
+		db->snapshot = snap;
+	} else {
+		old = NULL;
 	}
+	pthread_mutex_unlock(&db->snapshot_mtx);
+	dbtree_snapshot_release(old);
 
-	void *ret = inserter(node, args);
-	pthread_rwlock_unlock(&(db->rwlock));
-	topic_queue_free(for_free);
-	return ret;
+	return snap;
 }
 
-void *
-dbtree_insert_client(dbtree *db, char *topic, void *ctxt, uint32_t pipe_id)
+size_t
+dbtree_snapshot_count(const dbtree_snapshot *snap)
 {
-	dbtree_client *client = dbtree_client_new(0, ctxt, pipe_id);
-	return search_insert_node(db, topic, client, insert_dbtree_client);
+	return cvector_size(snap->subs);
+}
+
+const dbtree_subscription *
+dbtree_snapshot_get(const dbtree_snapshot *snap, size_t i)
+{
+	return i < cvector_size(snap->subs) ? &snap->subs[i] : NULL;
+}
+
+uint64_t
+dbtree_snapshot_gen(const dbtree_snapshot *snap)
+{
+	return snap->gen;
 }
 
 // search session vector and delete
@@ -700,40 +3226,32 @@ dbtree_insert_client(dbtree *db, char *topic, void *ctxt, uint32_t pipe_id)
 static void *
 delete_and_insert(dbtree_node *node, void *args)
 {
-	pthread_rwlock_wrlock(&(node->rwlock));
-
 	int            index  = 0;
-        void           *ret = NULL;
+	void *         ret    = NULL;
 	dbtree_client *client = (dbtree_client *) args;
 
 	if (true ==
 	    binary_search((void **) node->session_vector, 0, &index,
 	        &client->session_id, session_cmp)) {
 		dbtree_session *s = node->session_vector[index];
-		cvector_erase(node->session_vector, index);
-		if (cvector_empty(node->session_vector)) {
-			cvector_free(node->session_vector);
-			node->session_vector = NULL;
-		}
+		vec_publish((void ***) &node->session_vector,
+		    vec_erase_copy((void **) node->session_vector, index));
 
 		if (s) {
-			client->ctxt       = s->ctxt;
-                        ret = client->ctxt;
+			client->ctxt = s->ctxt;
+			client->qos  = s->qos;
+			ret          = client->ctxt;
 
 			client->session_id = 0;
-			zfree(s);
+			dbtree_retire(s, zfree);
 			s = NULL;
 
 			if (false ==
 			    binary_search((void **) node->clients, 0, &index,
 			        &(client->pipe_id), client_cmp)) {
-				if (index == cvector_size(node->clients)) {
-					cvector_push_back(
-					    node->clients, client);
-				} else {
-					cvector_insert(
-					    node->clients, index, client);
-				}
+				vec_publish((void ***) &node->clients,
+				    vec_insert_copy(
+				        (void **) node->clients, index, client));
 			} else {
 				log_err("Pipe id is conflicted!");
 				dbtree_client_free(client);
@@ -744,43 +3262,9 @@ delete_and_insert(dbtree_node *node, void *args)
 		zfree(client);
 	}
 
-	pthread_rwlock_unlock(&(node->rwlock));
-
 	return ret;
 }
 
-// session vector delete
-static void *
-delete_session_client(dbtree_node *node, void *args)
-{
-	pthread_rwlock_wrlock(&(node->rwlock));
-
-	int            index  = 0;
-	dbtree_client *client = (dbtree_client *) args;
-
-	if (true ==
-	    binary_search((void **) node->session_vector, 0, &index,
-	        &client->session_id, session_cmp)) {
-
-		dbtree_session *s = node->session_vector[index];
-		cvector_erase(node->session_vector, index);
-
-		if (s) {
-			if (s->ctxt) {
-				return s->ctxt;
-			}
-		}
-
-	} else {
-		log_err("Client identify is not find in session vector!");
-		dbtree_client_free(client);
-	}
-
-	pthread_rwlock_unlock(&(node->rwlock));
-
-	return NULL;
-}
-
 void*
 dbtree_restore_session(
     dbtree *db, char *topic, uint32_t session_id, uint32_t pipe_id)
@@ -790,192 +3274,128 @@ dbtree_restore_session(
 		return NULL;
 	}
 
-	dbtree_client *client = dbtree_client_new(session_id, NULL, pipe_id);
+	dbtree_client *client =
+	    dbtree_client_new(session_id, NULL, pipe_id, 0);
 	return search_insert_node(db, topic, client, delete_and_insert);
 }
 
-static cvector(dbtree_session_msg *)
-    insert_session_msg(cvector(dbtree_session_msg *) session_msg_list,
-        void *msg, cvector(dbtree_session *) session_vector)
-{
-	// TODO 直接返回ID的链表
-	size_t session_size = cvector_size(session_vector);
-	for (int i = 0; i < session_size; i++) {
-		uint32_t id = session_vector[i]->session_id;
+typedef dbtree_client *dbtree_client_ptr;
+typedef dbtree_node *  dbtree_node_ptr;
 
-		int index = 0;
+#define MATCH_CLIENTS 0x01
+#define MATCH_SHARED 0x02
+#define MATCH_ONLINE 0x04 // offline sessions are not visited
 
-		if (false ==
-		    binary_search((void **) session_msg_list, 0, &index, &id,
-		        session_cmp)) {
-			// New session_msg instance.
+// elements of a scratch vector of a walk before it moves to the heap
+#define MATCH_SCRATCH 32
 
-			dbtree_session_msg *smsg =
-			    (dbtree_session_msg *) zmalloc(
-			        sizeof(dbtree_session_msg));
-			if (smsg == NULL) {
-				log_err("Memory alloc failed!");
-				return NULL;
-			}
+/*
+ * Result of one walk. Nodes with clients and shared groups of matched
+ * filters are collected whatever flags is, offline sessions only for the
+ * kinds in flags and never with MATCH_ONLINE. complete is cleared once a
+ * session of the other kind is skipped, such a result must not be cached.
+ */
+typedef struct {
+	cvector(dbtree_node *) nodes;
+	cvector(dbtree_node *) groups;
+	cvector(uint32_t) sessions;
+	int  flags;
+	bool complete;
+} match_result;
 
-			smsg->session_id = id;
-			smsg->msg_list   = NULL;
+static void
+collect_node_sessions(match_result *res, dbtree_node *node, int kind)
+{
+	cvector(dbtree_session *) session_vector = NULL;
 
-			cvector_push_back(smsg->msg_list, msg);
-			if (index == cvector_size(session_msg_list)) {
-				cvector_push_back(session_msg_list, smsg);
-			} else {
-				cvector_insert(session_msg_list, index, smsg);
-			}
-		}
+	if (res->flags & MATCH_ONLINE) {
+		return;
+	}
+	session_vector = node_load(node->session_vector);
+	if (cvector_empty(session_vector)) {
+		return;
 	}
 
-	return session_msg_list;
+	if (res->flags & kind) {
+		for (int i = 0; i < cvector_size(session_vector); i++) {
+			cvector_push_back(
+			    res->sessions, session_vector[i]->session_id);
+		}
+	} else {
+		res->complete = false;
+	}
 }
 
-// if QOS != AT_MOST_ONCE, we will retain QOS level and message with client
-// identify to session_msg_list, if client identify is never retained before,
-// we should create a new session_msg instance, or we can push message info to
-// msg_list to session_msg
-static cvector(dbtree_session_msg *)
-    insert_session_msg_list(cvector(dbtree_session_msg *) session_msg_list,
-        cvector(dbtree_session_msg *) session_msg_list_temp)
+/**
+ * @brief collect_node_clients - Push node if it has clients and push its
+ * shared groups, cache msg for its sessions.
+ * @param res - match_result
+ * @param node - matched node
+ * @return void
+ */
+static void
+collect_node_clients(match_result *res, dbtree_node *node)
 {
-	size_t session_msg_size = cvector_size(session_msg_list_temp);
-
-	for (int i = 0; i < session_msg_size; i++) {
-		dbtree_session_msg *s    = session_msg_list_temp[i];
-		session_msg_list_temp[i] = NULL;
-		uint32_t id              = s->session_id;
-
-		int                 index = 0;
-		dbtree_session_msg *smsg  = NULL;
+	cvector(dbtree_client *) clients = node_load(node->clients);
+	cvector(dbtree_node *) shared    = node_load(node->shared);
 
-		if (false ==
-		    binary_search((void **) session_msg_list, 0, &index, &id,
-		        session_msg_cmp)) {
-			// New session_msg instance.
-			smsg = s;
-			if (index == cvector_size(session_msg_list)) {
-				cvector_push_back(session_msg_list, smsg);
-			} else {
-				cvector_insert(session_msg_list, index, smsg);
-			}
-
-		} else {
-			smsg       = session_msg_list[index];
-			void *info = s->msg_list[0];
-			cvector_free(s->msg_list);
-			zfree(s);
-			s = NULL;
-			cvector_push_back(smsg->msg_list, info);
-		}
+	if (!cvector_empty(clients)) {
+		cvector_push_back(res->nodes, node);
 	}
+	collect_node_sessions(res, node, MATCH_CLIENTS);
 
-	cvector_free(session_msg_list_temp);
-	return session_msg_list;
+	for (int i = 0; i < cvector_size(shared); i++) {
+		cvector_push_back(res->groups, shared[i]);
+		collect_node_sessions(res, shared[i], MATCH_SHARED);
+	}
 }
 
-typedef dbtree_client *dbtree_client_ptr;
-typedef dbtree_node *  dbtree_node_ptr;
-
 /**
- * @brief collect_clients - Get all clients in nodes
- * @param vec - all clients obey this rule will insert
- * @param nodes - all node need to be compare
- * @param nodes_t - all node need to be compare next time
- * @param topic_queue - topic queue position
- * @return all clients on lots of nodes
+ * @brief wild_index_match - Collect the nodes of all wildcard filters
+ * which match topic tk, from the shapes of no more levels than tk.
+ * @param res - match_result
+ * @param index - dbtree_wild_index
+ * @param tk - topic tokens
+ * @return void
  */
-static dbtree_client ***
-collect_clients(dbtree_session_msg ***session_msg_list, dbtree_client ***vec,
-    dbtree_node **nodes, dbtree_node ***nodes_t, char **topic_queue, void *msg)
+static void
+wild_index_match(match_result *res, dbtree_wild_index *index, topic_tokens *tk)
 {
-	// TODO insert sort for clients and session_vectors
-	while (!cvector_empty(nodes)) {
-		dbtree_node **node_t_ = cvector_end(nodes) - 1;
-		dbtree_node * node_t  = *node_t_;
-		cvector_pop_back(nodes);
+	cvector(wild_shape *) shapes = node_load(index->shapes);
 
-		if (node_t == NULL || node_t->child == NULL ||
-		    (*(node_t->child)) == NULL) {
+	for (size_t i = 0; i < cvector_size(shapes); i++) {
+		wild_shape *s = shapes[i];
+		if (s->cnt > tk->cnt) {
+			break;
+		}
+		// "#" matches one level at least
+		if (!s->well && s->cnt != tk->cnt) {
 			continue;
 		}
 
-		dbtree_node * t     = *node_t->child;
-		dbtree_node **child = node_t->child;
-
-		if (node_t->well != -1) {
-			if (!cvector_empty(child[node_t->well]->clients)) {
-				log_info("Find # tag");
-				cvector_push_back(
-				    vec, child[node_t->well]->clients);
-			}
-
-			if (!cvector_empty(
-			        child[node_t->well]->session_vector)) {
-				*session_msg_list =
-				    insert_session_msg(*session_msg_list, msg,
-				        child[node_t->well]->session_vector);
+		uint32_t hash = WILD_HASH_SEED;
+		for (int lv = 0; lv < s->cnt; lv++) {
+			if (s->sig[lv] == 'L') {
+				hash = wild_hash_fold(
+				    hash, tk->spans[lv].hash);
 			}
 		}
 
-		if (node_t->plus != -1) {
-			if (*(topic_queue + 1) == NULL) {
-				log_info("add + clients");
-				if (!cvector_empty(
-				        child[node_t->plus]->clients)) {
-					cvector_push_back(
-					    vec, child[node_t->plus]->clients);
-				}
-				if (!cvector_empty(
-				        child[node_t->plus]->session_vector)) {
-					*session_msg_list = insert_session_msg(
-					    *session_msg_list, msg,
-					    child[node_t->plus]
-					        ->session_vector);
-				}
-
-			} else {
-				cvector_push_back(
-				    (*nodes_t), child[node_t->plus]);
-				log_info("add node_t: %s",
-				    (*(cvector_end((*nodes_t)) - 1))->topic);
+		wild_table *t    = node_load(s->table);
+		size_t      mask = t->cap - 1;
+		for (size_t j = hash & mask;; j = (j + 1) & mask) {
+			dbtree_wild_entry *e = node_load(t->slots[j]);
+			if (e == NULL) {
+				break;
 			}
-		}
-
-		bool equal = false;
-		if (strcmp(t->topic, *topic_queue)) {
-			int index = 0;
-			t = find_next(node_t, &equal, topic_queue, &index);
-		} else {
-			equal = true;
-		}
-
-		if (equal == true) {
-			log_info("Searching client: %s", t->topic);
-			if (*(topic_queue + 1) == NULL) {
-				if (!cvector_empty(t->clients)) {
-					log_info(
-					    "Searching client: %s", t->topic);
-					cvector_push_back(vec, t->clients);
-				}
-
-				if (!cvector_empty(t->session_vector)) {
-					*session_msg_list = insert_session_msg(
-					    *session_msg_list, msg,
-					    t->session_vector);
-				}
-			} else {
-				log_info("Searching client: %s", t->topic);
-				cvector_push_back((*nodes_t), t);
-				log_info("add node_t: %s",
-				    (*(cvector_end((*nodes_t)) - 1))->topic);
+			if (e != WILD_TOMBSTONE && e->hash == hash &&
+			    wild_key_eq(e, s->sig, tk)) {
+				log_trace("Wildcard match: [%s]", s->sig);
+				collect_node_clients(res, e->node);
+				break;
 			}
 		}
 	}
-
-	return vec;
 }
 
 /**
@@ -1019,92 +3439,341 @@ iterate_client_old(dbtree_client ***v)
 	return ctxts;
 }
 
+/**
+ * @brief iterate_client - Deduplicate clients of nodes by pipe id, a pipe
+ * on many matched filters gets the highest qos granted.
+ * @param v - nodes with clients
+ * @param qos - granted qos of ctxts are pushed to it if not NULL
+ * @return ctxts
+ */
 static void **
-iterate_client(dbtree_client ***v)
+iterate_client(dbtree_node **v, uint8_t **qos)
 {
 	cvector(void *) ctxts = NULL;
-	cvector(uint32_t *) ids = NULL;
 
 	if (v) {
+		pipe_set *set  = &epoch_rec_get()->dedup;
+		size_t    hint = 0;
 		for (int i = 0; i < cvector_size(v); ++i) {
+			dbtree_client **clients = node_load(v[i]->clients);
+			hint += cvector_size(clients);
+		}
+		if (hint == 0) {
+			return NULL;
+		}
 
-			for (int j = 0; j < cvector_size(v[i]); j++) {
-				int index = 0;
-
-				if (false == binary_search((void **)ids, 0, &index, &v[i][j]->pipe_id, ids_cmp)) {
-					if (cvector_empty(ids)) {
-					 	cvector_push_back(
-					 	    ids, &v[i][j]->pipe_id);
-					} else {
-						cvector_insert(ids, index, &v[i][j]->pipe_id);
+		pipe_set_begin(set, hint);
+		cvector_grow(ctxts, hint);
+		if (qos) {
+			size_t cnt = cvector_size(*qos) + hint;
+			cvector_grow((*qos), cnt);
+		}
+		for (int i = 0; i < cvector_size(v); ++i) {
+			dbtree_client **clients = node_load(v[i]->clients);
+			for (int j = 0; j < cvector_size(clients); j++) {
+				uint8_t  q = __atomic_load_n(
+				     &clients[j]->qos, __ATOMIC_RELAXED);
+				uint32_t at;
+				if (pipe_set_add_at(set, clients[j]->pipe_id,
+				        cvector_size(ctxts), &at)) {
+					cvector_push_back(ctxts, clients[j]->ctxt);
+					if (qos) {
+						cvector_push_back((*qos), q);
 					}
+				} else if (qos && (*qos)[at] < q) {
+					(*qos)[at] = q;
+				}
+			}
+		}
+	}
 
-				 	cvector_push_back(
-				 	    ctxts, v[i][j]->ctxt);
+	return ctxts;
+}
 
+/**
+ * @brief shared_pick - Pick a member of a shared group.
+ * @param db - dbtree
+ * @param node - group node, dispatch state lives here
+ * @param clients - members loaded by the caller, not empty
+ * @param key - hash of publisher client id
+ * @return index of member
+ */
+static int
+shared_pick(dbtree *db, dbtree_node *node, dbtree_client **clients,
+    uint32_t key)
+{
+	uint32_t size = cvector_size(clients);
+	uint32_t rr   = 0;
+
+	switch (db->shared_strategy) {
+	case SHARED_RANDOM: {
+		// xorshift32
+		uint32_t *seed = &epoch_rec_get()->seed;
+		*seed ^= *seed << 13;
+		*seed ^= *seed >> 17;
+		*seed ^= *seed << 5;
+		return *seed % size;
+	}
+	case SHARED_STICKY:
+		return (key * 2654435761u) % size;
+	case SHARED_LEAST_INFLIGHT:
+		rr = __atomic_fetch_add(&node->rr, 1, __ATOMIC_RELAXED);
+		if (db->shared_load) {
+			int      j   = rr % size;
+			uint32_t min = UINT32_MAX;
+			for (uint32_t k = 0; k < size && min > 0; k++) {
+				uint32_t i    = (rr + k) % size;
+				uint32_t load = db->shared_load(clients[i]->pipe_id);
+				if (load < min) {
+					min = load;
+					j   = i;
 				}
-				
+			}
+			return j;
+		}
+		return rr % size;
+	case SHARED_ROUND_ROBIN:
+	default:
+		rr = __atomic_fetch_add(&node->rr, 1, __ATOMIC_RELAXED);
+		return rr % size;
+	}
+}
+
+/**
+ * @brief dbtree_shared_iterate_client - Pick one member of each group,
+ * deduplicated by pipe id, and push them to ctxts.
+ * @param db - dbtree
+ * @param v - group nodes
+ * @param cnt - number of groups in v
+ * @param key - hash of publisher client id
+ * @param ctxts - vector to push to, may be NULL
+ * @param qos - granted qos of picked members are pushed to it if not NULL
+ * @return ctxts
+ */
+static void **
+dbtree_shared_iterate_client(dbtree *db, dbtree_node **v, size_t cnt,
+    uint32_t key, void **ctxts, uint8_t **qos)
+{
+	if (cnt == 0) {
+		return ctxts;
+	}
+
+	pipe_set *set = &epoch_rec_get()->dedup;
+	pipe_set_begin(set, cnt);
+	for (size_t i = 0; i < cnt; ++i) {
+		dbtree_client **clients = node_load(v[i]->clients);
+		if (cvector_empty(clients)) {
+			continue;
+		}
+
+		int j = shared_pick(db, v[i], clients, key);
+		if (pipe_set_add(set, clients[j]->pipe_id)) {
+			cvector_push_back(ctxts, clients[j]->ctxt);
+			if (qos) {
+				cvector_push_back((*qos),
+				    __atomic_load_n(
+				        &clients[j]->qos, __ATOMIC_RELAXED));
 			}
 		}
-		cvector_free(ids);
 	}
 
 	return ctxts;
 }
 
-void **
-search_client(dbtree *db, char *topic, void *message, size_t *msg_cnt)
+/*
+ * A cache entry is the number of clients, the clients, their granted qos
+ * and then the shared groups, a member of each group is picked again on
+ * every hit. The number is shifted left by one, the low bit set on an
+ * entry of a MATCH_ONLINE walk, which did not look for offline sessions
+ * and so serves only lookups of the same kind.
+ */
+typedef struct {
+	dbtree *  db;
+	uint32_t  key;
+	int       flags;
+	uint8_t **qos;
+} match_hit_arg;
+
+static void **
+match_entry_new(
+    void **ctxts, uint8_t *qos, size_t n, dbtree_node **groups, bool online)
 {
-	assert(db && topic);
-	char **topic_queue = topic_parse(topic);
-	char **for_free    = topic_queue;
+	size_t g   = cvector_size(groups);
+	void **vec = NULL;
+
+	if (n + g == 0 && !online) {
+		return NULL;
+	}
+
+	cvector_grow(vec, 2 * n + g + 1);
+	cvector_push_back(vec, (void *) (uintptr_t) (n << 1 | online));
+	for (size_t i = 0; i < n; i++) {
+		cvector_push_back(vec, ctxts[i]);
+	}
+	for (size_t i = 0; i < n; i++) {
+		cvector_push_back(vec, (void *) (uintptr_t) qos[i]);
+	}
+	for (size_t i = 0; i < g; i++) {
+		cvector_push_back(vec, groups[i]);
+	}
 
-	pthread_rwlock_rdlock(&(db->rwlock));
+	return vec;
+}
 
-	dbtree_node *node                              = db->root;
-	cvector(dbtree_client **) ctxts                = NULL;
-	cvector(dbtree_node *) nodes                   = NULL;
-	cvector(dbtree_node *) nodes_t                 = NULL;
-	cvector(dbtree_session_msg *) session_msg_list = NULL;
+static void **
+match_entry_hit(void **vec, void *arg, bool *hit)
+{
+	match_hit_arg *a     = (match_hit_arg *) arg;
+	void **        ctxts = NULL;
 
-	if (node->child && *node->child) {
-		cvector_push_back(nodes, node);
+	if (vec == NULL) {
+		return NULL;
+	}
+	if (((uintptr_t) vec[0] & 1) && !(a->flags & MATCH_ONLINE)) {
+		*hit = false;
+		return NULL;
 	}
 
-	// log_info("node->topic %s, topic_queue %s", node->topic,
-	// *topic_queue); printf("node->topic %s, topic_queue %s\n",
-	// node->topic, *topic_queue);
+	size_t n = (uintptr_t) vec[0] >> 1;
+	if ((a->flags & MATCH_CLIENTS) && n > 0) {
+		cvector_grow(ctxts, n);
+		for (size_t i = 1; i <= n; i++) {
+			cvector_push_back(ctxts, vec[i]);
+		}
+		if (a->qos) {
+			cvector_grow((*a->qos), n);
+			for (size_t i = n + 1; i <= 2 * n; i++) {
+				cvector_push_back(
+				    (*a->qos), (uint8_t) (uintptr_t) vec[i]);
+			}
+		}
+	}
+	if (a->flags & MATCH_SHARED) {
+		ctxts = dbtree_shared_iterate_client(a->db,
+		    (dbtree_node **) vec + 2 * n + 1,
+		    cvector_size(vec) - 2 * n - 1, a->key, ctxts, a->qos);
+	}
 
-	while (*topic_queue && (!cvector_empty(nodes))) {
+	return ctxts;
+}
 
-		ctxts = collect_clients(&session_msg_list, ctxts, nodes,
-		    &nodes_t, topic_queue, message);
-		topic_queue++;
-		if (*topic_queue == NULL) {
-			break;
+/**
+ * @brief search_client - Walk the tree once for topic.
+ * @param db - dbtree
+ * @param topic - publish topic
+ * @param message - message cached for offline sessions, may be NULL
+ * @param msg_cnt - number of sessions message is cached for
+ * @param key - hash of publisher client id
+ * @param flags - MATCH_CLIENTS, MATCH_SHARED or both, with MATCH_ONLINE if
+ * message is NULL and offline sessions are not wanted
+ * @param qos - if not NULL, set to the granted qos of each returned ctxt
+ * @return ctxts of clients followed by ctxts picked from shared groups
+ */
+static void **
+search_client(dbtree *db, char *topic, void *message, size_t *msg_cnt,
+    uint32_t key, int flags, uint8_t **qos)
+{
+	assert(db && topic);
+	uint64_t      gen = 0;
+	bool          hit = false;
+	match_hit_arg arg = {
+		.db = db, .key = key, .flags = flags, .qos = qos
+	};
+
+	if (qos) {
+		*qos = NULL;
+	}
+
+	dbtree_read_enter();
+
+	if (db->cache && ((gen = dbtree_gen_load(db)) & 1) == 0) {
+		void **ret = match_cache_lookup(
+		    db->cache, topic, gen, match_entry_hit, &arg, &hit);
+		if (hit) {
+			dbtree_read_exit();
+			// only results without offline sessions are cached
+			if (message) {
+				*msg_cnt = 0;
+			}
+			return ret;
 		}
-		ctxts = collect_clients(&session_msg_list, ctxts, nodes_t,
-		    &nodes, topic_queue, message);
-		topic_queue++;
 	}
 
-	void **ret = iterate_client(ctxts);
-	pthread_rwlock_unlock(&(db->rwlock));
+	topic_tokens tk;
+	topic_tokenize(&tk, topic);
+
+	dbtree_node *node = db->root;
+	match_result res  = { 0 };
+
+	nano_arena * scratch = &epoch_rec_get()->scratch;
+
+	cvector_init_arena(res.nodes, scratch, MATCH_SCRATCH);
+	cvector_init_arena(res.groups, scratch, MATCH_SCRATCH);
+	cvector_init_arena(res.sessions, scratch, MATCH_SCRATCH);
+	res.flags    = flags;
+	res.complete = true;
+
+	// wildcards first as a walk level by level found them, then the
+	// filter without wildcards, which is the path of topic itself
+	wild_index_match(&res, db->wild, &tk);
+	for (int lv = 0; lv < tk.cnt && node != NULL; lv++) {
+		topic_level level = topic_tokens_level(&tk, lv);
+		node              = child_lookup(node_load(node->child),
+		    node_load(node->child_index), &level);
+	}
+	if (node != NULL) {
+		collect_node_clients(&res, node);
+	}
+
+	void **ret = NULL;
+	size_t n   = 0;
+	cvector(uint8_t) cqos = NULL;
+	if (flags & MATCH_CLIENTS) {
+		ret = iterate_client(res.nodes, &cqos);
+		n   = cvector_size(ret);
+	}
+	if (db->cache && (gen & 1) == 0 && res.complete &&
+	    cvector_empty(res.sessions) &&
+	    dbtree_gen_load(db) == gen) {
+		void **clients = ret;
+		if (!(flags & MATCH_CLIENTS)) {
+			clients = iterate_client(res.nodes, &cqos);
+			n       = cvector_size(clients);
+		}
+		match_cache_store(db->cache, topic, gen,
+		    match_entry_new(clients, cqos, n, res.groups,
+		        (flags & MATCH_ONLINE) != 0));
+		if (clients != ret) {
+			cvector_free(clients);
+			cvector_free(cqos);
+			cqos = NULL;
+		}
+	}
+	if (flags & MATCH_SHARED) {
+		ret = dbtree_shared_iterate_client(db, res.groups,
+		    cvector_size(res.groups), key, ret, &cqos);
+	}
+	if (qos) {
+		*qos = cqos;
+	} else {
+		cvector_free(cqos);
+	}
+	dbtree_read_exit();
 	if (message) {
-		size_t size = cvector_size(session_msg_list);
+		size_t size = 0;
+		if (!cvector_empty(res.sessions)) {
+			size = session_store_put_all(
+			    db->session_store, res.sessions, message);
+		}
 		log_info("########: %lu", size);
 		*msg_cnt = size;
 	}
 
-	pthread_rwlock_wrlock(&(db->rwlock_session));
-	db->session_msg_list =
-	    insert_session_msg_list(db->session_msg_list, session_msg_list);
-	pthread_rwlock_unlock(&(db->rwlock_session));
-
-	topic_queue_free(for_free);
-	cvector_free(nodes);
-	cvector_free(nodes_t);
-	cvector_free(ctxts);
+	topic_tokens_fini(&tk);
+	cvector_free(res.nodes);
+	cvector_free(res.groups);
+	cvector_free(res.sessions);
+	nano_arena_reset(scratch);
 
 	return ret;
 }
@@ -1112,30 +3781,28 @@ search_client(dbtree *db, char *topic, void *message, size_t *msg_cnt)
 void **
 dbtree_find_clients_and_cache_msg(dbtree *db, char *topic, void *msg, size_t *msg_cnt)
 {
-	return search_client(db, topic, msg, msg_cnt);
+	return search_client(db, topic, msg, msg_cnt, 0, MATCH_CLIENTS, NULL);
 }
 
-int
-dbtree_cache_session_msg(dbtree *db, void *msg, uint32_t session_id)
+void **
+dbtree_find_all_clients_and_cache_msg(dbtree *db, char *topic, void *msg,
+    size_t *msg_cnt, uint32_t key, uint8_t **qos)
 {
-	cvector(dbtree_session_msg *) session_msg_list = NULL;
-	dbtree_session_msg *smsg =
-	    (dbtree_session_msg *) zmalloc(sizeof(dbtree_session_msg));
-	if (smsg == NULL) {
-		log_err("Memory alloc failed!");
-		return -1;
-	}
-
-	smsg->session_id = session_id;
-	smsg->msg_list   = NULL;
+	return search_client(
+	    db, topic, msg, msg_cnt, key, MATCH_CLIENTS | MATCH_SHARED, qos);
+}
 
-	cvector_push_back(smsg->msg_list, msg);
-	cvector_push_back(session_msg_list, smsg);
+void **
+dbtree_find_online_clients(dbtree *db, char *topic, uint32_t key)
+{
+	return search_client(db, topic, NULL, NULL, key,
+	    MATCH_CLIENTS | MATCH_SHARED | MATCH_ONLINE, NULL);
+}
 
-	pthread_rwlock_wrlock(&(db->rwlock_session));
-	db->session_msg_list =
-	    insert_session_msg_list(db->session_msg_list, session_msg_list);
-	pthread_rwlock_unlock(&(db->rwlock_session));
+int
+dbtree_cache_session_msg(dbtree *db, void *msg, uint32_t session_id)
+{
+	return session_store_put(db->session_store, session_id, msg) ? 0 : -1;
 }
 
 /**
@@ -1151,23 +3818,18 @@ delete_dbtree_client(dbtree_node *node /*, char *id*/, uint32_t pipe_id)
 	int   index = 0;
 	void *ctxt  = NULL;
 
-	pthread_rwlock_wrlock(&(node->rwlock));
 	// TODO maybe ctxt need to be protected
 	print_client(node->clients);
 	if (true ==
 	    binary_search(
 	        (void **) node->clients, 0, &index, &pipe_id, client_cmp)) {
 		dbtree_client *c = node->clients[index];
-		cvector_erase(node->clients, index);
+		vec_publish((void ***) &node->clients,
+		    vec_erase_copy((void **) node->clients, index));
 		print_client(node->clients);
-		ctxt = dbtree_client_free(c);
-
-		if (cvector_empty(node->clients)) {
-			cvector_free(node->clients);
-			node->clients = NULL;
-		} else {
-			print_client(node->clients);
-		}
+		log_info("Delete client pipe_id: [%d]", c->pipe_id);
+		ctxt = c->ctxt;
+		dbtree_retire(c, zfree);
 	} else {
 		log_err("Not find pipe id: [%d]", pipe_id);
 		log_err("node->topic: %s", node->topic);
@@ -1177,7 +3839,6 @@ delete_dbtree_client(dbtree_node *node /*, char *id*/, uint32_t pipe_id)
 		}
 	}
 
-	pthread_rwlock_unlock(&(node->rwlock));
 	return ctxt;
 }
 
@@ -1219,27 +3880,41 @@ delete_dbtree_client(dbtree_node *node /*, char *id*/, uint32_t pipe_id)
 // }
 
 /**
- * @brief delete_dbtree_node - delete dbtree node
- * @param dbtree - dbtree_node
- * @param index - index
+ * @brief delete_dbtree_node - delete dbtree node if it is empty
+ * @param dbtree - parent dbtree_node
+ * @param node_t - child to delete
  * @return
  */
 static int
-delete_dbtree_node(dbtree_node *node, int index)
+delete_dbtree_node(dbtree_node *node, dbtree_node *node_t)
 {
-	pthread_rwlock_wrlock(&(node->rwlock));
-	dbtree_node *node_t = node->child[index];
-	// TODO plus && well
+	if (child_count(node_t) == 0 && cvector_empty(node_t->clients) &&
+	    cvector_empty(node_t->session_vector) &&
+	    cvector_empty(node_t->shared)) {
+		topic_level level = { .s = node_t->topic, .len = node_t->len };
+		int         index = -1;
 
-	if (cvector_empty(node_t->child) && cvector_empty(node_t->clients) &&
-	    cvector_empty(node_t->session_vector)) {
 		log_info("Delete node: [%s]", node_t->topic);
-		cvector_free(node_t->child);
-		cvector_free(node_t->clients);
-		cvector_free(node_t->session_vector);
-		zfree(node_t->topic);
-		cvector_erase(node->child, index);
-		zfree(node_t);
+		if (is_well(&level)) {
+			index = node->well;
+		} else if (is_plus(&level)) {
+			index = node->plus;
+		} else if (node->child_index) {
+			child_index_del(node->child_index, node_t);
+		} else if (!binary_search((void **) node->child,
+		               skip_wildcard(node->child), &index, &level,
+		               node_cmp)) {
+			index = -1;
+		}
+
+		if (index != -1) {
+			vec_publish((void ***) &node->child,
+			    vec_erase_copy((void **) node->child, index));
+		}
+		if (node_t->wild) {
+			wild_index_del(node_t->wild);
+		}
+		dbtree_retire(node_t, dbtree_node_retire_cb);
 		node_t = NULL;
 		if (index == 0) {
 			if (node->plus >= 0) {
@@ -1253,65 +3928,26 @@ delete_dbtree_node(dbtree_node *node, int index)
 
 		if (index == 1) {
 			if (node->plus == 1) {
-				node->plus = -1;
-			}
-
-			if (node->well == 1) {
-				node->well = -1;
-			}
-		}
-	}
-
-	if (cvector_empty(node->child)) {
-		cvector_free(node->child);
-		node->child = NULL;
-	}
-
-	pthread_rwlock_unlock(&(node->rwlock));
-	return 0;
-}
-
-// Search session message depending on clientid.
-void **
-search_session(dbtree *db, uint32_t id)
-{
-	if (db == NULL) {
-		return NULL;
-	}
-
-	pthread_rwlock_wrlock(&(db->rwlock_session));
-	if (db->session_msg_list) {
-		int index = 0;
-		if (true ==
-		    binary_search((void **) db->session_msg_list, 0, &index,
-		        &id, session_msg_cmp)) {
-
-			dbtree_session_msg *msg = db->session_msg_list[index];
-			cvector(void *) msg_list =
-			    db->session_msg_list[index]->msg_list;
-			cvector_erase(db->session_msg_list, index);
-			pthread_rwlock_unlock(&(db->rwlock_session));
+				node->plus = -1;
+			}
 
-			zfree(msg);
-			msg = NULL;
-			return msg_list;
-		} else {
-			log_warn("Not find session list");
+			if (node->well == 1) {
+				node->well = -1;
+			}
 		}
-
-	} else {
-		log_info("Session_msg_list is NULL!\n");
 	}
 
-	pthread_rwlock_unlock(&(db->rwlock_session));
-
-	return NULL;
+	return 0;
 }
 
 void **
 dbtree_restore_session_msg(dbtree *db, uint32_t session_id)
 {
-	return search_session(db, session_id);
+	if (db == NULL) {
+		return NULL;
+	}
+
+	return session_store_take(db->session_store, session_id);
 }
 
 static void
@@ -1321,11 +3957,8 @@ insert_session_vector(dbtree_node *node, dbtree_session *s)
 	if (false ==
 	    binary_search((void **) node->session_vector, 0, &index,
 	        &s->session_id, session_cmp)) {
-		if (index == cvector_size(node->session_vector)) {
-			cvector_push_back(node->session_vector, s);
-		} else {
-			cvector_insert(node->session_vector, index, s);
-		}
+		vec_publish((void ***) &node->session_vector,
+		    vec_insert_copy((void **) node->session_vector, index, s));
 	} else {
 		zfree(s);
 		s = NULL;
@@ -1338,8 +3971,6 @@ insert_session_vector(dbtree_node *node, dbtree_session *s)
 static void *
 delete_from_session_vector(dbtree_node *node, uint32_t session_id)
 {
-	pthread_rwlock_wrlock(&(node->rwlock));
-
 	int   index = 0;
 	void *ctxt  = NULL;
 
@@ -1348,14 +3979,15 @@ delete_from_session_vector(dbtree_node *node, uint32_t session_id)
 	        &session_id, session_cmp)) {
 
 		dbtree_session *s = node->session_vector[index];
-		cvector_erase(node->session_vector, index);
+		vec_publish((void ***) &node->session_vector,
+		    vec_erase_copy((void **) node->session_vector, index));
 
 		if (s) {
 			if (s->ctxt) {
 				ctxt = s->ctxt;
 			}
 
-			zfree(s);
+			dbtree_retire(s, zfree);
 			s = NULL;
 		}
 
@@ -1363,13 +3995,6 @@ delete_from_session_vector(dbtree_node *node, uint32_t session_id)
 		log_err("Client identify is not find in session vector!");
 	}
 
-	if (cvector_size(node->session_vector) == 0) {
-		cvector_free(node->session_vector);
-		node->session_vector = NULL;
-	}
-
-	pthread_rwlock_unlock(&(node->rwlock));
-
 	return ctxt;
 }
 
@@ -1379,107 +4004,101 @@ search_and_delete(dbtree *db, char *topic, uint32_t session_id,
 {
 	assert(db->root && topic);
 	pthread_rwlock_wrlock(&(db->rwlock));
-
-	char **       topic_queue = topic_parse(topic);
-	char **       for_free    = topic_queue;
-	dbtree_node * node        = db->root;
-	dbtree_node **node_buf    = NULL;
-	void *        ctxt        = NULL;
-	int *         vec         = NULL;
-	int           index       = 0;
-
-	while (*topic_queue && node->child && *node->child) {
-		index               = 0;
-		dbtree_node *node_t = *node->child;
-		log_info("topic is: %s, node->topic is: %s", *topic_queue,
-		    node_t->topic);
-		if (strcmp(node_t->topic, *topic_queue)) {
-			bool equal = false;
-			if (is_well(*topic_queue) && (node->well != -1)) {
-				index = node->well;
-				equal = true;
-			}
-
-			if (is_plus(*topic_queue) && (node->plus != -1)) {
-				index = node->plus;
-				equal = true;
-			}
-
-			node_t = node->child[index];
-
-			if (equal == false) {
-				// TODO node_t or node->child[index], to
-				// determine if node_t is needed
-				node_t = find_next(
-				    node, &equal, topic_queue, &index);
-				if (equal == false) {
-					log_info("searching unequal");
-					goto mem_free;
-				}
-			}
+	dbtree_gen_bump(db);
+
+	topic_tokens  tk;
+	int           lv       = 0;
+	dbtree_node * node     = db->root;
+	dbtree_node * node_t   = NULL;
+	dbtree_node **node_buf = NULL;
+	dbtree_node **vec      = NULL;
+	dbtree_node * target   = NULL;
+	void *        ctxt     = NULL;
+	int           index    = 0;
+	uint8_t       qos      = 0;
+	topic_level   group    = { 0 };
+	const char *  filter   = shared_topic_split(topic, &group);
+	topic_tokenize(&tk, filter ? filter : topic);
+
+	for (; lv < tk.cnt; lv++) {
+		topic_level level = topic_tokens_level(&tk, lv);
+		node_t            = child_find(node, &level);
+		if (node_t == NULL) {
+			log_info("No node and client need to be delete");
+			goto mem_free;
 		}
 
-		if (node_t->child && *node_t->child && *(topic_queue + 1)) {
-			topic_queue++;
-			cvector_push_back(node_buf, node);
-			cvector_push_back(vec, index);
-			node = node_t;
-
-		} else if (*(topic_queue + 1) == NULL) {
+		if (lv + 1 == tk.cnt) {
 			log_info("Search and delete client");
 			log_info("node->topic: %s", node->topic);
 			break;
-		} else {
-			log_info("No node and client need to be delete");
-			goto mem_free;
 		}
+
+		cvector_push_back(node_buf, node);
+		cvector_push_back(vec, node_t);
+		node = node_t;
 	}
 
-	if (node->child) {
+	// members and sessions of a shared subscription live in its group
+	target = node_t;
+	if (filter && (target = shared_group_find(node_t, &group, false)) ==
+	        NULL) {
+		log_info("No shared group need to be delete");
+		goto mem_free;
+	}
 
-		switch (flag) {
-		case DB_CACHE_SESSION:
-			ctxt =
-			    delete_dbtree_client(node->child[index], pipe_id);
-			dbtree_session *s =
-			    (dbtree_session *) zmalloc(sizeof(dbtree_session));
-			if (s == NULL) {
-				log_err("Meomory alloc leak!");
-			}
-			s->session_id = session_id;
-			s->ctxt       = ctxt;
-			log_info("New session session_id: [%d]", session_id);
-			insert_session_vector(node->child[index], s);
-			break;
-		case DB_DELETE_CLIENT:
-			ctxt =
-			    delete_dbtree_client(node->child[index], pipe_id);
-			delete_dbtree_node(node, index);
-			break;
-		case DB_DELETE_SESSION:
-			ctxt = delete_from_session_vector(
-			    node->child[index], session_id);
-			delete_dbtree_node(node, index);
-			break;
-		default:
-			log_err("Error delete dbtree flag type!");
+	switch (flag) {
+	case DB_CACHE_SESSION:
+		if (binary_search((void **) target->clients, 0, &index,
+		        &pipe_id, client_cmp)) {
+			qos = target->clients[index]->qos;
+		}
+		ctxt = delete_dbtree_client(target, pipe_id);
+		dbtree_session *s =
+		    (dbtree_session *) zmalloc(sizeof(dbtree_session));
+		if (s == NULL) {
+			log_err("Meomory alloc leak!");
+		}
+		s->session_id = session_id;
+		s->ctxt       = ctxt;
+		s->qos        = qos;
+		log_info("New session session_id: [%d]", session_id);
+		insert_session_vector(target, s);
+		break;
+	case DB_DELETE_CLIENT:
+		ctxt = delete_dbtree_client(target, pipe_id);
+		if (target != node_t) {
+			delete_shared_group(node_t, target);
 		}
+		delete_dbtree_node(node, node_t);
+		break;
+	case DB_DELETE_SESSION:
+		ctxt = delete_from_session_vector(target, session_id);
+		if (target != node_t) {
+			delete_shared_group(node_t, target);
+		}
+		delete_dbtree_node(node, node_t);
+		break;
+	default:
+		log_err("Error delete dbtree flag type!");
 	}
 
 	while (!cvector_empty(node_buf) && !cvector_empty(vec)) {
 		dbtree_node *t = *(cvector_end(node_buf) - 1);
-		int          i = *(cvector_end(vec) - 1);
+		dbtree_node *c = *(cvector_end(vec) - 1);
 		cvector_pop_back(node_buf);
 		cvector_pop_back(vec);
 
-		delete_dbtree_node(t, i);
+		delete_dbtree_node(t, c);
 	}
 
 mem_free:
 	cvector_free(node_buf);
-	topic_queue_free(for_free);
+	topic_tokens_fini(&tk);
 	cvector_free(vec);
+	dbtree_gen_bump(db);
 	pthread_rwlock_unlock(&(db->rwlock));
+	dbtree_reclaim();
 
 	return ctxt;
 }
@@ -1508,300 +4127,227 @@ dbtree_delete_session(
 	    db, topic, session_id, pipe_id, DB_DELETE_SESSION);
 }
 
-static void *
-insert_dbtree_retain(dbtree_node *node, void *args)
+// unlink the nodes of path deeper than lv which are left empty
+static void
+prune_path(dbtree_node **path, int len, int lv)
 {
-	dbtree_retain_msg *retain = (dbtree_retain_msg *) args;
-	void *             ret    = NULL;
-	pthread_rwlock_wrlock(&(node->rwlock));
-	if (node->retain != NULL) {
-		ret = node->retain;
+	for (; len > lv; len--) {
+		delete_dbtree_node(path[len - 1], path[len]);
 	}
-
-	node->retain = retain;
-
-	pthread_rwlock_unlock(&(node->rwlock));
-
-	return ret;
 }
 
-void *
-dbtree_insert_retain(dbtree *db, char *topic, dbtree_retain_msg *ret_msg)
-{
-	return search_insert_node(db, topic, ret_msg, insert_dbtree_retain);
-}
+typedef struct {
+	uint32_t session_id;
+	uint32_t pipe_id;
+} batch_arg;
 
-dbtree_retain_msg **
-collect_retain_well(dbtree_retain_msg **vec, dbtree_node *node)
+// change one topic of a batch, target is node or its shared group
+typedef void *(*batch_op)(
+    dbtree_node *node, dbtree_node *target, batch_arg *arg);
+
+/**
+ * @brief batch_apply - Run op on the node of each topic which is on the
+ * tree, with the tree locked once. Topics are sorted so that the walks
+ * of neighbours share their common prefix, a node left empty is pruned
+ * once the walk leaves it for good.
+ * @param db - dbtree
+ * @param topics - topics
+ * @param n - count of topics
+ * @param op - batch_op
+ * @param arg - passed to op
+ * @param rets - may be NULL, set to what op returns for each topic, NULL
+ * for a topic not on the tree
+ * @return void
+ */
+static void
+batch_apply(dbtree *db, char **topics, size_t n, batch_op op,
+    batch_arg *arg, void **rets)
 {
-	dbtree_node **nodes   = NULL;
-	dbtree_node **nodes_t = NULL;
-	cvector_push_back(nodes, node);
-	while (!cvector_empty(nodes)) {
-		for (int i = 0; i < cvector_size(nodes); i++) {
-			if (nodes[i]->retain) {
-				cvector_push_back(vec, nodes[i]->retain);
-			}
+	assert(db->root && topics);
+
+	insert_item * items = (insert_item *) zmalloc(sizeof(insert_item) * n);
+	dbtree_node **path  = NULL;
+	size_t        depth = 0;
+	int           len   = 0; // path[0..len] is on the tree
+	topic_tokens  tks[2];
+	topic_tokens *prev = NULL;
+
+	for (size_t i = 0; i < n; i++) {
+		memset(&items[i].group, 0, sizeof(topic_level));
+		items[i].filter = shared_topic_split(topics[i], &items[i].group);
+		if (items[i].filter == NULL) {
+			items[i].filter = topics[i];
+		}
+		items[i].idx = i;
+		if (rets) {
+			rets[i] = NULL;
+		}
+	}
+	qsort(items, n, sizeof(insert_item), insert_item_cmp);
 
-			for (int j = 0; j < cvector_size(nodes[i]->child);
-			     j++) {
-				cvector_push_back(
-				    nodes_t, (nodes[i]->child)[j]);
+	pthread_rwlock_wrlock(&(db->rwlock));
+	dbtree_gen_bump(db);
+	for (size_t i = 0; i < n; i++) {
+		topic_tokens *tk = &tks[i & 1];
+		int           lv = 0;
+
+		topic_tokenize(tk, items[i].filter);
+		if (depth < (size_t) tk->cnt + 1) {
+			depth = tk->cnt + 1;
+			path  = (dbtree_node **) zrealloc(
+			     path, sizeof(dbtree_node *) * depth);
+		}
+		path[0] = db->root;
+		if (prev) {
+			while (lv < tk->cnt && lv < len &&
+			    tokens_level_eq(tk, prev, lv)) {
+				lv++;
 			}
+			prune_path(path, len, lv);
+			topic_tokens_fini(prev);
 		}
+		prev = tk;
 
-		cvector_free(nodes);
-		nodes = NULL;
-
-		for (int i = 0; i < cvector_size(nodes_t); i++) {
-			if (nodes_t[i]->retain) {
-				cvector_push_back(vec, nodes_t[i]->retain);
+		dbtree_node *node = path[lv];
+		for (len = lv; len < tk->cnt; len++) {
+			topic_level level = topic_tokens_level(tk, len);
+			if ((node = child_find(node, &level)) == NULL) {
+				break;
 			}
+			path[len + 1] = node;
+		}
+		if (node == NULL) {
+			log_info("No node and client need to be delete");
+			continue;
+		}
 
-			for (int j = 0; j < cvector_size(nodes_t[i]->child);
-			     j++) {
-				cvector_push_back(
-				    nodes, (nodes_t[i]->child)[j]);
-			}
+		dbtree_node *target = node;
+		if (items[i].group.s &&
+		    (target = shared_group_find(
+		         node, &items[i].group, false)) == NULL) {
+			log_info("No shared group need to be delete");
+			continue;
+		}
+		void *ret = op(node, target, arg);
+		if (rets) {
+			rets[items[i].idx] = ret;
 		}
-		cvector_free(nodes_t);
-		nodes_t = NULL;
 	}
+	prune_path(path, len, 0);
+	dbtree_gen_bump(db);
+	pthread_rwlock_unlock(&(db->rwlock));
+	dbtree_reclaim();
 
-	return vec;
+	if (prev) {
+		topic_tokens_fini(prev);
+	}
+	zfree(path);
+	zfree(items);
 }
 
-/**
- * @brief collect_retains - Get all retain in nodes
- * @param vec - all clients obey this rule will insert
- * @param nodes - all node need to be compare
- * @param nodes_t - all node need to be compare next time
- * @param topic_queue - topic queue position
- * @return all clients on lots of nodes
- */
-static dbtree_retain_msg **
-collect_retains(dbtree_retain_msg **vec, dbtree_node **nodes,
-    dbtree_node ***nodes_t, char **topic_queue)
+static void *
+batch_delete_client(dbtree_node *node, dbtree_node *target, batch_arg *arg)
 {
+	void *ctxt = delete_dbtree_client(target, arg->pipe_id);
 
-	while (!cvector_empty(nodes)) {
-		dbtree_node **node_t_ = cvector_end(nodes) - 1;
-		dbtree_node * node_t  = *node_t_;
-		cvector_pop_back(nodes);
-
-		if (node_t == NULL || node_t->child == NULL ||
-		    (*(node_t->child)) == NULL) {
-			continue;
-		}
-
-		dbtree_node * t     = *node_t->child;
-		dbtree_node **child = node_t->child;
-
-		if (is_well(*topic_queue)) {
-			vec = collect_retain_well(vec, node_t);
-			break;
-		} else if (is_plus(*topic_queue)) {
-			if (*(topic_queue + 1) == NULL) {
-				for (int i = 0; i < cvector_size(child); i++) {
-					node_t = child[i];
-					if (node_t->retain) {
-						cvector_push_back(
-						    vec, node_t->retain);
-					}
-				}
-
-			} else {
-				for (int i = 0; i < cvector_size(child); i++) {
-					node_t = child[i];
-					cvector_push_back(
-					    ((*nodes_t)), node_t);
-				}
-			}
-
-		} else {
-			bool equal = false;
-
-			if (strcmp(t->topic, *topic_queue)) {
-				int index = 0;
-				t         = find_next(
-                                    node_t, &equal, topic_queue, &index);
-
-			} else {
-				equal = true;
-			}
-
-			if (equal == true) {
-				log_info(
-				    "Searching client: %s", node_t->topic);
-				if (*(topic_queue + 1) == NULL) {
-					if (t->retain) {
-						log_info(
-						    "Searching client: %s",
-						    t->topic);
-						cvector_push_back(
-						    vec, t->retain);
-					}
-				} else {
-					log_info(
-					    "Searching client: %s", t->topic);
-					cvector_push_back((*nodes_t), t);
-					log_info("add node_t: %s",
-					    (*(cvector_end((*nodes_t)) - 1))
-					        ->topic);
-				}
-			}
-		}
+	if (target != node) {
+		delete_shared_group(node, target);
 	}
-
-	return vec;
+	return ctxt;
 }
 
-dbtree_retain_msg **
-dbtree_find_retain(dbtree *db, char *topic)
+void
+dbtree_delete_clients(
+    dbtree *db, char **topics, size_t n, uint32_t pipe_id, void **ctxts)
 {
+	batch_arg arg = { .session_id = 0, .pipe_id = pipe_id };
 
-	assert(db && topic);
-	char **topic_queue = topic_parse(topic);
-	char **for_free    = topic_queue;
-	pthread_rwlock_rdlock(&(db->rwlock));
+	batch_apply(db, topics, n, batch_delete_client, &arg, ctxts);
+}
 
-	dbtree_node *node                 = db->root;
-	cvector(dbtree_retain_msg *) rets = NULL;
-	cvector(dbtree_node *) nodes      = NULL;
-	cvector(dbtree_node *) nodes_t    = NULL;
+// the client goes offline, its subscription stays as a session
+static void *
+batch_cache_session(dbtree_node *node, dbtree_node *target, batch_arg *arg)
+{
+	dbtree_session *s     = NULL;
+	int             index = 0;
+	uint8_t         qos   = 0;
 
-	if (node->child && *node->child) {
-		cvector_push_back(nodes, node);
+	if (binary_search((void **) target->clients, 0, &index,
+	        &arg->pipe_id, client_cmp)) {
+		qos = target->clients[index]->qos;
 	}
-
-	while (*topic_queue && (!cvector_empty(nodes))) {
-
-		rets = collect_retains(rets, nodes, &nodes_t, topic_queue);
-		topic_queue++;
-		if (*topic_queue == NULL) {
-			break;
-		}
-		rets = collect_retains(rets, nodes_t, &nodes, topic_queue);
-		topic_queue++;
+	if ((s = (dbtree_session *) zmalloc(sizeof(dbtree_session))) ==
+	    NULL) {
+		log_err("Meomory alloc leak!");
+		return NULL;
 	}
+	s->session_id = arg->session_id;
+	s->ctxt       = delete_dbtree_client(target, arg->pipe_id);
+	s->qos        = qos;
+	insert_session_vector(target, s);
+	return s->ctxt;
+}
 
-	pthread_rwlock_unlock(&(db->rwlock));
-
-	topic_queue_free(for_free);
-	cvector_free(nodes);
-	cvector_free(nodes_t);
+void
+dbtree_cache_sessions(dbtree *db, char **topics, size_t n,
+    uint32_t session_id, uint32_t pipe_id)
+{
+	batch_arg arg = { .session_id = session_id, .pipe_id = pipe_id };
 
-	return rets;
+	batch_apply(db, topics, n, batch_cache_session, &arg, NULL);
 }
 
 static void *
-delete_dbtree_retain(dbtree_node *node)
+batch_restore_session(
+    dbtree_node *node, dbtree_node *target, batch_arg *arg)
 {
-	assert(node);
-	void *retain = NULL;
-	if (node) {
-		retain       = node->retain;
-		node->retain = NULL;
-	}
-
-	return retain;
+	return delete_and_insert(target,
+	    dbtree_client_new(arg->session_id, NULL, arg->pipe_id, 0));
 }
 
 void *
-dbtree_delete_retain(dbtree *db, char *topic)
+dbtree_restore_sessions(dbtree *db, char **topics, size_t n,
+    uint32_t session_id, uint32_t pipe_id, void ***msgs)
 {
-	assert(db->root && topic);
-	pthread_rwlock_wrlock(&(db->rwlock));
-
-	char **       topic_queue = topic_parse(topic);
-	char **       for_free    = topic_queue;
-	dbtree_node * node        = db->root;
-	dbtree_node **node_buf    = NULL;
-	int *         vec         = NULL;
-	void *        ret         = NULL;
-	int           index       = 0;
-
-	while (*topic_queue && node->child && *node->child) {
-		index               = 0;
-		dbtree_node *node_t = *node->child;
-		log_info("topic is: %s, node->topic is: %s", *topic_queue,
-		    node_t->topic);
-		if (strcmp(node_t->topic, *topic_queue)) {
-			bool equal = false;
-
-			// TODO node_t or node->child[index], to determine if
-			// node_t is needed
-			node_t = find_next(node, &equal, topic_queue, &index);
-			if (equal == false) {
-				log_info("searching unequal");
-				goto mem_free;
-			}
-		}
-
-		if (node_t->child && *node_t->child && *(topic_queue + 1)) {
-			topic_queue++;
-			cvector_push_back(node_buf, node);
-			cvector_push_back(vec, index);
-			node = node_t;
-
-		} else if (*(topic_queue + 1) == NULL) {
-			log_info("Search and delete retain");
-			log_info("node->topic: %s", node->topic);
-			break;
-		} else {
-			log_info("No node and client need to be delete");
-			goto mem_free;
+	batch_arg arg  = { .session_id = session_id, .pipe_id = pipe_id };
+	void **   rets = NULL;
+	void *    ctxt = NULL;
+
+	if (n > 0) {
+		rets = (void **) zmalloc(sizeof(void *) * n);
+		batch_apply(db, topics, n, batch_restore_session, &arg, rets);
+		for (size_t i = 0; i < n && ctxt == NULL; i++) {
+			ctxt = rets[i];
 		}
+		zfree(rets);
 	}
-
-	if (node->child) {
-		ret = delete_dbtree_retain(node->child[index]);
-		// print_client(node->child[index]->clients);
-		delete_dbtree_node(node, index);
-		// print_client(node->child[index]->clients);
-	}
-
-	// dbtree_print(dbtree);
-
-	while (!cvector_empty(node_buf) && !cvector_empty(vec)) {
-		dbtree_node *t = *(cvector_end(node_buf) - 1);
-		int          i = *(cvector_end(vec) - 1);
-		cvector_pop_back(node_buf);
-		cvector_pop_back(vec);
-
-		delete_dbtree_node(t, i);
-		// dbtree_print(dbtree);
+	if (msgs) {
+		*msgs = session_store_take(db->session_store, session_id);
 	}
 
-	pthread_rwlock_unlock(&(db->rwlock));
-
-mem_free:
-	cvector_free(node_buf);
-	topic_queue_free(for_free);
-	cvector_free(vec);
-
-	return ret;
+	return ctxt;
 }
 
-void
-hash_add_alias(int alias, char *topic)
+static void *
+batch_delete_session(dbtree_node *node, dbtree_node *target, batch_arg *arg)
 {
-	assert(topic);
-	push_val(alias, topic);
-}
+	void *ctxt = delete_from_session_vector(target, arg->session_id);
 
-char *
-hash_check_alias(int alias)
-{
-	return get_val(alias);
+	if (target != node) {
+		delete_shared_group(node, target);
+	}
+	return ctxt;
 }
 
 void
-hash_del_alias(int alias)
+dbtree_delete_sessions(dbtree *db, char **topics, size_t n,
+    uint32_t session_id, void **ctxts)
 {
-	del_val(alias);
-}
+	batch_arg arg = { .session_id = session_id, .pipe_id = 0 };
 
+	batch_apply(db, topics, n, batch_delete_session, &arg, ctxts);
+}
 
 bool dbtree_check_shared_sub(const char *topic)
 {
@@ -1821,181 +4367,173 @@ bool dbtree_check_shared_sub(const char *topic)
 	return true;
 }
 
-static void **
-dbtree_shared_iterate_client(dbtree_client ***v)
+void **
+dbtree_find_shared_sub_clients(
+    dbtree *db, char *topic, void *msg, size_t *msg_cnt, uint32_t key)
 {
-	cvector(void *) ctxts = NULL;
-	cvector(uint32_t *) ids = NULL;
-
-	if (v) {
-		for (int i = 0; i < cvector_size(v); ++i) {
-			// Dispatch strategy.
-#ifdef RANDOM
-			int t = rand();
-#elif  defined(ROUND_ROBIN)
-			int t = acnt;
-#endif
-			int j = t % cvector_size(v[i]);
-
-			// printf("acnt: %d\n", acnt);
-			// printf("j: %d\n", j);
-			// printf("size: %d\n", cvector_size(v[i]));
-			// bool equal = false;
-
-			int index = 0;
-			if (false == binary_search((void **)ids, 0, &index, &v[i][j]->pipe_id, ids_cmp)) {
-				if (cvector_empty(ids)) {
-				 	cvector_push_back(
-				 	    ids, &v[i][j]->pipe_id);
-				} else {
-					cvector_insert(ids, index, &v[i][j]->pipe_id);
-				}
-
-			 	cvector_push_back(
-			 	    ctxts, v[i][j]->ctxt);
+	return search_client(
+	    db, topic, msg, msg_cnt, key, MATCH_SHARED, NULL);
+}
 
-			}
+void
+dbtree_set_shared_strategy(dbtree *db, dbtree_shared_strategy strategy,
+    uint32_t (*load)(uint32_t pipe_id))
+{
+	db->shared_strategy = strategy;
+	db->shared_load     = load;
+}
 
+/*
+ * A dbtree_filter_set is a small trie of fixed topic filters, built once
+ * and only read afterwards, so matching takes no lock. Levels of the
+ * topic are walked in place, nothing is allocated to match.
+ */
+typedef struct filter_node filter_node;
+
+struct filter_node {
+	char *        level;
+	bool          end;  // a filter ends here
+	bool          hash; // a filter ends with "#" below here
+	filter_node * plus;
+	filter_node **children;
+	size_t        cnt;
+};
+
+struct dbtree_filter_set {
+	filter_node root;
+	size_t      cnt;
+};
+
+static filter_node *
+filter_node_child(filter_node *node, const char *s, size_t len)
+{
+	filter_node *child;
 
-		}
-		cvector_free(ids);
-		acnt++;
-		if (acnt == INT_MAX) {
-			acnt = 0;
+	for (size_t i = 0; i < node->cnt; i++) {
+		if (!strncmp(node->children[i]->level, s, len) &&
+		    node->children[i]->level[len] == '\0') {
+			return node->children[i];
 		}
 	}
 
-	return ctxts;
+	child = (filter_node *) zmalloc(sizeof(filter_node));
+	memset(child, 0, sizeof(filter_node));
+	child->level = zmalloc(len + 1);
+	memcpy(child->level, s, len);
+	child->level[len] = '\0';
+
+	node->children = (filter_node **) zrealloc(
+	    node->children, sizeof(filter_node *) * (node->cnt + 1));
+	node->children[node->cnt++] = child;
+	return child;
 }
 
-/**
- * @brief iterate_client - Deduplication for all clients
- * @param v - client
- * @return dbtree_client
- */
-// TODO polish
-static void **
-dbtree_shared_iterate_client_old(dbtree_client ***v)
+static void
+filter_node_free(filter_node *node)
 {
-	cvector(void *) ctxts = NULL;
-	cvector(uint32_t) ids = NULL;
+	for (size_t i = 0; i < node->cnt; i++) {
+		filter_node_free(node->children[i]);
+		zfree(node->children[i]->level);
+		zfree(node->children[i]);
+	}
+	zfree(node->children);
+	if (node->plus) {
+		filter_node_free(node->plus);
+		zfree(node->plus);
+	}
+}
 
-	if (v) {
-		for (int i = 0; i < cvector_size(v); ++i) {
-			// Dispatch strategy.
-#ifdef RANDOM
-			int t = rand();
-#elif  defined(ROUND_ROBIN)
-			int t = acnt;
-#endif
-			int j = t % cvector_size(v[i]);
-
-			// printf("acnt: %d\n", acnt);
-			// printf("j: %d\n", j);
-			// printf("size: %d\n", cvector_size(v[i]));
-			bool equal = false;
-			for (int k = 0; k < cvector_size(ids); k++) {
-				if (ids[k] == v[i][j]->pipe_id) {
-					equal = true;
-					break;
-				}
-			}
+dbtree_filter_set *
+dbtree_filter_set_new(char **filters, size_t n)
+{
+	dbtree_filter_set *set = zmalloc(sizeof(dbtree_filter_set));
 
-			if (equal == false) {
-				cvector_push_back(
-				    ctxts, v[i][j]->ctxt);
-				// TODO  binary sort and
-				// cvector_insert();
-				cvector_push_back(
-				    ids, v[i][j]->pipe_id);
-			}
+	memset(set, 0, sizeof(dbtree_filter_set));
+	for (size_t i = 0; i < n; i++) {
+		filter_node *node = &set->root;
+		const char * s    = filters[i];
+		const char * e;
 
-			log_info("client id: %d", v[i][j]->pipe_id);
+		if (s == NULL) {
+			continue;
 		}
-		cvector_free(ids);
-		acnt++;
-		if (acnt == INT_MAX) {
-			acnt = 0;
+		for (;;) {
+			e          = strchr(s, '/');
+			size_t len = e ? (size_t)(e - s) : strlen(s);
+			if (len == 1 && s[0] == '#' && e != NULL) {
+				log_warn("Invalid topic filter %s", filters[i]);
+				break;
+			}
+			if (len == 1 && s[0] == '#') {
+				node->hash = true;
+				break;
+			}
+			if (len == 1 && s[0] == '+') {
+				if (node->plus == NULL) {
+					node->plus = zmalloc(sizeof(filter_node));
+					memset(node->plus, 0, sizeof(filter_node));
+				}
+				node = node->plus;
+			} else {
+				node = filter_node_child(node, s, len);
+			}
+			if (e == NULL) {
+				node->end = true;
+				break;
+			}
+			s = e + 1;
 		}
+		set->cnt++;
 	}
 
-	return ctxts;
+	return set;
 }
 
-
-void **
-dbtree_find_shared_clients(dbtree *db, char *topic, void *message, size_t *msg_cnt)
-{
-	pthread_rwlock_rdlock(&(db->rwlock));
-	dbtree_node *node                              = db->root;
-	cvector(dbtree_client **) ctxts                = NULL;
-	cvector(dbtree_node *) nodes                   = NULL;
-	cvector(dbtree_node *) nodes_t                 = NULL;
-	cvector(dbtree_session_msg *) session_msg_list = NULL;
-	bool equal = false;
-	char *t = "$share";
-	int index;
-
-	if (node == NULL) {
-		return NULL;
+void
+dbtree_filter_set_free(dbtree_filter_set *set)
+{
+	if (set != NULL) {
+		filter_node_free(&set->root);
+		zfree(set);
 	}
+}
 
+// s is the rest of topic from the level under node, NULL past the end
+static bool
+filter_node_match(filter_node *node, const char *s)
+{
+	const char *e;
+	size_t      len;
 
-	dbtree_node *shared = find_next(node, &equal, &t, &index);
-
-	if (shared == NULL || shared->child == NULL) {
-		pthread_rwlock_unlock(&(db->rwlock));
-		return NULL;
+	// "#" also matches the parent level
+	if (node->hash) {
+		return true;
 	}
-
-	dbtree_node **nlist = shared->child;
-
-	char **topic_queue = topic_parse(topic);
-	char **for_free    = topic_queue;
-
-	for (int i = 0 ; i < cvector_size(nlist); i++) {
-		dbtree_node *node = nlist[i];
-		if (node->child && *node->child) {
-			cvector_push_back(nodes, node);
-		}
+	if (s == NULL) {
+		return node->end;
 	}
 
-	log_info("nodes size: %lu", cvector_size(nlist));
-	while (*topic_queue && (!cvector_empty(nodes))) {
-
-		ctxts = collect_clients(&session_msg_list, ctxts, nodes,
-		    &nodes_t, topic_queue, message);
-		topic_queue++;
-		if (*topic_queue == NULL) {
+	e   = strchr(s, '/');
+	len = e ? (size_t)(e - s) : strlen(s);
+	for (size_t i = 0; i < node->cnt; i++) {
+		if (!strncmp(node->children[i]->level, s, len) &&
+		    node->children[i]->level[len] == '\0') {
+			if (filter_node_match(
+			        node->children[i], e ? e + 1 : NULL)) {
+				return true;
+			}
 			break;
 		}
-		ctxts = collect_clients(&session_msg_list, ctxts, nodes_t,
-		    &nodes, topic_queue, message);
-		topic_queue++;
-	}
-
-	void **ret = dbtree_shared_iterate_client(ctxts);
-	pthread_rwlock_unlock(&(db->rwlock));
-	if (message) {
-		size_t size = cvector_size(session_msg_list);
-		log_info("########: %lu", size);
-		*msg_cnt = size;
 	}
 
-	pthread_rwlock_wrlock(&(db->rwlock_session));
-	db->session_msg_list =
-	    insert_session_msg_list(db->session_msg_list, session_msg_list);
-	pthread_rwlock_unlock(&(db->rwlock_session));
-
-	topic_queue_free(for_free);
-	cvector_free(nodes);
-	cvector_free(nodes_t);
-	cvector_free(ctxts);
-
-	return ret;
+	return node->plus && filter_node_match(node->plus, e ? e + 1 : NULL);
 }
 
-void **dbtree_find_shared_sub_clients(dbtree *db, char *topic, void *msg, size_t *msg_cnt)
+bool
+dbtree_filter_set_match(dbtree_filter_set *set, const char *topic)
 {
-	return dbtree_find_shared_clients(db, topic, msg, msg_cnt);
+	if (set == NULL || topic == NULL || set->cnt == 0) {
+		return false;
+	}
+	return filter_node_match(&set->root, topic);
 }
@@ -0,0 +1,165 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "nano_alias.h"
+#include "zmalloc.h"
+
+struct nano_alias_out {
+	uint32_t hash;
+	uint16_t id; // 0 if the slot is free
+	uint16_t len;
+	char *   topic;
+};
+
+static uint32_t
+alias_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (uint8_t) s[i]) * 16777619u;
+	}
+	return h;
+}
+
+/**
+ * @brief nano_alias_init - Set up the alias tables of a connection, the
+ * inbound one is allocated at once, the outbound one on first use.
+ * @param alias - nano_alias
+ * @param in_max - Topic Alias Maximum the client may use
+ * @param out_max - Topic Alias Maximum the broker may use
+ * @return 0 or -1
+ */
+int
+nano_alias_init(nano_alias *alias, uint16_t in_max, uint16_t out_max)
+{
+	memset(alias, 0, sizeof(nano_alias));
+	alias->in_max  = in_max;
+	alias->out_max = out_max;
+	if (in_max > 0) {
+		alias->in = zmalloc(sizeof(char *) * (in_max + 1));
+		if (alias->in == NULL) {
+			return -1;
+		}
+		memset(alias->in, 0, sizeof(char *) * (in_max + 1));
+	}
+	return 0;
+}
+
+void
+nano_alias_fini(nano_alias *alias)
+{
+	for (uint32_t i = 0; alias->in && i <= alias->in_max; i++) {
+		zfree(alias->in[i]);
+	}
+	zfree(alias->in);
+	for (uint32_t i = 0; alias->out && i <= alias->out_mask; i++) {
+		zfree(alias->out[i].topic);
+	}
+	zfree(alias->out);
+	memset(alias, 0, sizeof(nano_alias));
+}
+
+/**
+ * @brief nano_alias_set - Map an inbound alias to topic, as a PUBLISH
+ * carrying both a topic and an alias does.
+ * @param alias - nano_alias
+ * @param id - alias
+ * @param topic - topic
+ * @param len - length of topic
+ * @return 0, or -1 if id is not a valid alias
+ */
+int
+nano_alias_set(nano_alias *alias, uint16_t id, const char *topic, size_t len)
+{
+	char *t;
+
+	if (id == 0 || id > alias->in_max) {
+		return -1;
+	}
+	if ((t = zmalloc(len + 1)) == NULL) {
+		return -1;
+	}
+	memcpy(t, topic, len);
+	t[len] = '\0';
+	zfree(alias->in[id]);
+	alias->in[id] = t;
+	return 0;
+}
+
+// topic of an inbound alias or NULL, valid until the alias is set again
+const char *
+nano_alias_get(nano_alias *alias, uint16_t id)
+{
+	if (id == 0 || id > alias->in_max) {
+		return NULL;
+	}
+	return alias->in[id];
+}
+
+/**
+ * @brief nano_alias_out_get - Find the outbound alias of topic, give it
+ * the next one if it has none and some are left.
+ * @param alias - nano_alias
+ * @param topic - topic
+ * @param len - length of topic
+ * @param fresh - set if the alias is new, it must be sent with the topic
+ * @return alias, or 0 if topic goes without one
+ */
+uint16_t
+nano_alias_out_get(
+    nano_alias *alias, const char *topic, size_t len, bool *fresh)
+{
+	nano_alias_out *slot;
+	uint32_t        hash;
+	uint32_t        i;
+
+	*fresh = false;
+	if (alias->out_max == 0 || len > UINT16_MAX) {
+		return 0;
+	}
+	if (alias->out == NULL) {
+		// at most half full, so probing always ends on a free slot
+		uint32_t cap = 2;
+		while (cap < (uint32_t) alias->out_max * 2) {
+			cap <<= 1;
+		}
+		if ((alias->out = zmalloc(sizeof(nano_alias_out) * cap)) ==
+		    NULL) {
+			return 0;
+		}
+		memset(alias->out, 0, sizeof(nano_alias_out) * cap);
+		alias->out_mask = cap - 1;
+	}
+
+	hash = alias_hash(topic, len);
+	for (i = hash & alias->out_mask; alias->out[i].id != 0;
+	     i = (i + 1) & alias->out_mask) {
+		slot = &alias->out[i];
+		if (slot->hash == hash && slot->len == len &&
+		    memcmp(slot->topic, topic, len) == 0) {
+			return slot->id;
+		}
+	}
+	if (alias->out_next == alias->out_max) {
+		return 0;
+	}
+
+	slot = &alias->out[i];
+	if ((slot->topic = zmalloc(len)) == NULL) {
+		return 0;
+	}
+	memcpy(slot->topic, topic, len);
+	slot->hash = hash;
+	slot->len  = (uint16_t) len;
+	slot->id   = ++alias->out_next;
+	*fresh     = true;
+	return slot->id;
+}
@@ -0,0 +1,133 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "nano_arena.h"
+#include "zmalloc.h"
+
+struct nano_arena_block {
+	nano_arena_block *next;
+	uint8_t           data[];
+};
+
+static inline size_t
+arena_align(size_t sz)
+{
+	return (sz + NANO_ARENA_ALIGN - 1) & ~(size_t)(NANO_ARENA_ALIGN - 1);
+}
+
+/**
+ * @brief nano_arena_init - Init an empty arena, the buffer is allocated on
+ * first use.
+ * @param arena - nano_arena
+ * @param size - initial size of buffer
+ * @return void
+ */
+void
+nano_arena_init(nano_arena *arena, size_t size)
+{
+	arena->buf    = NULL;
+	arena->size   = arena_align(size);
+	arena->used   = 0;
+	arena->high   = 0;
+	arena->blocks = NULL;
+}
+
+void
+nano_arena_fini(nano_arena *arena)
+{
+	nano_arena_reset(arena);
+	zfree(arena->buf);
+	arena->buf  = NULL;
+	arena->size = 0;
+}
+
+void *
+nano_arena_alloc(nano_arena *arena, size_t sz)
+{
+	nano_arena_block *block;
+
+	sz = arena_align(sz ? sz : 1);
+	arena->high += sz;
+
+	if (arena->buf == NULL && arena->size > 0) {
+		arena->buf = zmalloc(arena->size);
+	}
+	if (arena->buf != NULL && sz <= arena->size - arena->used) {
+		void *p = arena->buf + arena->used;
+		arena->used += sz;
+		return p;
+	}
+
+	// slow path, freed on reset
+	if ((block = zmalloc(sizeof(nano_arena_block) + sz)) == NULL) {
+		return NULL;
+	}
+	block->next   = arena->blocks;
+	arena->blocks = block;
+	return block->data;
+}
+
+void *
+nano_arena_zalloc(nano_arena *arena, size_t sz)
+{
+	void *p = nano_arena_alloc(arena, sz);
+
+	if (p != NULL) {
+		memset(p, 0, sz);
+	}
+	return p;
+}
+
+/**
+ * @brief nano_arena_strndup - Copy n bytes of s with a NUL appended.
+ * @param arena - nano_arena
+ * @param s - string, need not be terminated
+ * @param n - length of s
+ * @return copy or NULL
+ */
+char *
+nano_arena_strndup(nano_arena *arena, const char *s, size_t n)
+{
+	char *p = nano_arena_alloc(arena, n + 1);
+
+	if (p != NULL) {
+		memcpy(p, s, n);
+		p[n] = '\0';
+	}
+	return p;
+}
+
+/**
+ * @brief nano_arena_reset - Drop all allocations. If the slow path was
+ * taken the buffer grows to what was asked for, up to NANO_ARENA_MAX.
+ * @param arena - nano_arena
+ * @return void
+ */
+void
+nano_arena_reset(nano_arena *arena)
+{
+	nano_arena_block *block;
+
+	if (arena->blocks != NULL) {
+		while ((block = arena->blocks) != NULL) {
+			arena->blocks = block->next;
+			zfree(block);
+		}
+		if (arena->high > arena->size && arena->size < NANO_ARENA_MAX) {
+			zfree(arena->buf);
+			arena->buf  = NULL;
+			arena->size = arena->high < NANO_ARENA_MAX
+			    ? arena->high
+			    : NANO_ARENA_MAX;
+		}
+	}
+	arena->used = 0;
+	arena->high = 0;
+}
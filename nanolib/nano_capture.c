@@ -0,0 +1,235 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <errno.h>
+#include <string.h>
+
+#include "include/nano_capture.h"
+#include "include/zmalloc.h"
+
+static const uint8_t capture_magic[4] = { 'N', 'M', 'Q', 'C' };
+
+static size_t
+put_varint(uint8_t *p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (uint8_t) v;
+	return n;
+}
+
+static bool
+get_varint(FILE *fp, uint64_t *v)
+{
+	int c;
+
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if ((c = getc(fp)) == EOF) {
+			return false;
+		}
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief nano_capture_open - Create the capture file of path, or empty it.
+ * @param c - nano_capture
+ * @param path - file
+ * @param max - bytes of the file at most, records past it are dropped,
+ * 0 unbounded
+ * @return 0, or -1 with errno
+ */
+int
+nano_capture_open(nano_capture *c, const char *path, uint64_t max)
+{
+	uint8_t header[NANO_CAPTURE_HEADER] = { 0 };
+
+	memset(c, 0, sizeof(nano_capture));
+	if ((c->fp = fopen(path, "wb")) == NULL) {
+		return -1;
+	}
+	memcpy(header, capture_magic, sizeof(capture_magic));
+	header[4] = NANO_CAPTURE_VERSION;
+	if (fwrite(header, 1, sizeof(header), c->fp) != sizeof(header) ||
+	    fflush(c->fp) != 0) {
+		fclose(c->fp);
+		c->fp = NULL;
+		return -1;
+	}
+	pthread_mutex_init(&c->mtx, NULL);
+	c->max   = max;
+	c->bytes = sizeof(header);
+
+	return 0;
+}
+
+/**
+ * @brief nano_capture_write - Add the record of a packet.
+ * @param c - nano_capture, open
+ * @param now_us - microseconds of a monotonic clock
+ * @param pipe - pipe the packet came on
+ * @param kind - command type the transport gave it
+ * @param proto - protocol version of the pipe, 0 if not known
+ * @param header - fixed header
+ * @param header_len - of header
+ * @param body - rest of the packet
+ * @param body_len - of body
+ * @return 0, 1 if the file is past max, or -1 with errno
+ */
+int
+nano_capture_write(nano_capture *c, uint64_t now_us, uint32_t pipe,
+    uint8_t kind, uint8_t proto, const uint8_t *header, size_t header_len,
+    const uint8_t *body, size_t body_len)
+{
+	uint8_t prefix[40];
+	size_t  n;
+	int     rv = 0;
+
+	if (header_len + body_len > NANO_CAPTURE_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->mtx);
+	if (c->records == 0 && c->dropped == 0) {
+		c->first_us = c->last_us = c->flush_us = now_us;
+	}
+	// threads race to the lock, time never goes back in the file
+	if (now_us < c->last_us) {
+		now_us = c->last_us;
+	}
+	n = put_varint(prefix, now_us - c->last_us);
+	n += put_varint(prefix + n, pipe);
+	n += put_varint(prefix + n, header_len);
+	n += put_varint(prefix + n, body_len);
+	prefix[n++] = kind;
+	prefix[n++] = proto;
+
+	if (c->max > 0 && c->bytes + n + header_len + body_len > c->max) {
+		c->dropped++;
+		rv = 1;
+		goto out;
+	}
+	if (fwrite(prefix, 1, n, c->fp) != n ||
+	    fwrite(header, 1, header_len, c->fp) != header_len ||
+	    fwrite(body, 1, body_len, c->fp) != body_len) {
+		rv = -1;
+		goto out;
+	}
+	c->bytes += n + header_len + body_len;
+	c->last_us = now_us;
+	c->records++;
+	if (now_us - c->flush_us >= NANO_CAPTURE_FLUSH_US) {
+		fflush(c->fp);
+		c->flush_us = now_us;
+	}
+out:
+	pthread_mutex_unlock(&c->mtx);
+	return rv;
+}
+
+void
+nano_capture_close(nano_capture *c)
+{
+	if (c->fp == NULL) {
+		return;
+	}
+	fclose(c->fp);
+	pthread_mutex_destroy(&c->mtx);
+	memset(c, 0, sizeof(nano_capture));
+}
+
+/**
+ * @brief nano_capture_reader_open - Open a capture file to read.
+ * @param r - nano_capture_reader
+ * @param path - file
+ * @return 0, or -1 with errno, EINVAL if it is not a capture file
+ */
+int
+nano_capture_reader_open(nano_capture_reader *r, const char *path)
+{
+	uint8_t header[NANO_CAPTURE_HEADER];
+
+	memset(r, 0, sizeof(nano_capture_reader));
+	if ((r->fp = fopen(path, "rb")) == NULL) {
+		return -1;
+	}
+	if (fread(header, 1, sizeof(header), r->fp) != sizeof(header) ||
+	    memcmp(header, capture_magic, sizeof(capture_magic)) != 0 ||
+	    header[4] != NANO_CAPTURE_VERSION) {
+		fclose(r->fp);
+		r->fp = NULL;
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief nano_capture_next - Read the next record, its header and body
+ * are good until the next call.
+ * @param r - nano_capture_reader
+ * @param rec - set to the record
+ * @return false at the end of the file, or once it is broken
+ */
+bool
+nano_capture_next(nano_capture_reader *r, nano_capture_record *rec)
+{
+	uint64_t dt, pipe, hlen, blen;
+	int      kind, proto;
+	uint8_t *p;
+
+	if (r->fp == NULL || !get_varint(r->fp, &dt) ||
+	    !get_varint(r->fp, &pipe) || !get_varint(r->fp, &hlen) ||
+	    !get_varint(r->fp, &blen) || (kind = getc(r->fp)) == EOF ||
+	    (proto = getc(r->fp)) == EOF || pipe > UINT32_MAX ||
+	    hlen > NANO_CAPTURE_MAX || blen > NANO_CAPTURE_MAX - hlen) {
+		return false;
+	}
+	if (hlen + blen > r->cap) {
+		if ((p = zrealloc(r->buf, hlen + blen)) == NULL) {
+			return false;
+		}
+		r->buf = p;
+		r->cap = hlen + blen;
+	}
+	if (fread(r->buf, 1, hlen + blen, r->fp) != hlen + blen) {
+		return false;
+	}
+
+	r->time_us += dt;
+	rec->time_us    = r->time_us;
+	rec->pipe       = (uint32_t) pipe;
+	rec->kind       = (uint8_t) kind;
+	rec->proto      = (uint8_t) proto;
+	rec->header     = r->buf;
+	rec->header_len = (uint32_t) hlen;
+	rec->body       = r->buf + hlen;
+	rec->body_len   = (uint32_t) blen;
+
+	return true;
+}
+
+void
+nano_capture_reader_close(nano_capture_reader *r)
+{
+	if (r->fp != NULL) {
+		fclose(r->fp);
+	}
+	zfree(r->buf);
+	memset(r, 0, sizeof(nano_capture_reader));
+}
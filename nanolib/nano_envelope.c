@@ -0,0 +1,228 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "include/nano_envelope.h"
+#include "include/nano_lz.h"
+#include "include/zmalloc.h"
+
+#define RECORD_HEADER 7
+
+static inline void
+put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline uint32_t
+get_u32(const uint8_t *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+	    ((uint32_t) p[2] << 8) | p[3];
+}
+
+void
+nano_envelope_init(nano_envelope *e)
+{
+	memset(e, 0, sizeof(nano_envelope));
+}
+
+void
+nano_envelope_fini(nano_envelope *e)
+{
+	zfree(e->buf);
+	memset(e, 0, sizeof(nano_envelope));
+}
+
+// empty again, keeping the buffer
+void
+nano_envelope_reset(nano_envelope *e)
+{
+	e->len   = 0;
+	e->count = 0;
+	e->qos   = 0;
+}
+
+/**
+ * @brief nano_envelope_add - Append a publish to an envelope, copied.
+ * @param e - nano_envelope
+ * @param topic - topic, not 0 terminated
+ * @param topic_len - of topic, up to 65535
+ * @param payload - payload
+ * @param payload_len - of payload
+ * @param flags - NANO_ENVELOPE_RETAIN and the qos shifted by 1
+ * @return 0, or -1 if it does not fit in NANO_ENVELOPE_MAX
+ */
+int
+nano_envelope_add(nano_envelope *e, const char *topic, size_t topic_len,
+    const uint8_t *payload, size_t payload_len, uint8_t flags)
+{
+	size_t   need = RECORD_HEADER + topic_len + payload_len;
+	uint8_t *p;
+
+	if (topic_len > UINT16_MAX || need > NANO_ENVELOPE_MAX - e->len) {
+		return -1;
+	}
+	if (e->len + need > e->cap) {
+		size_t cap = e->cap > 0 ? e->cap : 1024;
+
+		while (cap < e->len + need) {
+			cap *= 2;
+		}
+		if ((p = zrealloc(e->buf, cap)) == NULL) {
+			return -1;
+		}
+		e->buf = p;
+		e->cap = cap;
+	}
+	p    = e->buf + e->len;
+	p[0] = flags;
+	p[1] = topic_len >> 8;
+	p[2] = topic_len & 0xff;
+	put_u32(p + 3, (uint32_t) payload_len);
+	memcpy(p + RECORD_HEADER, topic, topic_len);
+	memcpy(p + RECORD_HEADER + topic_len, payload, payload_len);
+	e->len += need;
+	e->count++;
+	if (((flags >> 1) & 0x03) > e->qos) {
+		e->qos = (flags >> 1) & 0x03;
+	}
+	return 0;
+}
+
+/**
+ * @brief nano_envelope_pack - Make the wire form of an envelope, its
+ * records compressed if asked and they shrink.
+ * @param e - nano_envelope, left as it is
+ * @param compress - try nano_lz on the records
+ * @param len - set to the bytes of the wire form
+ * @return wire form for zfree, or NULL
+ */
+uint8_t *
+nano_envelope_pack(nano_envelope *e, bool compress, size_t *len)
+{
+	uint8_t *out = zmalloc(NANO_ENVELOPE_HEADER + e->len);
+	size_t   n   = 0;
+
+	if (out == NULL) {
+		return NULL;
+	}
+	if (compress && e->len > 1) {
+		n = nano_lz_compress(
+		    e->buf, e->len, out + NANO_ENVELOPE_HEADER, e->len - 1);
+	}
+	if (n == 0) {
+		memcpy(out + NANO_ENVELOPE_HEADER, e->buf, e->len);
+	}
+	out[0] = 'N';
+	out[1] = 'B';
+	out[2] = NANO_ENVELOPE_VERSION;
+	out[3] = n > 0 ? NANO_ENVELOPE_LZ : 0;
+	put_u32(out + 4, e->count);
+	put_u32(out + 8, (uint32_t) e->len);
+	*len = NANO_ENVELOPE_HEADER + (n > 0 ? n : e->len);
+
+	return out;
+}
+
+// looks like an envelope of this version, the records are not checked
+bool
+nano_envelope_is(const uint8_t *in, size_t len)
+{
+	return len >= NANO_ENVELOPE_HEADER && in[0] == 'N' && in[1] == 'B' &&
+	    in[2] == NANO_ENVELOPE_VERSION &&
+	    get_u32(in + 8) <= NANO_ENVELOPE_MAX;
+}
+
+/**
+ * @brief nano_envelope_open - Unpack the records of the wire form of an
+ * envelope, in is not used afterwards.
+ * @param r - nano_envelope_reader, closed by the caller if 0 is returned
+ * @param in - wire form
+ * @param len - of in
+ * @return 0, or -1 if in is broken
+ */
+int
+nano_envelope_open(nano_envelope_reader *r, const uint8_t *in, size_t len)
+{
+	const uint8_t *body = in + NANO_ENVELOPE_HEADER;
+	size_t         raw;
+
+	memset(r, 0, sizeof(nano_envelope_reader));
+	if (!nano_envelope_is(in, len)) {
+		return -1;
+	}
+	raw = get_u32(in + 8);
+	len -= NANO_ENVELOPE_HEADER;
+	if ((in[3] & NANO_ENVELOPE_LZ) == 0 && len != raw) {
+		return -1;
+	}
+	if ((r->buf = zmalloc(raw > 0 ? raw : 1)) == NULL) {
+		return -1;
+	}
+	if ((in[3] & NANO_ENVELOPE_LZ) == 0) {
+		memcpy(r->buf, body, raw);
+	} else if (nano_lz_decompress(body, len, r->buf, raw) != raw) {
+		nano_envelope_close(r);
+		return -1;
+	}
+	r->pos  = r->buf;
+	r->end  = r->buf + raw;
+	r->left = get_u32(in + 4);
+
+	return 0;
+}
+
+/**
+ * @brief nano_envelope_next - The next record, pointers into the reader.
+ * @param r - nano_envelope_reader
+ * @param topic - set to the topic, not 0 terminated
+ * @param topic_len - set to its length
+ * @param payload - set to the payload
+ * @param payload_len - set to its length
+ * @param flags - set to the flags of the record
+ * @return false once all are read, or at a broken one
+ */
+bool
+nano_envelope_next(nano_envelope_reader *r, const char **topic,
+    uint16_t *topic_len, const uint8_t **payload, uint32_t *payload_len,
+    uint8_t *flags)
+{
+	const uint8_t *p = r->pos;
+	size_t         tlen, plen;
+
+	if (r->left == 0 || (size_t) (r->end - p) < RECORD_HEADER) {
+		return false;
+	}
+	tlen = (p[1] << 8) | p[2];
+	plen = get_u32(p + 3);
+	if (tlen + plen > (size_t) (r->end - p) - RECORD_HEADER) {
+		r->left = 0;
+		return false;
+	}
+	*flags       = p[0];
+	*topic_len   = tlen;
+	*topic       = (const char *) p + RECORD_HEADER;
+	*payload_len = plen;
+	*payload     = p + RECORD_HEADER + tlen;
+	r->pos       = p + RECORD_HEADER + tlen + plen;
+	r->left--;
+
+	return true;
+}
+
+void
+nano_envelope_close(nano_envelope_reader *r)
+{
+	zfree(r->buf);
+	memset(r, 0, sizeof(nano_envelope_reader));
+}
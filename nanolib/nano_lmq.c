@@ -158,6 +158,28 @@ nano_lmq_getq(nano_lmq *lmq, void **msgp)
 	return (0);
 }
 
+// the msg nano_lmq_getq would take, left in the queue
+int
+nano_lmq_peek(nano_lmq *lmq, void **msgp)
+{
+	if (lmq->lmq_len == 0) {
+		return (-8);
+	}
+	*msgp = lmq->lmq_msgs[lmq->lmq_get];
+	return (0);
+}
+
+// the slot of the i-th msg from the one nano_lmq_getq would take, NULL
+// past the last one, a msg may be replaced there in place
+void **
+nano_lmq_slot(nano_lmq *lmq, size_t i)
+{
+	if (i >= lmq->lmq_len) {
+		return (NULL);
+	}
+	return (&lmq->lmq_msgs[(lmq->lmq_get + i) & lmq->lmq_mask]);
+}
+
 int
 nano_lmq_resize(nano_lmq *lmq, size_t cap)
 {
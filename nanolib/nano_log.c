@@ -0,0 +1,458 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "include/nano_log.h"
+#include "include/zmalloc.h"
+
+#define LOG_RING_SIZE 256 // lines of a thread, a power of 2
+#define LOG_TEXT_MAX 224  // a longer line is cut
+#define LOG_OUT_SIZE (16 * 1024)
+#define LOG_FLUSH_INTERVAL 100
+
+typedef struct {
+	uint64_t    time; // ms since the epoch
+	const char *func;
+	int         line;
+	int         level;
+	char        text[LOG_TEXT_MAX];
+} log_line;
+
+// head is only stored by the owner and tail only by the writer, each on a
+// cache line of its own.
+typedef struct log_ring log_ring;
+struct log_ring {
+	uint32_t      head;
+	char          pad0[60];
+	uint32_t      tail;
+	char          pad1[60];
+	uint64_t      dropped;
+	unsigned long thread;
+	bool          dead; // the owner exited, freed once drained
+	log_ring *    next;
+	log_line      lines[LOG_RING_SIZE];
+};
+
+int nano_log_cur_level = NANO_LOG_DEBUG;
+
+static struct {
+	pthread_mutex_t mtx;
+	pthread_cond_t  cv;
+	pthread_t       thr;
+	bool            running;
+	bool            stop;
+	int             to;
+	uint32_t        interval;
+	FILE *          file;
+	log_ring *      rings;   // prepended under mtx, read without it
+	uint64_t        written; // by the writer
+	uint64_t        dropped; // by the rings already freed
+	char            out[LOG_OUT_SIZE];
+	size_t          out_len;
+} logger = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.cv  = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_key_t      ring_key;
+static pthread_once_t     ring_once = PTHREAD_ONCE_INIT;
+static __thread log_ring *ring_self = NULL;
+
+static const char *level_names[] = { "trace", "debug", "info", "warn",
+	"error", "off" };
+static const char *level_tags[]  = { "TRACE", "DEBUG", "INFO", "WARN",
+	"ERROR" };
+static const int   level_prio[]  = { LOG_DEBUG, LOG_DEBUG, LOG_INFO,
+	LOG_WARNING, LOG_ERR };
+
+static uint64_t
+log_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// "2021-11-02 10:11:12.123 INFO  [thread] func:line: text\n"
+static int
+log_format(char *buf, size_t sz, uint64_t ms, int level,
+    unsigned long thread, const char *func, int line, const char *text)
+{
+	time_t    sec = ms / 1000;
+	struct tm tm;
+	size_t    n;
+	int       rv;
+
+	localtime_r(&sec, &tm);
+	n  = strftime(buf, sz, "%Y-%m-%d %H:%M:%S", &tm);
+	rv = snprintf(buf + n, sz - n, ".%03d %-5s [%lu] %s:%d: %s\n",
+	    (int) (ms % 1000), level_tags[level], thread, func, line, text);
+	if (rv < 0) {
+		return (int) n;
+	}
+	if ((size_t) rv >= sz - n) {
+		buf[sz - 2] = '\n';
+		return (int) sz - 1;
+	}
+	return (int) n + rv;
+}
+
+static void
+ring_exit(void *arg)
+{
+	log_ring *r = arg;
+
+	ring_self = NULL;
+	__atomic_store_n(&r->dead, true, __ATOMIC_RELEASE);
+}
+
+static void
+ring_key_init(void)
+{
+	pthread_key_create(&ring_key, ring_exit);
+}
+
+// The ring of the calling thread, made and linked on its first line.
+static log_ring *
+ring_get(void)
+{
+	log_ring *r;
+
+	if (ring_self != NULL) {
+		return ring_self;
+	}
+	pthread_once(&ring_once, ring_key_init);
+	r = zmalloc(sizeof(log_ring));
+	memset(r, 0, sizeof(log_ring));
+	r->thread = (unsigned long) pthread_self();
+	pthread_setspecific(ring_key, r);
+
+	pthread_mutex_lock(&logger.mtx);
+	r->next = logger.rings;
+	__atomic_store_n(&logger.rings, r, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&logger.mtx);
+	ring_self = r;
+
+	return r;
+}
+
+static void
+out_flush(void)
+{
+	if (logger.out_len == 0) {
+		return;
+	}
+	if (logger.to & NANO_LOG_TO_CONSOLE) {
+		fwrite(logger.out, 1, logger.out_len, stderr);
+	}
+	if (logger.file != NULL) {
+		fwrite(logger.out, 1, logger.out_len, logger.file);
+		fflush(logger.file);
+	}
+	logger.out_len = 0;
+}
+
+static void
+out_line(const log_ring *r, const log_line *l)
+{
+	if (logger.to & NANO_LOG_TO_SYSLOG) {
+		syslog(level_prio[l->level], "%s:%d: %s", l->func, l->line,
+		    l->text);
+	}
+	if (logger.file == NULL && !(logger.to & NANO_LOG_TO_CONSOLE)) {
+		return;
+	}
+	if (LOG_OUT_SIZE - logger.out_len < LOG_TEXT_MAX + 128) {
+		out_flush();
+	}
+	logger.out_len += log_format(logger.out + logger.out_len,
+	    LOG_OUT_SIZE - logger.out_len, l->time, l->level, r->thread,
+	    l->func, l->line, l->text);
+}
+
+// Write the lines of all rings, free the rings of threads gone.
+static void
+log_drain(void)
+{
+	log_ring * r;
+	log_ring * next;
+	log_ring **pp;
+	uint32_t   head;
+	uint32_t   tail;
+	bool       dead;
+	uint64_t   n = 0;
+
+	r = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE);
+	while (r != NULL) {
+		next = r->next;
+		// the last line of a thread is published before it is dead
+		dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+		tail = r->tail;
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (; tail != head; tail++) {
+			out_line(r, &r->lines[tail & (LOG_RING_SIZE - 1)]);
+			n++;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+		if (dead) {
+			pthread_mutex_lock(&logger.mtx);
+			for (pp = &logger.rings; *pp != r; pp = &(*pp)->next)
+				;
+			*pp = next;
+			logger.dropped += r->dropped;
+			pthread_mutex_unlock(&logger.mtx);
+			zfree(r);
+		}
+		r = next;
+	}
+	out_flush();
+	__atomic_store_n(
+	    &logger.written, logger.written + n, __ATOMIC_RELAXED);
+}
+
+static void *
+log_thread(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&logger.mtx);
+	while (!logger.stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += logger.interval / 1000;
+		ts.tv_nsec += (logger.interval % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&logger.cv, &logger.mtx, &ts);
+		pthread_mutex_unlock(&logger.mtx);
+		log_drain();
+		pthread_mutex_lock(&logger.mtx);
+	}
+	pthread_mutex_unlock(&logger.mtx);
+
+	return NULL;
+}
+
+/**
+ * @brief nano_log_open - Start the writer, lines are queued from now on.
+ * @param opt - nano_log_opt
+ * @return 0, or -1 if the writer is running or can not be started
+ */
+int
+nano_log_open(const nano_log_opt *opt)
+{
+	if (__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+	logger.to       = opt->to;
+	logger.interval = opt->flush_interval > 0 ? opt->flush_interval
+	                                          : LOG_FLUSH_INTERVAL;
+	logger.file     = NULL;
+	logger.stop     = false;
+	if ((opt->to & NANO_LOG_TO_FILE) && opt->file != NULL &&
+	    (logger.file = fopen(opt->file, "a")) == NULL) {
+		fprintf(stderr, "log file %s can not be opened\n", opt->file);
+	}
+	if (opt->to & NANO_LOG_TO_SYSLOG) {
+		openlog("nanomq", LOG_PID, LOG_DAEMON);
+	}
+	if (pthread_create(&logger.thr, NULL, log_thread, NULL) != 0) {
+		if (logger.file != NULL) {
+			fclose(logger.file);
+			logger.file = NULL;
+		}
+		return -1;
+	}
+	nano_log_set_level(opt->level);
+	__atomic_store_n(&logger.running, true, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * @brief nano_log_close - Stop the writer after the lines queued are
+ * written, lines go to stderr again.
+ * @return void
+ */
+void
+nano_log_close(void)
+{
+	if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	__atomic_store_n(&logger.running, false, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&logger.mtx);
+	logger.stop = true;
+	pthread_cond_signal(&logger.cv);
+	pthread_mutex_unlock(&logger.mtx);
+	pthread_join(logger.thr, NULL);
+
+	log_drain();
+	if (logger.file != NULL) {
+		fclose(logger.file);
+		logger.file = NULL;
+	}
+	if (logger.to & NANO_LOG_TO_SYSLOG) {
+		closelog();
+	}
+}
+
+void
+nano_log_set_level(int level)
+{
+	if (level < NANO_LOG_TRACE) {
+		level = NANO_LOG_TRACE;
+	} else if (level > NANO_LOG_OFF) {
+		level = NANO_LOG_OFF;
+	}
+	__atomic_store_n(&nano_log_cur_level, level, __ATOMIC_RELAXED);
+}
+
+int
+nano_log_get_level(void)
+{
+	return __atomic_load_n(&nano_log_cur_level, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief nano_log_level - Level of a name.
+ * @param name - trace, debug, info, warn, error or off
+ * @return NANO_LOG_* or -1 if name is unknown
+ */
+int
+nano_log_level(const char *name)
+{
+	for (int i = NANO_LOG_TRACE; i <= NANO_LOG_OFF; i++) {
+		if (strcasecmp(name, level_names[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char *
+nano_log_level_str(int level)
+{
+	if (level < NANO_LOG_TRACE || level > NANO_LOG_OFF) {
+		return "unknown";
+	}
+	return level_names[level];
+}
+
+/**
+ * @brief nano_log_to - Sinks of a list of names.
+ * @param names - console, file or syslog, separated by ',' or '|'
+ * @return NANO_LOG_TO_* flags, unknown names are ignored
+ */
+int
+nano_log_to(const char *names)
+{
+	const char *p  = names;
+	int         to = 0;
+	size_t      n;
+
+	while (*p != '\0') {
+		n = strcspn(p, ",| ");
+		if (n == 7 && strncasecmp(p, "console", n) == 0) {
+			to |= NANO_LOG_TO_CONSOLE;
+		} else if (n == 4 && strncasecmp(p, "file", n) == 0) {
+			to |= NANO_LOG_TO_FILE;
+		} else if (n == 6 && strncasecmp(p, "syslog", n) == 0) {
+			to |= NANO_LOG_TO_SYSLOG;
+		}
+		p += n;
+		if (*p != '\0') {
+			p++;
+		}
+	}
+	return to;
+}
+
+void
+nano_log_get_stats(nano_log_stats *stats)
+{
+	log_ring *r;
+
+	pthread_mutex_lock(&logger.mtx);
+	stats->written = __atomic_load_n(&logger.written, __ATOMIC_RELAXED);
+	stats->dropped = logger.dropped;
+	for (r = logger.rings; r != NULL; r = r->next) {
+		stats->dropped +=
+		    __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&logger.mtx);
+}
+
+/**
+ * @brief nano_log_write - Queue a line to the ring of the calling thread,
+ * or write it to stderr if the writer is not running. Callers go through
+ * nano_log, which checks the level first.
+ * @param level - NANO_LOG_*
+ * @param func - function of the line
+ * @param line - source line
+ * @param fmt - printf format
+ * @return void
+ */
+void
+nano_log_write(int level, const char *func, int line, const char *fmt, ...)
+{
+	va_list   ap;
+	log_ring *r;
+	log_line *l;
+	uint32_t  head;
+	uint32_t  used;
+	char      text[LOG_TEXT_MAX];
+	char      buf[LOG_TEXT_MAX + 128];
+
+	if (level < NANO_LOG_TRACE || level >= NANO_LOG_OFF) {
+		return;
+	}
+	if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+		va_start(ap, fmt);
+		vsnprintf(text, sizeof(text), fmt, ap);
+		va_end(ap);
+		log_format(buf, sizeof(buf), log_now(), level,
+		    (unsigned long) pthread_self(), func, line, text);
+		fputs(buf, stderr);
+		return;
+	}
+
+	r    = ring_get();
+	head = r->head;
+	used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (used == LOG_RING_SIZE) {
+		__atomic_store_n(
+		    &r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	l        = &r->lines[head & (LOG_RING_SIZE - 1)];
+	l->time  = log_now();
+	l->func  = func;
+	l->line  = line;
+	l->level = level;
+	va_start(ap, fmt);
+	vsnprintf(l->text, sizeof(l->text), fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+	// wake the writer early rather than drop lines of a busy thread
+	if (used + 1 == LOG_RING_SIZE * 3 / 4) {
+		pthread_cond_signal(&logger.cv);
+	}
+}
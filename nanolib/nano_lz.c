@@ -0,0 +1,162 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "include/nano_lz.h"
+
+#define LZ_HLOG 13
+#define LZ_HSIZE (1 << LZ_HLOG)
+#define LZ_MAX_LIT 32
+#define LZ_MAX_OFF (1 << 13)
+#define LZ_MAX_REF (7 + 255 + 2) // bytes of the longest reference
+
+static inline uint32_t
+lz_hash(const uint8_t *p)
+{
+	uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+
+	return (v * 2654435761u) >> (32 - LZ_HLOG);
+}
+
+/**
+ * @brief nano_lz_compress - Compress len bytes of in to out. The last
+ * position of each 3 bytes hash is the only candidate of a reference.
+ * @param in - data
+ * @param len - length of data
+ * @param out - buffer
+ * @param out_len - size of out
+ * @return bytes written to out, 0 if out is too small
+ */
+size_t
+nano_lz_compress(const uint8_t *in, size_t len, uint8_t *out, size_t out_len)
+{
+	uint32_t       htab[LZ_HSIZE]; // position plus 1, 0 is none
+	const uint8_t *ip   = in;
+	const uint8_t *end  = in + len;
+	const uint8_t *ref  = NULL;
+	uint8_t *      op   = out;
+	uint8_t *      oend = out + out_len;
+	uint8_t *      ctrl = NULL; // of the open literal run
+	size_t         lit  = 0;
+	size_t         off, n, max;
+	uint32_t       h;
+
+	memset(htab, 0, sizeof(htab));
+	while (ip < end) {
+		ref = NULL;
+		if (end - ip >= 3) {
+			h       = lz_hash(ip);
+			ref     = htab[h] ? in + htab[h] - 1 : NULL;
+			htab[h] = (uint32_t) (ip - in) + 1;
+		}
+		if (ref != NULL && (off = ip - ref - 1) < LZ_MAX_OFF &&
+		    memcmp(ref, ip, 3) == 0) {
+			max = end - ip < LZ_MAX_REF ? end - ip : LZ_MAX_REF;
+			for (n = 3; n < max && ref[n] == ip[n]; n++)
+				;
+			if (ctrl != NULL) {
+				*ctrl = lit - 1;
+				ctrl  = NULL;
+				lit   = 0;
+			}
+			if (oend - op < 3) {
+				return 0;
+			}
+			ip += n;
+			n -= 2;
+			if (n < 7) {
+				*op++ = (off >> 8) | (n << 5);
+			} else {
+				*op++ = (off >> 8) | (7 << 5);
+				*op++ = n - 7;
+			}
+			*op++ = off & 0xff;
+			continue;
+		}
+
+		if (ctrl == NULL) {
+			if (op >= oend) {
+				return 0;
+			}
+			ctrl = op++;
+		}
+		if (op >= oend) {
+			return 0;
+		}
+		*op++ = *ip++;
+		if (++lit == LZ_MAX_LIT) {
+			*ctrl = lit - 1;
+			ctrl  = NULL;
+			lit   = 0;
+		}
+	}
+	if (ctrl != NULL) {
+		*ctrl = lit - 1;
+	}
+
+	return op - out;
+}
+
+/**
+ * @brief nano_lz_decompress - Decompress what nano_lz_compress wrote.
+ * @param in - compressed data
+ * @param len - length of in
+ * @param out - buffer
+ * @param out_len - size of out
+ * @return bytes written to out, 0 if in is broken or out too small
+ */
+size_t
+nano_lz_decompress(
+    const uint8_t *in, size_t len, uint8_t *out, size_t out_len)
+{
+	const uint8_t *ip   = in;
+	const uint8_t *iend = in + len;
+	uint8_t *      op   = out;
+	uint8_t *      oend = out + out_len;
+	const uint8_t *ref;
+	size_t         n, off;
+	uint8_t        c;
+
+	while (ip < iend) {
+		c = *ip++;
+		if (c < LZ_MAX_LIT) {
+			n = (size_t) c + 1;
+			if ((size_t) (iend - ip) < n ||
+			    (size_t) (oend - op) < n) {
+				return 0;
+			}
+			memcpy(op, ip, n);
+			op += n;
+			ip += n;
+			continue;
+		}
+
+		n = c >> 5;
+		if (n == 7) {
+			if (ip >= iend) {
+				return 0;
+			}
+			n += *ip++;
+		}
+		n += 2;
+		if (ip >= iend) {
+			return 0;
+		}
+		off = ((size_t) (c & 0x1f) << 8) + *ip++ + 1;
+		if (off > (size_t) (op - out) || (size_t) (oend - op) < n) {
+			return 0;
+		}
+		// may overlap what it writes, copy byte by byte
+		for (ref = op - off; n > 0; n--) {
+			*op++ = *ref++;
+		}
+	}
+
+	return op - out;
+}
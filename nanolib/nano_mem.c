@@ -0,0 +1,124 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include "include/nano_mem.h"
+
+// each on a cache line of its own, the tags are counted by different
+// threads
+typedef struct {
+	size_t bytes;
+	char   pad[64 - sizeof(size_t)];
+} mem_counter;
+
+static mem_counter counters[NANO_MEM_TAGS];
+static size_t      high     = 0;
+static size_t      low      = 0;
+static bool        pressure = false;
+
+static const char *names[NANO_MEM_TAGS] = {
+	"tree",
+	"retain",
+	"session",
+	"inflight",
+	"conn",
+};
+
+void
+nano_mem_add(nano_mem_tag tag, size_t bytes)
+{
+	__atomic_add_fetch(&counters[tag].bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void
+nano_mem_sub(nano_mem_tag tag, size_t bytes)
+{
+	__atomic_sub_fetch(&counters[tag].bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void
+nano_mem_set(nano_mem_tag tag, size_t bytes)
+{
+	__atomic_store_n(&counters[tag].bytes, bytes, __ATOMIC_RELAXED);
+}
+
+size_t
+nano_mem_used(nano_mem_tag tag)
+{
+	return __atomic_load_n(&counters[tag].bytes, __ATOMIC_RELAXED);
+}
+
+size_t
+nano_mem_total(void)
+{
+	size_t total = 0;
+
+	for (int i = 0; i < NANO_MEM_TAGS; i++) {
+		total += nano_mem_used(i);
+	}
+	return total;
+}
+
+const char *
+nano_mem_name(nano_mem_tag tag)
+{
+	return names[tag];
+}
+
+/**
+ * @brief nano_mem_watermarks - Set where pressure starts and ends, and
+ * end it.
+ * @param h - bytes of all tags pressure starts above, 0 never
+ * @param l - bytes pressure ends below, 0 or above h for 90% of h
+ * @return void
+ */
+void
+nano_mem_watermarks(size_t h, size_t l)
+{
+	high = h;
+	low  = l > 0 && l < h ? l : h / 10 * 9;
+	__atomic_store_n(&pressure, false, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief nano_mem_check - Start or end pressure by the total, between the
+ * watermarks it stays as it is. Called by one thread.
+ * @return whether under pressure
+ */
+bool
+nano_mem_check(void)
+{
+	size_t total = nano_mem_total();
+	bool   p     = nano_mem_pressure();
+
+	if (high == 0) {
+		p = false;
+	} else if (total > high) {
+		p = true;
+	} else if (total < low) {
+		p = false;
+	}
+	__atomic_store_n(&pressure, p, __ATOMIC_RELAXED);
+
+	return p;
+}
+
+bool
+nano_mem_pressure(void)
+{
+	return __atomic_load_n(&pressure, __ATOMIC_RELAXED);
+}
+
+// bytes to free for the total to be below the low watermark
+size_t
+nano_mem_excess(void)
+{
+	size_t total = nano_mem_total();
+
+	return high > 0 && total >= low ? total - low + 1 : 0;
+}
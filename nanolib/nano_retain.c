@@ -0,0 +1,911 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <pthread.h>
+#include <string.h>
+
+#include "include/dbg.h"
+#include "include/nano_lz.h"
+#include "include/nano_retain.h"
+#include "include/zmalloc.h"
+
+#define RETAIN_BUCKETS_MIN 64
+#define RETAIN_SCAN_STEP 1024 // buckets a cursor walks in a step at most
+#define RETAIN_INDEX_DEPTH 3  // first levels of topics indexed
+
+typedef struct retain_entry retain_entry;
+
+struct retain_entry {
+	retain_entry *next;     // in the same bucket
+	retain_entry *lru_prev; // towards the front
+	retain_entry *lru_next;
+	uint64_t      expire_at; // 0 never
+	uint32_t      hash;
+	uint32_t      topic_len;
+	uint32_t      props_len;
+	uint32_t      payload_len;
+	uint32_t      stored_len; // of the payload in data
+	uint32_t      refs;       // the table and the cursors holding it
+	uint8_t       qos;
+	bool          compressed;
+	uint8_t       depth; // of the groups it is in
+	struct {
+		retain_entry *prev;
+		retain_entry *next;
+	} links[RETAIN_INDEX_DEPTH]; // in the group of the first levels
+	uint8_t data[];              // topic, '\0', properties, payload
+};
+
+// the messages of which the first levels of the topic are prefix
+typedef struct retain_group retain_group;
+
+struct retain_group {
+	retain_group *next; // in the same bucket
+	retain_entry *first;
+	uint32_t      hash;
+	uint32_t      len;
+	char          prefix[];
+};
+
+struct nano_retain {
+	pthread_mutex_t mtx;
+	nano_retain_opt opt;
+	retain_entry ** buckets;
+	size_t          mask; // buckets minus 1
+	size_t          count;
+	size_t          used; // bytes of the blocks
+	retain_entry *  front;
+	retain_entry *  back;
+	uint64_t        evicted;
+	uint64_t        compressed;
+	uint64_t        expired;
+	size_t          sweep; // next bucket of nano_retain_expire
+	retain_group ** groups;
+	size_t          group_mask;
+	size_t          group_count;
+	size_t          group_used; // bytes of the groups
+};
+
+struct nano_retain_cursor {
+	nano_retain *  r;
+	char *         filter;
+	bool           wild;
+	bool           done;   // nothing left to take from the store
+	int            levels; // of the group walked, 0 walks the table
+	size_t         v;      // bucket of the next step, reverse binary order
+	retain_entry **held;   // taken from the store, handed out unlocked
+	size_t         held_len;
+	size_t         held_cap;
+	size_t         pos;     // next one of held to hand out
+	uint8_t *      scratch; // compressed payloads handed out
+	size_t         scratch_len;
+};
+
+static inline uint32_t
+topic_hash(const char *topic, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (uint8_t) topic[i]) * 16777619u;
+	}
+	return h;
+}
+
+static inline size_t
+entry_size(const retain_entry *e)
+{
+	return sizeof(*e) + e->topic_len + 1 + e->props_len + e->stored_len;
+}
+
+static inline const uint8_t *
+entry_props(const retain_entry *e)
+{
+	return e->data + e->topic_len + 1;
+}
+
+static inline const uint8_t *
+entry_payload(const retain_entry *e)
+{
+	return e->data + e->topic_len + 1 + e->props_len;
+}
+
+static void
+lru_unlink(nano_retain *r, retain_entry *e)
+{
+	if (e->lru_prev) {
+		e->lru_prev->lru_next = e->lru_next;
+	} else {
+		r->front = e->lru_next;
+	}
+	if (e->lru_next) {
+		e->lru_next->lru_prev = e->lru_prev;
+	} else {
+		r->back = e->lru_prev;
+	}
+}
+
+static void
+lru_push_front(nano_retain *r, retain_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = r->front;
+	if (r->front) {
+		r->front->lru_prev = e;
+	} else {
+		r->back = e;
+	}
+	r->front = e;
+}
+
+static retain_entry **
+entry_find(nano_retain *r, const char *topic, size_t len, uint32_t hash)
+{
+	retain_entry **pe = &r->buckets[hash & r->mask];
+
+	for (; *pe != NULL; pe = &(*pe)->next) {
+		if ((*pe)->hash == hash && (*pe)->topic_len == len &&
+		    memcmp((*pe)->data, topic, len) == 0) {
+			break;
+		}
+	}
+	return pe;
+}
+
+// end of the level-th level of topic, -1 if it has fewer levels
+static long
+level_end(const char *topic, size_t len, int level)
+{
+	size_t i = 0;
+
+	for (;;) {
+		while (i < len && topic[i] != '/') {
+			i++;
+		}
+		if (--level == 0) {
+			return (long) i;
+		}
+		if (i == len) {
+			return -1;
+		}
+		i++;
+	}
+}
+
+static retain_group **
+group_find(nano_retain *r, const char *prefix, size_t len, uint32_t hash)
+{
+	retain_group **pg = &r->groups[hash & r->group_mask];
+
+	for (; *pg != NULL; pg = &(*pg)->next) {
+		if ((*pg)->hash == hash && (*pg)->len == len &&
+		    memcmp((*pg)->prefix, prefix, len) == 0) {
+			break;
+		}
+	}
+	return pg;
+}
+
+static void
+groups_grow(nano_retain *r)
+{
+	size_t          n = (r->group_mask + 1) * 2;
+	retain_group ** b = zmalloc(sizeof(retain_group *) * n);
+	retain_group *  g, *next;
+
+	if (b == NULL) {
+		return;
+	}
+	memset(b, 0, sizeof(retain_group *) * n);
+	for (size_t i = 0; i <= r->group_mask; i++) {
+		for (g = r->groups[i]; g != NULL; g = next) {
+			next    = g->next;
+			g->next = b[g->hash & (n - 1)];
+			b[g->hash & (n - 1)] = g;
+		}
+	}
+	zfree(r->groups);
+	r->groups     = b;
+	r->group_mask = n - 1;
+}
+
+// take e out of the groups it is in, a group left empty is freed
+static void
+index_del(nano_retain *r, retain_entry *e)
+{
+	const char *   topic = (const char *) e->data;
+	retain_group **pg, *g;
+	size_t         len;
+
+	for (int k = 0; k < e->depth; k++) {
+		len = (size_t) level_end(topic, e->topic_len, k + 1);
+		pg  = group_find(r, topic, len, topic_hash(topic, len));
+		g   = *pg;
+		if (e->links[k].prev != NULL) {
+			e->links[k].prev->links[k].next = e->links[k].next;
+		} else {
+			g->first = e->links[k].next;
+		}
+		if (e->links[k].next != NULL) {
+			e->links[k].next->links[k].prev = e->links[k].prev;
+		}
+		if (g->first == NULL) {
+			*pg = g->next;
+			r->group_count--;
+			r->group_used -= sizeof(*g) + g->len;
+			zfree(g);
+		}
+	}
+	e->depth = 0;
+}
+
+// put e in the group of each of its first levels, false if one can not
+// be made, e is then in none
+static bool
+index_add(nano_retain *r, retain_entry *e)
+{
+	const char *   topic = (const char *) e->data;
+	retain_group **pg, *g;
+	long           len;
+	uint32_t       hash;
+
+	for (int k = 0; k < RETAIN_INDEX_DEPTH; k++) {
+		if ((len = level_end(topic, e->topic_len, k + 1)) < 0) {
+			break;
+		}
+		hash = topic_hash(topic, len);
+		pg   = group_find(r, topic, len, hash);
+		if ((g = *pg) == NULL) {
+			if ((g = zmalloc(sizeof(*g) + len)) == NULL) {
+				index_del(r, e);
+				return false;
+			}
+			g->next  = NULL;
+			g->first = NULL;
+			g->hash  = hash;
+			g->len   = len;
+			memcpy(g->prefix, topic, len);
+			*pg = g;
+			r->group_count++;
+			r->group_used += sizeof(*g) + len;
+		}
+		e->links[k].prev = NULL;
+		e->links[k].next = g->first;
+		if (g->first != NULL) {
+			g->first->links[k].prev = e;
+		}
+		g->first = e;
+		e->depth = k + 1;
+	}
+	if (r->group_count > r->group_mask + 1) {
+		groups_grow(r);
+	}
+	return true;
+}
+
+// drop a reference to e, the last one frees it
+static inline void
+entry_release(retain_entry *e)
+{
+	if (e != NULL &&
+	    __atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		zfree(e);
+	}
+}
+
+// unlink e found at pe from table, list and groups, the caller releases
+// it
+static void
+entry_remove(nano_retain *r, retain_entry **pe)
+{
+	retain_entry *e = *pe;
+
+	*pe = e->next;
+	lru_unlink(r, e);
+	index_del(r, e);
+	r->count--;
+	r->used -= entry_size(e);
+	if (e->compressed) {
+		r->compressed--;
+	}
+}
+
+static inline bool
+entry_expired(const retain_entry *e, uint64_t now)
+{
+	return e->expire_at != 0 && e->expire_at <= now;
+}
+
+// remove and free the expired entry at pe, pe then holds the next one
+static void
+entry_expire(nano_retain *r, retain_entry **pe)
+{
+	retain_entry *e = *pe;
+
+	entry_remove(r, pe);
+	r->expired++;
+	entry_release(e);
+}
+
+static void
+table_grow(nano_retain *r)
+{
+	size_t          n = (r->mask + 1) * 2;
+	retain_entry ** b = zmalloc(sizeof(retain_entry *) * n);
+	retain_entry *  e, *next;
+
+	if (b == NULL) {
+		return;
+	}
+	memset(b, 0, sizeof(retain_entry *) * n);
+	for (size_t i = 0; i <= r->mask; i++) {
+		for (e = r->buckets[i]; e != NULL; e = next) {
+			next    = e->next;
+			e->next = b[e->hash & (n - 1)];
+			b[e->hash & (n - 1)] = e;
+		}
+	}
+	zfree(r->buckets);
+	r->buckets = b;
+	r->mask    = n - 1;
+}
+
+nano_retain *
+nano_retain_create(const nano_retain_opt *opt)
+{
+	nano_retain *r = zmalloc(sizeof(nano_retain));
+
+	if (r == NULL) {
+		return NULL;
+	}
+	memset(r, 0, sizeof(nano_retain));
+	r->opt     = *opt;
+	r->mask    = RETAIN_BUCKETS_MIN - 1;
+	r->buckets = zmalloc(sizeof(retain_entry *) * RETAIN_BUCKETS_MIN);
+	if (r->buckets == NULL) {
+		zfree(r);
+		return NULL;
+	}
+	memset(r->buckets, 0, sizeof(retain_entry *) * RETAIN_BUCKETS_MIN);
+	r->group_mask = RETAIN_BUCKETS_MIN - 1;
+	r->groups     = zmalloc(sizeof(retain_group *) * RETAIN_BUCKETS_MIN);
+	if (r->groups == NULL) {
+		zfree(r->buckets);
+		zfree(r);
+		return NULL;
+	}
+	memset(r->groups, 0, sizeof(retain_group *) * RETAIN_BUCKETS_MIN);
+	pthread_mutex_init(&r->mtx, NULL);
+
+	return r;
+}
+
+// the cursors of r are freed before it
+void
+nano_retain_destroy(nano_retain *r)
+{
+	retain_entry *e, *next;
+	retain_group *g, *gnext;
+
+	if (r == NULL) {
+		return;
+	}
+	for (e = r->front; e != NULL; e = next) {
+		next = e->lru_next;
+		zfree(e);
+	}
+	for (size_t i = 0; i <= r->group_mask; i++) {
+		for (g = r->groups[i]; g != NULL; g = gnext) {
+			gnext = g->next;
+			zfree(g);
+		}
+	}
+	pthread_mutex_destroy(&r->mtx);
+	zfree(r->groups);
+	zfree(r->buckets);
+	zfree(r);
+}
+
+// Pack msg into a new block, its payload compressed if that saves space.
+static retain_entry *
+entry_new(nano_retain *r, const nano_retain_msg *msg, uint32_t hash)
+{
+	uint8_t *     lz     = NULL;
+	size_t        lz_len = 0;
+	retain_entry *e;
+
+	if (r->opt.compress_threshold > 0 &&
+	    msg->payload_len > r->opt.compress_threshold &&
+	    (lz = zmalloc(msg->payload_len)) != NULL) {
+		lz_len = nano_lz_compress(
+		    msg->payload, msg->payload_len, lz, msg->payload_len - 1);
+	}
+
+	e = zmalloc(sizeof(*e) + msg->topic_len + 1 + msg->props_len +
+	    (lz_len > 0 ? lz_len : msg->payload_len));
+	if (e != NULL) {
+		e->expire_at   = msg->expire_at;
+		e->hash        = hash;
+		e->topic_len   = msg->topic_len;
+		e->props_len   = msg->props_len;
+		e->payload_len = msg->payload_len;
+		e->stored_len  = lz_len > 0 ? lz_len : msg->payload_len;
+		e->refs        = 1;
+		e->qos         = msg->qos;
+		e->compressed  = lz_len > 0;
+		e->depth       = 0;
+		memcpy(e->data, msg->topic, msg->topic_len);
+		e->data[msg->topic_len] = '\0';
+		if (msg->props_len > 0) {
+			memcpy((uint8_t *) entry_props(e), msg->props,
+			    msg->props_len);
+		}
+		if (e->stored_len > 0) {
+			memcpy((uint8_t *) entry_payload(e),
+			    lz_len > 0 ? lz : msg->payload, e->stored_len);
+		}
+	}
+	zfree(lz);
+
+	return e;
+}
+
+/**
+ * @brief nano_retain_set - Keep a copy of msg as the retained message of
+ * its topic, then evict from the back of the list while the store is
+ * beyond mem_limit.
+ * @param r - nano_retain
+ * @param msg - nano_retain_msg, copied
+ * @return 1 if the topic had none, 0 if one was replaced, -1 if msg is
+ * not kept, the one it replaces is deleted all the same
+ */
+int
+nano_retain_set(nano_retain *r, const nano_retain_msg *msg)
+{
+	uint32_t       hash = topic_hash(msg->topic, msg->topic_len);
+	retain_entry * e    = entry_new(r, msg, hash);
+	retain_entry * old  = NULL;
+	retain_entry **pe;
+	size_t         size;
+
+	pthread_mutex_lock(&r->mtx);
+	pe = entry_find(r, msg->topic, msg->topic_len, hash);
+	if ((old = *pe) != NULL) {
+		entry_remove(r, pe);
+	}
+	if (e == NULL ||
+	    (r->opt.mem_limit > 0 && entry_size(e) > r->opt.mem_limit) ||
+	    !index_add(r, e)) {
+		pthread_mutex_unlock(&r->mtx);
+		log_warn("retained message of %.*s is not kept",
+		    (int) msg->topic_len, msg->topic);
+		entry_release(old);
+		zfree(e);
+		return -1;
+	}
+
+	size    = entry_size(e);
+	e->next = *pe;
+	*pe     = e;
+	lru_push_front(r, e);
+	r->count++;
+	r->used += size;
+	if (e->compressed) {
+		r->compressed++;
+	}
+
+	while (r->opt.mem_limit > 0 && r->used > r->opt.mem_limit &&
+	    r->back != e) {
+		retain_entry *v = r->back;
+		entry_remove(r,
+		    entry_find(r, (const char *) v->data, v->topic_len,
+		        v->hash));
+		r->evicted++;
+		entry_release(v);
+	}
+	if (r->count > r->mask + 1) {
+		table_grow(r);
+	}
+	pthread_mutex_unlock(&r->mtx);
+
+	entry_release(old);
+	return old != NULL ? 0 : 1;
+}
+
+/**
+ * @brief nano_retain_del - Delete the retained message of topic.
+ * @param r - nano_retain
+ * @param topic - topic
+ * @return true if topic had one
+ */
+bool
+nano_retain_del(nano_retain *r, const char *topic)
+{
+	size_t         len  = strlen(topic);
+	uint32_t       hash = topic_hash(topic, len);
+	retain_entry * e;
+	retain_entry **pe;
+
+	pthread_mutex_lock(&r->mtx);
+	pe = entry_find(r, topic, len, hash);
+	if ((e = *pe) != NULL) {
+		entry_remove(r, pe);
+	}
+	pthread_mutex_unlock(&r->mtx);
+
+	entry_release(e);
+	return e != NULL;
+}
+
+/**
+ * @brief nano_retain_shrink - Evict messages from the back of the list,
+ * as mem_limit does, until bytes of blocks are freed.
+ * @param r - nano_retain
+ * @param bytes - to free
+ * @return bytes freed, with those of the last message evicted
+ */
+size_t
+nano_retain_shrink(nano_retain *r, size_t bytes)
+{
+	retain_entry *victims = NULL;
+	retain_entry *v;
+	size_t        freed = 0;
+
+	pthread_mutex_lock(&r->mtx);
+	while (freed < bytes && (v = r->back) != NULL) {
+		entry_remove(r,
+		    entry_find(r, (const char *) v->data, v->topic_len,
+		        v->hash));
+		r->evicted++;
+		freed += entry_size(v);
+		v->next = victims;
+		victims = v;
+	}
+	pthread_mutex_unlock(&r->mtx);
+
+	while ((v = victims) != NULL) {
+		victims = v->next;
+		entry_release(v);
+	}
+	return freed;
+}
+
+void
+nano_retain_get_stats(nano_retain *r, nano_retain_stats *st)
+{
+	pthread_mutex_lock(&r->mtx);
+	st->count      = r->count;
+	st->memory     = r->used + sizeof(retain_entry *) * (r->mask + 1) +
+	    r->group_used + sizeof(retain_group *) * (r->group_mask + 1);
+	st->evicted    = r->evicted;
+	st->compressed = r->compressed;
+	st->expired    = r->expired;
+	pthread_mutex_unlock(&r->mtx);
+}
+
+/**
+ * @brief nano_retain_expire - Drop the expired messages of the next max
+ * buckets of the table, a call carries on where the last one stopped.
+ * @param r - nano_retain
+ * @param now - current time, in the clock of expire_at
+ * @param max - buckets to sweep
+ * @return messages dropped
+ */
+size_t
+nano_retain_expire(nano_retain *r, uint64_t now, size_t max)
+{
+	retain_entry **pe;
+	size_t         n = 0;
+
+	pthread_mutex_lock(&r->mtx);
+	for (size_t i = 0; i < max && i <= r->mask; i++) {
+		pe = &r->buckets[r->sweep & r->mask];
+		while (*pe != NULL) {
+			if (entry_expired(*pe, now)) {
+				entry_expire(r, pe);
+				n++;
+			} else {
+				pe = &(*pe)->next;
+			}
+		}
+		r->sweep = (r->sweep + 1) & r->mask;
+	}
+	pthread_mutex_unlock(&r->mtx);
+
+	return n;
+}
+
+// MQTT filter against topic, a wildcard first never matches $ topics
+static bool
+topic_match(const char *f, const char *t, size_t len)
+{
+	const char *end = t + len;
+
+	if ((*f == '+' || *f == '#') && len > 0 && *t == '$') {
+		return false;
+	}
+	while (*f != '\0') {
+		if (*f == '#') {
+			return true;
+		}
+		if (*f == '+') {
+			while (t < end && *t != '/') {
+				t++;
+			}
+			f++;
+		} else {
+			for (; *f != '\0' && *f != '/'; f++, t++) {
+				if (t >= end || *t != *f) {
+					return false;
+				}
+			}
+		}
+		if (*f == '\0') {
+			return t == end;
+		}
+		if (t == end) {
+			// a/# matches a
+			return strcmp(f, "/#") == 0;
+		}
+		if (*t != '/') {
+			return false;
+		}
+		f++;
+		t++;
+	}
+	return t == end;
+}
+
+// take a reference to e for cur to hand out, called with r locked
+static void
+cursor_hold(nano_retain_cursor *cur, retain_entry *e)
+{
+	nano_retain *  r = cur->r;
+	retain_entry **held;
+	size_t         cap;
+
+	if (cur->held_len == cur->held_cap) {
+		cap  = cur->held_cap > 0 ? cur->held_cap * 2 : 16;
+		held = zrealloc(cur->held, sizeof(retain_entry *) * cap);
+		if (held == NULL) {
+			log_err("Memory alloc failed!");
+			return;
+		}
+		cur->held     = held;
+		cur->held_cap = cap;
+	}
+	__atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+	cur->held[cur->held_len++] = e;
+	if (r->opt.eviction == NANO_RETAIN_EVICT_LRU) {
+		lru_unlink(r, e);
+		lru_push_front(r, e);
+	}
+}
+
+// hand e out to cb with r unlocked, the fields read are never changed
+static bool
+cursor_hand_out(
+    nano_retain_cursor *cur, retain_entry *e, nano_retain_cb cb, void *arg)
+{
+	nano_retain_msg msg = {
+		.topic       = (const char *) e->data,
+		.topic_len   = e->topic_len,
+		.qos         = e->qos,
+		.props       = entry_props(e),
+		.props_len   = e->props_len,
+		.payload     = entry_payload(e),
+		.payload_len = e->payload_len,
+		.expire_at   = e->expire_at,
+	};
+	uint8_t *buf;
+
+	if (e->compressed) {
+		if (cur->scratch_len < e->payload_len) {
+			buf = zrealloc(cur->scratch, e->payload_len);
+			if (buf == NULL) {
+				return false;
+			}
+			cur->scratch     = buf;
+			cur->scratch_len = e->payload_len;
+		}
+		if (nano_lz_decompress(entry_payload(e), e->stored_len,
+		        cur->scratch, e->payload_len) != e->payload_len) {
+			log_err("retained message of %s is broken", e->data);
+			return false;
+		}
+		msg.payload = cur->scratch;
+	}
+	cb(&msg, arg);
+	return true;
+}
+
+/**
+ * @brief nano_retain_cursor_new - Start a walk of the retained messages
+ * matching filter. A filter with its first levels literal walks the group
+ * of up to RETAIN_INDEX_DEPTH of them, one starting with a wildcard walks
+ * the table.
+ * @param r - nano_retain
+ * @param filter - topic filter
+ * @return nano_retain_cursor, NULL if out of memory
+ */
+nano_retain_cursor *
+nano_retain_cursor_new(nano_retain *r, const char *filter)
+{
+	nano_retain_cursor *cur = zmalloc(sizeof(nano_retain_cursor));
+	const char *        lv;
+
+	if (cur == NULL) {
+		log_err("Memory alloc failed!");
+		return NULL;
+	}
+	memset(cur, 0, sizeof(nano_retain_cursor));
+	cur->r      = r;
+	cur->filter = zstrdup(filter);
+	cur->wild   = strpbrk(filter, "+#") != NULL;
+	// levels before the first wildcard
+	for (lv = filter; cur->wild && cur->levels < RETAIN_INDEX_DEPTH &&
+	     *lv != '+' && *lv != '#';
+	     lv++) {
+		cur->levels++;
+		if ((lv = strchr(lv, '/')) == NULL) {
+			break;
+		}
+	}
+
+	return cur;
+}
+
+static inline size_t
+rev_bits(size_t v)
+{
+	size_t s    = sizeof(v) * 8;
+	size_t mask = ~(size_t) 0;
+
+	while ((s >>= 1) > 0) {
+		mask ^= mask << s;
+		v = ((v >> s) & mask) | ((v << s) & ~mask);
+	}
+	return v;
+}
+
+// take the matching messages of the group of cur at once
+static void
+cursor_take_group(nano_retain_cursor *cur, uint64_t now)
+{
+	nano_retain *  r = cur->r;
+	int            k = cur->levels - 1;
+	long           len;
+	retain_group * g;
+	retain_entry * e, *next;
+	retain_entry **pe;
+
+	len = level_end(cur->filter, strlen(cur->filter), k + 1);
+	g   = *group_find(r, cur->filter, len, topic_hash(cur->filter, len));
+	for (e = g != NULL ? g->first : NULL; e != NULL; e = next) {
+		next = e->links[k].next;
+		if (entry_expired(e, now)) {
+			pe = entry_find(
+			    r, (const char *) e->data, e->topic_len, e->hash);
+			entry_expire(r, pe);
+		} else if (topic_match(cur->filter, (const char *) e->data,
+		               e->topic_len)) {
+			cursor_hold(cur, e);
+		}
+	}
+	cur->done = true;
+}
+
+// take the matching messages of the next buckets of the table, at most
+// RETAIN_SCAN_STEP of them, until max are taken
+static void
+cursor_take_scan(nano_retain_cursor *cur, size_t max, uint64_t now)
+{
+	nano_retain *  r = cur->r;
+	retain_entry * e;
+	retain_entry **pe;
+
+	for (int step = 0;
+	     !cur->done && cur->held_len < max && step < RETAIN_SCAN_STEP;
+	     step++) {
+		pe = &r->buckets[cur->v & r->mask];
+		while ((e = *pe) != NULL) {
+			if (entry_expired(e, now)) {
+				entry_expire(r, pe);
+				continue;
+			}
+			if (topic_match(cur->filter, (const char *) e->data,
+			        e->topic_len)) {
+				cursor_hold(cur, e);
+			}
+			pe = &e->next;
+		}
+		// next in reverse binary order of the bits of mask
+		cur->v |= ~r->mask;
+		cur->v = rev_bits(rev_bits(cur->v) + 1);
+		cur->done = cur->v == 0;
+	}
+}
+
+/**
+ * @brief nano_retain_cursor_next - Hand the next retained messages
+ * matching the filter of cur to cb. Once all those taken from the store
+ * are handed out, the next ones are taken with the store locked: the
+ * message of a filter without wildcards, all those of the group of a
+ * filter with literal first levels, or those of at most
+ * RETAIN_SCAN_STEP buckets of the table until max. They are handed out
+ * with the store unlocked, so cb may take its time. Expired messages met
+ * are dropped.
+ * @param cur - nano_retain_cursor
+ * @param max - messages wanted, at most as many are handed out
+ * @param now - current time, in the clock of expire_at
+ * @param cb - nano_retain_cb
+ * @param arg - passed to cb
+ * @return messages handed out, maybe 0 before the walk is done
+ */
+size_t
+nano_retain_cursor_next(nano_retain_cursor *cur, size_t max, uint64_t now,
+    nano_retain_cb cb, void *arg)
+{
+	nano_retain *  r = cur->r;
+	retain_entry * e;
+	retain_entry **pe;
+	size_t         n = 0;
+	size_t         len;
+
+	if (cur->pos == cur->held_len && !cur->done) {
+		cur->pos = cur->held_len = 0;
+		pthread_mutex_lock(&r->mtx);
+		if (!cur->wild) {
+			len = strlen(cur->filter);
+			pe  = entry_find(
+                            r, cur->filter, len, topic_hash(cur->filter, len));
+			if ((e = *pe) != NULL && entry_expired(e, now)) {
+				entry_expire(r, pe);
+			} else if (e != NULL) {
+				cursor_hold(cur, e);
+			}
+			cur->done = true;
+		} else if (cur->levels > 0) {
+			cursor_take_group(cur, now);
+		} else {
+			cursor_take_scan(cur, max, now);
+		}
+		pthread_mutex_unlock(&r->mtx);
+	}
+
+	while (n < max && cur->pos < cur->held_len) {
+		e = cur->held[cur->pos++];
+		if (cursor_hand_out(cur, e, cb, arg)) {
+			n++;
+		}
+		entry_release(e);
+	}
+
+	return n;
+}
+
+bool
+nano_retain_cursor_done(nano_retain_cursor *cur)
+{
+	return cur->done && cur->pos == cur->held_len;
+}
+
+void
+nano_retain_cursor_free(nano_retain_cursor *cur)
+{
+	if (cur == NULL) {
+		return;
+	}
+	while (cur->pos < cur->held_len) {
+		entry_release(cur->held[cur->pos++]);
+	}
+	zfree(cur->held);
+	zfree(cur->scratch);
+	zfree(cur->filter);
+	zfree(cur);
+}
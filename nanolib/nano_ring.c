@@ -0,0 +1,413 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <errno.h>
+#include <time.h>
+
+#include "include/nano_ring.h"
+#include "include/zmalloc.h"
+
+// A slot of nano_mpsc has the sequence of the put it waits for, a put
+// at pos takes the slot once its seq is pos, publishes the item by
+// setting it to pos + 1 and the consumer gives it back to the next round
+// with pos + cap. Producers only contend on the CAS of the tail, and a
+// producer stalled between the CAS and the publish holds the consumer
+// back at its slot and no one else.
+struct nano_mpsc_cell {
+	size_t seq;
+	void * item;
+};
+
+#define load_acq(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_rel(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static size_t
+ring_alloc(size_t cap)
+{
+	size_t alloc = 2;
+
+	while (alloc < cap) {
+		alloc *= 2;
+	}
+	return alloc;
+}
+
+static void
+waiter_init(nano_ring_waiter *w)
+{
+	pthread_mutex_init(&w->mtx, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->sleeping = 0;
+}
+
+static void
+waiter_fini(nano_ring_waiter *w)
+{
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mtx);
+}
+
+// after a put is published, the fence pairs with the one in waiter_wait
+static inline void
+waiter_wake(nano_ring_waiter *w)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->sleeping, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+	pthread_mutex_lock(&w->mtx);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mtx);
+}
+
+// block up to timeout_ms, negative forever, while ready(q) is false
+static bool
+waiter_wait(nano_ring_waiter *w, bool (*ready)(void *), void *q,
+    int timeout_ms)
+{
+	struct timespec ts;
+	bool            ok;
+
+	if (ready(q) || timeout_ms == 0) {
+		return ready(q);
+	}
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+	pthread_mutex_lock(&w->mtx);
+	__atomic_store_n(&w->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (!(ok = ready(q))) {
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&w->cond, &w->mtx);
+		} else if (pthread_cond_timedwait(&w->cond, &w->mtx, &ts) ==
+		    ETIMEDOUT) {
+			ok = ready(q);
+			break;
+		}
+	}
+	__atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&w->mtx);
+
+	return ok;
+}
+
+/**
+ * @brief nano_spsc_init - Init a ring of one producer and one consumer.
+ * @param q - nano_spsc
+ * @param cap - items it holds at least, rounded up to a power of 2
+ * @return 0
+ */
+int
+nano_spsc_init(nano_spsc *q, size_t cap)
+{
+	size_t alloc = ring_alloc(cap);
+
+	q->tail       = 0;
+	q->head_cache = 0;
+	q->head       = 0;
+	q->tail_cache = 0;
+	q->mask       = alloc - 1;
+	q->slots      = zmalloc(sizeof(void *) * alloc);
+	waiter_init(&q->waiter);
+
+	return 0;
+}
+
+// items left are the caller's
+void
+nano_spsc_fini(nano_spsc *q)
+{
+	zfree(q->slots);
+	q->slots = NULL;
+	waiter_fini(&q->waiter);
+}
+
+// room for n puts, refreshing head_cache only if the last one is short
+static inline size_t
+spsc_room(nano_spsc *q, size_t tail, size_t n)
+{
+	size_t room = q->mask + 1 - (tail - q->head_cache);
+
+	if (room < n) {
+		q->head_cache = load_acq(&q->head);
+		room          = q->mask + 1 - (tail - q->head_cache);
+	}
+	return room < n ? room : n;
+}
+
+bool
+nano_spsc_put(nano_spsc *q, void *item)
+{
+	return nano_spsc_put_n(q, &item, 1) == 1;
+}
+
+/**
+ * @brief nano_spsc_put_n - Put as many of items as there is room for,
+ * published at once. Only the producer thread calls it.
+ * @param q - nano_spsc
+ * @param items - in order
+ * @param n - of items
+ * @return items put, 0 if the ring is full
+ */
+size_t
+nano_spsc_put_n(nano_spsc *q, void **items, size_t n)
+{
+	size_t tail = q->tail;
+	size_t k    = spsc_room(q, tail, n);
+
+	for (size_t i = 0; i < k; i++) {
+		q->slots[(tail + i) & q->mask] = items[i];
+	}
+	if (k > 0) {
+		store_rel(&q->tail, tail + k);
+		waiter_wake(&q->waiter);
+	}
+	return k;
+}
+
+// items there are for n gets, refreshing tail_cache only if short
+static inline size_t
+spsc_ready(nano_spsc *q, size_t head, size_t n)
+{
+	size_t ready = q->tail_cache - head;
+
+	if (ready < n) {
+		q->tail_cache = load_acq(&q->tail);
+		ready         = q->tail_cache - head;
+	}
+	return ready < n ? ready : n;
+}
+
+bool
+nano_spsc_get(nano_spsc *q, void **item)
+{
+	return nano_spsc_get_n(q, item, 1) == 1;
+}
+
+/**
+ * @brief nano_spsc_get_n - Get up to n items. Only the consumer thread
+ * calls it.
+ * @param q - nano_spsc
+ * @param items - set to the items in the order they were put
+ * @param n - room of items
+ * @return items got, 0 if the ring is empty
+ */
+size_t
+nano_spsc_get_n(nano_spsc *q, void **items, size_t n)
+{
+	size_t head = q->head;
+	size_t k    = spsc_ready(q, head, n);
+
+	for (size_t i = 0; i < k; i++) {
+		items[i] = q->slots[(head + i) & q->mask];
+	}
+	if (k > 0) {
+		store_rel(&q->head, head + k);
+	}
+	return k;
+}
+
+// a snapshot, exact only from the producer or the consumer
+size_t
+nano_spsc_len(nano_spsc *q)
+{
+	size_t head = load_acq(&q->head);
+
+	return load_acq(&q->tail) - head;
+}
+
+size_t
+nano_spsc_cap(nano_spsc *q)
+{
+	return q->mask + 1;
+}
+
+static bool
+spsc_ready_any(void *arg)
+{
+	nano_spsc *q = arg;
+
+	return load_acq(&q->tail) != q->head;
+}
+
+/**
+ * @brief nano_spsc_wait - Block the consumer until there is an item.
+ * @param q - nano_spsc
+ * @param timeout_ms - 0 to poll, negative to wait forever
+ * @return true if there is one, false on timeout
+ */
+bool
+nano_spsc_wait(nano_spsc *q, int timeout_ms)
+{
+	return waiter_wait(&q->waiter, spsc_ready_any, q, timeout_ms);
+}
+
+/**
+ * @brief nano_mpsc_init - Init a ring of many producers and one consumer.
+ * @param q - nano_mpsc
+ * @param cap - items it holds at least, rounded up to a power of 2
+ * @return 0
+ */
+int
+nano_mpsc_init(nano_mpsc *q, size_t cap)
+{
+	size_t alloc = ring_alloc(cap);
+
+	q->tail  = 0;
+	q->head  = 0;
+	q->mask  = alloc - 1;
+	q->cells = zmalloc(sizeof(nano_mpsc_cell) * alloc);
+	for (size_t i = 0; i < alloc; i++) {
+		q->cells[i].seq  = i;
+		q->cells[i].item = NULL;
+	}
+	waiter_init(&q->waiter);
+
+	return 0;
+}
+
+// items left are the caller's
+void
+nano_mpsc_fini(nano_mpsc *q)
+{
+	zfree(q->cells);
+	q->cells = NULL;
+	waiter_fini(&q->waiter);
+}
+
+bool
+nano_mpsc_put(nano_mpsc *q, void *item)
+{
+	return nano_mpsc_put_n(q, &item, 1) == 1;
+}
+
+/**
+ * @brief nano_mpsc_put_n - Put as many of items as there is room for in
+ * one reservation, they are got in order without items of other
+ * producers in between. Any thread calls it.
+ * @param q - nano_mpsc
+ * @param items - in order
+ * @param n - of items
+ * @return items put, 0 if the ring is full
+ */
+size_t
+nano_mpsc_put_n(nano_mpsc *q, void **items, size_t n)
+{
+	size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	size_t k   = n < q->mask + 1 ? n : q->mask + 1;
+
+	while (k > 0) {
+		// the consumer frees slots in order, so the last one of k
+		// being free means the k are
+		size_t    last = pos + k - 1;
+		size_t    seq  = load_acq(&q->cells[last & q->mask].seq);
+		ptrdiff_t diff = (ptrdiff_t) (seq - last);
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos,
+			        pos + k, true, __ATOMIC_RELAXED,
+			        __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			// not consumed yet, try fewer
+			k /= 2;
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+	for (size_t i = 0; i < k; i++) {
+		nano_mpsc_cell *c = &q->cells[(pos + i) & q->mask];
+
+		c->item = items[i];
+		store_rel(&c->seq, pos + i + 1);
+	}
+	if (k > 0) {
+		waiter_wake(&q->waiter);
+	}
+	return k;
+}
+
+bool
+nano_mpsc_get(nano_mpsc *q, void **item)
+{
+	return nano_mpsc_get_n(q, item, 1) == 1;
+}
+
+/**
+ * @brief nano_mpsc_get_n - Get up to n items, stopping at a slot whose
+ * producer has not published yet. Only the consumer thread calls it.
+ * @param q - nano_mpsc
+ * @param items - set to the items got
+ * @param n - room of items
+ * @return items got, 0 if the ring is empty
+ */
+size_t
+nano_mpsc_get_n(nano_mpsc *q, void **items, size_t n)
+{
+	size_t head = q->head;
+	size_t k    = 0;
+
+	for (; k < n; k++) {
+		nano_mpsc_cell *c = &q->cells[(head + k) & q->mask];
+
+		if (load_acq(&c->seq) != head + k + 1) {
+			break;
+		}
+		items[k] = c->item;
+		store_rel(&c->seq, head + k + q->mask + 1);
+	}
+	if (k > 0) {
+		store_rel(&q->head, head + k);
+	}
+	return k;
+}
+
+// a snapshot, it counts reserved items not published yet
+size_t
+nano_mpsc_len(nano_mpsc *q)
+{
+	size_t head = load_acq(&q->head);
+	size_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+	return tail - head <= q->mask + 1 ? tail - head : 0;
+}
+
+size_t
+nano_mpsc_cap(nano_mpsc *q)
+{
+	return q->mask + 1;
+}
+
+static bool
+mpsc_ready_any(void *arg)
+{
+	nano_mpsc *q = arg;
+
+	return load_acq(&q->cells[q->head & q->mask].seq) == q->head + 1;
+}
+
+/**
+ * @brief nano_mpsc_wait - Block the consumer until the next item is
+ * published.
+ * @param q - nano_mpsc
+ * @param timeout_ms - 0 to poll, negative to wait forever
+ * @return true if there is one, false on timeout
+ */
+bool
+nano_mpsc_wait(nano_mpsc *q, int timeout_ms)
+{
+	return waiter_wait(&q->waiter, mpsc_ready_any, q, timeout_ms);
+}
@@ -0,0 +1,346 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "include/nano_shm.h"
+
+#define SHM_MAGIC 0x4e4d5153 // "NMQS"
+#define RECORD_HEADER 12
+#define RECORD_PAD 0x01 // kind of a record filling the end of the ring
+
+static inline size_t
+align8(size_t n)
+{
+	return (n + 7) & ~(size_t) 7;
+}
+
+static void
+shm_map(nano_shm *s, void *map, size_t map_len)
+{
+	memset(s, 0, sizeof(nano_shm));
+	s->hdr     = map;
+	s->data    = (uint8_t *) map + sizeof(nano_shm_header);
+	s->mask    = s->hdr->size - 1;
+	s->map_len = map_len;
+}
+
+// the path of ring i in dir, as snprintf
+int
+nano_shm_path(char *buf, size_t len, const char *dir, int i)
+{
+	int n = snprintf(buf, len, "%s/", dir);
+
+	if (n < 0 || (size_t) n >= len) {
+		return -1;
+	}
+	return n + snprintf(buf + n, len - n, NANO_SHM_NAME, i);
+}
+
+/**
+ * @brief nano_shm_create - Create the ring of path, or take it over as it
+ * is if it has the same size, with the producer attached to it.
+ * @param s - nano_shm, the consumer of the ring
+ * @param path - file, in /dev/shm to stay in memory
+ * @param size - bytes of records, rounded up to a power of 2
+ * @return 0, or -1 with errno
+ */
+int
+nano_shm_create(nano_shm *s, const char *path, size_t size)
+{
+	nano_shm_header *hdr;
+	struct stat      st;
+	size_t           len;
+	int              fd;
+	bool             keep;
+
+	if (size < NANO_SHM_SIZE_MIN) {
+		size = NANO_SHM_SIZE_MIN;
+	}
+	size = (size_t) 1 << (64 - __builtin_clzll(size - 1));
+	len  = sizeof(nano_shm_header) + size;
+
+	if ((fd = open(path, O_RDWR | O_CREAT, 0660)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 ||
+	    ((size_t) st.st_size != len && ftruncate(fd, len) != 0)) {
+		close(fd);
+		return -1;
+	}
+	hdr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		return -1;
+	}
+
+	keep = (size_t) st.st_size == len &&
+	    __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == SHM_MAGIC &&
+	    hdr->version == NANO_SHM_VERSION && hdr->size == size &&
+	    hdr->tail - hdr->head <= size;
+	if (!keep) {
+		__atomic_store_n(&hdr->magic, 0, __ATOMIC_RELEASE);
+		hdr->version = NANO_SHM_VERSION;
+		hdr->size    = size;
+		hdr->owner   = 0;
+		hdr->full    = 0;
+		hdr->tail    = 0;
+		hdr->head    = 0;
+		__atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+	shm_map(s, hdr, len);
+	s->next       = hdr->head;
+	s->tail_cache = hdr->head;
+
+	return 0;
+}
+
+/**
+ * @brief nano_shm_attach - Map the ring the broker created at path.
+ * @param s - nano_shm
+ * @param path - file of the ring
+ * @return 0, or -1 with errno
+ */
+int
+nano_shm_attach(nano_shm *s, const char *path)
+{
+	nano_shm_header *hdr;
+	struct stat      st;
+	size_t           min = sizeof(nano_shm_header) + NANO_SHM_SIZE_MIN;
+	int              fd;
+
+	if ((fd = open(path, O_RDWR)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < min) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	hdr = mmap(
+	    NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		return -1;
+	}
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+	    hdr->version != NANO_SHM_VERSION ||
+	    (hdr->size & (hdr->size - 1)) != 0 ||
+	    sizeof(nano_shm_header) + hdr->size != (size_t) st.st_size) {
+		munmap(hdr, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+	shm_map(s, hdr, st.st_size);
+	s->head_cache = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+	return 0;
+}
+
+void
+nano_shm_detach(nano_shm *s)
+{
+	if (s->hdr != NULL) {
+		munmap(s->hdr, s->map_len);
+	}
+	memset(s, 0, sizeof(nano_shm));
+}
+
+// be the producer of s, if it has none or its owner is not alive
+bool
+nano_shm_claim(nano_shm *s)
+{
+	int32_t pid   = (int32_t) getpid();
+	int32_t owner = __atomic_load_n(&s->hdr->owner, __ATOMIC_ACQUIRE);
+
+	if (owner == pid) {
+		return true;
+	}
+	if (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH)) {
+		return false;
+	}
+	return __atomic_compare_exchange_n(&s->hdr->owner, &owner, pid, false,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void
+nano_shm_unclaim(nano_shm *s)
+{
+	int32_t pid = (int32_t) getpid();
+
+	__atomic_compare_exchange_n(&s->hdr->owner, &pid, 0, false,
+	    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief nano_shm_publish - Put a publish on the ring, copied.
+ * @param s - nano_shm, claimed
+ * @param topic - topic, not 0 terminated
+ * @param topic_len - of topic, up to 65535
+ * @param payload - payload
+ * @param payload_len - of payload
+ * @param flags - NANO_SHM_RETAIN and the qos shifted by 1
+ * @return 0, 1 if the ring has no room for it now, or -1 if it is larger
+ * than half the ring
+ */
+int
+nano_shm_publish(nano_shm *s, const char *topic, size_t topic_len,
+    const uint8_t *payload, size_t payload_len, uint8_t flags)
+{
+	size_t   size = s->mask + 1;
+	size_t   need = align8(RECORD_HEADER + topic_len + payload_len);
+	uint64_t tail = __atomic_load_n(&s->hdr->tail, __ATOMIC_RELAXED);
+	size_t   off  = tail & s->mask;
+	size_t   end  = size - off;
+	size_t   total;
+	uint8_t *p;
+
+	if (topic_len == 0 || topic_len > UINT16_MAX || need > size / 2) {
+		return -1;
+	}
+	total = need <= end ? need : end + need;
+	if (tail + total - s->head_cache > size) {
+		s->head_cache =
+		    __atomic_load_n(&s->hdr->head, __ATOMIC_ACQUIRE);
+		if (tail + total - s->head_cache > size) {
+			__atomic_add_fetch(&s->hdr->full, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
+	if (need > end) {
+		p               = s->data + off;
+		*(uint32_t *) p = (uint32_t) end;
+		p[4]            = RECORD_PAD;
+
+		tail += end;
+		off = 0;
+	}
+
+	p                     = s->data + off;
+	*(uint32_t *) p       = (uint32_t) need;
+	p[4]                  = 0;
+	p[5]                  = flags;
+	*(uint16_t *) (p + 6) = (uint16_t) topic_len;
+	*(uint32_t *) (p + 8) = (uint32_t) payload_len;
+	memcpy(p + RECORD_HEADER, topic, topic_len);
+	memcpy(p + RECORD_HEADER + topic_len, payload, payload_len);
+	__atomic_store_n(&s->hdr->tail, tail + need, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * @brief nano_shm_producer_open - Attach to the first ring of dir which
+ * has no producer alive and claim it.
+ * @param s - nano_shm, closed by nano_shm_producer_close
+ * @param dir - where the broker created the rings, shm.dir
+ * @return index of the ring, or -1 if none is free
+ */
+int
+nano_shm_producer_open(nano_shm *s, const char *dir)
+{
+	char path[256];
+	int  n;
+
+	for (int i = 0; i < NANO_SHM_RINGS_MAX; i++) {
+		n = nano_shm_path(path, sizeof(path), dir, i);
+		if (n < 0 || n >= (int) sizeof(path)) {
+			break;
+		}
+		if (nano_shm_attach(s, path) != 0) {
+			if (errno == ENOENT) {
+				break;
+			}
+			continue;
+		}
+		if (nano_shm_claim(s)) {
+			return i;
+		}
+		nano_shm_detach(s);
+	}
+	memset(s, 0, sizeof(nano_shm));
+	return -1;
+}
+
+void
+nano_shm_producer_close(nano_shm *s)
+{
+	if (s->hdr != NULL) {
+		nano_shm_unclaim(s);
+	}
+	nano_shm_detach(s);
+}
+
+/**
+ * @brief nano_shm_next - The next record, pointers into the ring until
+ * nano_shm_release.
+ * @param s - nano_shm, the consumer
+ * @param topic - set to the topic, not 0 terminated
+ * @param topic_len - set to its length
+ * @param payload - set to the payload
+ * @param payload_len - set to its length
+ * @param flags - set to the flags of the record
+ * @return false if there is none now
+ */
+bool
+nano_shm_next(nano_shm *s, const char **topic, uint16_t *topic_len,
+    const uint8_t **payload, uint32_t *payload_len, uint8_t *flags)
+{
+	const uint8_t *p;
+	size_t         off, len, tlen, plen;
+
+	for (;;) {
+		if (s->next == s->tail_cache) {
+			s->tail_cache =
+			    __atomic_load_n(&s->hdr->tail, __ATOMIC_ACQUIRE);
+			if (s->next == s->tail_cache) {
+				return false;
+			}
+		}
+		off = s->next & s->mask;
+		p   = s->data + off;
+		len = *(const uint32_t *) p;
+		if (len < 8 || (len & 7) != 0 || len > s->mask + 1 - off ||
+		    len > s->tail_cache - s->next) {
+			// broken by the producer, what is left is skipped
+			s->next = s->tail_cache;
+			return false;
+		}
+		if (p[4] == RECORD_PAD) {
+			s->next += len;
+			continue;
+		}
+		tlen = *(const uint16_t *) (p + 6);
+		plen = *(const uint32_t *) (p + 8);
+		if (len < RECORD_HEADER || tlen + plen > len - RECORD_HEADER) {
+			s->next = s->tail_cache;
+			return false;
+		}
+		*flags       = p[5];
+		*topic_len   = tlen;
+		*topic       = (const char *) p + RECORD_HEADER;
+		*payload_len = plen;
+		*payload     = p + RECORD_HEADER + tlen;
+		s->next += len;
+		return true;
+	}
+}
+
+// give the room of the records taken back to the producer
+void
+nano_shm_release(nano_shm *s)
+{
+	__atomic_store_n(&s->hdr->head, s->next, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,252 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include "include/nano_timer.h"
+#include "include/zmalloc.h"
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_REACH (1ull << (WHEEL_BITS * WHEEL_LEVELS)) // in ticks
+
+struct nano_timer_wheel {
+	uint64_t   base; // time of tick 0
+	uint64_t   tick;
+	uint64_t   now; // ticks passed
+	size_t     count;
+	nano_timer slots[WHEEL_LEVELS][WHEEL_SLOTS]; // list heads
+};
+
+static inline void
+list_init(nano_timer *head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static inline void
+list_unlink(nano_timer *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next       = NULL;
+	t->prev       = NULL;
+}
+
+// move all timers of head to the empty list of dst
+static inline void
+list_splice(nano_timer *head, nano_timer *dst)
+{
+	if (head->next == head) {
+		list_init(dst);
+		return;
+	}
+	dst->next       = head->next;
+	dst->prev       = head->prev;
+	dst->next->prev = dst;
+	dst->prev->next = dst;
+	list_init(head);
+}
+
+// the slot for t->expire seen from w->now
+static void
+wheel_link(nano_timer_wheel *w, nano_timer *t)
+{
+	uint64_t    expire = t->expire;
+	uint64_t    delta  = expire - w->now;
+	nano_timer *head;
+	int         l;
+
+	if (delta >= WHEEL_REACH) {
+		expire = w->now + WHEEL_REACH - 1;
+		delta  = WHEEL_REACH - 1;
+	}
+	for (l = 0; l < WHEEL_LEVELS - 1 &&
+	     delta >= (1ull << (WHEEL_BITS * (l + 1)));
+	     l++)
+		;
+	head = &w->slots[l][(expire >> (WHEEL_BITS * l)) & WHEEL_MASK];
+
+	t->next          = head;
+	t->prev          = head->prev;
+	head->prev->next = t;
+	head->prev       = t;
+}
+
+void
+nano_timer_init(nano_timer *t, nano_timer_cb cb, void *arg)
+{
+	t->next   = NULL;
+	t->prev   = NULL;
+	t->expire = 0;
+	t->cb     = cb;
+	t->arg    = arg;
+}
+
+bool
+nano_timer_pending(const nano_timer *t)
+{
+	return t->prev != NULL;
+}
+
+/**
+ * @brief nano_timer_wheel_create - Create a wheel.
+ * @param now - current time
+ * @param tick - time of a slot of the lowest level, at least 1
+ * @return nano_timer_wheel or NULL
+ */
+nano_timer_wheel *
+nano_timer_wheel_create(uint64_t now, uint64_t tick)
+{
+	nano_timer_wheel *w = zmalloc(sizeof(nano_timer_wheel));
+
+	if (w == NULL) {
+		return NULL;
+	}
+	w->base  = now;
+	w->tick  = tick > 0 ? tick : 1;
+	w->now   = 0;
+	w->count = 0;
+	for (int l = 0; l < WHEEL_LEVELS; l++) {
+		for (int i = 0; i < WHEEL_SLOTS; i++) {
+			list_init(&w->slots[l][i]);
+		}
+	}
+
+	return w;
+}
+
+// timers still pending are left not pending, their callbacks never run
+void
+nano_timer_wheel_destroy(nano_timer_wheel *w)
+{
+	nano_timer *head;
+
+	if (w == NULL) {
+		return;
+	}
+	for (int l = 0; l < WHEEL_LEVELS; l++) {
+		for (int i = 0; i < WHEEL_SLOTS; i++) {
+			head = &w->slots[l][i];
+			while (head->next != head) {
+				list_unlink(head->next);
+			}
+		}
+	}
+	zfree(w);
+}
+
+/**
+ * @brief nano_timer_add - Schedule t at when, rounded up to a tick, a
+ * pending t is moved. A time already passed runs on the next tick.
+ * @param w - nano_timer_wheel
+ * @param t - nano_timer
+ * @param when - time t runs at
+ * @return void
+ */
+void
+nano_timer_add(nano_timer_wheel *w, nano_timer *t, uint64_t when)
+{
+	uint64_t expire = 0;
+
+	if (t->prev != NULL) {
+		list_unlink(t);
+		w->count--;
+	}
+	if (when > w->base) {
+		expire = (when - w->base + w->tick - 1) / w->tick;
+	}
+	if (expire <= w->now) {
+		expire = w->now + 1;
+	}
+	t->expire = expire;
+	wheel_link(w, t);
+	w->count++;
+}
+
+void
+nano_timer_del(nano_timer_wheel *w, nano_timer *t)
+{
+	if (t->prev != NULL) {
+		list_unlink(t);
+		w->count--;
+	}
+}
+
+// place the timers of a slot of level l again, they are all nearer now
+static void
+wheel_cascade(nano_timer_wheel *w, int l, int i)
+{
+	nano_timer list;
+	nano_timer *t;
+
+	list_splice(&w->slots[l][i], &list);
+	while ((t = list.next) != &list) {
+		list_unlink(t);
+		wheel_link(w, t);
+	}
+}
+
+static size_t
+wheel_fire(nano_timer_wheel *w, nano_timer *head)
+{
+	nano_timer  list;
+	nano_timer *t;
+	size_t      n = 0;
+
+	// a callback may delete the timers after it, they sit in list
+	list_splice(head, &list);
+	while ((t = list.next) != &list) {
+		list_unlink(t);
+		w->count--;
+		n++;
+		t->cb(t, t->arg);
+	}
+
+	return n;
+}
+
+/**
+ * @brief nano_timer_advance - Run the callbacks of all timers due by now.
+ * @param w - nano_timer_wheel
+ * @param now - current time
+ * @return timers run
+ */
+size_t
+nano_timer_advance(nano_timer_wheel *w, uint64_t now)
+{
+	uint64_t target = now > w->base ? (now - w->base) / w->tick : 0;
+	size_t   n      = 0;
+
+	while (w->now < target) {
+		if (w->count == 0) {
+			w->now = target;
+			break;
+		}
+		w->now++;
+		// a level comes round once each level below wrapped
+		for (int l = 1; l < WHEEL_LEVELS; l++) {
+			if (((w->now >> (WHEEL_BITS * (l - 1))) & WHEEL_MASK) !=
+			    0) {
+				break;
+			}
+			wheel_cascade(
+			    w, l, (w->now >> (WHEEL_BITS * l)) & WHEEL_MASK);
+		}
+		n += wheel_fire(w, &w->slots[0][w->now & WHEEL_MASK]);
+	}
+
+	return n;
+}
+
+size_t
+nano_timer_count(nano_timer_wheel *w)
+{
+	return w->count;
+}
@@ -0,0 +1,170 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "include/nano_topic.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define TOPIC_CHUNK 16
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define TOPIC_CHUNK 16
+#endif
+
+#define FNV_SEED 2166136261u
+#define FNV_PRIME 16777619u
+
+// FNV-1a
+uint32_t
+nano_topic_hash(const char *s, size_t len)
+{
+	uint32_t h = FNV_SEED;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t) s[i];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+#ifdef TOPIC_CHUNK
+// the 16 bytes at p are ASCII and none is '/', '+', '#' or NUL
+static inline bool
+chunk_plain(const uint8_t *p)
+{
+#if defined(__SSE2__)
+	__m128i v = _mm_loadu_si128((const __m128i *) p);
+	__m128i s = _mm_or_si128(
+	    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')),
+	        _mm_cmpeq_epi8(v, _mm_set1_epi8('+'))),
+	    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('#')),
+	        _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+
+	// the top bit is set on a special byte and on any non ASCII one
+	return _mm_movemask_epi8(_mm_or_si128(s, v)) == 0;
+#else
+	uint8x16_t v = vld1q_u8(p);
+	uint8x16_t s = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('/')),
+	                            vceqq_u8(v, vdupq_n_u8('+'))),
+	    vorrq_u8(vceqq_u8(v, vdupq_n_u8('#')), vceqzq_u8(v)));
+
+	return vmaxvq_u8(vorrq_u8(s, v)) < 0x80;
+#endif
+}
+#endif
+
+// bytes of the UTF-8 sequence led by p[0] >= 0x80, 0 if it is malformed,
+// overlong, a surrogate or above U+10FFFF
+static size_t
+utf8_seq(const uint8_t *p, size_t len)
+{
+	uint8_t c  = p[0];
+	uint8_t lo = 0x80;
+	uint8_t hi = 0xBF;
+	size_t  n;
+
+	if (c >= 0xC2 && c <= 0xDF) {
+		n = 2;
+	} else if (c >= 0xE0 && c <= 0xEF) {
+		n  = 3;
+		lo = c == 0xE0 ? 0xA0 : lo;
+		hi = c == 0xED ? 0x9F : hi;
+	} else if (c >= 0xF0 && c <= 0xF4) {
+		n  = 4;
+		lo = c == 0xF0 ? 0x90 : lo;
+		hi = c == 0xF4 ? 0x8F : hi;
+	} else {
+		return 0;
+	}
+
+	if (len < n || p[1] < lo || p[1] > hi) {
+		return 0;
+	}
+	for (size_t i = 2; i < n; i++) {
+		if ((p[i] & 0xC0) != 0x80) {
+			return 0;
+		}
+	}
+	return n;
+}
+
+/**
+ * @brief nano_topic_scan - Split, hash and check a topic in one pass.
+ * @param topic - topic, not NUL terminated
+ * @param len - length of topic
+ * @param flags - NANO_TOPIC_FILTER if topic is a filter
+ * @param levels - filled with the first cap levels, may be NULL if cap is 0
+ * @param cap - room in levels
+ * @param cnt - set to the count of levels
+ * @return NANO_TOPIC_OK or the first nano_topic_err found
+ */
+int
+nano_topic_scan(const char *topic, size_t len, int flags,
+    nano_topic_level *levels, int cap, int *cnt)
+{
+	const uint8_t *p  = (const uint8_t *) topic;
+	size_t         b  = 0; // where the level starts
+	size_t         i  = 0;
+	uint32_t       h  = FNV_SEED;
+	int            n  = 0;
+	int            rv = len == 0 ? NANO_TOPIC_EMPTY : NANO_TOPIC_OK;
+
+	while (i < len) {
+#ifdef TOPIC_CHUNK
+		if (i + TOPIC_CHUNK <= len && chunk_plain(p + i)) {
+			for (size_t j = i + TOPIC_CHUNK; i < j; i++) {
+				h = (h ^ p[i]) * FNV_PRIME;
+			}
+			continue;
+		}
+#endif
+		uint8_t c = p[i];
+		size_t  k = 1;
+
+		if (c == '/') {
+			if (n < cap) {
+				levels[n].off  = b;
+				levels[n].len  = i - b;
+				levels[n].hash = h;
+			}
+			n++;
+			b = ++i;
+			h = FNV_SEED;
+			continue;
+		}
+
+		if (c == 0) {
+			rv = rv ? rv : NANO_TOPIC_UTF8;
+		} else if (c == '+' || c == '#') {
+			// a whole level, and "#" the last one
+			bool whole =
+			    i == b && (i + 1 == len || p[i + 1] == '/');
+			if (!(flags & NANO_TOPIC_FILTER) || !whole ||
+			    (c == '#' && i + 1 != len)) {
+				rv = rv ? rv : NANO_TOPIC_WILDCARD;
+			}
+		} else if (c >= 0x80 && (k = utf8_seq(p + i, len - i)) == 0) {
+			rv = rv ? rv : NANO_TOPIC_UTF8;
+			k  = 1;
+		}
+		for (size_t j = i + k; i < j; i++) {
+			h = (h ^ p[i]) * FNV_PRIME;
+		}
+	}
+
+	if (n < cap) {
+		levels[n].off  = b;
+		levels[n].len  = i - b;
+		levels[n].hash = h;
+	}
+	*cnt = n + 1;
+	return rv;
+}
@@ -0,0 +1,681 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "include/dbg.h"
+#include "include/file.h"
+#include "include/nano_wal.h"
+#include "include/zmalloc.h"
+
+#define WAL_HDR_SIZE 9
+#define WAL_BUF_SIZE (64 * 1024)
+#define WAL_PATH_LEN 512
+
+// A file being written, records are gathered in buf so that a batch of
+// appends costs one write(2).
+struct nano_wal_file {
+	int      fd;
+	uint8_t *buf;
+	size_t   len;
+	size_t   cap;
+	size_t   size;
+};
+
+struct nano_wal {
+	nano_wal_opt         opt;
+	pthread_mutex_t      mtx;
+	pthread_cond_t       cv;
+	pthread_t            thr;
+	bool                 running;
+	bool                 stop;
+	bool                 compacting;
+	struct nano_wal_file seg;
+	uint32_t             seg_id;   // segment appended to
+	uint32_t             first_id; // oldest segment to replay
+	uint32_t             ckpt_id;  // latest checkpoint, 0 if none
+	uint32_t             pending;  // appends not fsync'ed yet
+	size_t               since_ckpt;
+	nano_wal_dump_cb     dump;
+	void *               arg;
+};
+
+static uint32_t        crc_table[256];
+static pthread_once_t  crc_once = PTHREAD_ONCE_INIT;
+
+static void
+crc_table_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t
+crc32_update(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = ~crc;
+	while (len--) {
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static inline void
+put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline uint32_t
+get_u32(const uint8_t *p)
+{
+	return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+	    (uint32_t) p[3] << 24;
+}
+
+static void
+wal_path(char *buf, const char *dir, const char *kind, uint32_t id,
+    const char *ext)
+{
+	snprintf(buf, WAL_PATH_LEN, "%s/%s-%08u.%s", dir, kind, id, ext);
+}
+
+static int
+wal_file_open(struct nano_wal_file *f, const char *path)
+{
+	f->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (f->fd < 0) {
+		log_err("open %s failed", path);
+		return -1;
+	}
+	f->len  = 0;
+	f->size = 0;
+	if (f->buf == NULL) {
+		f->cap = WAL_BUF_SIZE;
+		f->buf = zmalloc(f->cap);
+	}
+
+	return 0;
+}
+
+static int
+wal_file_flush(struct nano_wal_file *f)
+{
+	size_t off = 0;
+
+	while (off < f->len) {
+		ssize_t n = write(f->fd, f->buf + off, f->len - off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			log_err("write wal failed");
+			return -1;
+		}
+		off += n;
+	}
+	f->len = 0;
+
+	return 0;
+}
+
+static int
+wal_file_sync(struct nano_wal_file *f)
+{
+	if (wal_file_flush(f) != 0) {
+		return -1;
+	}
+	return fdatasync(f->fd);
+}
+
+static void
+wal_file_close(struct nano_wal_file *f)
+{
+	if (f->fd >= 0) {
+		wal_file_sync(f);
+		close(f->fd);
+		f->fd = -1;
+	}
+}
+
+/**
+ * @brief wal_file_put - Encode a record into the buffer of f.
+ * @param f - nano_wal_file
+ * @param type - record type
+ * @param iov - payload pieces
+ * @param cnt - count of iov
+ * @return bytes of the record, or -1
+ */
+static ssize_t
+wal_file_put(struct nano_wal_file *f, uint8_t type, const struct iovec *iov,
+    int cnt)
+{
+	size_t   len = 0;
+	uint32_t crc = 0;
+	uint8_t *p   = NULL;
+
+	for (int i = 0; i < cnt; i++) {
+		len += iov[i].iov_len;
+	}
+	if (len > UINT32_MAX - WAL_HDR_SIZE) {
+		return -1;
+	}
+	if (f->len + WAL_HDR_SIZE + len > f->cap && wal_file_flush(f) != 0) {
+		return -1;
+	}
+	if (WAL_HDR_SIZE + len > f->cap) {
+		f->cap = WAL_HDR_SIZE + len;
+		f->buf = zrealloc(f->buf, f->cap);
+	}
+
+	p   = f->buf + f->len;
+	crc = crc32_update(crc, &type, 1);
+	put_u32(p, len);
+	p[8] = type;
+	p += WAL_HDR_SIZE;
+	for (int i = 0; i < cnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		crc = crc32_update(crc, p, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	put_u32(f->buf + f->len + 4, crc);
+	f->len += WAL_HDR_SIZE + len;
+	f->size += WAL_HDR_SIZE + len;
+
+	return WAL_HDR_SIZE + len;
+}
+
+static void
+wal_dir_sync(const char *dir)
+{
+	int fd = open(dir, O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/**
+ * @brief wal_rotate - Seal the current segment and start the next one, the
+ * caller holds mtx.
+ * @param wal - nano_wal
+ * @return 0 or -1
+ */
+static int
+wal_rotate(nano_wal *wal)
+{
+	char path[WAL_PATH_LEN];
+
+	wal_file_close(&wal->seg);
+	wal->pending = 0;
+	wal->seg_id++;
+	wal_path(path, wal->opt.dir, "wal", wal->seg_id, "log");
+
+	return wal_file_open(&wal->seg, path);
+}
+
+/**
+ * @brief wal_replay_file - Map a log file and hand its records to cb, stop
+ * at the first torn or corrupted record.
+ * @param path - file path
+ * @param cb - nano_wal_replay_cb
+ * @param arg - argument of cb
+ * @return count of records replayed, or -1 if path can not be read
+ */
+static int
+wal_replay_file(const char *path, nano_wal_replay_cb cb, void *arg)
+{
+	struct stat st;
+	uint8_t *   map = NULL;
+	size_t      off = 0;
+	int         cnt = 0;
+	int         fd  = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_err("mmap %s failed", path);
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	while (off + WAL_HDR_SIZE <= (size_t) st.st_size) {
+		uint32_t len  = get_u32(map + off);
+		uint32_t crc  = get_u32(map + off + 4);
+		uint8_t  type = map[off + 8];
+		if (len > st.st_size - off - WAL_HDR_SIZE) {
+			break;
+		}
+		const uint8_t *data = map + off + WAL_HDR_SIZE;
+		if (crc32_update(crc32_update(0, &type, 1), data, len) != crc) {
+			break;
+		}
+		cb(type, data, len, arg);
+		off += WAL_HDR_SIZE + len;
+		cnt++;
+	}
+	if (off != (size_t) st.st_size) {
+		log_warn("%s: torn record at %zu, %zu bytes skipped", path,
+		    off, (size_t) st.st_size - off);
+	}
+	munmap(map, st.st_size);
+
+	return cnt;
+}
+
+/**
+ * @brief wal_scan - Find last segment and latest checkpoint of the log
+ * directory, leftovers of an unfinished compaction are removed.
+ * @param wal - nano_wal
+ * @param oldest - oldest segment or checkpoint id found
+ * @param last - last segment id found
+ * @return 0 or -1
+ */
+static int
+wal_scan(nano_wal *wal, uint32_t *oldest, uint32_t *last)
+{
+	char           path[WAL_PATH_LEN];
+	struct dirent *ent;
+	uint32_t       id;
+	char           ext[8];
+	DIR *          d = opendir(wal->opt.dir);
+
+	if (d == NULL) {
+		log_err("opendir %s failed", wal->opt.dir);
+		return -1;
+	}
+	*oldest       = UINT32_MAX;
+	*last         = 0;
+	wal->first_id = UINT32_MAX;
+	wal->ckpt_id  = 0;
+	while ((ent = readdir(d)) != NULL) {
+		if (sscanf(ent->d_name, "wal-%8u.%3s", &id, ext) == 2 &&
+		    strcmp(ext, "log") == 0) {
+			*last   = id > *last ? id : *last;
+			*oldest = id < *oldest ? id : *oldest;
+			wal->first_id = id < wal->first_id ? id : wal->first_id;
+		} else if (sscanf(ent->d_name, "ckpt-%8u.%3s", &id, ext) == 2) {
+			if (strcmp(ext, "log") == 0) {
+				wal->ckpt_id = id > wal->ckpt_id ? id : wal->ckpt_id;
+				*oldest = id < *oldest ? id : *oldest;
+			} else {
+				snprintf(path, sizeof(path), "%s/%s",
+				    wal->opt.dir, ent->d_name);
+				file_delete(path);
+			}
+		}
+	}
+	closedir(d);
+
+	if (wal->ckpt_id != 0) {
+		wal->first_id = wal->ckpt_id;
+	} else if (wal->first_id == UINT32_MAX) {
+		wal->first_id = 1;
+	}
+	if (*oldest == UINT32_MAX) {
+		*oldest = wal->first_id;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief wal_prune - Remove segments and checkpoints made obsolete by
+ * checkpoint ckpt_id.
+ * @param wal - nano_wal
+ * @param from - oldest segment that may exist
+ * @return void
+ */
+static void
+wal_prune(nano_wal *wal, uint32_t from)
+{
+	char path[WAL_PATH_LEN];
+
+	for (uint32_t id = from; id < wal->ckpt_id; id++) {
+		wal_path(path, wal->opt.dir, "wal", id, "log");
+		unlink(path);
+		wal_path(path, wal->opt.dir, "ckpt", id, "log");
+		unlink(path);
+	}
+}
+
+static void *
+wal_thread(void *arg)
+{
+	nano_wal *      wal = arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&wal->mtx);
+	while (!wal->stop) {
+		if (wal->opt.fsync_interval > 0) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += wal->opt.fsync_interval / 1000;
+			ts.tv_nsec += (wal->opt.fsync_interval % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&wal->cv, &wal->mtx, &ts);
+		} else {
+			pthread_cond_wait(&wal->cv, &wal->mtx);
+		}
+		if (wal->stop) {
+			break;
+		}
+		if (wal->pending > 0 || wal->seg.len > 0) {
+			wal_file_sync(&wal->seg);
+			wal->pending = 0;
+		}
+		if (wal->opt.compact_size > 0 &&
+		    wal->since_ckpt >= wal->opt.compact_size) {
+			pthread_mutex_unlock(&wal->mtx);
+			nano_wal_compact(wal);
+			pthread_mutex_lock(&wal->mtx);
+		}
+	}
+	pthread_mutex_unlock(&wal->mtx);
+
+	return NULL;
+}
+
+/**
+ * @brief nano_wal_open - Open the log in opt->dir, the directory is
+ * created if needed. Appends go to a new segment, call nano_wal_replay to
+ * read what was logged before.
+ * @param wal - nano_wal
+ * @param opt - nano_wal_opt
+ * @param dump - write live state to a checkpoint, NULL disables compaction
+ * @param arg - argument of dump
+ * @return 0 or -1
+ */
+int
+nano_wal_open(nano_wal **wal, const nano_wal_opt *opt, nano_wal_dump_cb dump,
+    void *arg)
+{
+	nano_wal *w      = NULL;
+	uint32_t  last   = 0;
+	uint32_t  oldest = 0;
+
+	pthread_once(&crc_once, crc_table_init);
+	if (opt->dir == NULL ||
+	    (!file_is_directory(opt->dir) && file_create_dir(opt->dir) < 0)) {
+		log_err("wal dir %s is not available",
+		    opt->dir ? opt->dir : "");
+		return -1;
+	}
+
+	w = zmalloc(sizeof(nano_wal));
+	memset(w, 0, sizeof(nano_wal));
+	w->opt     = *opt;
+	w->opt.dir = zstrdup(opt->dir);
+	w->dump    = dump;
+	w->arg     = arg;
+	w->seg.fd  = -1;
+	pthread_mutex_init(&w->mtx, NULL);
+	pthread_cond_init(&w->cv, NULL);
+
+	if (wal_scan(w, &oldest, &last) != 0) {
+		goto err;
+	}
+	wal_prune(w, oldest);
+	w->seg_id = last > w->ckpt_id ? last : w->ckpt_id;
+	if (wal_rotate(w) != 0) {
+		goto err;
+	}
+	wal_dir_sync(w->opt.dir);
+
+	if (w->opt.fsync_interval > 0 || (dump && w->opt.compact_size > 0)) {
+		if (pthread_create(&w->thr, NULL, wal_thread, w) != 0) {
+			log_err("create wal thread failed");
+			goto err;
+		}
+		w->running = true;
+	}
+
+	*wal = w;
+	return 0;
+
+err:
+	wal_file_close(&w->seg);
+	zfree(w->seg.buf);
+	zfree((char *) w->opt.dir);
+	pthread_mutex_destroy(&w->mtx);
+	pthread_cond_destroy(&w->cv);
+	zfree(w);
+	return -1;
+}
+
+/**
+ * @brief nano_wal_close - Sync and close the log.
+ * @param wal - nano_wal
+ * @return void
+ */
+void
+nano_wal_close(nano_wal *wal)
+{
+	if (wal == NULL) {
+		return;
+	}
+	if (wal->running) {
+		pthread_mutex_lock(&wal->mtx);
+		wal->stop = true;
+		pthread_cond_signal(&wal->cv);
+		pthread_mutex_unlock(&wal->mtx);
+		pthread_join(wal->thr, NULL);
+	}
+	wal_file_close(&wal->seg);
+	zfree(wal->seg.buf);
+	zfree((char *) wal->opt.dir);
+	pthread_mutex_destroy(&wal->mtx);
+	pthread_cond_destroy(&wal->cv);
+	zfree(wal);
+}
+
+/**
+ * @brief nano_wal_replay - Replay the latest checkpoint and the segments
+ * written after it, in order.
+ * @param wal - nano_wal
+ * @param cb - nano_wal_replay_cb, called once for each record
+ * @param arg - argument of cb
+ * @return count of records replayed
+ */
+int
+nano_wal_replay(nano_wal *wal, nano_wal_replay_cb cb, void *arg)
+{
+	char path[WAL_PATH_LEN];
+	int  cnt = 0;
+	int  rv;
+
+	if (wal->ckpt_id != 0) {
+		wal_path(path, wal->opt.dir, "ckpt", wal->ckpt_id, "log");
+		if ((rv = wal_replay_file(path, cb, arg)) > 0) {
+			cnt += rv;
+		}
+	}
+	for (uint32_t id = wal->first_id; id < wal->seg_id; id++) {
+		wal_path(path, wal->opt.dir, "wal", id, "log");
+		if ((rv = wal_replay_file(path, cb, arg)) > 0) {
+			cnt += rv;
+		}
+	}
+	log_info("%d wal records replayed from %s", cnt, wal->opt.dir);
+
+	return cnt;
+}
+
+/**
+ * @brief nano_wal_append - Append a record, the payload is the
+ * concatenation of iov. It reaches the disk with the next group commit,
+ * after fsync_batch appends or fsync_interval, or nano_wal_sync.
+ * @param wal - nano_wal
+ * @param type - record type
+ * @param iov - payload pieces
+ * @param cnt - count of iov
+ * @return 0 or -1
+ */
+int
+nano_wal_append(nano_wal *wal, uint8_t type, const struct iovec *iov, int cnt)
+{
+	ssize_t n;
+	bool    compact = false;
+	int     rv      = 0;
+
+	pthread_mutex_lock(&wal->mtx);
+	if (wal->opt.segment_size > 0 &&
+	    wal->seg.size >= wal->opt.segment_size && wal_rotate(wal) != 0) {
+		pthread_mutex_unlock(&wal->mtx);
+		return -1;
+	}
+	if ((n = wal_file_put(&wal->seg, type, iov, cnt)) < 0) {
+		pthread_mutex_unlock(&wal->mtx);
+		return -1;
+	}
+	wal->since_ckpt += n;
+	if (wal->opt.fsync_batch > 0 &&
+	    ++wal->pending >= wal->opt.fsync_batch) {
+		rv           = wal_file_sync(&wal->seg);
+		wal->pending = 0;
+	}
+	if (wal->running && wal->dump && wal->opt.compact_size > 0 &&
+	    wal->since_ckpt >= wal->opt.compact_size && !wal->compacting) {
+		compact = true;
+	}
+	pthread_mutex_unlock(&wal->mtx);
+
+	if (compact) {
+		pthread_cond_signal(&wal->cv);
+	}
+
+	return rv;
+}
+
+/**
+ * @brief nano_wal_sync - Write and fsync all appended records.
+ * @param wal - nano_wal
+ * @return 0 or -1
+ */
+int
+nano_wal_sync(nano_wal *wal)
+{
+	int rv;
+
+	pthread_mutex_lock(&wal->mtx);
+	rv           = wal_file_sync(&wal->seg);
+	wal->pending = 0;
+	pthread_mutex_unlock(&wal->mtx);
+
+	return rv;
+}
+
+/**
+ * @brief nano_wal_ckpt_append - Append a record to the checkpoint being
+ * dumped, only valid inside nano_wal_dump_cb.
+ * @param ckpt - nano_wal_ckpt
+ * @param type - record type
+ * @param iov - payload pieces
+ * @param cnt - count of iov
+ * @return 0 or -1
+ */
+int
+nano_wal_ckpt_append(
+    nano_wal_ckpt *ckpt, uint8_t type, const struct iovec *iov, int cnt)
+{
+	return wal_file_put(ckpt, type, iov, cnt) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief nano_wal_compact - Dump live state to a new checkpoint and remove
+ * the log it replaces. Appends go on to a fresh segment meanwhile, so the
+ * records of the dump window are kept in both.
+ * @param wal - nano_wal
+ * @return 0 or -1
+ */
+int
+nano_wal_compact(nano_wal *wal)
+{
+	struct nano_wal_file ckpt = { .fd = -1 };
+	char                 tmp[WAL_PATH_LEN];
+	char                 path[WAL_PATH_LEN];
+	uint32_t             id;
+	uint32_t             from;
+	int                  rv = -1;
+
+	pthread_mutex_lock(&wal->mtx);
+	if (wal->dump == NULL || wal->compacting) {
+		pthread_mutex_unlock(&wal->mtx);
+		return wal->dump == NULL ? -1 : 0;
+	}
+	if (wal_rotate(wal) != 0) {
+		pthread_mutex_unlock(&wal->mtx);
+		return -1;
+	}
+	wal->compacting = true;
+	wal->since_ckpt = 0;
+	id              = wal->seg_id;
+	from            = wal->first_id;
+	pthread_mutex_unlock(&wal->mtx);
+
+	wal_path(tmp, wal->opt.dir, "ckpt", id, "tmp");
+	wal_path(path, wal->opt.dir, "ckpt", id, "log");
+	if (wal_file_open(&ckpt, tmp) == 0) {
+		rv = wal->dump(&ckpt, wal->arg);
+		if (wal_file_sync(&ckpt) != 0) {
+			rv = -1;
+		}
+		close(ckpt.fd);
+		if (rv == 0 && rename(tmp, path) != 0) {
+			log_err("rename %s failed", tmp);
+			rv = -1;
+		}
+		if (rv != 0) {
+			unlink(tmp);
+		}
+		zfree(ckpt.buf);
+	}
+
+	pthread_mutex_lock(&wal->mtx);
+	if (rv == 0) {
+		wal_dir_sync(wal->opt.dir);
+		wal->ckpt_id  = id;
+		wal->first_id = id;
+		wal_prune(wal, from);
+		log_info("wal compacted to checkpoint %u", id);
+	}
+	wal->compacting = false;
+	pthread_mutex_unlock(&wal->mtx);
+
+	return rv;
+}
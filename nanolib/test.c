@@ -1,7 +1,27 @@
 #include "include/mqtt_db.h"
 #include "include/nanolib.h"
+#include "include/nano_alias.h"
+#include "include/nano_arena.h"
+#include "include/nano_capture.h"
+#include "include/nano_log.h"
+#include "include/nano_envelope.h"
+#include "include/nano_lz.h"
+#include "include/nano_mem.h"
+#include "include/nano_retain.h"
+#include "include/nano_shm.h"
+#include "include/nano_ring.h"
+#include "include/nano_timer.h"
+#include "include/nano_topic.h"
+#include "include/nano_wal.h"
 #include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define TEST_NUM_THREADS 8
 #define TEST_QUE_SIZE 10
@@ -10,7 +30,6 @@
 #define TEST_LOOP 10
 
 dbtree *db     = NULL;
-dbtree *db_ret = NULL;
 
 ///////////for wildcard////////////
 char topic0[] = "zhang/bei/hai";
@@ -90,17 +109,6 @@ dbtree_client client9 = {
 	.session_id = 250420, .pipe_id = 150420, (void *) &"350420"
 };
 
-dbtree_retain_msg retain0 = { 1, true, "150429", NULL };
-dbtree_retain_msg retain1 = { 1, true, "150428", NULL };
-dbtree_retain_msg retain2 = { 1, true, "150427", NULL };
-dbtree_retain_msg retain3 = { 1, true, "150426", NULL };
-dbtree_retain_msg retain4 = { 1, true, "150425", NULL };
-dbtree_retain_msg retain5 = { 1, true, "150424", NULL };
-dbtree_retain_msg retain6 = { 1, true, "150423", NULL };
-dbtree_retain_msg retain7 = { 1, true, "150422", NULL };
-dbtree_retain_msg retain8 = { 1, true, "150421", NULL };
-dbtree_retain_msg retain9 = { 1, true, "150420", NULL };
-
 dbtree_client client[] = {
 	{ 230429, 130429, NULL },
 	{ 230428, 130428, NULL },
@@ -117,25 +125,25 @@ dbtree_client client[] = {
 static void
 test_insert_client()
 {
-	dbtree_insert_client(db, topic0, client0.ctxt, client0.pipe_id);
+	dbtree_insert_client(db, topic0, client0.ctxt, client0.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, topic1, client1.ctxt, client1.pipe_id);
+	dbtree_insert_client(db, topic1, client1.ctxt, client1.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, topic2, client2.ctxt, client2.pipe_id);
+	dbtree_insert_client(db, topic2, client2.ctxt, client2.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, topic3, client3.ctxt, client3.pipe_id);
+	dbtree_insert_client(db, topic3, client3.ctxt, client3.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, topic4, client4.ctxt, client4.pipe_id);
+	dbtree_insert_client(db, topic4, client4.ctxt, client4.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, topic5, client5.ctxt, client5.pipe_id);
+	dbtree_insert_client(db, topic5, client5.ctxt, client5.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, topic6, client6.ctxt, client6.pipe_id);
+	dbtree_insert_client(db, topic6, client6.ctxt, client6.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, topic7, client7.ctxt, client7.pipe_id);
+	dbtree_insert_client(db, topic7, client7.ctxt, client7.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, topic8, client8.ctxt, client8.pipe_id);
+	dbtree_insert_client(db, topic8, client8.ctxt, client8.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, topic9, client9.ctxt, client9.pipe_id);
+	dbtree_insert_client(db, topic9, client9.ctxt, client9.pipe_id, 0);
 	dbtree_print(db);
 }
 
@@ -143,25 +151,25 @@ test_insert_client()
 static void
 test_insert_shared_client()
 {
-	dbtree_insert_client(db, share0, client0.ctxt, client0.pipe_id);
+	dbtree_insert_client(db, share0, client0.ctxt, client0.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, share1, client1.ctxt, client1.pipe_id);
+	dbtree_insert_client(db, share1, client1.ctxt, client1.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, share2, client2.ctxt, client2.pipe_id);
+	dbtree_insert_client(db, share2, client2.ctxt, client2.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, share3, client3.ctxt, client3.pipe_id);
+	dbtree_insert_client(db, share3, client3.ctxt, client3.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, share4, client4.ctxt, client4.pipe_id);
+	dbtree_insert_client(db, share4, client4.ctxt, client4.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, share5, client5.ctxt, client5.pipe_id);
+	dbtree_insert_client(db, share5, client5.ctxt, client5.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, share6, client6.ctxt, client6.pipe_id);
+	dbtree_insert_client(db, share6, client6.ctxt, client6.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, share7, client7.ctxt, client7.pipe_id);
+	dbtree_insert_client(db, share7, client7.ctxt, client7.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, share8, client8.ctxt, client8.pipe_id);
+	dbtree_insert_client(db, share8, client8.ctxt, client8.pipe_id, 0);
 	dbtree_print(db);
-	dbtree_insert_client(db, share9, client9.ctxt, client9.pipe_id);
+	dbtree_insert_client(db, share9, client9.ctxt, client9.pipe_id, 0);
 	dbtree_print(db);
 }
 
@@ -336,7 +344,7 @@ test_search_shared_client()
         	size_t size = 0;
 		// dbtree_print(db);
 		char **v =
-		    (char **) dbtree_find_shared_sub_clients(db, topic0, NULL, &size);
+		    (char **) dbtree_find_shared_sub_clients(db, topic0, NULL, &size, 0);
 		// dbtree_print(db);
 
 		if (v) {
@@ -391,56 +399,6 @@ test_cache_session_msg()
 	}
 }
 
-static void
-test_insert_retain()
-{
-	dbtree_insert_retain(db_ret, topic00, &retain0);
-	dbtree_print(db_ret);
-	dbtree_insert_retain(db_ret, topic01, &retain1);
-	dbtree_print(db_ret);
-	dbtree_insert_retain(db_ret, topic02, &retain2);
-	dbtree_print(db_ret);
-	dbtree_insert_retain(db_ret, topic03, &retain3);
-	dbtree_print(db_ret);
-	dbtree_insert_retain(db_ret, topic04, &retain4);
-	dbtree_print(db_ret);
-	dbtree_insert_retain(db_ret, topic05, &retain5);
-	dbtree_print(db_ret);
-	dbtree_insert_retain(db_ret, topic06, &retain6);
-	dbtree_print(db_ret);
-	dbtree_insert_retain(db_ret, topic07, &retain7);
-	dbtree_print(db_ret);
-	dbtree_insert_retain(db_ret, topic08, &retain8);
-	dbtree_print(db_ret);
-	dbtree_insert_retain(db_ret, topic09, &retain9);
-	dbtree_print(db_ret);
-}
-
-static void
-test_delete_retain()
-{
-	dbtree_delete_retain(db_ret, topic00);
-	dbtree_print(db_ret);
-	dbtree_delete_retain(db_ret, topic01);
-	dbtree_print(db_ret);
-	dbtree_delete_retain(db_ret, topic02);
-	dbtree_print(db_ret);
-	dbtree_delete_retain(db_ret, topic03);
-	dbtree_print(db_ret);
-	dbtree_delete_retain(db_ret, topic04);
-	dbtree_print(db_ret);
-	dbtree_delete_retain(db_ret, topic05);
-	dbtree_print(db_ret);
-	dbtree_delete_retain(db_ret, topic06);
-	dbtree_print(db_ret);
-	dbtree_delete_retain(db_ret, topic07);
-	dbtree_print(db_ret);
-	dbtree_delete_retain(db_ret, topic08);
-	dbtree_print(db_ret);
-	dbtree_delete_retain(db_ret, topic09);
-	dbtree_print(db_ret);
-}
-
 static void *
 test_single_thread(void *args)
 {
@@ -501,30 +459,2087 @@ test_concurrent()
 	// pthread_exit(NULL);
 }
 
+static atomic_bool test_search_stop = false;
 
-void test_shared_sub()
+static void *
+test_search_thread(void *args)
 {
-	const char *null = NULL;
-	const char *non_shared = "a/b/c";
-	const char *shared = "$shared/a/b/c";
-	assert(dbtree_check_shared_sub(null) == false);
-	assert(dbtree_check_shared_sub(non_shared) == false);
-	assert(dbtree_check_shared_sub(shared) == true);
+	while (!atomic_load(&test_search_stop)) {
+		size_t size = 0;
+		void **v =
+		    dbtree_find_clients_and_cache_msg(db, topic0, NULL, &size);
+		cvector_free(v);
+		v = dbtree_find_shared_sub_clients(db, topic0, NULL, &size, 0);
+		cvector_free(v);
+	}
+	return NULL;
+}
 
-	return;
+// Search without lock while insert and delete are going on.
+static void
+test_concurrent_search()
+{
+	pthread_t threads[TEST_NUM_THREADS];
+
+	atomic_store(&test_search_stop, false);
+	for (int t = 0; t < TEST_NUM_THREADS; t++) {
+		pthread_create(&threads[t], NULL, test_search_thread, NULL);
+	}
+
+	for (int i = 0; i < TEST_LOOP * 10; i++) {
+		test_insert_client();
+		test_insert_shared_client();
+		test_delete_client();
+		test_delete_shared_client();
+	}
+
+	atomic_store(&test_search_stop, true);
+	for (int t = 0; t < TEST_NUM_THREADS; t++) {
+		pthread_join(threads[t], NULL);
+	}
 }
 
-int
-main(int argc, char *argv[])
+// Extend a leaf and go deeper than the tokenizer stack.
+static void
+test_search_levels()
 {
-	puts("\n----------------TEST START------------------");
+	char *  short_topic = "zhang/bei";
+	char *  long_topic  = "zhang/bei/hai";
+	char    deep_topic[] = "a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/q/r/s/t";
+	size_t  size        = 0;
+	void ** v           = NULL;
+	dbtree *t           = NULL;
 
-	dbtree_create(&db);
-	test_insert_shared_client();
-	dbtree_print(db);
-	test_search_shared_client();
+	dbtree_create(&t);
+	dbtree_insert_client(t, short_topic, client0.ctxt, client0.pipe_id, 0);
+	dbtree_insert_client(t, long_topic, client1.ctxt, client1.pipe_id, 0);
+	dbtree_insert_client(t, deep_topic, client2.ctxt, client2.pipe_id, 0);
 
-	test_delete_shared_client();
+	v = dbtree_find_clients_and_cache_msg(t, long_topic, NULL, &size);
+	assert(cvector_size(v) == 1 && v[0] == client1.ctxt);
+	cvector_free(v);
+
+	v = dbtree_find_clients_and_cache_msg(t, deep_topic, NULL, &size);
+	assert(cvector_size(v) == 1 && v[0] == client2.ctxt);
+	cvector_free(v);
+
+	dbtree_delete_client(t, long_topic, 0, client1.pipe_id);
+	v = dbtree_find_clients_and_cache_msg(t, short_topic, NULL, &size);
+	assert(cvector_size(v) == 1 && v[0] == client0.ctxt);
+	cvector_free(v);
+
+	dbtree_delete_client(t, short_topic, 0, client0.pipe_id);
+	dbtree_delete_client(t, deep_topic, 0, client2.pipe_id);
+	dbtree_destory(t);
+}
+
+// count of filters in v, each ctxt is its filter
+static int
+count_filters(void **v, char **filters, int n)
+{
+	int cnt = 0;
+
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < cvector_size(v); j++) {
+			if (v[j] == filters[i]) {
+				cnt++;
+				break;
+			}
+		}
+	}
+	return cnt;
+}
+
+// Wildcard filters are found from their shapes, a shape goes away with
+// its last filter.
+static void
+test_wild_index()
+{
+	char    deep[64]  = { 0 };
+	char    plus[64]  = { 0 };
+	size_t  size      = 0;
+	void ** v         = NULL;
+	dbtree *t         = NULL;
+	char *  filters[] = { "#", "+", "+/+/+/status", "fleet/+/+/alarm",
+		"fleet/7/+/alarm", "fleet/#", "+/7/#", "a/#/b",
+		"fleet/7/door/alarm", "$share/g/+/+/+/status", plus };
+	int     n         = sizeof(filters) / sizeof(char *);
+
+	for (int i = 0; i < 20; i++) {
+		strcat(deep, i ? "/l" : "l");
+		strcat(plus, i ? "/+" : "+");
+	}
+	dbtree_create(&t);
+	for (int i = 0; i < n; i++) {
+		dbtree_insert_client(t, filters[i], filters[i], i + 1, 0);
+	}
+
+	v = dbtree_find_clients_and_cache_msg(
+	    t, "fleet/7/door/alarm", NULL, &size);
+	assert(cvector_size(v) == 6 && count_filters(v, filters, n) == 6);
+	cvector_free(v);
+	v = dbtree_find_all_clients_and_cache_msg(
+	    t, "fleet/8/door/status", NULL, &size, 0, NULL);
+	assert(cvector_size(v) == 4 && count_filters(v, filters + 9, 1));
+	cvector_free(v);
+	v = dbtree_find_clients_and_cache_msg(t, "x", NULL, &size);
+	assert(cvector_size(v) == 2);
+	cvector_free(v);
+	v = dbtree_find_clients_and_cache_msg(t, "a/q/b", NULL, &size);
+	assert(cvector_size(v) == 1 && v[0] == filters[0]);
+	cvector_free(v);
+	v = dbtree_find_clients_and_cache_msg(t, deep, NULL, &size);
+	assert(cvector_size(v) == 2 && count_filters(v, filters + 10, 1));
+	cvector_free(v);
+
+	dbtree_delete_client(t, filters[3], 0, 4);
+	dbtree_delete_client(t, filters[4], 0, 5);
+	v = dbtree_find_clients_and_cache_msg(
+	    t, "fleet/7/door/alarm", NULL, &size);
+	assert(cvector_size(v) == 4 && count_filters(v, filters + 3, 2) == 0);
+	cvector_free(v);
+
+	for (int i = 0; i < n; i++) {
+		dbtree_delete_client(t, filters[i], 0, i + 1);
+	}
+	assert(cvector_empty(t->root->child));
+	dbtree_destory(t);
+}
+
+// Levels kept in the node and on the heap, and levels which are a prefix
+// of their neighbours, are all found again.
+static void
+test_node_levels()
+{
+	char    topics[4][256];
+	size_t  size   = 0;
+	void ** v      = NULL;
+	dbtree *t      = NULL;
+	int     lens[] = { DBTREE_NODE_INLINE - 1, DBTREE_NODE_INLINE, 200 };
+
+	assert(sizeof(dbtree_node) == 96);
+	dbtree_create(&t);
+	for (int i = 0; i < 3; i++) {
+		memset(topics[i], 'a', lens[i]);
+		strcpy(topics[i] + lens[i], "/x");
+		dbtree_insert_client(t, topics[i], topics[i], 10 + i, 0);
+	}
+	strcpy(topics[3], "a/x");
+	dbtree_insert_client(t, topics[3], topics[3], 13, 0);
+
+	for (int i = 0; i < 4; i++) {
+		v = dbtree_find_clients_and_cache_msg(
+		    t, topics[i], NULL, &size);
+		assert(cvector_size(v) == 1 && v[0] == topics[i]);
+		cvector_free(v);
+		dbtree_delete_client(t, topics[i], 0, 10 + i);
+	}
+	assert(cvector_empty(t->root->child));
+	dbtree_destory(t);
+}
+
+// Many children under one node, past the size of a child vector.
+static void
+test_child_index()
+{
+	char    topic[64];
+	size_t  size = 0;
+	void ** v    = NULL;
+	dbtree *t    = NULL;
+	int     n    = 1000;
+
+	dbtree_create(&t);
+	dbtree_insert_client(
+	    t, "fleet/+/state", client0.ctxt, client0.pipe_id, 0);
+	for (int i = 0; i < n; i++) {
+		sprintf(topic, "fleet/%d/state", i);
+		dbtree_insert_client(t, topic, client1.ctxt, 1000 + i, 0);
+	}
+	dbtree_insert_client(t, "fleet/#", client2.ctxt, client2.pipe_id, 0);
+
+	for (int i = 0; i < n; i++) {
+		sprintf(topic, "fleet/%d/state", i);
+		v = dbtree_find_clients_and_cache_msg(t, topic, NULL, &size);
+		assert(cvector_size(v) == 3);
+		cvector_free(v);
+	}
+
+	for (int i = 0; i < n; i += 2) {
+		sprintf(topic, "fleet/%d/state", i);
+		dbtree_delete_client(t, topic, 0, 1000 + i);
+	}
+
+	for (int i = 0; i < n; i++) {
+		sprintf(topic, "fleet/%d/state", i);
+		v = dbtree_find_clients_and_cache_msg(t, topic, NULL, &size);
+		assert(cvector_size(v) == (i % 2 ? 3 : 2));
+		cvector_free(v);
+	}
+
+	for (int i = 1; i < n; i += 2) {
+		sprintf(topic, "fleet/%d/state", i);
+		dbtree_delete_client(t, topic, 0, 1000 + i);
+	}
+	dbtree_delete_client(t, "fleet/+/state", 0, client0.pipe_id);
+	dbtree_delete_client(t, "fleet/#", 0, client2.pipe_id);
+
+	v = dbtree_find_clients_and_cache_msg(t, "fleet/1/state", NULL, &size);
+	assert(v == NULL);
+	dbtree_destory(t);
+}
+
+// Clients on overlapping filters are returned once.
+static void
+test_dedup_clients()
+{
+	size_t  size = 0;
+	void ** v    = NULL;
+	dbtree *t    = NULL;
+	int     n    = 200;
+
+	dbtree_create(&t);
+	for (int i = 0; i < n; i++) {
+		dbtree_insert_client(t, "a/#", client0.ctxt, i, 0);
+		dbtree_insert_client(t, "a/b", client0.ctxt, i, 0);
+		dbtree_insert_client(t, "a/+", client0.ctxt, i, 0);
+	}
+
+	v = dbtree_find_clients_and_cache_msg(t, "a/b", NULL, &size);
+	assert(cvector_size(v) == n);
+	cvector_free(v);
+
+	for (int i = 0; i < n; i++) {
+		dbtree_delete_client(t, "a/#", 0, i);
+		dbtree_delete_client(t, "a/b", 0, i);
+		dbtree_delete_client(t, "a/+", 0, i);
+	}
+	dbtree_destory(t);
+}
+
+static uint32_t
+test_shared_load(uint32_t pipe_id)
+{
+	return pipe_id == 3 ? 0 : 10;
+}
+
+// Dispatch of one group with each strategy.
+static void
+test_shared_strategy()
+{
+	size_t  size     = 0;
+	void ** v        = NULL;
+	dbtree *t        = NULL;
+	int     n        = 4;
+	int     hits[4]  = { 0 };
+	char *  ctxts[4] = { "0", "1", "2", "3" };
+
+	dbtree_create(&t);
+	for (int i = 0; i < n; i++) {
+		dbtree_insert_client(t, "$share/g/a/b", ctxts[i], i, 0);
+	}
+
+	for (int i = 0; i < n * 2; i++) {
+		v = dbtree_find_shared_sub_clients(t, "a/b", NULL, &size, 0);
+		assert(cvector_size(v) == 1);
+		hits[*(char *) v[0] - '0']++;
+		cvector_free(v);
+	}
+	for (int i = 0; i < n; i++) {
+		assert(hits[i] == 2);
+	}
+
+	dbtree_set_shared_strategy(t, SHARED_STICKY, NULL);
+	v = dbtree_find_shared_sub_clients(t, "a/b", NULL, &size, 7);
+	void *first = v[0];
+	cvector_free(v);
+	for (int i = 0; i < n; i++) {
+		v = dbtree_find_shared_sub_clients(t, "a/b", NULL, &size, 7);
+		assert(v[0] == first);
+		cvector_free(v);
+	}
+
+	dbtree_set_shared_strategy(
+	    t, SHARED_LEAST_INFLIGHT, test_shared_load);
+	for (int i = 0; i < n; i++) {
+		v = dbtree_find_shared_sub_clients(t, "a/b", NULL, &size, 0);
+		assert(v[0] == ctxts[3]);
+		cvector_free(v);
+	}
+
+	for (int i = 0; i < n; i++) {
+		dbtree_delete_client(t, "$share/g/a/b", 0, i);
+	}
+	dbtree_destory(t);
+}
+
+// Hit on the same topic, miss again after the tree changes.
+static void
+test_match_cache()
+{
+	char *                   topic = "zhang/bei/hai";
+	size_t                   size  = 0;
+	void **                  v     = NULL;
+	dbtree *                 t     = NULL;
+	dbtree_match_cache_stats st;
+
+	dbtree_create(&t);
+	dbtree_match_cache_init(t, 4);
+	dbtree_insert_client(
+	    t, "zhang/+/hai", client0.ctxt, client0.pipe_id, 0);
+
+	for (int i = 0; i < 3; i++) {
+		v = dbtree_find_clients_and_cache_msg(t, topic, NULL, &size);
+		assert(cvector_size(v) == 1 && v[0] == client0.ctxt);
+		cvector_free(v);
+	}
+	dbtree_get_match_cache_stats(t, &st);
+	assert(st.miss == 1 && st.hit == 2 && st.size == 1);
+
+	dbtree_insert_client(t, "zhang/#", client1.ctxt, client1.pipe_id, 0);
+	v = dbtree_find_clients_and_cache_msg(t, topic, NULL, &size);
+	assert(cvector_size(v) == 2);
+	cvector_free(v);
+	dbtree_get_match_cache_stats(t, &st);
+	assert(st.miss == 2 && st.hit == 2);
+
+	dbtree_delete_client(t, "zhang/+/hai", 0, client0.pipe_id);
+	dbtree_delete_client(t, "zhang/#", 0, client1.pipe_id);
+	v = dbtree_find_clients_and_cache_msg(t, topic, NULL, &size);
+	assert(v == NULL);
+	dbtree_destory(t);
+}
+
+// Clients and shared groups are found by one walk, a member is picked
+// again on every cache hit.
+static void
+test_find_all_clients()
+{
+	size_t  size     = 0;
+	void ** v        = NULL;
+	dbtree *t        = NULL;
+	char *  ctxts[4] = { "0", "1", "2", "3" };
+
+	dbtree_create(&t);
+	dbtree_match_cache_init(t, 4);
+	dbtree_insert_client(t, "a/+", ctxts[0], 0, 0);
+	dbtree_insert_client(t, "$share/g/a/b", ctxts[1], 1, 0);
+	dbtree_insert_client(t, "$share/g/a/b", ctxts[2], 2, 0);
+	dbtree_insert_client(t, "$share/h/a/#", ctxts[3], 3, 0);
+
+	void *last = NULL;
+	for (int i = 0; i < 4; i++) {
+		v = dbtree_find_all_clients_and_cache_msg(
+		    t, "a/b", NULL, &size, 0, NULL);
+		assert(cvector_size(v) == 3 && v[0] == ctxts[0]);
+		assert(v[1] == ctxts[3]);
+		assert(v[2] == ctxts[1] || v[2] == ctxts[2]);
+		assert(v[2] != last);
+		last = v[2];
+		cvector_free(v);
+	}
+
+	v = dbtree_find_clients_and_cache_msg(t, "a/b", NULL, &size);
+	assert(cvector_size(v) == 1 && v[0] == ctxts[0]);
+	cvector_free(v);
+	v = dbtree_find_shared_sub_clients(t, "a/b", NULL, &size, 0);
+	assert(cvector_size(v) == 2 && v[0] == ctxts[3]);
+	cvector_free(v);
+
+	dbtree_match_cache_stats st;
+	dbtree_get_match_cache_stats(t, &st);
+	assert(st.miss == 1 && st.hit == 5);
+
+	dbtree_delete_client(t, "$share/g/a/b", 0, 1);
+	dbtree_delete_client(t, "$share/g/a/b", 0, 2);
+	dbtree_delete_client(t, "$share/h/a/#", 0, 3);
+	v = dbtree_find_all_clients_and_cache_msg(
+	    t, "a/b", NULL, &size, 0, NULL);
+	assert(cvector_size(v) == 1 && v[0] == ctxts[0]);
+	cvector_free(v);
+
+	dbtree_delete_client(t, "a/+", 0, 0);
+	assert(cvector_empty(t->root->child));
+	dbtree_destory(t);
+}
+
+// A QoS 0 lookup leaves offline sessions alone, the entry it caches is
+// not taken by a lookup which has to queue for them.
+static void
+test_find_online_clients()
+{
+	size_t  size     = 0;
+	void ** v        = NULL;
+	dbtree *t        = NULL;
+	char *  ctxts[2] = { "0", "1" };
+	char *  msg      = "message";
+
+	dbtree_create(&t);
+	dbtree_match_cache_init(t, 4);
+	dbtree_insert_client(t, "a/b", ctxts[0], 1, 0);
+	dbtree_insert_client(t, "a/+", ctxts[1], 2, 1);
+	dbtree_cache_session(t, "a/+", 7, 2);
+
+	for (int i = 0; i < 2; i++) {
+		v = dbtree_find_online_clients(t, "a/b", 0);
+		assert(cvector_size(v) == 1 && v[0] == ctxts[0]);
+		cvector_free(v);
+	}
+	char **ret = (char **) dbtree_restore_session_msg(t, 7);
+	assert(cvector_empty(ret));
+	cvector_free(ret);
+
+	v = dbtree_find_all_clients_and_cache_msg(
+	    t, "a/b", msg, &size, 0, NULL);
+	assert(cvector_size(v) == 1 && v[0] == ctxts[0] && size == 1);
+	cvector_free(v);
+	ret = (char **) dbtree_restore_session_msg(t, 7);
+	assert(cvector_size(ret) == 1 && ret[0] == msg);
+	cvector_free(ret);
+
+	v = dbtree_find_online_clients(t, "a/b", 0);
+	assert(cvector_size(v) == 1);
+	cvector_free(v);
+
+	dbtree_match_cache_stats st;
+	dbtree_get_match_cache_stats(t, &st);
+	assert(st.miss == 2 && st.hit == 2);
+	dbtree_destory(t);
+}
+
+// A batch insert matches the same clients as inserting one by one.
+static void
+test_insert_clients()
+{
+	size_t  size     = 0;
+	void ** v        = NULL;
+	dbtree *t        = NULL;
+	char *  topics[] = { "a/b/c", "a/+", "$share/g/a/b", "a/b/#", "a/b/c",
+		"x/y", "#" };
+	char *  matches[] = { "a/b/c", "a/b", "x/y", "a" };
+	size_t  cnts[]    = { 1, 2, 2, 1 }; // one pipe, shared counted apart
+	int     rets[7];
+
+	dbtree_create(&t);
+	dbtree_insert_client(t, "x/y", "9", 9, 0);
+	dbtree_insert_clients(t, topics, NULL, 7, "1", 1, rets);
+	assert(rets[0] == 0 && rets[4] == 1 && rets[5] == 0);
+
+	for (int i = 0; i < 4; i++) {
+		v = dbtree_find_all_clients_and_cache_msg(
+		    t, matches[i], NULL, &size, 0, NULL);
+		assert(cvector_size(v) == cnts[i]);
+		cvector_free(v);
+	}
+
+	for (int i = 0; i < 7; i++) {
+		if (i != 4) {
+			dbtree_delete_client(t, topics[i], 0, 1);
+		}
+	}
+	dbtree_delete_client(t, "x/y", 0, 9);
+	assert(cvector_empty(t->root->child));
+	dbtree_destory(t);
+}
+
+// Delete a client from all of its topics in one pass.
+static void
+test_delete_clients()
+{
+	size_t  size     = 0;
+	void ** v        = NULL;
+	dbtree *t        = NULL;
+	char *  topics[] = { "a/b/c", "a/+", "$share/g/a/b", "a/b/#", "x/y",
+		"#", "a/b", "no/such" };
+	void *  ctxts[8];
+
+	dbtree_create(&t);
+	dbtree_insert_client(t, "a/b", "9", 9, 0);
+	dbtree_insert_clients(t, topics, NULL, 7, "1", 1, NULL);
+	dbtree_delete_clients(t, topics, 8, 1, ctxts);
+	for (int i = 0; i < 7; i++) {
+		assert(ctxts[i] != NULL && !strcmp(ctxts[i], "1"));
+	}
+	assert(ctxts[7] == NULL);
+
+	v = dbtree_find_all_clients_and_cache_msg(
+	    t, "a/b", NULL, &size, 0, NULL);
+	assert(cvector_size(v) == 1);
+	cvector_free(v);
+	dbtree_delete_clients(t, topics + 6, 1, 9, NULL);
+	assert(cvector_empty(t->root->child));
+	dbtree_destory(t);
+}
+
+// Granted qos is matched along with clients, from the tree and the cache.
+static void
+test_granted_qos()
+{
+	size_t   size = 0;
+	void **  v    = NULL;
+	uint8_t *qos  = NULL;
+	dbtree * t    = NULL;
+	char *   topics[] = { "a/+", "a/b" };
+	uint8_t  grant[]  = { 1, 2 };
+
+	dbtree_create(&t);
+	dbtree_match_cache_init(t, 4);
+	dbtree_insert_clients(t, topics, grant, 2, "1", 1, NULL);
+	dbtree_insert_client(t, "a/#", "2", 2, 0);
+	dbtree_insert_client(t, "$share/g/a/b", "3", 3, 1);
+
+	for (int i = 0; i < 2; i++) {
+		v = dbtree_find_all_clients_and_cache_msg(
+		    t, "a/b", NULL, &size, 0, &qos);
+		assert(cvector_size(v) == 3 && cvector_size(qos) == 3);
+		for (int j = 0; j < 3; j++) {
+			uint8_t want = ((char *) v[j])[0] == '1' ? 2
+			    : ((char *) v[j])[0] == '3'          ? 1
+			                                         : 0;
+			assert(qos[j] == want);
+		}
+		cvector_free(v);
+		cvector_free(qos);
+	}
+
+	// subscribe again replaces the grant
+	dbtree_insert_client(t, "a/b", "1", 1, 0);
+	v = dbtree_find_all_clients_and_cache_msg(
+	    t, "a/b", NULL, &size, 0, &qos);
+	assert(v[0] == (void *) "1" || v[1] == (void *) "1");
+	assert(qos[v[0] == (void *) "1" ? 0 : 1] == 1);
+	cvector_free(v);
+	cvector_free(qos);
+
+	dbtree_delete_client(t, "a/+", 0, 1);
+	dbtree_delete_client(t, "a/b", 0, 1);
+	dbtree_delete_client(t, "a/#", 0, 2);
+	dbtree_delete_client(t, "$share/g/a/b", 0, 3);
+	assert(cvector_empty(t->root->child));
+	dbtree_destory(t);
+}
+
+static int test_session_freed = 0;
+
+static void
+test_session_free(void *msg)
+{
+	test_session_freed++;
+}
+
+// Offline session queue is bounded, overflow follows its policy.
+static void
+test_session_queue()
+{
+	size_t  size    = 0;
+	void ** v       = NULL;
+	dbtree *t       = NULL;
+	char *  msgs[6] = { "0", "1", "2", "3", "4", "5" };
+
+	dbtree_create(&t);
+	dbtree_set_session_queue(t, 4, SESSION_DROP_OLDEST, test_session_free);
+	dbtree_insert_client(t, "a/b", client0.ctxt, 1, 0);
+	dbtree_insert_client(t, "a/#", client0.ctxt, 1, 0);
+	dbtree_cache_session(t, "a/b", 100, 1);
+	dbtree_cache_session(t, "a/#", 100, 1);
+
+	for (int i = 0; i < 6; i++) {
+		v = dbtree_find_clients_and_cache_msg(t, "a/b", msgs[i], &size);
+		assert(v == NULL && size == 1);
+	}
+
+	dbtree_session_queue_stats st;
+	dbtree_get_session_queue_stats(t, &st);
+	assert(st.sessions == 1 && st.dropped == 2 && test_session_freed == 2);
+
+	v = dbtree_restore_session_msg(t, 100);
+	assert(cvector_size(v) == 4 && v[0] == msgs[2] && v[3] == msgs[5]);
+	cvector_free(v);
+	assert(dbtree_restore_session_msg(t, 100) == NULL);
+
+	dbtree_set_session_queue(t, 2, SESSION_REJECT, test_session_free);
+	for (int i = 0; i < 3; i++) {
+		dbtree_find_clients_and_cache_msg(t, "a/b", msgs[i], &size);
+		assert(size == (i < 2 ? 1 : 0));
+	}
+	dbtree_get_session_queue_stats(t, &st);
+	assert(st.rejected == 1 && test_session_freed == 2);
+
+	v = dbtree_restore_session_msg(t, 100);
+	assert(cvector_size(v) == 2 && v[1] == msgs[1]);
+	cvector_free(v);
+
+	dbtree_delete_session(t, "a/b", 100, 1);
+	dbtree_delete_session(t, "a/#", 100, 1);
+	dbtree_destory(t);
+}
+
+static size_t
+test_reap_size(void *msg)
+{
+	return strlen(msg);
+}
+
+static uint64_t
+test_reap_time(void *msg)
+{
+	return strtoull(msg, NULL, 10);
+}
+
+// The reaper expires old messages, then evicts while above the mem limit.
+static void
+test_session_reap()
+{
+	size_t  size     = 0;
+	dbtree *t        = NULL;
+	char *  topics[] = { "a/b", "$share/g/c" };
+	char    ctxt[]   = "ctxt";
+	void *  ctxts[2] = { NULL, NULL };
+	char *  msgs[5]  = { "1", "2", "30", "40", "50" };
+	int     freed    = test_session_freed;
+
+	dbtree_session_reap reap = {
+		.mem_limit = 4,
+		.max_age   = 10,
+		.msg_size  = test_reap_size,
+		.msg_time  = test_reap_time,
+	};
+	dbtree_session_queue_stats st;
+
+	dbtree_create(&t);
+	dbtree_set_session_queue(t, 0, SESSION_DROP_OLDEST, test_session_free);
+	dbtree_set_session_reap(t, &reap);
+	dbtree_insert_clients(t, topics, NULL, 2, ctxt, 1, NULL);
+	dbtree_cache_sessions(t, topics, 2, 100, 1);
+	for (int i = 0; i < 4; i++) {
+		dbtree_find_clients_and_cache_msg(t, "a/b", msgs[i], &size);
+	}
+	dbtree_get_session_queue_stats(t, &st);
+	assert(st.memory == 6);
+
+	assert(dbtree_reap_session_msg(t, 15, 64) == 2);
+	dbtree_get_session_queue_stats(t, &st);
+	assert(st.expired == 2 && st.memory == 4);
+	assert(test_session_freed == freed + 2);
+
+	dbtree_find_clients_and_cache_msg(t, "a/b", msgs[4], &size);
+	assert(dbtree_reap_session_msg(t, 20, 64) == 1);
+	dbtree_get_session_queue_stats(t, &st);
+	assert(st.dropped == 1 && st.memory == 4 && st.sessions == 1);
+
+	assert(dbtree_reap_session_msg(t, 100, 64) == 2);
+	dbtree_get_session_queue_stats(t, &st);
+	assert(st.memory == 0 && st.sessions == 0);
+	assert(dbtree_restore_session_msg(t, 100) == NULL);
+
+	dbtree_delete_sessions(t, topics, 2, 100, ctxts);
+	assert(ctxts[0] == ctxt && ctxts[1] == ctxt);
+	assert(cvector_empty(t->root->child));
+	dbtree_destory(t);
+}
+
+static uint64_t
+test_reap_expire(void *msg)
+{
+	char *at = strchr(msg, ':');
+
+	return at ? strtoull(at + 1, NULL, 10) : 0;
+}
+
+// Messages past their own deadline leave from anywhere in the queue.
+static void
+test_session_expire()
+{
+	size_t  size     = 0;
+	void ** v        = NULL;
+	dbtree *t        = NULL;
+	char *  topics[] = { "a/b" };
+	char    ctxt[]   = "ctxt";
+	void *  ctxts[1] = { NULL };
+	char *  msgs[5]  = { "a", "b:5", "c", "d:30", "e:8" };
+	int     keep[3]  = { 0, 2, 3 };
+
+	dbtree_session_reap reap = {
+		.msg_size   = test_reap_size,
+		.msg_expire = test_reap_expire,
+	};
+	dbtree_session_queue_stats st;
+
+	dbtree_create(&t);
+	// grows from 8 entries with its deadlines
+	dbtree_set_session_queue(t, 0, SESSION_DROP_OLDEST, NULL);
+	dbtree_set_session_reap(t, &reap);
+	dbtree_insert_clients(t, topics, NULL, 1, ctxt, 1, NULL);
+	dbtree_cache_sessions(t, topics, 1, 100, 1);
+	for (int i = 0; i < 20; i++) {
+		dbtree_find_clients_and_cache_msg(t, "a/b", msgs[i % 5], &size);
+	}
+
+	assert(dbtree_reap_session_msg(t, 4, 64) == 0);
+	assert(dbtree_reap_session_msg(t, 10, 64) == 8);
+	dbtree_get_session_queue_stats(t, &st);
+	assert(st.expired == 8);
+
+	v = dbtree_restore_session_msg(t, 100);
+	// the others keep their order
+	assert(cvector_size(v) == 12);
+	for (int i = 0; i < 12; i++) {
+		assert(v[i] == msgs[keep[i % 3]]);
+	}
+	cvector_free(v);
+
+	dbtree_delete_sessions(t, topics, 1, 100, ctxts);
+	assert(cvector_empty(t->root->child));
+	dbtree_destory(t);
+}
+
+// A client goes offline and comes back on all of its topics at once, the
+// messages queued meanwhile are handed back with the restore.
+static void
+test_session_batch()
+{
+	size_t  size     = 0;
+	void ** v        = NULL;
+	dbtree *t        = NULL;
+	char *  topics[] = { "a/b", "a/#", "$share/g/a/b", "x" };
+	char    ctxt[]   = "ctxt";
+
+	dbtree_create(&t);
+	dbtree_insert_clients(t, topics, NULL, 4, ctxt, 1, NULL);
+	dbtree_cache_sessions(t, topics, 4, 100, 1);
+
+	v = dbtree_find_clients_and_cache_msg(t, "a/b", "m", &size);
+	assert(v == NULL && size == 1);
+
+	v = NULL;
+	assert(dbtree_restore_sessions(t, topics, 4, 100, 2, &v) == ctxt);
+	assert(cvector_size(v) == 1 && !strcmp(v[0], "m"));
+	cvector_free(v);
+
+	size = 0;
+	v    = dbtree_find_clients_and_cache_msg(t, "a/b", NULL, &size);
+	assert(cvector_size(v) == 1 && size == 0);
+	cvector_free(v);
+
+	dbtree_delete_clients(t, topics, 4, 2, NULL);
+	assert(cvector_empty(t->root->child));
+	dbtree_destory(t);
+}
+
+static int
+test_foreach_count(const dbtree_subscription *sub, void *arg)
+{
+	size_t *cnt = (size_t *) arg;
+
+	if (sub->pipe_id) {
+		assert(!strcmp(sub->topic, "a/b") && sub->session_id == 0);
+	} else if (!strcmp(sub->topic, "$share/g/a/+")) {
+		assert(sub->session_id == 200 && sub->qos == 2);
+	}
+	(*cnt)++;
+	return 0;
+}
+
+// Sessions loaded at once are found by the walk and taken back by a
+// restore like sessions cached on disconnect.
+static void
+test_insert_sessions()
+{
+	size_t              cnt      = 0;
+	dbtree *            t        = NULL;
+	char                ctxt[]   = "ctxt";
+	char *              topics[] = { "a/b", "/x" };
+	dbtree_subscription subs[]   = {
+		{ "a/b", 100, 0, ctxt, 1 },
+		{ "/x", 100, 0, ctxt, 0 },
+		{ "$share/g/a/+", 200, 0, ctxt, 2 },
+		{ "a/b", 100, 0, ctxt, 1 },
+	};
+
+	dbtree_create(&t);
+	dbtree_insert_sessions(t, subs, 4);
+	dbtree_insert_client(t, "a/b", "c", 1, 0);
+	assert(dbtree_foreach_subscription(t, test_foreach_count, &cnt) == 0);
+	assert(cnt == 4);
+
+	assert(dbtree_restore_sessions(t, topics, 2, 100, 2, NULL) == ctxt);
+	dbtree_delete_clients(t, topics, 2, 2, NULL);
+	dbtree_delete_client(t, "a/b", 0, 1);
+	dbtree_delete_session(t, "$share/g/a/+", 200, 0);
+	assert(cvector_empty(t->root->child));
+	dbtree_destory(t);
+}
+
+// A snapshot holds the tree as it was when taken, is shared while the
+// tree does not change and outlives a change.
+static void
+test_snapshot()
+{
+	dbtree *                   t     = NULL;
+	dbtree_subscription        sub[] = { { "a/+", 300, 0, "s", 1 } };
+	dbtree_snapshot *          s1;
+	dbtree_snapshot *          s2;
+	const dbtree_subscription *e;
+
+	dbtree_create(&t);
+	dbtree_insert_client(t, "a/b", "c", 1, 0);
+	dbtree_insert_client(t, "a/b", "c", 2, 1);
+	dbtree_insert_client(t, "$share/g/a/b", "c", 3, 2);
+	dbtree_insert_sessions(t, sub, 1);
+
+	s1 = dbtree_snapshot_take(t);
+	assert(dbtree_snapshot_count(s1) == 4);
+	assert(dbtree_snapshot_get(s1, 4) == NULL);
+	for (size_t i = 0; i < 4; i++) {
+		e = dbtree_snapshot_get(s1, i);
+		assert(e->ctxt == NULL);
+		if (e->pipe_id == 0) {
+			assert(!strcmp(e->topic, "a/+"));
+			assert(e->session_id == 300);
+		} else if (e->pipe_id == 3) {
+			assert(!strcmp(e->topic, "$share/g/a/b"));
+			assert(e->qos == 2);
+		} else {
+			assert(!strcmp(e->topic, "a/b"));
+		}
+	}
+	s2 = dbtree_snapshot_take(t);
+	assert(s2 == s1);
+	dbtree_snapshot_release(s2);
+
+	dbtree_delete_client(t, "a/b", 0, 1);
+	s2 = dbtree_snapshot_take(t);
+	assert(s2 != s1 && dbtree_snapshot_count(s2) == 3);
+	assert(dbtree_snapshot_gen(s2) > dbtree_snapshot_gen(s1));
+	for (size_t i = 0, n = 0; i < 4; i++) {
+		e = dbtree_snapshot_get(s1, i);
+		n += e->pipe_id == 1 && !strcmp(e->topic, "a/b");
+		assert(i < 3 || n == 1);
+	}
+	dbtree_snapshot_release(s1);
+	dbtree_snapshot_release(s2);
+	dbtree_destory(t);
+}
+
+// Big allocations take the slow path once, then the arena has grown.
+static void
+test_arena()
+{
+	nano_arena a;
+	char *     p, *q;
+
+	nano_arena_init(&a, 64);
+	p = nano_arena_strndup(&a, "zhang/bei/hai/xyz", 13);
+	q = nano_arena_zalloc(&a, 20);
+	assert(strcmp(p, "zhang/bei/hai") == 0 && q[19] == 0);
+	assert(((uintptr_t) q & (NANO_ARENA_ALIGN - 1)) == 0);
+	assert(q >= (char *) a.buf && q < (char *) a.buf + a.size);
+
+	p = nano_arena_alloc(&a, 200);
+	assert(p && (p < (char *) a.buf || p >= (char *) a.buf + a.size));
+	memset(p, 1, 200);
+	nano_arena_reset(&a);
+	assert(a.size >= 240 && a.used == 0 && a.blocks == NULL);
+
+	p = nano_arena_alloc(&a, 200);
+	assert(p == (char *) a.buf);
+	nano_arena_reset(&a);
+	nano_arena_fini(&a);
+}
+
+// A vector on borrowed storage moves to the heap only once it outgrows it.
+static void
+test_cvector_buf()
+{
+	nano_arena a;
+	cvector(int) v = NULL;
+	cvector_buf(int, buf, 4);
+
+	cvector_init_buf(v, buf, sizeof(buf));
+	assert(cvector_empty(v) && cvector_capacity(v) == 4);
+	for (int i = 0; i < 4; i++) {
+		cvector_push_back(v, i);
+	}
+	assert(cvector_borrowed(v) && (void *) v == (void *) &buf[2]);
+	cvector_push_back(v, 4);
+	assert(!cvector_borrowed(v) && cvector_capacity(v) == 8);
+	for (int i = 0; i < 5; i++) {
+		assert(v[i] == i);
+	}
+	cvector_free(v);
+
+	nano_arena_init(&a, 256);
+	cvector_init_arena(v, &a, 16);
+	for (int i = 0; i < 16; i++) {
+		cvector_push_back(v, i);
+	}
+	assert(cvector_borrowed(v) && cvector_size(v) == 16);
+	cvector_clear(v);
+	assert(cvector_empty(v) && cvector_capacity(v) == 16);
+	cvector_free(v);
+	nano_arena_fini(&a);
+}
+
+static void
+test_lz()
+{
+	uint8_t in[4096], out[4096], dec[4096];
+	size_t  n;
+
+	for (size_t i = 0; i < sizeof(in); i++) {
+		in[i] = i % 64 < 48 ? 'a' + i % 7 : (uint8_t) (i * 31);
+	}
+	n = nano_lz_compress(in, sizeof(in), out, sizeof(out));
+	assert(n > 0 && n < sizeof(in) / 2);
+	assert(nano_lz_decompress(out, n, dec, sizeof(dec)) == sizeof(in));
+	assert(memcmp(in, dec, sizeof(in)) == 0);
+	assert(nano_lz_decompress(out, n, dec, sizeof(dec) - 1) == 0);
+	assert(nano_lz_compress(in, sizeof(in), out, 16) == 0);
+}
+
+static void
+test_envelope()
+{
+	nano_envelope        e;
+	nano_envelope_reader r;
+	char                 topic[32], payload[64];
+	const char *         t;
+	const uint8_t *      p;
+	uint16_t             tlen;
+	uint32_t             plen;
+	uint8_t              flags;
+	uint8_t *            wire;
+	size_t               len;
+	int                  i;
+
+	nano_envelope_init(&e);
+	for (i = 0; i < 100; i++) {
+		flags = (i % 3) << 1 | (i == 7 ? NANO_ENVELOPE_RETAIN : 0);
+		snprintf(topic, sizeof(topic), "site/1/sensor/%d", i % 4);
+		snprintf(payload, sizeof(payload),
+		    "{\"temperature\":%d,\"humidity\":40}", 20 + i % 3);
+		assert(nano_envelope_add(&e, topic, strlen(topic),
+		           (uint8_t *) payload, strlen(payload), flags) == 0);
+	}
+	assert(e.count == 100 && e.qos == 2);
+
+	// repetitive JSON shrinks several fold
+	wire = nano_envelope_pack(&e, true, &len);
+	assert(wire != NULL && nano_envelope_is(wire, len));
+	assert(wire[3] == NANO_ENVELOPE_LZ && len < e.len / 3);
+	assert(nano_envelope_open(&r, wire, len) == 0);
+	for (i = 0; nano_envelope_next(&r, &t, &tlen, &p, &plen, &flags);
+	     i++) {
+		snprintf(topic, sizeof(topic), "site/1/sensor/%d", i % 4);
+		snprintf(payload, sizeof(payload),
+		    "{\"temperature\":%d,\"humidity\":40}", 20 + i % 3);
+		assert(tlen == strlen(topic) && memcmp(t, topic, tlen) == 0);
+		assert(plen == strlen(payload) &&
+		    memcmp(p, payload, plen) == 0);
+		assert((flags >> 1) == i % 3);
+		assert(((flags & NANO_ENVELOPE_RETAIN) != 0) == (i == 7));
+	}
+	assert(i == 100);
+	nano_envelope_close(&r);
+
+	// broken ones are refused, not read past their end
+	wire[len - 1] ^= 0xff;
+	if (nano_envelope_open(&r, wire, len) == 0) {
+		while (nano_envelope_next(&r, &t, &tlen, &p, &plen, &flags)) {
+			assert(p + plen <= r.end);
+		}
+		nano_envelope_close(&r);
+	}
+	assert(nano_envelope_open(&r, wire, NANO_ENVELOPE_HEADER - 1) == -1);
+	zfree(wire);
+
+	// stored as it is if it does not shrink, or not asked to
+	nano_envelope_reset(&e);
+	assert(nano_envelope_add(&e, "a", 1, (uint8_t *) "b", 1, 0) == 0);
+	wire = nano_envelope_pack(&e, false, &len);
+	assert(wire[3] == 0 && len == NANO_ENVELOPE_HEADER + e.len);
+	assert(nano_envelope_open(&r, wire, len - 1) == -1);
+	assert(nano_envelope_open(&r, wire, len) == 0);
+	assert(nano_envelope_next(&r, &t, &tlen, &p, &plen, &flags));
+	assert(tlen == 1 && *t == 'a' && plen == 1 && *p == 'b');
+	assert(!nano_envelope_next(&r, &t, &tlen, &p, &plen, &flags));
+	nano_envelope_close(&r);
+	zfree(wire);
+	nano_envelope_fini(&e);
+}
+
+// A producer process fills a ring the consumer drains as it goes, the
+// records wrap around the end of the ring many times over.
+static void
+test_shm()
+{
+	char           dir[] = "/tmp/nanolib_shm_XXXXXX";
+	char           path[64], topic[32];
+	nano_shm       c, p;
+	const char *   t;
+	const uint8_t *pl;
+	uint16_t       tlen;
+	uint32_t       plen, seq;
+	uint8_t        flags;
+	pid_t          pid;
+	int            i, status;
+
+	assert(mkdtemp(dir) != NULL);
+	nano_shm_path(path, sizeof(path), dir, 0);
+	assert(nano_shm_create(&c, path, 5000) == 0);
+	assert(c.mask + 1 == 8192);
+
+	// the only ring is the producer's until it closes it
+	assert(nano_shm_producer_open(&p, dir) == 0);
+	assert(nano_shm_publish(&p, "", 0, NULL, 0, 0) == -1);
+	assert(nano_shm_publish(&p, "t", 1, NULL, 5000, 0) == -1);
+	assert(nano_shm_publish(&p, "a/b", 3, (uint8_t *) "x", 1,
+	           NANO_SHM_RETAIN | 1 << 1) == 0);
+	assert(nano_shm_next(&c, &t, &tlen, &pl, &plen, &flags));
+	assert(tlen == 3 && memcmp(t, "a/b", 3) == 0 && plen == 1);
+	assert(flags == (NANO_SHM_RETAIN | 1 << 1));
+	assert(!nano_shm_next(&c, &t, &tlen, &pl, &plen, &flags));
+	nano_shm_release(&c);
+	nano_shm_producer_close(&p);
+
+	if ((pid = fork()) == 0) {
+		if (nano_shm_producer_open(&p, dir) != 0) {
+			_exit(1);
+		}
+		for (seq = 0; seq < 20000;) {
+			snprintf(topic, sizeof(topic), "sensor/%u", seq % 7);
+			i = nano_shm_publish(&p, topic, strlen(topic),
+			    (uint8_t *) &seq, sizeof(seq), 0);
+			if (i == 0) {
+				seq++;
+			} else {
+				sched_yield();
+			}
+		}
+		// left claimed, a ring of a dead producer is free
+		nano_shm_detach(&p);
+		_exit(0);
+	}
+	assert(pid > 0);
+	for (seq = 0; seq < 20000;) {
+		if (!nano_shm_next(&c, &t, &tlen, &pl, &plen, &flags)) {
+			nano_shm_release(&c);
+			sched_yield();
+			continue;
+		}
+		snprintf(topic, sizeof(topic), "sensor/%u", seq % 7);
+		assert(tlen == strlen(topic) && memcmp(t, topic, tlen) == 0);
+		assert(plen == sizeof(seq) && memcmp(pl, &seq, plen) == 0);
+		seq++;
+	}
+	nano_shm_release(&c);
+	assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+	    WEXITSTATUS(status) == 0);
+	assert(c.hdr->owner == pid);
+	assert(nano_shm_producer_open(&p, dir) == 0);
+	nano_shm_producer_close(&p);
+
+	// taken over as it is by a broker started again
+	nano_shm_detach(&c);
+	assert(nano_shm_create(&c, path, 8192) == 0);
+	assert(c.next > 0 && c.next == c.hdr->tail);
+	nano_shm_detach(&c);
+	unlink(path);
+	rmdir(dir);
+}
+
+// Records come back as written, with their times, and none past max
+static void
+test_capture()
+{
+	char                path[] = "/tmp/nanolib_capture_XXXXXX";
+	nano_capture        c;
+	nano_capture_reader r;
+	nano_capture_record rec;
+	uint8_t             header[2] = { 0x30, 0 };
+	char                body[64];
+	uint8_t             big[4096] = { 0 };
+	int                 i;
+
+	close(mkstemp(path));
+	assert(nano_capture_open(&c, path, 4096) == 0);
+	for (i = 0; i < 1000; i++) {
+		snprintf(body, sizeof(body), "%cpacket %d", 0, i);
+		header[1] = strlen(body + 1) + 1;
+		if (nano_capture_write(&c, 5000 + i * 250, 70000 + i % 3,
+		        i % 5, i % 2 ? 5 : 4, header, sizeof(header),
+		        (uint8_t *) body, header[1]) != 0) {
+			break;
+		}
+	}
+	// the ones after the first too large are dropped
+	assert(i > 100 && i < 1000 && c.records == (uint64_t) i);
+	assert(nano_capture_write(
+	           &c, 0, 1, 0, 0, header, 2, big, sizeof(big)) == 1);
+	assert(c.dropped == 2 && c.bytes <= 4096);
+	nano_capture_close(&c);
+
+	assert(nano_capture_reader_open(&r, path) == 0);
+	for (i = 0; nano_capture_next(&r, &rec); i++) {
+		snprintf(body, sizeof(body), "%cpacket %d", 0, i);
+		assert(rec.time_us == (uint64_t) i * 250);
+		assert(rec.pipe == 70000u + i % 3 && rec.kind == i % 5);
+		assert(rec.proto == (i % 2 ? 5 : 4));
+		assert(rec.header_len == 2 && rec.header[0] == 0x30);
+		assert(rec.body_len == rec.header[1] &&
+		    memcmp(rec.body, body, rec.body_len) == 0);
+	}
+	assert(i > 100 && i < 1000);
+	nano_capture_reader_close(&r);
+
+	// not a capture file
+	assert(nano_capture_open(&c, path, 0) == 0);
+	nano_capture_close(&c);
+	assert(truncate(path, 4) == 0);
+	assert(nano_capture_reader_open(&r, path) == -1);
+	unlink(path);
+}
+
+static int
+topic_scan(const char *topic, int flags)
+{
+	int cnt;
+	return nano_topic_scan(topic, strlen(topic), flags, NULL, 0, &cnt);
+}
+
+static void
+test_topic_scan()
+{
+	const char *     t = "sensors/building-one/floor-2/temp/\xe6\xb8\xa9";
+	nano_topic_level lv[3];
+	int              cnt;
+
+	assert(nano_topic_scan(t, strlen(t), 0, lv, 3, &cnt) == NANO_TOPIC_OK);
+	assert(cnt == 5 && lv[1].off == 8 && lv[1].len == 12);
+	assert(lv[2].hash == nano_topic_hash(t + lv[2].off, lv[2].len));
+	assert(nano_topic_scan("a\0b", 3, 0, lv, 3, &cnt) == NANO_TOPIC_UTF8);
+	assert(nano_topic_scan("", 0, 0, lv, 3, &cnt) == NANO_TOPIC_EMPTY);
+	assert(cnt == 1 && lv[0].len == 0);
+
+	assert(topic_scan("a/\xc3\xbc/\xf0\x9f\x98\x80", 0) == NANO_TOPIC_OK);
+	assert(topic_scan("a/\xc0\x80", 0) == NANO_TOPIC_UTF8);
+	assert(topic_scan("a/\xed\xa0\x80", 0) == NANO_TOPIC_UTF8);
+	assert(topic_scan("a/\xf4\x90\x80\x80", 0) == NANO_TOPIC_UTF8);
+	assert(topic_scan("a/\xe6\xb8", 0) == NANO_TOPIC_UTF8);
+	assert(topic_scan("a/+", 0) == NANO_TOPIC_WILDCARD);
+	assert(topic_scan("0123456789abcdef0123#", 0) == NANO_TOPIC_WILDCARD);
+
+	assert(topic_scan("+/a/+/#", NANO_TOPIC_FILTER) == NANO_TOPIC_OK);
+	assert(topic_scan("#", NANO_TOPIC_FILTER) == NANO_TOPIC_OK);
+	assert(topic_scan("a/#/b", NANO_TOPIC_FILTER) == NANO_TOPIC_WILDCARD);
+	assert(topic_scan("a/b#", NANO_TOPIC_FILTER) == NANO_TOPIC_WILDCARD);
+	assert(topic_scan("a/+b", NANO_TOPIC_FILTER) == NANO_TOPIC_WILDCARD);
+}
+
+typedef struct {
+	nano_timer t;
+	uint64_t   when;
+	uint64_t * now;
+	int        fired;
+} test_timer;
+
+static void
+test_timer_cb(nano_timer *t, void *arg)
+{
+	test_timer *tt = arg;
+
+	// due, and not later than the tick it was due on
+	assert(*tt->now >= tt->when && *tt->now < tt->when + 10 + 37);
+	tt->fired++;
+}
+
+// Timers fire once on the advance passing them, far ones after moving
+// down the levels, deleted ones never.
+static void
+test_timer_wheel()
+{
+	static test_timer timers[2000];
+	nano_timer_wheel *w   = nano_timer_wheel_create(1000, 10);
+	uint64_t          now = 1000;
+
+	for (int i = 0; i < 2000; i++) {
+		timers[i].when  = 1000 + ((uint64_t) i * 7919) % 3000000;
+		timers[i].now   = &now;
+		timers[i].fired = 0;
+		nano_timer_init(&timers[i].t, test_timer_cb, &timers[i]);
+		nano_timer_add(w, &timers[i].t, timers[i].when);
+	}
+	// past the reach of the top level
+	timers[0].when = 1000 + 200000000;
+	nano_timer_add(w, &timers[0].t, timers[0].when);
+	for (int i = 1; i < 2000; i += 3) {
+		nano_timer_del(w, &timers[i].t);
+	}
+	assert(nano_timer_count(w) == 2000 - 667);
+
+	while (nano_timer_count(w) > 1) {
+		now += 37;
+		nano_timer_advance(w, now);
+	}
+	for (int i = 1; i < 2000; i++) {
+		assert(timers[i].fired == (i % 3 == 1 ? 0 : 1));
+	}
+	assert(timers[0].fired == 0 && nano_timer_pending(&timers[0].t));
+	now = timers[0].when;
+	nano_timer_advance(w, now);
+	assert(timers[0].fired == 1 && nano_timer_count(w) == 0);
+	nano_timer_wheel_destroy(w);
+}
+
+#define TEST_RING_ITEMS 100000
+#define TEST_RING_PRODUCERS 4
+
+// A ring is full at its capacity, batches are cut to the room there is.
+static void
+test_ring()
+{
+	nano_spsc s;
+	nano_mpsc m;
+	void *    items[8];
+	void *    got[8];
+
+	for (uintptr_t i = 0; i < 8; i++) {
+		items[i] = (void *) (i + 1);
+	}
+	nano_spsc_init(&s, 5);
+	assert(nano_spsc_cap(&s) == 8 && !nano_spsc_wait(&s, 0));
+	assert(nano_spsc_put_n(&s, items, 6) == 6);
+	assert(nano_spsc_put_n(&s, items, 6) == 2 && !nano_spsc_put(&s, items));
+	assert(nano_spsc_len(&s) == 8 && nano_spsc_wait(&s, 10));
+	assert(nano_spsc_get_n(&s, got, 7) == 7 && got[6] == items[0]);
+	assert(nano_spsc_get(&s, &got[0]) && got[0] == items[1]);
+	assert(!nano_spsc_get(&s, &got[0]) && !nano_spsc_wait(&s, 10));
+	nano_spsc_fini(&s);
+
+	nano_mpsc_init(&m, 4);
+	assert(nano_mpsc_put_n(&m, items, 3) == 3);
+	assert(nano_mpsc_put_n(&m, items + 3, 3) == 1);
+	assert(nano_mpsc_len(&m) == 4 && !nano_mpsc_put(&m, items));
+	assert(nano_mpsc_get_n(&m, got, 8) == 4 && got[3] == items[3]);
+	assert(nano_mpsc_put_n(&m, items, 8) == 4);
+	assert(nano_mpsc_get(&m, &got[0]) && got[0] == items[0]);
+	assert(nano_mpsc_get_n(&m, got, 8) == 3 && nano_mpsc_len(&m) == 0);
+	assert(!nano_mpsc_wait(&m, 10));
+	nano_mpsc_fini(&m);
+}
+
+static void *
+test_ring_spsc_put(void *arg)
+{
+	nano_spsc *q = arg;
+	void *     batch[16];
+	size_t     k;
+
+	for (uintptr_t i = 1; i <= TEST_RING_ITEMS;) {
+		size_t n = 0;
+
+		while (n < 16 && i + n <= TEST_RING_ITEMS) {
+			batch[n] = (void *) (i + n);
+			n++;
+		}
+		if ((k = nano_spsc_put_n(q, batch, n)) == 0) {
+			sched_yield(); // full, the consumer may share the cpu
+		}
+		i += k;
+	}
+	return NULL;
+}
+
+typedef struct {
+	nano_mpsc *q;
+	uintptr_t  id;
+} test_ring_producer;
+
+// items of producer id are id << 24 | 1, 2 .. in batches of 1 to 4
+static void *
+test_ring_mpsc_put(void *arg)
+{
+	test_ring_producer *p = arg;
+	void *              batch[4];
+	size_t              k;
+
+	for (uintptr_t i = 1; i <= TEST_RING_ITEMS;) {
+		size_t n = 0;
+
+		while (n < (i & 3) + 1 && i + n <= TEST_RING_ITEMS) {
+			batch[n] = (void *) (p->id << 24 | (i + n));
+			n++;
+		}
+		if ((k = nano_mpsc_put_n(p->q, batch, n)) == 0) {
+			sched_yield();
+		}
+		i += k;
+	}
+	return NULL;
+}
+
+// Items cross in the order each producer put them, none lost, while the
+// consumer keeps blocking on an empty ring.
+static void
+test_ring_threads()
+{
+	nano_spsc          s;
+	nano_mpsc          m;
+	pthread_t          thr[TEST_RING_PRODUCERS];
+	test_ring_producer prod[TEST_RING_PRODUCERS];
+	uintptr_t          next[TEST_RING_PRODUCERS];
+	void *             got[32];
+	size_t             total = 0;
+	uintptr_t          want  = 1;
+
+	nano_spsc_init(&s, 64);
+	pthread_create(&thr[0], NULL, test_ring_spsc_put, &s);
+	while (want <= TEST_RING_ITEMS) {
+		size_t n = nano_spsc_get_n(&s, got, 32);
+
+		for (size_t i = 0; i < n; i++) {
+			assert((uintptr_t) got[i] == want++);
+		}
+		if (n == 0) {
+			nano_spsc_wait(&s, 100);
+		}
+	}
+	pthread_join(thr[0], NULL);
+	assert(nano_spsc_len(&s) == 0);
+	nano_spsc_fini(&s);
+
+	nano_mpsc_init(&m, 64);
+	for (uintptr_t i = 0; i < TEST_RING_PRODUCERS; i++) {
+		prod[i].q  = &m;
+		prod[i].id = i;
+		next[i]    = 1;
+		pthread_create(&thr[i], NULL, test_ring_mpsc_put, &prod[i]);
+	}
+	while (total < TEST_RING_PRODUCERS * TEST_RING_ITEMS) {
+		size_t n = nano_mpsc_get_n(&m, got, 32);
+
+		for (size_t i = 0; i < n; i++) {
+			uintptr_t v  = (uintptr_t) got[i];
+			uintptr_t id = v >> 24;
+
+			assert(id < TEST_RING_PRODUCERS);
+			assert((v & 0xffffff) == next[id]++);
+		}
+		total += n;
+		if (n == 0) {
+			nano_mpsc_wait(&m, 100);
+		}
+	}
+	for (int i = 0; i < TEST_RING_PRODUCERS; i++) {
+		pthread_join(thr[i], NULL);
+	}
+	assert(nano_mpsc_len(&m) == 0 && !nano_mpsc_get(&m, &got[0]));
+	nano_mpsc_fini(&m);
+}
+
+static void
+test_retain_count(const nano_retain_msg *msg, void *arg)
+{
+	int *n = arg;
+
+	assert(msg->payload_len == 0 || msg->payload[0] == 'v');
+	(*n)++;
+}
+
+typedef struct {
+	nano_retain *r;
+	int          n;
+} test_retain_del_arg;
+
+// the store is unlocked while a cursor hands out
+static void
+test_retain_del(const nano_retain_msg *msg, void *arg)
+{
+	test_retain_del_arg *d = arg;
+	char                 topic[32];
+
+	snprintf(topic, sizeof(topic), "%.*s", (int) msg->topic_len,
+	    msg->topic);
+	assert(nano_retain_del(d->r, topic));
+	assert(msg->payload[0] == 'v');
+	d->n++;
+}
+
+// Group walks and table walks match as the filters tell, in small steps.
+static void
+test_retain_cursor()
+{
+	nano_retain_opt opt = { 0, NANO_RETAIN_EVICT_LRU, 0 };
+	nano_retain *   r   = nano_retain_create(&opt);
+	char *topics[]  = { "a", "a/b", "a/c", "a/b/c", "b/b", "c" };
+	char *filters[] = { "#", "a/#", "a/+", "+/b", "a/b", "d" };
+	int   counts[]  = { 6, 4, 2, 2, 1, 0 };
+	nano_retain_cursor *cur;
+	nano_retain_msg     m = { 0 };
+	int                 n;
+
+	m.payload     = (const uint8_t *) "v";
+	m.payload_len = 1;
+	for (int i = 0; i < 6; i++) {
+		m.topic     = topics[i];
+		m.topic_len = strlen(topics[i]);
+		assert(nano_retain_set(r, &m) == 1);
+	}
+	for (int i = 0; i < 6; i++) {
+		n   = 0;
+		cur = nano_retain_cursor_new(r, filters[i]);
+		while (!nano_retain_cursor_done(cur)) {
+			assert(nano_retain_cursor_next(
+			           cur, 3, 0, test_retain_count, &n) <= 3);
+		}
+		nano_retain_cursor_free(cur);
+		assert(n == counts[i]);
+	}
+	nano_retain_destroy(r);
+}
+
+// Wildcard walks see every message once while the table grows under them.
+static void
+test_retain_store()
+{
+	nano_retain_opt     opt = { 0, NANO_RETAIN_EVICT_LRU, 64 };
+	nano_retain *       r   = nano_retain_create(&opt);
+	nano_retain_cursor *cur;
+	nano_retain_stats   st;
+	nano_retain_msg     m = { 0 };
+	test_retain_del_arg d = { 0 };
+	char                topic[32], payload[1024];
+	int                 n = 0;
+
+	memset(payload, 'v', sizeof(payload));
+	m.payload     = (uint8_t *) payload;
+	m.payload_len = 16;
+	for (int i = 0; i < 100; i++) {
+		m.topic_len = sprintf(topic, "dev/%d/state", i);
+		m.topic     = topic;
+		assert(nano_retain_set(r, &m) == 1);
+	}
+	m.topic_len = sprintf(topic, "$SYS/x");
+	nano_retain_set(r, &m);
+
+	cur = nano_retain_cursor_new(r, "dev/+/state");
+	nano_retain_cursor_next(cur, 10, 0, test_retain_count, &n);
+	for (int i = 100; i < 1000; i++) {
+		m.topic_len = sprintf(topic, "dev/%d/state", i);
+		nano_retain_set(r, &m);
+	}
+	while (!nano_retain_cursor_done(cur)) {
+		nano_retain_cursor_next(cur, 10, 0, test_retain_count, &n);
+	}
+	nano_retain_cursor_free(cur);
+	// the 100 present all along at least, once each
+	assert(n >= 100 && n <= 1000);
+
+	n   = 0;
+	cur = nano_retain_cursor_new(r, "#");
+	while (!nano_retain_cursor_done(cur)) {
+		nano_retain_cursor_next(cur, 64, 0, test_retain_count, &n);
+	}
+	nano_retain_cursor_free(cur);
+	assert(n == 1000);
+
+	n   = 0;
+	cur = nano_retain_cursor_new(r, "dev/7/state");
+	assert(nano_retain_cursor_next(cur, 64, 0, test_retain_count, &n) == 1);
+	assert(nano_retain_cursor_done(cur));
+	nano_retain_cursor_free(cur);
+
+	// a group walk and a table walk see the same messages
+	n   = 0;
+	cur = nano_retain_cursor_new(r, "dev/7/#");
+	while (!nano_retain_cursor_done(cur)) {
+		nano_retain_cursor_next(cur, 64, 0, test_retain_count, &n);
+	}
+	nano_retain_cursor_free(cur);
+	assert(n == 1);
+	n   = 0;
+	cur = nano_retain_cursor_new(r, "+/7/state");
+	while (!nano_retain_cursor_done(cur)) {
+		nano_retain_cursor_next(cur, 64, 0, test_retain_count, &n);
+	}
+	nano_retain_cursor_free(cur);
+	assert(n == 1);
+
+	// messages handed out may be deleted by the callback
+	d.r = r;
+	cur = nano_retain_cursor_new(r, "dev/9/+");
+	nano_retain_cursor_next(cur, 64, 0, test_retain_del, &d);
+	assert(nano_retain_cursor_done(cur));
+	nano_retain_cursor_free(cur);
+	assert(d.n == 1 && !nano_retain_del(r, "dev/9/state"));
+	m.topic_len = sprintf(topic, "dev/9/state");
+	m.topic     = topic;
+	assert(nano_retain_set(r, &m) == 1);
+
+	// compressed above the threshold, handed out as set
+	m.topic_len   = sprintf(topic, "big");
+	m.payload_len = sizeof(payload);
+	assert(nano_retain_set(r, &m) == 1);
+	n   = 0;
+	cur = nano_retain_cursor_new(r, "big");
+	nano_retain_cursor_next(cur, 1, 0, test_retain_count, &n);
+	nano_retain_cursor_free(cur);
+	nano_retain_get_stats(r, &st);
+	assert(n == 1 && st.compressed == 1 && st.count == 1002);
+
+	assert(nano_retain_del(r, "big") && !nano_retain_del(r, "big"));
+	nano_retain_destroy(r);
+
+	// the older untouched message goes first
+	opt.mem_limit          = 1000;
+	opt.compress_threshold = 0;
+	r                      = nano_retain_create(&opt);
+	m.payload_len = 200;
+	for (int i = 0; i < 4; i++) {
+		m.topic_len = sprintf(topic, "t/%d", i);
+		nano_retain_set(r, &m);
+		if (i == 2) {
+			cur = nano_retain_cursor_new(r, "t/0");
+			nano_retain_cursor_next(
+			    cur, 1, 0, test_retain_count, &n);
+			nano_retain_cursor_free(cur);
+		}
+	}
+	nano_retain_get_stats(r, &st);
+	assert(st.count == 3 && st.evicted == 1);
+	n   = 0;
+	cur = nano_retain_cursor_new(r, "t/#");
+	while (!nano_retain_cursor_done(cur)) {
+		nano_retain_cursor_next(cur, 8, 0, test_retain_count, &n);
+	}
+	nano_retain_cursor_free(cur);
+	assert(n == 3 && !nano_retain_del(r, "t/1"));
+	assert(nano_retain_del(r, "t/0"));
+	m.payload_len = 1000;
+	assert(nano_retain_set(r, &m) == -1);
+	nano_retain_destroy(r);
+}
+
+// Expired messages are skipped and dropped by cursors and the sweep.
+static void
+test_retain_expire()
+{
+	nano_retain_opt     opt = { 0, NANO_RETAIN_EVICT_LRU, 0 };
+	nano_retain *       r   = nano_retain_create(&opt);
+	nano_retain_cursor *cur;
+	nano_retain_stats   st;
+	nano_retain_msg     m = { 0 };
+	char                topic[32];
+	int                 n = 0;
+
+	m.payload     = (const uint8_t *) "v";
+	m.payload_len = 1;
+	for (int i = 0; i < 100; i++) {
+		m.topic_len = sprintf(topic, "e/%d", i);
+		m.topic     = topic;
+		m.expire_at = i % 2 ? 1000 : 0;
+		nano_retain_set(r, &m);
+	}
+	m.topic_len = sprintf(topic, "e/x");
+	m.expire_at = 3000;
+	nano_retain_set(r, &m);
+
+	cur = nano_retain_cursor_new(r, "e/1");
+	assert(nano_retain_cursor_next(cur, 1, 999, test_retain_count, &n));
+	nano_retain_cursor_free(cur);
+	cur = nano_retain_cursor_new(r, "e/1");
+	assert(!nano_retain_cursor_next(cur, 1, 1000, test_retain_count, &n));
+	nano_retain_cursor_free(cur);
+
+	n   = 0;
+	cur = nano_retain_cursor_new(r, "e/#");
+	while (!nano_retain_cursor_done(cur)) {
+		nano_retain_cursor_next(cur, 8, 2000, test_retain_count, &n);
+	}
+	nano_retain_cursor_free(cur);
+	nano_retain_get_stats(r, &st);
+	assert(n == 51 && st.count == 51 && st.expired == 50);
+
+	// the sweep visits each bucket once per round
+	assert(nano_retain_expire(r, 3000, 1000) == 1);
+	assert(nano_retain_expire(r, 3000, 1000) == 0);
+	nano_retain_get_stats(r, &st);
+	assert(st.count == 50 && st.expired == 51);
+	nano_retain_destroy(r);
+}
+
+// Pressure starts above high, ends below low, shrink evicts from the back.
+static void
+test_mem()
+{
+	nano_retain_opt   opt = { 0, NANO_RETAIN_EVICT_OLDEST, 0 };
+	nano_retain *     r   = nano_retain_create(&opt);
+	nano_retain_stats st;
+	nano_retain_msg   m = { 0 };
+	dbtree *          db;
+	char              topic[32];
+	size_t            tree, freed;
+
+	nano_mem_watermarks(1000, 500);
+	nano_mem_set(NANO_MEM_SESSION, 0);
+	nano_mem_set(NANO_MEM_RETAIN, 0);
+	nano_mem_set(NANO_MEM_INFLIGHT, 0);
+	nano_mem_set(NANO_MEM_CONN, 0);
+	nano_mem_set(NANO_MEM_TREE, 0);
+	assert(!nano_mem_check());
+	nano_mem_add(NANO_MEM_SESSION, 1001);
+	assert(nano_mem_check() && nano_mem_pressure());
+	assert(nano_mem_excess() == 502);
+	nano_mem_sub(NANO_MEM_SESSION, 300);
+	assert(nano_mem_check());
+	nano_mem_sub(NANO_MEM_SESSION, 300);
+	assert(!nano_mem_check() && nano_mem_total() == 401);
+	assert(nano_mem_excess() == 0);
+	nano_mem_set(NANO_MEM_SESSION, 0);
+	nano_mem_watermarks(1000, 0);
+	nano_mem_add(NANO_MEM_CONN, 1001);
+	assert(nano_mem_check());
+	nano_mem_sub(NANO_MEM_CONN, 102);
+	assert(!nano_mem_check());
+	nano_mem_set(NANO_MEM_CONN, 0);
+	nano_mem_watermarks(0, 0);
+	assert(strcmp(nano_mem_name(NANO_MEM_INFLIGHT), "inflight") == 0);
+
+	// a level too long to be inline is counted with its node and client
+	dbtree_create(&db);
+	tree = nano_mem_used(NANO_MEM_TREE);
+	dbtree_insert_client(
+	    db, "mem/a-level-longer-than-the-inline-name", NULL, 1, 0);
+	assert(nano_mem_used(NANO_MEM_TREE) >= tree + sizeof(dbtree_client) +
+	        strlen("a-level-longer-than-the-inline-name") + 1);
+	dbtree_destory(db);
+
+	m.payload     = (const uint8_t *) "payload";
+	m.payload_len = 7;
+	for (int i = 0; i < 10; i++) {
+		m.topic_len = sprintf(topic, "m/%d", i);
+		m.topic     = topic;
+		nano_retain_set(r, &m);
+	}
+	assert(nano_retain_shrink(r, 0) == 0);
+	freed = nano_retain_shrink(r, 1);
+	nano_retain_get_stats(r, &st);
+	assert(freed > 0 && st.count == 9 && st.evicted == 1);
+	assert(!nano_retain_del(r, "m/0") && nano_retain_del(r, "m/1"));
+	assert(nano_retain_shrink(r, 1000000) == freed * 8);
+	nano_retain_get_stats(r, &st);
+	assert(st.count == 0 && st.evicted == 9);
+	nano_retain_destroy(r);
+}
+
+static void
+test_alias()
+{
+	nano_alias a;
+	bool       fresh;
+
+	nano_alias_init(&a, 4, 2);
+	assert(nano_alias_set(&a, 0, "a/b", 3) == -1);
+	assert(nano_alias_set(&a, 5, "a/b", 3) == -1);
+	assert(nano_alias_set(&a, 4, "a/b/c", 3) == 0);
+	assert(strcmp(nano_alias_get(&a, 4), "a/b") == 0);
+	nano_alias_set(&a, 4, "x", 1);
+	assert(strcmp(nano_alias_get(&a, 4), "x") == 0);
+	assert(nano_alias_get(&a, 1) == NULL && nano_alias_get(&a, 9) == NULL);
+
+	assert(nano_alias_out_get(&a, "t/1", 3, &fresh) == 1 && fresh);
+	assert(nano_alias_out_get(&a, "t/2", 3, &fresh) == 2 && fresh);
+	assert(nano_alias_out_get(&a, "t/1", 3, &fresh) == 1 && !fresh);
+	assert(nano_alias_out_get(&a, "t/3", 3, &fresh) == 0 && !fresh);
+	nano_alias_fini(&a);
+}
+
+static void
+test_filter_set()
+{
+	char *filters[] = { "a/b", "a/+/c", "x/#", "+/y", "#/bad", "s/" };
+	dbtree_filter_set *set = dbtree_filter_set_new(filters, 6);
+
+	assert(dbtree_filter_set_match(set, "a/b"));
+	assert(dbtree_filter_set_match(set, "a/zz/c"));
+	assert(dbtree_filter_set_match(set, "x"));
+	assert(dbtree_filter_set_match(set, "x/1/2/3"));
+	assert(dbtree_filter_set_match(set, "q/y"));
+	assert(dbtree_filter_set_match(set, "s/"));
+	assert(!dbtree_filter_set_match(set, "a"));
+	assert(!dbtree_filter_set_match(set, "a/b/c/d"));
+	assert(!dbtree_filter_set_match(set, "a/zz/d"));
+	assert(!dbtree_filter_set_match(set, "q/y/z"));
+	assert(!dbtree_filter_set_match(set, "s"));
+	assert(!dbtree_filter_set_match(NULL, "a/b"));
+	dbtree_filter_set_free(set);
+}
+
+static void *
+test_hash_thread(void *args)
+{
+	uint32_t base    = (uint32_t) (uintptr_t) args * 1000;
+	char     topic[] = "hash/t";
+
+	for (int i = 0; i < TEST_LOOP * 10; i++) {
+		for (uint32_t id = base; id < base + 16; id++) {
+			add_topic(id, topic);
+			assert(check_topic(id, topic));
+			add_session(id, args);
+			assert(get_session(id) == args);
+		}
+		for (uint32_t id = base; id < base + 16; id++) {
+			del_topic_one(id, topic);
+			assert(!check_id(id));
+			assert(del_session(id) == args);
+		}
+	}
+	return NULL;
+}
+
+// Lookups on a miss do not insert and the striped tables stay consistent
+// under concurrent writers.
+static void
+test_hash()
+{
+	pthread_t threads[TEST_NUM_THREADS];
+	char      a[] = "a/b", b[] = "a/c";
+
+	assert(get_topic(7) == NULL && !check_id(7));
+	assert(get_session(7) == NULL && !check_session(7));
+	assert(get_client_id(7) == NULL && !check_pipe_id(7));
+	assert(del_session(7) == NULL);
+
+	add_topic(7, a);
+	add_topic(7, b);
+	assert(check_topic(7, a) && check_topic(7, b));
+	del_topic_one(7, a);
+	assert(!check_topic(7, a) && check_topic(7, b));
+	cache_topic_all(7, 70);
+	assert(!check_id(7) && cached_check_id(70));
+	restore_topic_all(70, 8);
+	assert(!cached_check_id(70) && check_topic(8, b));
+	del_topic_all(8);
+	assert(!check_id(8) && !check_topic(8, b));
+	add_cached_topic(71, a);
+	add_cached_topic(71, b);
+	restore_topic_all(71, 9);
+	assert(check_topic(9, a) && check_topic(9, b));
+	del_topic_all(9);
+
+	for (uintptr_t t = 0; t < TEST_NUM_THREADS; t++) {
+		pthread_create(
+		    &threads[t], NULL, test_hash_thread, (void *) (t + 1));
+	}
+	for (int t = 0; t < TEST_NUM_THREADS; t++) {
+		pthread_join(threads[t], NULL);
+	}
+}
+
+static void
+test_scan_pipe_cb(uint32_t pipe_id, const char *client_id, void *arg)
+{
+	int *seen = arg;
+
+	assert(pipe_id >= 100 && pipe_id < 400 && client_id != NULL);
+	seen[pipe_id - 100]++;
+}
+
+static void
+test_scan_topic_cb(uint32_t pipe_id, const char *topic, void *arg)
+{
+	(*(int *) arg)++;
+}
+
+// Page through a table with a cursor, every entry is seen once.
+static void
+test_hash_scan()
+{
+	int      seen[300] = { 0 };
+	int      topics    = 0;
+	uint64_t cursor    = 0;
+	char     id[]      = "client";
+	char     t[]       = "scan/t";
+	int      pages     = 0;
+
+	for (uint32_t i = 100; i < 400; i++) {
+		add_pipe_id(i, id);
+	}
+	do {
+		cursor = scan_pipe_id(cursor, 16, test_scan_pipe_cb, seen);
+		pages++;
+	} while (cursor != 0);
+	assert(pages > 300 / 16);
+	for (int i = 0; i < 300; i++) {
+		assert(seen[i] == 1);
+		del_pipe_id(i + 100);
+	}
+	assert(scan_pipe_id(0, 16, test_scan_pipe_cb, seen) == 0);
+
+	for (uint32_t i = 100; i < 110; i++) {
+		add_topic(i, t);
+	}
+	do {
+		cursor = scan_topic(cursor, 3, test_scan_topic_cb, &topics);
+	} while (cursor != 0);
+	assert(topics == 10);
+	for (uint32_t i = 100; i < 110; i++) {
+		del_topic_all(i);
+	}
+}
+
+static int test_wal_seen[8];
+
+static void
+test_wal_replay_cb(uint8_t type, const uint8_t *data, size_t len, void *arg)
+{
+	assert(type < 8 && len == 2 && data[0] == 'r' && data[1] == '0' + type);
+	test_wal_seen[type]++;
+}
+
+static int
+test_wal_dump(nano_wal_ckpt *ckpt, void *arg)
+{
+	struct iovec iov = { "r0", 2 };
+	return nano_wal_ckpt_append(ckpt, 0, &iov, 1);
+}
+
+static void
+test_wal_put(uint32_t session_id, void *msg, void *arg)
+{
+	(*(int *) arg)++;
+}
+
+static void
+test_wal_take(uint32_t session_id, void *arg)
+{
+	(*(int *) arg) += 100;
+}
+
+static int test_log_evals;
+
+static int
+test_log_eval(void)
+{
+	return ++test_log_evals;
+}
+
+static void *
+test_log_thread(void *arg)
+{
+	for (int i = 0; i < 100; i++) {
+		nano_log(NANO_LOG_INFO, "line %d of %d", i, *(int *) arg);
+		nano_log(NANO_LOG_DEBUG, "skipped %d", test_log_eval());
+	}
+	return NULL;
+}
+
+// Lines of exited threads are all written or counted as dropped, a
+// disabled line does not evaluate its arguments.
+static void
+test_log()
+{
+	char           path[] = "/tmp/nanolib_log_XXXXXX";
+	nano_log_opt   opt    = { NANO_LOG_INFO, NANO_LOG_TO_FILE, path, 10 };
+	nano_log_stats stats;
+	pthread_t      thr[4];
+	int            ids[4];
+	char           line[512];
+	uint64_t       lines = 0;
+	FILE *         fp;
+	int            level = nano_log_get_level();
+
+	assert(nano_log_level("Warn") == NANO_LOG_WARN);
+	assert(nano_log_level("verbose") == -1);
+	assert(nano_log_to("console,syslog") ==
+	    (NANO_LOG_TO_CONSOLE | NANO_LOG_TO_SYSLOG));
+
+	close(mkstemp(path));
+	assert(nano_log_open(&opt) == 0);
+	assert(nano_log_open(&opt) == -1);
+	for (int i = 0; i < 4; i++) {
+		ids[i] = i;
+		pthread_create(&thr[i], NULL, test_log_thread, &ids[i]);
+	}
+	for (int i = 0; i < 4; i++) {
+		pthread_join(thr[i], NULL);
+	}
+	nano_log_close();
+	nano_log_get_stats(&stats);
+	assert(test_log_evals == 0);
+	assert(stats.written + stats.dropped == 400 && stats.written > 0);
+
+	assert((fp = fopen(path, "r")) != NULL);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		assert(strstr(line, " INFO  ") != NULL);
+		lines++;
+	}
+	fclose(fp);
+	assert(lines == stats.written);
+	unlink(path);
+	nano_log_set_level(level);
+}
+
+// Records survive reopen, a torn tail is skipped and compaction replaces
+// the log by the dumped state.
+static void
+test_wal()
+{
+	char         dir[] = "/tmp/nanolib_wal_XXXXXX";
+	char         path[64];
+	nano_wal *   wal   = NULL;
+	nano_wal_opt opt   = { dir, 64, 2, 0, 0 };
+	struct iovec iov[2];
+	char         tag[8][2];
+	int          fd;
+	DIR *        d;
+	struct dirent *ent;
+
+	assert(mkdtemp(dir) != NULL);
+	assert(nano_wal_open(&wal, &opt, test_wal_dump, NULL) == 0);
+	for (int i = 0; i < 24; i++) {
+		tag[i % 8][0] = 'r';
+		tag[i % 8][1] = '0' + i % 8;
+		iov[0]        = (struct iovec){ tag[i % 8], 1 };
+		iov[1]        = (struct iovec){ tag[i % 8] + 1, 1 };
+		assert(nano_wal_append(wal, i % 8, iov, 2) == 0);
+	}
+	nano_wal_close(wal);
+
+	// a sealed segment gets a torn tail, the next one is still read
+	snprintf(path, sizeof(path), "%s/wal-%08u.log", dir, 3);
+	assert((fd = open(path, O_WRONLY | O_APPEND)) >= 0);
+	assert(write(fd, "\x05\0\0\0\x01", 5) == 5);
+	close(fd);
+
+	memset(test_wal_seen, 0, sizeof(test_wal_seen));
+	assert(nano_wal_open(&wal, &opt, test_wal_dump, NULL) == 0);
+	assert(nano_wal_replay(wal, test_wal_replay_cb, NULL) == 24);
+	for (int i = 0; i < 8; i++) {
+		assert(test_wal_seen[i] == 3);
+	}
+
+	assert(nano_wal_compact(wal) == 0);
+	iov[0] = (struct iovec){ "r7", 2 };
+	assert(nano_wal_append(wal, 7, iov, 1) == 0);
+	nano_wal_close(wal);
+
+	memset(test_wal_seen, 0, sizeof(test_wal_seen));
+	assert(nano_wal_open(&wal, &opt, test_wal_dump, NULL) == 0);
+	assert(nano_wal_replay(wal, test_wal_replay_cb, NULL) == 2);
+	assert(test_wal_seen[0] == 1 && test_wal_seen[7] == 1);
+	nano_wal_close(wal);
+
+	snprintf(path, sizeof(path), "%s/wal-%08u.log", dir, 1);
+	assert(access(path, F_OK) != 0);
+
+	// the segments and checkpoints left
+	assert((d = opendir(dir)) != NULL);
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] != '.') {
+			snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+			unlink(path);
+		}
+	}
+	closedir(d);
+	assert(rmdir(dir) == 0);
+
+	// session queues report puts and takes to their persistence hooks
+	int                    calls   = 0;
+	size_t                 size    = 0;
+	dbtree *               t       = NULL;
+	dbtree_session_persist persist = { test_wal_put, test_wal_take, &calls };
+
+	dbtree_create(&t);
+	dbtree_set_session_persist(t, &persist);
+	dbtree_insert_client(t, "a/b", client0.ctxt, 1, 0);
+	dbtree_cache_session(t, "a/b", 100, 1);
+	dbtree_find_clients_and_cache_msg(t, "a/b", "m0", &size);
+	dbtree_cache_session_msg(t, "m1", 100);
+	void **v = dbtree_restore_session_msg(t, 100);
+	assert(calls == 102 && cvector_size(v) == 2);
+	cvector_free(v);
+	dbtree_delete_session(t, "a/b", 100, 1);
+	dbtree_destory(t);
+}
+
+void test_shared_sub()
+{
+	const char *null = NULL;
+	const char *non_shared = "a/b/c";
+	const char *shared = "$shared/a/b/c";
+	assert(dbtree_check_shared_sub(null) == false);
+	assert(dbtree_check_shared_sub(non_shared) == false);
+	assert(dbtree_check_shared_sub(shared) == true);
+
+	return;
+}
+
+int
+main(int argc, char *argv[])
+{
+	puts("\n----------------TEST START------------------");
+
+	dbtree_create(&db);
+	test_insert_shared_client();
+	dbtree_print(db);
+	test_search_shared_client();
+
+	test_delete_shared_client();
+
+	test_concurrent_search();
+
+	test_search_levels();
+
+	test_child_index();
+	test_node_levels();
+	test_wild_index();
+
+	test_dedup_clients();
+
+	test_shared_strategy();
+
+	test_match_cache();
+
+	test_find_all_clients();
+
+	test_find_online_clients();
+
+	test_insert_clients();
+
+	test_delete_clients();
+
+	test_granted_qos();
+
+	test_session_queue();
+	test_session_reap();
+	test_session_expire();
+
+	test_session_batch();
+	test_insert_sessions();
+	test_snapshot();
+
+
+	test_wal();
+	test_log();
+
+	test_arena();
+	test_cvector_buf();
+	test_lz();
+	test_envelope();
+	test_shm();
+	test_capture();
+	test_topic_scan();
+	test_timer_wheel();
+	test_ring();
+	test_ring_threads();
+	test_retain_store();
+	test_retain_cursor();
+	test_retain_expire();
+	test_mem();
+	test_alias();
+	test_filter_set();
+	test_hash();
+	test_hash_scan();
 	
 	// test_single_thread(NULL);
 	// test_concurrent();
@@ -534,20 +2549,6 @@ main(int argc, char *argv[])
 
 	test_shared_sub();
 
-	// dbtree_create(&db_ret);
-	// test_insert_retain();
-	// puts("=======================================");
-	// dbtree_retain_msg **r = dbtree_find_retain(db_ret, topic6);
-	// for (int i = 0; i < cvector_size(r); i++) {
-	// 	if (r[i]) {
-	// 		printf("%s\t", r[i]->m);
-	// 	}
-	// }
-	// puts("");
-	// puts("=======================================");
-	// test_delete_retain();
-
-	// dbtree_destory(db_ret);
 	puts("---------------TEST FINISHED----------------\n");
 
 	return 0;
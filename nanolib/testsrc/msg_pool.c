@@ -1,7 +1,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include "../include/msg_pool.h"
+#include "../../nanomq/include/msg_pool.h"
 #include "../include/dbg.h"
 
 char * test_msg_pool()
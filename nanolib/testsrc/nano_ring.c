@@ -0,0 +1,251 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io> //
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+// ring_bench hands items from producer threads to one consumer through
+// nano_spsc, nano_mpsc and, as the baseline, nano_lmq under a mutex, and
+// reports the items per second. It is a stress test too: the consumer
+// checks every item arrives once and in the order its producer put it,
+// and exits with 1 on the first one which does not.
+//
+// Runs are made with batches of 1 and -b items a put and a get, the
+// nano_mpsc and nano_lmq runs with 1, 2, 4 .. -p producers. A full ring
+// makes a producer yield, an empty one blocks the consumer in _wait.
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../include/nano_lmq.h"
+#include "../include/nano_ring.h"
+
+#define RING_PRODUCERS_MAX 64
+#define RING_BATCH_MAX 256
+
+enum {
+	RING_SPSC,
+	RING_MPSC,
+	RING_LMQ,
+};
+
+static const char *ring_names[] = { "spsc", "mpsc", "lmq+mtx" };
+
+typedef struct {
+	int             kind;
+	size_t          batch;
+	uint64_t        items; // of a producer
+	nano_spsc       spsc;
+	nano_mpsc       mpsc;
+	nano_lmq        lmq;
+	pthread_mutex_t mtx;
+} ring_run;
+
+typedef struct {
+	ring_run *run;
+	uintptr_t id;
+} ring_producer;
+
+static inline uint64_t
+ring_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t
+ring_put(ring_run *r, void **items, size_t n)
+{
+	size_t k = 0;
+
+	switch (r->kind) {
+	case RING_SPSC:
+		return nano_spsc_put_n(&r->spsc, items, n);
+	case RING_MPSC:
+		return nano_mpsc_put_n(&r->mpsc, items, n);
+	default:
+		pthread_mutex_lock(&r->mtx);
+		while (k < n && nano_lmq_putq(&r->lmq, items[k]) == 0) {
+			k++;
+		}
+		pthread_mutex_unlock(&r->mtx);
+		return k;
+	}
+}
+
+static size_t
+ring_get(ring_run *r, void **items, size_t n)
+{
+	size_t k = 0;
+
+	switch (r->kind) {
+	case RING_SPSC:
+		if ((k = nano_spsc_get_n(&r->spsc, items, n)) == 0) {
+			nano_spsc_wait(&r->spsc, 100);
+		}
+		return k;
+	case RING_MPSC:
+		if ((k = nano_mpsc_get_n(&r->mpsc, items, n)) == 0) {
+			nano_mpsc_wait(&r->mpsc, 100);
+		}
+		return k;
+	default:
+		pthread_mutex_lock(&r->mtx);
+		while (k < n && nano_lmq_getq(&r->lmq, &items[k]) == 0) {
+			k++;
+		}
+		pthread_mutex_unlock(&r->mtx);
+		if (k == 0) {
+			sched_yield();
+		}
+		return k;
+	}
+}
+
+// item i of producer id is i * RING_PRODUCERS_MAX + id, from i = 0
+static void *
+ring_produce(void *arg)
+{
+	ring_producer *p = arg;
+	ring_run *     r = p->run;
+	void *         batch[RING_BATCH_MAX];
+
+	for (uint64_t i = 0; i < r->items;) {
+		size_t n = 0;
+		size_t k;
+
+		while (n < r->batch && i + n < r->items) {
+			batch[n] = (void *) (uintptr_t) ((i + n) *
+			    RING_PRODUCERS_MAX + p->id);
+			n++;
+		}
+		if ((k = ring_put(r, batch, n)) == 0) {
+			sched_yield();
+		}
+		i += k;
+	}
+	return NULL;
+}
+
+static void
+ring_bench(int kind, int producers, size_t batch, uint64_t items,
+    size_t cap)
+{
+	ring_run      r = { .kind = kind, .batch = batch, .items = items };
+	ring_producer prod[RING_PRODUCERS_MAX];
+	pthread_t     thr[RING_PRODUCERS_MAX];
+	uint64_t      next[RING_PRODUCERS_MAX] = { 0 };
+	void *        got[RING_BATCH_MAX];
+	uint64_t      total = 0;
+	uint64_t      t0, ns;
+
+	nano_spsc_init(&r.spsc, cap);
+	nano_mpsc_init(&r.mpsc, cap);
+	nano_lmq_init(&r.lmq, cap);
+	pthread_mutex_init(&r.mtx, NULL);
+
+	t0 = ring_now();
+	for (int i = 0; i < producers; i++) {
+		prod[i].run = &r;
+		prod[i].id  = i;
+		pthread_create(&thr[i], NULL, ring_produce, &prod[i]);
+	}
+	while (total < items * producers) {
+		size_t n = ring_get(&r, got, batch);
+
+		for (size_t i = 0; i < n; i++) {
+			uintptr_t v  = (uintptr_t) got[i];
+			uintptr_t id = v % RING_PRODUCERS_MAX;
+
+			if (id >= (uintptr_t) producers ||
+			    v / RING_PRODUCERS_MAX != next[id]) {
+				fprintf(stderr,
+				    "%s: item %lu of %lu out of order\n",
+				    ring_names[kind],
+				    (unsigned long) (v / RING_PRODUCERS_MAX),
+				    (unsigned long) id);
+				exit(1);
+			}
+			next[id]++;
+		}
+		total += n;
+	}
+	for (int i = 0; i < producers; i++) {
+		pthread_join(thr[i], NULL);
+	}
+	ns = ring_now() - t0;
+	printf("%-8s %9d %5zu %14.0f\n", ring_names[kind], producers, batch,
+	    (double) total * 1e9 / (double) ns);
+
+	pthread_mutex_destroy(&r.mtx);
+	nano_lmq_fini(&r.lmq);
+	nano_mpsc_fini(&r.mpsc);
+	nano_spsc_fini(&r.spsc);
+}
+
+static void
+ring_usage(const char *prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [-n items] [-p producers] [-b batch] [-c cap]\n"
+	    "  -n  items of each producer\n",
+	    prog);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t items     = 10000000;
+	int      producers = 4;
+	size_t   batch     = 32;
+	size_t   cap       = 1024;
+	int      c;
+
+	while ((c = getopt(argc, argv, "n:p:b:c:h")) != -1) {
+		switch (c) {
+		case 'n':
+			items = strtoull(optarg, NULL, 10);
+			break;
+		case 'p':
+			producers = atoi(optarg);
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			cap = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			ring_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (items == 0 || producers < 1 || producers > RING_PRODUCERS_MAX ||
+	    batch < 1 || batch > RING_BATCH_MAX || cap < batch) {
+		ring_usage(argv[0]);
+		return 1;
+	}
+
+	printf("ring bench: %lu items a producer, cap %zu\n",
+	    (unsigned long) items, cap);
+	printf("%-8s %9s %5s %14s\n", "ring", "producers", "batch",
+	    "items/s");
+	ring_bench(RING_SPSC, 1, 1, items, cap);
+	ring_bench(RING_SPSC, 1, batch, items, cap);
+	for (int p = 1; p <= producers; p *= 2) {
+		ring_bench(RING_MPSC, p, 1, items, cap);
+		ring_bench(RING_MPSC, p, batch, items, cap);
+		ring_bench(RING_LMQ, p, 1, items, cap);
+		ring_bench(RING_LMQ, p, batch, items, cap);
+	}
+
+	return 0;
+}
@@ -11,6 +11,7 @@
 #include "include/broker.h"
 #include "include/client.h"
 #include "include/mq.h"
+#include "include/replay.h"
 
 #include <stdlib.h>
 
@@ -18,10 +19,12 @@
 NANOMQ_APP(mq, mqcreate_debug, mqsend_debug, mqreceive_debug, NULL);
 #endif
 NANOMQ_APP(broker, broker_dflt, broker_start, broker_stop, broker_restart);
+NANOMQ_APP(replay, replay_dflt, replay_start, NULL, NULL);
 #if defined(SUPP_CLIENT)
 NANOMQ_APP(pub, pub_dflt, pub_start, NULL, client_stop);
 NANOMQ_APP(sub, sub_dflt, sub_start, NULL, client_stop);
 NANOMQ_APP(conn, conn_dflt, conn_start, NULL, client_stop);
+NANOMQ_APP(bench, bench_dflt, bench_start, NULL, client_stop);
 #endif
 #if defined(NANO_DEBUG)
 
@@ -32,10 +35,12 @@ const struct nanomq_app *edge_apps[] = {
 	&nanomq_app_mq,
 #endif
 	&nanomq_app_broker,
+	&nanomq_app_replay,
 #if defined(SUPP_CLIENT)
 	&nanomq_app_pub,
 	&nanomq_app_sub,
 	&nanomq_app_conn,
+	&nanomq_app_bench,
 #endif
 #if defined(NANO_DEBUG)
 //&
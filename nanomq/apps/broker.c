@@ -11,13 +11,16 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 
 #include <conf.h>
 #include <env.h>
+#include <file.h>
 #include <hash.h>
 #include <mqtt_db.h>
+#include <nano_mem.h>
 #include <nng.h>
 #include <nng/mqtt/mqtt_client.h>
 #include <nng/supplemental/util/options.h>
@@ -25,14 +28,32 @@
 #include <protocol/mqtt/mqtt_parser.h>
 #include <protocol/mqtt/nmq_mqtt.h>
 #include <zmalloc.h>
+#ifdef NNG_SUPP_TLS
+#include <nng/supplemental/tls/tls.h>
+#endif
 
 #include "include/bridge.h"
+#include "include/capture.h"
+#include "include/fanout.h"
+#include "include/inflight.h"
+#include "include/mem_guard.h"
+#include "include/metrics.h"
+#include "include/msg_pool.h"
 #include "include/nanomq.h"
+#include "include/persistence.h"
+#include "include/pipe_queue.h"
 #include "include/process.h"
+#include "include/rate_limit.h"
+#include "include/reaper.h"
+#include "include/route.h"
+#include "include/shm_ingest.h"
+#include "include/snapshot.h"
 #include "include/pub_handler.h"
 #include "include/sub_handler.h"
+#include "include/sys_event.h"
 #include "include/unsub_handler.h"
 #include "include/web_server.h"
+#include "include/work_pool.h"
 
 // Parallel is the maximum number of outstanding requests we can handle.
 // This is *NOT* the number of threads in use, but instead represents
@@ -45,6 +66,17 @@
 #define PARALLEL 32
 #endif
 
+// Max retain messages sent for a SUBSCRIBE before the worker yields, and
+// the wait while the subscriber is not acknowledging.
+#define RETAIN_BATCH 64
+#define RETAIN_BACKOFF_MS 10
+
+// Works publishing client connected and disconnected events, one keeps
+// the events of a client in order, and its poll while none is queued.
+#define SYS_EVENT_WORKS 1
+#define SYS_EVENT_IDLE_MS 10
+#define SHM_INGEST_WORKS 1 // the consumer of all rings
+
 enum options {
 	OPT_HELP = 1,
 	OPT_CONFFILE,
@@ -115,12 +147,749 @@ intHandler(int dummy)
 }
 #endif
 
+static volatile sig_atomic_t termRequested = 0;
+
+// SUBACK and UNSUBACK are got from it, the control packets received put
+static nnl_msg_pool *msg_pool = NULL;
+
+static void
+termHandler(int dummy)
+{
+	termRequested = 1;
+}
+
 void
 fatal(const char *func, int rv)
 {
 	fprintf(stderr, "%s: %s\n", func, nng_strerror(rv));
 }
 
+static void
+free_retain_cursors(nano_work *work)
+{
+	for (int i = 0; i < cvector_size(work->retain_cur); i++) {
+		nano_retain_cursor_free(work->retain_cur[i]);
+	}
+	cvector_free(work->retain_cur);
+	work->retain_cur = NULL;
+}
+
+/**
+ * @brief retain_msg_encode - Rebuild the PUBLISH of a retained message,
+ * with the retain flag set and a packet identifier left to the transport.
+ * A Message Expiry Interval is rewritten to the time left of it.
+ * @param ret - nano_retain_msg
+ * @return nng_msg or NULL
+ */
+static nng_msg *
+retain_msg_encode(const nano_retain_msg *ret)
+{
+	nng_msg *msg          = NULL;
+	uint8_t  fixed_header = CMD_PUBLISH | 0x01 | (ret->qos << 1);
+	uint8_t  tmp[4]       = { 0 };
+	nng_time now          = nng_clock();
+	uint8_t *p;
+	size_t   pos, off;
+	uint32_t interval;
+	int      arr_len;
+
+	if (nng_msg_alloc(&msg, 0) != 0) {
+		return NULL;
+	}
+	tmp[0] = ret->topic_len >> 8;
+	tmp[1] = ret->topic_len & 0xff;
+	nng_msg_append(msg, tmp, 2);
+	nng_msg_append(msg, ret->topic, ret->topic_len);
+	if (ret->qos > 0) {
+		tmp[0] = tmp[1] = 0;
+		nng_msg_append(msg, tmp, 2);
+	}
+	pos = nng_msg_len(msg);
+	nng_msg_append(msg, ret->props, ret->props_len);
+	nng_msg_append(msg, ret->payload, ret->payload_len);
+	if (ret->expire_at > now &&
+	    pub_props_expiry(ret->props, ret->props_len, &off, &interval)) {
+		p        = (uint8_t *) nng_msg_body(msg) + pos + off;
+		interval = (ret->expire_at - now + 999) / 1000;
+		p[0]     = interval >> 24;
+		p[1]     = interval >> 16;
+		p[2]     = interval >> 8;
+		p[3]     = interval;
+	}
+
+	nng_msg_header_append(msg, &fixed_header, 1);
+	arr_len = put_var_integer(tmp, nng_msg_len(msg));
+	nng_msg_header_append(msg, tmp, arr_len);
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+	nng_msg_set_remaining_len(msg, nng_msg_len(msg));
+	nng_msg_set_timestamp(msg, nng_clock());
+
+	return msg;
+}
+
+// Encode and send a retained message handed out by a cursor.
+static void
+send_retain_cb(const nano_retain_msg *ret, void *arg)
+{
+	nano_work *work = arg;
+	nng_msg *  m    = retain_msg_encode(ret);
+
+	if (m == NULL) {
+		return;
+	}
+	inflight_sent(work->pid.id, ret->qos);
+	metrics_msg_out(m);
+	nng_aio_set_msg(work->aio, m);
+	nng_msg_set_pipe(m, work->pid);
+	nng_ctx_send(work->ctx, work->aio);
+}
+
+/*
+ * Send next batch of retain messages of a SUBSCRIBE and come back to
+ * RETAIN, so a large retain store never holds the worker. It waits while
+ * the pipe has msq_len unacknowledged messages. Return false once all
+ * cursors are done.
+ */
+static bool
+send_retain_batch(nano_work *work)
+{
+	size_t   max      = RETAIN_BATCH;
+	size_t   window   = work->config->msq_len;
+	uint32_t inflight = inflight_count(work->pid.id);
+
+	if (window > 0 && inflight >= window) {
+		nng_sleep_aio(RETAIN_BACKOFF_MS, work->aio);
+		return true;
+	}
+	if (window > 0 && window - inflight < max) {
+		max = window - inflight;
+	}
+
+	while (!cvector_empty(work->retain_cur)) {
+		nano_retain_cursor *cur = work->retain_cur[0];
+		size_t              n =
+		    nano_retain_cursor_next(
+		        cur, max, nng_clock(), send_retain_cb, work);
+		bool done = nano_retain_cursor_done(cur);
+
+		if (done) {
+			nano_retain_cursor_free(cur);
+			cvector_erase(work->retain_cur, 0);
+		}
+		// a step of a wildcard walk may find nothing, yield anyway
+		if (n > 0 || !done) {
+			nng_aio_finish(work->aio, 0);
+			return true;
+		}
+	}
+
+	free_retain_cursors(work);
+	return false;
+}
+
+/*
+ * Receivers of a PUBLISH get one of few wire encodings, by granted qos and
+ * protocol version. Each one is encoded once, on first use, and shared by
+ * refcount among its receivers. The first variant laid out like the
+ * received msg forwards it with only the fixed header rewritten, the
+ * payload of pub_packet points into that msg so others never clear it.
+ */
+#define PUB_VARIANTS 6
+
+static nng_msg *
+pub_variant(nano_work *work, nng_msg **variants, nng_msg **smsg,
+    struct pipe_info *p_info)
+{
+	bool    v5    = p_info->proto_ver == PROTOCOL_VERSION_v5;
+	int     idx   = p_info->qos * 2 + (v5 ? 1 : 0);
+	uint8_t proto = v5 ? PROTOCOL_VERSION_v5 : 4;
+
+	if (variants[idx] == NULL) {
+		if (*smsg != NULL &&
+		    forward_pub_message(*smsg, p_info->work, p_info->qos, proto)) {
+			variants[idx] = *smsg;
+			*smsg         = NULL;
+		} else {
+			nng_msg_alloc(&variants[idx], 0);
+			work->pipe_ct->encode_msg(variants[idx], p_info->work,
+			    p_info->cmd, p_info->qos, proto, 0);
+		}
+	}
+
+	return variants[idx];
+}
+
+/*
+ * MQTT 5 receivers may get a PUBLISH with a topic alias instead of its
+ * topic, not worth it for short topics. Receivers with the same alias
+ * share the aliased msg, cached per variant.
+ */
+#define PUB_ALIAS_MIN_TOPIC 8
+
+typedef struct {
+	nng_msg *msg;
+	uint16_t alias;
+	bool     fresh;
+} pub_aliased;
+
+static void
+pub_send(nano_work *work, nng_msg *msg, nng_pipe pipe, uint8_t qos)
+{
+	nng_msg_clone(msg);
+	nng_msg_set_pipe(msg, pipe);
+	nng_aio_set_prov_extra(work->aio, 0, (void *) (intptr_t) qos);
+	metrics_msg_out(msg);
+	nng_aio_set_msg(work->aio, msg);
+	nng_ctx_send(work->ctx, work->aio);
+}
+
+// aliases of the pipe stay locked until the msg is queued to it
+static void
+pub_send_aliased(nano_work *work, pub_aliased *cache, nng_msg *msg,
+    nng_pipe pipe, uint8_t qos)
+{
+	struct mqtt_string *topic =
+	    &work->pub_packet->variable_header.publish.topic_name;
+	nng_msg *m;
+	uint16_t alias;
+	bool     fresh;
+
+	alias = pipe_alias_out_begin(pipe.id, topic->body, topic->len, &fresh);
+	if (alias != 0 &&
+	    (cache->msg == NULL || cache->alias != alias ||
+	        cache->fresh != fresh) &&
+	    (m = encode_pub_alias(msg, alias, fresh)) != NULL) {
+		if (cache->msg != NULL) {
+			nng_msg_free(cache->msg);
+		}
+		cache->msg   = m;
+		cache->alias = alias;
+		cache->fresh = fresh;
+	}
+	if (alias != 0 && cache->msg != NULL && cache->alias == alias &&
+	    cache->fresh == fresh) {
+		msg = cache->msg;
+	}
+	pub_send(work, msg, pipe, qos);
+	pipe_alias_out_end(pipe.id);
+}
+
+// a receiver of the PUBLISH of work, with its variant encoded already
+static void
+pub_send_one(nano_work *work, nng_msg **variants, pub_aliased *aliased,
+    struct pipe_info *p_info, bool alias)
+{
+	bool     v5   = p_info->proto_ver == PROTOCOL_VERSION_v5;
+	nng_msg *msg  = variants[p_info->qos * 2 + (v5 ? 1 : 0)];
+	nng_pipe pipe = work->pid;
+
+	if (!pipe_queue_admit(
+	        p_info->pipe, msg, p_info->qos, p_info->proto_ver)) {
+		return;
+	}
+	inflight_sent(p_info->pipe, p_info->qos);
+	pipe.id = p_info->pipe;
+	if (alias && v5) {
+		pub_send_aliased(work, &aliased[p_info->qos * 2 + 1], msg,
+		    pipe, p_info->qos);
+	} else {
+		pub_send(work, msg, pipe, p_info->qos);
+	}
+}
+
+/*
+ * The variants of a PUBLISH the fanout works send, see fanout.c. The
+ * work which received it is in SEND and its pipe_ct is kept until the
+ * last part is sent, which frees the variants and finishes its aio.
+ */
+struct pub_fanout {
+	nng_msg *variants[PUB_VARIANTS];
+	uint32_t left; // parts not sent yet
+	bool     alias;
+};
+
+// split the receivers of work by shard, false if it sends them itself
+static bool
+pub_fanout_post(nano_work *work, nng_msg **variants, nng_msg *smsg,
+    bool alias)
+{
+	struct pipe_content *pipe_ct                  = work->pipe_ct;
+	fanout_part *        parts[FANOUT_WORKS_MAX] = { NULL };
+	struct pub_fanout *  f;
+	uint32_t             shard;
+
+	if ((f = nng_alloc(sizeof(struct pub_fanout))) == NULL) {
+		return false;
+	}
+	memcpy(f->variants, variants, sizeof(f->variants));
+	f->left  = 0;
+	f->alias = alias;
+	for (uint32_t i = 0; i < pipe_ct->total; i++) {
+		shard = fanout_shard_of(pipe_ct->pipe_info[i].pipe);
+		if (parts[shard] == NULL) {
+			parts[shard]         = zmalloc(sizeof(fanout_part));
+			parts[shard]->origin = work;
+			parts[shard]->index  = NULL;
+			f->left++;
+		}
+		cvector_push_back(parts[shard]->index, i);
+	}
+	if (smsg != NULL) {
+		nng_msg_free(smsg);
+	}
+	work->fanout = f;
+	work->msg    = NULL;
+	work->state  = SEND;
+
+	// work is not touched once posted, the last part may be sent already
+	for (shard = 0; shard < fanout_shards(); shard++) {
+		if (parts[shard] != NULL) {
+			fanout_post(shard, parts[shard]);
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief pub_fanout_send - Send a part of a large fan-out on a fanout
+ * work, the receivers of a shard in the order of pipe_info. The last part
+ * of a PUBLISH moves the work which received it on.
+ * @param work - fanout work
+ * @param part - fanout_part, consumed
+ * @return void
+ */
+static void
+pub_fanout_send(nano_work *work, fanout_part *part)
+{
+	nano_work *        origin                = part->origin;
+	struct pub_fanout *f                     = origin->fanout;
+	pub_aliased        aliased[PUB_VARIANTS] = { { NULL } };
+
+	// topic aliases are of the topic origin decoded
+	work->pub_packet = origin->pub_packet;
+	for (size_t i = 0; i < cvector_size(part->index); i++) {
+		pub_send_one(work, f->variants, aliased,
+		    &origin->pipe_ct->pipe_info[part->index[i]], f->alias);
+	}
+	work->pub_packet = NULL;
+	for (int i = 0; i < PUB_VARIANTS; i++) {
+		if (aliased[i].msg != NULL) {
+			nng_msg_free(aliased[i].msg);
+		}
+	}
+	cvector_free(part->index);
+	zfree(part);
+
+	if (__atomic_sub_fetch(&f->left, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	for (int i = 0; i < PUB_VARIANTS; i++) {
+		if (f->variants[i] != NULL) {
+			nng_msg_free(f->variants[i]);
+		}
+	}
+	nng_free(f, sizeof(struct pub_fanout));
+	origin->fanout = NULL;
+	nng_aio_finish(origin->aio, 0);
+}
+
+/**
+ * @brief pub_multicast - Send the PUBLISH of work to all pipes of
+ * work->pipe_ct, the (pipe, qos) pairs resolved by foreach_client, then
+ * complete work->aio once and move to SEND.
+ * Each receiver takes a reference of its variant, the variants are
+ * all encoded before the first send so no submission waits on encoding.
+ * The nmq protocol takes one msg per nng_ctx_send, the pipe and qos ride
+ * on the msg and the prov extra of the aio. A pipe behind its window gets
+ * the msg held or dropped by pipe_queue instead. More than
+ * fanout_threshold receivers are sent by the fanout works in parallel,
+ * then the last of them completes work->aio.
+ * @param work - nano_work in WAIT
+ * @param smsg - received msg, consumed
+ * @return void
+ */
+static void
+pub_multicast(nano_work *work, nng_msg *smsg)
+{
+	struct pipe_content *pipe_ct                = work->pipe_ct;
+	nng_msg *            variants[PUB_VARIANTS] = { NULL };
+	pub_aliased          aliased[PUB_VARIANTS]  = { { NULL } };
+	nng_time             recv_at;
+	bool                 alias;
+
+	recv_at = nng_msg_get_timestamp(smsg);
+	metrics_latency(recv_at);
+	metrics_trace_mark(&work->trace, TRACE_HANDOFF);
+	alias = pipe_alias_out_enabled() &&
+	    work->pub_packet->variable_header.publish.topic_name.len >=
+	        PUB_ALIAS_MIN_TOPIC;
+
+	for (uint32_t i = 0; i < pipe_ct->total; i++) {
+		pub_variant(work, variants, &smsg, &pipe_ct->pipe_info[i]);
+	}
+	// expiry of what pipe_queue holds counts from the arrival
+	for (int i = 0; i < PUB_VARIANTS; i++) {
+		if (variants[i] != NULL) {
+			nng_msg_set_timestamp(variants[i], recv_at);
+		}
+	}
+	metrics_trace_mark(&work->trace, TRACE_ENCODE);
+
+	if (fanout_wanted(pipe_ct->total) &&
+	    pub_fanout_post(work, variants, smsg, alias)) {
+		return;
+	}
+
+	for (; pipe_ct->current_index < pipe_ct->total;
+	     pipe_ct->current_index++) {
+		pub_send_one(work, variants, aliased,
+		    &pipe_ct->pipe_info[pipe_ct->current_index], alias);
+	}
+	work->pid.id = pipe_ct->pipe_info[pipe_ct->total - 1].pipe;
+
+	reset_pipe_content(pipe_ct);
+	for (int i = 0; i < PUB_VARIANTS; i++) {
+		if (variants[i] != NULL) {
+			nng_msg_free(variants[i]);
+		}
+		if (aliased[i].msg != NULL) {
+			nng_msg_free(aliased[i].msg);
+		}
+	}
+	if (smsg) {
+		nng_msg_free(smsg);
+	}
+
+	work->msg   = NULL;
+	work->state = SEND;
+	nng_aio_finish(work->aio, 0);
+}
+
+/*
+ * Send what pipe_queue holds for the pipe of work once an acknowledgement
+ * opened its window, until the window is full again. Held QoS 0 msgs do
+ * not take a slot. Return false if nothing was held.
+ */
+static bool
+pub_release_held(nano_work *work)
+{
+	nng_msg *msg;
+	nng_time now = nng_clock();
+	uint8_t *header;
+	uint8_t  qos;
+
+	if ((msg = pipe_queue_next(work->pid.id, now)) == NULL) {
+		return false;
+	}
+	do {
+		header = nng_msg_header(msg);
+		qos    = (header[0] >> 1) & 0x03;
+		inflight_sent(work->pid.id, qos);
+		nng_msg_set_pipe(msg, work->pid);
+		nng_aio_set_prov_extra(work->aio, 0, (void *) (intptr_t) qos);
+		metrics_msg_out(msg);
+		nng_aio_set_msg(work->aio, msg);
+		nng_ctx_send(work->ctx, work->aio);
+	} while ((msg = pipe_queue_next(work->pid.id, now)) != NULL);
+
+	work->state = SEND;
+	nng_aio_finish(work->aio, 0);
+	return true;
+}
+
+// take the pipe off the tree for all of its topics in one pass
+static void
+del_pipe_subs(nano_work *work)
+{
+	topic_queue *tq     = get_topic(work->pid.id);
+	char **      topics = NULL;
+	void **      ctxts  = NULL;
+	size_t       n      = 0;
+
+	for (topic_queue *t = tq; t; t = t->next) {
+		if (t->topic) {
+			cvector_push_back(topics, t->topic);
+		}
+	}
+	n = cvector_size(topics);
+	if (n > 0) {
+		ctxts = nng_alloc(sizeof(void *) * n);
+		dbtree_delete_clients(work->db, topics, n, work->pid.id, ctxts);
+		for (size_t i = 0; i < n; i++) {
+			del_sub_ctx(ctxts[i], topics[i]);
+		}
+		nng_free(ctxts, sizeof(void *) * n);
+	}
+	cvector_free(topics);
+	del_topic_all(work->pid.id);
+}
+
+// drops a reference held by an offline session queue
+static void
+session_msg_free(void *msg)
+{
+	nng_msg_free((nng_msg *) msg);
+}
+
+/*
+ * A PUBLISH on BRIDGE_BATCH_TOPIC is a batch the bridge of another nanomq
+ * packed with bridge_batch_add. Its messages are published one at a time
+ * as if each was received, the next one is taken from work->unpack when
+ * work is done with the last, from WAIT or SEND.
+ */
+static bool
+pub_is_batch(nng_msg *msg)
+{
+	uint8_t *body = nng_msg_body(msg);
+	size_t   len  = nng_msg_len(msg);
+	size_t   tlen = sizeof(BRIDGE_BATCH_TOPIC) - 1;
+
+	// the topic leads the body
+	return len >= 2 + tlen && ((body[0] << 8) | body[1]) == tlen &&
+	    memcmp(body + 2, BRIDGE_BATCH_TOPIC, tlen) == 0;
+}
+
+static bool
+pub_unpack_open(nano_work *work)
+{
+	struct pub_packet_struct *pub;
+
+	work->pub_packet = nano_arena_alloc(
+	    &work->arena, sizeof(struct pub_packet_struct));
+	if (decode_pub_message(work) != SUCCESS) {
+		return false;
+	}
+	pub          = work->pub_packet;
+	work->unpack = zmalloc(sizeof(nano_envelope_reader));
+	if (nano_envelope_open(work->unpack, pub->payload_body.payload,
+	        pub->payload_body.payload_len) != 0) {
+		zfree(work->unpack);
+		work->unpack = NULL;
+		return false;
+	}
+	return true;
+}
+
+static void
+pub_unpack_close(nano_work *work)
+{
+	nano_envelope_close(work->unpack);
+	zfree(work->unpack);
+	work->unpack = NULL;
+}
+
+/*
+ * A message of a batch is admitted as if it was received on its own, by
+ * the rate limits of the pipe and by QoS 0 shedding, the envelope alone
+ * tells nothing of its topics and qos. It is not held back by PAUSE, a
+ * batch is not paused midway, so one over a limit is dropped. Return
+ * false to drop it, by DISCONNECT with the pipe closed and the rest of
+ * the batch too.
+ */
+static bool
+pub_unpack_admit(nano_work *work, nng_msg *msg, uint8_t qos)
+{
+	int policy;
+
+	if (rate_limit_enabled() &&
+	    rate_limit_take(work->pid.id, msg, metrics_now_ns(), false) !=
+	        0) {
+		policy = rate_limit_get_policy();
+		rate_limit_reject(policy);
+		if (policy == RATE_LIMIT_DISCONNECT) {
+			nng_pipe_close(work->pid);
+			pub_unpack_close(work);
+		}
+		return false;
+	}
+	return qos != 0 || !mem_guard_refuse(MEM_GUARD_QOS0);
+}
+
+// the next message of the batch admitted into work->msg, matched like
+// received
+static bool
+pub_unpack_next(nano_work *work)
+{
+	mqtt_string    topic, payload;
+	const char *   t;
+	const uint8_t *p;
+	uint16_t       tlen;
+	uint32_t       plen;
+	uint8_t        flags;
+	nng_msg *      msg;
+
+	for (;;) {
+		msg = NULL;
+		if (!nano_envelope_next(
+		        work->unpack, &t, &tlen, &p, &plen, &flags) ||
+		    nng_msg_alloc(&msg, 0) != 0) {
+			pub_unpack_close(work);
+			return false;
+		}
+		topic.body   = (char *) t;
+		topic.len    = tlen;
+		payload.body = (char *) p;
+		payload.len  = plen;
+
+		msg = nano_msg_composer(&msg, flags & NANO_ENVELOPE_RETAIN,
+		    (flags >> 1) & 0x03, &payload, &topic);
+		if (pub_unpack_admit(work, msg, (flags >> 1) & 0x03)) {
+			break;
+		}
+		nng_msg_free(msg);
+		if (work->unpack == NULL) {
+			return false;
+		}
+	}
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+	nng_msg_set_timestamp(msg, nng_clock());
+	nng_msg_set_pipe(msg, work->pid);
+	if (work->msg != NULL) {
+		nng_msg_free(work->msg);
+	}
+	work->msg         = msg;
+	work->pub_packet  = NULL;
+	work->trace.start = 0;
+	nano_arena_reset(&work->arena);
+	handle_pub(work, work->pipe_ct);
+
+	return true;
+}
+
+// PUBLISH in work->msg received, decode it and forward it to the bridge
+static void
+pub_recv(nano_work *work)
+{
+	nng_msg *    msg    = work->msg;
+	nng_msg *    smsg   = NULL;
+	conf_bridge *bridge = &(work->config->bridge);
+	char *       topic;
+	uint32_t     link;
+
+	nng_msg_set_timestamp(msg, nng_clock());
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+	// a batch which can not be read is published as it is, one with
+	// none of its messages admitted is done with in WAIT
+	if (pub_is_batch(msg) && pub_unpack_open(work)) {
+		pub_unpack_next(work);
+		return;
+	}
+	metrics_trace_begin(&work->trace);
+	handle_pub(work, work->pipe_ct);
+
+	if (bridge->bridge_mode) {
+		topic =
+		    work->pub_packet->variable_header.publish.topic_name.body;
+		// the remote nanomq tells what to forward to it
+		if (bridge->routes && work->proto == PROTO_MQTT_BRIDGE &&
+		    strcmp(topic, ROUTE_TOPIC) == 0) {
+			route_peer_update(
+			    work->pub_packet->payload_body.payload,
+			    work->pub_packet->payload_body.payload_len);
+			return;
+		}
+		if (!dbtree_filter_set_match(bridge->forward_set, topic) ||
+		    (bridge->routes && !route_peer_match(topic))) {
+			return;
+		}
+		link = bridge_link_of(bridge, topic);
+		if (bridge_batch_add(link, topic,
+		        work->pub_packet->payload_body.payload,
+		        work->pub_packet->payload_body.payload_len,
+		        work->pub_packet->fixed_header.qos,
+		        work->pub_packet->fixed_header.retain)) {
+			return;
+		}
+		smsg = bridge_publish_msg(topic,
+		    work->pub_packet->payload_body.payload,
+		    work->pub_packet->payload_body.payload_len,
+		    work->pub_packet->fixed_header.dup,
+		    work->pub_packet->fixed_header.qos,
+		    work->pub_packet->fixed_header.retain);
+		nng_aio_set_msg(work->bridge_aio, smsg);
+		nng_ctx_send(work->bridge_links[link], work->bridge_aio);
+	}
+}
+
+/*
+ * Check the PUBLISH in work->msg against the rate limits of its pipe.
+ * Over a limit it is dropped, with its pipe closed by DISCONNECT, or
+ * PAUSE charges it anyway and holds it in THROTTLE until it is within,
+ * while fewer than half of the works are paused. Return false if work
+ * is done with it.
+ */
+static bool
+pub_rate_admit(nano_work *work)
+{
+	uint64_t now = metrics_now_ns();
+	uint64_t over;
+	int      policy = rate_limit_get_policy();
+
+	if (rate_limit_take(work->pid.id, work->msg, now, false) == 0) {
+		return true;
+	}
+	if (policy == RATE_LIMIT_PAUSE && rate_limit_pause_begin()) {
+		over = rate_limit_take(work->pid.id, work->msg, now, true);
+		work->state = THROTTLE;
+		nng_sleep_aio((nng_duration) ((over + 999999) / 1000000),
+		    work->aio);
+		return false;
+	}
+
+	rate_limit_reject(policy);
+	if (policy == RATE_LIMIT_DISCONNECT) {
+		nng_pipe_close(work->pid);
+	}
+	nng_msg_free(work->msg);
+	work->msg   = NULL;
+	work->state = RECV;
+	work_pool_recv(work);
+	return false;
+}
+
+// a QoS 0 PUBLISH is dropped under memory pressure, false if it is kept
+static bool
+pub_mem_shed(nano_work *work)
+{
+	uint8_t *header = nng_msg_header(work->msg);
+
+	if (((header[0] >> 1) & 0x03) != 0 ||
+	    !mem_guard_refuse(MEM_GUARD_QOS0)) {
+		return false;
+	}
+	nng_msg_free(work->msg);
+	work->msg   = NULL;
+	work->state = RECV;
+	work_pool_recv(work);
+	return true;
+}
+
+/*
+ * The CONNACK of a pipe refused under memory pressure, Server unavailable
+ * or Quota exceeded to MQTT 5. The client closes on it, the pipe goes
+ * away with the usual DISCONNECT_EV, no session is restored for it.
+ */
+static void
+conn_mem_refuse(nano_work *work)
+{
+	uint8_t *header = nng_msg_header(work->msg);
+
+	if (nng_msg_header_len(work->msg) >= 4) {
+		header[3] = conn_param_get_protover(work->cparam) ==
+		        PROTOCOL_VERSION_v5
+		    ? 0x97
+		    : 0x03;
+	}
+	log_warn("connection of pipe %u refused under memory pressure",
+	    work->pid.id);
+	metrics_msg_out(work->msg);
+	nng_aio_set_msg(work->aio, work->msg);
+	work->msg = NULL;
+	nng_ctx_send(work->ctx, work->aio);
+	work->state = SEND;
+	nng_aio_finish(work->aio, 0);
+}
+
 void
 server_cb(void *arg)
 {
@@ -129,25 +898,44 @@ server_cb(void *arg)
 	nng_msg *  smsg = NULL;
 	int        rv;
 
-	reason_code reason;
-	uint8_t *   ptr;
-	conn_param *cparam = NULL;
-
-	struct pipe_info p_info;
+	reason_code  reason;
+	uint8_t *    ptr;
+	conn_param * cparam = NULL;
+	fanout_part *part;
 
 	switch (work->state) {
 	case INIT:
-		debug_msg("INIT ^^^^ ctx%d ^^^^\n", work->ctx.id);
+		log_trace("INIT ^^^^ ctx%d ^^^^\n", work->ctx.id);
 		if (work->proto == PROTO_MQTT_BRIDGE) {
 			work->state = BRIDGE;
 			nng_ctx_recv(work->bridge_ctx, work->aio);
+		} else if (work->proto == PROTO_SYS_EVENT) {
+			work->state = EVENT;
+			nng_sleep_aio(SYS_EVENT_IDLE_MS, work->aio);
+		} else if (work->proto == PROTO_INFLIGHT) {
+			work->state = RESEND;
+			nng_sleep_aio(INFLIGHT_TICK_MS, work->aio);
+		} else if (work->proto == PROTO_SHM_INGEST) {
+			work->state = INGEST;
+			nng_sleep_aio(work->config->shm.interval, work->aio);
+		} else if (work->proto == PROTO_FANOUT) {
+			work->shard = fanout_attach(work->aio);
+			work->state = FANOUT;
+			nng_aio_finish(work->aio, 0);
 		} else {
 			work->state = RECV;
-			nng_ctx_recv(work->ctx, work->aio);
+			work_pool_recv(work);
 		}
 		break;
 	case RECV:
-		debug_msg("RECV  ^^^^ ctx%d ^^^^\n", work->ctx.id);
+		log_trace("RECV  ^^^^ ctx%d ^^^^\n", work->ctx.id);
+		// the last msg is done with, drop what was decoded for it
+		work->pub_packet  = NULL;
+		work->trace.start = 0;
+		nano_arena_reset(&work->arena);
+		if (!work_pool_got(work, nng_aio_result(work->aio))) {
+			break;
+		}
 		if ((rv = nng_aio_result(work->aio)) != 0) {
 			debug_msg("ERROR: RECV nng aio result error: %d", rv);
 			nng_aio_wait(work->aio);
@@ -159,6 +947,13 @@ server_cb(void *arg)
 		work->msg    = msg;
 		work->cparam = nng_msg_get_conn_param(work->msg);
 		work->pid    = nng_msg_get_pipe(work->msg);
+		if (capture_enabled()) {
+			capture_msg(msg, work->pid.id,
+			    work->cparam ? conn_param_get_protover(work->cparam)
+			                 : 0);
+		}
+		metrics_msg_in(msg);
+		inflight_seen(work->pid.id);
 
 		if (nng_msg_cmd_type(msg) == CMD_DISCONNECT) {
 			// Disconnect reserved for will msg.
@@ -176,53 +971,32 @@ server_cb(void *arg)
 			} else {
 				work->msg   = NULL;
 				work->state = RECV;
-				nng_ctx_recv(work->ctx, work->aio);
+				work_pool_recv(work);
 				break;
 			}
 		} else if (nng_msg_cmd_type(msg) == CMD_PUBLISH) {
-			nng_msg_set_timestamp(msg, nng_clock());
-			nng_msg_set_cmd_type(msg, CMD_PUBLISH);
-			handle_pub(work, work->pipe_ct);
-
-			conf_bridge *bridge = &(work->config->bridge);
-			if (bridge->bridge_mode) {
-				bool found = false;
-				for (size_t i = 0; i < bridge->forwards_count;
-				     i++) {
-					if (topic_filter(bridge->forwards[i],
-					        work->pub_packet
-					            ->variable_header.publish
-					            .topic_name.body)) {
-						found = true;
-						break;
-					}
-				}
-
-				if (found) {
-					smsg = bridge_publish_msg(
-					    work->pub_packet->variable_header
-					        .publish.topic_name.body,
-					    work->pub_packet->payload_body
-					        .payload,
-					    work->pub_packet->payload_body
-					        .payload_len,
-					    work->pub_packet->fixed_header.dup,
-					    work->pub_packet->fixed_header.qos,
-					    work->pub_packet->fixed_header
-					        .retain);
-					work->state = WAIT;
-					nng_aio_set_msg(
-					    work->bridge_aio, smsg);
-					nng_ctx_send(work->bridge_ctx,
-					    work->bridge_aio);
-				}
+			if (rate_limit_enabled() && !pub_rate_admit(work)) {
+				break;
+			}
+			if (pub_mem_shed(work)) {
+				break;
 			}
+			pub_recv(work);
 		} else if (nng_msg_cmd_type(msg) == CMD_CONNACK) {
 			nng_msg_set_pipe(work->msg, work->pid);
+			nano_mem_add(NANO_MEM_CONN, MEM_GUARD_CONN_BYTES);
+			if (mem_guard_refuse(MEM_GUARD_CONNECT)) {
+				conn_mem_refuse(work);
+				break;
+			}
 
+			rate_limit_open(work->pid.id);
 			if (work->cparam != NULL) {
 				// avoid being free
 				conn_param_clone(work->cparam);
+				inflight_open(work->pid.id,
+				    conn_param_get_rx_max(work->cparam),
+				    conn_param_get_keepalive(work->cparam));
 			}
 			// restore clean session
 			char *clientid =
@@ -232,29 +1006,32 @@ server_cb(void *arg)
 				    work->pid.id, work->db);
 			}
 
-			// clone for sending connect event notification
-			nng_msg_clone(work->msg);
+			// the connect event is published by a sys event work
+			if (sys_event_enabled()) {
+				uint8_t *header = nng_msg_header(work->msg);
+				uint8_t  flag   = *(header + 3);
+				smsg =
+				    nano_msg_notify_connect(work->cparam, flag);
+				nng_msg_set_cmd_type(smsg, CMD_PUBLISH);
+				sys_event_post(smsg);
+				smsg = NULL;
+			}
+			metrics_msg_out(work->msg);
 			nng_aio_set_msg(work->aio, work->msg);
+			work->msg = NULL;
 			nng_ctx_send(work->ctx, work->aio); // send connack
 
-			uint8_t *header = nng_msg_header(work->msg);
-			uint8_t  flag   = *(header + 3);
-			smsg = nano_msg_notify_connect(work->cparam, flag);
-
-			nng_msg_set_cmd_type(smsg, CMD_PUBLISH);
-			nng_msg_free(work->msg);
-			work->msg = smsg;
-			handle_pub(work, work->pipe_ct);
-
 			// Free here due to the clone before
 			conn_param_free(work->cparam);
-
+			work->state = SEND;
+			nng_aio_finish(work->aio, 0);
+			break;
 		} else if (nng_msg_cmd_type(msg) == CMD_DISCONNECT_EV) {
 			nng_msg_set_cmd_type(work->msg, CMD_PUBLISH);
-			handle_pub(work, work->pipe_ct);
+			sys_event_post(work->msg);
+			work->msg = NULL;
 			// cache session
-			client_ctx *cli_ctx = NULL;
-			char *      clientid =
+			char *clientid =
 			    (char *) conn_param_get_clientid(work->cparam);
 			if (clientid != NULL &&
 			    conn_param_get_clean_start(work->cparam) == 0) {
@@ -263,30 +1040,27 @@ server_cb(void *arg)
 			}
 			// free client ctx
 			if (check_id(work->pid.id)) {
-				topic_queue *tq = get_topic(work->pid.id);
-				while (tq) {
-					if (tq->topic) {
-						cli_ctx = dbtree_delete_client(
-						    work->db, tq->topic, 0,
-						    work->pid.id);
-					}
-					del_sub_ctx(cli_ctx, tq->topic);
-					tq = tq->next;
-				}
-				del_topic_all(work->pid.id);
+				del_pipe_subs(work);
 			} else {
 				debug_msg("ERROR it should not happen");
 			}
+			inflight_close(work->pid.id);
+			pipe_queue_drop(work->pid.id);
+			pipe_alias_drop(work->pid.id);
+			nano_mem_sub(NANO_MEM_CONN, MEM_GUARD_CONN_BYTES);
 			cparam       = work->cparam;
 			work->cparam = NULL;
 			conn_param_free(cparam);
+			work->state = RECV;
+			work_pool_recv(work);
+			break;
 		}
 		work->state = WAIT;
 		nng_aio_finish(work->aio, 0);
 		// nng_aio_finish_sync(work->aio, 0);
 		break;
 	case WAIT:
-		debug_msg("WAIT ^^^^ ctx%d ^^^^", work->ctx.id);
+		log_trace("WAIT ^^^^ ctx%d ^^^^", work->ctx.id);
 		if (nng_msg_cmd_type(work->msg) == CMD_PINGREQ) {
 			smsg = work->msg;
 			nng_msg_clear(smsg);
@@ -297,6 +1071,7 @@ server_cb(void *arg)
 			work->msg = smsg;
 			work->pid = nng_msg_get_pipe(work->msg);
 			nng_msg_set_pipe(work->msg, work->pid);
+			metrics_msg_out(work->msg);
 			nng_aio_set_msg(work->aio, work->msg);
 			work->msg   = NULL;
 			work->state = SEND;
@@ -312,6 +1087,7 @@ server_cb(void *arg)
 			work->msg = smsg;
 			work->pid = nng_msg_get_pipe(work->msg);
 			nng_msg_set_pipe(work->msg, work->pid);
+			metrics_msg_out(work->msg);
 			nng_aio_set_msg(work->aio, work->msg);
 			work->msg   = NULL;
 			work->state = SEND;
@@ -319,7 +1095,7 @@ server_cb(void *arg)
 			smsg = NULL;
 			nng_aio_finish(work->aio, 0);
 		} else if (nng_msg_cmd_type(work->msg) == CMD_SUBSCRIBE) {
-			nng_msg_alloc(&smsg, 0);
+			nnl_msg_get(msg_pool, &smsg);
 			work->pid     = nng_msg_get_pipe(work->msg);
 			work->sub_pkt = nng_alloc(sizeof(packet_subscribe));
 			if (work->sub_pkt == NULL) {
@@ -334,37 +1110,23 @@ server_cb(void *arg)
 					del_topic_all(work->pid.id);
 				}
 			}
-			nng_msg_free(work->msg);
+			nnl_msg_put(msg_pool, &work->msg);
 			destroy_sub_pkt(work->sub_pkt,
 			    conn_param_get_protover(work->cparam));
-			// handle retain
-			if (work->msg_ret) {
-				debug_msg("retain msg [%p] size [%ld] \n",
-				    work->msg_ret,
-				    cvector_size(work->msg_ret));
-				for (int i = 0;
-				     i < cvector_size(work->msg_ret); i++) {
-					nng_msg *m = work->msg_ret[i];
-					nng_msg_clone(m);
-					work->msg = m;
-					nng_aio_set_msg(work->aio, work->msg);
-					nng_msg_set_pipe(work->msg, work->pid);
-					nng_ctx_send(work->ctx, work->aio);
-				}
-				cvector_free(work->msg_ret);
-			}
 			nng_msg_set_cmd_type(smsg, CMD_SUBACK);
 			work->msg = smsg;
 			nng_msg_set_pipe(work->msg, work->pid);
+			metrics_msg_out(work->msg);
 			nng_aio_set_msg(work->aio, work->msg);
-			work->msg   = NULL;
-			work->state = SEND;
+			work->msg = NULL;
+			// handle retain after SUBACK
+			work->state = work->retain_cur ? RETAIN : SEND;
 			nng_ctx_send(work->ctx, work->aio);
 			smsg = NULL;
 			nng_aio_finish(work->aio, 0);
 			break;
 		} else if (nng_msg_cmd_type(work->msg) == CMD_UNSUBSCRIBE) {
-			nng_msg_alloc(&smsg, 0);
+			nnl_msg_get(msg_pool, &smsg);
 			work->unsub_pkt =
 			    nng_alloc(sizeof(packet_unsubscribe));
 			work->pid = nng_msg_get_pipe(work->msg);
@@ -379,11 +1141,12 @@ server_cb(void *arg)
 			}
 			// free unsub_pkt
 			destroy_unsub_ctx(work->unsub_pkt);
-			nng_msg_free(work->msg);
+			nnl_msg_put(msg_pool, &work->msg);
 
 			work->msg    = smsg;
 			work->pid.id = 0;
 			nng_msg_set_pipe(work->msg, work->pid);
+			metrics_msg_out(work->msg);
 			nng_aio_set_msg(work->aio, work->msg);
 			work->msg   = NULL;
 			work->state = SEND;
@@ -399,80 +1162,82 @@ server_cb(void *arg)
 			smsg      = work->msg; // reuse the same msg
 			work->msg = NULL;
 
-			debug_msg("total pipes: %d", work->pipe_ct->total);
-			// TODO rewrite this part.
+			log_trace("total pipes: %d", work->pipe_ct->total);
 			if (work->pipe_ct->total > 0) {
-				p_info = work->pipe_ct->pipe_info
-				             [work->pipe_ct->current_index];
-				work->pipe_ct->encode_msg(smsg, p_info.work,
-				    p_info.cmd, p_info.qos, 0);
-				while (work->pipe_ct->total >
-				    work->pipe_ct->current_index) {
-					p_info =
-					    work->pipe_ct->pipe_info
-					        [work->pipe_ct->current_index];
-					nng_msg_clone(smsg);
-					work->msg = smsg;
-
-					nng_aio_set_prov_extra(work->aio, 0,
-					    (void *) (intptr_t) p_info.qos);
-					nng_aio_set_msg(work->aio, work->msg);
-					work->pid.id = p_info.pipe;
-					nng_msg_set_pipe(work->msg, work->pid);
-					work->msg = NULL;
-					work->pipe_ct->current_index++;
-					nng_ctx_send(work->ctx, work->aio);
-				}
-				if (work->pipe_ct->total <=
-				    work->pipe_ct->current_index) {
-					free_pub_packet(work->pub_packet);
-					free_pipes_info(
-					    work->pipe_ct->pipe_info);
-					init_pipe_content(work->pipe_ct);
-				}
-				work->state = SEND;
-				nng_msg_free(smsg);
+				pub_multicast(work, smsg);
 				smsg = NULL;
-				nng_aio_finish(work->aio, 0);
 				break;
 			} else {
+				if (work->trace.start != 0) {
+					metrics_trace_end(&work->trace,
+					    work->pub_packet->variable_header
+					        .publish.topic_name.body);
+				}
 				if (smsg) {
 					nng_msg_free(smsg);
 				}
-				free_pub_packet(work->pub_packet);
-				free_pipes_info(work->pipe_ct->pipe_info);
-				init_pipe_content(work->pipe_ct);
+				reset_pipe_content(work->pipe_ct);
 			}
 
 			if (work->state != SEND) {
 				if (work->msg != NULL)
 					nng_msg_free(work->msg);
 				work->msg = NULL;
+				if (work->unpack != NULL &&
+				    pub_unpack_next(work)) {
+					nng_aio_finish(work->aio, 0);
+					break;
+				}
+				if (work->proto == PROTO_SYS_EVENT) {
+					work->state = EVENT;
+					nng_sleep_aio(
+					    work->config->sys_event.interval,
+					    work->aio);
+					break;
+				}
+				if (work->proto == PROTO_SHM_INGEST) {
+					work->state = INGEST;
+					nng_aio_finish(work->aio, 0);
+					break;
+				}
 				if (work->proto == PROTO_MQTT_BRIDGE) {
 					work->state = BRIDGE;
 				} else {
 					work->state = RECV;
 				}
-				nng_ctx_recv(work->ctx, work->aio);
+				work_pool_recv(work);
 			}
 		} else if (nng_msg_cmd_type(work->msg) == CMD_PUBACK ||
 		    nng_msg_cmd_type(work->msg) == CMD_PUBREL ||
 		    nng_msg_cmd_type(work->msg) == CMD_PUBCOMP) {
-			nng_msg_free(work->msg);
-			work->msg   = NULL;
+			inflight_ack(work->pid.id, nng_msg_cmd_type(work->msg));
+			nnl_msg_put(msg_pool, &work->msg);
+			// the window moved, send what is held for the pipe
+			if (pub_release_held(work)) {
+				break;
+			}
 			work->state = RECV;
-			nng_ctx_recv(work->ctx, work->aio);
+			work_pool_recv(work);
 			break;
 		} else {
 			debug_msg("broker has nothing to do");
-			if (work->msg != NULL)
-				nng_msg_free(work->msg);
-			work->msg   = NULL;
+			nnl_msg_put(msg_pool, &work->msg);
 			work->state = RECV;
-			nng_ctx_recv(work->ctx, work->aio);
+			work_pool_recv(work);
 			break;
 		}
 		break;
+	case THROTTLE:
+		// the PUBLISH held back is within the limits of its pipe now,
+		// admitted by memory like one just received
+		rate_limit_pause_end();
+		if (pub_mem_shed(work)) {
+			break;
+		}
+		pub_recv(work);
+		work->state = WAIT;
+		nng_aio_finish(work->aio, 0);
+		break;
 	case BRIDGE:
 		if ((rv = nng_aio_result(work->aio)) != 0) {
 			debug_msg("nng_recv_aio: %s", nng_strerror(rv));
@@ -488,6 +1253,17 @@ server_cb(void *arg)
 		work->state = RECV;
 		nng_aio_finish(work->aio, 0);
 		break;
+	case RETAIN:
+		if ((rv = nng_aio_result(work->aio)) != 0) {
+			debug_msg("RETAIN nng aio result error: %d", rv);
+			free_retain_cursors(work);
+		} else if (send_retain_batch(work)) {
+			break;
+		}
+		work->msg   = NULL;
+		work->state = RECV;
+		work_pool_recv(work);
+		break;
 	case SEND:
 		if (NULL != smsg) {
 			smsg = NULL;
@@ -496,19 +1272,87 @@ server_cb(void *arg)
 			debug_msg("SEND nng aio result error: %d", rv);
 			fatal("SEND nng_ctx_send", rv);
 		}
+		if (work->trace.start != 0) {
+			metrics_trace_mark(&work->trace, TRACE_SEND);
+			metrics_trace_end(&work->trace,
+			    work->pub_packet->variable_header.publish
+			        .topic_name.body);
+		}
 		if (work->pipe_ct->total > 0) {
-			free_pub_packet(work->pub_packet);
-			free_pipes_info(work->pipe_ct->pipe_info);
-			init_pipe_content(work->pipe_ct);
+			reset_pipe_content(work->pipe_ct);
 		}
 		work->msg = NULL;
+		if (work->unpack != NULL && pub_unpack_next(work)) {
+			work->state = WAIT;
+			nng_aio_finish(work->aio, 0);
+			break;
+		}
 		if (work->proto == PROTO_MQTT_BRIDGE) {
 			work->state = BRIDGE;
 			nng_ctx_recv(work->bridge_ctx, work->aio);
+		} else if (work->proto == PROTO_SYS_EVENT) {
+			work->state = EVENT;
+			nng_sleep_aio(
+			    work->config->sys_event.interval, work->aio);
+		} else if (work->proto == PROTO_SHM_INGEST) {
+			work->state = INGEST;
+			nng_aio_finish(work->aio, 0);
 		} else {
 			work->state = RECV;
-			nng_ctx_recv(work->ctx, work->aio);
+			work_pool_recv(work);
+		}
+		break;
+	case RESEND:
+		// never receives, it runs the keepalive timers, the transport
+		// sends unacknowledged QoS 1/2 msgs again itself
+		inflight_tick(nng_clock());
+		nng_sleep_aio(INFLIGHT_TICK_MS, work->aio);
+		break;
+	case EVENT:
+		// never receives, it publishes what sys_event has queued
+		work->pub_packet = NULL;
+		nano_arena_reset(&work->arena);
+		if ((smsg = metrics_sys_msg(nng_clock(),
+		         work->config->sys_event.metrics_interval)) != NULL) {
+			sys_event_post(smsg);
+			smsg = NULL;
+		}
+		// a route update is not queued, it is never coalesced
+		if ((work->msg = route_sys_msg(nng_clock())) == NULL &&
+		    (work->msg = sys_event_take()) == NULL) {
+			nng_sleep_aio(SYS_EVENT_IDLE_MS, work->aio);
+			break;
 		}
+		work->cparam = NULL;
+		work->pid.id = 0;
+		handle_pub(work, work->pipe_ct);
+		work->state = WAIT;
+		nng_aio_finish(work->aio, 0);
+		break;
+	case INGEST:
+		// never receives, it publishes what local processes put on
+		// the shm rings, bridged like one received
+		work->pub_packet  = NULL;
+		work->trace.start = 0;
+		nano_arena_reset(&work->arena);
+		if ((work->msg = shm_ingest_take()) == NULL) {
+			nng_sleep_aio(work->config->shm.interval, work->aio);
+			break;
+		}
+		work->cparam = NULL;
+		work->pid.id = 0;
+		pub_recv(work);
+		work->state = WAIT;
+		nng_aio_finish(work->aio, 0);
+		break;
+	case FANOUT:
+		// never receives, it sends the parts of large fan-outs posted
+		// to its shard, woken from its sleep by a post
+		if ((part = fanout_take(work->shard, work->aio)) == NULL) {
+			break;
+		}
+		pub_fanout_send(work, part);
+		nng_aio_finish(work->aio, 0);
 		break;
 	default:
 		fatal("bad state!", NNG_ESTATE);
@@ -537,27 +1381,45 @@ alloc_work(nng_socket sock)
 
 	w->pipe_ct = nng_alloc(sizeof(struct pipe_content));
 	init_pipe_content(w->pipe_ct);
+	nano_arena_init(&w->arena, NANO_WORK_ARENA_SIZE);
+	w->pub_packet   = NULL;
+	w->unpack       = NULL;
+	w->bridge_links = NULL;
+	w->trace.start  = 0;
+	w->fanout       = NULL;
+	w->shard        = 0;
+	w->pool_state   = WORK_POOL_NONE;
 
 	w->state = INIT;
 	return (w);
 }
 
 nano_work *
-proto_work_init(nng_socket sock, nng_socket bridge_sock, uint8_t proto,
-    dbtree *db_tree, dbtree *db_tree_ret, conf *config)
+proto_work_init(nng_socket sock, nng_socket *bridge_socks, uint8_t proto,
+    dbtree *db_tree, nano_retain *retain, conf *config)
 {
 	int        rv;
+	uint32_t   links = config->bridge.links;
 	nano_work *w;
 	w         = alloc_work(sock);
 	w->db     = db_tree;
-	w->db_ret = db_tree_ret;
+	w->retain = retain;
 	w->proto  = proto;
 	w->config = config;
 
 	if (config->bridge.bridge_mode) {
-		if ((rv = nng_ctx_open(&w->bridge_ctx, bridge_sock)) != 0) {
+		rv = nng_ctx_open(&w->bridge_ctx, bridge_socks[0]);
+		if (rv != 0) {
 			fatal("nng_ctx_open", rv);
 		}
+		w->bridge_links    = nng_alloc(sizeof(nng_ctx) * links);
+		w->bridge_links[0] = w->bridge_ctx;
+		for (uint32_t i = 1; i < links; i++) {
+			if ((rv = nng_ctx_open(
+			         &w->bridge_links[i], bridge_socks[i])) != 0) {
+				fatal("nng_ctx_open", rv);
+			}
+		}
 		if ((rv = nng_aio_alloc(&w->bridge_aio, NULL, NULL) != 0)) {
 			fatal("nng_aio_alloc", rv);
 		}
@@ -566,8 +1428,48 @@ proto_work_init(nng_socket sock, nng_socket bridge_sock, uint8_t proto,
 	return w;
 }
 
-static dbtree *db     = NULL;
-static dbtree *db_ret = NULL;
+static dbtree *     db     = NULL;
+static nano_retain *retain = NULL;
+
+// what the works the pool grows by are made with
+static nng_socket  pool_sock;
+static nng_socket *pool_bridge_socks = NULL;
+static conf *      pool_conf         = NULL;
+
+static nano_work *
+pool_work_alloc(void)
+{
+	return proto_work_init(pool_sock, pool_bridge_socks,
+	    PROTO_MQTT_BROKER, db, retain, pool_conf);
+}
+
+// a work the pool parked, freeing its aio waits for its callback
+static void
+pool_work_free(nano_work *w)
+{
+	uint32_t links = pool_conf->bridge.links;
+
+	nng_aio_free(w->aio);
+	nng_ctx_close(w->ctx);
+	if (w->bridge_links != NULL) {
+		for (uint32_t i = 0; i < links; i++) {
+			nng_ctx_close(w->bridge_links[i]);
+		}
+		nng_free(w->bridge_links, sizeof(nng_ctx) * links);
+		nng_aio_free(w->bridge_aio);
+	}
+	nng_mtx_free(w->mutex);
+	zfree(w->pipe_ct->pipe_info);
+	nng_free(w->pipe_ct, sizeof(struct pipe_content));
+	nano_arena_fini(&w->arena);
+	nng_free(w, sizeof(*w));
+}
+
+static const work_pool_ops pool_ops = {
+	.alloc = pool_work_alloc,
+	.start = server_cb,
+	.free  = pool_work_free,
+};
 
 dbtree *
 get_broker_db(void)
@@ -575,27 +1477,163 @@ get_broker_db(void)
 	return db;
 }
 
+nano_retain *
+get_broker_retain(void)
+{
+	return retain;
+}
+
+#ifdef NNG_SUPP_TLS
+static nng_listener tls_listener = NNG_LISTENER_INITIALIZER;
+
+// a pipe of the tls listener is added once its handshake is done
+static void
+tls_pipe_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
+{
+	(void) arg;
+	if (nng_pipe_listener(p).id == tls_listener.id) {
+		metrics_tls_pipe(ev == NNG_PIPE_EV_ADD_POST);
+	}
+}
+
+// the PEM of path 0 terminated, NULL if it can not be read
+static char *
+tls_load_pem(const char *path)
+{
+	unsigned char *buf = NULL;
+	int            n   = path != NULL ? file_size(path) : 0;
+
+	if (n <= 0 || file_read_bin(path, &buf, 0, n) != n) {
+		free(buf);
+		log_warn("tls file %s can not be read", path ? path : "");
+		return NULL;
+	}
+	buf[n] = '\0';
+	return (char *) buf;
+}
+
+/**
+ * @brief listen_tls - Start the TLS listener of tls.url on sock, with the
+ * certificate and key of tls and the CA chain if clients are verified.
+ * @param sock - nmq socket
+ * @param tls - conf_tls
+ * @return 0, or the error of nng
+ */
+static int
+listen_tls(nng_socket sock, conf_tls *tls)
+{
+	nng_tls_config *cfg;
+	char *          cert = NULL, *key = NULL, *ca = NULL;
+	int             rv;
+
+	if ((rv = nng_tls_config_alloc(&cfg, NNG_TLS_MODE_SERVER)) != 0) {
+		return rv;
+	}
+	cert = tls_load_pem(tls->certfile);
+	key  = tls_load_pem(tls->keyfile);
+	if (cert == NULL || key == NULL) {
+		rv = NNG_EINVAL;
+		goto out;
+	}
+	rv = nng_tls_config_own_cert(cfg, cert, key, tls->key_password);
+	if (rv != 0) {
+		goto out;
+	}
+	if (tls->verify_peer) {
+		if ((ca = tls_load_pem(tls->cafile)) == NULL) {
+			rv = NNG_EINVAL;
+			goto out;
+		}
+		if ((rv = nng_tls_config_ca_chain(cfg, ca, NULL)) != 0) {
+			goto out;
+		}
+		nng_tls_config_auth_mode(cfg,
+		    tls->fail_if_no_peer_cert ? NNG_TLS_AUTH_MODE_REQUIRED
+		                              : NNG_TLS_AUTH_MODE_OPTIONAL);
+	} else {
+		nng_tls_config_auth_mode(cfg, NNG_TLS_AUTH_MODE_NONE);
+	}
+
+	if ((rv = nng_listener_create(&tls_listener, sock, tls->url)) != 0 ||
+	    (rv = nng_listener_setopt_ptr(
+	         tls_listener, NNG_OPT_TLS_CONFIG, cfg)) != 0) {
+		goto out;
+	}
+	nng_pipe_notify(sock, NNG_PIPE_EV_ADD_POST, tls_pipe_cb, NULL);
+	nng_pipe_notify(sock, NNG_PIPE_EV_REM_POST, tls_pipe_cb, NULL);
+	rv = nng_listener_start(tls_listener, 0);
+
+out:
+	// the listener holds a reference of its own
+	nng_tls_config_free(cfg);
+	free(cert);
+	free(key);
+	free(ca);
+	return rv;
+}
+#endif
+
 int
 broker(conf *nanomq_conf)
 {
 	nng_socket sock;
 
-	nng_socket bridge_sock;
-	nng_pipe   pipe_id;
-	int        rv;
-	int        i;
+	nng_socket *bridge_socks = NULL;
+	nng_pipe    pipe_id;
+	int         rv;
+	int         i;
 	// add the num of other proto
 	uint64_t    num_ctx = nanomq_conf->parallel;
+	uint64_t    ev_ctx  = 0;
+	uint64_t    shm_ctx = 0;
+	uint64_t    fan_ctx = 0;
 	const char *url     = nanomq_conf->url;
 
+	nnl_msg_pool_create(&msg_pool);
 	// init tree
 	dbtree_create(&db);
 	if (db == NULL) {
 		debug_msg("NNL_ERROR error in db create");
+	} else {
+		if (nanomq_conf->match_cache_size > 0) {
+			dbtree_match_cache_init(
+			    db, nanomq_conf->match_cache_size);
+		}
+		dbtree_set_shared_strategy(
+		    db, nanomq_conf->shared_strategy, inflight_count);
+		dbtree_set_session_queue(db, nanomq_conf->session_queue_size,
+		    nanomq_conf->session_overflow, session_msg_free);
 	}
-	dbtree_create(&db_ret);
-	if (db_ret == NULL) {
-		debug_msg("NNL_ERROR error in db create");
+	pipe_queue_init(
+	    nanomq_conf->sub_queue_size, nanomq_conf->sub_queue_overflow,
+	    nanomq_conf->sub_queue_conflate);
+	pipe_alias_init(
+	    nanomq_conf->topic_alias_max, nanomq_conf->topic_alias_out);
+	metrics_trace_init(&nanomq_conf->trace);
+	inflight_init();
+	nano_retain_opt retain_opt = {
+		.mem_limit = nanomq_conf->retain.mem_limit > 0
+		    ? (size_t) nanomq_conf->retain.mem_limit
+		    : 0,
+		.eviction           = nanomq_conf->retain.eviction,
+		.compress_threshold = nanomq_conf->retain.compress_threshold > 0
+		    ? (size_t) nanomq_conf->retain.compress_threshold
+		    : 0,
+	};
+	if ((retain = nano_retain_create(&retain_opt)) == NULL) {
+		debug_msg("NNL_ERROR error in retain create");
+	}
+	if (db != NULL) {
+		// before the replay, which queues session messages
+		reaper_start(nanomq_conf, db, retain);
+	}
+	if (nanomq_conf->snapshot.enable && db != NULL) {
+		// sessions are on the tree before their messages are replayed
+		snapshot_start(&nanomq_conf->snapshot, db);
+		signal(SIGTERM, termHandler);
+	}
+	if (nanomq_conf->persistence.enable && db != NULL && retain != NULL) {
+		persistence_start(&nanomq_conf->persistence, db, retain);
 	}
 
 	/*  Create the socket. */
@@ -609,22 +1647,62 @@ broker(conf *nanomq_conf)
 
 	if (nanomq_conf->bridge.bridge_mode) {
 		num_ctx += nanomq_conf->bridge.parallel;
-		bridge_client(&bridge_sock, &nanomq_conf->bridge);
+		bridge_socks =
+		    nng_alloc(sizeof(nng_socket) * nanomq_conf->bridge.links);
+		bridge_client(bridge_socks, &nanomq_conf->bridge);
 	}
+	sys_event_init(&nanomq_conf->sys_event);
+	route_init(&nanomq_conf->sys_event, db);
+	capture_init(&nanomq_conf->capture);
+	mem_guard_init(&nanomq_conf->mem, db, retain);
+	rate_limit_init(&nanomq_conf->rate_limit, nanomq_conf->parallel);
+	// route updates are published by the sys event works too
+	if (sys_event_enabled() || nanomq_conf->sys_event.route_interval > 0) {
+		ev_ctx = SYS_EVENT_WORKS;
+		num_ctx += ev_ctx;
+	}
+	if (shm_ingest_init(&nanomq_conf->shm) > 0) {
+		shm_ctx = SHM_INGEST_WORKS;
+		num_ctx += shm_ctx;
+	}
+	num_ctx += INFLIGHT_WORKS;
+	// fanout works last, after all the others
+	fan_ctx = fanout_init(nanomq_conf);
 
-	struct work *works[num_ctx];
+	// broker works first, the pool takes them over
+	nano_work **works = zmalloc(sizeof(nano_work *) * (num_ctx + fan_ctx));
 
 	for (i = 0; i < nanomq_conf->parallel; i++) {
-		works[i] = proto_work_init(sock, bridge_sock,
-		    PROTO_MQTT_BROKER, db, db_ret, nanomq_conf);
+		works[i] = proto_work_init(sock, bridge_socks,
+		    PROTO_MQTT_BROKER, db, retain, nanomq_conf);
 	}
 
 	if (nanomq_conf->bridge.bridge_mode) {
-		for (i = nanomq_conf->parallel; i < num_ctx; i++) {
-			works[i] = proto_work_init(sock, bridge_sock,
-			    PROTO_MQTT_BRIDGE, db, db_ret, nanomq_conf);
+		for (i = nanomq_conf->parallel;
+		     i < num_ctx - ev_ctx - shm_ctx - INFLIGHT_WORKS; i++) {
+			works[i] = proto_work_init(sock, bridge_socks,
+			    PROTO_MQTT_BRIDGE, db, retain, nanomq_conf);
 		}
 	}
+	for (i = num_ctx - ev_ctx - shm_ctx - INFLIGHT_WORKS;
+	     i < num_ctx - shm_ctx - INFLIGHT_WORKS; i++) {
+		works[i] = proto_work_init(sock, bridge_socks, PROTO_SYS_EVENT,
+		    db, retain, nanomq_conf);
+	}
+	for (i = num_ctx - shm_ctx - INFLIGHT_WORKS;
+	     i < num_ctx - INFLIGHT_WORKS; i++) {
+		works[i] = proto_work_init(sock, bridge_socks,
+		    PROTO_SHM_INGEST, db, retain, nanomq_conf);
+	}
+	for (i = num_ctx - INFLIGHT_WORKS; i < num_ctx; i++) {
+		works[i] = proto_work_init(sock, bridge_socks, PROTO_INFLIGHT,
+		    db, retain, nanomq_conf);
+	}
+	for (i = num_ctx; i < num_ctx + fan_ctx; i++) {
+		works[i] = proto_work_init(sock, bridge_socks, PROTO_FANOUT,
+		    db, retain, nanomq_conf);
+	}
+	num_ctx += fan_ctx;
 
 	if ((rv = nng_listen(sock, url, NULL, 0)) != 0) {
 		fatal("nng_listen", rv);
@@ -638,9 +1716,26 @@ broker(conf *nanomq_conf)
 		}
 	}
 
+	if (nanomq_conf->tls.enable) {
+#ifdef NNG_SUPP_TLS
+		if ((rv = listen_tls(sock, &nanomq_conf->tls)) != 0) {
+			fatal("nng_listen tls", rv);
+		}
+#else
+		log_warn("built without tls, %s is not listened on",
+		    nanomq_conf->tls.url);
+#endif
+	}
+
+	pool_sock         = sock;
+	pool_bridge_socks = bridge_socks;
+	pool_conf         = nanomq_conf;
+	work_pool_start(nanomq_conf, works, &pool_ops);
+
 	for (i = 0; i < num_ctx; i++) {
 		server_cb(works[i]); // this starts them going (INIT state)
 	}
+	zfree(works);
 
 #if (defined DEBUG) && (defined ASAN)
 	signal(SIGINT, intHandler);
@@ -648,12 +1743,21 @@ broker(conf *nanomq_conf)
 		if (keepRunning == 0) {
 			exit(0);
 		}
+		if (termRequested) {
+			snapshot_stop();
+			exit(0);
+		}
 		nng_msleep(6000);
 	}
 #else
-	for (;;) {
-		nng_msleep(3600000); // neither pause() nor sleep() portable
+	while (!termRequested) {
+		nng_msleep(1000); // neither pause() nor sleep() portable
 	}
+	// broker_stop, the sessions are saved for the next start
+	snapshot_stop();
+	persistence_stop();
+	bridge_batch_stop();
+	exit(0);
 #endif
 }
 
@@ -866,6 +1970,8 @@ broker_start(int argc, char **argv)
 	char *bridge_conf_path = NULL;
 	conf *nanomq_conf;
 
+	nano_log_opt log_opt;
+
 	if (!status_check(&pid)) {
 		fprintf(stderr,
 		    "One NanoMQ instance is still running, a new instance "
@@ -909,12 +2015,28 @@ broker_start(int argc, char **argv)
 		    ? nanomq_conf->websocket.url
 		    : nng_strdup(CONF_WS_URL_DEFAULT);
 	}
+	if (nanomq_conf->tls.enable) {
+		nanomq_conf->tls.url = nanomq_conf->tls.url != NULL
+		    ? nanomq_conf->tls.url
+		    : nng_strdup(CONF_TLS_URL_DEFAULT);
+	}
 
+	nano_log_set_level(nanomq_conf->log.level);
 	print_conf(nanomq_conf);
 	print_bridge_conf(&nanomq_conf->bridge);
 
 	active_conf(nanomq_conf);
 
+	// the writer is a thread, start it once the daemon is forked
+	log_opt.level          = nanomq_conf->log.level;
+	log_opt.to             = nanomq_conf->log.to;
+	log_opt.file           = nanomq_conf->log.file;
+	log_opt.flush_interval = 0;
+	if (log_opt.file == NULL) {
+		log_opt.file = CONF_LOG_FILE_DEFAULT;
+	}
+	nano_log_open(&log_opt);
+
 	if (nanomq_conf->http_server.enable) {
 		start_rest_server(nanomq_conf);
 	}
@@ -928,6 +2050,7 @@ broker_start(int argc, char **argv)
 	if (nanomq_conf->http_server.enable) {
 		stop_rest_server();
 	}
+	nano_log_close();
 	exit(rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
@@ -17,6 +17,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <nng/mqtt/mqtt_client.h>
 #include <nng/nng.h>
@@ -39,11 +41,15 @@ static void fatal(const char *msg, ...);
 		fatal(fmt, ##__VA_ARGS__); \
 	}
 
+// A bench payload starts with the send time in ns, the publisher and the
+// sequence number of the message, all big endian.
+#define BENCH_HDR_LEN 16
+
 struct topic {
 	struct topic *next;
 	char *        val;
 };
-enum client_type { PUB, SUB, CONN };
+enum client_type { PUB, SUB, CONN, BENCH };
 
 struct client_opts {
 	enum client_type type;
@@ -77,6 +83,12 @@ struct client_opts {
 	char *           key;
 	size_t           key_len;
 	char *           keypass;
+	size_t           pubs;     // publisher connections of a bench
+	size_t           subs;     // subscriber connections of a bench
+	size_t           rate;     // msg/s of all publishers, 0 is unpaced
+	size_t           duration; // s a bench publishes if count is 0
+	size_t           size;     // bytes of a bench payload
+	bool             json;
 };
 
 typedef struct client_opts client_opts;
@@ -112,6 +124,12 @@ enum options {
 	OPT_KEYPASS,
 	OPT_MSG,
 	OPT_FILE,
+	OPT_PUBS,
+	OPT_SUBS,
+	OPT_RATE,
+	OPT_DURATION,
+	OPT_SIZE,
+	OPT_JSON,
 };
 
 static nng_optspec cmd_opts[] = {
@@ -171,6 +189,12 @@ static nng_optspec cmd_opts[] = {
 
 	{ .o_name = "msg", .o_short = 'm', .o_val = OPT_MSG, .o_arg = true },
 	{ .o_name = "file", .o_short = 'f', .o_val = OPT_FILE, .o_arg = true },
+	{ .o_name = "pubs", .o_val = OPT_PUBS, .o_arg = true },
+	{ .o_name = "subs", .o_val = OPT_SUBS, .o_arg = true },
+	{ .o_name = "rate", .o_val = OPT_RATE, .o_arg = true },
+	{ .o_name = "duration", .o_val = OPT_DURATION, .o_arg = true },
+	{ .o_name = "size", .o_val = OPT_SIZE, .o_arg = true },
+	{ .o_name = "json", .o_val = OPT_JSON },
 
 	{ .o_name = NULL, .o_val = 0 },
 };
@@ -219,6 +243,10 @@ help(enum client_type type)
 		printf("Usage: nanomq conn { start | stop } <addr> "
 		       "[<opts>...]\n\n");
 		break;
+	case BENCH:
+		printf("Usage: nanomq bench start <addr> [<topic>...] "
+		       "[<opts>...]\n\n");
+		break;
 
 	default:
 		break;
@@ -230,7 +258,7 @@ help(enum client_type type)
 	printf("                                   [default: "
 	       "mqtt-tcp://127.0.0.1:1883]\n");
 
-	if (type == PUB || type == SUB) {
+	if (type == PUB || type == SUB || type == BENCH) {
 		printf("\n<topic> must be set:\n");
 		printf(
 		    "  -t, --topic <topic>              Topic for publish or "
@@ -289,6 +317,29 @@ help(enum client_type type)
 		printf("  -m, --msg  <data>                \n");
 		printf("  -f, --file <file>                \n");
 	}
+	if (type == BENCH) {
+		printf("\n<bench> may be any of:\n");
+		printf("  --pubs <num>                     Publisher "
+		       "connections [default: 1]\n");
+		printf("  --subs <num>                     Subscriber "
+		       "connections [default: 1]\n");
+		printf("  --rate <num>                     Messages per "
+		       "second of all publishers, 0 is as fast as possible "
+		       "[default: 0]\n");
+		printf("  -C, --count <num>                Messages of each "
+		       "publisher, 0 publishes for --duration [default: "
+		       "0]\n");
+		printf("  --duration <s>                   Seconds to publish "
+		       "[default: 10]\n");
+		printf("  --size <bytes>                   Payload size, at "
+		       "least %d [default: 64]\n",
+		    BENCH_HDR_LEN);
+		printf("  --json                           Print the results "
+		       "as JSON\n");
+		printf("\nEach payload starts with its send time, subscribers "
+		       "on other hosts need synced clocks.\nLoss assumes "
+		       "every subscriber gets every message.\n");
+	}
 }
 
 static int
@@ -489,6 +540,24 @@ client_parse_opts(int argc, char **argv, client_opts *opts)
 			    "only once.");
 			loadfile(arg, (void **) &opts->msg, &opts->msg_len);
 			break;
+		case OPT_PUBS:
+			opts->pubs = intarg(arg, 1024000);
+			break;
+		case OPT_SUBS:
+			opts->subs = intarg(arg, 1024000);
+			break;
+		case OPT_RATE:
+			opts->rate = intarg(arg, 10240000);
+			break;
+		case OPT_DURATION:
+			opts->duration = intarg(arg, 10240000);
+			break;
+		case OPT_SIZE:
+			opts->size = intarg(arg, 268435455);
+			break;
+		case OPT_JSON:
+			opts->json = true;
+			break;
 		}
 	}
 	switch (rv) {
@@ -534,6 +603,20 @@ client_parse_opts(int argc, char **argv, client_opts *opts)
 	case CONN:
 		/* code */
 		break;
+	case BENCH:
+		if (opts->topic_count == 0) {
+			fatal("Missing required option: '(-t, --topic) "
+			      "<topic>'\nTry 'nanomq bench --help' for more "
+			      "information. ");
+		}
+		if (opts->size < BENCH_HDR_LEN) {
+			fatal("Option --size must be at least %d.",
+			    BENCH_HDR_LEN);
+		}
+		if (opts->pubs == 0 && opts->subs == 0) {
+			fatal("Nothing to bench with --pubs 0 --subs 0.");
+		}
+		break;
 
 	default:
 		break;
@@ -556,6 +639,12 @@ set_default_conf(client_opts *opts)
 	opts->enable_ssl    = false;
 	opts->verbose       = false;
 	opts->topic_count   = 0;
+	opts->pubs          = 1;
+	opts->subs          = 1;
+	opts->rate          = 0;
+	opts->duration      = 10;
+	opts->size          = 64;
+	opts->json          = false;
 }
 
 // This reads a file into memory.  Care is taken to ensure that
@@ -697,6 +786,8 @@ client_cb(void *arg)
 			work->state = RECV;
 			nng_ctx_recv(work->ctx, work->aio);
 			break;
+		case BENCH:
+			break;
 		}
 		break;
 
@@ -822,24 +913,34 @@ connect_msg(client_opts *opts)
 }
 
 struct connect_param {
-	nng_socket * sock;
-	client_opts *opts;
+	nng_socket *     sock;
+	client_opts *    opts;
+	enum client_type type; // SUB subscribes to the topics of opts
 };
 
+static atomic_long bench_connected;
+
 static void
 connect_cb(void *connect_arg, nng_msg *msg)
 {
 	struct connect_param *param = connect_arg;
 	uint8_t ret_code = nng_mqtt_msg_get_connack_return_code(msg);
-	printf("%s(%d)\n",
-	    ret_code == 0 ? "connection established" : "connect failed",
-	    ret_code);
+	if (param->opts->type == BENCH) {
+		if (ret_code == 0) {
+			bench_connected++;
+		}
+	} else {
+		printf("%s(%d)\n",
+		    ret_code == 0 ? "connection established"
+		                  : "connect failed",
+		    ret_code);
+	}
 
 	nng_msg_free(msg);
 	msg = NULL;
 
 	if (ret_code == 0) {
-		if (param->opts->type == SUB && param->opts->topic_count > 0) {
+		if (param->type == SUB && param->opts->topic_count > 0) {
 			// Connected succeed
 			nng_mqtt_msg_alloc(&msg, 0);
 			nng_mqtt_msg_set_packet_type(msg, NNG_MQTT_SUBSCRIBE);
@@ -921,7 +1022,11 @@ client(int argc, char **argv, enum client_type type)
 	}
 #endif
 
-	struct connect_param connect_arg = { .sock = &sock, .opts = opts };
+	struct connect_param connect_arg = {
+		.sock = &sock,
+		.opts = opts,
+		.type = type,
+	};
 
 	nng_mqtt_cb user_cb = {
 		.name            = "user_cb",
@@ -947,6 +1052,412 @@ client(int argc, char **argv, enum client_type type)
 	client_stop(argc, argv);
 }
 
+// Bench runs subscribers and publishers on connections of their own, each
+// connection is one socket with one context. A publisher paces its share
+// of the rate, a subscriber takes the latency of a message from the send
+// time in its payload.
+#define BENCH_HIST_SUB 16
+#define BENCH_HIST_BUCKETS (64 * BENCH_HIST_SUB)
+#define BENCH_CONNECT_WAIT 10000 // ms for all connections to be up
+#define BENCH_SUBACK_WAIT 500    // ms for the SUBACKs after a connect
+#define BENCH_GRACE 1000         // ms for messages in flight at the end
+
+struct bench_hist {
+	uint64_t count;
+	uint64_t max;
+	uint64_t bucket[BENCH_HIST_BUCKETS];
+};
+
+struct bench_conn {
+	enum client_type     type;
+	nng_socket           sock;
+	nng_dialer           dialer;
+	nng_ctx              ctx;
+	nng_aio *            aio;
+	struct connect_param param;
+	nng_mqtt_cb          cb;
+	uint32_t             id;
+	uint64_t             due;    // ns the next message of a PUB is due
+	uint64_t             period; // ns between two messages of a PUB
+	uint8_t *            payload;
+	bool                 waiting; // PUB sleeps until due
+	uint64_t             sent;
+	uint64_t             received;
+	struct bench_hist    hist;
+};
+
+static atomic_bool  bench_stop;
+static atomic_long  bench_disconnected;
+static atomic_ulong bench_pubs_done;
+
+static inline uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void
+bench_put(uint8_t *p, uint64_t v, int n)
+{
+	for (int i = n - 1; i >= 0; i--, v >>= 8) {
+		p[i] = (uint8_t) v;
+	}
+}
+
+static inline uint64_t
+bench_get(const uint8_t *p, int n)
+{
+	uint64_t v = 0;
+
+	for (int i = 0; i < n; i++) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+// log-linear histogram, 16 buckets per power of 2 are within 7%
+static void
+bench_hist_add(struct bench_hist *h, uint64_t ns)
+{
+	int b = (int) ns;
+	int e;
+
+	if (ns >= BENCH_HIST_SUB) {
+		e = 63 - __builtin_clzll(ns);
+		b = (e - 3) * BENCH_HIST_SUB +
+		    (int) ((ns >> (e - 4)) & (BENCH_HIST_SUB - 1));
+	}
+	h->bucket[b]++;
+	h->count++;
+	if (ns > h->max) {
+		h->max = ns;
+	}
+}
+
+static uint64_t
+bench_hist_pct(const struct bench_hist *h, double pct)
+{
+	uint64_t rank = (uint64_t) (h->count * pct);
+	uint64_t seen = 0;
+
+	for (int b = 0; b < BENCH_HIST_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen > rank) {
+			if (b < BENCH_HIST_SUB) {
+				return b;
+			}
+			return (uint64_t) (BENCH_HIST_SUB + b % BENCH_HIST_SUB)
+			    << (b / BENCH_HIST_SUB - 1);
+		}
+	}
+	return h->max;
+}
+
+static void
+bench_pub_send(struct bench_conn *c)
+{
+	nng_msg *msg;
+
+	bench_put(c->payload, bench_now(), 8);
+	bench_put(c->payload + 8, c->id, 4);
+	bench_put(c->payload + 12, c->sent, 4);
+
+	nng_mqtt_msg_alloc(&msg, 0);
+	nng_mqtt_msg_set_packet_type(msg, NNG_MQTT_PUBLISH);
+	nng_mqtt_msg_set_publish_qos(msg, opts->qos);
+	nng_mqtt_msg_set_publish_payload(msg, c->payload, opts->size);
+	nng_mqtt_msg_set_publish_topic(msg, opts->topic->val);
+	nng_aio_set_msg(c->aio, msg);
+	nng_ctx_send(c->ctx, c->aio);
+}
+
+static void
+bench_pub_done(struct bench_conn *c)
+{
+	(void) c;
+	bench_pubs_done++;
+}
+
+// Send, then sleep until the next message is due. A publisher behind its
+// pace sends at once until it caught up.
+static void
+bench_pub_cb(void *arg)
+{
+	struct bench_conn *c = arg;
+	nng_msg *          msg;
+	uint64_t           now;
+	int                rv;
+
+	rv = nng_aio_result(c->aio);
+	if (c->waiting) {
+		c->waiting = false;
+		if (rv == 0) {
+			bench_pub_send(c);
+			return;
+		}
+	} else if (rv == 0) {
+		c->sent++;
+	} else if ((msg = nng_aio_get_msg(c->aio)) != NULL) {
+		nng_aio_set_msg(c->aio, NULL);
+		nng_msg_free(msg);
+	}
+
+	if (rv == NNG_ECLOSED || rv == NNG_ECANCELED || bench_stop ||
+	    (opts->msg_count > 0 && c->sent >= opts->msg_count)) {
+		bench_pub_done(c);
+		return;
+	}
+	if (c->period == 0) {
+		bench_pub_send(c);
+		return;
+	}
+	c->due += c->period;
+	now = bench_now();
+	if (c->due <= now) {
+		bench_pub_send(c);
+		return;
+	}
+	c->waiting = true;
+	nng_sleep_aio(
+	    (nng_duration) ((c->due - now + 999999) / 1000000), c->aio);
+}
+
+static void
+bench_sub_cb(void *arg)
+{
+	struct bench_conn *c = arg;
+	nng_msg *          msg;
+	uint8_t *          payload;
+	uint32_t           len;
+	uint64_t           now;
+	uint64_t           sent;
+
+	if (nng_aio_result(c->aio) != 0) {
+		return;
+	}
+	msg     = nng_aio_get_msg(c->aio);
+	now     = bench_now();
+	payload = nng_mqtt_msg_get_publish_payload(msg, &len);
+	if (payload != NULL && len >= BENCH_HDR_LEN) {
+		sent = bench_get(payload, 8);
+		bench_hist_add(&c->hist, now > sent ? now - sent : 0);
+		c->received++;
+	}
+	nng_msg_free(msg);
+	nng_ctx_recv(c->ctx, c->aio);
+}
+
+static void
+bench_disconnect_cb(void *disconn_arg, nng_msg *msg)
+{
+	(void) disconn_arg;
+	(void) msg;
+	bench_disconnected++;
+}
+
+static void
+bench_conn_start(struct bench_conn *c, enum client_type type, uint32_t id)
+{
+	char     client_id[64];
+	nng_msg *msg;
+	int      rv;
+
+	c->type       = type;
+	c->id         = id;
+	c->param.sock = &c->sock;
+	c->param.opts = opts;
+	c->param.type = type;
+
+	if ((rv = nng_mqtt_client_open(&c->sock)) != 0) {
+		nng_fatal("nng_socket", rv);
+	}
+	if ((rv = nng_ctx_open(&c->ctx, c->sock)) != 0) {
+		nng_fatal("nng_ctx_open", rv);
+	}
+	if ((rv = nng_aio_alloc(&c->aio,
+	         type == PUB ? bench_pub_cb : bench_sub_cb, c)) != 0) {
+		nng_fatal("nng_aio_alloc", rv);
+	}
+	if ((rv = nng_dialer_create(&c->dialer, c->sock, opts->url)) != 0) {
+		nng_fatal("nng_dialer_create", rv);
+	}
+#ifdef NNG_SUPP_TLS
+	if (opts->enable_ssl) {
+		if ((rv = init_dialer_tls(c->dialer, opts->cacert, opts->cert,
+		         opts->key, opts->keypass)) != 0) {
+			fatal("init_dialer_tls", rv);
+		}
+	}
+#endif
+
+	// -I is a prefix of the ids, they are unique per run without it
+	if (opts->client_id != NULL) {
+		snprintf(client_id, sizeof(client_id), "%s-%c%u",
+		    opts->client_id, type == PUB ? 'p' : 's', id);
+	} else {
+		snprintf(client_id, sizeof(client_id), "bench-%d-%c%u",
+		    (int) getpid(), type == PUB ? 'p' : 's', id);
+	}
+	msg = connect_msg(opts);
+	nng_mqtt_msg_set_connect_client_id(msg, client_id);
+
+	c->cb.name            = "bench_cb";
+	c->cb.on_connected    = connect_cb;
+	c->cb.on_disconnected = bench_disconnect_cb;
+	c->cb.connect_arg     = &c->param;
+	c->cb.disconn_arg     = c;
+
+	nng_dialer_set_ptr(c->dialer, NNG_OPT_MQTT_CONNMSG, msg);
+	nng_dialer_set_cb(c->dialer, &c->cb);
+	nng_dialer_start(c->dialer, NNG_FLAG_NONBLOCK);
+}
+
+static void
+bench_wait_connected(long want)
+{
+	for (int ms = 0; bench_connected < want; ms += 10) {
+		if (ms >= BENCH_CONNECT_WAIT) {
+			fatal("Only %ld of %ld connections are up after "
+			      "%d ms.",
+			    (long) bench_connected, want, BENCH_CONNECT_WAIT);
+		}
+		nng_msleep(10);
+	}
+}
+
+static void
+bench_report(uint64_t sent, uint64_t received, uint64_t ns,
+    const struct bench_hist *h)
+{
+	uint64_t expect = sent * opts->subs;
+	uint64_t lost   = expect > received ? expect - received : 0;
+	double   secs   = ns / 1e9;
+	double   pct[]  = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t lat[4];
+
+	for (int i = 0; i < 4; i++) {
+		lat[i] = bench_hist_pct(h, pct[i]) / 1000;
+	}
+	if (opts->json) {
+		printf("{\"pubs\":%zu,\"subs\":%zu,\"qos\":%u,\"size\":%zu,"
+		       "\"seconds\":%.3f,\"sent\":%lu,\"sent_rate\":%.0f,"
+		       "\"received\":%lu,\"received_rate\":%.0f,"
+		       "\"lost\":%lu,\"disconnects\":%ld,\"latency_us\":{"
+		       "\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,"
+		       "\"max\":%lu}}\n",
+		    opts->pubs, opts->subs, opts->qos, opts->size, secs, sent,
+		    sent / secs, received, received / secs, lost,
+		    (long) bench_disconnected, lat[0], lat[1], lat[2], lat[3],
+		    h->max / 1000);
+		return;
+	}
+	printf("connections   %zu pubs, %zu subs, qos %u, %zu bytes\n",
+	    opts->pubs, opts->subs, opts->qos, opts->size);
+	printf("sent          %lu in %.3f s, %.0f msg/s\n", sent, secs,
+	    sent / secs);
+	printf("received      %lu, %.0f msg/s\n", received, received / secs);
+	printf("lost          %lu (%.3f%%)\n", lost,
+	    expect > 0 ? lost * 100.0 / expect : 0.0);
+	printf("disconnects   %ld\n", (long) bench_disconnected);
+	printf("latency (us)  p50 %lu, p90 %lu, p99 %lu, p999 %lu, max %lu\n",
+	    lat[0], lat[1], lat[2], lat[3], h->max / 1000);
+}
+
+static void
+bench(int argc, char **argv)
+{
+	struct bench_conn *conns;
+	struct bench_hist *all;
+	size_t             n;
+	uint64_t           start, end, deadline;
+	uint64_t           sent = 0, received = 0;
+
+	opts = nng_zalloc(sizeof(client_opts));
+	set_default_conf(opts);
+	opts->type = BENCH;
+	client_parse_opts(argc, argv, opts);
+
+	n = opts->subs + opts->pubs;
+	if ((conns = nng_zalloc(sizeof(*conns) * n)) == NULL ||
+	    (all = nng_zalloc(sizeof(*all))) == NULL) {
+		fatal("Out of memory.");
+	}
+
+	// subscribers first, a message of the first publisher finds them all
+	for (size_t i = 0; i < opts->subs; i++) {
+		bench_conn_start(&conns[i], SUB, i);
+	}
+	bench_wait_connected(opts->subs);
+	if (opts->subs > 0) {
+		nng_msleep(BENCH_SUBACK_WAIT);
+	}
+	for (size_t i = opts->subs; i < n; i++) {
+		bench_conn_start(&conns[i], PUB, i - opts->subs);
+		conns[i].payload = nng_zalloc(opts->size);
+		if (opts->rate > 0) {
+			conns[i].period =
+			    opts->pubs * 1000000000ull / opts->rate;
+		}
+	}
+	bench_wait_connected(n);
+
+	start    = bench_now();
+	deadline = start + opts->duration * 1000000000ull;
+	for (size_t i = 0; i < n; i++) {
+		if (conns[i].type == SUB) {
+			nng_ctx_recv(conns[i].ctx, conns[i].aio);
+		} else {
+			conns[i].due = start;
+			bench_pub_send(&conns[i]);
+		}
+	}
+	// without publishers the subscribers take messages for duration
+	for (;;) {
+		if (opts->pubs > 0 && bench_pubs_done == opts->pubs) {
+			break;
+		}
+		if ((opts->pubs == 0 || opts->msg_count == 0) &&
+		    bench_now() >= deadline) {
+			break;
+		}
+		nng_msleep(10);
+	}
+	bench_stop = true;
+	while (bench_pubs_done < opts->pubs) {
+		nng_msleep(1);
+	}
+	end = bench_now();
+	nng_msleep(BENCH_GRACE);
+
+	for (size_t i = 0; i < n; i++) {
+		nng_aio_stop(conns[i].aio);
+		nng_close(conns[i].sock);
+		sent += conns[i].sent;
+		received += conns[i].received;
+		for (int b = 0; b < BENCH_HIST_BUCKETS; b++) {
+			all->bucket[b] += conns[i].hist.bucket[b];
+		}
+		all->count += conns[i].hist.count;
+		if (conns[i].hist.max > all->max) {
+			all->max = conns[i].hist.max;
+		}
+	}
+	bench_report(sent, received, end - start, all);
+
+	for (size_t i = 0; i < n; i++) {
+		nng_aio_free(conns[i].aio);
+		if (conns[i].payload != NULL) {
+			nng_free(conns[i].payload, opts->size);
+		}
+	}
+	nng_free(all, sizeof(*all));
+	nng_free(conns, sizeof(*conns) * n);
+	client_stop(argc, argv);
+}
+
 int
 pub_start(int argc, char **argv)
 {
@@ -986,6 +1497,20 @@ conn_dflt(int argc, char **argv)
 	return 0;
 }
 
+int
+bench_start(int argc, char **argv)
+{
+	bench(argc, argv);
+	return 0;
+}
+
+int
+bench_dflt(int argc, char **argv)
+{
+	help(BENCH);
+	return 0;
+}
+
 int
 client_stop(int argc, char **argv)
 {
@@ -0,0 +1,468 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cvector.h>
+#include <mqtt_db.h>
+#include <nano_capture.h>
+#include <nano_retain.h>
+#include <nng.h>
+#include <nng/supplemental/util/options.h>
+#include <nng/supplemental/util/platform.h>
+#include <protocol/mqtt/mqtt_parser.h>
+#include <zmalloc.h>
+
+#include "include/broker.h"
+#include "include/metrics.h"
+#include "include/nanomq.h"
+#include "include/pub_handler.h"
+#include "include/replay.h"
+
+/*
+ * nanomq replay feeds a capture file, see capture.c, to the broker core
+ * in this process, with no transport and no network. A PUBLISH goes
+ * through handle_pub and is encoded once for each variant of its
+ * receivers, as the broker works do, a SUBSCRIBE and an UNSUBSCRIBE
+ * change the subscriptions on the tree. Packets go one after the other
+ * as fast as they can, or with --timing as far apart as they came. What
+ * the core did and the time it took is printed, for a profiler to look
+ * at the traffic of a real broker, or to compare two builds on it.
+ *
+ * A pipe is known from its CONNACK record, or from its first packet, as
+ * MQTT 3.1.1 unless the record tells. SUBSCRIBE and UNSUBSCRIBE are read
+ * here rather than by sub_ctx_handle, which wants the connection the
+ * transport keeps of the pipe. Sessions are not replayed, a closed pipe
+ * drops its subscriptions and is forgotten.
+ */
+#define REPLAY_BUCKETS 4096
+#define REPLAY_VARIANTS 6
+
+enum replay_options {
+	OPT_REPLAY_HELP = 1,
+	OPT_REPLAY_FILE,
+	OPT_REPLAY_TIMING,
+	OPT_REPLAY_LOOP,
+};
+
+static nng_optspec replay_opts[] = {
+	{ .o_name = "help", .o_short = 'h', .o_val = OPT_REPLAY_HELP },
+	{ .o_name    = "file",
+	    .o_short = 'f',
+	    .o_val   = OPT_REPLAY_FILE,
+	    .o_arg   = true },
+	{ .o_name = "timing", .o_short = 't', .o_val = OPT_REPLAY_TIMING },
+	{ .o_name    = "loop",
+	    .o_short = 'l',
+	    .o_val   = OPT_REPLAY_LOOP,
+	    .o_arg   = true },
+	{ .o_name = NULL, .o_val = 0 },
+};
+
+typedef struct replay_pipe replay_pipe;
+
+struct replay_pipe {
+	client_ctx   ctx;
+	char **      topics; // cvector, subscribed
+	replay_pipe *next;
+};
+
+typedef struct {
+	uint64_t count;
+	uint64_t ns;
+} replay_stat;
+
+typedef struct {
+	dbtree *     db;
+	nano_retain *retain;
+	nano_work    work;
+	replay_pipe *buckets[REPLAY_BUCKETS];
+	replay_stat  pub, sub, unsub;
+	uint64_t     records;
+	uint64_t     opened;
+	uint64_t     closed;
+	uint64_t     skipped;
+	uint64_t     receivers;
+	uint64_t     encoded;
+} replay_ctx;
+
+static void
+replay_usage(void)
+{
+	printf("Usage: nanomq replay start --file <path> [-t, --timing] "
+	       "[-l, --loop <num>]\n\n");
+	printf("Options: \n");
+	printf("  -f, --file <path>  The capture file of a broker with "
+	       "capture.enable\n");
+	printf("  -t, --timing       Keep the time between the packets as "
+	       "they came (default: as fast as possible)\n");
+	printf("  -l, --loop <num>   Replay the file num times, the "
+	       "subscriptions carry over (default: 1)\n");
+}
+
+static replay_pipe **
+replay_bucket(replay_ctx *r, uint32_t id)
+{
+	return &r->buckets[(id * 2654435761u) % REPLAY_BUCKETS];
+}
+
+static replay_pipe *
+replay_pipe_get(replay_ctx *r, uint32_t id, uint8_t proto)
+{
+	replay_pipe **bucket = replay_bucket(r, id);
+	replay_pipe * p      = *bucket;
+
+	while (p != NULL && p->ctx.pid.id != id) {
+		p = p->next;
+	}
+	if (p == NULL) {
+		p                = zmalloc(sizeof(replay_pipe));
+		p->ctx.pid.id    = id;
+		p->ctx.cparam    = NULL;
+		p->ctx.sub_pkt   = NULL;
+		p->ctx.proto_ver = 4;
+		p->topics        = NULL;
+		p->next          = *bucket;
+		*bucket          = p;
+		r->opened++;
+	}
+	if (proto != 0) {
+		p->ctx.proto_ver = proto;
+	}
+	return p;
+}
+
+static void
+replay_pipe_close(replay_ctx *r, uint32_t id)
+{
+	replay_pipe **pp = replay_bucket(r, id);
+	replay_pipe * p;
+
+	while (*pp != NULL && (*pp)->ctx.pid.id != id) {
+		pp = &(*pp)->next;
+	}
+	if ((p = *pp) == NULL) {
+		return;
+	}
+	*pp = p->next;
+	for (size_t i = 0; i < cvector_size(p->topics); i++) {
+		dbtree_delete_client(r->db, p->topics[i], 0, id);
+		zfree(p->topics[i]);
+	}
+	cvector_free(p->topics);
+	zfree(p);
+	r->closed++;
+}
+
+// position of the topic filters of a SUBSCRIBE or UNSUBSCRIBE, 0 if bad
+static size_t
+replay_filters_pos(const nano_capture_record *rec, uint8_t proto)
+{
+	size_t   pos = 2, plen = 0;
+	uint32_t shift = 0;
+
+	if (proto == PROTOCOL_VERSION_v5) {
+		do {
+			if (pos >= rec->body_len || shift > 21) {
+				return 0;
+			}
+			plen |= (size_t)(rec->body[pos] & 0x7f) << shift;
+			shift += 7;
+		} while (rec->body[pos++] & 0x80);
+		pos += plen;
+	}
+	return pos <= rec->body_len ? pos : 0;
+}
+
+// the next topic filter of body from *pos, NULL once none is left
+static char *
+replay_filter_next(const nano_capture_record *rec, size_t *pos, bool opts,
+    uint8_t *qos)
+{
+	size_t len;
+	char * topic;
+
+	if (*pos == 0 || *pos + 2 > rec->body_len) {
+		return NULL;
+	}
+	len = (rec->body[*pos] << 8) | rec->body[*pos + 1];
+	if (len == 0 || *pos + 2 + len + (opts ? 1 : 0) > rec->body_len) {
+		return NULL;
+	}
+	topic = zmalloc(len + 1);
+	memcpy(topic, rec->body + *pos + 2, len);
+	topic[len] = '\0';
+	*pos += 2 + len;
+	if (opts) {
+		*qos = rec->body[(*pos)++] & 0x03;
+	}
+	return topic;
+}
+
+static void
+replay_subscribe(replay_ctx *r, const nano_capture_record *rec)
+{
+	replay_pipe *p   = replay_pipe_get(r, rec->pipe, rec->proto);
+	size_t       pos = replay_filters_pos(rec, p->ctx.proto_ver);
+	uint8_t      qos = 0;
+	char *       topic;
+	size_t       i;
+
+	while ((topic = replay_filter_next(rec, &pos, true, &qos)) != NULL) {
+		dbtree_insert_client(r->db, topic, &p->ctx, rec->pipe, qos);
+		for (i = 0; i < cvector_size(p->topics); i++) {
+			if (strcmp(p->topics[i], topic) == 0) {
+				break;
+			}
+		}
+		if (i < cvector_size(p->topics)) {
+			zfree(topic);
+		} else {
+			cvector_push_back(p->topics, topic);
+		}
+	}
+}
+
+static void
+replay_unsubscribe(replay_ctx *r, const nano_capture_record *rec)
+{
+	replay_pipe *p   = replay_pipe_get(r, rec->pipe, rec->proto);
+	size_t       pos = replay_filters_pos(rec, p->ctx.proto_ver);
+	char *       topic;
+
+	while ((topic = replay_filter_next(rec, &pos, false, NULL)) != NULL) {
+		dbtree_delete_client(r->db, topic, 0, rec->pipe);
+		for (size_t i = 0; i < cvector_size(p->topics); i++) {
+			if (strcmp(p->topics[i], topic) == 0) {
+				zfree(p->topics[i]);
+				cvector_erase(p->topics, i);
+				break;
+			}
+		}
+		zfree(topic);
+	}
+}
+
+// through handle_pub and encoded for its receivers, as pub_variant does
+static void
+replay_publish(replay_ctx *r, const nano_capture_record *rec)
+{
+	nano_work *       work                      = &r->work;
+	nng_msg *         variants[REPLAY_VARIANTS] = { NULL };
+	nng_msg *         msg;
+	struct pipe_info *info;
+	uint8_t           proto;
+	int               idx;
+
+	replay_pipe_get(r, rec->pipe, rec->proto);
+	if (nng_msg_alloc(&msg, 0) != 0) {
+		return;
+	}
+	nng_msg_header_append(msg, rec->header, rec->header_len);
+	nng_msg_append(msg, rec->body, rec->body_len);
+	nng_msg_set_remaining_len(msg, rec->body_len);
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+	nng_msg_set_timestamp(msg, nng_clock());
+
+	work->msg        = msg;
+	work->pid.id     = rec->pipe;
+	work->pub_packet = NULL;
+	nano_arena_reset(&work->arena);
+	handle_pub(work, work->pipe_ct);
+
+	for (uint32_t i = 0; i < work->pipe_ct->total; i++) {
+		info  = &work->pipe_ct->pipe_info[i];
+		proto = info->proto_ver == PROTOCOL_VERSION_v5
+		    ? PROTOCOL_VERSION_v5
+		    : 4;
+		idx   = info->qos * 2 + (proto == PROTOCOL_VERSION_v5 ? 1 : 0);
+		if (variants[idx] == NULL &&
+		    nng_msg_alloc(&variants[idx], 0) == 0) {
+			work->pipe_ct->encode_msg(variants[idx], work,
+			    info->cmd, info->qos, proto, 0);
+			r->encoded++;
+		}
+	}
+	r->receivers += work->pipe_ct->total;
+
+	for (idx = 0; idx < REPLAY_VARIANTS; idx++) {
+		if (variants[idx] != NULL) {
+			nng_msg_free(variants[idx]);
+		}
+	}
+	reset_pipe_content(work->pipe_ct);
+	work->pub_packet = NULL;
+	work->msg        = NULL;
+	nng_msg_free(msg);
+}
+
+static void
+replay_stat_add(replay_stat *stat, uint64_t start)
+{
+	stat->count++;
+	stat->ns += metrics_now_ns() - start;
+}
+
+static void
+replay_stat_print(const char *name, const replay_stat *stat)
+{
+	printf("  %-12s %10lu  %10.0f ns each\n", name,
+	    (unsigned long) stat->count,
+	    stat->count > 0 ? (double) stat->ns / stat->count : 0.0);
+}
+
+// feed the records of path once, false if it is not a capture file
+static bool
+replay_file(replay_ctx *r, const char *path, bool timing)
+{
+	nano_capture_reader reader;
+	nano_capture_record rec;
+	uint64_t            begin = metrics_now_ns() / 1000;
+	uint64_t            start, now;
+
+	if (nano_capture_reader_open(&reader, path) != 0) {
+		return false;
+	}
+	while (nano_capture_next(&reader, &rec)) {
+		r->records++;
+		now = metrics_now_ns() / 1000;
+		if (timing && begin + rec.time_us > now) {
+			usleep(begin + rec.time_us - now);
+		}
+		start = metrics_now_ns();
+		switch (rec.kind) {
+		case CMD_CONNACK:
+			replay_pipe_get(r, rec.pipe, rec.proto);
+			break;
+		case CMD_PUBLISH:
+			replay_publish(r, &rec);
+			replay_stat_add(&r->pub, start);
+			break;
+		case CMD_SUBSCRIBE:
+			replay_subscribe(r, &rec);
+			replay_stat_add(&r->sub, start);
+			break;
+		case CMD_UNSUBSCRIBE:
+			replay_unsubscribe(r, &rec);
+			replay_stat_add(&r->unsub, start);
+			break;
+		case CMD_DISCONNECT_EV:
+			replay_pipe_close(r, rec.pipe);
+			break;
+		default:
+			r->skipped++;
+			break;
+		}
+	}
+	nano_capture_reader_close(&reader);
+	return true;
+}
+
+static int
+replay(const char *path, bool timing, int loop)
+{
+	replay_ctx *    r   = zmalloc(sizeof(replay_ctx));
+	nano_retain_opt opt = { 0 };
+	uint64_t        start;
+	int             rv = 0;
+
+	memset(r, 0, sizeof(replay_ctx));
+	dbtree_create(&r->db);
+	r->retain        = nano_retain_create(&opt);
+	r->work.db       = r->db;
+	r->work.retain   = r->retain;
+	r->work.proto    = PROTO_MQTT_BROKER;
+	r->work.pipe_ct  = zmalloc(sizeof(struct pipe_content));
+	r->work.cparam   = NULL;
+	init_pipe_content(r->work.pipe_ct);
+	nano_arena_init(&r->work.arena, NANO_WORK_ARENA_SIZE);
+
+	start = metrics_now_ns();
+	for (int i = 0; i < loop; i++) {
+		if (!replay_file(r, path, timing)) {
+			fprintf(stderr, "%s is not a capture file\n", path);
+			rv = 1;
+			break;
+		}
+	}
+	if (rv == 0) {
+		printf("%lu records in %.3f ms, %lu pipes opened, %lu "
+		       "closed, %lu skipped\n",
+		    (unsigned long) r->records,
+		    (double) (metrics_now_ns() - start) / 1e6,
+		    (unsigned long) r->opened, (unsigned long) r->closed,
+		    (unsigned long) r->skipped);
+		replay_stat_print("PUBLISH", &r->pub);
+		replay_stat_print("SUBSCRIBE", &r->sub);
+		replay_stat_print("UNSUBSCRIBE", &r->unsub);
+		printf("  %lu receivers, %lu encodings\n",
+		    (unsigned long) r->receivers, (unsigned long) r->encoded);
+	}
+
+	for (int i = 0; i < REPLAY_BUCKETS; i++) {
+		while (r->buckets[i] != NULL) {
+			replay_pipe_close(r, r->buckets[i]->ctx.pid.id);
+		}
+	}
+	free_pipes_info(r->work.pipe_ct->pipe_info);
+	zfree(r->work.pipe_ct);
+	nano_arena_fini(&r->work.arena);
+	nano_retain_destroy(r->retain);
+	dbtree_destory(r->db);
+	zfree(r);
+	return rv;
+}
+
+int
+replay_start(int argc, char **argv)
+{
+	char *path   = NULL;
+	bool  timing = false;
+	int   loop   = 1;
+	int   idx    = 0;
+	char *arg;
+	int   val;
+	int   rv;
+
+	while ((rv = nng_opts_parse(
+	            argc, argv, replay_opts, &val, &arg, &idx)) == 0) {
+		switch (val) {
+		case OPT_REPLAY_HELP:
+			replay_usage();
+			exit(0);
+			break;
+		case OPT_REPLAY_FILE:
+			path = arg;
+			break;
+		case OPT_REPLAY_TIMING:
+			timing = true;
+			break;
+		case OPT_REPLAY_LOOP:
+			loop = atoi(arg);
+			break;
+		default:
+			break;
+		}
+	}
+	if (rv != -1 || path == NULL || loop <= 0) {
+		replay_usage();
+		return 1;
+	}
+	return replay(path, timing, loop);
+}
+
+int
+replay_dflt(int argc, char **argv)
+{
+	replay_usage();
+	return 0;
+}
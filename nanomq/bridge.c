@@ -1,11 +1,19 @@
 #include "include/bridge.h"
 #include <nng/mqtt/mqtt_client.h>
 #include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt_parser.h>
+#include <nng/supplemental/util/platform.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <nano_envelope.h>
+#include <zmalloc.h>
 
 #include "include/nanomq.h"
+#include "include/route.h"
 
 #if defined(NNG_PLATFORM_POSIX)
 #define nano_strtok strtok_r
@@ -44,18 +52,24 @@ bridge_publish_msg(const char *topic, uint8_t *payload,
 	return pubmsg;
 }
 
+typedef struct {
+	nng_socket * sock;
+	conf_bridge *config;
+	uint32_t     link; // index of the connection
+} bridge_param;
+
 // Disconnect message callback function
 static void
 disconnect_cb(void *disconn_arg, nng_msg *msg)
 {
-	nng_socket sock = *(nng_socket *) disconn_arg;
-	debug_msg("%d\n", sock.id);
-}
+	bridge_param *param = disconn_arg;
 
-typedef struct {
-	nng_socket * sock;
-	conf_bridge *config;
-} bridge_param;
+	debug_msg("%d\n", param->sock->id);
+	// route updates come over the first link, some may be missed now
+	if (param->config->routes && param->link == 0) {
+		route_peer_reset();
+	}
+}
 
 // Connack message callback function
 static void
@@ -69,44 +83,66 @@ bridge_connect_cb(void *connect_arg, nng_msg *msg)
 	nng_msg_free(msg);
 	msg = NULL;
 
-	if (ret_code == 0) {
+	// subscriptions go over the first link only, or each would be
+	// delivered once per link
+	bridge_param *param = connect_arg;
+	if (ret_code == 0 && param->link == 0) {
 		// Connected succeed
-		bridge_param *param = connect_arg;
+		size_t n = param->config->sub_count;
 
 		nng_mqtt_msg_alloc(&msg, 0);
 		nng_mqtt_msg_set_packet_type(msg, NNG_MQTT_SUBSCRIBE);
 
-		nng_mqtt_topic_qos *topic_qos =
-		    nng_mqtt_topic_qos_array_create(param->config->sub_count);
-		for (size_t i = 0; i < param->config->sub_count; i++) {
+		nng_mqtt_topic_qos *topic_qos = nng_mqtt_topic_qos_array_create(
+		    param->config->routes ? n + 1 : n);
+		for (size_t i = 0; i < n; i++) {
 			nng_mqtt_topic_qos_array_set(topic_qos, i,
 			    param->config->sub_list[i].topic,
 			    param->config->sub_list[i].qos);
 		}
-		nng_mqtt_msg_set_subscribe_topics(
-		    msg, topic_qos, param->config->sub_count);
+		if (param->config->routes) {
+			nng_mqtt_topic_qos_array_set(
+			    topic_qos, n++, ROUTE_TOPIC, 0);
+		}
+		nng_mqtt_msg_set_subscribe_topics(msg, topic_qos, n);
 
-		nng_mqtt_topic_qos_array_free(
-		    topic_qos, param->config->sub_count);
+		nng_mqtt_topic_qos_array_free(topic_qos, n);
 
 		// Send subscribe message
 		nng_sendmsg(*param->sock, msg, NNG_FLAG_NONBLOCK);
 	}
 }
 
-static nng_mqtt_cb bridge_user_cb = {
-	.name            = "bridge_user_cb",
-	.on_connected    = bridge_connect_cb,
-	.on_disconnected = disconnect_cb,
-};
-
-static bridge_param bridge_arg;
+typedef struct {
+	nng_mqtt_cb  cb;
+	bridge_param arg;
+	char *       clientid;
+} bridge_link;
+
+static bridge_link *bridge_links = NULL;
+
+/**
+ * @brief bridge_link_of - Pick the link a forwarded PUBLISH goes over, a
+ * topic always takes the same one so its messages stay in order.
+ * @param config - conf_bridge
+ * @param topic - topic of PUBLISH
+ * @return index of link
+ */
+uint32_t
+bridge_link_of(conf_bridge *config, const char *topic)
+{
+	if (config->links <= 1 || topic == NULL) {
+		return 0;
+	}
+	return DJBHashn((char *) topic, strlen(topic)) % config->links;
+}
 
-int
-bridge_client(nng_socket *sock, conf_bridge *config)
+static int
+bridge_link_open(nng_socket *sock, conf_bridge *config, uint32_t link)
 {
-	int        rv;
-	nng_dialer dialer;
+	int          rv;
+	nng_dialer   dialer;
+	bridge_link *bl = &bridge_links[link];
 
 	if ((rv = nng_mqtt_client_open(sock)) != 0) {
 		fatal("nng_mqtt_client_open", rv);
@@ -126,8 +162,14 @@ bridge_client(nng_socket *sock, conf_bridge *config)
 	nng_mqtt_msg_set_connect_keep_alive(connmsg, config->keepalive);
 	nng_mqtt_msg_set_connect_proto_version(connmsg, config->proto_ver);
 	nng_mqtt_msg_set_connect_clean_session(connmsg, config->clean_start);
-	if (config->clientid) {
+	if (config->clientid && link == 0) {
 		nng_mqtt_msg_set_connect_client_id(connmsg, config->clientid);
+	} else if (config->clientid) {
+		// the remote broker keeps one connection per client id
+		size_t len   = strlen(config->clientid) + 12;
+		bl->clientid = malloc(len);
+		snprintf(bl->clientid, len, "%s-%u", config->clientid, link);
+		nng_mqtt_msg_set_connect_client_id(connmsg, bl->clientid);
 	}
 	if (config->username) {
 		nng_mqtt_msg_set_connect_user_name(connmsg, config->username);
@@ -136,18 +178,231 @@ bridge_client(nng_socket *sock, conf_bridge *config)
 		nng_mqtt_msg_set_connect_password(connmsg, config->password);
 	}
 
-	bridge_arg.config = config;
-	bridge_arg.sock   = sock;
+	bl->arg.config = config;
+	bl->arg.sock   = sock;
+	bl->arg.link   = link;
 
-	bridge_user_cb.connect_arg = &bridge_arg;
-	bridge_user_cb.disconn_arg = sock;
+	bl->cb.name            = "bridge_user_cb";
+	bl->cb.on_connected    = bridge_connect_cb;
+	bl->cb.on_disconnected = disconnect_cb;
+	bl->cb.connect_arg     = &bl->arg;
+	bl->cb.disconn_arg     = &bl->arg;
 
 	nng_dialer_set_ptr(dialer, NNG_OPT_MQTT_CONNMSG, connmsg);
-	nng_dialer_set_cb(dialer, &bridge_user_cb);
+	nng_dialer_set_cb(dialer, &bl->cb);
 	nng_dialer_start(dialer, NNG_FLAG_NONBLOCK);
 	return 0;
 }
 
+/*
+ * With bridge.mqtt.batch, forwards of a link are appended to its batch
+ * instead of sent one by one. A batch is sent as one PUBLISH on
+ * BRIDGE_BATCH_TOPIC, at the highest qos of its messages, once it holds
+ * batch_size bytes or its first message is batch_interval ms old, which
+ * the batch thread looks after. A batch is packed and sent under its
+ * lock so those of a link go out in order.
+ */
+typedef struct {
+	pthread_mutex_t mtx;
+	nano_envelope   env;
+	nng_time        since; // of the first message
+} bridge_batch;
+
+static bridge_batch *  batches       = NULL;
+static nng_socket *    batch_socks   = NULL;
+static conf_bridge *   batch_conf    = NULL;
+static pthread_mutex_t batch_mtx     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  batch_cond    = PTHREAD_COND_INITIALIZER;
+static pthread_t       batch_thread;
+static bool            batch_running = false;
+
+// send the batch of link, its lock held
+static void
+bridge_batch_flush(uint32_t link)
+{
+	bridge_batch *b = &batches[link];
+	nng_msg *     msg;
+	uint8_t *     wire;
+	size_t        len = 0;
+	int           rv;
+
+	if (b->env.count == 0) {
+		return;
+	}
+	wire = nano_envelope_pack(&b->env, batch_conf->batch_compress, &len);
+	if (wire != NULL) {
+		msg = bridge_publish_msg(BRIDGE_BATCH_TOPIC, wire, len, false,
+		    b->env.qos, false);
+		if ((rv = nng_sendmsg(batch_socks[link], msg,
+		         NNG_FLAG_NONBLOCK)) != 0) {
+			fatal("bridge batch nng_sendmsg", rv);
+			nng_msg_free(msg);
+		}
+		zfree(wire);
+	}
+	debug_msg("bridge batch of %u sent, %zu bytes", b->env.count, len);
+	nano_envelope_reset(&b->env);
+}
+
+// sends the batches as they get old, waking at the oldest
+static void *
+bridge_batch_run(void *arg)
+{
+	struct timespec ts;
+	nng_duration    wait;
+
+	pthread_mutex_lock(&batch_mtx);
+	while (batch_running) {
+		wait = batch_conf->batch_interval;
+		pthread_mutex_unlock(&batch_mtx);
+		for (uint32_t i = 0; i < batch_conf->links; i++) {
+			bridge_batch *b = &batches[i];
+			nng_time      now, due;
+
+			pthread_mutex_lock(&b->mtx);
+			now = nng_clock();
+			due = b->since + batch_conf->batch_interval;
+			if (b->env.count > 0 && due <= now) {
+				bridge_batch_flush(i);
+			} else if (b->env.count > 0 && due - now < wait) {
+				wait = due - now;
+			}
+			pthread_mutex_unlock(&b->mtx);
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += wait / 1000;
+		ts.tv_nsec += (long) (wait % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_mutex_lock(&batch_mtx);
+		if (batch_running) {
+			pthread_cond_timedwait(&batch_cond, &batch_mtx, &ts);
+		}
+	}
+	pthread_mutex_unlock(&batch_mtx);
+
+	return NULL;
+}
+
+static void
+bridge_batch_start(nng_socket *socks, conf_bridge *config)
+{
+	batches = zmalloc(sizeof(bridge_batch) * config->links);
+	for (uint32_t i = 0; i < config->links; i++) {
+		pthread_mutex_init(&batches[i].mtx, NULL);
+		nano_envelope_init(&batches[i].env);
+		batches[i].since = 0;
+	}
+	batch_socks   = socks;
+	batch_conf    = config;
+	batch_running = true;
+	if (pthread_create(&batch_thread, NULL, bridge_batch_run, NULL) !=
+	    0) {
+		debug_msg("bridge batch thread can not be created");
+		batch_running = false;
+	}
+}
+
+/**
+ * @brief bridge_batch_stop - Send what the batches hold and stop the
+ * batch thread.
+ * @return void
+ */
+void
+bridge_batch_stop(void)
+{
+	pthread_mutex_lock(&batch_mtx);
+	if (!batch_running) {
+		pthread_mutex_unlock(&batch_mtx);
+		return;
+	}
+	batch_running = false;
+	pthread_cond_signal(&batch_cond);
+	pthread_mutex_unlock(&batch_mtx);
+	pthread_join(batch_thread, NULL);
+
+	for (uint32_t i = 0; i < batch_conf->links; i++) {
+		pthread_mutex_lock(&batches[i].mtx);
+		bridge_batch_flush(i);
+		pthread_mutex_unlock(&batches[i].mtx);
+	}
+}
+
+/**
+ * @brief bridge_batch_add - Append a forwarded PUBLISH to the batch of
+ * its link, copied, sending the batch if it is full.
+ * @param link - index of link, by bridge_link_of
+ * @param topic - topic of PUBLISH
+ * @param payload - payload
+ * @param len - of payload
+ * @param qos - qos
+ * @param retain - retain flag
+ * @return false if batches are not used, the caller sends it then
+ */
+bool
+bridge_batch_add(uint32_t link, const char *topic, uint8_t *payload,
+    uint32_t len, uint8_t qos, bool retain)
+{
+	bridge_batch *b;
+	uint8_t       flags = qos << 1 | (retain ? NANO_ENVELOPE_RETAIN : 0);
+
+	if (!batch_running) {
+		return false;
+	}
+	b = &batches[link];
+	pthread_mutex_lock(&b->mtx);
+	if (b->env.count == 0) {
+		b->since = nng_clock();
+	}
+	if (nano_envelope_add(&b->env, topic, strlen(topic), payload, len,
+	        flags) != 0) {
+		// too large for the rest of the batch, or at all
+		bridge_batch_flush(link);
+		b->since = nng_clock();
+		if (nano_envelope_add(&b->env, topic, strlen(topic), payload,
+		        len, flags) != 0) {
+			debug_msg("PUBLISH to '%s' too large for a batch",
+			    topic);
+		}
+	}
+	if (b->env.len >= batch_conf->batch_size) {
+		bridge_batch_flush(link);
+	}
+	pthread_mutex_unlock(&b->mtx);
+
+	return true;
+}
+
+/**
+ * @brief bridge_client - Open config->links connections to the remote
+ * broker, and start the batch thread if forwards are batched.
+ * @param socks - array of config->links sockets
+ * @param config - conf_bridge
+ * @return 0 or error of the first link failed
+ */
+int
+bridge_client(nng_socket *socks, conf_bridge *config)
+{
+	int rv;
+
+	bridge_links = calloc(config->links, sizeof(bridge_link));
+	if (bridge_links == NULL) {
+		return NNG_ENOMEM;
+	}
+	for (uint32_t i = 0; i < config->links; i++) {
+		if ((rv = bridge_link_open(&socks[i], config, i)) != 0) {
+			return rv;
+		}
+	}
+	if (config->batch) {
+		bridge_batch_start(socks, config);
+	}
+	return 0;
+}
+
 bool
 topic_filter(const char *origin, const char *input)
 {
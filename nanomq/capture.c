@@ -0,0 +1,72 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <errno.h>
+#include <string.h>
+
+#include <conf.h>
+#include <nano_capture.h>
+#include <nanolib.h>
+
+#include "include/capture.h"
+#include "include/metrics.h"
+#include "include/nanomq.h"
+
+/*
+ * The packets the broker works receive, as they come out of the
+ * transport, recorded to capture.file for nanomq replay. A CONNECT is
+ * seen as the CONNACK the transport made for it and a closed pipe as
+ * the DISCONNECT_EV, the protocol of the pipe goes with each record.
+ *
+ * A work records the msg it got before anything else is done with it,
+ * under the lock of the file, so the records of a pipe are in the order
+ * it sent them.
+ */
+static nano_capture file;
+static bool         enabled = false;
+
+/**
+ * @brief capture_init - Create the capture file of config.
+ * @param config - conf_capture
+ * @return true if packets are recorded
+ */
+bool
+capture_init(conf_capture *config)
+{
+	const char *path =
+	    config->file ? config->file : CONF_CAPTURE_FILE_DEFAULT;
+
+	if (!config->enable) {
+		return false;
+	}
+	if (nano_capture_open(&file, path,
+	        config->max_size > 0 ? (uint64_t) config->max_size : 0) != 0) {
+		log_warn("capture file %s can not be created: %s", path,
+		    strerror(errno));
+		return false;
+	}
+	enabled = true;
+	debug_msg("capturing packets to %s", path);
+	return true;
+}
+
+bool
+capture_enabled(void)
+{
+	return enabled;
+}
+
+// record msg received on pipe, before it is decoded
+void
+capture_msg(nng_msg *msg, uint32_t pipe, uint8_t proto)
+{
+	nano_capture_write(&file, metrics_now_ns() / 1000, pipe,
+	    nng_msg_cmd_type(msg), proto, nng_msg_header(msg),
+	    nng_msg_header_len(msg), nng_msg_body(msg), nng_msg_len(msg));
+}
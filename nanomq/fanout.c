@@ -0,0 +1,183 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <pthread.h>
+
+#include <conf.h>
+#include <cvector.h>
+#include <nng/nng.h>
+#include <nng/supplemental/util/platform.h>
+
+#include "include/fanout.h"
+#include "include/nanomq.h"
+
+/*
+ * Large fan-outs sent in parallel. A PUBLISH matching more than
+ * fanout_threshold receivers is not sent by the work which received it
+ * alone, pub_multicast encodes its variants once, then splits the
+ * receivers into a part per shard by pipe id and posts each one to the
+ * fanout work of its shard. The parts share the variants by refcount, the
+ * work which received the PUBLISH waits until the last one is sent and
+ * frees them.
+ *
+ * A pipe is always in the same shard and each shard is a FIFO sent by
+ * one work, so a receiver gets the large fan-outs in the order they were
+ * posted, and the work which posted goes on only once its is all sent,
+ * as it does sending by itself.
+ *
+ * A fanout work with nothing to send sleeps in fanout_take, a post to its
+ * shard aborts that sleep so the work takes the part right away.
+ */
+typedef struct {
+	pthread_mutex_t mtx;
+	fanout_part *   head;
+	fanout_part *   tail;
+	nng_aio *       aio;  // of the fanout work
+	bool            idle; // aio sleeps in fanout_take
+} fanout_shard;
+
+static fanout_shard  shards[FANOUT_WORKS_MAX];
+static uint32_t      count     = 0;
+static uint32_t      attached  = 0;
+static uint32_t      threshold = 0;
+static fanout_totals totals;
+
+/**
+ * @brief fanout_init - Set up the shards of the fanout works.
+ * @param config - conf, fanout_threshold and fanout_works
+ * @return fanout works to start, 0 if fan-outs are not parallel
+ */
+int
+fanout_init(conf *config)
+{
+	int n = config->fanout_works > 0 ? config->fanout_works
+	                                 : config->max_taskq_thread;
+
+	if (config->fanout_threshold <= 0 || n <= 1) {
+		return 0;
+	}
+	if (n > FANOUT_WORKS_MAX) {
+		n = FANOUT_WORKS_MAX;
+	}
+	for (int i = 0; i < n; i++) {
+		pthread_mutex_init(&shards[i].mtx, NULL);
+		shards[i].head = shards[i].tail = NULL;
+		shards[i].aio                   = NULL;
+		shards[i].idle                  = false;
+	}
+	count     = n;
+	threshold = config->fanout_threshold;
+
+	return n;
+}
+
+// not until as many works as shards are attached
+bool
+fanout_wanted(uint32_t receivers)
+{
+	return threshold > 0 && receivers > threshold &&
+	    __atomic_load_n(&attached, __ATOMIC_ACQUIRE) == count;
+}
+
+uint32_t
+fanout_shards(void)
+{
+	return count;
+}
+
+uint32_t
+fanout_shard_of(uint32_t pipe_id)
+{
+	return (pipe_id * 2654435761u) % count;
+}
+
+/**
+ * @brief fanout_attach - Give a fanout work its shard.
+ * @param aio - of the work, a post wakes it
+ * @return shard
+ */
+uint32_t
+fanout_attach(nng_aio *aio)
+{
+	uint32_t shard = __atomic_load_n(&attached, __ATOMIC_RELAXED);
+
+	shards[shard].aio = aio;
+	__atomic_store_n(&attached, shard + 1, __ATOMIC_RELEASE);
+
+	return shard;
+}
+
+/**
+ * @brief fanout_post - Queue a part for the fanout work of shard.
+ * @param shard - fanout_shard_of the pipes of part
+ * @param part - fanout_part, the work takes it
+ * @return void
+ */
+void
+fanout_post(uint32_t shard, fanout_part *part)
+{
+	fanout_shard *s = &shards[shard];
+
+	part->next = NULL;
+	__atomic_add_fetch(&totals.parts, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(
+	    &totals.receivers, cvector_size(part->index), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&totals.queued, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&s->mtx);
+	if (s->tail != NULL) {
+		s->tail->next = part;
+	} else {
+		s->head = part;
+	}
+	s->tail = part;
+	if (s->idle) {
+		s->idle = false;
+		nng_aio_abort(s->aio, NNG_ECANCELED);
+	}
+	pthread_mutex_unlock(&s->mtx);
+}
+
+/**
+ * @brief fanout_take - Take the next part of shard, or sleep on aio
+ * until one is posted.
+ * @param shard - of the fanout work
+ * @param aio - of the fanout work, not busy
+ * @return fanout_part, or NULL with aio sleeping
+ */
+fanout_part *
+fanout_take(uint32_t shard, nng_aio *aio)
+{
+	fanout_shard *s = &shards[shard];
+	fanout_part * part;
+
+	pthread_mutex_lock(&s->mtx);
+	if ((part = s->head) != NULL) {
+		if ((s->head = part->next) == NULL) {
+			s->tail = NULL;
+		}
+	} else {
+		s->idle = true;
+		nng_sleep_aio(FANOUT_IDLE_MS, aio);
+	}
+	pthread_mutex_unlock(&s->mtx);
+
+	if (part != NULL) {
+		__atomic_sub_fetch(&totals.queued, 1, __ATOMIC_RELAXED);
+	}
+	return part;
+}
+
+void
+fanout_get_totals(fanout_totals *t)
+{
+	t->parts     = __atomic_load_n(&totals.parts, __ATOMIC_RELAXED);
+	t->receivers = __atomic_load_n(&totals.receivers, __ATOMIC_RELAXED);
+	t->queued    = __atomic_load_n(&totals.queued, __ATOMIC_RELAXED);
+}
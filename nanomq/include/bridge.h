@@ -6,9 +6,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+// forwards batched by a bridge are sent to, and unpacked from, this topic
+#define BRIDGE_BATCH_TOPIC "$nanomq/bridge/batch"
+
 extern bool     topic_filter(const char *origin, const char *input);
-extern int      bridge_client(nng_socket *sock, conf_bridge *config);
+extern int      bridge_client(nng_socket *socks, conf_bridge *config);
+extern uint32_t bridge_link_of(conf_bridge *config, const char *topic);
 extern nng_msg *bridge_publish_msg(const char *topic, uint8_t *payload,
     uint32_t len, bool dup, uint8_t qos, bool retain);
+extern bool     bridge_batch_add(uint32_t link, const char *topic,
+    uint8_t *payload, uint32_t len, uint8_t qos, bool retain);
+extern void     bridge_batch_stop(void);
 
 #endif // NANOMQ_BRIDGE_H
\ No newline at end of file
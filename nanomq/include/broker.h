@@ -3,37 +3,75 @@
 #define MQTT_VER 5
 
 #include <conf.h>
+#include <nano_arena.h>
+#include <nano_envelope.h>
+#include <nano_retain.h>
 #include <nanolib.h>
 #include <nng/nng.h>
 #include <nng/protocol/mqtt/mqtt.h>
 #include <nng/supplemental/util/platform.h>
 
+#include "metrics.h"
+
 #define PROTO_MQTT_BROKER 0x00
 #define PROTO_MQTT_BRIDGE 0x01
+#define PROTO_SYS_EVENT 0x02
+#define PROTO_INFLIGHT 0x03
+#define PROTO_SHM_INGEST 0x04
+#define PROTO_FANOUT 0x05
+
+// fits the decoded PUBLISH of common topics
+#define NANO_WORK_ARENA_SIZE 1024
 
 typedef struct work nano_work;
 struct work {
-	enum { INIT, RECV, WAIT, SEND, RESEND, FREE, NOTIFY, BRIDGE } state;
+	enum {
+		INIT,
+		RECV,
+		WAIT,
+		SEND,
+		RESEND,
+		FREE,
+		NOTIFY,
+		BRIDGE,
+		RETAIN,
+		EVENT,
+		THROTTLE,
+		INGEST,
+		FANOUT
+	} state;
 	// 0x00 mqtt_broker
 	// 0x01 mqtt_bridge
 	uint8_t   proto;
 	nng_aio * aio;
 	nng_aio * bridge_aio;
 	nng_msg * msg;
-	nng_msg **msg_ret;
+	// retain cursors of the topics in SUBSCRIBE, sent after SUBACK
+	nano_retain_cursor **retain_cur;
 	nng_ctx   ctx;        // ctx for mqtt broker
 	nng_ctx   bridge_ctx; // ctx for bridging
+	nng_ctx * bridge_links; // ctx on each bridge link, by bridge_link_of
 	nng_pipe  pid;
-	nng_mtx * mutex;
+	nng_mtx * mutex; // pool_state of a broker work changes with it
+	uint32_t  pool_state; // WORK_POOL_* of work_pool.h
 	dbtree *  db;
-	dbtree *  db_ret;
+	nano_retain *retain;
 	conf *    config;
 
 	struct pipe_content *      pipe_ct;
 	conn_param *               cparam;
+	// decoded from msg in the arena, reset when back to RECV
+	nano_arena                 arena;
 	struct pub_packet_struct * pub_packet;
 	struct packet_subscribe *  sub_pkt;
 	struct packet_unsubscribe *unsub_pkt;
+	// records of a bridge batch left to publish, after the one in msg
+	nano_envelope_reader *     unpack;
+	// stages of the PUBLISH in msg if it is a trace sample
+	metrics_trace              trace;
+	// variants of the PUBLISH in msg while fanout works send it
+	struct pub_fanout *        fanout;
+	uint32_t                   shard; // of a fanout work
 };
 
 struct client_ctx {
@@ -50,6 +88,7 @@ int broker_stop(int argc, char **argv);
 int broker_restart(int argc, char **argv);
 int broker_dflt(int argc, char **argv);
 
-dbtree *get_broker_db(void);
+dbtree *     get_broker_db(void);
+nano_retain *get_broker_retain(void);
 
 #endif
@@ -0,0 +1,23 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_CAPTURE_H
+#define NANOMQ_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <conf.h>
+#include <nng/nng.h>
+
+extern bool capture_init(conf_capture *config);
+extern bool capture_enabled(void);
+extern void capture_msg(nng_msg *msg, uint32_t pipe, uint8_t proto);
+
+#endif // NANOMQ_CAPTURE_H
@@ -4,9 +4,11 @@
 int pub_dflt(int argc, char **argv);
 int sub_dflt(int argc, char **argv);
 int conn_dflt(int argc, char **argv);
+int bench_dflt(int argc, char **argv);
 int pub_start(int argc, char **argv);
 int sub_start(int argc, char **argv);
 int conn_start(int argc, char **argv);
+int bench_start(int argc, char **argv);
 int client_stop(int argc, char **argv);
 
 #endif // NANOMQ_CLIENT_H
@@ -0,0 +1,48 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_FANOUT_H
+#define NANOMQ_FANOUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <conf.h>
+#include <nng/nng.h>
+
+#include "broker.h"
+
+#define FANOUT_WORKS_MAX 64
+#define FANOUT_IDLE_MS 1000 // a post wakes the work of its shard before
+
+typedef struct fanout_part fanout_part;
+
+// receivers of a PUBLISH in one shard, sent by the fanout work of it
+struct fanout_part {
+	nano_work *  origin; // waits in SEND until its last part is sent
+	uint32_t *   index;  // cvector, of origin->pipe_ct->pipe_info
+	fanout_part *next;
+};
+
+typedef struct {
+	uint64_t parts;     // posted
+	uint64_t receivers; // of the parts posted
+	uint64_t queued;    // parts not taken yet
+} fanout_totals;
+
+extern int          fanout_init(conf *config);
+extern bool         fanout_wanted(uint32_t receivers);
+extern uint32_t     fanout_shards(void);
+extern uint32_t     fanout_shard_of(uint32_t pipe_id);
+extern uint32_t     fanout_attach(nng_aio *aio);
+extern void         fanout_post(uint32_t shard, fanout_part *part);
+extern fanout_part *fanout_take(uint32_t shard, nng_aio *aio);
+extern void         fanout_get_totals(fanout_totals *totals);
+
+#endif // NANOMQ_FANOUT_H
@@ -0,0 +1,39 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_INFLIGHT_H
+#define NANOMQ_INFLIGHT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nng/nng.h>
+
+#define INFLIGHT_WORKS 1     // works running inflight_tick
+#define INFLIGHT_TICK_MS 100 // tick of the timer wheels
+
+typedef struct {
+	uint64_t sessions;
+	uint64_t inflight;   // QoS 1/2 messages not completed
+	uint64_t timed_out;  // pipes closed for their keepalive
+} inflight_totals;
+
+extern void     inflight_init(void);
+extern void     inflight_open(
+        uint32_t pipe_id, uint16_t receive_max, uint16_t keepalive);
+extern void     inflight_close(uint32_t pipe_id);
+extern void     inflight_seen(uint32_t pipe_id);
+extern uint16_t inflight_window(uint32_t pipe_id);
+extern void     inflight_sent(uint32_t pipe_id, uint8_t qos);
+extern bool     inflight_ack(uint32_t pipe_id, uint8_t cmd);
+extern uint32_t inflight_count(uint32_t pipe_id);
+extern void     inflight_tick(nng_time now);
+extern void     inflight_get_totals(inflight_totals *totals);
+
+#endif // NANOMQ_INFLIGHT_H
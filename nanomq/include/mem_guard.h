@@ -0,0 +1,42 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_MEM_GUARD_H
+#define NANOMQ_MEM_GUARD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <conf.h>
+#include <mqtt_db.h>
+#include <nano_retain.h>
+
+#define MEM_GUARD_TICK 100 // ms between samples
+// a pipe, its conn_param and the buffers of its transport, estimated
+#define MEM_GUARD_CONN_BYTES 4096
+
+// what mem_guard_refuse is asked for
+#define MEM_GUARD_CONNECT 0x01
+#define MEM_GUARD_SUBSCRIBE 0x02
+#define MEM_GUARD_QOS0 0x04
+
+typedef struct {
+	bool     pressure;
+	uint64_t pressured;  // times pressure started
+	uint64_t connects;   // refused
+	uint64_t subscribes; // refused
+	uint64_t shed;       // QoS 0 publishes dropped
+	uint64_t evicted;    // bytes of retained messages
+} mem_guard_totals;
+
+extern void mem_guard_init(conf_mem *config, dbtree *db, nano_retain *retain);
+extern bool mem_guard_refuse(int what);
+extern void mem_guard_get_totals(mem_guard_totals *totals);
+
+#endif // NANOMQ_MEM_GUARD_H
@@ -0,0 +1,61 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_METRICS_H
+#define NANOMQ_METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <conf.h>
+#include <nng/nng.h>
+
+struct cJSON;
+
+// Stages of a PUBLISH timed by a metrics_trace, in the order they end.
+enum {
+	TRACE_DECODE,  // taken in RECV until decoded
+	TRACE_MATCH,   // subscribers found and resolved to pipes
+	TRACE_HANDOFF, // retained, bridged and handed over to WAIT
+	TRACE_ENCODE,  // the variants of the subscribers encoded
+	TRACE_SEND,    // submitted to the pipes until the aio completed
+	TRACE_STAGES,
+};
+
+typedef struct {
+	uint64_t start; // ns the PUBLISH was taken, 0 if not timed
+	uint64_t last;  // ns the last stage ended
+	uint64_t stage[TRACE_STAGES];
+} metrics_trace;
+
+extern void          metrics_msg_in(nng_msg *msg);
+extern void          metrics_msg_out(nng_msg *msg);
+extern void          metrics_tls_pipe(bool added);
+extern void          metrics_fanout(uint32_t pipes);
+extern void          metrics_match(uint64_t ns);
+extern void          metrics_latency(nng_time recv_time);
+extern uint64_t      metrics_now_ns(void);
+extern struct cJSON *metrics_json(void);
+extern nng_msg *     metrics_sys_msg(nng_time now, int interval);
+
+extern void metrics_trace_init(conf_trace *config);
+extern void metrics_trace_begin(metrics_trace *t);
+extern void metrics_trace_stage(metrics_trace *t, int stage);
+extern void metrics_trace_end(metrics_trace *t, const char *topic);
+
+// a no-op unless metrics_trace_begin took t as a sample
+static inline void
+metrics_trace_mark(metrics_trace *t, int stage)
+{
+	if (t->start != 0) {
+		metrics_trace_stage(t, stage);
+	}
+}
+
+#endif // NANOMQ_METRICS_H
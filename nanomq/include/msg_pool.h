@@ -0,0 +1,33 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_MSG_POOL_H
+#define NANOMQ_MSG_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <nng/nng.h>
+
+#define NNL_MSG_POOL_CAP 64 // idle msgs kept, until resized
+#define NNL_MSG_SMALL 256   // longer msgs are freed, not kept
+
+typedef struct nnl_msg_pool nnl_msg_pool;
+
+extern int    nnl_msg_pool_create(nnl_msg_pool **mp);
+extern void   nnl_msg_pool_delete(nnl_msg_pool *mp);
+extern int    nnl_msg_pool_resize(nnl_msg_pool *mp, size_t cap);
+extern size_t nnl_msg_pool_capacity(nnl_msg_pool *mp);
+extern size_t nnl_msg_pool_used(nnl_msg_pool *mp);
+extern bool   nnl_msg_pool_empty(nnl_msg_pool *mp);
+extern bool   nnl_msg_pool_full(nnl_msg_pool *mp);
+extern int    nnl_msg_get(nnl_msg_pool *mp, nng_msg **msg);
+extern int    nnl_msg_put(nnl_msg_pool *mp, nng_msg **msg);
+
+#endif // NANOMQ_MSG_POOL_H
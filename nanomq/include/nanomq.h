@@ -1,102 +1,15 @@
 
 #define _GNU_SOURCE
-#define DEBUG_FILE_PATH "/tmp/debug_nanomq.log"
+#include <nano_log.h>
 
-// later expose on makefile
-/**/
+// debug_msg goes through the nano_log rings, the broker opens the writer
+// with the configured log.* options. Use log_trace on per message paths.
 #if defined(NOLOG)
-#undef DEBUG_CONSOLE
-#undef DEBUG_FILE
-#undef DEBUG_SYSLOG
-#undef DEBUG_TRACE
-#else
-#define DEBUG_CONSOLE
-#define DEBUG_FILE
-#define DEBUG_SYSLOG
-#define DEBUG_TRACE
-#endif
-
-#undef LIBNANO_DEBUG
-#if defined(DEBUG_CONSOLE) || defined(DEBUG_FILE) || defined(DEBUG_SYSLOG)
-#define LIBNANO_DEBUG
-
-#include <stdio.h>
-#include <string.h>
-#include <sys/types.h>
-#include <syslog.h>
-#include <time.h>
-#include <unistd.h>
-
-static inline char *
-nanomq_time_str()
-{
-	char * buff;
-	time_t now;
-
-	now  = time(NULL);
-	buff = ctime(&now);
-	if (!buff)
-		return NULL;
-
-	if (buff[strlen(buff) - 1] == '\n')
-		buff[strlen(buff) - 1] = '\0';
-
-	return buff;
-}
-
-#endif
-
-#if defined(DEBUG_CONSOLE)
-#define debug_console(fmt, arg...)                                            \
-	do {                                                                  \
-		char *_t = nanomq_time_str();                                 \
-		fprintf(stderr, "%s %s: " fmt "\n", _t, __FUNCTION__, ##arg); \
-	} while (0)
-#else
-#define debug_console(fmt, arg...) \
-	do {                       \
-	} while (0)
-#endif
-
-#if defined(DEBUG_FILE)
-#define debug_file(fmt, arg...)                                      \
-	do {                                                         \
-		char *_t   = nanomq_time_str();                      \
-		FILE *file = fopen(DEBUG_FILE_PATH, "a");            \
-		fprintf(file, "%s [%i] %s: " fmt "\n", _t, getpid(), \
-		    __FUNCTION__, ##arg);                            \
-		fclose(file);                                        \
-	} while (0)
-#else
-#define debug_file(fmt, arg...) \
-	do {                    \
-	} while (0)
-#endif
-
-#if defined(DEBUG_SYSLOG)
-#define debug_syslog(fmt, arg...)                                   \
-	do {                                                        \
-		openlog("nanomq", LOG_PID, LOG_DAEMON | LOG_EMERG); \
-		syslog(0, "%s: " fmt, __FUNCTION__, ##arg);         \
-		closelog();                                         \
-	} while (0)
-#else
-#define debug_syslog(fmt, arg...) \
-	do {                      \
-	} while (0)
-#endif
-
-#if defined(LIBNANO_DEBUG)
-#define debug_msg(fmt, arg...)             \
-	do {                               \
-		debug_console(fmt, ##arg); \
-		debug_file(fmt, ##arg);    \
-		debug_syslog(fmt, ##arg);  \
-	} while (0)
-#else
 #define debug_msg(fmt, arg...) \
 	do {                   \
 	} while (0)
+#else
+#define debug_msg(fmt, arg...) nano_log(NANO_LOG_DEBUG, fmt, ##arg)
 #endif
 
 #define NNI_PUT16(ptr, u)                                    \
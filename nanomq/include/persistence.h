@@ -0,0 +1,22 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_PERSISTENCE_H
+#define NANOMQ_PERSISTENCE_H
+
+#include <conf.h>
+#include <mqtt_db.h>
+#include <nano_retain.h>
+
+extern int  persistence_start(
+     conf_persistence *config, dbtree *db, nano_retain *retain);
+extern void persistence_stop(void);
+extern void persistence_retain(const char *topic, const nano_retain_msg *ret);
+
+#endif // NANOMQ_PERSISTENCE_H
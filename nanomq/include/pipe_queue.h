@@ -0,0 +1,49 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_PIPE_QUEUE_H
+#define NANOMQ_PIPE_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nng/nng.h>
+
+// the user property of a SUBSCRIBE, true conflates its filters
+#define PIPE_CONFLATE_PROPERTY "conflate"
+
+typedef struct {
+	uint32_t pipe_id;
+	uint32_t depth;    // messages held by the broker
+	uint32_t inflight; // sent and not acknowledged
+	uint64_t dropped;
+} pipe_queue_stat;
+
+typedef struct {
+	uint64_t queued; // messages held by the broker now
+	uint64_t dropped;
+	uint64_t disconnected;
+	uint64_t expired;   // held past their Message Expiry Interval
+	uint64_t conflated; // replaced by a newer one on their topic
+} pipe_queue_totals;
+
+typedef void (*pipe_queue_cb)(const pipe_queue_stat *stat, void *arg);
+
+extern void     pipe_queue_init(int size, int overflow, const char *conflate);
+extern void     pipe_queue_conflate(
+        uint32_t pipe_id, const char *filter, bool on);
+extern bool     pipe_queue_admit(
+        uint32_t pipe_id, nng_msg *msg, uint8_t qos, uint8_t proto);
+extern nng_msg *pipe_queue_next(uint32_t pipe_id, nng_time now);
+extern void     pipe_queue_drop(uint32_t pipe_id);
+extern bool     pipe_queue_get_stat(uint32_t pipe_id, pipe_queue_stat *stat);
+extern void     pipe_queue_foreach(pipe_queue_cb cb, void *arg);
+extern void     pipe_queue_get_totals(pipe_queue_totals *totals);
+
+#endif // NANOMQ_PIPE_QUEUE_H
@@ -39,17 +39,11 @@ struct property_u32 {
 	uint32_t value;
 };
 
-// Special for publish message data structure
+// Special for publish message data structure, the other properties of a
+// PUBLISH stay in the received msg, see pub_props_find
 union property_content {
 	struct {
-		struct property_u8   payload_fmt_indicator;
-		struct property_u32  msg_expiry_interval;
-		struct property_u16  topic_alias;
-		struct mqtt_string   response_topic;
-		struct mqtt_binary   correlation_data;
-		struct mqtt_str_pair user_property;
-		struct property_u32  subscription_identifier;
-		struct mqtt_string   content_type;
+		struct property_u16 topic_alias;
 	} publish;
 	struct {
 		struct mqtt_string   reason_string;
@@ -69,6 +63,10 @@ union variable_header {
 		uint16_t           packet_identifier;
 		struct mqtt_string topic_name;
 		struct properties  properties;
+		// the property block as received, in the body of the msg
+		uint8_t *props;
+		uint32_t props_len;
+		uint32_t alias_at; // offset of the Topic Alias, left out
 	} publish;
 
 	struct {
@@ -81,16 +79,20 @@ union variable_header {
 struct mqtt_payload {
 	uint8_t *payload;
 	uint32_t payload_len;
+	bool     borrowed; // payload points into the body of received msg
 };
 
 struct pub_packet_struct {
 	struct fixed_header   fixed_header;
 	union variable_header variable_header;
 	struct mqtt_payload   payload_body;
+	uint8_t               proto; // protocol the received msg is decoded by
+	bool                  aliased; // topic came with a topic alias
 };
 
 struct pipe_info {
 	uint8_t                   qos;
+	uint8_t                   proto_ver;
 	mqtt_control_packet_types cmd;
 
 	uint32_t  pipe;
@@ -99,25 +101,44 @@ struct pipe_info {
 };
 
 struct pipe_content {
+	uint32_t  cap; // size of pipe_info, kept across messages
 	uint32_t  total;
 	uint32_t  current_index;
 	uint32_t *pipes; // queue of nng_pipes
 	bool (*encode_msg)(nng_msg *, const nano_work *,
-	    mqtt_control_packet_types, uint8_t, bool);
+	    mqtt_control_packet_types, uint8_t, uint8_t, bool);
 	struct pipe_info *pipe_info;
 };
 
 bool        encode_pub_message(nng_msg *dest_msg, const nano_work *work,
-           mqtt_control_packet_types cmd, uint8_t sub_qos, bool dup);
+           mqtt_control_packet_types cmd, uint8_t sub_qos, uint8_t proto,
+           bool dup);
+bool        forward_pub_message(nng_msg *msg, const nano_work *work,
+           uint8_t sub_qos, uint8_t proto);
+nng_msg *   encode_pub_alias(nng_msg *src, uint16_t alias, bool with_topic);
+bool        pub_props_find(
+           const uint8_t *props, size_t len, uint8_t id, size_t *off);
+bool        pub_props_expiry(const uint8_t *props, size_t len, size_t *off,
+           uint32_t *interval);
+nng_time    pub_msg_expire_at(nng_msg *msg);
+nng_msg *   pub_msg_refresh(nng_msg *msg, nng_time now);
 reason_code decode_pub_message(nano_work *work);
-void        foreach_client(
-           void **cli_ctx_list, nano_work *pub_work, struct pipe_content *pipe_ct);
+void        foreach_client(void **cli_ctx_list, uint8_t *qos,
+           nano_work *pub_work, struct pipe_content *pipe_ct);
 void free_pub_packet(struct pub_packet_struct *pub_packet);
 void free_pipes_info(struct pipe_info *p_info);
 void init_pipe_content(struct pipe_content *pipe_ct);
+void reset_pipe_content(struct pipe_content *pipe_ct);
 void handle_pub(nano_work *work, struct pipe_content *pipe_ct);
 struct pub_packet_struct *copy_pub_packet(
     struct pub_packet_struct *src_pub_packet);
 void init_pub_packet_property(struct pub_packet_struct *pub_packet);
 
+void     pipe_alias_init(uint16_t in_max, uint16_t out_max);
+void     pipe_alias_drop(uint32_t pipe_id);
+bool     pipe_alias_out_enabled(void);
+uint16_t pipe_alias_out_begin(
+    uint32_t pipe_id, const char *topic, size_t len, bool *fresh);
+void     pipe_alias_out_end(uint32_t pipe_id);
+
 #endif // NNG_PUB_HANDLER_H
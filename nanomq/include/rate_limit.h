@@ -0,0 +1,36 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_RATE_LIMIT_H
+#define NANOMQ_RATE_LIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <conf.h>
+#include <nng/nng.h>
+
+typedef struct {
+	uint64_t dropped;      // PUBLISH dropped over a limit
+	uint64_t disconnected; // pipes closed over a limit
+	uint64_t paused;       // PUBLISH held back until within a limit
+} rate_limit_totals;
+
+extern void     rate_limit_init(conf_rate_limit *config, int works);
+extern bool     rate_limit_enabled(void);
+extern int      rate_limit_get_policy(void);
+extern void     rate_limit_open(uint32_t pipe_id);
+extern uint64_t rate_limit_take(
+        uint32_t pipe_id, nng_msg *msg, uint64_t now, bool force);
+extern bool     rate_limit_pause_begin(void);
+extern void     rate_limit_pause_end(void);
+extern void     rate_limit_reject(int policy);
+extern void     rate_limit_get_totals(rate_limit_totals *totals);
+
+#endif // NANOMQ_RATE_LIMIT_H
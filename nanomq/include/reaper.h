@@ -0,0 +1,25 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_REAPER_H
+#define NANOMQ_REAPER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <conf.h>
+#include <mqtt_db.h>
+#include <nano_retain.h>
+
+extern void reaper_start(conf *config, dbtree *db, nano_retain *retain);
+extern void reaper_stop(void);
+extern void reaper_session_offline(uint32_t session_id);
+extern bool reaper_session_online(uint32_t session_id);
+
+#endif // NANOMQ_REAPER_H
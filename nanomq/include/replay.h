@@ -0,0 +1,16 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_REPLAY_H
+#define NANOMQ_REPLAY_H
+
+int replay_start(int argc, char **argv);
+int replay_dflt(int argc, char **argv);
+
+#endif // NANOMQ_REPLAY_H
@@ -0,0 +1,45 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_REST_JSON_H
+#define NANOMQ_REST_JSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Writes a JSON document as it goes into a list of fixed size chunks, so
+// a listing is never held as a cJSON tree and a printed copy of it. Every
+// value takes the key it has in its object, NULL in an array or at the
+// top. Nesting is limited to REST_JSON_DEPTH.
+
+#define REST_JSON_CHUNK 16384
+#define REST_JSON_DEPTH 32
+
+typedef struct rest_json_chunk rest_json_chunk;
+
+typedef struct {
+	rest_json_chunk *head;
+	rest_json_chunk *tail;
+	size_t           len;   // bytes written
+	int              depth; // of open objects and arrays
+	uint32_t         used;  // bit per depth, set once it holds a value
+} rest_json;
+
+extern void  rest_json_init(rest_json *w);
+extern void  rest_json_fini(rest_json *w);
+extern void  rest_json_obj_begin(rest_json *w, const char *key);
+extern void  rest_json_obj_end(rest_json *w);
+extern void  rest_json_arr_begin(rest_json *w, const char *key);
+extern void  rest_json_arr_end(rest_json *w);
+extern void  rest_json_str(rest_json *w, const char *key, const char *s);
+extern void  rest_json_uint(rest_json *w, const char *key, uint64_t n);
+extern char *rest_json_take(rest_json *w, size_t *len);
+
+#endif // NANOMQ_REST_JSON_H
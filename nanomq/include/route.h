@@ -0,0 +1,30 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_ROUTE_H
+#define NANOMQ_ROUTE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <conf.h>
+#include <mqtt_db.h>
+#include <nng/nng.h>
+
+#define ROUTE_TOPIC "$nanomq/route"
+
+extern void     route_init(conf_sys_event *config, dbtree *db);
+extern nng_msg *route_sys_msg(nng_time now);
+
+extern bool route_peer_update(const uint8_t *payload, size_t len);
+extern bool route_peer_match(const char *topic);
+extern void route_peer_reset(void);
+
+#endif // NANOMQ_ROUTE_H
@@ -0,0 +1,31 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_SHM_INGEST_H
+#define NANOMQ_SHM_INGEST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <conf.h>
+#include <nng/nng.h>
+
+typedef struct {
+	uint64_t rings;     // created
+	uint64_t producers; // rings claimed by a process alive or not
+	uint64_t published; // PUBLISH taken from the rings
+	uint64_t full;      // publishes the producers found no room for
+} shm_ingest_totals;
+
+extern int      shm_ingest_init(conf_shm *config);
+extern bool     shm_ingest_enabled(void);
+extern nng_msg *shm_ingest_take(void);
+extern void     shm_ingest_get_totals(shm_ingest_totals *totals);
+
+#endif // NANOMQ_SHM_INGEST_H
@@ -0,0 +1,21 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_SNAPSHOT_H
+#define NANOMQ_SNAPSHOT_H
+
+#include <conf.h>
+#include <mqtt_db.h>
+
+extern void snapshot_start(conf_snapshot *config, dbtree *db);
+extern void snapshot_stop(void);
+extern int  snapshot_save(dbtree *db, const char *path);
+extern int  snapshot_load(dbtree *db, const char *path);
+
+#endif // NANOMQ_SNAPSHOT_H
@@ -19,5 +19,6 @@ void init_sub_property(packet_subscribe *);
 // functions about clean session
 int  cache_session(char *, conn_param *, uint32_t, void *);
 int  restore_session(char *, conn_param *, uint32_t, void *);
+int  expire_session(uint32_t, void *);
 
 #endif
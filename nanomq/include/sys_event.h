@@ -0,0 +1,31 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_SYS_EVENT_H
+#define NANOMQ_SYS_EVENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <conf.h>
+#include <nng/nng.h>
+
+typedef struct {
+	uint64_t queued;    // events waiting for a sys event work now
+	uint64_t dropped;   // events lost to a full queue
+	uint64_t published; // PUBLISH built from events
+} sys_event_totals;
+
+extern void     sys_event_init(conf_sys_event *config);
+extern bool     sys_event_enabled(void);
+extern void     sys_event_post(nng_msg *msg);
+extern nng_msg *sys_event_take(void);
+extern void     sys_event_get_totals(sys_event_totals *totals);
+
+#endif // NANOMQ_SYS_EVENT_H
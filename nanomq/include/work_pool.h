@@ -0,0 +1,49 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#ifndef NANOMQ_WORK_POOL_H
+#define NANOMQ_WORK_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <conf.h>
+
+#include "broker.h"
+
+// pool_state of a work
+#define WORK_POOL_NONE 0   // not a broker work of the pool
+#define WORK_POOL_BUSY 1   // on a message
+#define WORK_POOL_IDLE 2   // waiting for a message
+#define WORK_POOL_RETIRE 3 // to be parked at its next receive
+#define WORK_POOL_PARKED 4 // stopped, to be freed by the pool
+
+typedef struct {
+	nano_work *(*alloc)(void);     // a broker work in INIT
+	void (*start)(void *work);     // its aio callback
+	void (*free)(nano_work *work); // once parked
+} work_pool_ops;
+
+typedef struct {
+	uint32_t works;      // broker works, with those retiring
+	uint32_t idle;       // waiting for a message
+	uint32_t max;        // works grown to at most
+	uint64_t backlog_ms; // no work has been idle for
+	uint64_t grown;
+	uint64_t shrunk;
+} work_pool_stats;
+
+extern void work_pool_start(
+    conf *config, nano_work **works, const work_pool_ops *ops);
+extern void work_pool_stop(void);
+extern void work_pool_recv(nano_work *work);
+extern bool work_pool_got(nano_work *work, int result);
+extern void work_pool_get_stats(work_pool_stats *stats);
+
+#endif // NANOMQ_WORK_POOL_H
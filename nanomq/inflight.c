@@ -0,0 +1,334 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <pthread.h>
+#include <string.h>
+
+#include <cvector.h>
+#include <nano_timer.h>
+#include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt_parser.h>
+#include <zmalloc.h>
+
+#include "include/inflight.h"
+#include "include/nanomq.h"
+
+/*
+ * QoS 1/2 deliveries of each connection which are not completed yet. The
+ * transport gives each a packet identifier of its pipe and sends it again
+ * every qos_duration until it is acknowledged, so the broker only counts
+ * them: a delivery is counted as it is sent and released by the PUBACK or
+ * PUBCOMP of its pipe. The count is the load least_inflight shared
+ * subscription balances and what the window of pipe_queue is checked
+ * against.
+ *
+ * Keepalive timeouts, 1.5 times the keepalive of the CONNECT, are timers
+ * of hierarchical wheels, so a tick costs what expires on it and not what
+ * is connected. Sessions are hashed to buckets, a stripe of buckets
+ * shares a lock and a wheel. The inflight work runs the ticks, a pipe
+ * silent for too long is closed.
+ *
+ * The window of a pipe is the Receive Maximum of its CONNECT. Pipes are
+ * hashed to slots for it and for the count, pipes sharing a slot share
+ * them.
+ */
+#define INFLIGHT_BUCKETS 4096
+#define INFLIGHT_STRIPES 64
+#define INFLIGHT_SLOTS 65536
+
+typedef struct inflight_session inflight_session;
+
+struct inflight_session {
+	uint32_t          pipe_id;
+	nng_time          seen;
+	nng_duration      keepalive; // 0 never times out
+	nano_timer        ka_timer;
+	inflight_session *next;
+};
+
+typedef struct {
+	pthread_mutex_t   mtx;
+	nano_timer_wheel *wheel;
+	nng_time          now;  // of the tick being run
+	uint32_t *        idle; // pipes past their keepalive
+} inflight_stripe;
+
+static bool              started = false;
+static inflight_session *buckets[INFLIGHT_BUCKETS];
+static inflight_stripe   stripes[INFLIGHT_STRIPES];
+static uint16_t          windows[INFLIGHT_SLOTS];
+static uint32_t          counts[INFLIGHT_SLOTS];
+static inflight_totals   totals;
+
+// only the inflight work touches it
+static nng_time last_tick = 0;
+
+static inline inflight_session **
+bucket_of(uint32_t pipe_id)
+{
+	return &buckets[(pipe_id * 2654435761u) % INFLIGHT_BUCKETS];
+}
+
+static inline inflight_stripe *
+stripe_of(uint32_t pipe_id)
+{
+	return &stripes[((pipe_id * 2654435761u) % INFLIGHT_BUCKETS) %
+	    INFLIGHT_STRIPES];
+}
+
+static inflight_session *
+session_find(uint32_t pipe_id)
+{
+	inflight_session *s = *bucket_of(pipe_id);
+
+	while (s != NULL && s->pipe_id != pipe_id) {
+		s = s->next;
+	}
+	return s;
+}
+
+// close the pipe unless it was seen since the timer was set
+static void
+keepalive_cb(nano_timer *t, void *arg)
+{
+	inflight_session *s  = arg;
+	inflight_stripe * st = stripe_of(s->pipe_id);
+
+	if (st->now < s->seen + s->keepalive) {
+		nano_timer_add(st->wheel, t, s->seen + s->keepalive);
+		return;
+	}
+	cvector_push_back(st->idle, s->pipe_id);
+}
+
+// called before the works start
+void
+inflight_init(void)
+{
+	nng_time now = nng_clock();
+
+	for (int i = 0; i < INFLIGHT_STRIPES; i++) {
+		pthread_mutex_init(&stripes[i].mtx, NULL);
+		stripes[i].wheel =
+		    nano_timer_wheel_create(now, INFLIGHT_TICK_MS);
+		stripes[i].idle = NULL;
+	}
+	last_tick = now;
+	started   = true;
+}
+
+/**
+ * @brief inflight_open - Start the session of a pipe on its CONNACK.
+ * @param pipe_id - pipe
+ * @param receive_max - Receive Maximum of the CONNECT, 0 if none
+ * @param keepalive - Keep Alive of the CONNECT in seconds, 0 if none
+ * @return void
+ */
+void
+inflight_open(uint32_t pipe_id, uint16_t receive_max, uint16_t keepalive)
+{
+	inflight_stripe * st = stripe_of(pipe_id);
+	inflight_session *s  = NULL;
+
+	if (!started) {
+		return;
+	}
+	__atomic_store_n(&windows[pipe_id % INFLIGHT_SLOTS], receive_max,
+	    __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&st->mtx);
+	if (session_find(pipe_id) != NULL) {
+		pthread_mutex_unlock(&st->mtx);
+		return;
+	}
+	if ((s = zmalloc(sizeof(inflight_session))) == NULL) {
+		pthread_mutex_unlock(&st->mtx);
+		return;
+	}
+	memset(s, 0, sizeof(inflight_session));
+	s->pipe_id   = pipe_id;
+	s->seen      = nng_clock();
+	s->keepalive = (nng_duration) keepalive * 1500;
+	nano_timer_init(&s->ka_timer, keepalive_cb, s);
+	if (s->keepalive > 0) {
+		nano_timer_add(
+		    st->wheel, &s->ka_timer, s->seen + s->keepalive);
+	}
+	s->next             = *bucket_of(pipe_id);
+	*bucket_of(pipe_id) = s;
+	pthread_mutex_unlock(&st->mtx);
+
+	__atomic_add_fetch(&totals.sessions, 1, __ATOMIC_RELAXED);
+}
+
+// the pipe is gone, so is what it did not acknowledge
+void
+inflight_close(uint32_t pipe_id)
+{
+	inflight_stripe *  st = stripe_of(pipe_id);
+	inflight_session **pp = bucket_of(pipe_id);
+	inflight_session * s  = NULL;
+	uint32_t           cnt;
+
+	cnt = __atomic_exchange_n(
+	    &counts[pipe_id % INFLIGHT_SLOTS], 0, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&totals.inflight, cnt, __ATOMIC_RELAXED);
+	if (!started) {
+		return;
+	}
+	__atomic_store_n(
+	    &windows[pipe_id % INFLIGHT_SLOTS], 0, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&st->mtx);
+	while (*pp != NULL && (*pp)->pipe_id != pipe_id) {
+		pp = &(*pp)->next;
+	}
+	if ((s = *pp) == NULL) {
+		pthread_mutex_unlock(&st->mtx);
+		return;
+	}
+	*pp = s->next;
+	nano_timer_del(st->wheel, &s->ka_timer);
+	pthread_mutex_unlock(&st->mtx);
+
+	zfree(s);
+	__atomic_sub_fetch(&totals.sessions, 1, __ATOMIC_RELAXED);
+}
+
+// a packet came from the pipe, its keepalive starts again
+void
+inflight_seen(uint32_t pipe_id)
+{
+	inflight_stripe * st = stripe_of(pipe_id);
+	inflight_session *s;
+
+	if (!started) {
+		return;
+	}
+	pthread_mutex_lock(&st->mtx);
+	if ((s = session_find(pipe_id)) != NULL && s->keepalive > 0) {
+		s->seen = nng_clock();
+	}
+	pthread_mutex_unlock(&st->mtx);
+}
+
+/**
+ * @brief inflight_window - QoS 1/2 messages the pipe takes unacknowledged.
+ * @param pipe_id - pipe
+ * @return Receive Maximum of the pipe, 0 if it has none
+ */
+uint16_t
+inflight_window(uint32_t pipe_id)
+{
+	return __atomic_load_n(
+	    &windows[pipe_id % INFLIGHT_SLOTS], __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief inflight_sent - Count a PUBLISH sent to a pipe until it is
+ * acknowledged, QoS 0 has nothing to wait for.
+ * @param pipe_id - pipe
+ * @param qos - qos the PUBLISH is sent with
+ * @return void
+ */
+void
+inflight_sent(uint32_t pipe_id, uint8_t qos)
+{
+	if (qos == 0) {
+		return;
+	}
+	__atomic_add_fetch(
+	    &counts[pipe_id % INFLIGHT_SLOTS], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&totals.inflight, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief inflight_ack - Release a delivery of the pipe by an
+ * acknowledgement, PUBACK completes QoS 1 and PUBCOMP QoS 2. A PUBREC is
+ * only halfway, the delivery waits for its PUBCOMP.
+ * @param pipe_id - pipe
+ * @param cmd - CMD_PUBACK, CMD_PUBREC or CMD_PUBCOMP
+ * @return true if a delivery was released
+ */
+bool
+inflight_ack(uint32_t pipe_id, uint8_t cmd)
+{
+	uint32_t *slot = &counts[pipe_id % INFLIGHT_SLOTS];
+	uint32_t  cnt  = __atomic_load_n(slot, __ATOMIC_RELAXED);
+
+	if (cmd != CMD_PUBACK && cmd != CMD_PUBCOMP) {
+		return false;
+	}
+	do {
+		if (cnt == 0) {
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(slot, &cnt, cnt - 1, true,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_sub_fetch(&totals.inflight, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+// QoS 1/2 deliveries sent to the pipe and not acknowledged
+uint32_t
+inflight_count(uint32_t pipe_id)
+{
+	return __atomic_load_n(
+	    &counts[pipe_id % INFLIGHT_SLOTS], __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief inflight_tick - Run a tick of the wheels once one passed, pipes
+ * past their keepalive are closed. Called by the inflight work only.
+ * @param now - nng_clock()
+ * @return void
+ */
+void
+inflight_tick(nng_time now)
+{
+	uint32_t *idle = NULL;
+
+	if (!started || now < last_tick + INFLIGHT_TICK_MS) {
+		return;
+	}
+	last_tick = now;
+
+	for (int i = 0; i < INFLIGHT_STRIPES; i++) {
+		inflight_stripe *st = &stripes[i];
+
+		pthread_mutex_lock(&st->mtx);
+		st->now = now;
+		nano_timer_advance(st->wheel, now);
+		for (size_t j = 0; j < cvector_size(st->idle); j++) {
+			cvector_push_back(idle, st->idle[j]);
+		}
+		cvector_free(st->idle);
+		st->idle = NULL;
+		pthread_mutex_unlock(&st->mtx);
+	}
+
+	// closing notifies the broker, which closes the session
+	for (size_t j = 0; j < cvector_size(idle); j++) {
+		nng_pipe pipe = { .id = idle[j] };
+
+		debug_msg("pipe %u keepalive timed out", idle[j]);
+		nng_pipe_close(pipe);
+		__atomic_add_fetch(&totals.timed_out, 1, __ATOMIC_RELAXED);
+	}
+	cvector_free(idle);
+}
+
+void
+inflight_get_totals(inflight_totals *t)
+{
+	t->sessions  = __atomic_load_n(&totals.sessions, __ATOMIC_RELAXED);
+	t->inflight  = __atomic_load_n(&totals.inflight, __ATOMIC_RELAXED);
+	t->timed_out = __atomic_load_n(&totals.timed_out, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,155 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <pthread.h>
+#include <string.h>
+
+#include <conf.h>
+#include <nano_mem.h>
+#include <nanolib.h>
+#include <nng/nng.h>
+#include <nng/supplemental/util/platform.h>
+
+#include "include/mem_guard.h"
+#include "include/nanomq.h"
+
+/*
+ * Admission control by the memory nano_mem accounts. The tree, inflight
+ * and the connections count their bytes as they go, a sampler sets those
+ * the retain store and the session queues count themselves every
+ * MEM_GUARD_TICK, then moves the pressure by the watermarks.
+ *
+ * Under pressure the broker refuses what the config tells: a CONNACK
+ * goes out with Server unavailable, or Quota exceeded to MQTT 5, a
+ * SUBSCRIBE gets its filters refused, a QoS 0 PUBLISH is dropped as it
+ * comes in, and the sampler evicts retained messages from the back of
+ * their list until the total would be below the low watermark. Queued
+ * and inflight messages are never dropped for it and QoS 1/2 publishes
+ * go on, so the broker sheds what it may lose and keeps its promises.
+ */
+static pthread_t        thread;
+static conf_mem *       mem_conf = NULL;
+static dbtree *         mem_db   = NULL;
+static nano_retain *    mem_ret  = NULL;
+static int              refusals = 0; // MEM_GUARD_* of the config
+static mem_guard_totals totals;
+
+// set the bytes of the subsystems counting their own
+static void
+mem_guard_sample(void)
+{
+	dbtree_session_queue_stats sq = { 0 };
+	nano_retain_stats          rs = { 0 };
+
+	if (mem_db != NULL) {
+		dbtree_get_session_queue_stats(mem_db, &sq);
+	}
+	if (mem_ret != NULL) {
+		nano_retain_get_stats(mem_ret, &rs);
+	}
+	nano_mem_set(NANO_MEM_SESSION, sq.memory);
+	nano_mem_set(NANO_MEM_RETAIN, rs.memory);
+}
+
+static void *
+mem_guard_run(void *arg)
+{
+	bool   was = false;
+	bool   now;
+	size_t freed;
+
+	(void) arg;
+	for (;;) {
+		nng_msleep(MEM_GUARD_TICK);
+		mem_guard_sample();
+		now = nano_mem_check();
+		if (now != was) {
+			if (now) {
+				__atomic_add_fetch(
+				    &totals.pressured, 1, __ATOMIC_RELAXED);
+			}
+			log_warn("memory pressure %s at %zu bytes",
+			    now ? "starts" : "ends", nano_mem_total());
+			was = now;
+		}
+		if (now && mem_conf->evict_retain && mem_ret != NULL &&
+		    (freed = nano_retain_shrink(mem_ret, nano_mem_excess())) >
+		        0) {
+			__atomic_add_fetch(
+			    &totals.evicted, freed, __ATOMIC_RELAXED);
+			mem_guard_sample();
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief mem_guard_init - Start the sampler, pressure is never on with
+ * no high watermark but the bytes are sampled all the same for metrics.
+ * @param config - conf_mem
+ * @param db - tree of the broker, its session queues are sampled
+ * @param retain - retain store of the broker, or NULL
+ * @return void
+ */
+void
+mem_guard_init(conf_mem *config, dbtree *db, nano_retain *retain)
+{
+	mem_conf = config;
+	mem_db   = db;
+	mem_ret  = retain;
+	refusals = (config->reject_connect ? MEM_GUARD_CONNECT : 0) |
+	    (config->reject_subscribe ? MEM_GUARD_SUBSCRIBE : 0) |
+	    (config->shed_qos0 ? MEM_GUARD_QOS0 : 0);
+	nano_mem_watermarks(config->high_watermark > 0
+	        ? (size_t) config->high_watermark
+	        : 0,
+	    config->low_watermark > 0 ? (size_t) config->low_watermark : 0);
+
+	if (pthread_create(&thread, NULL, mem_guard_run, NULL) != 0) {
+		log_warn("memory sampler can not be created");
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/**
+ * @brief mem_guard_refuse - Whether to refuse what, counted if so.
+ * @param what - MEM_GUARD_CONNECT, MEM_GUARD_SUBSCRIBE or MEM_GUARD_QOS0
+ * @return true under pressure if the config refuses what
+ */
+bool
+mem_guard_refuse(int what)
+{
+	if ((refusals & what) == 0 || !nano_mem_pressure()) {
+		return false;
+	}
+	switch (what) {
+	case MEM_GUARD_CONNECT:
+		__atomic_add_fetch(&totals.connects, 1, __ATOMIC_RELAXED);
+		break;
+	case MEM_GUARD_SUBSCRIBE:
+		__atomic_add_fetch(&totals.subscribes, 1, __ATOMIC_RELAXED);
+		break;
+	default:
+		__atomic_add_fetch(&totals.shed, 1, __ATOMIC_RELAXED);
+		break;
+	}
+	return true;
+}
+
+void
+mem_guard_get_totals(mem_guard_totals *t)
+{
+	t->pressure   = nano_mem_pressure();
+	t->pressured  = __atomic_load_n(&totals.pressured, __ATOMIC_RELAXED);
+	t->connects   = __atomic_load_n(&totals.connects, __ATOMIC_RELAXED);
+	t->subscribes = __atomic_load_n(&totals.subscribes, __ATOMIC_RELAXED);
+	t->shed       = __atomic_load_n(&totals.shed, __ATOMIC_RELAXED);
+	t->evicted    = __atomic_load_n(&totals.evicted, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,475 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <mqtt_db.h>
+#include <nano_mem.h>
+#include <nng/mqtt/packet.h>
+#include <protocol/mqtt/mqtt_parser.h>
+
+#include "include/broker.h"
+#include "include/fanout.h"
+#include "include/inflight.h"
+#include "include/mem_guard.h"
+#include "include/metrics.h"
+#include "include/nanomq.h"
+#include "include/pipe_queue.h"
+#include "include/shm_ingest.h"
+#include "include/sys_event.h"
+#include "include/work_pool.h"
+#include "libs/cJSON.h"
+
+/*
+ * Broker metrics. Each thread counts in a slot of its own, padded to
+ * cache lines, with relaxed loads and stores and no lock prefix, so the
+ * hot path never contends. Readers sum all slots, a sum may miss the
+ * updates in flight. A thread takes its slot on first use, past
+ * METRICS_SLOTS threads the last slot is shared and updated atomically.
+ *
+ * Histograms have log2 buckets, bucket i counts values below 2^i.
+ *
+ * One PUBLISH in trace.sample is traced, its stages are timed on the work
+ * that handles it and added to the trace histograms of the thread that
+ * ends each stage. A traced PUBLISH taking longer than
+ * trace.slow_threshold is logged with its stages.
+ */
+#define METRICS_SLOTS 64
+#define METRICS_BUCKETS 32
+#define METRICS_TYPES 16 // MQTT packet types, the high nibble of cmd
+#define METRICS_SYS_TOPIC "$SYS/brokers/metrics"
+
+enum {
+	MT_BYTES_IN,
+	MT_BYTES_OUT,
+	MT_TRACED,
+	MT_TRACED_SLOW,
+	MT_TLS_ADDED,   // pipes of the tls listener, each one handshake
+	MT_TLS_REMOVED,
+	MT_COUNTERS,
+};
+
+enum {
+	HIST_MATCH_NS,   // time to match a PUBLISH against the tree
+	HIST_LATENCY_MS, // received to sent to the transport
+	HIST_FANOUT,     // pipes a matched PUBLISH went to
+	HIST_TRACE,      // ns of each TRACE_* stage, then of all of them
+	HIST_COUNT = HIST_TRACE + TRACE_STAGES + 1,
+};
+
+typedef struct {
+	uint64_t in[METRICS_TYPES];
+	uint64_t out[METRICS_TYPES];
+	uint64_t counter[MT_COUNTERS];
+	uint64_t hist[HIST_COUNT][METRICS_BUCKETS];
+	uint64_t hist_sum[HIST_COUNT];
+	bool     shared;
+} __attribute__((aligned(64))) metrics_slot;
+
+static const char *type_names[METRICS_TYPES] = { "reserved", "connect",
+	"connack", "publish", "puback", "pubrec", "pubrel", "pubcomp",
+	"subscribe", "suback", "unsubscribe", "unsuback", "pingreq",
+	"pingresp", "disconnect", "auth" };
+
+static const char *hist_names[HIST_COUNT] = { "match_ns", "latency_ms",
+	"fanout", "decode_ns", "match_ns", "handoff_ns", "encode_ns",
+	"send_ns", "total_ns" };
+
+static metrics_slot           slots[METRICS_SLOTS] = {
+	[METRICS_SLOTS - 1].shared = true,
+};
+static int                    slot_cnt = 0;
+static pthread_mutex_t        slot_mtx = PTHREAD_MUTEX_INITIALIZER;
+static __thread metrics_slot *self     = NULL;
+static nng_time               sys_next = 0;
+static int                    trace_sample = 0;
+static uint64_t               trace_slow   = 0; // ns, 0 never
+static __thread int           trace_skip   = 0;
+
+static metrics_slot *
+slot_take(void)
+{
+	metrics_slot *s;
+
+	pthread_mutex_lock(&slot_mtx);
+	if (slot_cnt < METRICS_SLOTS - 1) {
+		s = &slots[slot_cnt++];
+	} else {
+		s = &slots[METRICS_SLOTS - 1];
+	}
+	pthread_mutex_unlock(&slot_mtx);
+
+	return s;
+}
+
+static inline void
+slot_add(metrics_slot *s, uint64_t *c, uint64_t n)
+{
+	if (s->shared) {
+		__atomic_add_fetch(c, n, __ATOMIC_RELAXED);
+	} else {
+		uint64_t v = __atomic_load_n(c, __ATOMIC_RELAXED);
+		__atomic_store_n(c, v + n, __ATOMIC_RELAXED);
+	}
+}
+
+static inline metrics_slot *
+slot_self(void)
+{
+	if (self == NULL) {
+		self = slot_take();
+	}
+	return self;
+}
+
+static inline int
+bucket_of(uint64_t v)
+{
+	int b = v == 0 ? 0 : 64 - __builtin_clzll(v);
+
+	return b < METRICS_BUCKETS ? b : METRICS_BUCKETS - 1;
+}
+
+static void
+hist_add(int h, uint64_t v)
+{
+	metrics_slot *s = slot_self();
+
+	slot_add(s, &s->hist[h][bucket_of(v)], 1);
+	slot_add(s, &s->hist_sum[h], v);
+}
+
+static inline uint64_t
+slot_load(const uint64_t *c)
+{
+	return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+void
+metrics_msg_in(nng_msg *msg)
+{
+	metrics_slot *s = slot_self();
+
+	slot_add(s, &s->in[(nng_msg_cmd_type(msg) >> 4) & 0x0F], 1);
+	slot_add(s, &s->counter[MT_BYTES_IN],
+	    nng_msg_header_len(msg) + nng_msg_len(msg));
+}
+
+void
+metrics_msg_out(nng_msg *msg)
+{
+	metrics_slot *s = slot_self();
+
+	slot_add(s, &s->out[(nng_msg_cmd_type(msg) >> 4) & 0x0F], 1);
+	slot_add(s, &s->counter[MT_BYTES_OUT],
+	    nng_msg_header_len(msg) + nng_msg_len(msg));
+}
+
+// a pipe of the tls listener is added once its handshake is done
+void
+metrics_tls_pipe(bool added)
+{
+	metrics_slot *s = slot_self();
+
+	slot_add(s, &s->counter[added ? MT_TLS_ADDED : MT_TLS_REMOVED], 1);
+}
+
+void
+metrics_fanout(uint32_t pipes)
+{
+	hist_add(HIST_FANOUT, pipes);
+}
+
+void
+metrics_match(uint64_t ns)
+{
+	hist_add(HIST_MATCH_NS, ns);
+}
+
+void
+metrics_latency(nng_time recv_time)
+{
+	nng_time now = nng_clock();
+
+	if (recv_time != 0 && now >= recv_time) {
+		hist_add(HIST_LATENCY_MS, now - recv_time);
+	}
+}
+
+uint64_t
+metrics_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+metrics_trace_init(conf_trace *config)
+{
+	trace_sample = config->sample > 0 ? config->sample : 0;
+	trace_slow   = config->slow_threshold > 0
+	    ? (uint64_t) config->slow_threshold * 1000
+	    : 0;
+}
+
+/**
+ * @brief metrics_trace_begin - Take a PUBLISH as a sample, one in
+ * trace.sample per thread, or leave t untimed.
+ * @param t - metrics_trace of the work taking the PUBLISH
+ * @return void
+ */
+void
+metrics_trace_begin(metrics_trace *t)
+{
+	t->start = 0;
+	if (trace_sample == 0 || ++trace_skip < trace_sample) {
+		return;
+	}
+	trace_skip = 0;
+	memset(t->stage, 0, sizeof(t->stage));
+	t->start = t->last = metrics_now_ns();
+}
+
+void
+metrics_trace_stage(metrics_trace *t, int stage)
+{
+	uint64_t now = metrics_now_ns();
+
+	t->stage[stage] = now - t->last;
+	t->last         = now;
+	hist_add(HIST_TRACE + stage, t->stage[stage]);
+}
+
+/**
+ * @brief metrics_trace_end - Add the total of a traced PUBLISH, log its
+ * stages if it is slow, then leave t untimed. Stages not reached are 0.
+ * @param t - metrics_trace taken as a sample
+ * @param topic - topic of the PUBLISH, for the log
+ * @return void
+ */
+void
+metrics_trace_end(metrics_trace *t, const char *topic)
+{
+	metrics_slot *s     = slot_self();
+	uint64_t      total = metrics_now_ns() - t->start;
+
+	hist_add(HIST_TRACE + TRACE_STAGES, total);
+	slot_add(s, &s->counter[MT_TRACED], 1);
+	if (trace_slow != 0 && total >= trace_slow) {
+		slot_add(s, &s->counter[MT_TRACED_SLOW], 1);
+		log_warn("slow PUBLISH %s: %lu ns, decode %lu match %lu "
+		         "handoff %lu encode %lu send %lu",
+		    topic ? topic : "", total, t->stage[TRACE_DECODE],
+		    t->stage[TRACE_MATCH], t->stage[TRACE_HANDOFF],
+		    t->stage[TRACE_ENCODE], t->stage[TRACE_SEND]);
+	}
+	t->start = 0;
+}
+
+static cJSON *
+types_json(bool out)
+{
+	cJSON *obj = cJSON_CreateObject();
+
+	for (int t = 1; t < METRICS_TYPES; t++) {
+		uint64_t n = 0;
+		for (int i = 0; i < METRICS_SLOTS; i++) {
+			metrics_slot *sl = &slots[i];
+			n += slot_load(out ? &sl->out[t] : &sl->in[t]);
+		}
+		if (n > 0) {
+			cJSON_AddNumberToObject(obj, type_names[t], n);
+		}
+	}
+	return obj;
+}
+
+static uint64_t
+counter_sum(int c)
+{
+	uint64_t n = 0;
+
+	for (int i = 0; i < METRICS_SLOTS; i++) {
+		n += slot_load(&slots[i].counter[c]);
+	}
+	return n;
+}
+
+// count, sum and the buckets up to the last one not empty
+static cJSON *
+hist_json(int h)
+{
+	uint64_t b[METRICS_BUCKETS] = { 0 };
+	uint64_t cnt                = 0;
+	uint64_t sum                = 0;
+	int      last               = -1;
+	cJSON *  obj                = cJSON_CreateObject();
+	cJSON *  arr                = cJSON_CreateArray();
+
+	for (int i = 0; i < METRICS_SLOTS; i++) {
+		for (int k = 0; k < METRICS_BUCKETS; k++) {
+			b[k] += slot_load(&slots[i].hist[h][k]);
+		}
+		sum += slot_load(&slots[i].hist_sum[h]);
+	}
+	for (int k = 0; k < METRICS_BUCKETS; k++) {
+		cnt += b[k];
+		last = b[k] > 0 ? k : last;
+	}
+	for (int k = 0; k <= last; k++) {
+		cJSON_AddItemToArray(arr, cJSON_CreateNumber(b[k]));
+	}
+	cJSON_AddNumberToObject(obj, "count", cnt);
+	cJSON_AddNumberToObject(obj, "sum", sum);
+	cJSON_AddItemToObject(obj, "buckets", arr);
+	return obj;
+}
+
+static cJSON *
+trace_json(void)
+{
+	cJSON *obj = cJSON_CreateObject();
+
+	cJSON_AddNumberToObject(obj, "sample", trace_sample);
+	cJSON_AddNumberToObject(obj, "traced", counter_sum(MT_TRACED));
+	cJSON_AddNumberToObject(obj, "slow", counter_sum(MT_TRACED_SLOW));
+	for (int h = HIST_TRACE; h < HIST_COUNT; h++) {
+		cJSON_AddItemToObject(obj, hist_names[h], hist_json(h));
+	}
+	return obj;
+}
+
+/**
+ * @brief metrics_json - Sum the slots of all threads, with the gauges of
+ * retained messages, session and subscriber queues.
+ * @return cJSON object, owned by the caller
+ */
+cJSON *
+metrics_json(void)
+{
+	cJSON *                    obj = cJSON_CreateObject();
+	dbtree *                   db  = get_broker_db();
+	nano_retain *              ret = get_broker_retain();
+	dbtree_session_queue_stats sq  = { 0 };
+	nano_retain_stats          rs  = { 0 };
+	pipe_queue_totals          pq;
+	sys_event_totals           ev;
+	inflight_totals            in;
+	work_pool_stats            wp;
+	shm_ingest_totals          shm;
+	fanout_totals              fan;
+	mem_guard_totals           mg;
+	cJSON *                    mem;
+
+	cJSON_AddItemToObject(obj, "msg_in", types_json(false));
+	cJSON_AddItemToObject(obj, "msg_out", types_json(true));
+	cJSON_AddNumberToObject(obj, "bytes_in", counter_sum(MT_BYTES_IN));
+	cJSON_AddNumberToObject(obj, "bytes_out", counter_sum(MT_BYTES_OUT));
+	cJSON_AddNumberToObject(
+	    obj, "tls_handshakes", counter_sum(MT_TLS_ADDED));
+	cJSON_AddNumberToObject(obj, "tls_pipes",
+	    counter_sum(MT_TLS_ADDED) - counter_sum(MT_TLS_REMOVED));
+
+	if (ret != NULL) {
+		nano_retain_get_stats(ret, &rs);
+	}
+	cJSON_AddNumberToObject(obj, "retained", rs.count);
+	cJSON_AddNumberToObject(obj, "retain_bytes", rs.memory);
+	cJSON_AddNumberToObject(obj, "retain_evicted", rs.evicted);
+	cJSON_AddNumberToObject(obj, "retain_compressed", rs.compressed);
+	cJSON_AddNumberToObject(obj, "retain_expired", rs.expired);
+
+	if (db != NULL) {
+		dbtree_get_session_queue_stats(db, &sq);
+	}
+	pipe_queue_get_totals(&pq);
+	sys_event_get_totals(&ev);
+	inflight_get_totals(&in);
+	work_pool_get_stats(&wp);
+	shm_ingest_get_totals(&shm);
+	fanout_get_totals(&fan);
+	mem_guard_get_totals(&mg);
+	cJSON_AddNumberToObject(obj, "session_queue_bytes", sq.memory);
+	cJSON_AddNumberToObject(obj, "sub_queue_depth", pq.queued);
+	cJSON_AddNumberToObject(obj, "sub_queue_expired", pq.expired);
+	cJSON_AddNumberToObject(obj, "sub_queue_conflated", pq.conflated);
+	cJSON_AddNumberToObject(obj, "inflight", in.inflight);
+	cJSON_AddNumberToObject(obj, "keepalive_timeouts", in.timed_out);
+	cJSON_AddNumberToObject(obj, "works", wp.works);
+	cJSON_AddNumberToObject(obj, "works_idle", wp.idle);
+	cJSON_AddNumberToObject(obj, "work_backlog_ms", wp.backlog_ms);
+	cJSON_AddNumberToObject(obj, "shm_producers", shm.producers);
+	cJSON_AddNumberToObject(obj, "shm_published", shm.published);
+	cJSON_AddNumberToObject(obj, "shm_full", shm.full);
+	cJSON_AddNumberToObject(obj, "fanout_parts", fan.parts);
+	cJSON_AddNumberToObject(obj, "fanout_receivers", fan.receivers);
+	cJSON_AddNumberToObject(obj, "fanout_queued", fan.queued);
+	mem = cJSON_CreateObject();
+	for (int t = 0; t < NANO_MEM_TAGS; t++) {
+		cJSON_AddNumberToObject(
+		    mem, nano_mem_name(t), nano_mem_used(t));
+	}
+	cJSON_AddNumberToObject(mem, "total", nano_mem_total());
+	cJSON_AddItemToObject(obj, "memory", mem);
+	cJSON_AddBoolToObject(obj, "mem_pressure", mg.pressure);
+	cJSON_AddNumberToObject(obj, "mem_pressured", mg.pressured);
+	cJSON_AddNumberToObject(obj, "mem_refused_connects", mg.connects);
+	cJSON_AddNumberToObject(obj, "mem_refused_subscribes", mg.subscribes);
+	cJSON_AddNumberToObject(obj, "mem_shed_qos0", mg.shed);
+	cJSON_AddNumberToObject(obj, "mem_retain_evicted", mg.evicted);
+	cJSON_AddNumberToObject(obj, "dropped",
+	    sq.dropped + sq.rejected + sq.expired + pq.dropped + pq.expired +
+	        ev.dropped + mg.shed);
+
+	for (int h = 0; h < HIST_TRACE; h++) {
+		cJSON_AddItemToObject(obj, hist_names[h], hist_json(h));
+	}
+	cJSON_AddItemToObject(obj, "trace", trace_json());
+	return obj;
+}
+
+/**
+ * @brief metrics_sys_msg - Build the PUBLISH of the metrics to
+ * $SYS/brokers/metrics once interval seconds passed since the last one.
+ * @param now - nng_clock
+ * @param interval - seconds, 0 disables
+ * @return PUBLISH or NULL if it is not due
+ */
+nng_msg *
+metrics_sys_msg(nng_time now, int interval)
+{
+	nng_time    next = __atomic_load_n(&sys_next, __ATOMIC_RELAXED);
+	nng_msg *   msg  = NULL;
+	mqtt_string topic, payload;
+	cJSON *     obj;
+
+	if (interval <= 0 || now < next ||
+	    !__atomic_compare_exchange_n(&sys_next, &next,
+	        now + (nng_time) interval * 1000, false, __ATOMIC_RELAXED,
+	        __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	obj          = metrics_json();
+	payload.body = cJSON_PrintUnformatted(obj);
+	payload.len  = strlen(payload.body);
+	topic.body   = METRICS_SYS_TOPIC;
+	topic.len    = strlen(METRICS_SYS_TOPIC);
+	cJSON_Delete(obj);
+
+	nng_msg_alloc(&msg, 0);
+	msg = nano_msg_composer(&msg, 0, 0, &payload, &topic);
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+	cJSON_free(payload.body);
+
+	return msg;
+}
@@ -0,0 +1,304 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <pthread.h>
+#include <string.h>
+
+#include <nng/nng.h>
+#include <zmalloc.h>
+
+#include "include/msg_pool.h"
+
+/*
+ * Pool of small nng_msg kept for reuse instead of freed, for the control
+ * packets a broker sends. A thread gets and puts on its own free list of
+ * MSG_CACHE msgs with no lock, and moves MSG_BATCH at once from or to the
+ * depot of the pool under its lock when the list runs empty or full. A
+ * thread keeps a list for the first pool it uses, others go to the depot.
+ *
+ * A msg is put by whoever holds its only reference, it is cleared then,
+ * so one got is like one new from nng_msg_alloc. At most cap msgs are
+ * kept idle, the others are freed as they come, like long msgs which
+ * keep the chunk they grew to. A pool lives as long as the threads using
+ * it, nnl_msg_pool_delete frees the msgs of the depot and of the calling
+ * thread.
+ */
+#define MSG_CACHE 32
+#define MSG_BATCH (MSG_CACHE / 2)
+
+struct nnl_msg_pool {
+	pthread_mutex_t mtx;
+	nng_msg **      depot; // of cap, lock held
+	size_t          depot_n;
+	size_t          depot_cap;
+	size_t          cap;
+	size_t          idle; // in the depot and lists
+	long            used; // got and not put back
+};
+
+typedef struct {
+	nnl_msg_pool *pool;
+	size_t        n;
+	nng_msg *     msgs[MSG_CACHE];
+} msg_cache;
+
+static pthread_key_t       cache_key;
+static pthread_once_t      cache_once = PTHREAD_ONCE_INIT;
+static __thread msg_cache *cache_self = NULL;
+
+// msg to the depot, freed if it is full, lock held
+static void
+depot_push(nnl_msg_pool *mp, nng_msg *msg)
+{
+	if (mp->depot_n < mp->depot_cap) {
+		mp->depot[mp->depot_n++] = msg;
+		return;
+	}
+	__atomic_sub_fetch(&mp->idle, 1, __ATOMIC_RELAXED);
+	nng_msg_free(msg);
+}
+
+// the list of an exiting thread goes back to its pool
+static void
+cache_exit(void *arg)
+{
+	msg_cache *c = arg;
+
+	cache_self = NULL;
+	if (c->pool != NULL) {
+		pthread_mutex_lock(&c->pool->mtx);
+		while (c->n > 0) {
+			depot_push(c->pool, c->msgs[--c->n]);
+		}
+		pthread_mutex_unlock(&c->pool->mtx);
+	}
+	zfree(c);
+}
+
+static void
+cache_key_init(void)
+{
+	pthread_key_create(&cache_key, cache_exit);
+}
+
+// the list of the calling thread for mp, NULL if it has one for another
+static msg_cache *
+cache_of(nnl_msg_pool *mp)
+{
+	msg_cache *c = cache_self;
+
+	if (c != NULL) {
+		if (c->pool == NULL) {
+			c->pool = mp;
+		}
+		return c->pool == mp ? c : NULL;
+	}
+	pthread_once(&cache_once, cache_key_init);
+	c       = zmalloc(sizeof(msg_cache));
+	c->pool = mp;
+	c->n    = 0;
+	pthread_setspecific(cache_key, c);
+	cache_self = c;
+	return c;
+}
+
+/**
+ * @brief nnl_msg_pool_create - Create a pool keeping NNL_MSG_POOL_CAP msgs.
+ * @param mp - set to the pool
+ * @return 0
+ */
+int
+nnl_msg_pool_create(nnl_msg_pool **mp)
+{
+	nnl_msg_pool *p = zmalloc(sizeof(nnl_msg_pool));
+
+	memset(p, 0, sizeof(nnl_msg_pool));
+	pthread_mutex_init(&p->mtx, NULL);
+	p->cap       = NNL_MSG_POOL_CAP;
+	p->depot_cap = NNL_MSG_POOL_CAP;
+	p->depot     = zmalloc(sizeof(nng_msg *) * p->depot_cap);
+	*mp          = p;
+
+	return 0;
+}
+
+void
+nnl_msg_pool_delete(nnl_msg_pool *mp)
+{
+	msg_cache *c = cache_self;
+
+	if (c != NULL && c->pool == mp) {
+		while (c->n > 0) {
+			nng_msg_free(c->msgs[--c->n]);
+		}
+		c->pool = NULL;
+	}
+	while (mp->depot_n > 0) {
+		nng_msg_free(mp->depot[--mp->depot_n]);
+	}
+	pthread_mutex_destroy(&mp->mtx);
+	zfree(mp->depot);
+	zfree(mp);
+}
+
+/**
+ * @brief nnl_msg_pool_resize - Keep cap msgs idle at most, and as many
+ * new ones in the depot for the gets to come.
+ * @param mp - nnl_msg_pool
+ * @param cap - 0 keeps none
+ * @return 0, or the error of nng_msg_alloc
+ */
+int
+nnl_msg_pool_resize(nnl_msg_pool *mp, size_t cap)
+{
+	nng_msg *msg;
+	int      rv = 0;
+
+	pthread_mutex_lock(&mp->mtx);
+	__atomic_store_n(&mp->cap, cap, __ATOMIC_RELAXED);
+	while (mp->depot_n > cap) {
+		nng_msg_free(mp->depot[--mp->depot_n]);
+		__atomic_sub_fetch(&mp->idle, 1, __ATOMIC_RELAXED);
+	}
+	if (cap > mp->depot_cap) {
+		mp->depot     = zrealloc(mp->depot, sizeof(nng_msg *) * cap);
+		mp->depot_cap = cap;
+	}
+	while (__atomic_load_n(&mp->idle, __ATOMIC_RELAXED) < cap &&
+	    mp->depot_n < mp->depot_cap) {
+		if ((rv = nng_msg_alloc(&msg, 0)) != 0) {
+			break;
+		}
+		mp->depot[mp->depot_n++] = msg;
+		__atomic_add_fetch(&mp->idle, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&mp->mtx);
+
+	return rv;
+}
+
+size_t
+nnl_msg_pool_capacity(nnl_msg_pool *mp)
+{
+	return __atomic_load_n(&mp->cap, __ATOMIC_RELAXED);
+}
+
+// as far as the pool can tell, a msg put which it did not give counts
+size_t
+nnl_msg_pool_used(nnl_msg_pool *mp)
+{
+	long used = __atomic_load_n(&mp->used, __ATOMIC_RELAXED);
+
+	return used > 0 ? (size_t) used : 0;
+}
+
+bool
+nnl_msg_pool_empty(nnl_msg_pool *mp)
+{
+	return nnl_msg_pool_used(mp) == 0;
+}
+
+// as many msgs idle as it keeps
+bool
+nnl_msg_pool_full(nnl_msg_pool *mp)
+{
+	return __atomic_load_n(&mp->idle, __ATOMIC_RELAXED) >=
+	    nnl_msg_pool_capacity(mp);
+}
+
+/**
+ * @brief nnl_msg_get - Get an empty msg, one kept or a new one.
+ * @param mp - nnl_msg_pool
+ * @param msg - set to the msg, sent or put back by the caller
+ * @return 0, or the error of nng_msg_alloc
+ */
+int
+nnl_msg_get(nnl_msg_pool *mp, nng_msg **msg)
+{
+	msg_cache *c = cache_of(mp);
+	nng_msg *  m = NULL;
+	int        rv;
+
+	if (c != NULL && c->n == 0) {
+		pthread_mutex_lock(&mp->mtx);
+		while (c->n < MSG_BATCH && mp->depot_n > 0) {
+			c->msgs[c->n++] = mp->depot[--mp->depot_n];
+		}
+		pthread_mutex_unlock(&mp->mtx);
+	}
+	if (c != NULL && c->n > 0) {
+		m = c->msgs[--c->n];
+	} else if (c == NULL) {
+		pthread_mutex_lock(&mp->mtx);
+		if (mp->depot_n > 0) {
+			m = mp->depot[--mp->depot_n];
+		}
+		pthread_mutex_unlock(&mp->mtx);
+	}
+
+	if (m != NULL) {
+		__atomic_sub_fetch(&mp->idle, 1, __ATOMIC_RELAXED);
+	} else if ((rv = nng_msg_alloc(&m, 0)) != 0) {
+		return rv;
+	}
+	__atomic_add_fetch(&mp->used, 1, __ATOMIC_RELAXED);
+	*msg = m;
+	return 0;
+}
+
+/**
+ * @brief nnl_msg_put - Give a msg back instead of freeing it, the caller
+ * holds its only reference.
+ * @param mp - nnl_msg_pool
+ * @param msg - msg, set to NULL
+ * @return 0
+ */
+int
+nnl_msg_put(nnl_msg_pool *mp, nng_msg **msg)
+{
+	nng_msg *  m = *msg;
+	msg_cache *c;
+
+	*msg = NULL;
+	if (m == NULL) {
+		return 0;
+	}
+	__atomic_sub_fetch(&mp->used, 1, __ATOMIC_RELAXED);
+	if (nng_msg_header_len(m) + nng_msg_len(m) > NNL_MSG_SMALL) {
+		nng_msg_free(m);
+		return 0;
+	}
+	if (__atomic_add_fetch(&mp->idle, 1, __ATOMIC_RELAXED) >
+	    nnl_msg_pool_capacity(mp)) {
+		__atomic_sub_fetch(&mp->idle, 1, __ATOMIC_RELAXED);
+		nng_msg_free(m);
+		return 0;
+	}
+	nng_msg_clear(m);
+	nng_msg_header_clear(m);
+	nng_msg_set_cmd_type(m, 0);
+	nng_msg_set_pipe(m, (nng_pipe) { .id = 0 });
+	nng_msg_set_timestamp(m, 0);
+
+	if ((c = cache_of(mp)) == NULL) {
+		pthread_mutex_lock(&mp->mtx);
+		depot_push(mp, m);
+		pthread_mutex_unlock(&mp->mtx);
+		return 0;
+	}
+	if (c->n == MSG_CACHE) {
+		pthread_mutex_lock(&mp->mtx);
+		while (c->n > MSG_CACHE - MSG_BATCH) {
+			depot_push(mp, c->msgs[--c->n]);
+		}
+		pthread_mutex_unlock(&mp->mtx);
+	}
+	c->msgs[c->n++] = m;
+	return 0;
+}
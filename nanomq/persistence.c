@@ -0,0 +1,378 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include <include/nanomq.h>
+#include <mqtt_db.h>
+#include <nano_wal.h>
+#include <nng.h>
+#include <nng/supplemental/util/platform.h>
+#include <nng/protocol/mqtt/mqtt_parser.h>
+#include <zmalloc.h>
+
+#include "include/persistence.h"
+#include "include/pub_handler.h"
+
+// Retained and offline session messages are logged to a nano_wal, the log
+// is replayed into the tree and the retain store on start. A session
+// message is kept as the header and body of its PUBLISH, a retained one
+// as the fields the store keeps.
+enum {
+	PERSIST_RETAIN_SET = 1, // qos, topic, properties, payload
+	PERSIST_RETAIN_DEL,     // topic
+	PERSIST_SESSION_PUT,    // session id, header length, header, body
+	PERSIST_SESSION_TAKE,   // session id
+};
+
+#define PERSIST_RETAIN_BATCH 64
+
+typedef int (*persist_emit)(
+    void *dst, uint8_t type, const struct iovec *iov, int cnt);
+
+static nano_wal *   wal      = NULL;
+static dbtree *     p_db     = NULL;
+static nano_retain *p_retain = NULL;
+
+static int
+wal_emit(void *dst, uint8_t type, const struct iovec *iov, int cnt)
+{
+	return nano_wal_append((nano_wal *) dst, type, iov, cnt);
+}
+
+static int
+ckpt_emit(void *dst, uint8_t type, const struct iovec *iov, int cnt)
+{
+	return nano_wal_ckpt_append((nano_wal_ckpt *) dst, type, iov, cnt);
+}
+
+static inline void
+put_u32(uint8_t *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline uint32_t
+get_u32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**
+ * @brief emit_msg - Log a message after a fixed size prefix.
+ * @param emit - persist_emit
+ * @param dst - nano_wal or nano_wal_ckpt
+ * @param type - record type
+ * @param pre - prefix
+ * @param pre_len - length of prefix
+ * @param msg - nng_msg
+ * @return 0 or -1
+ */
+static int
+emit_msg(persist_emit emit, void *dst, uint8_t type, const uint8_t *pre,
+    size_t pre_len, nng_msg *msg)
+{
+	uint8_t      hlen[4];
+	struct iovec iov[4];
+
+	put_u32(hlen, nng_msg_header_len(msg));
+	iov[0].iov_base = (void *) pre;
+	iov[0].iov_len  = pre_len;
+	iov[1].iov_base = hlen;
+	iov[1].iov_len  = sizeof(hlen);
+	iov[2].iov_base = nng_msg_header(msg);
+	iov[2].iov_len  = nng_msg_header_len(msg);
+	iov[3].iov_base = nng_msg_body(msg);
+	iov[3].iov_len  = nng_msg_len(msg);
+
+	return emit(dst, type, iov, 4);
+}
+
+/**
+ * @brief load_msg - Rebuild a PUBLISH logged by emit_msg.
+ * @param data - record data after the prefix
+ * @param len - length of data
+ * @return nng_msg or NULL if data is broken
+ */
+static nng_msg *
+load_msg(const uint8_t *data, size_t len)
+{
+	nng_msg *msg = NULL;
+	uint32_t hlen;
+
+	if (len < 4 || (hlen = get_u32(data)) > len - 4) {
+		return NULL;
+	}
+	if (nng_msg_alloc(&msg, 0) != 0) {
+		return NULL;
+	}
+	if (nng_msg_header_append(msg, data + 4, hlen) != 0 ||
+	    nng_msg_append(msg, data + 4 + hlen, len - 4 - hlen) != 0) {
+		nng_msg_free(msg);
+		return NULL;
+	}
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+	nng_msg_set_remaining_len(msg, nng_msg_len(msg));
+	// the age of a message restarts with the broker
+	nng_msg_set_timestamp(msg, nng_clock());
+
+	return msg;
+}
+
+/**
+ * @brief emit_retain - Log a retained message as qos, topic length,
+ * topic, properties length, properties and payload.
+ * @param emit - persist_emit
+ * @param dst - nano_wal or nano_wal_ckpt
+ * @param ret - nano_retain_msg
+ * @return 0 or -1
+ */
+static int
+emit_retain(persist_emit emit, void *dst, const nano_retain_msg *ret)
+{
+	uint8_t      tlen[4], plen[4];
+	struct iovec iov[6];
+
+	put_u32(tlen, ret->topic_len);
+	put_u32(plen, ret->props_len);
+	iov[0].iov_base = (void *) &ret->qos;
+	iov[0].iov_len  = 1;
+	iov[1].iov_base = tlen;
+	iov[1].iov_len  = sizeof(tlen);
+	iov[2].iov_base = (void *) ret->topic;
+	iov[2].iov_len  = ret->topic_len;
+	iov[3].iov_base = plen;
+	iov[3].iov_len  = sizeof(plen);
+	iov[4].iov_base = (void *) ret->props;
+	iov[4].iov_len  = ret->props_len;
+	iov[5].iov_base = (void *) ret->payload;
+	iov[5].iov_len  = ret->payload_len;
+
+	return emit(dst, PERSIST_RETAIN_SET, iov, 6);
+}
+
+static void
+replay_retain(const uint8_t *data, size_t len)
+{
+	nano_retain_msg ret = { 0 };
+	char *          topic;
+	size_t          pos = 5;
+	size_t          off;
+	uint32_t        interval;
+
+	if (len < pos || (ret.topic_len = get_u32(data + 1)) > len - pos ||
+	    len - pos - ret.topic_len < 4) {
+		return;
+	}
+	ret.qos = data[0];
+	pos += ret.topic_len;
+	if ((ret.props_len = get_u32(data + pos)) > len - pos - 4) {
+		return;
+	}
+	pos += 4;
+	ret.props       = data + pos;
+	ret.payload     = data + pos + ret.props_len;
+	ret.payload_len = len - pos - ret.props_len;
+	// the expiry counts again from the start of the broker
+	if (ret.props_len > 0 &&
+	    pub_props_expiry(ret.props, ret.props_len, &off, &interval)) {
+		ret.expire_at = nng_clock() + (nng_time) interval * 1000;
+	}
+
+	// the store wants it terminated
+	topic = zmalloc(ret.topic_len + 1);
+	memcpy(topic, data + 5, ret.topic_len);
+	topic[ret.topic_len] = '\0';
+	ret.topic            = topic;
+	nano_retain_set(p_retain, &ret);
+	zfree(topic);
+}
+
+static void
+replay_cb(uint8_t type, const uint8_t *data, size_t len, void *arg)
+{
+	nng_msg *msg = NULL;
+	char *   topic;
+	void **  msgs;
+
+	switch (type) {
+	case PERSIST_RETAIN_SET:
+		replay_retain(data, len);
+		break;
+	case PERSIST_RETAIN_DEL:
+		topic = zmalloc(len + 1);
+		memcpy(topic, data, len);
+		topic[len] = '\0';
+		nano_retain_del(p_retain, topic);
+		zfree(topic);
+		break;
+	case PERSIST_SESSION_PUT:
+		if (len < 4 || (msg = load_msg(data + 4, len - 4)) == NULL) {
+			break;
+		}
+		if (dbtree_cache_session_msg(p_db, msg, get_u32(data)) != 0) {
+			nng_msg_free(msg);
+		}
+		break;
+	case PERSIST_SESSION_TAKE:
+		if (len < 4) {
+			break;
+		}
+		msgs = dbtree_restore_session_msg(p_db, get_u32(data));
+		for (size_t i = 0; i < cvector_size(msgs); i++) {
+			nng_msg_free(msgs[i]);
+		}
+		cvector_free(msgs);
+		break;
+	default:
+		debug_msg("Unknown wal record type %u", type);
+		break;
+	}
+}
+
+static void
+session_put_cb(uint32_t session_id, void *msg, void *arg)
+{
+	uint8_t id[4];
+
+	put_u32(id, session_id);
+	emit_msg(wal_emit, wal, PERSIST_SESSION_PUT, id, sizeof(id),
+	    (nng_msg *) msg);
+}
+
+static void
+session_take_cb(uint32_t session_id, void *arg)
+{
+	uint8_t      id[4];
+	struct iovec iov = { id, sizeof(id) };
+
+	put_u32(id, session_id);
+	nano_wal_append(wal, PERSIST_SESSION_TAKE, &iov, 1);
+}
+
+static int
+dump_session_cb(uint32_t session_id, void *msg, void *arg)
+{
+	uint8_t id[4];
+
+	put_u32(id, session_id);
+	return emit_msg(ckpt_emit, arg, PERSIST_SESSION_PUT, id, sizeof(id),
+	    (nng_msg *) msg);
+}
+
+typedef struct {
+	nano_wal_ckpt *ckpt;
+	int            rv;
+} dump_retain_arg;
+
+static void
+dump_retain_cb(const nano_retain_msg *ret, void *arg)
+{
+	dump_retain_arg *d = arg;
+
+	if (d->rv == 0) {
+		d->rv = emit_retain(ckpt_emit, d->ckpt, ret);
+	}
+}
+
+// Write the retained and queued messages still alive to a checkpoint.
+static int
+dump_cb(nano_wal_ckpt *ckpt, void *arg)
+{
+	nano_retain_cursor *cur = nano_retain_cursor_new(p_retain, "#");
+	dump_retain_arg     d   = { .ckpt = ckpt, .rv = 0 };
+
+	while (cur != NULL && d.rv == 0 && !nano_retain_cursor_done(cur)) {
+		nano_retain_cursor_next(cur, PERSIST_RETAIN_BATCH,
+		    nng_clock(), dump_retain_cb, &d);
+	}
+	nano_retain_cursor_free(cur);
+
+	if (d.rv == 0) {
+		d.rv = dbtree_foreach_session_msg(p_db, dump_session_cb, ckpt);
+	}
+
+	return d.rv;
+}
+
+/**
+ * @brief persistence_start - Open the log, restore retained and offline
+ * session messages from it, then log their changes.
+ * @param config - conf_persistence
+ * @param db - dbtree of subscriptions and sessions
+ * @param retain - store of retained messages
+ * @return 0 or -1
+ */
+int
+persistence_start(conf_persistence *config, dbtree *db, nano_retain *retain)
+{
+	nano_wal_opt opt = {
+		.dir = config->dir ? config->dir : CONF_PERSISTENCE_DIR_DEFAULT,
+		.segment_size   = config->segment_size,
+		.fsync_batch    = config->fsync_batch,
+		.fsync_interval = config->fsync_interval,
+		.compact_size   = config->compact_size,
+	};
+	dbtree_session_persist persist = {
+		.put  = session_put_cb,
+		.take = session_take_cb,
+		.arg  = NULL,
+	};
+
+	p_db     = db;
+	p_retain = retain;
+	if (nano_wal_open(&wal, &opt, dump_cb, NULL) != 0) {
+		debug_msg("persistence disabled, wal %s can not be opened",
+		    opt.dir);
+		wal = NULL;
+		return -1;
+	}
+	nano_wal_replay(wal, replay_cb, NULL);
+	dbtree_set_session_persist(db, &persist);
+
+	return 0;
+}
+
+void
+persistence_stop(void)
+{
+	if (wal == NULL) {
+		return;
+	}
+	dbtree_set_session_persist(p_db, NULL);
+	nano_wal_close(wal);
+	wal = NULL;
+}
+
+/**
+ * @brief persistence_retain - Log a retain message set or, if ret is
+ * NULL, deleted on topic.
+ * @param topic - topic
+ * @param ret - nano_retain_msg
+ * @return void
+ */
+void
+persistence_retain(const char *topic, const nano_retain_msg *ret)
+{
+	struct iovec iov;
+
+	if (wal == NULL) {
+		return;
+	}
+	if (ret != NULL) {
+		emit_retain(wal_emit, wal, ret);
+	} else {
+		iov.iov_base = (void *) topic;
+		iov.iov_len  = strlen(topic);
+		nano_wal_append(wal, PERSIST_RETAIN_DEL, &iov, 1);
+	}
+}
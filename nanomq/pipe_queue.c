@@ -0,0 +1,554 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <pthread.h>
+#include <string.h>
+
+#include <conf.h>
+#include <cvector.h>
+#include <mqtt_db.h>
+#include <nano_lmq.h>
+#include <zmalloc.h>
+
+#include "include/inflight.h"
+#include "include/nanomq.h"
+#include "include/pipe_queue.h"
+#include "include/pub_handler.h"
+
+/*
+ * Bounded outbound queue of a subscriber pipe. A pipe may have size
+ * unacknowledged QoS 1/2 messages in the transport, or fewer if that is
+ * its Receive Maximum, messages for it past that are held here and sent
+ * as acknowledgements come back. What the overflow policy does once size
+ * more, or a window more with no size set, are held is up to the config.
+ * QoS 0 has no acknowledgement, it is only held back behind a QoS 1/2
+ * backlog. A held MQTT 5 message leaving once its Message Expiry Interval
+ * passed is dropped, the others go with the interval left.
+ *
+ * Queues are created on first need and removed once empty, a pipe which
+ * keeps up never has one. Pipes are hashed to buckets, a stripe of
+ * buckets shares a lock.
+ *
+ * A message on a topic of sub_queue_conflate, or of a filter the pipe
+ * subscribed with the user property conflate=true, is conflated: it
+ * replaces a message of the same topic held for the pipe, in its place,
+ * and is held whatever its qos. The newest held message of the topic is
+ * looked for, so a queue of such topics keeps one message per topic. A
+ * message sent with a topic alias and no topic is not conflated.
+ */
+#define PIPE_QUEUE_BUCKETS 4096
+#define PIPE_QUEUE_STRIPES 64
+
+typedef struct pipe_queue pipe_queue;
+
+struct pipe_queue {
+	uint32_t    pipe_id;
+	bool        v5; // held messages are encoded for MQTT 5
+	uint64_t    dropped;
+	nano_lmq    lmq;
+	pipe_queue *next;
+};
+
+typedef struct pipe_conflate pipe_conflate;
+
+// the filters a pipe subscribed with conflate
+struct pipe_conflate {
+	uint32_t           pipe_id;
+	char **            filters; // cvector
+	dbtree_filter_set *set;
+	pipe_conflate *    next;
+};
+
+typedef struct {
+	pthread_mutex_t mtx;
+	uint32_t        queues;    // pipe_queue in buckets of this stripe
+	uint32_t        conflates; // pipe_conflate in them
+} pipe_queue_stripe;
+
+static int                size     = 0;
+static int                overflow = SUB_QUEUE_DROP_QOS0;
+static pipe_queue *       buckets[PIPE_QUEUE_BUCKETS];
+static pipe_conflate *    conflates[PIPE_QUEUE_BUCKETS];
+static pipe_queue_stripe  stripes[PIPE_QUEUE_STRIPES];
+static pipe_queue_totals  totals;
+static dbtree_filter_set *conflate_rules = NULL; // of sub_queue_conflate
+
+static inline pipe_queue **
+bucket_of(uint32_t pipe_id)
+{
+	return &buckets[(pipe_id * 2654435761u) % PIPE_QUEUE_BUCKETS];
+}
+
+static inline pipe_conflate **
+conflate_bucket_of(uint32_t pipe_id)
+{
+	return &conflates[(pipe_id * 2654435761u) % PIPE_QUEUE_BUCKETS];
+}
+
+static inline pipe_queue_stripe *
+stripe_of(uint32_t pipe_id)
+{
+	return &stripes[((pipe_id * 2654435761u) % PIPE_QUEUE_BUCKETS) %
+	    PIPE_QUEUE_STRIPES];
+}
+
+// 0 if the pipe has no window
+static inline uint32_t
+window_of(uint32_t pipe_id)
+{
+	uint32_t window = inflight_window(pipe_id);
+
+	if (size > 0 && (window == 0 || (uint32_t) size < window)) {
+		window = size;
+	}
+	return window;
+}
+
+static pipe_queue *
+queue_find(uint32_t pipe_id)
+{
+	pipe_queue *q = *bucket_of(pipe_id);
+
+	while (q != NULL && q->pipe_id != pipe_id) {
+		q = q->next;
+	}
+	return q;
+}
+
+static void
+queue_remove(pipe_queue_stripe *s, pipe_queue *q)
+{
+	pipe_queue **pp = bucket_of(q->pipe_id);
+	void *       msg;
+
+	while (*pp != q) {
+		pp = &(*pp)->next;
+	}
+	*pp = q->next;
+	__atomic_sub_fetch(&s->queues, 1, __ATOMIC_RELAXED);
+
+	while (nano_lmq_getq(&q->lmq, &msg) == 0) {
+		nng_msg_free((nng_msg *) msg);
+		__atomic_sub_fetch(&totals.queued, 1, __ATOMIC_RELAXED);
+	}
+	nano_lmq_fini(&q->lmq);
+	zfree(q);
+}
+
+static pipe_conflate *
+conflate_find(uint32_t pipe_id)
+{
+	pipe_conflate *c = *conflate_bucket_of(pipe_id);
+
+	while (c != NULL && c->pipe_id != pipe_id) {
+		c = c->next;
+	}
+	return c;
+}
+
+static void
+conflate_remove(pipe_queue_stripe *s, pipe_conflate *c)
+{
+	pipe_conflate **pp = conflate_bucket_of(c->pipe_id);
+
+	while (*pp != c) {
+		pp = &(*pp)->next;
+	}
+	*pp = c->next;
+	s->conflates--;
+
+	for (size_t i = 0; i < cvector_size(c->filters); i++) {
+		zfree(c->filters[i]);
+	}
+	cvector_free(c->filters);
+	dbtree_filter_set_free(c->set);
+	zfree(c);
+}
+
+// if msg is conflated for the pipe, lock held
+static bool
+msg_conflated(pipe_queue_stripe *s, uint32_t pipe_id, nng_msg *msg)
+{
+	uint8_t *      body = nng_msg_body(msg);
+	size_t         len  = nng_msg_len(msg);
+	pipe_conflate *c    = s->conflates > 0 ? conflate_find(pipe_id) : NULL;
+	char           buf[256];
+	char *         topic;
+	size_t         tlen;
+	bool           match;
+
+	if ((conflate_rules == NULL && c == NULL) || len < 2) {
+		return false;
+	}
+	tlen = (body[0] << 8) | body[1];
+	if (tlen == 0 || tlen > len - 2) {
+		return false;
+	}
+	topic = tlen < sizeof(buf) ? buf : zmalloc(tlen + 1);
+	memcpy(topic, body + 2, tlen);
+	topic[tlen] = '\0';
+	match       = dbtree_filter_set_match(conflate_rules, topic) ||
+	    (c != NULL && dbtree_filter_set_match(c->set, topic));
+	if (topic != buf) {
+		zfree(topic);
+	}
+	return match;
+}
+
+// the slot of the newest msg held in q on the topic of msg, or NULL
+static void **
+queue_find_topic(pipe_queue *q, nng_msg *msg)
+{
+	uint8_t *body = nng_msg_body(msg);
+	size_t   tlen = (body[0] << 8) | body[1];
+	size_t   n    = nano_lmq_len(&q->lmq);
+	void **  slot;
+	uint8_t *b;
+
+	while (n-- > 0) {
+		slot = nano_lmq_slot(&q->lmq, n);
+		b    = nng_msg_body((nng_msg *) *slot);
+		if (nng_msg_len((nng_msg *) *slot) >= 2 + tlen &&
+		    memcmp(b, body, 2 + tlen) == 0) {
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief pipe_queue_init - Set the queue options of the subscribers.
+ * @param queue_size - sub_queue_size, 0 holds a window more
+ * @param queue_overflow - sub_queue_overflow
+ * @param conflate - filters conflated for all pipes separated by ',', or
+ * NULL
+ * @return void
+ */
+void
+pipe_queue_init(int queue_size, int queue_overflow, const char *conflate)
+{
+	char **filters = NULL;
+	char * list, *save = NULL;
+
+	size     = queue_size > 0 ? queue_size : 0;
+	overflow = queue_overflow;
+	for (int i = 0; i < PIPE_QUEUE_STRIPES; i++) {
+		pthread_mutex_init(&stripes[i].mtx, NULL);
+		stripes[i].queues    = 0;
+		stripes[i].conflates = 0;
+	}
+	if (conflate == NULL) {
+		return;
+	}
+	list = zstrdup(conflate);
+	for (char *tk = strtok_r(list, ",", &save); tk != NULL;
+	     tk       = strtok_r(NULL, ",", &save)) {
+		cvector_push_back(filters, tk);
+	}
+	if (cvector_size(filters) > 0) {
+		conflate_rules =
+		    dbtree_filter_set_new(filters, cvector_size(filters));
+	}
+	cvector_free(filters);
+	zfree(list);
+}
+
+/**
+ * @brief pipe_queue_conflate - Note the filter a pipe subscribed to, or
+ * unsubscribed from, for conflation.
+ * @param pipe_id - subscriber pipe
+ * @param filter - topic filter
+ * @param on - subscribed with PIPE_CONFLATE_PROPERTY true, false if not or
+ * unsubscribed
+ * @return void
+ */
+void
+pipe_queue_conflate(uint32_t pipe_id, const char *filter, bool on)
+{
+	pipe_queue_stripe *s = stripe_of(pipe_id);
+	pipe_conflate *    c;
+	size_t             i;
+
+	pthread_mutex_lock(&s->mtx);
+	c = s->conflates > 0 ? conflate_find(pipe_id) : NULL;
+	for (i = 0; c != NULL && i < cvector_size(c->filters); i++) {
+		if (strcmp(c->filters[i], filter) == 0) {
+			break;
+		}
+	}
+	if (c != NULL && i < cvector_size(c->filters)) {
+		if (on) {
+			goto out;
+		}
+		zfree(c->filters[i]);
+		cvector_erase(c->filters, i);
+	} else if (on) {
+		if (c == NULL) {
+			c          = zmalloc(sizeof(pipe_conflate));
+			c->pipe_id = pipe_id;
+			c->filters = NULL;
+			c->set     = NULL;
+			c->next    = *conflate_bucket_of(pipe_id);
+			*conflate_bucket_of(pipe_id) = c;
+			s->conflates++;
+		}
+		cvector_push_back(c->filters, zstrdup(filter));
+	} else {
+		goto out;
+	}
+
+	if (cvector_size(c->filters) == 0) {
+		conflate_remove(s, c);
+	} else {
+		dbtree_filter_set_free(c->set);
+		c->set = dbtree_filter_set_new(
+		    c->filters, cvector_size(c->filters));
+	}
+out:
+	pthread_mutex_unlock(&s->mtx);
+}
+
+/**
+ * @brief pipe_queue_admit - Decide if msg goes to the pipe now. If not,
+ * msg is held, with a reference of its own, or dropped.
+ * @param pipe_id - subscriber pipe
+ * @param msg - encoded PUBLISH, the reference of the caller is kept
+ * @param qos - qos msg is sent with
+ * @param proto - protocol version of the pipe
+ * @return true if the caller sends msg now
+ */
+bool
+pipe_queue_admit(uint32_t pipe_id, nng_msg *msg, uint8_t qos, uint8_t proto)
+{
+	pipe_queue_stripe *s;
+	pipe_queue *       q;
+	void *             old;
+	void **            slot;
+	bool               send   = false;
+	bool               kick   = false;
+	bool               conf   = false;
+	uint32_t           window = window_of(pipe_id);
+
+	if (window == 0) {
+		return true;
+	}
+	s = stripe_of(pipe_id);
+	// no queue in the stripe, only the window is checked
+	if (__atomic_load_n(&s->queues, __ATOMIC_RELAXED) == 0 &&
+	    inflight_count(pipe_id) < window) {
+		return true;
+	}
+
+	pthread_mutex_lock(&s->mtx);
+	q = queue_find(pipe_id);
+	if (q == NULL) {
+		if (inflight_count(pipe_id) < window) {
+			send = true;
+			goto out;
+		}
+		conf = msg_conflated(s, pipe_id, msg);
+		if (qos == 0 && overflow == SUB_QUEUE_DROP_QOS0 && !conf) {
+			__atomic_add_fetch(&totals.dropped, 1, __ATOMIC_RELAXED);
+			goto out;
+		}
+		if ((q = zmalloc(sizeof(pipe_queue))) == NULL) {
+			send = true;
+			goto out;
+		}
+		if (nano_lmq_init(&q->lmq, size > 0 ? size : window) != 0) {
+			zfree(q);
+			send = true;
+			goto out;
+		}
+		q->pipe_id          = pipe_id;
+		q->v5               = proto == PROTOCOL_VERSION_v5;
+		q->dropped          = 0;
+		q->next             = *bucket_of(pipe_id);
+		*bucket_of(pipe_id) = q;
+		__atomic_add_fetch(&s->queues, 1, __ATOMIC_RELAXED);
+	} else {
+		conf = msg_conflated(s, pipe_id, msg);
+	}
+
+	if (conf && (slot = queue_find_topic(q, msg)) != NULL) {
+		nng_msg_free((nng_msg *) *slot);
+		nng_msg_clone(msg);
+		*slot = msg;
+		__atomic_add_fetch(&totals.conflated, 1, __ATOMIC_RELAXED);
+		goto out;
+	}
+	if (qos == 0 && overflow == SUB_QUEUE_DROP_QOS0 && !conf) {
+		q->dropped++;
+		__atomic_add_fetch(&totals.dropped, 1, __ATOMIC_RELAXED);
+		goto out;
+	}
+	if (nano_lmq_full(&q->lmq)) {
+		if (overflow == SUB_QUEUE_DISCONNECT) {
+			debug_msg("pipe %u is too slow, disconnect", pipe_id);
+			__atomic_add_fetch(
+			    &totals.disconnected, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&totals.dropped,
+			    nano_lmq_len(&q->lmq) + 1, __ATOMIC_RELAXED);
+			queue_remove(s, q);
+			kick = true;
+			goto out;
+		}
+		nano_lmq_getq(&q->lmq, &old);
+		nng_msg_free((nng_msg *) old);
+		__atomic_sub_fetch(&totals.queued, 1, __ATOMIC_RELAXED);
+		q->dropped++;
+		__atomic_add_fetch(&totals.dropped, 1, __ATOMIC_RELAXED);
+	}
+	nng_msg_clone(msg);
+	nano_lmq_putq(&q->lmq, msg);
+	__atomic_add_fetch(&totals.queued, 1, __ATOMIC_RELAXED);
+
+out:
+	pthread_mutex_unlock(&s->mtx);
+	// closing may notify the broker, which drops the queue under the lock
+	if (kick) {
+		nng_pipe pipe = { .id = pipe_id };
+		nng_pipe_close(pipe);
+	}
+	return send;
+}
+
+/**
+ * @brief pipe_queue_next - Take the next held msg of the pipe if the
+ * window has room, called once the pipe acknowledged one. Expired ones
+ * on the way are dropped.
+ * @param pipe_id - subscriber pipe
+ * @param now - current time
+ * @return msg with a reference of the caller, or NULL
+ */
+nng_msg *
+pipe_queue_next(uint32_t pipe_id, nng_time now)
+{
+	pipe_queue_stripe *s = stripe_of(pipe_id);
+	pipe_queue *       q;
+	void *             msg = NULL;
+
+	if (__atomic_load_n(&s->queues, __ATOMIC_RELAXED) == 0) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&s->mtx);
+	if ((q = queue_find(pipe_id)) != NULL &&
+	    inflight_count(pipe_id) < window_of(pipe_id)) {
+		while (msg == NULL && nano_lmq_getq(&q->lmq, &msg) == 0) {
+			__atomic_sub_fetch(&totals.queued, 1, __ATOMIC_RELAXED);
+			if (q->v5 &&
+			    (msg = pub_msg_refresh(msg, now)) == NULL) {
+				__atomic_add_fetch(
+				    &totals.expired, 1, __ATOMIC_RELAXED);
+			}
+		}
+		if (nano_lmq_empty(&q->lmq)) {
+			queue_remove(s, q);
+		}
+	}
+	pthread_mutex_unlock(&s->mtx);
+
+	return (nng_msg *) msg;
+}
+
+// the pipe is gone, free what is held and noted for it
+void
+pipe_queue_drop(uint32_t pipe_id)
+{
+	pipe_queue_stripe *s = stripe_of(pipe_id);
+	pipe_queue *       q;
+	pipe_conflate *    c;
+
+	if (__atomic_load_n(&s->queues, __ATOMIC_RELAXED) == 0 &&
+	    __atomic_load_n(&s->conflates, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&s->mtx);
+	if ((q = queue_find(pipe_id)) != NULL) {
+		queue_remove(s, q);
+	}
+	if (s->conflates > 0 && (c = conflate_find(pipe_id)) != NULL) {
+		conflate_remove(s, c);
+	}
+	pthread_mutex_unlock(&s->mtx);
+}
+
+/**
+ * @brief pipe_queue_get_stat - Read the queue of one pipe.
+ * @param pipe_id - subscriber pipe
+ * @param stat - pipe_queue_stat, depth and dropped are 0 without a queue
+ * @return true if messages are held for the pipe
+ */
+bool
+pipe_queue_get_stat(uint32_t pipe_id, pipe_queue_stat *stat)
+{
+	pipe_queue_stripe *s = stripe_of(pipe_id);
+	pipe_queue *       q = NULL;
+
+	stat->pipe_id  = pipe_id;
+	stat->depth    = 0;
+	stat->inflight = inflight_count(pipe_id);
+	stat->dropped  = 0;
+	if (__atomic_load_n(&s->queues, __ATOMIC_RELAXED) == 0) {
+		return false;
+	}
+
+	pthread_mutex_lock(&s->mtx);
+	if ((q = queue_find(pipe_id)) != NULL) {
+		stat->depth   = nano_lmq_len(&q->lmq);
+		stat->dropped = q->dropped;
+	}
+	pthread_mutex_unlock(&s->mtx);
+
+	return q != NULL;
+}
+
+/**
+ * @brief pipe_queue_foreach - Call cb for each pipe holding messages,
+ * under the lock of its stripe.
+ * @param cb - pipe_queue_cb
+ * @param arg - passed to cb
+ * @return void
+ */
+void
+pipe_queue_foreach(pipe_queue_cb cb, void *arg)
+{
+	pipe_queue_stat stat;
+
+	for (int i = 0; i < PIPE_QUEUE_STRIPES; i++) {
+		pipe_queue_stripe *s = &stripes[i];
+
+		pthread_mutex_lock(&s->mtx);
+		for (int b = i; b < PIPE_QUEUE_BUCKETS &&
+		     __atomic_load_n(&s->queues, __ATOMIC_RELAXED) > 0;
+		     b += PIPE_QUEUE_STRIPES) {
+			for (pipe_queue *q = buckets[b]; q; q = q->next) {
+				stat.pipe_id  = q->pipe_id;
+				stat.depth    = nano_lmq_len(&q->lmq);
+				stat.inflight = inflight_count(q->pipe_id);
+				stat.dropped  = q->dropped;
+				cb(&stat, arg);
+			}
+		}
+		pthread_mutex_unlock(&s->mtx);
+	}
+}
+
+void
+pipe_queue_get_totals(pipe_queue_totals *t)
+{
+	t->queued  = __atomic_load_n(&totals.queued, __ATOMIC_RELAXED);
+	t->dropped = __atomic_load_n(&totals.dropped, __ATOMIC_RELAXED);
+	t->disconnected =
+	    __atomic_load_n(&totals.disconnected, __ATOMIC_RELAXED);
+	t->expired = __atomic_load_n(&totals.expired, __ATOMIC_RELAXED);
+	t->conflated = __atomic_load_n(&totals.conflated, __ATOMIC_RELAXED);
+}
@@ -7,15 +7,20 @@
 // found online at https://opensource.org/licenses/MIT.
 //
 
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <include/nanomq.h>
 #include <mqtt_db.h>
+#include <nano_alias.h>
+#include <nano_topic.h>
 #include <nng.h>
 #include <nng/protocol/mqtt/mqtt_parser.h>
 #include <zmalloc.h>
 
+#include "include/metrics.h"
+#include "include/persistence.h"
 #include "include/pub_handler.h"
 #include "include/sub_handler.h"
 
@@ -29,60 +34,237 @@ static uint32_t append_bytes_with_type(
     nng_msg *msg, uint8_t type, uint8_t *content, uint32_t len);
 static void handle_pub_retain(const nano_work *work, char *topic);
 
+/*
+ * Topic aliases of each connection, the table is created by the first
+ * PUBLISH from the pipe carrying an alias or the first delivery to it
+ * which may use one, and dropped with the pipe. Pipes are hashed to
+ * buckets, a stripe of buckets shares a lock, so connections only
+ * contend with the few sharing their stripe.
+ */
+#define PIPE_ALIAS_BUCKETS 4096
+#define PIPE_ALIAS_STRIPES 64
+
+typedef struct pipe_alias pipe_alias;
+
+struct pipe_alias {
+	uint32_t    pipe_id;
+	nano_alias  alias;
+	pipe_alias *next;
+};
+
+static uint16_t        alias_in_max  = 0;
+static uint16_t        alias_out_max = 0;
+static pipe_alias *    alias_buckets[PIPE_ALIAS_BUCKETS];
+static pthread_mutex_t alias_locks[PIPE_ALIAS_STRIPES];
+
+static inline uint32_t
+pipe_alias_bucket(uint32_t pipe_id)
+{
+	return (pipe_id * 2654435761u) % PIPE_ALIAS_BUCKETS;
+}
+
+static inline pthread_mutex_t *
+pipe_alias_lock(uint32_t pipe_id)
+{
+	return &alias_locks[pipe_alias_bucket(pipe_id) % PIPE_ALIAS_STRIPES];
+}
+
+// with the lock of the stripe held
+static nano_alias *
+pipe_alias_find(uint32_t pipe_id)
+{
+	pipe_alias **bucket = &alias_buckets[pipe_alias_bucket(pipe_id)];
+	pipe_alias * a      = *bucket;
+
+	while (a != NULL && a->pipe_id != pipe_id) {
+		a = a->next;
+	}
+	if (a == NULL) {
+		if ((a = zmalloc(sizeof(pipe_alias))) == NULL) {
+			return NULL;
+		}
+		if (nano_alias_init(&a->alias, alias_in_max, alias_out_max) !=
+		    0) {
+			zfree(a);
+			return NULL;
+		}
+		a->pipe_id = pipe_id;
+		a->next    = *bucket;
+		*bucket    = a;
+	}
+	return &a->alias;
+}
+
+void
+pipe_alias_init(uint16_t in_max, uint16_t out_max)
+{
+	alias_in_max  = in_max;
+	alias_out_max = out_max;
+	for (int i = 0; i < PIPE_ALIAS_STRIPES; i++) {
+		pthread_mutex_init(&alias_locks[i], NULL);
+	}
+}
+
+// the pipe is gone, so are its aliases
+void
+pipe_alias_drop(uint32_t pipe_id)
+{
+	pipe_alias **pp = &alias_buckets[pipe_alias_bucket(pipe_id)];
+	pipe_alias * a;
+
+	pthread_mutex_lock(pipe_alias_lock(pipe_id));
+	while (*pp != NULL && (*pp)->pipe_id != pipe_id) {
+		pp = &(*pp)->next;
+	}
+	if ((a = *pp) != NULL) {
+		*pp = a->next;
+		nano_alias_fini(&a->alias);
+		zfree(a);
+	}
+	pthread_mutex_unlock(pipe_alias_lock(pipe_id));
+}
+
+/**
+ * @brief pipe_alias_out_begin - Find the alias a PUBLISH of topic to the
+ * pipe goes with and lock the aliases of the pipe, so the msg carrying a
+ * new alias is sent before any using it. Must be followed by
+ * pipe_alias_out_end once the msg is sent.
+ * @param pipe_id - subscriber pipe, MQTT 5
+ * @param topic - topic
+ * @param len - length of topic
+ * @param fresh - set if the alias is new and sent with the topic
+ * @return alias, or 0 if the topic is sent without one
+ */
+uint16_t
+pipe_alias_out_begin(
+    uint32_t pipe_id, const char *topic, size_t len, bool *fresh)
+{
+	nano_alias *alias;
+
+	*fresh = false;
+	pthread_mutex_lock(pipe_alias_lock(pipe_id));
+	if ((alias = pipe_alias_find(pipe_id)) == NULL) {
+		return 0;
+	}
+	return nano_alias_out_get(alias, topic, len, fresh);
+}
+
+void
+pipe_alias_out_end(uint32_t pipe_id)
+{
+	pthread_mutex_unlock(pipe_alias_lock(pipe_id));
+}
+
+bool
+pipe_alias_out_enabled(void)
+{
+	return alias_out_max > 0;
+}
+
+/*
+ * A PUBLISH with a topic alias maps the alias to its topic, one with an
+ * empty topic takes it from the alias. The alias means nothing to the
+ * receivers, it is stripped from the decoded properties.
+ */
+static reason_code
+pub_alias_resolve(nano_work *work)
+{
+	struct pub_packet_struct *pub_packet = work->pub_packet;
+	struct mqtt_string *      topic;
+	nano_alias *              alias;
+	const char *              t;
+	uint16_t                  id;
+	reason_code               rv = SUCCESS;
+
+	topic = &pub_packet->variable_header.publish.topic_name;
+	id    = pub_packet->variable_header.publish.properties.content.publish
+	         .topic_alias.value;
+
+	pthread_mutex_lock(pipe_alias_lock(work->pid.id));
+	if ((alias = pipe_alias_find(work->pid.id)) == NULL) {
+		rv = PROTOCOL_ERROR;
+	} else if (topic->len > 0) {
+		if (nano_alias_set(alias, id, topic->body, topic->len) != 0) {
+			rv = PROTOCOL_ERROR;
+		}
+	} else if ((t = nano_alias_get(alias, id)) != NULL) {
+		topic->len  = strlen(t);
+		topic->body = nano_arena_strndup(&work->arena, t, topic->len);
+	} else {
+		rv = PROTOCOL_ERROR;
+	}
+	pthread_mutex_unlock(pipe_alias_lock(work->pid.id));
+
+	if (rv != SUCCESS) {
+		debug_msg("invalid topic alias %u", id);
+		return rv;
+	}
+	// property id and value
+	pub_packet->variable_header.publish.properties.len -= 3;
+	pub_packet->variable_header.publish.properties.content.publish
+	    .topic_alias.has_value = false;
+	pub_packet->aliased = true;
+	return SUCCESS;
+}
+
 void
 init_pipe_content(struct pipe_content *pipe_ct)
 {
-	debug_msg("pub_handler: init pipe_info");
+	log_trace("pub_handler: init pipe_info");
 	pipe_ct->pipe_info     = NULL;
+	pipe_ct->cap           = 0;
 	pipe_ct->total         = 0;
 	pipe_ct->current_index = 0;
 	pipe_ct->encode_msg    = encode_pub_message;
 }
 
+// Done with the pipes of a message, pipe_info is kept for the next one.
 void
-foreach_client(
-    void **cli_ctx_list, nano_work *pub_work, struct pipe_content *pipe_ct)
+reset_pipe_content(struct pipe_content *pipe_ct)
+{
+	pipe_ct->total         = 0;
+	pipe_ct->current_index = 0;
+}
+
+/**
+ * @brief foreach_client - Fill pipe_ct with a pipe for each matched
+ * client, pipe_info only grows if there are more than ever before.
+ * @param cli_ctx_list - matched client_ctx
+ * @param qos - granted qos of each client_ctx, from dbtree
+ * @param pub_work - nano_work
+ * @param pipe_ct - pipe_content
+ * @return void
+ */
+void
+foreach_client(void **cli_ctx_list, uint8_t *qos, nano_work *pub_work,
+    struct pipe_content *pipe_ct)
 {
-	bool               equal = false;
-	packet_subscribe * sub_pkt;
 	struct client_ctx *ctx;
-	topic_node *       tn;
 
-	int      ctx_list_len = cvector_size(cli_ctx_list);
+	uint32_t ctx_list_len = cvector_size(cli_ctx_list);
 	uint32_t pids;
 	uint8_t  sub_qos;
 
-	for (int i = 0; i < ctx_list_len; i++) {
+	if (pipe_ct->total + ctx_list_len > pipe_ct->cap) {
+		pipe_ct->cap       = pipe_ct->total + ctx_list_len;
+		pipe_ct->pipe_info = zrealloc(pipe_ct->pipe_info,
+		    sizeof(struct pipe_info) * pipe_ct->cap);
+	}
+
+	for (uint32_t i = 0; i < ctx_list_len; i++) {
 		ctx     = (struct client_ctx *) cli_ctx_list[i];
 		pids    = ctx->pid.id;
-		tn      = ctx->sub_pkt->node;
-		sub_qos = 0; // default
-
-		if (tn != NULL) {
-			sub_qos = tn->it->qos;
-		}
-
-		while (tn != NULL) {
-			if (0 ==
-			    strcmp(tn->it->topic_filter.body,
-			        pub_work->pub_packet->variable_header.publish
-			            .topic_name.body)) {
-				sub_qos = tn->it->qos;
-				break;
-			}
-			tn = tn->next;
-		}
+		sub_qos = qos ? qos[i] : 0;
 
 		if (pids == 0) {
 			continue;
 		}
-		pipe_ct->pipe_info = zrealloc(pipe_ct->pipe_info,
-		    sizeof(struct pipe_info) * (pipe_ct->total + 1));
 
 		pipe_ct->pipe_info[pipe_ct->total].index = pipe_ct->total;
 		pipe_ct->pipe_info[pipe_ct->total].pipe  = pids;
 		pipe_ct->pipe_info[pipe_ct->total].cmd   = PUBLISH;
 		pipe_ct->pipe_info[pipe_ct->total].work  = pub_work;
+		pipe_ct->pipe_info[pipe_ct->total].proto_ver = ctx->proto_ver;
 		pipe_ct->pipe_info[pipe_ct->total].qos =
 		    pub_work->pub_packet->fixed_header.qos <= sub_qos
 		    ? pub_work->pub_packet->fixed_header.qos
@@ -97,26 +279,40 @@ handle_pub(nano_work *work, struct pipe_content *pipe_ct)
 {
 	char **topic_queue = NULL;
 
-	work->pub_packet = (struct pub_packet_struct *) nng_alloc(
-	    sizeof(struct pub_packet_struct));
+	// lives in the arena of work, never given to free_pub_packet
+	work->pub_packet = (struct pub_packet_struct *) nano_arena_alloc(
+	    &work->arena, sizeof(struct pub_packet_struct));
 
 	reason_code result = decode_pub_message(work);
 	if (SUCCESS != result) {
 		debug_msg("decode message failed.");
 		return;
 	}
+	metrics_trace_mark(&work->trace, TRACE_DECODE);
 
 	// TODO no local
 	if (PUBLISH == work->pub_packet->fixed_header.packet_type) {
-		void **cli_ctx_list = NULL;
-		void **shared_cli_list = NULL;
-		size_t msg_cnt      = 0;
+		void **  cli_ctx_list = NULL;
+		uint8_t *sub_qos      = NULL;
+		size_t   msg_cnt      = 0;
+		uint32_t key          = 0;
+		uint64_t start        = metrics_now_ns();
+
+		if (work->db->shared_strategy == SHARED_STICKY &&
+		    work->cparam != NULL) {
+			const char *clientid =
+			    conn_param_get_clientid(work->cparam);
+			if (clientid) {
+				key = DJBHashn(
+				    (char *) clientid, strlen(clientid));
+			}
+		}
 		if (work->pub_packet->fixed_header.qos > 0) {
 			cli_ctx_list =
-			    dbtree_find_clients_and_cache_msg(work->db,
+			    dbtree_find_all_clients_and_cache_msg(work->db,
 			        work->pub_packet->variable_header.publish
 			            .topic_name.body,
-			        work->msg, &msg_cnt);
+			        work->msg, &msg_cnt, key, &sub_qos);
 			// Note. Why do we clone msg (msg_cnt-1) times?
 			// It's because that the refcnt of msg is 1, when
 			// plus (msg_cnt-1), equals (msg_cnt), and it means
@@ -124,42 +320,24 @@ handle_pub(nano_work *work, struct pipe_content *pipe_ct)
 			for (int i = 0; i < (int) (msg_cnt); i++) {
 				nng_msg_clone(work->msg);
 			}
-
-			shared_cli_list = dbtree_find_shared_sub_clients(work->db,
-			        work->pub_packet->variable_header.publish
-			            .topic_name.body,
-			        work->msg, &msg_cnt);
-			// Note. Why do we clone msg (msg_cnt-1) times?
-			// It's because that the refcnt of msg is 1, when
-			// plus (msg_cnt-1), equals (msg_cnt), and it means
-			// the count of session which the msg would be sent to.
-			for (int i = 0; i < (int) (msg_cnt - 1); i++) {
-				nng_msg_clone(work->msg);
-			}
-
 		} else {
-			cli_ctx_list =
-			    dbtree_find_clients_and_cache_msg(work->db,
-			        work->pub_packet->variable_header.publish
-			            .topic_name.body,
-			        NULL, &msg_cnt);
-
-			shared_cli_list = dbtree_find_shared_sub_clients(work->db,
-			        work->pub_packet->variable_header.publish
-			            .topic_name.body,
-			        NULL, &msg_cnt);
+			// QoS 0 is sent at QoS 0 to whoever is online, the
+			// sessions and granted qos are of no use to it
+			cli_ctx_list = dbtree_find_online_clients(work->db,
+			    work->pub_packet->variable_header.publish.topic_name
+			        .body,
+			    key);
 		}
 
+		metrics_match(metrics_now_ns() - start);
 
 		if (cli_ctx_list != NULL) {
-			foreach_client(cli_ctx_list, work, pipe_ct);
+			foreach_client(cli_ctx_list, sub_qos, work, pipe_ct);
 		}
+		metrics_trace_mark(&work->trace, TRACE_MATCH);
+		metrics_fanout(pipe_ct->total);
 		cvector_free(cli_ctx_list);
-		
-		if (shared_cli_list != NULL) {
-			foreach_client(shared_cli_list, work, pipe_ct);
-		}
-		cvector_free(shared_cli_list);
+		cvector_free(sub_qos);
 
 		debug_msg("pipe_info size: [%d]", pipe_ct->total);
 
@@ -172,41 +350,76 @@ handle_pub(nano_work *work, struct pipe_content *pipe_ct)
 }
 
 #if ENABLE_RETAIN
+/*
+ * The store keeps the properties as received, but for the topic alias
+ * which means nothing to the receivers, it is cut from a copy of the
+ * block of an aliased PUBLISH. They sit between the variable header and
+ * the payload at the end of the body. A Message Expiry Interval counts
+ * from the arrival.
+ */
 static void
 handle_pub_retain(const nano_work *work, char *topic)
 {
-	dbtree_retain_msg *retain = NULL;
-
-	if (work->pub_packet->fixed_header.retain) {
-		dbtree_retain_msg *r = NULL;
-
-		if (work->pub_packet->payload_body.payload_len > 0) {
-			retain      = nng_alloc(sizeof(dbtree_retain_msg));
-			retain->qos = work->pub_packet->fixed_header.qos;
-			nng_msg_clone(work->msg);
-
-			retain->message = work->msg;
-			retain->exist   = true;
-			retain->m       = NULL;
-			debug_msg("update/add retain message");
-			debug("found retain [%p], message: [%p][%p]\n", retain,
-			    retain->message,
-			    nng_msg_payload_ptr(retain->message));
-			r = dbtree_insert_retain(work->db_ret, topic, retain);
-		} else {
-			debug_msg("delete retain message");
-			r = dbtree_delete_retain(work->db_ret, topic);
-		}
-		dbtree_retain_msg *ret = (dbtree_retain_msg *) r;
+	struct pub_packet_struct *pub_packet = work->pub_packet;
+	nano_retain_msg           ret        = { 0 };
+	uint8_t *                 body       = nng_msg_body(work->msg);
+	size_t                    len        = nng_msg_len(work->msg);
+	uint8_t *                 props      = NULL;
+	const uint8_t *           block;
+	size_t                    pos;
+	uint32_t                  plen, at, n;
+	uint32_t                  interval;
+
+	if (!pub_packet->fixed_header.retain) {
+		return;
+	}
+	if (pub_packet->payload_body.payload_len == 0) {
+		debug_msg("delete retain message");
+		nano_retain_del(work->retain, topic);
+		persistence_retain(topic, NULL);
+		return;
+	}
 
-		if (ret != NULL) {
-			if (ret->message) {
-				nng_msg_free(ret->message);
-			}
-			nng_free(ret, sizeof(dbtree_retain_msg));
-			ret = NULL;
+	pos = 2 + ((body[0] << 8) | body[1]);
+	if (pub_packet->fixed_header.qos > 0) {
+		pos += 2;
+	}
+	ret.topic       = topic;
+	ret.topic_len   = strlen(topic);
+	ret.qos         = pub_packet->fixed_header.qos;
+	ret.payload_len = pub_packet->payload_body.payload_len;
+	ret.payload     = body + len - ret.payload_len;
+	if (pub_packet->aliased) {
+		block = pub_packet->variable_header.publish.props;
+		plen  = pub_packet->variable_header.publish.props_len - 3;
+		at    = pub_packet->variable_header.publish.alias_at;
+		if ((props = zmalloc(5 + plen)) == NULL) {
+			return;
 		}
+		n = put_var_integer(props, plen);
+		memcpy(props + n, block, at);
+		memcpy(props + n + at, block + at + 3, plen - at);
+		ret.props     = props;
+		ret.props_len = n + plen;
+	} else if (body + pos <= ret.payload) {
+		ret.props     = body + pos;
+		ret.props_len = ret.payload - ret.props;
+	}
+	if (ret.props_len > 0 &&
+	    pub_props_expiry(ret.props, ret.props_len, &pos, &interval)) {
+		ret.expire_at = nng_msg_get_timestamp(work->msg) +
+		    (nng_time) interval * 1000;
 	}
+	debug_msg("update/add retain message");
+	if (nano_retain_set(work->retain, &ret) < 0) {
+		log_warn("retain message on %s dropped, it exceeds the "
+		         "retain memory limit",
+		    topic);
+		persistence_retain(topic, NULL);
+	} else {
+		persistence_retain(topic, &ret);
+	}
+	zfree(props);
 }
 #endif
 
@@ -234,6 +447,8 @@ copy_pub_packet(struct pub_packet_struct *src_pub_packet)
 	    src_pub_packet->payload_body.payload_len);
 	packet->payload_body.payload_len =
 	    src_pub_packet->payload_body.payload_len;
+	packet->payload_body.borrowed = false;
+	init_pub_packet_property(packet);
 	return packet;
 }
 
@@ -259,7 +474,8 @@ free_pub_packet(struct pub_packet_struct *pub_packet)
 			}
 
 			if (pub_packet->payload_body.payload != NULL &&
-			    pub_packet->payload_body.payload_len > 0) {
+			    pub_packet->payload_body.payload_len > 0 &&
+			    !pub_packet->payload_body.borrowed) {
 				nng_free(pub_packet->payload_body.payload,
 				    pub_packet->payload_body.payload_len + 1);
 				pub_packet->payload_body.payload     = NULL;
@@ -298,221 +514,172 @@ append_bytes_with_type(
 	return 1;
 }
 
-bool
-encode_pub_message(nng_msg *dest_msg, const nano_work *work,
-    mqtt_control_packet_types cmd, uint8_t sub_qos, bool dup)
+/*
+ * A PUBLISH to receivers is encoded by one of few encoders, by protocol,
+ * by qos 0 or not for the packet identifier and by property block or
+ * not. Each is pub_encode with those as constants, so its branches fold
+ * away. The size is known before anything is written, the body is sized
+ * once and written in place, the fixed header appended in one go.
+ */
+typedef bool (*pub_encoder)(
+    nng_msg *, const nano_work *, uint8_t qos, bool dup);
+
+static inline __attribute__((always_inline)) bool
+pub_encode(nng_msg *dest_msg, const nano_work *work, uint8_t qos, bool dup,
+    const bool id, const bool v5, const bool props)
 {
-	uint8_t  tmp[4]     = { 0 };
-	uint32_t arr_len    = 0;
-	int      append_res = 0;
-	uint8_t  proto = 0;
-	uint32_t buf;
-	properties_type prop_type;
-
-	if (work->cparam) {
-		proto = conn_param_get_protover(work->cparam);
+	struct pub_packet_struct *pub = work->pub_packet;
+	struct mqtt_string *      topic;
+	const uint8_t *           block;
+	uint32_t                  at, plen = 0, vlen = 0, hlen, len;
+	uint8_t                   var[4];
+	uint8_t                   header[5];
+	uint8_t *                 p;
+	struct fixed_header       fixed_header;
+
+	topic = &pub->variable_header.publish.topic_name;
+	block = pub->variable_header.publish.props;
+	at    = pub->variable_header.publish.alias_at;
+	if (v5) {
+		vlen = put_var_integer(
+		    var, pub->variable_header.publish.properties.len);
+	}
+	if (props) {
+		// the block of the publisher as it is, but for its topic alias
+		plen = pub->variable_header.publish.props_len -
+		    (pub->aliased ? 3 : 0);
+	}
+	len = (topic->len > 0 ? 2 + topic->len : 0) + (id ? 2 : 0) + vlen +
+	    plen + pub->payload_body.payload_len;
+	if (nng_msg_realloc(dest_msg, len) != 0) {
+		return false;
 	}
 
-	debug_msg("start encode message");
-
-	nng_msg_clear(dest_msg);
-	nng_msg_header_clear(dest_msg);
-	nng_msg_set_cmd_type(dest_msg, CMD_UNKNOWN);
-	switch (cmd) {
-	case PUBLISH:
-		/*fixed header*/
-		nng_msg_set_cmd_type(dest_msg, CMD_PUBLISH);
-		work->pub_packet->fixed_header.packet_type = cmd;
-		// work->pub_packet->fixed_header.qos =
-		// work->pub_packet->fixed_header.qos < sub_qos ?
-		// work->pub_packet->fixed_header.qos : sub_qos;
-		work->pub_packet->fixed_header.dup = dup;
-		append_res                         = nng_msg_header_append(
-                    dest_msg, (uint8_t *) &work->pub_packet->fixed_header, 1);
-
-		arr_len = put_var_integer(
-		    tmp, work->pub_packet->fixed_header.remain_len);
-
-		append_res = nng_msg_header_append(dest_msg, tmp, arr_len);
-		nng_msg_set_remaining_len(
-		    dest_msg, work->pub_packet->fixed_header.remain_len);
-		debug_msg("header len [%ld] remain len [%d]\n",
-		    nng_msg_header_len(dest_msg),
-		    work->pub_packet->fixed_header.remain_len);
-		/*variable header*/
-		// topic name
-		if (work->pub_packet->variable_header.publish.topic_name.len >
-		    0) {
-			append_res = nng_msg_append_u16(dest_msg,
-			    work->pub_packet->variable_header.publish
-			        .topic_name.len);
+	p = nng_msg_body(dest_msg);
+	if (topic->len > 0) {
+		NNI_PUT16(p, topic->len);
+		memcpy(p + 2, topic->body, topic->len);
+		p += 2 + topic->len;
+	}
+	if (id) {
+		NNI_PUT16(p, pub->variable_header.publish.packet_identifier);
+		p += 2;
+	}
+	if (v5) {
+		memcpy(p, var, vlen);
+		p += vlen;
+	}
+	if (props && pub->aliased) {
+		memcpy(p, block, at);
+		memcpy(p + at, block + at + 3, plen - at);
+		p += plen;
+	} else if (props) {
+		memcpy(p, block, plen);
+		p += plen;
+	}
+	if (pub->payload_body.payload_len > 0) {
+		memcpy(p, pub->payload_body.payload,
+		    pub->payload_body.payload_len);
+	}
 
-			append_res = nng_msg_append(dest_msg,
-			    work->pub_packet->variable_header.publish
-			        .topic_name.body,
-			    work->pub_packet->variable_header.publish
-			        .topic_name.len);
-		}
+	pub->fixed_header.packet_type = PUBLISH;
+	pub->fixed_header.dup         = dup;
+	// qos is the one granted to the receiver
+	fixed_header     = pub->fixed_header;
+	fixed_header.qos = qos;
+	memcpy(header, &fixed_header, 1);
+	hlen = 1 + put_var_integer(header + 1, len);
+	nng_msg_header_append(dest_msg, header, hlen);
+	nng_msg_set_remaining_len(dest_msg, len);
+	nng_msg_set_cmd_type(dest_msg, CMD_PUBLISH);
 
-		// identifier
-		if (work->pub_packet->fixed_header.qos > 0) {
-			append_res = nng_msg_append_u16(dest_msg,
-			    work->pub_packet->variable_header.publish
-			        .packet_identifier);
-		}
-		debug_msg("after topic and id len in msg already [%ld]",
-		    nng_msg_len(dest_msg));
+	return true;
+}
 
-#if SUPPORT_MQTT5_0
-		if (PROTOCOL_VERSION_v5 == proto) {
-			// properties
-			// properties length
-			memset(tmp, 0, sizeof(tmp));
-			arr_len = put_var_integer(tmp,
-			    work->pub_packet->variable_header.publish
-			        .properties.len);
-			nng_msg_append(dest_msg, tmp, arr_len);
-			debug_msg("arr_len [%d]", arr_len);
-
-			// Payload Format Indicator
-			if (work->pub_packet->variable_header.publish
-			        .properties.content.publish
-			        .payload_fmt_indicator.has_value) {
-				prop_type = PAYLOAD_FORMAT_INDICATOR;
-				nng_msg_append(dest_msg, &prop_type, 1);
-				nng_msg_append(dest_msg,
-				    &work->pub_packet->variable_header.publish
-				         .properties.content.publish
-				         .payload_fmt_indicator.value,
-				    sizeof(
-				        work->pub_packet->variable_header
-				            .publish.properties.content.publish
-				            .payload_fmt_indicator));
-			}
+static bool
+pub_encode_v4_qos0(
+    nng_msg *dest_msg, const nano_work *work, uint8_t qos, bool dup)
+{
+	return pub_encode(dest_msg, work, qos, dup, false, false, false);
+}
 
-			// Message Expiry Interval
-			if (work->pub_packet->variable_header.publish
-			        .properties.content.publish.msg_expiry_interval
-			        .has_value) {
-				prop_type = MESSAGE_EXPIRY_INTERVAL;
-				nng_msg_append(dest_msg, &prop_type, 1);
-				nng_msg_append_u32(dest_msg,
-				    work->pub_packet->variable_header.publish
-				        .properties.content.publish
-				        .msg_expiry_interval.value);
-			}
+static bool
+pub_encode_v4_qos1(
+    nng_msg *dest_msg, const nano_work *work, uint8_t qos, bool dup)
+{
+	return pub_encode(dest_msg, work, qos, dup, true, false, false);
+}
 
-			// Topic Alias
-			if (work->pub_packet->variable_header.publish
-			        .properties.content.publish.topic_alias
-			        .has_value) {
-				prop_type = TOPIC_ALIAS;
-				nng_msg_append(dest_msg, &prop_type, 1);
-				nng_msg_append_u16(dest_msg,
-				    work->pub_packet->variable_header.publish
-				        .properties.content.publish.topic_alias
-				        .value);
-			}
+static bool
+pub_encode_v5_qos0(
+    nng_msg *dest_msg, const nano_work *work, uint8_t qos, bool dup)
+{
+	return pub_encode(dest_msg, work, qos, dup, false, true, false);
+}
 
-			// Response Topic
-			if (work->pub_packet->variable_header.publish
-			        .properties.content.publish.response_topic
-			        .len > 0) {
-				append_bytes_with_type(dest_msg,
-				    RESPONSE_TOPIC,
-				    (uint8_t *) work->pub_packet
-				        ->variable_header.publish.properties
-				        .content.publish.response_topic.body,
-				    work->pub_packet->variable_header.publish
-				        .properties.content.publish
-				        .response_topic.len);
-			}
+static bool
+pub_encode_v5_qos1(
+    nng_msg *dest_msg, const nano_work *work, uint8_t qos, bool dup)
+{
+	return pub_encode(dest_msg, work, qos, dup, true, true, false);
+}
 
-			// Correlation Data
-			if (work->pub_packet->variable_header.publish
-			        .properties.content.publish.correlation_data
-			        .len > 0) {
-				append_bytes_with_type(dest_msg,
-				    CORRELATION_DATA,
-				    work->pub_packet->variable_header.publish
-				        .properties.content.publish
-				        .correlation_data.body,
-				    work->pub_packet->variable_header.publish
-				        .properties.content.publish
-				        .correlation_data.len);
-			}
+static bool
+pub_encode_v5_qos0_props(
+    nng_msg *dest_msg, const nano_work *work, uint8_t qos, bool dup)
+{
+	return pub_encode(dest_msg, work, qos, dup, false, true, true);
+}
 
-			// User Property
-			if (work->pub_packet->variable_header.publish
-			        .properties.content.publish.user_property
-			        .len_key > 0) {
-				append_bytes_with_type(dest_msg, USER_PROPERTY,
-				    (uint8_t *) work->pub_packet
-				        ->variable_header.publish.properties
-				        .content.publish.user_property.key,
-				    work->pub_packet->variable_header.publish
-				        .properties.content.publish
-				        .user_property.len_key);
-				nng_msg_append(dest_msg,
-				    (uint8_t *) work->pub_packet
-				        ->variable_header.publish.properties
-				        .content.publish.user_property.val,
-				    work->pub_packet->variable_header.publish
-				        .properties.content.publish
-				        .user_property.len_val);
-			}
+static bool
+pub_encode_v5_qos1_props(
+    nng_msg *dest_msg, const nano_work *work, uint8_t qos, bool dup)
+{
+	return pub_encode(dest_msg, work, qos, dup, true, true, true);
+}
 
-			// Subscription Identifier
-			if (work->pub_packet->variable_header.publish
-			        .properties.content.publish
-			        .subscription_identifier.has_value) {
-				prop_type = SUBSCRIPTION_IDENTIFIER;
-				nng_msg_append(dest_msg, &prop_type, 1);
-				memset(tmp, 0, sizeof(tmp));
-				arr_len = put_var_integer(tmp,
-				    work->pub_packet->variable_header.publish
-				        .properties.content.publish
-				        .subscription_identifier.value);
-				nng_msg_append(dest_msg, tmp, arr_len);
-			}
+// the encoder for receivers of qos and proto
+static pub_encoder
+pub_encoder_of(const nano_work *work, uint8_t qos, uint8_t proto)
+{
+	static const pub_encoder encoders[3][2] = {
+		{ pub_encode_v4_qos0, pub_encode_v4_qos1 },
+		{ pub_encode_v5_qos0, pub_encode_v5_qos1 },
+		{ pub_encode_v5_qos0_props, pub_encode_v5_qos1_props },
+	};
+	int kind = 0;
 
-			// CONTENT TYPE
-			if (work->pub_packet->variable_header.publish
-			        .properties.content.publish.content_type.len >
-			    0) {
-				append_bytes_with_type(dest_msg, CONTENT_TYPE,
-				    (uint8_t *) work->pub_packet
-				        ->variable_header.publish.properties
-				        .content.publish.content_type.body,
-				    work->pub_packet->variable_header.publish
-				        .properties.content.publish
-				        .content_type.len);
-			}
-		}
-		/* check */
-		else {
-			debug_msg("pro_ver [%d]", proto);
-		}
+#if SUPPORT_MQTT5_0
+	if (proto == PROTOCOL_VERSION_v5) {
+		kind = work->pub_packet->variable_header.publish.props_len > 0
+		    ? 2
+		    : 1;
+	}
 #endif
-		debug_msg("property len in msg already [%ld]",
-		    nng_msg_len(dest_msg));
+	return encoders[kind][qos > 0];
+}
 
-		// payload
-		if (work->pub_packet->payload_body.payload_len > 0) {
-			// nng_msg_set_payload_ptr(msg, nng_msg_body());
-			append_res = nng_msg_append(dest_msg,
-			    work->pub_packet->payload_body.payload,
-			    work->pub_packet->payload_body.payload_len);
-			//				debug_msg("payload [%s]
-			// len
-			//[%d]", (char
-			//*)work->pub_packet->payload_body.payload,
-			// work->pub_packet->payload_body.payload_len);
-		}
+bool
+encode_pub_message(nng_msg *dest_msg, const nano_work *work,
+    mqtt_control_packet_types cmd, uint8_t sub_qos, uint8_t proto, bool dup)
+{
+	uint8_t  tmp[4]  = { 0 };
+	uint32_t arr_len = 0;
 
-		debug_msg("after payload len in msg already [%ld]",
-		    nng_msg_len(dest_msg));
-		break;
+	// encode for the protocol of publisher unless told
+	if (proto == 0 && work->cparam) {
+		proto = conn_param_get_protover(work->cparam);
+	}
+
+	log_trace("start encode message");
+
+	nng_msg_clear(dest_msg);
+	nng_msg_header_clear(dest_msg);
+	nng_msg_set_cmd_type(dest_msg, CMD_UNKNOWN);
+	switch (cmd) {
+	case PUBLISH:
+		return pub_encoder_of(work, sub_qos, proto)(
+		    dest_msg, work, sub_qos, dup);
 
 	case PUBREL:
 		nng_msg_set_cmd_type(dest_msg, CMD_PUBREL);
@@ -521,7 +688,7 @@ encode_pub_message(nng_msg *dest_msg, const nano_work *work,
 	case PUBREC:
 		nng_msg_set_cmd_type(dest_msg, CMD_PUBREC);
 	case PUBCOMP:
-		debug_msg("encode %d message", cmd);
+		log_trace("encode %d message", cmd);
 		nng_msg_set_cmd_type(dest_msg, CMD_PUBCOMP);
 		struct pub_packet_struct pub_response = {
 			.fixed_header.packet_type = cmd,
@@ -605,26 +772,397 @@ encode_pub_message(nng_msg *dest_msg, const nano_work *work,
 		break;
 	}
 
-	debug_msg("end encode message");
+	log_trace("end encode message");
+	return true;
+}
+
+/**
+ * @brief forward_pub_message - Reuse the received msg for receivers when
+ * its body is what encode_pub_message would produce for them, only the
+ * fixed header is rewritten in place.
+ * @param msg - the received msg
+ * @param work - nano_work
+ * @param sub_qos - qos granted to receivers
+ * @param proto - protocol of receivers
+ * @return false if msg must be encoded
+ */
+bool
+forward_pub_message(
+    nng_msg *msg, const nano_work *work, uint8_t sub_qos, uint8_t proto)
+{
+	struct pub_packet_struct *pub_packet = work->pub_packet;
+	struct fixed_header       fixed_header;
+
+	// packet identifier and property block must stay as they are, topic
+	// and alias of an aliased one are only good for the publisher
+	if (pub_packet->aliased ||
+	    (sub_qos > 0) != (pub_packet->fixed_header.qos > 0) ||
+	    (proto == PROTOCOL_VERSION_v5) !=
+	        (pub_packet->proto == PROTOCOL_VERSION_v5) ||
+	    nng_msg_header_len(msg) < 2) {
+		return false;
+	}
+
+	fixed_header     = pub_packet->fixed_header;
+	fixed_header.qos = sub_qos;
+	fixed_header.dup = 0;
+	memcpy(nng_msg_header(msg), &fixed_header, 1);
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+
+	return true;
+}
+
+/**
+ * @brief encode_pub_alias - Build a PUBLISH going with a topic alias from
+ * its MQTT 5 encoding. The alias is put first in the property block and
+ * the topic is left out unless the alias is new to the receiver.
+ * @param src - MQTT 5 PUBLISH
+ * @param alias - topic alias
+ * @param with_topic - keep the topic, the receiver learns the alias
+ * @return new msg, or NULL if src is broken
+ */
+nng_msg *
+encode_pub_alias(nng_msg *src, uint16_t alias, bool with_topic)
+{
+	uint8_t *header = nng_msg_header(src);
+	uint8_t *body   = nng_msg_body(src);
+	size_t   len    = nng_msg_len(src);
+	size_t   tlen, pos, plen = 0, vlen = 0;
+	uint8_t  tmp[4];
+	uint8_t  prop[3] = { TOPIC_ALIAS, alias >> 8, alias & 0xff };
+	nng_msg *msg;
+
+	if (len < 2 || nng_msg_header_len(src) < 2) {
+		return NULL;
+	}
+	tlen = (body[0] << 8) | body[1];
+	pos  = 2 + tlen + (((header[0] >> 1) & 0x03) > 0 ? 2 : 0);
+	// property length, a variable byte integer
+	do {
+		if (pos + vlen >= len || vlen == 4) {
+			return NULL;
+		}
+		plen |= (size_t)(body[pos + vlen] & 0x7f) << (7 * vlen);
+	} while (body[pos + vlen++] & 0x80);
+	if (pos + vlen + plen > len || nng_msg_alloc(&msg, 0) != 0) {
+		return NULL;
+	}
+
+	if (with_topic) {
+		nng_msg_append(msg, body, 2 + tlen);
+	} else {
+		nng_msg_append_u16(msg, 0);
+	}
+	// packet identifier
+	nng_msg_append(msg, body + 2 + tlen, pos - 2 - tlen);
+	nng_msg_append(msg, tmp, put_var_integer(tmp, plen + sizeof(prop)));
+	nng_msg_append(msg, prop, sizeof(prop));
+	nng_msg_append(msg, body + pos + vlen, len - pos - vlen);
+
+	nng_msg_header_append(msg, header, 1);
+	nng_msg_header_append(
+	    msg, tmp, put_var_integer(tmp, nng_msg_len(msg)));
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+	nng_msg_set_remaining_len(msg, nng_msg_len(msg));
+
+	return msg;
+}
+
+// a variable byte integer of at most 4 bytes in buf, 0 if broken
+static size_t
+get_varint(const uint8_t *buf, size_t len, uint32_t *val)
+{
+	size_t n = 0;
+
+	*val = 0;
+	do {
+		if (n >= len || n == 4) {
+			return 0;
+		}
+		*val |= (uint32_t)(buf[n] & 0x7f) << (7 * n);
+	} while (buf[n++] & 0x80);
+
+	return n;
+}
+
+// step over the property at *pos of the len bytes of properties at p, off
+// is set to the offset of its value, false if it is broken or unknown
+static bool
+props_next(const uint8_t *p, size_t len, size_t *pos, uint8_t *id,
+    size_t *off)
+{
+	size_t   i = *pos;
+	size_t   n;
+	uint32_t v;
+
+	if (i >= len) {
+		return false;
+	}
+	*id  = p[i++];
+	*off = i;
+	switch (*id) {
+	case PAYLOAD_FORMAT_INDICATOR:
+		i += 1;
+		break;
+	case MESSAGE_EXPIRY_INTERVAL:
+		i += 4;
+		break;
+	case TOPIC_ALIAS:
+		i += 2;
+		break;
+	case SUBSCRIPTION_IDENTIFIER:
+		if ((n = get_varint(p + i, len - i, &v)) == 0) {
+			return false;
+		}
+		i += n;
+		break;
+	case CONTENT_TYPE:
+	case RESPONSE_TOPIC:
+	case CORRELATION_DATA:
+		if (i + 2 > len) {
+			return false;
+		}
+		i += 2 + ((p[i] << 8) | p[i + 1]);
+		break;
+	case USER_PROPERTY:
+		for (int k = 0; k < 2; k++) {
+			if (i + 2 > len) {
+				return false;
+			}
+			i += 2 + ((p[i] << 8) | p[i + 1]);
+		}
+		break;
+	default:
+		return false;
+	}
+	if (i > len) {
+		return false;
+	}
+	*pos = i;
+	return true;
+}
+
+/**
+ * @brief pub_props_find - Find a property in the property block of a
+ * PUBLISH, they are only looked into when one is needed.
+ * @param props - property length and properties
+ * @param len - bytes of props, may run into the payload
+ * @param id - property identifier
+ * @param off - offset of the value in props
+ * @return true if props has one
+ */
+bool
+pub_props_find(const uint8_t *props, size_t len, uint8_t id, size_t *off)
+{
+	uint32_t plen;
+	size_t   n   = get_varint(props, len, &plen);
+	size_t   pos = 0;
+	size_t   at;
+	uint8_t  t;
+
+	if (n == 0 || n + plen > len) {
+		return false;
+	}
+	while (pos < plen) {
+		if (!props_next(props + n, plen, &pos, &t, &at)) {
+			return false;
+		}
+		if (t == id) {
+			*off = n + at;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief pub_props_expiry - Find the Message Expiry Interval in the
+ * property block of a PUBLISH.
+ * @param props - property length and properties
+ * @param len - bytes of props, may run into the payload
+ * @param off - offset of the 4 bytes of the interval in props
+ * @param interval - the interval in seconds
+ * @return true if props has one
+ */
+bool
+pub_props_expiry(
+    const uint8_t *props, size_t len, size_t *off, uint32_t *interval)
+{
+	const uint8_t *p;
+
+	if (!pub_props_find(props, len, MESSAGE_EXPIRY_INTERVAL, off)) {
+		return false;
+	}
+	p         = props + *off;
+	*interval = ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) |
+	    p[3];
 	return true;
 }
 
+/**
+ * @brief pub_props_decode - Check the property block of an MQTT 5 PUBLISH
+ * and keep where it is. Only the Topic Alias is decoded, receivers get
+ * the rest as it came.
+ * @param pub_packet - pub_packet_struct
+ * @param buf - property length in the received msg
+ * @param len - bytes left in msg from buf
+ * @return bytes of property length and properties, 0 if they are broken
+ */
+static size_t
+pub_props_decode(
+    struct pub_packet_struct *pub_packet, uint8_t *buf, size_t len)
+{
+	struct property_u16 *alias =
+	    &pub_packet->variable_header.publish.properties.content.publish
+	         .topic_alias;
+	uint32_t plen;
+	size_t   n   = get_varint(buf, len, &plen);
+	size_t   pos = 0;
+	size_t   at, off;
+	uint8_t  id;
+
+	if (n == 0 || n + plen > len) {
+		return 0;
+	}
+	while (pos < plen) {
+		at = pos;
+		if (!props_next(buf + n, plen, &pos, &id, &off)) {
+			return 0;
+		}
+		// only a server sends a Subscription Identifier
+		if (id == SUBSCRIPTION_IDENTIFIER ||
+		    (id == TOPIC_ALIAS && alias->has_value)) {
+			return 0;
+		}
+		if (id == TOPIC_ALIAS) {
+			alias->has_value = true;
+			alias->value = (buf[n + off] << 8) | buf[n + off + 1];
+			pub_packet->variable_header.publish.alias_at = at;
+		}
+	}
+	pub_packet->variable_header.publish.properties.len = plen;
+	pub_packet->variable_header.publish.props          = buf + n;
+	pub_packet->variable_header.publish.props_len      = plen;
+
+	return n + plen;
+}
+
+// offset of the property block in the body of an MQTT 5 PUBLISH, 0 if none
+static size_t
+pub_props_pos(nng_msg *msg)
+{
+	uint8_t *header = nng_msg_header(msg);
+	uint8_t *body   = nng_msg_body(msg);
+	size_t   len    = nng_msg_len(msg);
+	size_t   pos;
+
+	if (len < 2 || nng_msg_header_len(msg) < 1) {
+		return 0;
+	}
+	pos = 2 + ((body[0] << 8) | body[1]);
+	if (((header[0] >> 1) & 0x03) > 0) {
+		pos += 2;
+	}
+	return pos < len ? pos : 0;
+}
+
+/**
+ * @brief pub_msg_expire_at - Time an MQTT 5 PUBLISH expires at, by its
+ * Message Expiry Interval counted from the timestamp set as it arrived.
+ * @param msg - PUBLISH encoded for MQTT 5
+ * @return time in nng_clock, 0 if msg never expires
+ */
+nng_time
+pub_msg_expire_at(nng_msg *msg)
+{
+	size_t   pos = pub_props_pos(msg);
+	size_t   off;
+	uint32_t interval;
+
+	if (pos == 0 ||
+	    !pub_props_expiry((uint8_t *) nng_msg_body(msg) + pos,
+	        nng_msg_len(msg) - pos, &off, &interval)) {
+		return 0;
+	}
+	return nng_msg_get_timestamp(msg) + (nng_time) interval * 1000;
+}
+
+/**
+ * @brief pub_msg_refresh - Check the Message Expiry Interval of an MQTT 5
+ * PUBLISH about to be sent, the receiver gets the interval left of it.
+ * @param msg - PUBLISH encoded for MQTT 5, the reference of the caller
+ * @param now - current time
+ * @return msg or a copy of it with the interval left, NULL if it expired,
+ * the reference of the caller moves to what is returned
+ */
+nng_msg *
+pub_msg_refresh(nng_msg *msg, nng_time now)
+{
+	size_t   pos = pub_props_pos(msg);
+	size_t   off;
+	uint32_t interval, left;
+	nng_time elapsed = now - nng_msg_get_timestamp(msg);
+	nng_msg *dup;
+	uint8_t *p;
+
+	if (pos == 0 ||
+	    !pub_props_expiry((uint8_t *) nng_msg_body(msg) + pos,
+	        nng_msg_len(msg) - pos, &off, &interval)) {
+		return msg;
+	}
+	if (nng_msg_get_timestamp(msg) > now) {
+		elapsed = 0;
+	}
+	if (elapsed >= (nng_time) interval * 1000) {
+		nng_msg_free(msg);
+		return NULL;
+	}
+	if ((left = interval - (uint32_t)(elapsed / 1000)) == interval) {
+		return msg;
+	}
+	// the encoding is shared with other receivers, write a copy
+	if (nng_msg_dup(&dup, msg) != 0) {
+		return msg;
+	}
+	// counted from the time the interval left refers to
+	nng_msg_set_cmd_type(dup, CMD_PUBLISH);
+	nng_msg_set_timestamp(dup,
+	    nng_msg_get_timestamp(msg) + (nng_time)(interval - left) * 1000);
+	nng_msg_free(msg);
+	p    = (uint8_t *) nng_msg_body(dup) + pos + off;
+	p[0] = left >> 24;
+	p[1] = left >> 16;
+	p[2] = left >> 8;
+	p[3] = left;
+
+	return dup;
+}
+
 reason_code
 decode_pub_message(nano_work *work)
 {
-	uint32_t pos      = 0;
-	uint32_t used_pos = 0;
-	uint32_t len, len_of_varint;
+	uint32_t pos = 0;
+	uint32_t len;
 	uint8_t  proto;
+	int      rv, cnt;
 
-	proto = conn_param_get_protover(work->cparam);
+	// a sys event work has no cparam, it only decodes PUBLISH
 	if (nng_msg_cmd_type(work->msg) == CMD_PUBLISH) {
 		proto = 4;
+	} else {
+		proto = conn_param_get_protover(work->cparam);
 	}
 
 	nng_msg *                 msg        = work->msg;
 	struct pub_packet_struct *pub_packet = work->pub_packet;
 
+	// the payload is not copied, it lives as long as work->msg
+	pub_packet->proto                    = proto;
+	pub_packet->aliased                  = false;
+	pub_packet->payload_body.payload     = NULL;
+	pub_packet->payload_body.payload_len = 0;
+	pub_packet->payload_body.borrowed    = true;
+
 	uint8_t *msg_body = nng_msg_body(msg);
 	size_t   msg_len  = nng_msg_len(msg);
 
@@ -649,31 +1187,25 @@ decode_pub_message(nano_work *work)
 		// topic length
 		NNI_GET16(msg_body + pos,
 		    pub_packet->variable_header.publish.topic_name.len);
-		pub_packet->variable_header.publish.topic_name.body =
-		    (char *) copy_utf8_str(msg_body, &pos, &len);
-
-		if (pub_packet->variable_header.publish.topic_name.len > 0) {
-			if (strchr(pub_packet->variable_header.publish
-			               .topic_name.body,
-			        '+') != NULL ||
-			    strchr(pub_packet->variable_header.publish
-			               .topic_name.body,
-			        '#') != NULL) {
-
-				// TODO search topic alias if mqtt version
-				// = 5.0
-
-				// protocol error
-				debug_msg(
-				    "protocol error in topic:[%s], len: [%d]",
-				    pub_packet->variable_header.publish
-				        .topic_name.body,
-				    pub_packet->variable_header.publish
-				        .topic_name.len);
-
-				return PROTOCOL_ERROR;
-			}
+		len = pub_packet->variable_header.publish.topic_name.len;
+		if (len + 2 > msg_len) {
+			debug_msg("ERROR: topic length > msg_len");
+			return PROTOCOL_ERROR;
+		}
+		// no U+0000, broken UTF-8 or wildcard before it is copied,
+		// an empty topic is left to the topic alias
+		if (len > 0 &&
+		    (rv = nano_topic_scan((char *) msg_body + pos + 2, len, 0,
+		         NULL, 0, &cnt)) != NANO_TOPIC_OK) {
+			debug_msg("protocol error in topic, len: [%d], err: %d",
+			    len, rv);
+			return PROTOCOL_ERROR;
 		}
+		pub_packet->variable_header.publish.topic_name.body = len > 0
+		    ? nano_arena_strndup(
+		          &work->arena, (char *) msg_body + pos + 2, len)
+		    : NULL;
+		pos += len + 2;
 
 		debug_msg("topic: [%s], qos: %d",
 		    pub_packet->variable_header.publish.topic_name.body,
@@ -690,350 +1222,36 @@ decode_pub_message(nano_work *work)
 			pos += 2;
 		}
 
-		used_pos                                           = pos;
-		pub_packet->variable_header.publish.properties.len = 0;
+		// all a v3.1.1 msg has of properties
+		init_pub_packet_property(pub_packet);
 
 #if SUPPORT_MQTT5_0
 		if (PROTOCOL_VERSION_v5 == proto) {
-			len_of_varint = 0;
-			pub_packet->variable_header.publish.properties.len =
-			    get_var_integer(msg_body, &len_of_varint);
-			pos += len_of_varint;
-			debug_msg("property len [%d]",
-			    pub_packet->variable_header.publish.properties
-			        .len);
-			init_pub_packet_property(pub_packet);
+			if (pos >= msg_len ||
+			    (len = pub_props_decode(pub_packet,
+			         msg_body + pos, msg_len - pos)) == 0) {
+				debug_msg("ERROR: broken properties");
+				return PROTOCOL_ERROR;
+			}
+			pos += len;
 			if (pub_packet->variable_header.publish.properties
-			        .len > 0) {
-				for (uint32_t i = 0;
-				     i < pub_packet->variable_header.publish
-				             .properties.len;) {
-					properties_type prop_type =
-					    get_var_integer(msg_body, &pos);
-					// TODO the same property cannot appear
-					// twice
-					switch (prop_type) {
-					case PAYLOAD_FORMAT_INDICATOR:
-						if (pub_packet->variable_header
-						        .publish.properties
-						        .content.publish
-						        .payload_fmt_indicator
-						        .has_value == false) {
-							pub_packet
-							    ->variable_header
-							    .publish.properties
-							    .content.publish
-							    .payload_fmt_indicator
-							    .value =
-							    *(msg_body + pos);
-							pub_packet
-							    ->variable_header
-							    .publish.properties
-							    .content.publish
-							    .payload_fmt_indicator
-							    .has_value = true;
-							++pos;
-							++i;
-						}
-						break;
-
-					case MESSAGE_EXPIRY_INTERVAL:
-						if (pub_packet->variable_header
-						        .publish.properties
-						        .content.publish
-						        .msg_expiry_interval
-						        .has_value == false) {
-							NNI_GET32(
-							    msg_body + pos,
-							    pub_packet
-							        ->variable_header
-							        .publish
-							        .properties
-							        .content
-							        .publish
-							        .msg_expiry_interval
-							        .value);
-							pub_packet
-							    ->variable_header
-							    .publish.properties
-							    .content.publish
-							    .msg_expiry_interval
-							    .has_value = true;
-							pos += 4;
-							i += 4;
-						}
-						break;
-
-					case CONTENT_TYPE:
-						if (pub_packet->variable_header
-						        .publish.properties
-						        .content.publish
-						        .content_type.len ==
-						    0) {
-							pub_packet
-							    ->variable_header
-							    .publish.properties
-							    .content.publish
-							    .content_type
-							    .len = get_utf8_str(
-							    &pub_packet
-							         ->variable_header
-							         .publish
-							         .properties
-							         .content
-							         .publish
-							         .content_type
-							         .body,
-							    msg_body, &pos);
-							i = i +
-							    pub_packet
-							        ->variable_header
-							        .publish
-							        .properties
-							        .content
-							        .publish
-							        .content_type
-							        .len +
-							    2;
-						}
-						break;
-
-					case TOPIC_ALIAS:
-						if (pub_packet->variable_header
-						        .publish.properties
-						        .content.publish
-						        .topic_alias
-						        .has_value == false) {
-							NNI_GET16(
-							    msg_body + pos,
-							    pub_packet
-							        ->variable_header
-							        .publish
-							        .properties
-							        .content
-							        .publish
-							        .topic_alias
-							        .value);
-							pub_packet
-							    ->variable_header
-							    .publish.properties
-							    .content.publish
-							    .topic_alias
-							    .has_value = true;
-							pos += 2;
-							i += 2;
-						}
-						break;
-
-					case RESPONSE_TOPIC:
-						if (pub_packet->variable_header
-						        .publish.properties
-						        .content.publish
-						        .response_topic.len ==
-						    0) {
-							pub_packet
-							    ->variable_header
-							    .publish.properties
-							    .content.publish
-							    .response_topic
-							    .len = get_utf8_str(
-							    &pub_packet
-							         ->variable_header
-							         .publish
-							         .properties
-							         .content
-							         .publish
-							         .response_topic
-							         .body,
-							    msg_body, &pos);
-							i = i +
-							    pub_packet
-							        ->variable_header
-							        .publish
-							        .properties
-							        .content
-							        .publish
-							        .content_type
-							        .len +
-							    2;
-						}
-						break;
-
-					case CORRELATION_DATA:
-						if (pub_packet->variable_header
-						        .publish.properties
-						        .content.publish
-						        .correlation_data
-						        .len == 0) {
-							pub_packet
-							    ->variable_header
-							    .publish.properties
-							    .content.publish
-							    .correlation_data
-							    .len =
-							    get_variable_binary(
-							        &pub_packet
-							             ->variable_header
-							             .publish
-							             .properties
-							             .content
-							             .publish
-							             .correlation_data
-							             .body,
-							        msg_body +
-							            pos);
-							pos +=
-							    pub_packet
-							        ->variable_header
-							        .publish
-							        .properties
-							        .content
-							        .publish
-							        .correlation_data
-							        .len +
-							    2;
-							i +=
-							    pub_packet
-							        ->variable_header
-							        .publish
-							        .properties
-							        .content
-							        .publish
-							        .correlation_data
-							        .len +
-							    2;
-						}
-						break;
-
-					case USER_PROPERTY:
-						if (pub_packet->variable_header
-						        .publish.properties
-						        .content.publish
-						        .user_property
-						        .len_key == 0) {
-							pub_packet
-							    ->variable_header
-							    .publish.properties
-							    .content.publish
-							    .user_property
-							    .len_key = get_utf8_str(
-							    &pub_packet
-							         ->variable_header
-							         .publish
-							         .properties
-							         .content
-							         .publish
-							         .user_property
-							         .key,
-							    msg_body, &pos);
-							i +=
-							    pub_packet
-							        ->variable_header
-							        .publish
-							        .properties
-							        .content
-							        .publish
-							        .user_property
-							        .len_key +
-							    2;
-							pub_packet
-							    ->variable_header
-							    .publish.properties
-							    .content.publish
-							    .user_property
-							    .len_val = get_utf8_str(
-							    &pub_packet
-							         ->variable_header
-							         .publish
-							         .properties
-							         .content
-							         .publish
-							         .user_property
-							         .val,
-							    msg_body, &pos);
-							i +=
-							    pub_packet
-							        ->variable_header
-							        .publish
-							        .properties
-							        .content
-							        .publish
-							        .user_property
-							        .len_val +
-							    2;
-						}
-						break;
-
-					case SUBSCRIPTION_IDENTIFIER:
-						if (pub_packet->variable_header
-						        .publish.properties
-						        .content.publish
-						        .subscription_identifier
-						        .has_value == false) {
-							len_of_varint = 0;
-							pub_packet
-							    ->variable_header
-							    .publish.properties
-							    .content.publish
-							    .subscription_identifier
-							    .value =
-							    get_var_integer(
-							        msg_body,
-							        &len_of_varint);
-							i += len_of_varint;
-							pub_packet
-							    ->variable_header
-							    .publish.properties
-							    .content.publish
-							    .subscription_identifier
-							    .has_value = true;
-							// Protocol error while
-							// Subscription
-							// Identifier = 0
-							if (pub_packet
-							        ->variable_header
-							        .publish
-							        .properties
-							        .content
-							        .publish
-							        .subscription_identifier
-							        .value == 0) {
-								return false;
-							}
-						}
-						break;
-
-					default:
-						i++;
-						break;
-					}
-				}
+			        .content.publish.topic_alias.has_value &&
+			    pub_alias_resolve(work) != SUCCESS) {
+				return PROTOCOL_ERROR;
 			}
-			used_pos += pub_packet->variable_header.publish
-			                .properties.len +
-			    1;
-		}
-		/* check */
-		else {
-			debug_msg("NOMQTT5ERR [%d] [%d]", proto,
-			    PROTOCOL_VERSION_v5);
 		}
 #endif
 
-		debug_msg("used pos: [%d]", used_pos);
+		debug_msg("used pos: [%d]", pos);
 		// payload
 		pub_packet->payload_body.payload_len =
-		    (uint32_t)(msg_len - (size_t) used_pos);
+		    (uint32_t)(msg_len - (size_t) pos);
 
 		if (pub_packet->payload_body.payload_len > 0) {
-			pub_packet->payload_body.payload = nng_alloc(
-			    pub_packet->payload_body.payload_len + 1);
-			memset(pub_packet->payload_body.payload, 0,
-			    pub_packet->payload_body.payload_len + 1);
-			memcpy(pub_packet->payload_body.payload,
-			    (uint8_t *) (msg_body + pos),
-			    pub_packet->payload_body.payload_len);
-			debug_msg("payload: [%s], len = %u",
+			pub_packet->payload_body.payload =
+			    (uint8_t *) (msg_body + pos);
+			debug_msg("payload: [%.*s], len = %u",
+			    (int) pub_packet->payload_body.payload_len,
 			    pub_packet->payload_body.payload,
 			    pub_packet->payload_body.payload_len);
 		}
@@ -1181,22 +1399,10 @@ print_hex(const char *prefix, const unsigned char *src, int src_len)
 void
 init_pub_packet_property(struct pub_packet_struct *pub_packet)
 {
+	pub_packet->variable_header.publish.properties.len = 0;
 	pub_packet->variable_header.publish.properties.content.publish
-	    .payload_fmt_indicator.has_value = false;
-	pub_packet->variable_header.publish.properties.content.publish
-	    .msg_expiry_interval.has_value = false;
-	pub_packet->variable_header.publish.properties.content.publish
-	    .response_topic.len = 0;
-	pub_packet->variable_header.publish.properties.content.publish
-	    .topic_alias.has_value = 0;
-	pub_packet->variable_header.publish.properties.content.publish
-	    .content_type.len = 0;
-	pub_packet->variable_header.publish.properties.content.publish
-	    .correlation_data.len = 0;
-	pub_packet->variable_header.publish.properties.content.publish
-	    .user_property.len_key = 0;
-	pub_packet->variable_header.publish.properties.content.publish
-	    .user_property.len_val = 0;
-	pub_packet->variable_header.publish.properties.content.publish
-	    .subscription_identifier.has_value = false;
+	    .topic_alias.has_value                        = false;
+	pub_packet->variable_header.publish.props     = NULL;
+	pub_packet->variable_header.publish.props_len = 0;
+	pub_packet->variable_header.publish.alias_at  = 0;
 }
@@ -0,0 +1,263 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include <conf.h>
+#include <nanolib.h>
+#include <zmalloc.h>
+
+#include "include/nanomq.h"
+#include "include/rate_limit.h"
+
+/*
+ * Token buckets on what clients publish, checked as a PUBLISH is received
+ * and before it is decoded. A bucket is kept as the theoretical arrival
+ * time of GCRA, the time up to which its tokens are spent, in one word a
+ * CAS moves forward, so a check takes no lock. A bucket holds one second
+ * of its rate, a client idle for a second may send that much at once. A
+ * PUBLISH is charged to all its buckets or to none, those it was taken
+ * from are given back once one is over.
+ *
+ * A pipe has a bucket of PUBLISH and one of bytes for the client limits
+ * and for each topic rule, a rule counts the PUBLISH whose topic starts
+ * with its prefix. They are in a slot of a table indexed by pipe id which
+ * a pipe resets on CONNACK, two pipes on one slot share their buckets.
+ * A PUBLISH sent with a topic alias and no topic only counts for the
+ * client limits.
+ */
+#define RATE_LIMIT_SLOTS 16384
+#define RATE_LIMIT_RULES 8
+#define RATE_LIMIT_BURST_NS 1000000000ull
+
+typedef struct {
+	const char *prefix; // NULL for the client limits
+	size_t      prefix_len;
+	uint64_t    msg_ns; // a PUBLISH costs, 0 unbounded
+	uint64_t    bytes;  // per second, 0 unbounded
+} rate_rule;
+
+static bool              enabled = false;
+static int               policy  = RATE_LIMIT_DROP;
+static rate_rule         rules[1 + RATE_LIMIT_RULES];
+static size_t            rule_cnt = 0;
+static uint64_t *        slots    = NULL; // 2 buckets of each rule a slot
+static int               pause_max = 0;
+static int               paused    = 0;
+static rate_limit_totals totals;
+
+static bool
+rule_set(rate_rule *rule, const char *prefix, int msgs, long bytes)
+{
+	rule->prefix     = prefix;
+	rule->prefix_len = prefix ? strlen(prefix) : 0;
+	rule->msg_ns     = msgs > 0 ? RATE_LIMIT_BURST_NS / msgs : 0;
+	rule->bytes      = bytes > 0 ? (uint64_t) bytes : 0;
+	return rule->msg_ns != 0 || rule->bytes != 0;
+}
+
+/**
+ * @brief rate_limit_init - Set the limits, call it before any pipe opens.
+ * @param config - conf_rate_limit, its rules are referred to
+ * @param works - works of the broker, half of them may pause at once
+ * @return void
+ */
+void
+rate_limit_init(conf_rate_limit *config, int works)
+{
+	size_t size;
+
+	// the client limits are rules[0] even if they are unbounded
+	rule_set(&rules[0], NULL, config->msgs, config->bytes);
+	rule_cnt = 1;
+	for (size_t i = 0; i < config->rules_count; i++) {
+		conf_rate_rule *r = &config->rules[i];
+
+		if (rule_cnt == 1 + RATE_LIMIT_RULES) {
+			log_warn("rate_limit.topics beyond %d rules are "
+			         "ignored",
+			    RATE_LIMIT_RULES);
+			break;
+		}
+		if (rule_set(
+		        &rules[rule_cnt], r->prefix, r->msgs, r->bytes)) {
+			rule_cnt++;
+		}
+	}
+
+	enabled =
+	    rules[0].msg_ns != 0 || rules[0].bytes != 0 || rule_cnt > 1;
+	if (!enabled) {
+		return;
+	}
+	size      = sizeof(uint64_t) * 2 * rule_cnt * RATE_LIMIT_SLOTS;
+	policy    = config->policy;
+	pause_max = works / 2 > 0 ? works / 2 : 1;
+	slots     = zmalloc(size);
+	memset(slots, 0, size);
+}
+
+bool
+rate_limit_enabled(void)
+{
+	return enabled;
+}
+
+int
+rate_limit_get_policy(void)
+{
+	return policy;
+}
+
+static inline uint64_t *
+slot_of(uint32_t pipe_id)
+{
+	return &slots[(size_t) (pipe_id % RATE_LIMIT_SLOTS) * 2 * rule_cnt];
+}
+
+// a new pipe starts with full buckets
+void
+rate_limit_open(uint32_t pipe_id)
+{
+	uint64_t *slot;
+
+	if (!enabled) {
+		return;
+	}
+	slot = slot_of(pipe_id);
+	for (size_t i = 0; i < 2 * rule_cnt; i++) {
+		__atomic_store_n(&slot[i], 0, __ATOMIC_RELAXED);
+	}
+}
+
+// ns a bucket is past its burst with cost more, the cost is taken if that
+// is 0 or with force
+static uint64_t
+bucket_take(uint64_t *tat, uint64_t now, uint64_t cost, bool force)
+{
+	uint64_t old = __atomic_load_n(tat, __ATOMIC_RELAXED);
+	uint64_t next;
+	uint64_t over;
+
+	do {
+		next = (old > now ? old : now) + cost;
+		over = old > now && next - now > RATE_LIMIT_BURST_NS
+		    ? next - now - RATE_LIMIT_BURST_NS
+		    : 0;
+		if (over != 0 && !force) {
+			return over;
+		}
+	} while (!__atomic_compare_exchange_n(
+	    tat, &old, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return over;
+}
+
+/**
+ * @brief rate_limit_take - Charge a PUBLISH to the buckets of its pipe,
+ * to none of them if it is over a limit.
+ * @param pipe_id - pipe it came from
+ * @param msg - PUBLISH as received
+ * @param now - monotonic ns
+ * @param force - charge it even over a limit
+ * @return 0 if it is within the limits, else ns until it would be
+ */
+uint64_t
+rate_limit_take(uint32_t pipe_id, nng_msg *msg, uint64_t now, bool force)
+{
+	uint64_t *     slot  = slot_of(pipe_id);
+	uint64_t       len   = nng_msg_header_len(msg) + nng_msg_len(msg);
+	const uint8_t *body  = nng_msg_body(msg);
+	size_t         tlen  = 0;
+	uint64_t       worst = 0;
+	uint64_t       over;
+	uint64_t       cost[2 * (1 + RATE_LIMIT_RULES)];
+	size_t         taken = 0;
+
+	if (nng_msg_len(msg) >= 2) {
+		tlen = (size_t) body[0] << 8 | body[1];
+		tlen = tlen + 2 <= nng_msg_len(msg) ? tlen : 0;
+	}
+	for (size_t i = 0; i < rule_cnt; i++) {
+		rate_rule *r = &rules[i];
+
+		if (r->prefix != NULL &&
+		    (tlen < r->prefix_len ||
+		        memcmp(body + 2, r->prefix, r->prefix_len) != 0)) {
+			continue;
+		}
+		cost[2 * i]     = r->msg_ns;
+		cost[2 * i + 1] = r->bytes != 0
+		    ? len * RATE_LIMIT_BURST_NS / r->bytes
+		    : 0;
+		for (size_t b = 2 * i; b < 2 * i + 2; b++) {
+			if (cost[b] == 0) {
+				continue;
+			}
+			over  = bucket_take(&slot[b], now, cost[b], force);
+			worst = over > worst ? over : worst;
+			if (worst != 0 && !force) {
+				goto back;
+			}
+			taken |= (size_t) 1 << b;
+		}
+	}
+	return worst;
+
+back:
+	// give back what the buckets before the one over took
+	for (size_t b = 0; b < 2 * rule_cnt; b++) {
+		if ((taken & ((size_t) 1 << b)) != 0) {
+			__atomic_sub_fetch(&slot[b], cost[b], __ATOMIC_RELAXED);
+		}
+	}
+	return worst;
+}
+
+/**
+ * @brief rate_limit_pause_begin - Ask for a work to hold a PUBLISH back,
+ * at most half of the works may be at once so that the others go on
+ * with the pipes within their limits.
+ * @return true if the work may, it calls rate_limit_pause_end once done
+ */
+bool
+rate_limit_pause_begin(void)
+{
+	if (__atomic_add_fetch(&paused, 1, __ATOMIC_RELAXED) > pause_max) {
+		__atomic_sub_fetch(&paused, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	__atomic_add_fetch(&totals.paused, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+void
+rate_limit_pause_end(void)
+{
+	__atomic_sub_fetch(&paused, 1, __ATOMIC_RELAXED);
+}
+
+// a PUBLISH over a limit is dropped, and its pipe closed by DISCONNECT
+void
+rate_limit_reject(int how)
+{
+	__atomic_add_fetch(&totals.dropped, 1, __ATOMIC_RELAXED);
+	if (how == RATE_LIMIT_DISCONNECT) {
+		__atomic_add_fetch(&totals.disconnected, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void
+rate_limit_get_totals(rate_limit_totals *st)
+{
+	st->dropped = __atomic_load_n(&totals.dropped, __ATOMIC_RELAXED);
+	st->disconnected =
+	    __atomic_load_n(&totals.disconnected, __ATOMIC_RELAXED);
+	st->paused = __atomic_load_n(&totals.paused, __ATOMIC_RELAXED);
+}
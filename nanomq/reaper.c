@@ -0,0 +1,297 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <pthread.h>
+#include <time.h>
+
+#include <conf.h>
+#include <mqtt_db.h>
+#include <nng/nng.h>
+#include <nng/supplemental/util/platform.h>
+#include <zmalloc.h>
+
+#include "include/nanomq.h"
+#include "include/pub_handler.h"
+#include "include/reaper.h"
+#include "include/sub_handler.h"
+
+/*
+ * Background reaper of offline sessions. A session cached on disconnect
+ * gets a deadline session_expiry_interval later, it is freed with its
+ * subscriptions and queued messages once the deadline passes and the
+ * client did not come back. Sessions are hashed to buckets for the
+ * reconnect and kept in a list sorted by deadline for the reaper, both
+ * under one lock which also serializes an expiry with a restore.
+ *
+ * Each pass also enforces session_msg_max_age and session_memory_limit
+ * on a few shards of the session store, so a pass never holds a lock of
+ * the store for long. MQTT 5 messages past their Message Expiry Interval
+ * are dropped from the session store and swept from the retain store by
+ * the same passes, those delivered before are caught on the way out.
+ */
+#define REAPER_BUCKETS 4096
+#define REAPER_INTERVAL 1000 // ms between passes
+#define REAPER_BATCH 256     // sessions expired per pass at most
+#define REAPER_SHARDS 16     // session store shards scanned per pass
+#define REAPER_RETAIN 4096   // retain store buckets swept per pass
+
+typedef struct reaper_session reaper_session;
+
+struct reaper_session {
+	uint32_t        session_id;
+	nng_time        deadline;
+	reaper_session *next;    // in bucket
+	reaper_session *dl_prev; // in deadline list
+	reaper_session *dl_next;
+};
+
+static pthread_mutex_t mtx  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       thread;
+static bool            running = false;
+static nng_duration    expiry  = 0;
+static dbtree *        r_db    = NULL;
+static nano_retain *   r_ret   = NULL;
+static reaper_session *buckets[REAPER_BUCKETS];
+static reaper_session *dl_head = NULL;
+static reaper_session *dl_tail = NULL;
+
+static inline reaper_session **
+bucket_of(uint32_t session_id)
+{
+	return &buckets[(session_id * 2654435761u) % REAPER_BUCKETS];
+}
+
+// unlink s from its bucket and the deadline list, lock held
+static void
+session_unlink(reaper_session *s)
+{
+	reaper_session **pp = bucket_of(s->session_id);
+
+	while (*pp != s) {
+		pp = &(*pp)->next;
+	}
+	*pp = s->next;
+
+	if (s->dl_prev) {
+		s->dl_prev->dl_next = s->dl_next;
+	} else {
+		dl_head = s->dl_next;
+	}
+	if (s->dl_next) {
+		s->dl_next->dl_prev = s->dl_prev;
+	} else {
+		dl_tail = s->dl_prev;
+	}
+}
+
+// sorted insert from the tail, where a new deadline usually goes
+static void
+session_link(reaper_session *s)
+{
+	reaper_session **pp = bucket_of(s->session_id);
+	reaper_session * at = dl_tail;
+
+	s->next = *pp;
+	*pp     = s;
+
+	while (at != NULL && at->deadline > s->deadline) {
+		at = at->dl_prev;
+	}
+	s->dl_prev = at;
+	s->dl_next = at ? at->dl_next : dl_head;
+	if (s->dl_next) {
+		s->dl_next->dl_prev = s;
+	} else {
+		dl_tail = s;
+	}
+	if (at) {
+		at->dl_next = s;
+	} else {
+		dl_head = s;
+	}
+}
+
+static reaper_session *
+session_find(uint32_t session_id)
+{
+	reaper_session *s = *bucket_of(session_id);
+
+	while (s != NULL && s->session_id != session_id) {
+		s = s->next;
+	}
+	return s;
+}
+
+/**
+ * @brief reaper_session_offline - Start the expiry of a session cached on
+ * disconnect, a session cached again gets a new deadline.
+ * @param session_id - client id hash value
+ * @return void
+ */
+void
+reaper_session_offline(uint32_t session_id)
+{
+	reaper_session *s = NULL;
+
+	if (expiry == 0) {
+		return;
+	}
+	pthread_mutex_lock(&mtx);
+	if ((s = session_find(session_id)) != NULL) {
+		session_unlink(s);
+	} else {
+		s             = zmalloc(sizeof(reaper_session));
+		s->session_id = session_id;
+	}
+	s->deadline = nng_clock() + expiry;
+	session_link(s);
+	pthread_mutex_unlock(&mtx);
+}
+
+/**
+ * @brief reaper_session_online - Stop the expiry of a session which is
+ * restored. Once it returns the session is either restorable or gone.
+ * @param session_id - client id hash value
+ * @return true if the session was waiting for its expiry
+ */
+bool
+reaper_session_online(uint32_t session_id)
+{
+	reaper_session *s = NULL;
+
+	if (expiry == 0) {
+		return false;
+	}
+	pthread_mutex_lock(&mtx);
+	if ((s = session_find(session_id)) != NULL) {
+		session_unlink(s);
+		zfree(s);
+	}
+	pthread_mutex_unlock(&mtx);
+
+	return s != NULL;
+}
+
+// free the sessions past their deadline, at most REAPER_BATCH of them
+static void
+reaper_expire(nng_time now)
+{
+	reaper_session *s = NULL;
+	int             n = 0;
+
+	pthread_mutex_lock(&mtx);
+	while ((s = dl_head) != NULL && s->deadline <= now &&
+	    n++ < REAPER_BATCH) {
+		session_unlink(s);
+		debug_msg("session %u expired", s->session_id);
+		expire_session(s->session_id, r_db);
+		zfree(s);
+	}
+	pthread_mutex_unlock(&mtx);
+}
+
+static void *
+reaper_run(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&mtx);
+	while (running) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += REAPER_INTERVAL / 1000;
+		pthread_cond_timedwait(&cond, &mtx, &ts);
+		if (!running) {
+			break;
+		}
+		pthread_mutex_unlock(&mtx);
+		reaper_expire(nng_clock());
+		dbtree_reap_session_msg(r_db, nng_clock(), REAPER_SHARDS);
+		if (r_ret != NULL) {
+			nano_retain_expire(r_ret, nng_clock(), REAPER_RETAIN);
+		}
+		pthread_mutex_lock(&mtx);
+	}
+	pthread_mutex_unlock(&mtx);
+
+	return NULL;
+}
+
+static size_t
+session_msg_size(void *msg)
+{
+	nng_msg *m = msg;
+
+	return nng_msg_header_len(m) + nng_msg_len(m);
+}
+
+static uint64_t
+session_msg_time(void *msg)
+{
+	return nng_msg_get_timestamp((nng_msg *) msg);
+}
+
+// asked as msg is queued, its publisher is still connected then
+static uint64_t
+session_msg_expire(void *msg)
+{
+	conn_param *cparam = nng_msg_get_conn_param((nng_msg *) msg);
+
+	if (cparam == NULL ||
+	    conn_param_get_protover(cparam) != PROTOCOL_VERSION_v5) {
+		return 0;
+	}
+	return pub_msg_expire_at((nng_msg *) msg);
+}
+
+/**
+ * @brief reaper_start - Set the limits of offline sessions and start the
+ * reaper. Called before the dbtree is shared.
+ * @param config - conf
+ * @param db - dbtree of subscriptions and sessions
+ * @param retain - retain store swept of expired messages, may be NULL
+ * @return void
+ */
+void
+reaper_start(conf *config, dbtree *db, nano_retain *retain)
+{
+	dbtree_session_reap reap = {
+		.mem_limit  = config->session_mem_limit,
+		.max_age    = (uint64_t) config->session_msg_max_age * 1000,
+		.msg_size   = session_msg_size,
+		.msg_time   = session_msg_time,
+		.msg_expire = session_msg_expire,
+	};
+
+	r_db   = db;
+	r_ret  = retain;
+	expiry = (nng_duration) config->session_expiry * 1000;
+	// sizes are counted even without a limit, for the stats
+	dbtree_set_session_reap(db, &reap);
+	// a Message Expiry Interval always needs the passes
+	running = true;
+	if (pthread_create(&thread, NULL, reaper_run, NULL) != 0) {
+		debug_msg("reaper thread can not be created");
+		running = false;
+	}
+}
+
+void
+reaper_stop(void)
+{
+	pthread_mutex_lock(&mtx);
+	if (!running) {
+		pthread_mutex_unlock(&mtx);
+		return;
+	}
+	running = false;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mtx);
+	pthread_join(thread, NULL);
+}
@@ -12,9 +12,19 @@
 // #include "utils/log.h"
 #include "include/broker.h"
 #include "include/nanomq.h"
+#include "include/metrics.h"
+#include "include/pipe_queue.h"
+#include "include/rate_limit.h"
+#include "include/rest_json.h"
+#include "include/sys_event.h"
 #include "libs/cJSON.h"
 
 #include <nng/supplemental/http/http.h>
+#include <zmalloc.h>
+
+// entries of a listing returned by one request
+#define REST_PAGE_LIMIT 1000
+#define REST_PAGE_LIMIT_MAX 10000
 
 static http_msg error_response(
     http_msg *msg, uint16_t status, enum result_code code, uint64_t sequence);
@@ -232,55 +242,198 @@ get_endpoints(cJSON *data, http_msg *msg, uint64_t sequence)
 	return res;
 }
 
-static http_msg
-get_broker(cJSON *data, http_msg *msg, uint64_t sequence)
+static cJSON *
+match_cache_stats_json(dbtree *db)
 {
-	http_msg res = { 0 };
-	res.status   = NNG_HTTP_STATUS_OK;
-	res.data     = strdup(__FUNCTION__);
-	res.data_len = strlen(__FUNCTION__);
-	// TODO not impelement yet
-	return res;
+	dbtree_match_cache_stats st;
+	cJSON *                  obj = cJSON_CreateObject();
+
+	dbtree_get_match_cache_stats(db, &st);
+	cJSON_AddNumberToObject(obj, "hit", st.hit);
+	cJSON_AddNumberToObject(obj, "miss", st.miss);
+	cJSON_AddNumberToObject(obj, "size", st.size);
+	cJSON_AddNumberToObject(obj, "capacity", st.capacity);
+	return obj;
 }
 
-static http_msg
-get_subscriptions(cJSON *data, http_msg *msg, uint64_t sequence)
+static cJSON *
+session_queue_stats_json(dbtree *db)
 {
-	http_msg res = { 0 };
-	res.status   = NNG_HTTP_STATUS_OK;
+	dbtree_session_queue_stats st;
+	cJSON *                    obj = cJSON_CreateObject();
+
+	dbtree_get_session_queue_stats(db, &st);
+	cJSON_AddNumberToObject(obj, "sessions", st.sessions);
+	cJSON_AddNumberToObject(obj, "dropped", st.dropped);
+	cJSON_AddNumberToObject(obj, "rejected", st.rejected);
+	cJSON_AddNumberToObject(obj, "expired", st.expired);
+	cJSON_AddNumberToObject(obj, "memory", st.memory);
+	return obj;
+}
 
-	cJSON *res_obj;
-	cJSON *topics = cJSON_CreateArray();
-	res_obj       = cJSON_CreateObject();
-	cJSON_AddNumberToObject(res_obj, "code", SUCCEED);
-	cJSON_AddNumberToObject(res_obj, "seq", (uint64_t) sequence);
-	cJSON_AddNumberToObject(res_obj, "rep", msg->request);
-	cJSON_AddItemToObject(res_obj, "subscriptions", topics);
+static cJSON *
+sub_queue_stats_json(void)
+{
+	pipe_queue_totals st;
+	cJSON *           obj = cJSON_CreateObject();
+
+	pipe_queue_get_totals(&st);
+	cJSON_AddNumberToObject(obj, "queued", st.queued);
+	cJSON_AddNumberToObject(obj, "dropped", st.dropped);
+	cJSON_AddNumberToObject(obj, "disconnected", st.disconnected);
+	return obj;
+}
 
-	size_t        sz = 0;
-	topic_queue **tq = get_all_topic_queue(&sz);
+static cJSON *
+sys_event_stats_json(void)
+{
+	sys_event_totals st;
+	cJSON *          obj = cJSON_CreateObject();
+
+	sys_event_get_totals(&st);
+	cJSON_AddNumberToObject(obj, "queued", st.queued);
+	cJSON_AddNumberToObject(obj, "dropped", st.dropped);
+	cJSON_AddNumberToObject(obj, "published", st.published);
+	return obj;
+}
+
+static cJSON *
+rate_limit_stats_json(void)
+{
+	rate_limit_totals st;
+	cJSON *           obj = cJSON_CreateObject();
+
+	rate_limit_get_totals(&st);
+	cJSON_AddNumberToObject(obj, "dropped", st.dropped);
+	cJSON_AddNumberToObject(obj, "disconnected", st.disconnected);
+	cJSON_AddNumberToObject(obj, "paused", st.paused);
+	return obj;
+}
+
+static cJSON *
+log_stats_json(void)
+{
+	nano_log_stats st;
+	cJSON *        obj = cJSON_CreateObject();
+
+	nano_log_get_stats(&st);
+	cJSON_AddStringToObject(
+	    obj, "level", nano_log_level_str(nano_log_get_level()));
+	cJSON_AddNumberToObject(obj, "written", st.written);
+	cJSON_AddNumberToObject(obj, "dropped", st.dropped);
+	return obj;
+}
 
-	for (size_t i = 0; i < sz; i++) {
-		topic_queue *queue = tq[i];
-		debug_msg("topic %s", queue->topic);
-		cJSON *topic = cJSON_CreateObject();
-		cJSON_AddStringToObject(topic, "topic", queue->topic);
-		cJSON_AddItemToArray(topics, topic);
+// "cursor" of a listing request, and "limit" clamped to a page
+static void
+page_params(cJSON *data, uint64_t *cursor, size_t *limit)
+{
+	cJSON *item = cJSON_GetObjectItem(data, "cursor");
+	double n;
+
+	*cursor = cJSON_IsNumber(item) ? (uint64_t) item->valuedouble : 0;
+	item    = cJSON_GetObjectItem(data, "limit");
+	n       = cJSON_IsNumber(item) ? item->valuedouble : REST_PAGE_LIMIT;
+	if (n < 1) {
+		n = 1;
+	} else if (n > REST_PAGE_LIMIT_MAX) {
+		n = REST_PAGE_LIMIT_MAX;
 	}
+	*limit = (size_t) n;
+}
 
-	char *dest = cJSON_PrintUnformatted(res_obj);
+static void
+subscription_json(uint32_t pipe_id, const char *topic, void *arg)
+{
+	rest_json *w = arg;
 
-	put_http_msg(
-	    &res, msg->content_type, NULL, NULL, NULL, dest, strlen(dest));
+	rest_json_obj_begin(w, NULL);
+	rest_json_uint(w, "pipe", pipe_id);
+	rest_json_str(w, "topic", topic);
+	rest_json_obj_end(w);
+}
 
-	free(tq);
-	cJSON_free(dest);
-	cJSON_Delete(res_obj);
+typedef struct {
+	uint32_t pipe_id;
+	char *   client_id;
+} client_entry;
+
+typedef struct {
+	client_entry *entries;
+	size_t        cnt;
+	size_t        cap;
+} client_page;
+
+// noted while the stripe of the pipe table is locked, written after
+static void
+client_note(uint32_t pipe_id, const char *client_id, void *arg)
+{
+	client_page * page = arg;
+	client_entry *e;
+
+	// a scan may pass its limit by a bucket
+	if (page->cnt == page->cap) {
+		page->cap     = page->cap ? page->cap * 2 : REST_PAGE_LIMIT;
+		page->entries = zrealloc(
+		    page->entries, page->cap * sizeof(client_entry));
+	}
+	e            = &page->entries[page->cnt++];
+	e->pipe_id   = pipe_id;
+	e->client_id = zstrdup(client_id ? client_id : "");
+}
+
+// a client and what the broker holds for it
+static void
+client_json(rest_json *w, client_entry *e)
+{
+	pipe_queue_stat stat;
+
+	pipe_queue_get_stat(e->pipe_id, &stat);
+	rest_json_obj_begin(w, NULL);
+	rest_json_uint(w, "pipe", e->pipe_id);
+	rest_json_str(w, "client_id", e->client_id);
+	rest_json_uint(w, "depth", stat.depth);
+	rest_json_uint(w, "inflight", stat.inflight);
+	rest_json_uint(w, "dropped", stat.dropped);
+	rest_json_obj_end(w);
+}
+
+// opens the object of a listing reply
+static void
+listing_begin(rest_json *w, http_msg *msg, uint64_t sequence)
+{
+	rest_json_init(w);
+	rest_json_obj_begin(w, NULL);
+	rest_json_uint(w, "code", SUCCEED);
+	rest_json_uint(w, "seq", sequence);
+	rest_json_uint(w, "rep", msg->request);
+}
+
+// closes the object and hands its text over to the reply
+static http_msg
+listing_end(rest_json *w, http_msg *msg, uint64_t cursor, uint64_t sequence)
+{
+	http_msg res = { 0 };
+	size_t   len;
+	char *   dest;
+
+	rest_json_uint(w, "cursor", cursor);
+	rest_json_obj_end(w);
+	if ((dest = rest_json_take(w, &len)) == NULL) {
+		return error_response(msg,
+		    NNG_HTTP_STATUS_INTERNAL_SERVER_ERROR, UNKNOWN_MISTAKE,
+		    sequence);
+	}
+
+	res.status = NNG_HTTP_STATUS_OK;
+	put_http_msg(&res, msg->content_type, NULL, NULL, NULL, NULL, 0);
+	res.data     = dest;
+	res.data_len = len;
 	return res;
 }
 
 static http_msg
-get_clients(cJSON *data, http_msg *msg, uint64_t sequence)
+get_broker(cJSON *data, http_msg *msg, uint64_t sequence)
 {
 	http_msg res = { 0 };
 	res.status   = NNG_HTTP_STATUS_OK;
@@ -291,6 +444,20 @@ get_clients(cJSON *data, http_msg *msg, uint64_t sequence)
 	cJSON_AddNumberToObject(res_obj, "code", SUCCEED);
 	cJSON_AddNumberToObject(res_obj, "seq", (uint64_t) sequence);
 	cJSON_AddNumberToObject(res_obj, "rep", msg->request);
+
+	dbtree *db = get_broker_db();
+	if (db) {
+		cJSON_AddItemToObject(
+		    res_obj, "match_cache", match_cache_stats_json(db));
+		cJSON_AddItemToObject(
+		    res_obj, "session_queue", session_queue_stats_json(db));
+	}
+	cJSON_AddItemToObject(res_obj, "sub_queue", sub_queue_stats_json());
+	cJSON_AddItemToObject(res_obj, "sys_event", sys_event_stats_json());
+	cJSON_AddItemToObject(res_obj, "rate_limit", rate_limit_stats_json());
+	cJSON_AddItemToObject(res_obj, "metrics", metrics_json());
+	cJSON_AddItemToObject(res_obj, "log", log_stats_json());
+
 	char *dest = cJSON_PrintUnformatted(res_obj);
 	cJSON_Delete(res_obj);
 
@@ -298,12 +465,46 @@ get_clients(cJSON *data, http_msg *msg, uint64_t sequence)
 	    &res, msg->content_type, NULL, NULL, NULL, dest, strlen(dest));
 
 	cJSON_free(dest);
+	return res;
+}
+
+static http_msg
+get_subscriptions(cJSON *data, http_msg *msg, uint64_t sequence)
+{
+	rest_json w;
+	uint64_t  cursor;
+	size_t    limit;
 
-	// db_tree *db = get_broker_db();
+	page_params(data, &cursor, &limit);
+	listing_begin(&w, msg, sequence);
+	rest_json_arr_begin(&w, "subscriptions");
+	cursor = scan_topic(cursor, limit, subscription_json, &w);
+	rest_json_arr_end(&w);
 
-	// print_db_tree(db);
+	return listing_end(&w, msg, cursor, sequence);
+}
 
-	return res;
+static http_msg
+get_clients(cJSON *data, http_msg *msg, uint64_t sequence)
+{
+	rest_json   w;
+	client_page page = { 0 };
+	uint64_t    cursor;
+	size_t      limit;
+
+	page_params(data, &cursor, &limit);
+	cursor = scan_pipe_id(cursor, limit, client_note, &page);
+
+	listing_begin(&w, msg, sequence);
+	rest_json_arr_begin(&w, "clients");
+	for (size_t i = 0; i < page.cnt; i++) {
+		client_json(&w, &page.entries[i]);
+		zfree(page.entries[i].client_id);
+	}
+	rest_json_arr_end(&w);
+	zfree(page.entries);
+
+	return listing_end(&w, msg, cursor, sequence);
 }
 
 static http_msg
@@ -325,6 +526,17 @@ post_ctrl(cJSON *data, http_msg *msg, uint64_t sequence)
 		broker_stop(0, NULL);
 	} else if (strcasecmp(value, "restart") == 0) {
 		// TODO not support yet
+	} else if (strcasecmp(value, "log_level") == 0) {
+		// { "req": 10, "action": "log_level", "level": "debug" }
+		char *name =
+		    cJSON_GetStringValue(cJSON_GetObjectItem(data, "level"));
+		int level = name != NULL ? nano_log_level(name) : -1;
+		if (level == -1) {
+			free(res.data);
+			return error_response(msg, NNG_HTTP_STATUS_BAD_REQUEST,
+			    REQ_PARAM_ERROR, sequence);
+		}
+		nano_log_set_level(level);
 	}
 
 	return res;
@@ -0,0 +1,227 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <nng/nng.h>
+#include <zmalloc.h>
+
+#include "include/rest_json.h"
+
+/*
+ * A response is written while the broker state is walked, a chunk of
+ * REST_JSON_CHUNK bytes is added once the last one is full, so what a
+ * listing costs is its text and no more, and a chunk never moves once
+ * written. rest_json_take gathers the chunks into the one buffer the HTTP
+ * response is sent from, freeing each as it is copied.
+ */
+
+struct rest_json_chunk {
+	rest_json_chunk *next;
+	size_t           len;
+	char             data[REST_JSON_CHUNK];
+};
+
+void
+rest_json_init(rest_json *w)
+{
+	memset(w, 0, sizeof(*w));
+}
+
+void
+rest_json_fini(rest_json *w)
+{
+	rest_json_chunk *c = w->head;
+
+	while (c != NULL) {
+		rest_json_chunk *next = c->next;
+		zfree(c);
+		c = next;
+	}
+	rest_json_init(w);
+}
+
+static void
+put(rest_json *w, const char *s, size_t len)
+{
+	while (len > 0) {
+		rest_json_chunk *c = w->tail;
+		size_t           n;
+
+		if (c == NULL || c->len == REST_JSON_CHUNK) {
+			c       = zmalloc(sizeof(*c));
+			c->next = NULL;
+			c->len  = 0;
+			if (w->tail != NULL) {
+				w->tail->next = c;
+			} else {
+				w->head = c;
+			}
+			w->tail = c;
+		}
+		n = REST_JSON_CHUNK - c->len;
+		n = n < len ? n : len;
+		memcpy(c->data + c->len, s, n);
+		c->len += n;
+		w->len += n;
+		s += n;
+		len -= n;
+	}
+}
+
+// s as a JSON string, with quotes, backslashes and control bytes escaped
+static void
+put_str(rest_json *w, const char *s)
+{
+	const char *run = s;
+	char        esc[8];
+
+	for (; *s != '\0'; s++) {
+		unsigned char c = (unsigned char) *s;
+
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			continue;
+		}
+		put(w, run, s - run);
+		run = s + 1;
+		switch (c) {
+		case '"':
+		case '\\':
+			esc[0] = '\\';
+			esc[1] = c;
+			put(w, esc, 2);
+			break;
+		case '\n':
+			put(w, "\\n", 2);
+			break;
+		case '\r':
+			put(w, "\\r", 2);
+			break;
+		case '\t':
+			put(w, "\\t", 2);
+			break;
+		default:
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			put(w, esc, 6);
+			break;
+		}
+	}
+	put(w, run, s - run);
+}
+
+// the comma before a value and its key
+static void
+put_key(rest_json *w, const char *key)
+{
+	uint32_t bit = 1u << w->depth;
+
+	if (w->used & bit) {
+		put(w, ",", 1);
+	}
+	w->used |= bit;
+	if (key != NULL) {
+		put(w, "\"", 1);
+		put_str(w, key);
+		put(w, "\":", 2);
+	}
+}
+
+static void
+nest_open(rest_json *w, const char *key, const char *brace)
+{
+	put_key(w, key);
+	put(w, brace, 1);
+	if (w->depth + 1 < REST_JSON_DEPTH) {
+		w->depth++;
+		w->used &= ~(1u << w->depth);
+	}
+}
+
+static void
+nest_close(rest_json *w, const char *brace)
+{
+	if (w->depth > 0) {
+		w->depth--;
+	}
+	put(w, brace, 1);
+}
+
+void
+rest_json_obj_begin(rest_json *w, const char *key)
+{
+	nest_open(w, key, "{");
+}
+
+void
+rest_json_obj_end(rest_json *w)
+{
+	nest_close(w, "}");
+}
+
+void
+rest_json_arr_begin(rest_json *w, const char *key)
+{
+	nest_open(w, key, "[");
+}
+
+void
+rest_json_arr_end(rest_json *w)
+{
+	nest_close(w, "]");
+}
+
+void
+rest_json_str(rest_json *w, const char *key, const char *s)
+{
+	put_key(w, key);
+	put(w, "\"", 1);
+	put_str(w, s != NULL ? s : "");
+	put(w, "\"", 1);
+}
+
+void
+rest_json_uint(rest_json *w, const char *key, uint64_t n)
+{
+	char num[24];
+	int  len = snprintf(num, sizeof(num), "%" PRIu64, n);
+
+	put_key(w, key);
+	put(w, num, len);
+}
+
+/**
+ * @brief rest_json_take - Gather what was written into one buffer.
+ * @param w - writer, left empty
+ * @param len - set to the length of the document
+ * @return buffer from nng_alloc of len bytes, NULL if it fails
+ */
+char *
+rest_json_take(rest_json *w, size_t *len)
+{
+	rest_json_chunk *c   = w->head;
+	char *           buf = nng_alloc(w->len);
+	size_t           pos = 0;
+
+	if (buf == NULL) {
+		rest_json_fini(w);
+		return NULL;
+	}
+	while (c != NULL) {
+		rest_json_chunk *next = c->next;
+		memcpy(buf + pos, c->data, c->len);
+		pos += c->len;
+		zfree(c);
+		c = next;
+	}
+	rest_json_init(w);
+	*len = pos;
+	return buf;
+}
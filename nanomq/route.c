@@ -0,0 +1,372 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cvector.h>
+#include <mqtt_db.h>
+#include <nanolib.h>
+#include <nng/mqtt/packet.h>
+#include <nng/supplemental/util/platform.h>
+#include <protocol/mqtt/mqtt_parser.h>
+#include <zmalloc.h>
+
+#include "include/nanomq.h"
+#include "include/route.h"
+#include "libs/cJSON.h"
+
+/*
+ * Routes between nanomq nodes. A node with sys_event.route_interval
+ * publishes the topic filters it has subscribers for, online or not, to
+ * ROUTE_TOPIC, and the bridge of another node with bridge.mqtt.routes
+ * subscribes to them and forwards a message only if one matches.
+ *
+ * An update is a JSON object, "node" is an id the node picks at start,
+ * "seq" counts its updates and "add" and "del" are the filters which
+ * came and went since the last one. Every ROUTE_FULL_MS or so "full" is
+ * true instead, "add" is all of them and "del" is left out. A peer takes
+ * an update which follows the last one it has of the node, or a full
+ * one, and forgets the filters after a gap, forwarding all until the
+ * next full one.
+ *
+ * Updates are published as qos 0 by the sys event work, the filters of
+ * the tree read from a dbtree_snapshot, so nothing is done while the
+ * tree does not change. A $share/<group>/ prefix is left out.
+ */
+#define ROUTE_FULL_MS 30000
+
+static pthread_mutex_t adv_mtx      = PTHREAD_MUTEX_INITIALIZER;
+static dbtree *        adv_db       = NULL;
+static int             adv_interval = 0;
+static nng_time        adv_next     = 0;
+static nng_time        adv_full     = 0; // when the next full one is due
+static uint64_t        adv_gen      = 0;
+static uint32_t        adv_seq      = 0;
+static char **         adv_filters  = NULL; // sorted, last published
+static char            adv_node[24];
+
+static pthread_rwlock_t   peer_lock    = PTHREAD_RWLOCK_INITIALIZER;
+static dbtree_filter_set *peer_set     = NULL; // NULL if not known
+static char **            peer_filters = NULL; // sorted
+static char               peer_node[24];
+static uint32_t           peer_seq     = 0;
+
+static int
+filter_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void
+filters_free(char **filters)
+{
+	for (size_t i = 0; i < cvector_size(filters); i++) {
+		zfree(filters[i]);
+	}
+	cvector_free(filters);
+}
+
+// index of filter in sorted, or where it goes with found false
+static size_t
+filters_find(char **sorted, const char *filter, bool *found)
+{
+	size_t lo = 0, hi = cvector_size(sorted);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int    c   = strcmp(sorted[mid], filter);
+
+		if (c == 0) {
+			*found = true;
+			return mid;
+		}
+		if (c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	*found = false;
+	return lo;
+}
+
+// the filters subscribed on the tree, sorted and each once
+static char **
+tree_filters(dbtree_snapshot *snap)
+{
+	char **     filters = NULL;
+	const char *last    = NULL;
+	size_t      n       = dbtree_snapshot_count(snap);
+	size_t      k       = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		const dbtree_subscription *sub = dbtree_snapshot_get(snap, i);
+		const char *               t   = sub ? sub->topic : NULL;
+
+		// the ones on a topic are in a row
+		if (t == NULL || (last != NULL && strcmp(t, last) == 0)) {
+			continue;
+		}
+		last = t;
+		if (dbtree_check_shared_sub(t) && (t = strchr(t, '/')) &&
+		    (t = strchr(t + 1, '/'))) {
+			t++;
+		}
+		if (t != NULL && strcmp(t, ROUTE_TOPIC) != 0) {
+			cvector_push_back(filters, zstrdup(t));
+		}
+	}
+	n = cvector_size(filters);
+	if (n > 1) {
+		qsort(filters, n, sizeof(char *), filter_cmp);
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (k > 0 && strcmp(filters[k - 1], filters[i]) == 0) {
+			zfree(filters[i]);
+		} else {
+			filters[k++] = filters[i];
+		}
+	}
+	if (filters != NULL) {
+		cvector_set_size(filters, k);
+	}
+	return filters;
+}
+
+/**
+ * @brief route_init - Set up the advertisement of the filters of db.
+ * @param config - conf_sys_event, route_interval 0 disables it
+ * @param db - dbtree
+ * @return void
+ */
+void
+route_init(conf_sys_event *config, dbtree *db)
+{
+	adv_db       = db;
+	adv_interval = config->route_interval;
+	snprintf(adv_node, sizeof(adv_node), "%08x%08x",
+	    (uint32_t) getpid(), (uint32_t) nng_clock() ^ (uint32_t) rand());
+}
+
+// add the filters of a missing from b to arr, those of both are skipped
+static void
+filters_diff(cJSON *arr, char **a, char **b)
+{
+	size_t i = 0, j = 0;
+
+	while (i < cvector_size(a)) {
+		int c = j < cvector_size(b) ? strcmp(a[i], b[j]) : -1;
+
+		if (c < 0) {
+			cJSON_AddItemToArray(arr, cJSON_CreateString(a[i++]));
+		} else {
+			j++;
+			i += c == 0;
+		}
+	}
+}
+
+/**
+ * @brief route_sys_msg - Build the PUBLISH of a route update once the
+ * route interval passed since the last one, if the filters changed or
+ * a full one is due.
+ * @param now - nng_clock
+ * @return PUBLISH to ROUTE_TOPIC or NULL
+ */
+nng_msg *
+route_sys_msg(nng_time now)
+{
+	dbtree_snapshot *snap;
+	char **          filters;
+	nng_msg *        msg = NULL;
+	mqtt_string      topic, payload;
+	cJSON *          obj, *add, *del;
+	uint32_t         seq;
+	bool             full;
+
+	if (adv_interval <= 0 || adv_db == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&adv_mtx);
+	if (now < adv_next) {
+		pthread_mutex_unlock(&adv_mtx);
+		return NULL;
+	}
+	adv_next = now + adv_interval;
+	full     = now >= adv_full;
+	snap     = dbtree_snapshot_take(adv_db);
+	if (!full && adv_seq > 0 && dbtree_snapshot_gen(snap) == adv_gen) {
+		dbtree_snapshot_release(snap);
+		pthread_mutex_unlock(&adv_mtx);
+		return NULL;
+	}
+	adv_gen = dbtree_snapshot_gen(snap);
+	filters = tree_filters(snap);
+	dbtree_snapshot_release(snap);
+
+	obj = cJSON_CreateObject();
+	add = cJSON_AddArrayToObject(obj, "add");
+	if (full) {
+		filters_diff(add, filters, NULL);
+		adv_full = now + ROUTE_FULL_MS;
+	} else {
+		filters_diff(add, filters, adv_filters);
+		del = cJSON_AddArrayToObject(obj, "del");
+		filters_diff(del, adv_filters, filters);
+		if (cJSON_GetArraySize(add) == 0 &&
+		    cJSON_GetArraySize(del) == 0) {
+			// the tree changed, not its filters
+			filters_free(filters);
+			cJSON_Delete(obj);
+			pthread_mutex_unlock(&adv_mtx);
+			return NULL;
+		}
+	}
+	filters_free(adv_filters);
+	adv_filters = filters;
+	cJSON_AddStringToObject(obj, "node", adv_node);
+	seq = ++adv_seq;
+	cJSON_AddNumberToObject(obj, "seq", seq);
+	cJSON_AddBoolToObject(obj, "full", full);
+	pthread_mutex_unlock(&adv_mtx);
+
+	payload.body = cJSON_PrintUnformatted(obj);
+	payload.len  = strlen(payload.body);
+	topic.body   = ROUTE_TOPIC;
+	topic.len    = strlen(ROUTE_TOPIC);
+	cJSON_Delete(obj);
+
+	nng_msg_alloc(&msg, 0);
+	msg = nano_msg_composer(&msg, 0, 0, &payload, &topic);
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+	cJSON_free(payload.body);
+	debug_msg("route update %u%s", seq, full ? " full" : "");
+
+	return msg;
+}
+
+// insert or remove the strings of arr, write lock held
+static void
+peer_apply(cJSON *arr, bool add)
+{
+	cJSON *item;
+	size_t i;
+	bool   found;
+
+	cJSON_ArrayForEach(item, arr)
+	{
+		if (!cJSON_IsString(item)) {
+			continue;
+		}
+		i = filters_find(peer_filters, item->valuestring, &found);
+		// cvector_insert does not append
+		if (add && !found && i == cvector_size(peer_filters)) {
+			cvector_push_back(
+			    peer_filters, zstrdup(item->valuestring));
+		} else if (add && !found) {
+			cvector_insert(
+			    peer_filters, i, zstrdup(item->valuestring));
+		} else if (!add && found) {
+			zfree(peer_filters[i]);
+			cvector_erase(peer_filters, i);
+		}
+	}
+}
+
+/**
+ * @brief route_peer_update - Take a route update the remote nanomq of the
+ * bridge published.
+ * @param payload - of the PUBLISH to ROUTE_TOPIC
+ * @param len - of payload
+ * @return true if the filters of the remote are known after it
+ */
+bool
+route_peer_update(const uint8_t *payload, size_t len)
+{
+	cJSON *            obj, *node, *seq;
+	dbtree_filter_set *old = NULL;
+	bool               full, follows, known;
+
+	obj  = cJSON_ParseWithLength((const char *) payload, len);
+	node = obj ? cJSON_GetObjectItem(obj, "node") : NULL;
+	seq  = obj ? cJSON_GetObjectItem(obj, "seq") : NULL;
+	if (!cJSON_IsString(node) || !cJSON_IsNumber(seq)) {
+		cJSON_Delete(obj);
+		return false;
+	}
+	full = cJSON_IsTrue(cJSON_GetObjectItem(obj, "full"));
+
+	pthread_rwlock_wrlock(&peer_lock);
+	follows = peer_set != NULL &&
+	    strcmp(peer_node, node->valuestring) == 0 &&
+	    (uint32_t) seq->valuedouble == peer_seq + 1;
+	if (full || !follows) {
+		filters_free(peer_filters);
+		peer_filters = NULL;
+	}
+	if (full || follows) {
+		peer_apply(cJSON_GetObjectItem(obj, "add"), true);
+		peer_apply(cJSON_GetObjectItem(obj, "del"), false);
+		snprintf(
+		    peer_node, sizeof(peer_node), "%s", node->valuestring);
+		peer_seq = (uint32_t) seq->valuedouble;
+	}
+	old      = peer_set;
+	peer_set = full || follows
+	    ? dbtree_filter_set_new(peer_filters, cvector_size(peer_filters))
+	    : NULL;
+	known    = peer_set != NULL;
+	pthread_rwlock_unlock(&peer_lock);
+
+	dbtree_filter_set_free(old);
+	if (!known) {
+		log_warn("route update before %u of %s missed, forwarding all",
+		    (uint32_t) seq->valuedouble, node->valuestring);
+	}
+	cJSON_Delete(obj);
+	return known;
+}
+
+/**
+ * @brief route_peer_match - Check if the remote nanomq has subscribers for
+ * topic, as far as its route updates tell.
+ * @param topic - topic of PUBLISH
+ * @return true if it has, or its filters are not known
+ */
+bool
+route_peer_match(const char *topic)
+{
+	bool match;
+
+	pthread_rwlock_rdlock(&peer_lock);
+	match = peer_set == NULL || dbtree_filter_set_match(peer_set, topic);
+	pthread_rwlock_unlock(&peer_lock);
+
+	return match;
+}
+
+// the link to the remote is down, its updates may be missed
+void
+route_peer_reset(void)
+{
+	dbtree_filter_set *old;
+
+	pthread_rwlock_wrlock(&peer_lock);
+	old      = peer_set;
+	peer_set = NULL;
+	filters_free(peer_filters);
+	peer_filters = NULL;
+	pthread_rwlock_unlock(&peer_lock);
+
+	dbtree_filter_set_free(old);
+}
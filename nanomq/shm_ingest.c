@@ -0,0 +1,139 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include <conf.h>
+#include <nano_shm.h>
+#include <nanolib.h>
+#include <nng/mqtt/packet.h>
+#include <nng/supplemental/util/platform.h>
+#include <protocol/mqtt/mqtt_parser.h>
+#include <zmalloc.h>
+
+#include "include/nanomq.h"
+#include "include/shm_ingest.h"
+
+/*
+ * Publishes of processes on this host, taken from the nano_shm rings the
+ * broker creates in shm.dir. A process claims a ring of its own with
+ * nano_shm_producer_open, so each ring has one producer and the one
+ * ingest work as its consumer, and neither takes a lock or makes a
+ * syscall per publish.
+ *
+ * The ingest work takes up to shm.batch records of a ring, each copied
+ * into the PUBLISH handle_pub matches like one received, then gives their
+ * room back to the producer at once and goes on with the next ring. Once
+ * all rings are empty it looks again after shm.interval ms.
+ */
+static nano_shm *rings   = NULL;
+static int       count   = 0;
+static int       cur     = 0; // ring taken from
+static int       taken   = 0; // records of cur since the last release
+static int       batch   = 64;
+static uint64_t  records = 0;
+
+/**
+ * @brief shm_ingest_init - Create the rings of config, or take over the
+ * ones a broker before left there.
+ * @param config - conf_shm
+ * @return rings created
+ */
+int
+shm_ingest_init(conf_shm *config)
+{
+	const char *dir = config->dir ? config->dir : CONF_SHM_DIR_DEFAULT;
+	char        path[256];
+	int         n = config->rings;
+
+	if (!config->enable || n <= 0) {
+		return 0;
+	}
+	if (n > NANO_SHM_RINGS_MAX) {
+		n = NANO_SHM_RINGS_MAX;
+	}
+	batch = config->batch > 0 ? config->batch : 1;
+	rings = zmalloc(sizeof(nano_shm) * n);
+	for (count = 0; count < n; count++) {
+		nano_shm_path(path, sizeof(path), dir, count);
+		if (nano_shm_create(&rings[count], path, config->ring_size) !=
+		    0) {
+			log_warn("shm ring %s can not be created", path);
+			break;
+		}
+	}
+	debug_msg("%d shm rings in %s", count, dir);
+	return count;
+}
+
+bool
+shm_ingest_enabled(void)
+{
+	return count > 0;
+}
+
+// the next record of the rings as a PUBLISH, the ingest work only
+nng_msg *
+shm_ingest_take(void)
+{
+	mqtt_string    topic, payload;
+	const char *   t;
+	const uint8_t *p;
+	uint16_t       tlen;
+	uint32_t       plen;
+	uint8_t        flags;
+	nng_msg *      msg   = NULL;
+	bool           found = false;
+
+	for (int tried = 0; count > 0 && tried <= count; tried++) {
+		if (taken < batch &&
+		    nano_shm_next(&rings[cur], &t, &tlen, &p, &plen, &flags)) {
+			found = true;
+			break;
+		}
+		// the room of those taken back to its producer, on to the next
+		nano_shm_release(&rings[cur]);
+		cur   = (cur + 1) % count;
+		taken = 0;
+	}
+	if (!found) {
+		return NULL;
+	}
+	taken++;
+	__atomic_add_fetch(&records, 1, __ATOMIC_RELAXED);
+
+	topic.body   = (char *) t;
+	topic.len    = tlen;
+	payload.body = (char *) p;
+	payload.len  = plen;
+	if (nng_msg_alloc(&msg, 0) != 0) {
+		return NULL;
+	}
+	msg = nano_msg_composer(&msg, flags & NANO_SHM_RETAIN,
+	    (flags >> 1) & 0x03, &payload, &topic);
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+	nng_msg_set_timestamp(msg, nng_clock());
+
+	return msg;
+}
+
+void
+shm_ingest_get_totals(shm_ingest_totals *t)
+{
+	memset(t, 0, sizeof(shm_ingest_totals));
+	t->rings     = count;
+	t->published = __atomic_load_n(&records, __ATOMIC_RELAXED);
+	for (int i = 0; i < count; i++) {
+		if (__atomic_load_n(&rings[i].hdr->owner, __ATOMIC_RELAXED)) {
+			t->producers++;
+		}
+		t->full +=
+		    __atomic_load_n(&rings[i].hdr->full, __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,469 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <conf.h>
+#include <hash.h>
+#include <mqtt_db.h>
+#include <nng.h>
+#include <protocol/mqtt/mqtt_parser.h>
+#include <zmalloc.h>
+
+#include "include/nanomq.h"
+#include "include/reaper.h"
+#include "include/snapshot.h"
+
+/*
+ * Persistent sessions and their subscriptions are saved to a snapshot on
+ * stop and every interval, and loaded on start, so that the clients
+ * coming back after a restart find their sessions instead of all of them
+ * subscribing again. Each topic of a session is saved as the tree has it,
+ * an online client with clean start 0 as the session it becomes as the
+ * broker stops. The file is written to <path>.tmp and renamed over path,
+ * it is loaded with mmap and all sessions are put on the tree with one
+ * dbtree_insert_sessions. Only the granted qos of the options of a
+ * SUBSCRIBE is kept, the list of a ctxt may change outside the tree lock.
+ *
+ * Layout, integers in host order:
+ *   magic u32, version u32, count of topics u32
+ *   per topic: session id u32, proto_ver u8, qos u8, length u16, topic
+ * Queued messages are in the log of persistence, not in the snapshot.
+ */
+#define SNAPSHOT_MAGIC 0x4e534e50 // "NSNP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEAD 12
+#define SNAPSHOT_REC 8 // before the topic
+
+typedef struct {
+	uint8_t *buf;
+	size_t   len;
+	size_t   cap;
+} snap_buf;
+
+// session key of a ctxt as saved, or ctxt of a session key as loaded
+typedef struct {
+	uintptr_t id; // ctxt or key, 0 is an empty slot
+	uintptr_t val;
+} snap_slot;
+
+typedef struct {
+	snap_slot *slots;
+	size_t     mask;
+	size_t     cnt;
+} snap_map;
+
+typedef struct {
+	snap_buf out;
+	snap_map keys;
+	uint32_t cnt;
+} snap_writer;
+
+static pthread_mutex_t mtx  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       thread;
+static bool            running  = false;
+static dbtree *        s_db     = NULL;
+static char *          s_path   = NULL;
+static int             interval = 0;
+
+static inline void
+put_u32(uint8_t *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline uint32_t
+get_u32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void
+put_u16(uint8_t *p, uint16_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline uint16_t
+get_u16(const uint8_t *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint8_t *
+buf_reserve(snap_buf *b, size_t len)
+{
+	if (b->len + len > b->cap) {
+		b->cap = (b->len + len) * 2;
+		b->buf = zrealloc(b->buf, b->cap);
+	}
+	b->len += len;
+	return b->buf + b->len - len;
+}
+
+// slot of id, an empty one to put it in if id is not in m
+static snap_slot *
+map_slot(snap_map *m, uintptr_t id)
+{
+	size_t i;
+
+	if ((m->cnt + 1) * 2 > m->mask + 1) {
+		snap_map n = { .mask = m->mask ? m->mask * 2 + 1 : 1023 };
+		n.slots    = zmalloc(sizeof(snap_slot) * (n.mask + 1));
+		memset(n.slots, 0, sizeof(snap_slot) * (n.mask + 1));
+		for (size_t k = 0; m->slots && k <= m->mask; k++) {
+			if (m->slots[k].id != 0) {
+				*map_slot(&n, m->slots[k].id) = m->slots[k];
+				n.cnt++;
+			}
+		}
+		zfree(m->slots);
+		*m = n;
+	}
+	i = (id ^ (id >> 16)) * 2654435761u & m->mask;
+	while (m->slots[i].id != 0 && m->slots[i].id != id) {
+		i = (i + 1) & m->mask;
+	}
+
+	return &m->slots[i];
+}
+
+// key of the session ctx is saved as, 0 if it is not persistent
+static uint32_t
+session_key(const dbtree_subscription *sub, client_ctx *ctx)
+{
+	const char *clientid;
+
+	if (sub->pipe_id == 0) {
+		return sub->session_id;
+	}
+	// the pipe and its cparam stay while the tree is locked
+	if (ctx->cparam == NULL ||
+	    conn_param_get_clean_start(ctx->cparam) != 0 ||
+	    (clientid = (const char *) conn_param_get_clientid(
+	         ctx->cparam)) == NULL) {
+		return 0;
+	}
+	return DJBHashn((char *) clientid, strlen(clientid));
+}
+
+static int
+save_cb(const dbtree_subscription *sub, void *arg)
+{
+	snap_writer *w   = arg;
+	client_ctx * ctx = sub->ctxt;
+	size_t       len = strlen(sub->topic);
+	snap_slot *  slot;
+	uint8_t *    p;
+
+	if (ctx == NULL || len == 0 || len > UINT16_MAX) {
+		return 0;
+	}
+	slot = map_slot(&w->keys, (uintptr_t) ctx);
+	if (slot->id == 0) {
+		slot->id  = (uintptr_t) ctx;
+		slot->val = session_key(sub, ctx);
+		w->keys.cnt++;
+	}
+	if (slot->val == 0) {
+		return 0;
+	}
+
+	p = buf_reserve(&w->out, SNAPSHOT_REC + len);
+	put_u32(p, slot->val);
+	p[4] = ctx->proto_ver;
+	p[5] = sub->qos;
+	put_u16(p + 6, len);
+	memcpy(p + SNAPSHOT_REC, sub->topic, len);
+	w->cnt++;
+
+	return 0;
+}
+
+/**
+ * @brief snapshot_save - Write the persistent sessions of db to path.
+ * The tree is locked against writers while it is walked, the file is
+ * written after.
+ * @param db - dbtree
+ * @param path - file of the snapshot
+ * @return topics saved or -1
+ */
+int
+snapshot_save(dbtree *db, const char *path)
+{
+	snap_writer w   = { 0 };
+	size_t      len = strlen(path) + 5;
+	char *      tmp = zmalloc(len);
+	int         fd  = -1;
+	int         rv  = -1;
+
+	put_u32(buf_reserve(&w.out, SNAPSHOT_HEAD), SNAPSHOT_MAGIC);
+	put_u32(w.out.buf + 4, SNAPSHOT_VERSION);
+	dbtree_foreach_subscription(db, save_cb, &w);
+	put_u32(w.out.buf + 8, w.cnt);
+	zfree(w.keys.slots);
+
+	snprintf(tmp, len, "%s.tmp", path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		debug_msg("snapshot %s can not be opened", tmp);
+		goto out;
+	}
+	for (size_t off = 0; off < w.out.len;) {
+		ssize_t n = write(fd, w.out.buf + off, w.out.len - off);
+		if (n < 0) {
+			goto out;
+		}
+		off += n;
+	}
+	rv = fsync(fd);
+	if (close(fd) != 0 || rv != 0) {
+		rv = -1;
+	}
+	fd = -1;
+	if (rv == 0 && rename(tmp, path) == 0) {
+		rv = w.cnt;
+	} else {
+		rv = -1;
+	}
+
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (rv < 0) {
+		unlink(tmp);
+	}
+	zfree(tmp);
+	zfree(w.out.buf);
+
+	return rv;
+}
+
+// a session as loaded, the topics of the tree are owned by its list
+static client_ctx *
+session_ctx_new(uint8_t proto_ver)
+{
+	client_ctx *ctx = nng_alloc(sizeof(client_ctx));
+
+	memset(ctx, 0, sizeof(client_ctx));
+	ctx->sub_pkt = nng_alloc(sizeof(packet_subscribe));
+	memset(ctx->sub_pkt, 0, sizeof(packet_subscribe));
+	ctx->proto_ver = proto_ver;
+
+	return ctx;
+}
+
+static char *
+session_ctx_add(client_ctx *ctx, const uint8_t *topic, uint16_t len,
+    uint8_t qos)
+{
+	topic_node *       tn  = nng_alloc(sizeof(topic_node));
+	topic_with_option *two = nng_alloc(sizeof(topic_with_option));
+
+	memset(two, 0, sizeof(topic_with_option));
+	two->qos               = qos;
+	two->topic_filter.len  = len;
+	two->topic_filter.body = nng_alloc(len + 1);
+	memcpy(two->topic_filter.body, topic, len);
+	two->topic_filter.body[len] = '\0';
+	tn->it                      = two;
+	tn->next                    = ctx->sub_pkt->node;
+	ctx->sub_pkt->node          = tn;
+
+	return two->topic_filter.body;
+}
+
+/**
+ * @brief snapshot_load - Put the sessions saved in path on db as offline
+ * sessions, as if their clients had just disconnected. Called before the
+ * dbtree is shared, a session already known is skipped.
+ * @param db - dbtree
+ * @param path - file of the snapshot
+ * @return sessions loaded or -1
+ */
+int
+snapshot_load(dbtree *db, const char *path)
+{
+	struct stat st;
+	uint8_t *   map                   = NULL;
+	snap_map    ctxs                  = { 0 };
+	size_t      off                   = SNAPSHOT_HEAD;
+	uint32_t    cnt                   = 0;
+	int         fd                    = -1;
+	int         rv                    = 0;
+	cvector(dbtree_subscription) subs = NULL;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < SNAPSHOT_HEAD ||
+	    (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+	        MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	if (get_u32(map) != SNAPSHOT_MAGIC ||
+	    get_u32(map + 4) != SNAPSHOT_VERSION) {
+		debug_msg("snapshot %s is not known", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	cnt = get_u32(map + 8);
+	if (cnt > (st.st_size - SNAPSHOT_HEAD) / (SNAPSHOT_REC + 1)) {
+		cnt = (st.st_size - SNAPSHOT_HEAD) / (SNAPSHOT_REC + 1);
+	}
+	cvector_grow(subs, cnt);
+	for (uint32_t i = 0; i < cnt; i++) {
+		const uint8_t *p = map + off;
+		uint32_t       key;
+		uint16_t       len;
+		snap_slot *    slot;
+
+		if ((size_t) st.st_size - off < SNAPSHOT_REC ||
+		    (len = get_u16(p + 6)) == 0 ||
+		    (size_t) st.st_size - off - SNAPSHOT_REC < len) {
+			debug_msg("snapshot %s is cut short", path);
+			break;
+		}
+		off += SNAPSHOT_REC + len;
+		if ((key = get_u32(p)) == 0) {
+			continue;
+		}
+		slot = map_slot(&ctxs, key);
+		if (slot->id == 0) {
+			slot->id = key;
+			// NULL for a session known already
+			slot->val = (uintptr_t) (cached_check_id(key)
+			        ? NULL
+			        : session_ctx_new(p[4]));
+			ctxs.cnt++;
+			if (slot->val != 0) {
+				rv++;
+			}
+		}
+		if (slot->val == 0) {
+			continue;
+		}
+
+		dbtree_subscription sub = {
+			.topic = session_ctx_add((client_ctx *) slot->val,
+			    p + SNAPSHOT_REC, len, p[5]),
+			.session_id = key,
+			.ctxt       = (void *) slot->val,
+			.qos        = p[5],
+		};
+		cvector_push_back(subs, sub);
+		add_cached_topic(key, (char *) sub.topic);
+	}
+	munmap(map, st.st_size);
+
+	if (!cvector_empty(subs)) {
+		dbtree_insert_sessions(db, subs, cvector_size(subs));
+	}
+	// expiry of a session loaded starts with the broker
+	for (size_t k = 0; ctxs.slots && k <= ctxs.mask; k++) {
+		if (ctxs.slots[k].val != 0) {
+			reaper_session_offline(ctxs.slots[k].id);
+		}
+	}
+	debug_msg("snapshot %s: %d sessions on %zu topics loaded", path, rv,
+	    cvector_size(subs));
+	cvector_free(subs);
+	zfree(ctxs.slots);
+
+	return rv;
+}
+
+static void *
+snapshot_run(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&mtx);
+	while (running) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += interval;
+		pthread_cond_timedwait(&cond, &mtx, &ts);
+		if (!running) {
+			break;
+		}
+		pthread_mutex_unlock(&mtx);
+		snapshot_save(s_db, s_path);
+		pthread_mutex_lock(&mtx);
+	}
+	pthread_mutex_unlock(&mtx);
+
+	return NULL;
+}
+
+/**
+ * @brief snapshot_start - Load the snapshot of config into db, then save
+ * one every interval. Called before the dbtree is shared, after
+ * reaper_start.
+ * @param config - conf_snapshot
+ * @param db - dbtree of subscriptions and sessions
+ * @return void
+ */
+void
+snapshot_start(conf_snapshot *config, dbtree *db)
+{
+	s_db     = db;
+	s_path   = zstrdup(config->path ? config->path
+	                               : CONF_SNAPSHOT_PATH_DEFAULT);
+	interval = config->interval;
+	snapshot_load(db, s_path);
+	if (interval <= 0) {
+		return;
+	}
+	running = true;
+	if (pthread_create(&thread, NULL, snapshot_run, NULL) != 0) {
+		debug_msg("snapshot thread can not be created");
+		running = false;
+	}
+}
+
+/**
+ * @brief snapshot_stop - Stop saving every interval and save the last
+ * snapshot, as the broker stops.
+ * @return void
+ */
+void
+snapshot_stop(void)
+{
+	if (s_db == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&mtx);
+	if (running) {
+		running = false;
+		pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&mtx);
+		pthread_join(thread, NULL);
+	} else {
+		pthread_mutex_unlock(&mtx);
+	}
+	snapshot_save(s_db, s_path);
+	zfree(s_path);
+	s_path = NULL;
+	s_db   = NULL;
+}
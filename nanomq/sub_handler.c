@@ -7,18 +7,34 @@
 // found online at https://opensource.org/licenses/MIT.
 //
 #include <nanolib.h>
+#include <nano_topic.h>
 #include <nng.h>
 #include <protocol/mqtt/mqtt.h>
 #include <protocol/mqtt/mqtt_parser.h>
 
+#include "include/mem_guard.h"
 #include "include/nanomq.h"
+#include "include/pipe_queue.h"
 #include "include/pub_handler.h"
+#include "include/reaper.h"
 #include "include/sub_handler.h"
 
 #define SUPPORT_MQTT5_0 1
 
 static void cli_ctx_merge(client_ctx *ctx, client_ctx *ctx_new);
 
+// qos granted to ctx on topic filter, looked up on subscribe only
+static uint8_t
+ctx_granted_qos(client_ctx *ctx, const char *topic)
+{
+	for (topic_node *tn = ctx->sub_pkt->node; tn != NULL; tn = tn->next) {
+		if (strcmp(tn->it->topic_filter.body, topic) == 0) {
+			return tn->it->qos;
+		}
+	}
+	return 0;
+}
+
 void
 init_sub_property(packet_subscribe *sub_pkt)
 {
@@ -37,6 +53,7 @@ decode_sub_message(nano_work *work)
 
 	size_t   len_of_varint = 0, len_of_property = 0, len_of_properties = 0;
 	uint32_t len_of_str, len_of_topic;
+	int      cnt;
 	nng_msg *msg           = work->msg;
 	size_t   remaining_len = nng_msg_remaining_len(msg);
 
@@ -148,6 +165,12 @@ decode_sub_message(nano_work *work)
 		bpos += 2;
 
 		if (len_of_topic != 0) {
+			if (nano_topic_scan((char *) (payload_ptr + bpos),
+			        len_of_topic, NANO_TOPIC_FILTER, NULL, 0,
+			        &cnt) != NANO_TOPIC_OK) {
+				debug_msg("ERROR : topic filter invalid.");
+				return PROTOCOL_ERROR;
+			}
 			topic_option->topic_filter.len = len_of_topic;
 			topic_option->topic_filter.body =
 			    nng_alloc(len_of_topic + 1);
@@ -270,6 +293,20 @@ encode_suback_message(nng_msg *msg, nano_work *work)
 	return SUCCESS;
 }
 
+// if the SUBSCRIBE has the user property PIPE_CONFLATE_PROPERTY true
+static bool
+sub_conflated(packet_subscribe *sub_pkt)
+{
+	size_t klen = sub_pkt->user_property.strpair.len_key;
+	size_t vlen = sub_pkt->user_property.strpair.len_val;
+
+	return klen == strlen(PIPE_CONFLATE_PROPERTY) &&
+	    memcmp(sub_pkt->user_property.strpair.key, PIPE_CONFLATE_PROPERTY,
+	        klen) == 0 &&
+	    vlen == 4 &&
+	    memcmp(sub_pkt->user_property.strpair.val, "true", 4) == 0;
+}
+
 // generate ctx for each topic
 uint8_t
 sub_ctx_handle(nano_work *work)
@@ -279,9 +316,19 @@ sub_ctx_handle(nano_work *work)
 	char *              clientid     = NULL;
 	int                 topic_len    = 0;
 	struct topic_queue *tq           = NULL;
-	work->msg_ret                    = NULL;
-	int topic_exist                  = 0;
+	work->retain_cur                 = NULL;
 	uint32_t clientid_key            = 0;
+	cvector(char *) topics           = NULL;
+	cvector(uint8_t) grants          = NULL;
+	bool conflate                    = false;
+
+	// under memory pressure the SUBACK refuses all filters
+	if (mem_guard_refuse(MEM_GUARD_SUBSCRIBE)) {
+		for (; topic_node_t; topic_node_t = topic_node_t->next) {
+			topic_node_t->it->reason_code = 0x80;
+		}
+		return SUCCESS;
+	}
 
 	client_ctx *old_ctx = NULL;
 	client_ctx *cli_ctx = nng_alloc(sizeof(client_ctx));
@@ -303,8 +350,8 @@ sub_ctx_handle(nano_work *work)
 		    dbtree_delete_client(work->db, tq->topic, clientid_key, cli_ctx->pid.id);
 	}
 	if (old_ctx) {
-		dbtree_insert_client(
-		    work->db, tq->topic, old_ctx, cli_ctx->pid.id);
+		dbtree_insert_client(work->db, tq->topic, old_ctx,
+		    cli_ctx->pid.id, ctx_granted_qos(old_ctx, tq->topic));
 	}
 	if (!tq || !old_ctx) { /* the real ctx stored in tree */
 		old_ctx                = nng_alloc(sizeof(client_ctx));
@@ -324,23 +371,18 @@ sub_ctx_handle(nano_work *work)
 	cli_ctx_merge(cli_ctx, old_ctx);
 	destroy_sub_ctx(cli_ctx);
 
+	conflate = sub_conflated(work->sub_pkt);
 	while (topic_node_t) {
 		topic_len = topic_node_t->it->topic_filter.len;
 		topic_str = topic_node_t->it->topic_filter.body;
 		debug_msg("topicLen: [%d] body: [%s]", topic_len, topic_str);
+		pipe_queue_conflate(work->pid.id, topic_str, conflate);
 
-		/* remove duplicate items */
-		topic_exist = 0;
-		tq          = get_topic(work->pid.id);
-		while (tq) {
-			if (!strcmp(topic_str, tq->topic)) {
-				topic_exist = 1;
-				break;
-			}
-			tq = tq->next;
-		}
-		if (!topic_exist) {
-			dbtree_insert_client(work->db, topic_str, old_ctx, work->pid.id);
+		/* filters are inserted in a batch, a filter subscribed again
+		 * only replaces its granted qos */
+		cvector_push_back(topics, topic_str);
+		cvector_push_back(grants, topic_node_t->it->qos);
+		if (!check_topic(work->pid.id, topic_str)) {
 			add_topic(work->pid.id, topic_str);
 		}
 #ifdef DEBUG
@@ -349,27 +391,23 @@ sub_ctx_handle(nano_work *work)
 		    work->pid.id);
 #endif
 
-		dbtree_retain_msg **r = dbtree_find_retain(work->db_ret, topic_str);
-		if (r) {
-			for (int i = 0; i < cvector_size(r); i++) {
-				if (!r[i]) {
-					continue;
-				}
-				debug_msg("found retain [%p], "
-				          "message: [%p][%p] sz [%ld]\n",
-				    r[i], r[i]->message,
-				    nng_msg_payload_ptr(r[i]->message),
-				    cvector_size(r));
-
-				cvector_push_back(
-				    work->msg_ret, (nng_msg *) r[i]->message);
-			}
+		// retain messages are sent in batches by the RETAIN state
+		nano_retain_cursor *cur =
+		    nano_retain_cursor_new(work->retain, topic_str);
+		if (cur) {
+			cvector_push_back(work->retain_cur, cur);
 		}
-		cvector_free(r);
 
 		topic_node_t = topic_node_t->next;
 	}
 
+	if (!cvector_empty(topics)) {
+		dbtree_insert_clients(work->db, topics, grants,
+		    cvector_size(topics), old_ctx, work->pid.id, NULL);
+	}
+	cvector_free(topics);
+	cvector_free(grants);
+
 #ifdef DEBUG
 	// check treeDB
 	dbtree_print(work->db);
@@ -569,22 +607,36 @@ destroy_sub_ctx(void *ctxt)
 	cli_ctx = NULL;
 }
 
+// cvector of the topics in tq, they are still owned by tq
+static char **
+topic_queue_topics(topic_queue *tq)
+{
+	char **topics = NULL;
+
+	for (; tq; tq = tq->next) {
+		if (tq->topic) {
+			cvector_push_back(topics, tq->topic);
+		}
+	}
+	return topics;
+}
+
 int
 cache_session(char *clientid, conn_param *cparam, uint32_t pid, void *db)
 {
 	debug_msg("cache session");
-	struct topic_queue *tq      = NULL;
+	char **topics = NULL;
 
 	uint32_t key_clientid = DJBHashn(clientid, strlen(clientid));
 
 	if (check_id(pid)) {
-		tq = get_topic(pid);
-		while (tq) {
-			// TODO Is it necessary to get ctx and set pipeid to 0 in ctx ??
-			dbtree_cache_session(db, tq->topic, key_clientid, pid);
-			tq = tq->next;
-		}
+		// TODO Is it necessary to get ctx and set pipeid to 0 in ctx ??
+		topics = topic_queue_topics(get_topic(pid));
+		dbtree_cache_sessions(
+		    db, topics, cvector_size(topics), key_clientid, pid);
+		cvector_free(topics);
 		cache_topic_all(pid, key_clientid);
+		reaper_session_offline(key_clientid);
 	}
 
 	debug_msg("Session cached.");
@@ -595,24 +647,67 @@ int
 restore_session(char *clientid, conn_param *cparam, uint32_t pid, void *db)
 {
 	debug_msg("restore session");
-	client_ctx * ctx;
-	topic_queue *tq = NULL;
+	client_ctx *ctx    = NULL;
+	char **     topics = NULL;
 
 	uint32_t key_clientid = DJBHashn(clientid, strlen(clientid));
 	// TODO hash collision?
 	// TODO kick prev connection(p or cs->pipeid)
 
+	// after this the reaper can not expire it under us
+	reaper_session_online(key_clientid);
 	if (!cached_check_id(key_clientid)) {
 		return 0;
 	}
-	tq = get_cached_topic(key_clientid);
-	while (tq) {
-		ctx = dbtree_restore_session(db, tq->topic, key_clientid, pid);
-		tq = tq->next;
-	}
+	// queued msgs stay in the session store, they are the PUBLISH as
+	// received and there is no encoder for a stored one yet
+	topics = topic_queue_topics(get_cached_topic(key_clientid));
+	ctx    = dbtree_restore_sessions(
+	    db, topics, cvector_size(topics), key_clientid, pid, NULL);
+	cvector_free(topics);
 	if (ctx) {
 		ctx->pid.id = pid;
 	}
 
 	restore_topic_all(key_clientid, pid);
+	return 0;
+}
+
+/**
+ * @brief expire_session - Free an offline session whose client did not
+ * come back in time, its subscriptions and its queued messages.
+ * @param key_clientid - client id hash value
+ * @param db - dbtree
+ * @return count of topics the session was on
+ */
+int
+expire_session(uint32_t key_clientid, void *db)
+{
+	char ** topics = NULL;
+	void ** ctxts  = NULL;
+	void ** msgs   = NULL;
+	size_t  n      = 0;
+
+	if (!cached_check_id(key_clientid)) {
+		return 0;
+	}
+	topics = topic_queue_topics(get_cached_topic(key_clientid));
+	if ((n = cvector_size(topics)) > 0) {
+		ctxts = nng_alloc(sizeof(void *) * n);
+		dbtree_delete_sessions(db, topics, n, key_clientid, ctxts);
+		for (size_t i = 0; i < n; i++) {
+			del_sub_ctx(ctxts[i], topics[i]);
+		}
+		nng_free(ctxts, sizeof(void *) * n);
+	}
+	cvector_free(topics);
+	del_cached_topic_all(key_clientid);
+
+	msgs = dbtree_restore_session_msg(db, key_clientid);
+	for (size_t i = 0; i < cvector_size(msgs); i++) {
+		nng_msg_free(msgs[i]);
+	}
+	cvector_free(msgs);
+
+	return n;
 }
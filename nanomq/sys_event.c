@@ -0,0 +1,199 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <pthread.h>
+#include <string.h>
+
+#include <conf.h>
+#include <nano_lmq.h>
+#include <nng/mqtt/packet.h>
+#include <protocol/mqtt/mqtt_parser.h>
+#include <zmalloc.h>
+
+#include "include/nanomq.h"
+#include "include/sys_event.h"
+
+/*
+ * Client connected and disconnected events are queued here by the works
+ * which see them and published by a work of their own, so a connect storm
+ * never holds a work or the tree lock of the data path for them. A full
+ * queue drops the newest events.
+ *
+ * An event is the qos 0 PUBLISH built by nano_msg_composer, its body is
+ * the topic and a JSON payload. Up to batch queued events of a topic are
+ * sent as one PUBLISH whose payload is the JSON array of theirs.
+ */
+#define SYS_EVENT_QUEUE 8192
+
+static pthread_mutex_t  mtx     = PTHREAD_MUTEX_INITIALIZER;
+static nano_lmq         queue;
+static bool             enabled = false;
+static int              batch   = 1;
+static sys_event_totals totals;
+
+void
+sys_event_init(conf_sys_event *config)
+{
+	enabled = config->enable;
+	batch   = config->batch > 0 ? config->batch : 1;
+	if (enabled) {
+		nano_lmq_init(&queue, SYS_EVENT_QUEUE);
+	}
+}
+
+bool
+sys_event_enabled(void)
+{
+	return enabled;
+}
+
+/**
+ * @brief sys_event_post - Queue an event for the sys event works.
+ * @param msg - PUBLISH of the event, consumed
+ * @return void
+ */
+void
+sys_event_post(nng_msg *msg)
+{
+	bool queued = false;
+
+	if (enabled) {
+		pthread_mutex_lock(&mtx);
+		queued = nano_lmq_putq(&queue, msg) == 0;
+		pthread_mutex_unlock(&mtx);
+	}
+	if (queued) {
+		__atomic_add_fetch(&totals.queued, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (enabled) {
+		__atomic_add_fetch(&totals.dropped, 1, __ATOMIC_RELAXED);
+	}
+	nng_msg_free(msg);
+}
+
+// topic and payload of an event, they point into its body
+static bool
+event_split(nng_msg *msg, mqtt_string *topic, mqtt_string *payload)
+{
+	uint8_t *body = nng_msg_body(msg);
+	size_t   len  = nng_msg_len(msg);
+	size_t   tlen;
+
+	if (len < 2 || (tlen = (body[0] << 8) | body[1]) > len - 2) {
+		return false;
+	}
+	topic->body   = (char *) body + 2;
+	topic->len    = tlen;
+	payload->body = (char *) body + 2 + tlen;
+	payload->len  = len - 2 - tlen;
+	return true;
+}
+
+static bool
+event_same_topic(nng_msg *msg, const mqtt_string *topic)
+{
+	mqtt_string t, p;
+
+	return event_split(msg, &t, &p) && t.len == topic->len &&
+	    memcmp(t.body, topic->body, t.len) == 0;
+}
+
+// one PUBLISH with the payloads of events as a JSON array, into events[0]
+static nng_msg *
+event_coalesce(nng_msg **events, int n)
+{
+	mqtt_string topic, payload, t, p;
+	nng_msg *   msg = events[0];
+	char *      buf;
+	size_t      pos;
+
+	event_split(msg, &topic, &p);
+	pos = topic.len + 2 + n;
+	for (int i = 0; i < n; i++) {
+		event_split(events[i], &t, &p);
+		pos += p.len;
+	}
+	// the topic is copied too, the composer rewrites events[0]
+	buf = zmalloc(pos);
+	memcpy(buf, topic.body, topic.len);
+	topic.body = buf;
+	pos        = topic.len;
+
+	buf[pos++] = '[';
+	for (int i = 0; i < n; i++) {
+		event_split(events[i], &t, &p);
+		if (i > 0) {
+			buf[pos++] = ',';
+		}
+		memcpy(buf + pos, p.body, p.len);
+		pos += p.len;
+	}
+	buf[pos++]   = ']';
+	payload.body = buf + topic.len;
+	payload.len  = pos - topic.len;
+
+	for (int i = 1; i < n; i++) {
+		nng_msg_free(events[i]);
+	}
+	msg = nano_msg_composer(&msg, 0, 0, &payload, &topic);
+	zfree(buf);
+
+	return msg;
+}
+
+/**
+ * @brief sys_event_take - Take the next PUBLISH to send, up to batch
+ * queued events of the same topic coalesced.
+ * @return PUBLISH or NULL if no event is queued
+ */
+nng_msg *
+sys_event_take(void)
+{
+	nng_msg *   events[batch];
+	mqtt_string topic, payload;
+	void *      msg   = NULL;
+	int         n     = 0;
+	bool        split = false;
+
+	pthread_mutex_lock(&mtx);
+	if (nano_lmq_getq(&queue, &msg) == 0) {
+		events[n++] = msg;
+		// one which can not be split is sent as it is
+		split = event_split(events[0], &topic, &payload);
+		while (split && n < batch &&
+		    nano_lmq_peek(&queue, &msg) == 0 &&
+		    event_same_topic(msg, &topic)) {
+			nano_lmq_getq(&queue, &msg);
+			events[n++] = msg;
+		}
+	}
+	pthread_mutex_unlock(&mtx);
+
+	if (n == 0) {
+		return NULL;
+	}
+	__atomic_sub_fetch(&totals.queued, n, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&totals.published, 1, __ATOMIC_RELAXED);
+	if (n == 1) {
+		return events[0];
+	}
+	msg = event_coalesce(events, n);
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+
+	return msg;
+}
+
+void
+sys_event_get_totals(sys_event_totals *t)
+{
+	t->queued    = __atomic_load_n(&totals.queued, __ATOMIC_RELAXED);
+	t->dropped   = __atomic_load_n(&totals.dropped, __ATOMIC_RELAXED);
+	t->published = __atomic_load_n(&totals.published, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,127 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <nng/nng.h>
+#include <nng/protocol/mqtt/mqtt_parser.h>
+
+#include "include/inflight.h"
+#include "include/rate_limit.h"
+
+// A delivery is counted until the acknowledgement completing its QoS.
+static void
+test_inflight_ack()
+{
+	inflight_totals t;
+
+	inflight_init();
+	inflight_open(7, 0, 0);
+	inflight_sent(7, 0);
+	inflight_sent(7, 1);
+	inflight_sent(7, 2);
+	assert(inflight_count(7) == 2);
+
+	// QoS 2 waits for its PUBCOMP
+	assert(!inflight_ack(7, CMD_PUBREC));
+	assert(inflight_count(7) == 2);
+	assert(inflight_ack(7, CMD_PUBACK));
+	assert(inflight_count(7) == 1);
+	assert(inflight_ack(7, CMD_PUBCOMP));
+	assert(inflight_count(7) == 0);
+	// nothing is left to release
+	assert(!inflight_ack(7, CMD_PUBACK));
+	assert(inflight_count(7) == 0);
+	inflight_get_totals(&t);
+	assert(t.inflight == 0 && t.sessions == 1);
+
+	// what a closed pipe did not acknowledge goes with it
+	inflight_sent(7, 1);
+	inflight_sent(8, 1);
+	inflight_close(7);
+	assert(inflight_count(7) == 0 && inflight_count(8) == 1);
+	inflight_get_totals(&t);
+	assert(t.inflight == 1 && t.sessions == 0);
+	assert(inflight_ack(8, CMD_PUBACK));
+}
+
+static nng_msg *
+test_publish(const char *topic, size_t payload)
+{
+	nng_msg *msg;
+	uint8_t  header[2] = { 0x30, 0 };
+	uint8_t  len[2]    = { 0, (uint8_t) strlen(topic) };
+
+	assert(nng_msg_alloc(&msg, 0) == 0);
+	nng_msg_header_append(msg, header, sizeof(header));
+	nng_msg_append(msg, len, sizeof(len));
+	nng_msg_append(msg, topic, strlen(topic));
+	while (payload-- > 0) {
+		nng_msg_append(msg, "p", 1);
+	}
+	return msg;
+}
+
+// A PUBLISH over one bucket of its rule is charged to none of them.
+static void
+test_rate_limit_take()
+{
+	conf_rate_rule  rule  = { .prefix = "a/", .msgs = 10, .bytes = 1000 };
+	conf_rate_limit c     = { .rules_count = 1, .rules = &rule };
+	nng_msg *       big   = test_publish("a/b", 893); // 900 bytes
+	nng_msg *       tiny  = test_publish("a/b", 3);   // 10 bytes
+	nng_msg *       other = test_publish("b/c", 893);
+	uint64_t        now   = 5000000000ull;
+	int             ok    = 0;
+
+	rate_limit_init(&c, 4);
+	assert(rate_limit_enabled());
+	rate_limit_open(3);
+	assert(rate_limit_take(3, big, now, false) == 0);
+	// over the bytes, not the PUBLISH of the rule
+	for (int i = 0; i < 4; i++) {
+		assert(rate_limit_take(3, big, now, false) != 0);
+	}
+	// the PUBLISH budget is still 9 of 10
+	while (rate_limit_take(3, tiny, now, false) == 0) {
+		ok++;
+	}
+	assert(ok == 9);
+	// topics out of the rule are not limited
+	assert(rate_limit_take(3, other, now, false) == 0);
+
+	// forced over a limit it is charged, the pipe waits for its bytes
+	rate_limit_open(4);
+	assert(rate_limit_take(4, big, now, false) == 0);
+	assert(rate_limit_take(4, big, now, false) != 0);
+	assert(rate_limit_take(4, big, now, true) != 0);
+	now += 800000000ull;
+	assert(rate_limit_take(4, tiny, now, false) != 0);
+	now += 100000000ull;
+	assert(rate_limit_take(4, tiny, now, false) == 0);
+
+	nng_msg_free(big);
+	nng_msg_free(tiny);
+	nng_msg_free(other);
+}
+
+int
+main(int argc, char *argv[])
+{
+	puts("\n----------------TEST START------------------");
+
+	test_inflight_ack();
+	test_rate_limit_take();
+
+	puts("---------------TEST FINISHED----------------\n");
+
+	return 0;
+}
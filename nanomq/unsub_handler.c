@@ -8,6 +8,7 @@
 //
 #include "include/unsub_handler.h"
 #include "include/nanomq.h"
+#include "include/pipe_queue.h"
 #include "include/sub_handler.h"
 #include <nanolib.h>
 #include <nng.h>
@@ -225,6 +226,7 @@ unsub_ctx_handle(nano_work *work)
 
 		cli_ctx = dbtree_delete_client(work->db, topic_str, clientid_key, work->pid.id);
 		del_topic_one(work->pid.id, topic_str);
+		pipe_queue_conflate(work->pid.id, topic_str, false);
 
 		if (cli_ctx != NULL) { // find the topic
 			topic_node_t->it->reason_code = 0x00;
@@ -0,0 +1,293 @@
+//
+// Copyright 2021 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <pthread.h>
+#include <time.h>
+
+#include <conf.h>
+#include <nng/nng.h>
+#include <nng/supplemental/util/platform.h>
+#include <zmalloc.h>
+
+#include "include/nanomq.h"
+#include "include/work_pool.h"
+
+/*
+ * Pool of the works receiving from the broker socket. It starts with
+ * parallel works, a sampler counts those waiting for a message every
+ * WORK_POOL_TICK and once none was for WORK_POOL_GROW_TICKS in a row,
+ * requests are queued behind busy works and a quarter more are started,
+ * up to parallel_max. Once more than half were waiting for
+ * WORK_POOL_SHRINK_TICKS, a quarter of those above parallel are retired.
+ *
+ * A work is in pool_state, which the work moves between busy and idle as
+ * it receives. The sampler retires an idle one by cancelling its receive
+ * under the work mutex, the work takes it too once its receive is done,
+ * so a cancel never hits what the work goes on with. A retired work
+ * parks itself, not receiving again, and the sampler frees it.
+ */
+#define WORK_POOL_TICK 100         // ms between samples
+#define WORK_POOL_GROW_TICKS 5     // samples with no work idle to grow
+#define WORK_POOL_SHRINK_TICKS 300 // samples with half idle to shrink
+#define WORK_POOL_PER_THREAD 8     // works above parallel a taskq thread
+
+static pthread_mutex_t mtx  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       thread;
+static bool            running = false;
+static work_pool_ops   p_ops;
+static nano_work **    works = NULL; // cnt of max, lock held
+static uint32_t        cnt   = 0;
+static uint32_t        min   = 0;
+static uint32_t        max   = 0;
+static uint32_t        busy_ticks = 0;
+static uint32_t        calm_ticks = 0;
+static uint64_t        grown      = 0;
+static uint64_t        shrunk     = 0;
+
+static inline uint32_t
+state_of(nano_work *w)
+{
+	return __atomic_load_n(&w->pool_state, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+state_set(nano_work *w, uint32_t state)
+{
+	__atomic_store_n(&w->pool_state, state, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief work_pool_recv - Receive the next message on a work, unless the
+ * pool retired it, then it parks and is freed by the pool.
+ * @param work - nano_work in RECV state
+ * @return void
+ */
+void
+work_pool_recv(nano_work *work)
+{
+	if (state_of(work) == WORK_POOL_NONE) {
+		nng_ctx_recv(work->ctx, work->aio);
+		return;
+	}
+	nng_mtx_lock(work->mutex);
+	if (state_of(work) == WORK_POOL_RETIRE) {
+		state_set(work, WORK_POOL_PARKED);
+	} else {
+		state_set(work, WORK_POOL_IDLE);
+		nng_ctx_recv(work->ctx, work->aio);
+	}
+	nng_mtx_unlock(work->mutex);
+}
+
+/**
+ * @brief work_pool_got - Mark a work busy once its receive is done.
+ * @param work - nano_work in RECV state
+ * @param result - of its aio
+ * @return false if the receive was cancelled to retire it, it is parked
+ */
+bool
+work_pool_got(nano_work *work, int result)
+{
+	bool got = true;
+
+	if (state_of(work) == WORK_POOL_NONE) {
+		return true;
+	}
+	nng_mtx_lock(work->mutex);
+	switch (state_of(work)) {
+	case WORK_POOL_IDLE:
+		state_set(work, WORK_POOL_BUSY);
+		break;
+	case WORK_POOL_RETIRE:
+		// a message done before the cancel is handled, then it parks
+		if (result != 0) {
+			state_set(work, WORK_POOL_PARKED);
+			got = false;
+		}
+		break;
+	default:
+		break;
+	}
+	nng_mtx_unlock(work->mutex);
+
+	return got;
+}
+
+// works retired by the sampler with a cancel, at most n
+static uint32_t
+pool_retire(uint32_t n)
+{
+	uint32_t done = 0;
+
+	// the last started first, the others stay warm
+	for (uint32_t i = cnt; i-- > 0 && done < n;) {
+		nano_work *w = works[i];
+
+		nng_mtx_lock(w->mutex);
+		if (state_of(w) == WORK_POOL_IDLE) {
+			state_set(w, WORK_POOL_RETIRE);
+			nng_aio_cancel(w->aio);
+			done++;
+		}
+		nng_mtx_unlock(w->mutex);
+	}
+
+	return done;
+}
+
+// free the parked works, freeing the aio waits for their callback
+static void
+pool_sweep(void)
+{
+	for (uint32_t i = 0; i < cnt;) {
+		nano_work *w = works[i];
+
+		if (state_of(w) != WORK_POOL_PARKED) {
+			i++;
+			continue;
+		}
+		works[i] = works[--cnt];
+		p_ops.free(w);
+		shrunk++;
+	}
+}
+
+static void
+pool_grow(uint32_t n)
+{
+	for (uint32_t i = 0; i < n && cnt < max; i++) {
+		nano_work *w = p_ops.alloc();
+
+		w->pool_state = WORK_POOL_BUSY;
+		works[cnt++]  = w;
+		grown++;
+		p_ops.start(w);
+	}
+}
+
+// one sample, lock held
+static void
+pool_tick(void)
+{
+	uint32_t idle   = 0;
+	uint32_t active = 0;
+	uint32_t n;
+
+	pool_sweep();
+	for (uint32_t i = 0; i < cnt; i++) {
+		uint32_t state = state_of(works[i]);
+
+		idle += state == WORK_POOL_IDLE;
+		active += state == WORK_POOL_IDLE || state == WORK_POOL_BUSY;
+	}
+
+	busy_ticks = idle == 0 ? busy_ticks + 1 : 0;
+	if (busy_ticks >= WORK_POOL_GROW_TICKS && cnt < max) {
+		n = active / 4 > 0 ? active / 4 : 1;
+		log_info("work pool grows by %u from %u", n, active);
+		pool_grow(n);
+		busy_ticks = 0;
+	}
+
+	calm_ticks = idle > active / 2 ? calm_ticks + 1 : 0;
+	if (calm_ticks >= WORK_POOL_SHRINK_TICKS && active > min) {
+		n = (active - min) / 4 > 0 ? (active - min) / 4 : 1;
+		n = pool_retire(n);
+		log_info("work pool retires %u of %u", n, active);
+		calm_ticks = 0;
+	}
+}
+
+static void *
+work_pool_run(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&mtx);
+	while (running) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += WORK_POOL_TICK * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&cond, &mtx, &ts);
+		if (!running) {
+			break;
+		}
+		pool_tick();
+	}
+	pthread_mutex_unlock(&mtx);
+
+	return NULL;
+}
+
+/**
+ * @brief work_pool_start - Take the broker works and start the sampler
+ * if they may grow. Called before the works start.
+ * @param config - conf, parallel works are given
+ * @param base - broker works in INIT, copied
+ * @param ops - work_pool_ops the pool makes and frees works with
+ * @return void
+ */
+void
+work_pool_start(conf *config, nano_work **base, const work_pool_ops *ops)
+{
+	pthread_mutex_lock(&mtx);
+	p_ops = *ops;
+	min   = (uint32_t) config->parallel;
+	max   = config->parallel_max > 0
+	      ? (uint32_t) config->parallel_max
+	      : min + WORK_POOL_PER_THREAD * config->max_taskq_thread;
+	max   = max > min ? max : min;
+	works = zmalloc(sizeof(nano_work *) * max);
+	for (cnt = 0; cnt < min; cnt++) {
+		works[cnt]             = base[cnt];
+		works[cnt]->pool_state = WORK_POOL_BUSY;
+	}
+	if (max > min) {
+		running = true;
+		if (pthread_create(&thread, NULL, work_pool_run, NULL) != 0) {
+			debug_msg("work pool thread can not be created");
+			running = false;
+		}
+	}
+	pthread_mutex_unlock(&mtx);
+}
+
+void
+work_pool_stop(void)
+{
+	pthread_mutex_lock(&mtx);
+	if (!running) {
+		pthread_mutex_unlock(&mtx);
+		return;
+	}
+	running = false;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mtx);
+	pthread_join(thread, NULL);
+}
+
+void
+work_pool_get_stats(work_pool_stats *st)
+{
+	pthread_mutex_lock(&mtx);
+	st->works      = cnt;
+	st->idle       = 0;
+	st->max        = max;
+	st->backlog_ms = (uint64_t) busy_ticks * WORK_POOL_TICK;
+	st->grown      = grown;
+	st->shrunk     = shrunk;
+	for (uint32_t i = 0; i < cnt; i++) {
+		st->idle += state_of(works[i]) == WORK_POOL_IDLE;
+	}
+	pthread_mutex_unlock(&mtx);
+}